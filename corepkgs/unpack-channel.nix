@@ -2,6 +2,7 @@ with import <nix/config.nix>;
 
 let
 
+  # Used for stores whose daemon doesn't know builtin:unpack-channel.
   builder = builtins.toFile "unpack-channel.sh"
     ''
       mkdir $out
@@ -22,18 +23,31 @@ let
 
 in
 
-{ name, channelName, src }:
+{ name, channelName, src, useBuiltin ? true }:
 
-derivation {
-  system = builtins.currentSystem;
-  builder = shell;
-  args = [ "-e" builder ];
-  inherit name channelName src;
+if useBuiltin then
 
-  PATH = "${nixBinDir}:${coreutils}";
+  derivation {
+    builder = "builtin:unpack-channel";
 
-  # No point in doing this remotely.
-  preferLocalBuild = true;
+    system = "builtin";
 
-  inherit chrootDeps;
-}
+    inherit name channelName src;
+
+    # No point in doing this remotely.
+    preferLocalBuild = true;
+  }
+
+else
+
+  derivation {
+    system = builtins.currentSystem;
+    builder = shell;
+    args = [ "-e" builder ];
+    inherit name channelName src;
+
+    PATH = "${nixBinDir}:${coreutils}";
+
+    # No point in doing this remotely.
+    preferLocalBuild = true;
+  }
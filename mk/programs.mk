@@ -22,6 +22,11 @@ programs-list :=
 #
 # - $(1)_INSTALL_DIR: the directory where the program will be
 #   installed; defaults to $(bindir).
+#
+# - $(1)_EXCLUDE_FROM_PROGRAM_LIST: if defined, the program will not
+#   be built by the top-level all target, will not be installed and
+#   will not be listed in the make help output. This is useful for
+#   programs built solely for testing, for example.
 define build-program
   _d := $(buildprefix)$$($(1)_DIR)
   _srcs := $$(sort $$(foreach src, $$($(1)_SOURCES), $$(src)))
@@ -34,6 +39,8 @@ define build-program
   $$($(1)_PATH): $$($(1)_OBJS) $$(_libs) | $$(_d)/
 	$$(trace-ld) $(CXX) -o $$@ $$(LDFLAGS) $$(GLOBAL_LDFLAGS) $$($(1)_OBJS) $$($(1)_LDFLAGS) $$(foreach lib, $$($(1)_LIBS), $$($$(lib)_LDFLAGS_USE))
 
+  ifndef $(1)_EXCLUDE_FROM_PROGRAM_LIST
+
   $(1)_INSTALL_DIR ?= $$(bindir)
   $(1)_INSTALL_PATH := $$($(1)_INSTALL_DIR)/$(1)
 
@@ -55,6 +62,10 @@ define build-program
 
   endif
 
+  programs-list += $$($(1)_PATH)
+
+  endif
+
   # Propagate CFLAGS and CXXFLAGS to the individual object files.
   $$(foreach obj, $$($(1)_OBJS), $$(eval $$(obj)_CFLAGS=$$($(1)_CFLAGS)))
   $$(foreach obj, $$($(1)_OBJS), $$(eval $$(obj)_CXXFLAGS=$$($(1)_CXXFLAGS)))
@@ -73,7 +84,6 @@ define build-program
   $(1)_DEPS := $$(foreach fn, $$($(1)_OBJS), $$(call filename-to-dep, $$(fn)))
   -include $$($(1)_DEPS)
 
-  programs-list += $$($(1)_PATH)
   clean-files += $$($(1)_PATH) $$(_d)/*.o $$(_d)/.*.dep $$($(1)_DEPS) $$($(1)_OBJS)
   dist-files += $$(_srcs)
 endef
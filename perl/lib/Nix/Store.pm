@@ -15,6 +15,7 @@ our @EXPORT_OK = ( @{ $EXPORT_TAGS{'all'} } );
 our @EXPORT = qw(
     setVerbosity
     isValidPath queryReferences queryPathInfo queryDeriver queryPathHash
+    queryValidPaths queryPathInfos
     queryPathFromHashPart
     topoSortPaths computeFSClosure followLinksToStorePath exportPaths importPaths
     hashPath hashFile hashString convertHash
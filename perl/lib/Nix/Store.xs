@@ -120,6 +120,60 @@ SV * queryPathInfo(char * path, int base32)
         }
 
 
+SV * queryValidPaths(...)
+    PPCODE:
+        try {
+            PathSet paths;
+            for (int n = 0; n < items; ++n) paths.insert(SvPV_nolen(ST(n)));
+            PathSet valid = store()->queryValidPaths(paths);
+            for (auto & i : valid)
+                XPUSHs(sv_2mortal(newSVpv(i.c_str(), 0)));
+        } catch (Error & e) {
+            croak("%s", e.what());
+        }
+
+
+SV * queryPathInfos(int base32, ...)
+    PREINIT:
+        HV *hash;
+    CODE:
+        try {
+            PathSet paths;
+            for (int n = 1; n < items; ++n) paths.insert(SvPV_nolen(ST(n)));
+
+            /* Fetch the info about all paths in one round trip, rather
+               than one per path. */
+            auto st = store();
+            st->preloadPathInfoCache(paths);
+
+            hash = newHV();
+            for (auto & path : paths) {
+                std::shared_ptr<const ValidPathInfo> info;
+                try {
+                    info = st->queryPathInfo(path);
+                } catch (InvalidPath &) {
+                    continue;
+                }
+                AV * entry = newAV();
+                av_push(entry, info->deriver == "" ? newSV(0) : newSVpv(info->deriver.c_str(), 0));
+                av_push(entry, newSVpv(info->narHash.to_string(base32 ? Base32 : Base16).c_str(), 0));
+                av_push(entry, newSViv(info->registrationTime));
+                av_push(entry, newSViv(info->narSize));
+                AV * refs = newAV();
+                for (auto & i : info->references)
+                    av_push(refs, newSVpv(i.c_str(), 0));
+                av_push(entry, newRV_noinc((SV *) refs));
+                hv_store(hash, path.c_str(), path.size(), newRV_noinc((SV *) entry), 0);
+            }
+
+            RETVAL = newRV_noinc((SV *) hash);
+        } catch (Error & e) {
+            croak("%s", e.what());
+        }
+    OUTPUT:
+        RETVAL
+
+
 SV * queryPathFromHashPart(char * hashPart)
     PPCODE:
         try {
@@ -133,9 +187,9 @@ SV * queryPathFromHashPart(char * hashPart)
 SV * computeFSClosure(int flipDirection, int includeOutputs, ...)
     PPCODE:
         try {
-            PathSet paths;
-            for (int n = 2; n < items; ++n)
-                store()->computeFSClosure(SvPV_nolen(ST(n)), paths, flipDirection, includeOutputs);
+            PathSet roots, paths;
+            for (int n = 2; n < items; ++n) roots.insert(SvPV_nolen(ST(n)));
+            store()->computeFSClosure(roots, paths, flipDirection, includeOutputs);
             for (PathSet::iterator i = paths.begin(); i != paths.end(); ++i)
                 XPUSHs(sv_2mortal(newSVpv(i->c_str(), 0)));
         } catch (Error & e) {
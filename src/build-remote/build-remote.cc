@@ -5,6 +5,8 @@
 #include <memory>
 #include <tuple>
 #include <iomanip>
+#include <chrono>
+#include <functional>
 #if __APPLE__
 #include <sys/time.h>
 #endif
@@ -18,6 +20,7 @@
 #include "derivations.hh"
 #include "local-store.hh"
 #include "legacy.hh"
+#include "build-times.hh"
 
 using namespace nix;
 using std::cin;
@@ -38,6 +41,255 @@ static AutoCloseFD openSlotLock(const Machine & m, unsigned long long slot)
     return openLockFile(fmt("%s/%s-%d", currentLoad, escapeUri(m.storeUri), slot), true);
 }
 
+/* Scheduling state of a machine that is shared between build hook
+   instances through a file in `currentLoad'. It's only accessed while
+   holding the main lock. */
+struct MachineStats
+{
+    /* Exponentially weighted average wall time of builds on this
+       machine, in seconds, or 0 if unknown. */
+    double avgBuildTime = 0;
+
+    /* Don't try to connect to the machine again before this time. */
+    time_t downUntil = 0;
+};
+
+/* How long to stop considering a machine after failing to connect. */
+static const time_t machineRetryDelay = 60;
+
+/* Build time assumed for machines we haven't built on yet. */
+static const double defaultBuildTime = 60;
+
+static Path machineStatsFile(const Machine & m)
+{
+    return fmt("%s/%s.stats", currentLoad, escapeUri(m.storeUri));
+}
+
+static MachineStats readMachineStats(const Machine & m)
+{
+    MachineStats stats;
+    try {
+        auto fields = tokenizeString<std::vector<string>>(readFile(machineStatsFile(m)));
+        if (fields.size() == 2) {
+            stats.avgBuildTime = std::stod(fields[0]);
+            stats.downUntil = std::stoll(fields[1]);
+        }
+    } catch (SysError &) {
+    } catch (std::logic_error &) {
+    }
+    return stats;
+}
+
+static void writeMachineStats(const Machine & m, const MachineStats & stats)
+{
+    try {
+        writeFile(machineStatsFile(m), fmt("%f %d\n", stats.avgBuildTime, stats.downUntil));
+    } catch (SysError & e) {
+        debug("cannot record state of '%s': %s", m.storeUri, e.what());
+    }
+}
+
+/* Update the shared state of a machine after a build attempt. */
+static void updateMachineStats(const Machine & m, std::function<void(MachineStats &)> update)
+{
+    AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
+    lockFile(lock.get(), ltWrite, true);
+    auto stats = readMachineStats(m);
+    update(stats);
+    writeMachineStats(m, stats);
+}
+
+/* Estimate how long a build started on `m' now would take to finish,
+   given the number of builds it's already running for us and, if
+   known, how long the derivation took to build locally. */
+static double estimateCost(const Machine & m, const MachineStats & stats,
+    unsigned long long load, std::optional<double> drvBuildTime)
+{
+    auto buildTime =
+        drvBuildTime ? *drvBuildTime :
+        stats.avgBuildTime > 0 ? stats.avgBuildTime :
+        defaultBuildTime;
+    return buildTime / m.speedFactor * (1 + (double) load / m.maxJobs);
+}
+
+/* The control socket for sharing SSH connections to `m' between
+   build hook instances. It's named after a hash of the URI since
+   socket paths are limited to about 100 characters. */
+static Path controlPathFor(const Machine & m)
+{
+    return fmt("%s/ssh-%s", currentLoad,
+        string(hashString(htSHA256, m.storeUri).to_string(Base32, false), 0, 16));
+}
+
+static bool canBuildOn(const Machine & m, const string & neededSystem,
+    const std::set<string> & requiredFeatures)
+{
+    return m.enabled
+        && std::find(m.systemTypes.begin(), m.systemTypes.end(), neededSystem) != m.systemTypes.end()
+        && m.allSupported(requiredFeatures)
+        && m.mandatoryMet(requiredFeatures);
+}
+
+/* Connections to the machines, keyed by store URI. */
+static std::map<string, ref<Store>> machineStores;
+
+static ref<Store> openMachineStore(const Machine & m)
+{
+    auto i = machineStores.find(m.storeUri);
+    if (i != machineStores.end()) return i->second;
+
+    Store::Params storeParams;
+    if (hasPrefix(m.storeUri, "ssh://")) {
+        /* A second connection lets us upload paths while the
+           remote is substituting others. */
+        storeParams["max-connections"] = settings.buildersUseSubstitutes ? "2" : "1";
+        storeParams["log-fd"] = "4";
+        if (m.sshKey != "")
+            storeParams["ssh-key"] = m.sshKey;
+        storeParams["control-path"] = controlPathFor(m);
+    }
+
+    auto store = openStore(m.storeUri, storeParams);
+    store->connect();
+    machineStores.emplace(m.storeUri, store);
+    return store;
+}
+
+/* How long we assume that what we found out about the presence of a
+   path on a machine still holds. */
+static const time_t knownPathsTTL = 300;
+
+/* Whether a path was present on a machine when we last checked. */
+struct KnownPath
+{
+    time_t checked;
+    bool valid;
+};
+
+typedef std::map<Path, KnownPath> KnownPaths;
+
+static Path knownPathsFile(const Machine & m)
+{
+    return fmt("%s/%s.known", currentLoad, escapeUri(m.storeUri));
+}
+
+/* Return the paths whose presence on `m' was checked recently. Paths
+   found to be missing are remembered too, so that the next build hook
+   doesn't ask the machine about them again. */
+static KnownPaths readKnownPaths(const Machine & m)
+{
+    KnownPaths paths;
+    auto now = time(0);
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile(knownPathsFile(m)), "\n")) {
+            auto fields = tokenizeString<std::vector<string>>(line);
+            if (fields.size() != 3) continue;
+            time_t checked = std::stoll(fields[0]);
+            if (checked + knownPathsTTL > now)
+                paths.emplace(fields[2], KnownPath{checked, fields[1] == "1"});
+        }
+    } catch (SysError &) {
+    } catch (std::logic_error &) {
+    }
+    return paths;
+}
+
+static void writeKnownPaths(const Machine & m, const KnownPaths & paths)
+{
+    string s;
+    for (auto & i : paths)
+        s += fmt("%d %d %s\n", i.second.checked, i.second.valid ? 1 : 0, i.first);
+    auto fileName = knownPathsFile(m);
+    auto tmp = fmt("%s.tmp-%d", fileName, getpid());
+    try {
+        writeFile(tmp, s);
+        if (rename(tmp.c_str(), fileName.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, fileName);
+    } catch (SysError & e) {
+        debug("cannot record known paths of '%s': %s", m.storeUri, e.what());
+    }
+}
+
+/* For each machine that could do the build, estimate how long it
+   would take to upload the part of the input closure of `drvPath'
+   that it doesn't have yet. */
+static std::map<const Machine *, double> estimateTransferCosts(ref<Store> store,
+    const Path & drvPath, Machines & machines,
+    const string & neededSystem, const std::set<string> & requiredFeatures)
+{
+    std::map<const Machine *, double> costs;
+
+    uint64_t bandwidth = settings.buildersUploadBandwidth;
+    if (!bandwidth) return costs;
+
+    std::vector<const Machine *> candidates;
+    auto now = time(0);
+    for (auto & m : machines)
+        if (canBuildOn(m, neededSystem, requiredFeatures) && readMachineStats(m).downUntil <= now)
+            candidates.push_back(&m);
+
+    /* Locality doesn't matter if there is no choice. */
+    if (candidates.size() < 2) return costs;
+
+    std::map<Path, uint64_t> sizes;
+    try {
+        auto drv = store->derivationFromPath(drvPath);
+        PathSet inputs = drv.inputSrcs;
+        for (auto & i : drv.inputDrvs) {
+            auto inDrv = store->derivationFromPath(i.first);
+            for (auto & j : i.second) {
+                auto k = inDrv.outputs.find(j);
+                if (k != inDrv.outputs.end()) inputs.insert(k->second.path);
+            }
+        }
+        PathSet closure;
+        store->computeFSClosure(inputs, closure);
+        for (auto & path : closure)
+            sizes.emplace(path, store->queryPathInfo(path)->narSize);
+    } catch (Error & e) {
+        debug("cannot determine the input closure of '%s': %s", drvPath, e.what());
+        return costs;
+    }
+
+    for (auto m : candidates) {
+        auto known = readKnownPaths(*m);
+
+        PathSet unknown;
+        for (auto & i : sizes)
+            if (!known.count(i.first)) unknown.insert(i.first);
+
+        if (!unknown.empty()) {
+            try {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("querying paths on '%s'", m->storeUri));
+                auto valid = openMachineStore(*m)->queryValidPaths(unknown);
+                for (auto & path : unknown)
+                    known[path] = KnownPath{now, valid.count(path) > 0};
+                writeKnownPaths(*m, known);
+            } catch (std::exception & e) {
+                /* Don't let every build hook instance wait for an
+                   unreachable machine. */
+                debug("cannot query paths on '%s': %s", m->storeUri, e.what());
+                updateMachineStats(*m, [&](MachineStats & stats) {
+                    stats.downUntil = time(0) + machineRetryDelay;
+                });
+                continue;
+            }
+        }
+
+        uint64_t missing = 0;
+        for (auto & i : sizes) {
+            auto j = known.find(i.first);
+            if (j == known.end() || !j->second.valid) missing += i.second;
+        }
+
+        debug("remote machine '%s' lacks %d bytes of inputs", m->storeUri, missing);
+
+        costs[m] = (double) missing / bandwidth;
+    }
+
+    return costs;
+}
+
 static bool allSupportedLocally(const std::set<std::string>& requiredFeatures) {
     for (auto & feature : requiredFeatures)
         if (!settings.systemFeatures.get().count(feature)) return false;
@@ -90,6 +342,7 @@ static int _main(int argc, char * * argv)
 
         string drvPath;
         string storeUri;
+        Machine * machine = nullptr;
 
         while (true) {
 
@@ -111,6 +364,18 @@ static int _main(int argc, char * * argv)
             /* Error ignored here, will be caught later */
             mkdir(currentLoad.c_str(), 0777);
 
+            std::optional<double> drvBuildTime;
+            {
+                auto name = storePathToName(drvPath);
+                if (hasSuffix(name, drvExtension))
+                    name.resize(name.size() - drvExtension.size());
+                if (auto estimate = openBuildTimes(store->dbDir)->lookup(buildTimesKey(name), neededSystem))
+                    drvBuildTime = estimate->wallTime;
+            }
+
+            auto transferCosts = estimateTransferCosts(ref<Store>(store), drvPath,
+                machines, neededSystem, requiredFeatures);
+
             while (true) {
                 bestSlotLock = -1;
                 AutoCloseFD lock = openLockFile(currentLoad + "/main-lock", true);
@@ -120,15 +385,21 @@ static int _main(int argc, char * * argv)
 
                 Machine * bestMachine = nullptr;
                 unsigned long long bestLoad = 0;
+                double bestCost = 0;
+                auto now = time(0);
+
                 for (auto & m : machines) {
                     debug("considering building on remote machine '%s'", m.storeUri);
 
-                    if (m.enabled && std::find(m.systemTypes.begin(),
-                            m.systemTypes.end(),
-                            neededSystem) != m.systemTypes.end() &&
-                        m.allSupported(requiredFeatures) &&
-                        m.mandatoryMet(requiredFeatures)) {
+                    if (canBuildOn(m, neededSystem, requiredFeatures)) {
                         rightType = true;
+
+                        auto stats = readMachineStats(m);
+                        if (stats.downUntil > now) {
+                            debug("remote machine '%s' is marked as down", m.storeUri);
+                            continue;
+                        }
+
                         AutoCloseFD free;
                         unsigned long long load = 0;
                         for (unsigned long long slot = 0; slot < m.maxJobs; ++slot) {
@@ -144,12 +415,19 @@ static int _main(int argc, char * * argv)
                         if (!free) {
                             continue;
                         }
+
+                        auto cost = estimateCost(m, stats, load, drvBuildTime);
+                        auto transferCost = transferCosts.find(&m);
+                        if (transferCost != transferCosts.end())
+                            cost += transferCost->second;
+                        debug("estimated cost of building on '%s' is %.1f", m.storeUri, cost);
+
                         bool best = false;
                         if (!bestSlotLock) {
                             best = true;
-                        } else if (load / m.speedFactor < bestLoad / bestMachine->speedFactor) {
+                        } else if (cost < bestCost) {
                             best = true;
-                        } else if (load / m.speedFactor == bestLoad / bestMachine->speedFactor) {
+                        } else if (cost == bestCost) {
                             if (m.speedFactor > bestMachine->speedFactor) {
                                 best = true;
                             } else if (m.speedFactor == bestMachine->speedFactor) {
@@ -160,6 +438,7 @@ static int _main(int argc, char * * argv)
                         }
                         if (best) {
                             bestLoad = load;
+                            bestCost = cost;
                             bestSlotLock = std::move(free);
                             bestMachine = &m;
                         }
@@ -186,17 +465,9 @@ static int _main(int argc, char * * argv)
 
                     Activity act(*logger, lvlTalkative, actUnknown, fmt("connecting to '%s'", bestMachine->storeUri));
 
-                    Store::Params storeParams;
-                    if (hasPrefix(bestMachine->storeUri, "ssh://")) {
-                        storeParams["max-connections"] ="1";
-                        storeParams["log-fd"] = "4";
-                        if (bestMachine->sshKey != "")
-                            storeParams["ssh-key"] = bestMachine->sshKey;
-                    }
-
-                    sshStore = openStore(bestMachine->storeUri, storeParams);
-                    sshStore->connect();
+                    sshStore = openMachineStore(*bestMachine);
                     storeUri = bestMachine->storeUri;
+                    machine = bestMachine;
 
                 } catch (std::exception & e) {
                     auto msg = chomp(drainFD(5, false));
@@ -204,6 +475,9 @@ static int _main(int argc, char * * argv)
                         bestMachine->storeUri, e.what(),
                         (msg.empty() ? "" : ": " + msg));
                     bestMachine->enabled = false;
+                    updateMachineStats(*bestMachine, [&](MachineStats & stats) {
+                        stats.downUntil = time(0) + machineRetryDelay;
+                    });
                     continue;
                 }
 
@@ -239,13 +513,32 @@ connected:
             copyPaths(store, ref<Store>(sshStore), inputs, NoRepair, NoCheckSigs, substitute);
         }
 
+        {
+            auto known = readKnownPaths(*machine);
+            auto now = time(0);
+            for (auto & path : inputs) known[path] = KnownPath{now, true};
+            writeKnownPaths(*machine, known);
+        }
+
         uploadLock = -1;
 
         BasicDerivation drv(readDerivation(store->realStoreDir + "/" + baseNameOf(drvPath)));
         drv.inputSrcs = inputs;
 
+        auto buildStart = std::chrono::steady_clock::now();
+
         auto result = sshStore->buildDerivation(drvPath, drv);
 
+        if (result.success()) {
+            double buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count();
+            updateMachineStats(*machine, [&](MachineStats & stats) {
+                stats.avgBuildTime = stats.avgBuildTime > 0
+                    ? 0.7 * stats.avgBuildTime + 0.3 * buildTime
+                    : buildTime;
+                stats.downUntil = 0;
+            });
+        }
+
         if (!result.success())
             throw Error("build of '%s' on '%s' failed: %s", drvPath, storeUri, result.errorMsg);
 
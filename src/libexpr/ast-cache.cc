@@ -0,0 +1,600 @@
+#include "ast-cache.hh"
+#include "eval.hh"
+#include "hash.hh"
+#include "util.hh"
+
+#include <cstring>
+
+#include <unistd.h>
+
+namespace nix {
+
+
+/* Bump this whenever the format or the Expr hierarchy changes. */
+static const char * astCacheVersion = "nix-ast-1";
+
+
+enum class Node : uint8_t
+{
+    Null, Ref, Int, Float, String, Path, Var, Select, OpHasAttr, Attrs, List,
+    Lambda, Let, With, If, Assert, OpNot, App, OpEq, OpNEq, OpAnd, OpOr,
+    OpImpl, OpUpdate, OpConcatLists, ConcatStrings, Pos,
+};
+
+
+static Path cacheFileFor(const Path & path, const string & text)
+{
+    /* Path literals are resolved relative to the file and to the home
+       directory at parse time. */
+    auto hash = hashString(htSHA256,
+        string(astCacheVersion) + '\0' + path + '\0' + getHome() + '\0' + text);
+    return getCacheDir() + "/nix/ast-v1/" + hash.to_string(Base32, false);
+}
+
+
+/* Symbols and subexpressions that occur more than once (such as
+   the set in `inherit (pkgs) a b') are written once and then referred
+   to by their index. */
+struct ASTWriter
+{
+    string buf;
+    std::map<Symbol, size_t> symbols;
+    std::map<Expr *, size_t> exprs;
+
+    void num(uint64_t n)
+    {
+        do {
+            unsigned char c = n & 0x7f;
+            n >>= 7;
+            buf.push_back(n ? c | 0x80 : c);
+        } while (n);
+    }
+
+    void str(const string & s)
+    {
+        num(s.size());
+        buf.append(s);
+    }
+
+    void symbol(const Symbol & sym)
+    {
+        if (!sym.set()) { num(0); return; }
+        auto i = symbols.find(sym);
+        if (i != symbols.end()) { num(i->second); return; }
+        auto n = symbols.size() + 1;
+        symbols[sym] = n;
+        num(n);
+        str(sym);
+    }
+
+    void pos(const Pos & pos)
+    {
+        num(pos.line);
+        if (!pos.line) return;
+        num(pos.column);
+        symbol(pos.file);
+    }
+
+    void node(Node n)
+    {
+        buf.push_back((char) n);
+    }
+
+    void attrPath(const AttrPath & attrPath)
+    {
+        num(attrPath.size());
+        for (auto & i : attrPath) {
+            if (i.symbol.set()) {
+                num(0);
+                symbol(i.symbol);
+            } else {
+                num(1);
+                expr(i.expr);
+            }
+        }
+    }
+
+    void attrs(ExprAttrs * e)
+    {
+        num(e->recursive);
+        num(e->attrs.size());
+        for (auto & i : e->attrs) {
+            symbol(i.first);
+            num(i.second.inherited);
+            pos(i.second.pos);
+            expr(i.second.e);
+        }
+        num(e->dynamicAttrs.size());
+        for (auto & i : e->dynamicAttrs) {
+            pos(i.pos);
+            expr(i.nameExpr);
+            expr(i.valueExpr);
+        }
+    }
+
+    template<typename Op>
+    bool binOp(Node n, Expr * e)
+    {
+        auto e2 = dynamic_cast<Op *>(e);
+        if (!e2) return false;
+        node(n);
+        pos(e2->pos);
+        expr(e2->e1);
+        expr(e2->e2);
+        return true;
+    }
+
+    void expr(Expr * e)
+    {
+        if (!e) { node(Node::Null); return; }
+
+        auto i = exprs.find(e);
+        if (i != exprs.end()) {
+            node(Node::Ref);
+            num(i->second);
+            return;
+        }
+        auto n = exprs.size();
+        exprs[e] = n;
+
+        if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+            node(Node::Int);
+            num(e2->n);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+            node(Node::Float);
+            buf.append((const char *) &e2->nf, sizeof(e2->nf));
+        }
+
+        else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+            node(Node::String);
+            symbol(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+            node(Node::Path);
+            str(e2->s);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+            node(Node::Var);
+            pos(e2->pos);
+            symbol(e2->name);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+            node(Node::Select);
+            pos(e2->pos);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+            expr(e2->def);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+            node(Node::OpHasAttr);
+            expr(e2->e);
+            attrPath(e2->attrPath);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+            node(Node::Attrs);
+            attrs(e2);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+            node(Node::List);
+            num(e2->elems.size());
+            for (auto & i : e2->elems) expr(i);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+            node(Node::Lambda);
+            pos(e2->pos);
+            symbol(e2->name);
+            symbol(e2->arg);
+            num(e2->matchAttrs);
+            num(e2->formals != nullptr);
+            if (e2->formals) {
+                num(e2->formals->ellipsis);
+                num(e2->formals->formals.size());
+                for (auto & i : e2->formals->formals) {
+                    symbol(i.name);
+                    expr(i.def);
+                }
+            }
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+            node(Node::Let);
+            attrs(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+            node(Node::With);
+            pos(e2->pos);
+            expr(e2->attrs);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+            node(Node::If);
+            expr(e2->cond);
+            expr(e2->then);
+            expr(e2->else_);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+            node(Node::Assert);
+            pos(e2->pos);
+            expr(e2->cond);
+            expr(e2->body);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+            node(Node::OpNot);
+            expr(e2->e);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+            node(Node::ConcatStrings);
+            pos(e2->pos);
+            num(e2->forceString);
+            num(e2->es->size());
+            for (auto & i : *e2->es) expr(i);
+        }
+
+        else if (auto e2 = dynamic_cast<ExprPos *>(e)) {
+            node(Node::Pos);
+            pos(e2->pos);
+        }
+
+        else if (binOp<ExprApp>(Node::App, e)
+            || binOp<ExprOpEq>(Node::OpEq, e)
+            || binOp<ExprOpNEq>(Node::OpNEq, e)
+            || binOp<ExprOpAnd>(Node::OpAnd, e)
+            || binOp<ExprOpOr>(Node::OpOr, e)
+            || binOp<ExprOpImpl>(Node::OpImpl, e)
+            || binOp<ExprOpUpdate>(Node::OpUpdate, e)
+            || binOp<ExprOpConcatLists>(Node::OpConcatLists, e))
+            ;
+
+        else
+            throw Error("cannot serialise expression '%s'", *e);
+    }
+};
+
+
+MakeError(BadASTCache, Error);
+
+
+struct ASTReader
+{
+    SymbolTable & symbolTable;
+    const char * p, * end;
+    std::vector<Symbol> symbols;
+    std::vector<Expr *> exprs;
+
+    ASTReader(SymbolTable & symbolTable, const string & s)
+        : symbolTable(symbolTable), p(s.data()), end(s.data() + s.size())
+    { }
+
+    void need(size_t n)
+    {
+        if ((size_t) (end - p) < n)
+            throw BadASTCache("AST cache entry is truncated");
+    }
+
+    uint64_t num()
+    {
+        uint64_t n = 0;
+        for (unsigned int shift = 0; ; shift += 7) {
+            need(1);
+            unsigned char c = *p++;
+            n |= (uint64_t) (c & 0x7f) << shift;
+            if (!(c & 0x80)) return n;
+            if (shift > 56) throw BadASTCache("bad number in AST cache entry");
+        }
+    }
+
+    string str()
+    {
+        auto n = num();
+        need(n);
+        string s(p, n);
+        p += n;
+        return s;
+    }
+
+    Symbol symbol()
+    {
+        auto n = num();
+        if (n == 0) return Symbol();
+        if (n <= symbols.size()) return symbols[n - 1];
+        if (n != symbols.size() + 1)
+            throw BadASTCache("bad symbol reference in AST cache entry");
+        symbols.push_back(symbolTable.create(str()));
+        return symbols.back();
+    }
+
+    Pos pos()
+    {
+        auto line = num();
+        if (!line) return noPos;
+        auto column = num();
+        auto file = symbol();
+        return Pos(file, line, column);
+    }
+
+    AttrPath attrPath()
+    {
+        AttrPath res;
+        auto n = num();
+        while (n--) {
+            if (num())
+                res.push_back(AttrName(expr()));
+            else
+                res.push_back(AttrName(symbol()));
+        }
+        return res;
+    }
+
+    void attrs(ExprAttrs * e)
+    {
+        e->recursive = num();
+        auto n = num();
+        while (n--) {
+            auto name = symbol();
+            bool inherited = num();
+            auto pos2 = pos();
+            e->attrs[name] = ExprAttrs::AttrDef(expr(), pos2, inherited);
+        }
+        n = num();
+        while (n--) {
+            auto pos2 = pos();
+            auto nameExpr = expr();
+            auto valueExpr = expr();
+            e->dynamicAttrs.push_back(ExprAttrs::DynamicAttrDef(nameExpr, valueExpr, pos2));
+        }
+    }
+
+    template<typename Op>
+    Expr * binOp()
+    {
+        auto pos2 = pos();
+        auto e1 = expr();
+        auto e2 = expr();
+        return new Op(pos2, e1, e2);
+    }
+
+    /* Note: the order of the reads must match the order in which
+       ASTWriter::expr() writes the fields, so function arguments
+       (whose evaluation order is unspecified) are read into
+       variables first. */
+    Expr * expr()
+    {
+        need(1);
+        auto n = (Node) *p++;
+
+        if (n == Node::Null) return nullptr;
+
+        if (n == Node::Ref) {
+            auto i = num();
+            if (i >= exprs.size())
+                throw BadASTCache("bad expression reference in AST cache entry");
+            return exprs[i];
+        }
+
+        /* Reserve the index of this node, since children are
+           numbered after their parent. */
+        auto index = exprs.size();
+        exprs.push_back(nullptr);
+
+        Expr * e;
+
+        switch (n) {
+
+        case Node::Int:
+            e = new ExprInt(num());
+            break;
+
+        case Node::Float: {
+            NixFloat nf;
+            need(sizeof(nf));
+            memcpy(&nf, p, sizeof(nf));
+            p += sizeof(nf);
+            e = new ExprFloat(nf);
+            break;
+        }
+
+        case Node::String:
+            e = new ExprString(symbol());
+            break;
+
+        case Node::Path:
+            e = new ExprPath(str());
+            break;
+
+        case Node::Var: {
+            auto pos2 = pos();
+            e = new ExprVar(pos2, symbol());
+            break;
+        }
+
+        case Node::Select: {
+            auto pos2 = pos();
+            auto e2 = expr();
+            auto attrPath2 = attrPath();
+            e = new ExprSelect(pos2, e2, attrPath2, expr());
+            break;
+        }
+
+        case Node::OpHasAttr: {
+            auto e2 = expr();
+            e = new ExprOpHasAttr(e2, attrPath());
+            break;
+        }
+
+        case Node::Attrs: {
+            auto e2 = new ExprAttrs;
+            attrs(e2);
+            e = e2;
+            break;
+        }
+
+        case Node::List: {
+            auto e2 = new ExprList;
+            auto n = num();
+            while (n--) e2->elems.push_back(expr());
+            e = e2;
+            break;
+        }
+
+        case Node::Lambda: {
+            auto pos2 = pos();
+            auto name = symbol();
+            auto arg = symbol();
+            bool matchAttrs = num();
+            Formals * formals = nullptr;
+            if (num()) {
+                formals = new Formals;
+                formals->ellipsis = num();
+                auto n = num();
+                while (n--) {
+                    auto name = symbol();
+                    formals->formals.emplace_back(name, expr());
+                    formals->argNames.insert(name);
+                }
+            }
+            auto e2 = new ExprLambda(pos2, arg, matchAttrs, formals, expr());
+            if (name.set()) e2->setName(name);
+            e = e2;
+            break;
+        }
+
+        case Node::Let: {
+            auto attrs2 = new ExprAttrs;
+            attrs(attrs2);
+            e = new ExprLet(attrs2, expr());
+            break;
+        }
+
+        case Node::With: {
+            auto pos2 = pos();
+            auto attrs2 = expr();
+            e = new ExprWith(pos2, attrs2, expr());
+            break;
+        }
+
+        case Node::If: {
+            auto cond = expr();
+            auto then = expr();
+            e = new ExprIf(cond, then, expr());
+            break;
+        }
+
+        case Node::Assert: {
+            auto pos2 = pos();
+            auto cond = expr();
+            e = new ExprAssert(pos2, cond, expr());
+            break;
+        }
+
+        case Node::OpNot:
+            e = new ExprOpNot(expr());
+            break;
+
+        case Node::ConcatStrings: {
+            auto pos2 = pos();
+            bool forceString = num();
+            auto es = new vector<Expr *>;
+            auto n = num();
+            while (n--) es->push_back(expr());
+            e = new ExprConcatStrings(pos2, forceString, es);
+            break;
+        }
+
+        case Node::Pos:
+            e = new ExprPos(pos());
+            break;
+
+        case Node::App: e = binOp<ExprApp>(); break;
+        case Node::OpEq: e = binOp<ExprOpEq>(); break;
+        case Node::OpNEq: e = binOp<ExprOpNEq>(); break;
+        case Node::OpAnd: e = binOp<ExprOpAnd>(); break;
+        case Node::OpOr: e = binOp<ExprOpOr>(); break;
+        case Node::OpImpl: e = binOp<ExprOpImpl>(); break;
+        case Node::OpUpdate: e = binOp<ExprOpUpdate>(); break;
+        case Node::OpConcatLists: e = binOp<ExprOpConcatLists>(); break;
+
+        default:
+            throw BadASTCache("bad node type in AST cache entry");
+        }
+
+        exprs[index] = e;
+        return e;
+    }
+};
+
+
+Expr * readASTCache(EvalState & state, const Path & path, const string & text)
+{
+    auto cacheFile = cacheFileFor(path, text);
+
+    string s;
+    try {
+        s = readFile(cacheFile);
+    } catch (SysError & e) {
+        return nullptr;
+    }
+
+    try {
+        ASTReader reader(state.symbols, s);
+        if (reader.str() != astCacheVersion)
+            throw BadASTCache("AST cache entry has the wrong version");
+        auto e = reader.expr();
+        if (reader.p != reader.end || !e)
+            throw BadASTCache("AST cache entry has trailing garbage");
+        debug("loaded parse tree of '%s' from '%s'", path, cacheFile);
+        return e;
+    } catch (Error & e) {
+        printError("warning: ignoring AST cache entry '%s' for '%s': %s", cacheFile, path, e.what());
+        return nullptr;
+    }
+}
+
+
+void writeASTCache(const Path & path, const string & text, Expr * e)
+{
+    auto cacheFile = cacheFileFor(path, text);
+
+    try {
+        ASTWriter writer;
+        writer.str(astCacheVersion);
+        writer.expr(e);
+
+        /* Write atomically, since other processes may be reading the
+           cache concurrently. The temporary file needs a unique name
+           because other threads of this process (such as the
+           preparser's) may be writing the same entry. */
+        createDirs(dirOf(cacheFile));
+        auto tmpFile = cacheFile + ".tmp-XXXXXX";
+        AutoCloseFD fd = mkstemp((char *) tmpFile.c_str());
+        if (!fd)
+            throw SysError("creating temporary file '%s'", tmpFile);
+        AutoDelete del(tmpFile, false);
+        writeFull(fd.get(), writer.buf);
+        if (close(fd.release()) == -1)
+            throw SysError("writing '%s'", tmpFile);
+        if (rename(tmpFile.c_str(), cacheFile.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpFile, cacheFile);
+        del.cancel();
+    } catch (Error & e) {
+        debug("cannot store parse tree of '%s' in the AST cache: %s", path, e.what());
+    }
+}
+
+
+}
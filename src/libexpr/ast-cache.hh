@@ -0,0 +1,23 @@
+#pragma once
+
+#include "nixexpr.hh"
+
+namespace nix {
+
+/* The AST cache stores the parse trees of Nix expression files in a
+   compact binary format under ~/.cache/nix/ast-v1, keyed on the path
+   and contents of the file.  Loading a tree from the cache skips
+   lexing and parsing, but not variable binding, since that depends
+   on the static environment of the import.  It is enabled by the
+   'ast-cache' option. */
+
+/* Return the parse tree of the file `path', with contents `text', from
+   the cache, or nullptr if it isn't cached (or the cache entry is
+   unusable). */
+Expr * readASTCache(EvalState & state, const Path & path, const string & text);
+
+/* Store the parse tree `e' of the file `path' in the cache.  This must
+   be done before binding variables and compiling to bytecode. */
+void writeASTCache(const Path & path, const string & text, Expr * e);
+
+}
@@ -2,6 +2,7 @@
 #include "eval-inline.hh"
 
 #include <algorithm>
+#include <cstring>
 
 
 namespace nix {
@@ -46,6 +47,39 @@ Value * EvalState::allocAttr(Value & vAttrs, const Symbol & name)
 void Bindings::sort()
 {
     std::sort(begin(), end());
+    index.store(nullptr, std::memory_order_relaxed);
+}
+
+
+uint32_t * Bindings::buildIndex()
+{
+    /* Use a load factor of at most 1/2. */
+    uint32_t tableSize = 1;
+    while (tableSize < 2 * size_) tableSize <<= 1;
+
+    auto bytes = (1 + tableSize) * sizeof(uint32_t);
+#if HAVE_BOEHMGC
+    auto idx = (uint32_t *) GC_MALLOC_ATOMIC(bytes);
+    if (!idx) throw std::bad_alloc();
+    memset(idx, 0, bytes);
+#else
+    auto idx = (uint32_t *) allocBytes(bytes);
+#endif
+
+    idx[0] = tableSize - 1;
+
+    for (size_t n = 0; n < size_; ++n) {
+        uint32_t h = hashSymbol(attrs[n].name);
+        while (idx[1 + (h & idx[0])]) ++h;
+        idx[1 + (h & idx[0])] = n + 1;
+    }
+
+    /* Another thread may have built the index concurrently, in which
+       case we use theirs. */
+    uint32_t * expected = nullptr;
+    if (!index.compare_exchange_strong(expected, idx, std::memory_order_acq_rel))
+        return expected;
+    return idx;
 }
 
 
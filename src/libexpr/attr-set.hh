@@ -4,6 +4,7 @@
 #include "symbol-table.hh"
 
 #include <algorithm>
+#include <atomic>
 
 namespace nix {
 
@@ -29,19 +30,46 @@ struct Attr
 /* Bindings contains all the attributes of an attribute set. It is defined
    by its size and its capacity, the capacity being the number of Attr
    elements allocated after this structure, while the size corresponds to
-   the number of elements already inserted in this structure. */
+   the number of elements already inserted in this structure.
+
+   Lookups do a binary search over the sorted attributes, except in
+   large sets that are looked up repeatedly (such as 'pkgs'), for
+   which find() builds a hash index from symbols to positions. */
 class Bindings
 {
 public:
     typedef uint32_t size_t;
 
+    /* Sets smaller than this are never indexed. */
+    static const size_t minIndexedSize = 64;
+
+    /* Number of binary searches in a large set before it's indexed. */
+    static const size_t lookupsBeforeIndexing = 16;
+
 private:
     size_t size_, capacity_;
+
+    /* Number of lookups done so far without the index.  This is
+       approximate during parallel evaluation, which is fine. */
+    size_t lookups = 0;
+
+    /* The hash index, or nullptr.  It's an open addressing table
+       whose first element is the mask to apply to hashes; the other
+       elements are positions plus one (0 denoting an empty slot). */
+    std::atomic<uint32_t *> index{nullptr};
+
     Attr attrs[0];
 
     Bindings(size_t capacity) : size_(0), capacity_(capacity) { }
     Bindings(const Bindings & bindings) = delete;
 
+    uint32_t * buildIndex();
+
+    static uint32_t hashSymbol(const Symbol & name)
+    {
+        return name.hash() * 2654435761U;
+    }
+
 public:
     size_t size() const { return size_; }
 
@@ -53,10 +81,34 @@ public:
     {
         assert(size_ < capacity_);
         attrs[size_++] = attr;
+        index.store(nullptr, std::memory_order_relaxed);
+    }
+
+    /* Append the attributes [first, last). */
+    void push_back(const Attr * first, const Attr * last)
+    {
+        assert((size_t) (last - first) <= capacity_ - size_);
+        std::copy(first, last, &attrs[size_]);
+        size_ += last - first;
+        index.store(nullptr, std::memory_order_relaxed);
     }
 
     iterator find(const Symbol & name)
     {
+        uint32_t * idx = index.load(std::memory_order_acquire);
+
+        if (!idx && size_ >= minIndexedSize && ++lookups > lookupsBeforeIndexing)
+            idx = buildIndex();
+
+        if (idx) {
+            uint32_t mask = idx[0];
+            for (uint32_t h = hashSymbol(name); ; ++h) {
+                uint32_t n = idx[1 + (h & mask)];
+                if (!n) return end();
+                if (attrs[n - 1].name == name) return &attrs[n - 1];
+            }
+        }
+
         Attr key(name, 0);
         iterator i = std::lower_bound(begin(), end(), key);
         if (i != end() && i->name == name) return i;
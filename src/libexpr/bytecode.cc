@@ -0,0 +1,498 @@
+#include "bytecode.hh"
+#include "eval.hh"
+#include "eval-inline.hh"
+
+namespace nix {
+
+
+Counter nrBytecodePrograms;
+Counter nrBytecodeInstrs;
+Counter nrBytecodeOps;
+
+
+/* Whether `e' is a node that the compiler lowers to instructions,
+   i.e. one that evaluates its operands in its own environment. */
+static bool isOperator(Expr * e)
+{
+    return dynamic_cast<ExprSelect *>(e)
+        || dynamic_cast<ExprOpHasAttr *>(e)
+        || dynamic_cast<ExprApp *>(e)
+        || dynamic_cast<ExprOpEq *>(e)
+        || dynamic_cast<ExprOpNEq *>(e)
+        || dynamic_cast<ExprOpAnd *>(e)
+        || dynamic_cast<ExprOpOr *>(e)
+        || dynamic_cast<ExprOpImpl *>(e)
+        || dynamic_cast<ExprOpNot *>(e)
+        || dynamic_cast<ExprOpUpdate *>(e)
+        || dynamic_cast<ExprOpConcatLists *>(e)
+        || dynamic_cast<ExprIf *>(e)
+        || dynamic_cast<ExprAssert *>(e);
+}
+
+
+static void compileAttrPath(AttrPath & attrPath)
+{
+    for (auto & i : attrPath)
+        if (!i.symbol.set())
+            i.expr = compileBytecode(i.expr);
+}
+
+
+/* Compile the subexpressions of a node that is not itself
+   compiled. Note that this may be called more than once for the same
+   node, since the parser shares subexpressions in `inherit (e) ...'. */
+static void compileChildren(Expr * e)
+{
+    if (auto e2 = dynamic_cast<ExprAttrs *>(e)) {
+        for (auto & i : e2->attrs)
+            i.second.e = compileBytecode(i.second.e);
+        for (auto & i : e2->dynamicAttrs) {
+            i.nameExpr = compileBytecode(i.nameExpr);
+            i.valueExpr = compileBytecode(i.valueExpr);
+        }
+    }
+
+    else if (auto e2 = dynamic_cast<ExprList *>(e)) {
+        for (auto & i : e2->elems)
+            i = compileBytecode(i);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLambda *>(e)) {
+        if (e2->matchAttrs)
+            for (auto & i : e2->formals->formals)
+                if (i.def) i.def = compileBytecode(i.def);
+        e2->body = compileBytecode(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprLet *>(e)) {
+        compileChildren(e2->attrs);
+        e2->body = compileBytecode(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprWith *>(e)) {
+        e2->attrs = compileBytecode(e2->attrs);
+        e2->body = compileBytecode(e2->body);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprConcatStrings *>(e)) {
+        for (auto & i : *e2->es)
+            i = compileBytecode(i);
+    }
+}
+
+
+struct Compiler
+{
+    ExprBytecode & prog;
+    size_t depth = 0;
+
+    Compiler(ExprBytecode & prog) : prog(prog) { }
+
+    size_t add(OpCode op)
+    {
+        Instr i;
+        i.op = op;
+        i.target = 0;
+        prog.code.push_back(i);
+        return prog.code.size() - 1;
+    }
+
+    void add(OpCode op, Expr * e)
+    {
+        prog.code[add(op)].expr = e;
+    }
+
+    void add(OpCode op, const Pos * pos)
+    {
+        prog.code[add(op)].pos = pos;
+    }
+
+    void patch(size_t jump)
+    {
+        prog.code[jump].target = prog.code.size();
+    }
+
+    void push()
+    {
+        assert(depth < ExprBytecode::stackSize);
+        if (++depth > prog.maxStack) prog.maxStack = depth;
+    }
+
+    void pop()
+    {
+        assert(depth);
+        depth--;
+    }
+
+    void checkBool(const Pos * pos)
+    {
+        add(OpCode::CheckBool, pos);
+    }
+
+    void emit(Expr * e);
+};
+
+
+void Compiler::emit(Expr * e)
+{
+    /* An operator may need two slots, so if only one is left,
+       evaluate it as a separate program, which has its own stack. */
+    if (depth + 1 >= ExprBytecode::stackSize && isOperator(e)) {
+        add(OpCode::Eval, compileBytecode(e));
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprInt *>(e)) {
+        prog.code[add(OpCode::PushValue)].value = &e2->v;
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprFloat *>(e)) {
+        prog.code[add(OpCode::PushValue)].value = &e2->v;
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprString *>(e)) {
+        prog.code[add(OpCode::PushValue)].value = &e2->v;
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprPath *>(e)) {
+        prog.code[add(OpCode::PushValue)].value = &e2->v;
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprVar *>(e)) {
+        add(OpCode::PushVar, e2);
+        push();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprSelect *>(e)) {
+        /* The default and any dynamic attribute names are evaluated
+           by ExprSelect::evalFrom(). */
+        if (e2->def) e2->def = compileBytecode(e2->def);
+        compileAttrPath(e2->attrPath);
+        emit(e2->e);
+        add(OpCode::Select, e2);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpHasAttr *>(e)) {
+        compileAttrPath(e2->attrPath);
+        emit(e2->e);
+        add(OpCode::HasAttr, e2);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprApp *>(e)) {
+        /* The argument is passed as a thunk, so it's not part of this
+           program. */
+        e2->e2 = compileBytecode(e2->e2);
+        emit(e2->e1);
+        add(OpCode::Call, e2);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpEq *>(e)) {
+        emit(e2->e1);
+        emit(e2->e2);
+        add(OpCode::Eq);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNEq *>(e)) {
+        emit(e2->e1);
+        emit(e2->e2);
+        add(OpCode::NEq);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpAnd *>(e)) {
+        emit(e2->e1);
+        checkBool(&e2->pos);
+        auto j = add(OpCode::JumpIfFalseOrPop);
+        pop();
+        emit(e2->e2);
+        checkBool(&e2->pos);
+        patch(j);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpOr *>(e)) {
+        emit(e2->e1);
+        checkBool(&e2->pos);
+        auto j = add(OpCode::JumpIfTrueOrPop);
+        pop();
+        emit(e2->e2);
+        checkBool(&e2->pos);
+        patch(j);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpImpl *>(e)) {
+        emit(e2->e1);
+        checkBool(&e2->pos);
+        add(OpCode::Not);
+        auto j = add(OpCode::JumpIfTrueOrPop);
+        pop();
+        emit(e2->e2);
+        checkBool(&e2->pos);
+        patch(j);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpNot *>(e)) {
+        emit(e2->e);
+        checkBool(nullptr);
+        add(OpCode::Not);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpUpdate *>(e)) {
+        emit(e2->e1);
+        add(OpCode::CheckAttrs);
+        emit(e2->e2);
+        add(OpCode::CheckAttrs);
+        add(OpCode::Update);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprOpConcatLists *>(e)) {
+        emit(e2->e1);
+        emit(e2->e2);
+        add(OpCode::ConcatLists, e2);
+        pop();
+    }
+
+    else if (auto e2 = dynamic_cast<ExprIf *>(e)) {
+        emit(e2->cond);
+        checkBool(nullptr);
+        auto j1 = add(OpCode::PopJumpIfFalse);
+        pop();
+        emit(e2->then);
+        auto j2 = add(OpCode::Jump);
+        pop();
+        patch(j1);
+        emit(e2->else_);
+        patch(j2);
+    }
+
+    else if (auto e2 = dynamic_cast<ExprAssert *>(e)) {
+        emit(e2->cond);
+        checkBool(&e2->pos);
+        add(OpCode::Assert, &e2->pos);
+        pop();
+        emit(e2->body);
+    }
+
+    else {
+        compileChildren(e);
+        add(OpCode::Eval, e);
+        push();
+    }
+}
+
+
+Expr * compileBytecode(Expr * e)
+{
+    if (!isOperator(e)) {
+        compileChildren(e);
+        return e;
+    }
+
+    auto prog = new ExprBytecode(e);
+    Compiler compiler(*prog);
+    compiler.emit(e);
+    assert(compiler.depth == 1);
+    compiler.add(OpCode::Return);
+
+    nrBytecodePrograms++;
+    nrBytecodeInstrs += prog->code.size();
+
+    return prog;
+}
+
+
+LocalNoInlineNoReturn(void throwAssertionError(const char * s, const Pos & pos))
+{
+    throw AssertionError(format(s) % pos);
+}
+
+
+void ExprBytecode::eval(EvalState & state, Env & env, Value & v)
+{
+    Value stack[stackSize];
+    size_t sp = 0;
+    const Instr * pc = code.data();
+
+    while (true) {
+        const Instr & i(*pc++);
+        nrBytecodeOps++;
+
+        switch (i.op) {
+
+        case OpCode::PushValue:
+            stack[sp++] = *i.value;
+            break;
+
+        case OpCode::PushVar:
+            ((ExprVar *) i.expr)->ExprVar::eval(state, env, stack[sp++]);
+            break;
+
+        case OpCode::Eval:
+            i.expr->eval(state, env, stack[sp++]);
+            break;
+
+        case OpCode::Select: {
+            Value v2;
+            ((ExprSelect *) i.expr)->evalFrom(state, env, stack[sp - 1], v2);
+            stack[sp - 1] = v2;
+            break;
+        }
+
+        case OpCode::HasAttr: {
+            Value v2;
+            ((ExprOpHasAttr *) i.expr)->evalFrom(state, env, stack[sp - 1], v2);
+            stack[sp - 1] = v2;
+            break;
+        }
+
+        case OpCode::Call: {
+            auto app = (ExprApp *) i.expr;
+
+            /* If the function is a primop and the following
+               instructions supply the rest of its arguments, call it
+               directly rather than building partial applications.
+               Primops with more than `maxArgs' arguments take the slow
+               path. */
+            const size_t maxArgs = 4;
+            Value & fun(stack[sp - 1]);
+            if (fun.type == tPrimOp && fun.primOp->arity > 1 && fun.primOp->arity <= maxArgs) {
+                auto arity = fun.primOp->arity;
+                size_t k = 1;
+                while (k < arity && pc[k - 1].op == OpCode::Call) k++;
+                if (k == arity) {
+                    Value * vArgs[maxArgs];
+                    vArgs[0] = app->e2->maybeThunk(state, env);
+                    for (k = 1; k < arity; ++k) {
+                        app = (ExprApp *) pc->expr;
+                        vArgs[k] = app->e2->maybeThunk(state, env);
+                        pc++;
+                    }
+                    if (pc->op == OpCode::Return) {
+                        state.callPrimOp(*fun.primOp, vArgs, v, app->pos);
+                        return;
+                    }
+                    Value v2;
+                    state.callPrimOp(*fun.primOp, vArgs, v2, app->pos);
+                    stack[sp - 1] = v2;
+                    break;
+                }
+            }
+
+            Value * arg = app->e2->maybeThunk(state, env);
+            /* In tail position, write the result directly to `v'. */
+            if (pc->op == OpCode::Return) {
+                state.callFunction(stack[sp - 1], *arg, v, app->pos);
+                return;
+            }
+            Value v2;
+            state.callFunction(stack[sp - 1], *arg, v2, app->pos);
+            stack[sp - 1] = v2;
+            break;
+        }
+
+        case OpCode::CheckBool: {
+            Value & top(stack[sp - 1]);
+            if (top.type != tBool) {
+                if (i.pos)
+                    throwTypeError("value is %1% while a Boolean was expected, at %2%", top, *i.pos);
+                else
+                    throwTypeError("value is %1% while a Boolean was expected", top);
+            }
+            break;
+        }
+
+        case OpCode::CheckAttrs:
+            if (stack[sp - 1].type != tAttrs)
+                throwTypeError("value is %1% while a set was expected", stack[sp - 1]);
+            break;
+
+        case OpCode::Not:
+            stack[sp - 1].boolean = !stack[sp - 1].boolean;
+            break;
+
+        case OpCode::Eq:
+        case OpCode::NEq: {
+            bool eq = state.eqValues(stack[sp - 2], stack[sp - 1]);
+            sp--;
+            mkBool(stack[sp - 1], i.op == OpCode::Eq ? eq : !eq);
+            break;
+        }
+
+        case OpCode::Update: {
+            Value v2;
+            state.updateAttrs(stack[sp - 2], stack[sp - 1], v2);
+            sp--;
+            stack[sp - 1] = v2;
+            break;
+        }
+
+        case OpCode::ConcatLists: {
+            Value * lists[2] = { &stack[sp - 2], &stack[sp - 1] };
+            Value v2;
+            state.concatLists(v2, 2, lists, ((ExprOpConcatLists *) i.expr)->pos);
+            sp--;
+            stack[sp - 1] = v2;
+            break;
+        }
+
+        case OpCode::Assert:
+            if (!stack[--sp].boolean)
+                throwAssertionError("assertion failed at %1%", *i.pos);
+            break;
+
+        case OpCode::Jump:
+            pc = code.data() + i.target;
+            break;
+
+        case OpCode::PopJumpIfFalse:
+            if (!stack[--sp].boolean)
+                pc = code.data() + i.target;
+            break;
+
+        case OpCode::JumpIfFalseOrPop:
+            if (!stack[sp - 1].boolean)
+                pc = code.data() + i.target;
+            else
+                sp--;
+            break;
+
+        case OpCode::JumpIfTrueOrPop:
+            if (stack[sp - 1].boolean)
+                pc = code.data() + i.target;
+            else
+                sp--;
+            break;
+
+        case OpCode::Return:
+            assert(sp == 1);
+            v = stack[0];
+            return;
+        }
+    }
+}
+
+
+void ExprBytecode::show(std::ostream & str) const
+{
+    orig->show(str);
+}
+
+
+void ExprBytecode::bindVars(const StaticEnv & env)
+{
+    orig->bindVars(env);
+}
+
+
+void ExprBytecode::setName(Symbol & name)
+{
+    orig->setName(name);
+}
+
+
+}
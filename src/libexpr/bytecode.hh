@@ -0,0 +1,90 @@
+#pragma once
+
+#include "nixexpr.hh"
+#include "util.hh"
+
+namespace nix {
+
+
+/* The bytecode interpreter.  After variable binding, compileBytecode()
+   replaces every maximal tree of "operator" nodes (selections,
+   comparisons, Boolean connectives, conditionals, function
+   applications, `//', `++' and so on) by a single ExprBytecode node
+   that evaluates the tree in a flat loop over a small value stack,
+   rather than through a chain of virtual Expr::eval() calls with a
+   Value temporary per node.
+
+   Nodes that create environments or lazy structures (functions,
+   sets, lets, withs, lists, string concatenations) are not compiled
+   themselves; they are called from the bytecode through an `Eval'
+   instruction, and their children are compiled recursively.
+   Function arguments stay separate expressions since they must be
+   delayed. */
+
+enum class OpCode : uint8_t
+{
+    PushValue,      // push a constant (`value')
+    PushVar,        // look up and force the ExprVar `expr'
+    Eval,           // evaluate the uncompiled node `expr'
+    Select,         // replace the top by the ExprSelect `expr' applied to it
+    HasAttr,        // same for ExprOpHasAttr
+    Call,           // apply the top to the argument of the ExprApp `expr'
+    CheckBool,      // check that the top is a Boolean (error at `pos', if set)
+    CheckAttrs,     // check that the top is a set
+    Not,            // negate the Boolean on top
+    Eq,             // pop two values, push whether they're equal
+    NEq,            // pop two values, push whether they're not equal
+    Update,         // pop two sets, push their `//'
+    ConcatLists,    // pop two lists, push their `++' (error at `expr')
+    Assert,         // pop a Boolean, fail at `pos' if it's false
+    Jump,           // continue at `target'
+    PopJumpIfFalse, // pop a Boolean, jump to `target' if it's false
+    JumpIfFalseOrPop, // jump to `target' if the top is false, else pop
+    JumpIfTrueOrPop,  // jump to `target' if the top is true, else pop
+    Return,         // return the top
+};
+
+
+struct Instr
+{
+    OpCode op;
+    union {
+        Value * value;
+        Expr * expr;
+        const Pos * pos;
+        size_t target;
+    };
+};
+
+
+struct ExprBytecode : Expr
+{
+    /* The expression that was compiled, used for printing. */
+    Expr * orig;
+
+    std::vector<Instr> code;
+
+    /* Maximum depth of the value stack, which is at most
+       `stackSize'.  Deeper subexpressions are compiled into separate
+       programs. */
+    size_t maxStack = 0;
+    static const size_t stackSize = 16;
+
+    ExprBytecode(Expr * orig) : orig(orig) { };
+    COMMON_METHODS
+    void setName(Symbol & name);
+};
+
+
+/* Compile `e' and its subexpressions.  Returns the expression to use
+   in place of `e'. */
+Expr * compileBytecode(Expr * e);
+
+
+/* Statistics, reported by EvalState::printStats(). */
+extern Counter nrBytecodePrograms;
+extern Counter nrBytecodeInstrs;
+extern Counter nrBytecodeOps;
+
+
+}
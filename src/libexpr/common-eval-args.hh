@@ -16,6 +16,10 @@ struct MixEvalArgs : virtual Args
 
     Strings searchPath;
 
+    /* The --arg and --argstr arguments, with values prefixed by 'E'
+       (an expression) or 'S' (a string) respectively. */
+    const std::map<std::string, std::string> & getRawAutoArgs() { return autoArgs; }
+
 private:
 
     std::map<std::string, std::string> autoArgs;
@@ -0,0 +1,331 @@
+#include "eval-cache.hh"
+#include "eval.hh"
+#include "sync.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+#include "store-api.hh"
+#include "serialise.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <algorithm>
+
+#include <sys/stat.h>
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists Results (
+    key       text primary key not null,
+    inputs    text not null,
+    value     text not null,
+    timestamp integer not null
+);
+
+create table if not exists Files (
+    path      text primary key not null,
+    ino       integer not null,
+    size      integer not null,
+    mtime     integer not null,
+    hash      text not null
+);
+
+create table if not exists Sources (
+    path        text not null,
+    storeDir    text not null,
+    fingerprint text not null,
+    storePath   text not null,
+    primary key (path, storeDir)
+);
+
+)sql";
+
+class EvalCacheImpl : public EvalCache
+{
+public:
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt insertResult, queryResult, insertFile, queryFile;
+        SQLiteStmt insertSource, querySource;
+    };
+
+    Sync<State> _state;
+
+    EvalCacheImpl()
+    {
+        auto state(_state.lock());
+
+        Path dbPath = getCacheDir() + "/nix/eval-cache-v1.sqlite";
+        createDirs(dirOf(dbPath));
+
+        state->db = SQLite(dbPath);
+
+        // We can always reproduce the cache.
+        state->db.exec("pragma busy_timeout = 3600000");
+        state->db.exec("pragma synchronous = off");
+        state->db.exec("pragma main.journal_mode = truncate");
+
+        state->db.exec(schema);
+
+        state->insertResult.create(state->db,
+            "insert or replace into Results(key, inputs, value, timestamp) values (?, ?, ?, ?)");
+
+        state->queryResult.create(state->db,
+            "select inputs, value from Results where key = ?");
+
+        state->insertFile.create(state->db,
+            "insert or replace into Files(path, ino, size, mtime, hash) values (?, ?, ?, ?, ?)");
+
+        state->queryFile.create(state->db,
+            "select hash from Files where path = ? and ino = ? and size = ? and mtime = ?");
+
+        state->insertSource.create(state->db,
+            "insert or replace into Sources(path, storeDir, fingerprint, storePath) values (?, ?, ?, ?)");
+
+        state->querySource.create(state->db,
+            "select storePath from Sources where path = ? and storeDir = ? and fingerprint = ?");
+    }
+
+    /* The key under which a result is stored also covers the settings
+       that affect every evaluation. */
+    std::string makeKey(EvalState & state, const std::string & key)
+    {
+        std::string s = key;
+        s += '\0'; s += settings.thisSystem.get();
+        s += '\0'; s += state.store->storeDir;
+        s += '\0'; s += evalSettings.pureEval ? "pure" : "impure";
+        s += '\0'; s += evalSettings.restrictEval ? "restricted" : "unrestricted";
+        for (auto & i : state.getSearchPath()) {
+            s += '\0'; s += i.first; s += '='; s += i.second;
+        }
+        return hashString(htSHA256, s).to_string(Base32, false);
+    }
+
+    /* Like fingerprintEvalInput(), but avoid rehashing source files
+       whose inode, size and modification time are unchanged since the
+       last lookup. */
+    std::string fingerprint(EvalState & state, const std::string & input)
+    {
+        if (!hasPrefix(input, "file:"))
+            return fingerprintEvalInput(state, input);
+
+        Path path(input, 5);
+
+        struct stat st;
+        if (stat(path.c_str(), &st) == -1)
+            return "";
+
+        auto mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+
+        {
+            auto _state_(_state.lock());
+            auto queryFile(_state_->queryFile.use()
+                (path)(st.st_ino)(st.st_size)(mtime));
+            if (queryFile.next())
+                return queryFile.getStr(0);
+        }
+
+        auto hash = fingerprintEvalInput(state, input);
+
+        auto _state_(_state.lock());
+        _state_->insertFile.use()
+            (path)(st.st_ino)(st.st_size)(mtime)(hash).exec();
+
+        return hash;
+    }
+
+    std::optional<std::string> lookup(EvalState & state, const std::string & key, bool addInputs) override
+    {
+        return retrySQLite<std::optional<std::string>>([&]() -> std::optional<std::string> {
+            std::string inputs, value;
+
+            {
+                auto _state_(_state.lock());
+                auto queryResult(_state_->queryResult.use()(makeKey(state, key)));
+                if (!queryResult.next()) return {};
+                inputs = queryResult.getStr(0);
+                value = queryResult.getStr(1);
+            }
+
+            std::map<std::string, std::string> inputs2;
+
+            for (auto & i : nlohmann::json::parse(inputs).items()) {
+                auto fp = i.value().get<std::string>();
+                if (fingerprint(state, i.key()) != fp) {
+                    debug("evaluation cache entry is stale because input '%s' has changed", i.key());
+                    return {};
+                }
+                inputs2.emplace(i.key(), fp);
+            }
+
+            if (addInputs) state.addEvalInputs(inputs2);
+
+            return value;
+        });
+    }
+
+    void insert(EvalState & state, const std::string & key, const std::string & value) override
+    {
+        auto inputs = state.getEvalInputs();
+        if (!inputs) {
+            debug("not caching evaluation result because the evaluation was impure");
+            return;
+        }
+
+        insert(state, key, value, *inputs);
+    }
+
+    void insert(EvalState & state, const std::string & key, const std::string & value,
+        const std::map<std::string, std::string> & inputs) override
+    {
+        nlohmann::json json(inputs);
+
+        retrySQLite<void>([&]() {
+            auto _state_(_state.lock());
+            _state_->insertResult.use()
+                (makeKey(state, key))
+                (json.dump())
+                (value)
+                (time(0)).exec();
+        });
+    }
+
+    std::optional<Path> lookupSource(EvalState & state, const Path & path,
+        const std::string & fingerprint) override
+    {
+        return retrySQLite<std::optional<Path>>([&]() -> std::optional<Path> {
+            auto _state_(_state.lock());
+            auto querySource(_state_->querySource.use()
+                (path)(state.store->storeDir)(fingerprint));
+            if (!querySource.next()) return {};
+            return querySource.getStr(0);
+        });
+    }
+
+    void insertSource(EvalState & state, const Path & path,
+        const std::string & fingerprint, const Path & storePath) override
+    {
+        retrySQLite<void>([&]() {
+            auto _state_(_state.lock());
+            _state_->insertSource.use()
+                (path)(state.store->storeDir)(fingerprint)(storePath).exec();
+        });
+    }
+};
+
+static std::shared_ptr<EvalCache> getCache()
+{
+    static std::shared_ptr<EvalCache> cache = std::make_shared<EvalCacheImpl>();
+    return cache;
+}
+
+std::shared_ptr<EvalCache> getEvalCache()
+{
+    if (!evalSettings.evalCache) return nullptr;
+    return getCache();
+}
+
+std::shared_ptr<EvalCache> getSourceCache()
+{
+    if (!evalSettings.sourceCache) return nullptr;
+    return getCache();
+}
+
+static void fingerprintSourceTree(const Path & path, const std::string & rel, Sink & sink)
+{
+    auto st = lstat(path);
+
+    sink << rel << st.st_mode << st.st_ino << st.st_size
+        << (uint64_t) st.st_mtim.tv_sec << (uint64_t) st.st_mtim.tv_nsec
+        << (uint64_t) st.st_ctim.tv_sec << (uint64_t) st.st_ctim.tv_nsec;
+
+    if (S_ISDIR(st.st_mode)) {
+        auto entries = readDirectory(path);
+        std::sort(entries.begin(), entries.end(),
+            [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+        for (auto & ent : entries)
+            fingerprintSourceTree(path + "/" + ent.name, rel + "/" + ent.name, sink);
+    }
+}
+
+std::string fingerprintSourceTree(EvalState & state, const Path & path)
+{
+    if (state.store->isInStore(path)) return "store";
+    HashSink sink(htSHA256);
+    fingerprintSourceTree(path, "", sink);
+    return sink.finish().first.to_string();
+}
+
+std::string fingerprintEvalInput(EvalState & state, const std::string & input)
+{
+    auto colon = input.find(':');
+    if (colon == std::string::npos)
+        throw Error("invalid evaluation input '%s'", input);
+
+    std::string kind(input, 0, colon);
+    std::string arg(input, colon + 1);
+
+    if (kind == "env")
+        return getEnv(arg);
+
+    if (kind == "exists")
+        return pathExists(arg) ? "1" : "0";
+
+    try {
+
+        if (kind == "file")
+            return hashFile(htSHA256, arg).to_string();
+
+        else if (kind == "dir") {
+            std::map<std::string, unsigned char> entries;
+            for (auto & ent : readDirectory(arg))
+                entries[ent.name] = ent.type == DT_UNKNOWN
+                    ? getFileType(arg + "/" + ent.name)
+                    : ent.type;
+            std::string s;
+            for (auto & i : entries)
+                s += i.first + ' ' + std::to_string(i.second) + '\n';
+            return hashString(htSHA256, s).to_string();
+        }
+
+        else if (kind == "path") {
+            auto sourceCache = getSourceCache();
+            std::string fingerprint;
+            if (sourceCache) {
+                fingerprint = baseNameOf(arg) + ":" + fingerprintSourceTree(state, arg);
+                if (auto storePath = sourceCache->lookupSource(state, arg, fingerprint))
+                    return *storePath;
+            }
+            auto storePath = state.store->computeStorePathForPath(baseNameOf(arg), arg).first;
+            if (sourceCache)
+                sourceCache->insertSource(state, arg, fingerprint, storePath);
+            return storePath;
+        }
+
+    } catch (SysError & e) {
+        /* The input has disappeared or changed type, so it cannot
+           match any fingerprint recorded for it. */
+        return "";
+    }
+
+    throw Error("invalid evaluation input '%s'", input);
+}
+
+std::string showAutoArgs(Bindings & args)
+{
+    std::ostringstream str;
+    for (auto & i : args) {
+        str << i.name << " = ";
+        if (i.value->type == tThunk)
+            str << *i.value->thunk.expr;
+        else
+            str << *i.value;
+        str << "; ";
+    }
+    return str.str();
+}
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ref.hh"
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+class EvalState;
+class Bindings;
+
+/* A persistent cache of evaluation results, such as the derivations
+   returned by 'nix-instantiate -A' or the package list of 'nix-env
+   -qa', enabled by the 'eval-cache' option.  Every result is stored
+   together with the inputs that the evaluation read (source files,
+   directory listings, environment variables and so on; see
+   EvalState::addEvalInput()) and their fingerprints at the time.  A
+   lookup only succeeds if all those inputs are unchanged. */
+class EvalCache
+{
+public:
+
+    /* Return the result stored under `key', if its inputs are
+       unchanged.  In that case the inputs are added to those of
+       `state', since anything computed from the result depends on
+       them, unless `addInputs' is false. */
+    virtual std::optional<std::string> lookup(EvalState & state,
+        const std::string & key, bool addInputs = true) = 0;
+
+    /* Store `value' under `key', together with the inputs that
+       `state' has read so far.  This does nothing if the evaluation
+       did something that cannot be captured by its inputs (such as
+       fetching a URL without a hash). */
+    virtual void insert(EvalState & state, const std::string & key,
+        const std::string & value) = 0;
+
+    /* Likewise, but with the given inputs (e.g. recorded by
+       EvalState::evalInChild()). */
+    virtual void insert(EvalState & state, const std::string & key,
+        const std::string & value, const std::map<std::string, std::string> & inputs) = 0;
+
+    /* Return the store path to which the source tree `path' was
+       copied by copyPathToStore() when its fingerprint (see
+       fingerprintSourceTree()) was `fingerprint'. */
+    virtual std::optional<Path> lookupSource(EvalState & state,
+        const Path & path, const std::string & fingerprint) = 0;
+
+    virtual void insertSource(EvalState & state, const Path & path,
+        const std::string & fingerprint, const Path & storePath) = 0;
+};
+
+/* Return a singleton cache object, or nullptr if the evaluation
+   cache is disabled. */
+std::shared_ptr<EvalCache> getEvalCache();
+
+/* Likewise, but for use by copyPathToStore(), which is controlled by
+   the 'eval-source-cache' option instead. */
+std::shared_ptr<EvalCache> getSourceCache();
+
+/* Compute a fingerprint of the metadata (type, inode, size and
+   modification and change times) of every file in the source tree
+   `path'.  This only requires lstat() calls, not reading the
+   files.  Paths in the Nix store are immutable, so for those the
+   walk is skipped. */
+std::string fingerprintSourceTree(EvalState & state, const Path & path);
+
+/* Compute the current fingerprint of an evaluation input of the form
+   "<kind>:<argument>". */
+std::string fingerprintEvalInput(EvalState & state, const std::string & input);
+
+/* Return a string describing the automatic function arguments
+   (--arg/--argstr), for use in cache keys. */
+std::string showAutoArgs(Bindings & args);
+
+}
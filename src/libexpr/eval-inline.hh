@@ -26,6 +26,11 @@ LocalNoInlineNoReturn(void throwTypeError(const char * s, const Value & v, const
 
 void EvalState::forceValue(Value & v, const Pos & pos)
 {
+    if (parallel) {
+        forceValueParallel(v, pos);
+        return;
+    }
+
     if (v.type == tThunk) {
         Env * env = v.thunk.env;
         Expr * expr = v.thunk.expr;
@@ -92,4 +97,19 @@ inline void * allocBytes(size_t n)
 }
 
 
+/* Allocate `n' bytes for a string, which the garbage collector
+   doesn't scan for pointers. */
+inline char * allocString(size_t n)
+{
+    char * p;
+#if HAVE_BOEHMGC
+    p = (char *) GC_MALLOC_ATOMIC(n);
+#else
+    p = (char *) malloc(n);
+#endif
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+
 }
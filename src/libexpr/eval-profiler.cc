@@ -0,0 +1,97 @@
+#include "eval-profiler.hh"
+#include "eval.hh"
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <map>
+
+namespace nix {
+
+
+EvalProfiler::Thread & EvalProfiler::getThread()
+{
+    static thread_local Thread * thread = nullptr;
+    if (!thread || thread->profiler != this) {
+        std::lock_guard<std::mutex> lock(threadsLock);
+        threads.push_back(std::make_unique<Thread>(this));
+        thread = threads.back().get();
+    }
+    return *thread;
+}
+
+
+static uint64_t elapsed(std::chrono::steady_clock::time_point & last)
+{
+    auto now = std::chrono::steady_clock::now();
+    auto d = std::chrono::duration_cast<std::chrono::microseconds>(now - last).count();
+    last = now;
+    return d;
+}
+
+
+void EvalProfiler::enter(const void * frame, std::function<std::string()> name)
+{
+    auto & thread(getThread());
+    thread.current->selfTime += elapsed(thread.last);
+    auto & child = thread.current->children[frame];
+    if (!child) {
+        /* ';' separates frames in the output. */
+        auto s = name();
+        std::replace(s.begin(), s.end(), ';', ',');
+        child = std::make_unique<Node>(thread.current, s);
+    }
+    thread.current = child.get();
+}
+
+
+void EvalProfiler::enter(ExprLambda & lambda)
+{
+    enter(&lambda, [&]() { return lambda.showNamePos(); });
+}
+
+
+void EvalProfiler::enter(PrimOp & primOp)
+{
+    enter(&primOp, [&]() { return "primop " + (const string &) primOp.name; });
+}
+
+
+void EvalProfiler::leave()
+{
+    auto & thread(getThread());
+    thread.current->selfTime += elapsed(thread.last);
+    assert(thread.current->parent);
+    thread.current = thread.current->parent;
+}
+
+
+void EvalProfiler::write()
+{
+    std::lock_guard<std::mutex> lock(threadsLock);
+
+    /* Merge the trees of all threads. */
+    std::map<std::string, uint64_t> stacks;
+
+    std::function<void(Node &, const std::string &)> recurse;
+    recurse = [&](Node & node, const std::string & prefix) {
+        auto stack = prefix.empty() ? node.name : prefix + ";" + node.name;
+        if (node.selfTime) stacks[stack] += node.selfTime;
+        for (auto & i : node.children)
+            recurse(*i.second, stack);
+    };
+
+    for (auto & thread : threads) {
+        thread->current->selfTime += elapsed(thread->last);
+        recurse(thread->root, "");
+    }
+
+    std::ofstream str(file);
+    for (auto & i : stacks)
+        str << i.first << " " << i.second << "\n";
+    str.close();
+    if (!str) throw SysError("writing evaluation profile to '%s'", file);
+}
+
+
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "types.hh"
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+namespace nix {
+
+struct ExprLambda;
+struct PrimOp;
+
+/* A profiler that tracks the Nix-level call stack (lambdas and
+   primops) and measures the time spent in each distinct stack.  It's
+   enabled by the 'eval-profile-file' option.  The result is written
+   in the "collapsed stack" format understood by flamegraph.pl and
+   speedscope, i.e. one line per stack of the form
+
+     frame1;frame2;...;frameN <microseconds>
+
+   Since evaluation is lazy, the time spent forcing a thunk is charged
+   to the stack that forced it, not the one that created it. */
+class EvalProfiler
+{
+    struct Node
+    {
+        Node * parent;
+        std::string name;
+        uint64_t selfTime = 0; // in microseconds
+        std::unordered_map<const void *, std::unique_ptr<Node>> children;
+        Node(Node * parent, const std::string & name) : parent(parent), name(name) { }
+    };
+
+    typedef std::chrono::steady_clock Clock;
+
+    /* Each thread has its own call tree. */
+    struct Thread
+    {
+        EvalProfiler * profiler;
+        Node root{nullptr, "(top level)"};
+        Node * current = &root;
+        Clock::time_point last = Clock::now();
+        Thread(EvalProfiler * profiler) : profiler(profiler) { }
+    };
+
+    Path file;
+
+    std::mutex threadsLock;
+    std::vector<std::unique_ptr<Thread>> threads;
+
+    Thread & getThread();
+
+    void enter(const void * frame, std::function<std::string()> name);
+
+public:
+
+    EvalProfiler(const Path & file) : file(file) { }
+
+    void enter(ExprLambda & lambda);
+
+    void enter(PrimOp & primOp);
+
+    void leave();
+
+    /* Write the collapsed stacks to the profile file. */
+    void write();
+};
+
+}
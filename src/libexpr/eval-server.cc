@@ -0,0 +1,405 @@
+#include "eval-server.hh"
+#include "eval.hh"
+#include "eval-cache.hh"
+#include "eval-inline.hh"
+#include "attr-path.hh"
+#include "common-eval-args.hh"
+#include "get-drvs.hh"
+#include "globals.hh"
+#include "serialise.hh"
+#include "store-api.hh"
+
+#include <nlohmann/json.hpp>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace nix {
+
+Path getEvalServerSocket()
+{
+    return getCacheDir() + "/nix/eval-server.socket";
+}
+
+
+/* The evaluation settings that were changed from their defaults,
+   except 'eval-server' itself.  The client and the server must
+   agree on these. */
+static std::map<std::string, std::string> getEvalSettings()
+{
+    std::map<std::string, Config::SettingInfo> infos;
+    evalSettings.getSettings(infos, true);
+    std::map<std::string, std::string> res;
+    for (auto & i : infos)
+        if (i.first != "eval-server")
+            res.emplace(i.first, i.second.value);
+    return res;
+}
+
+
+/* Likewise for the libstore settings, which also affect evaluation
+   (e.g. 'system' determines builtins.currentSystem). 'system' is
+   always included since its default depends on the platform. */
+static std::map<std::string, std::string> getStoreSettings()
+{
+    std::map<std::string, Config::SettingInfo> infos;
+    settings.getSettings(infos, true);
+    std::map<std::string, std::string> res;
+    for (auto & i : infos)
+        res.emplace(i.first, i.second.value);
+    res["system"] = settings.thisSystem;
+    return res;
+}
+
+
+static AutoCloseFD makeSocket(const Path & socketPath, struct sockaddr_un & addr)
+{
+    AutoCloseFD fd = socket(PF_UNIX, SOCK_STREAM
+        #ifdef SOCK_CLOEXEC
+        | SOCK_CLOEXEC
+        #endif
+        , 0);
+    if (!fd) throw SysError("cannot create Unix domain socket");
+    closeOnExec(fd.get());
+
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() + 1 >= sizeof(addr.sun_path))
+        throw Error("socket path '%s' is too long", socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    return fd;
+}
+
+
+std::optional<DrvOutputs> instantiateViaServer(const EvalRequest & request)
+{
+    auto socketPath = getEvalServerSocket();
+
+    struct sockaddr_un addr;
+    auto fd = makeSocket(socketPath, addr);
+    if (connect(fd.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+        debug("cannot connect to evaluation server at '%s': %s", socketPath, strerror(errno));
+        return {};
+    }
+
+    nlohmann::json req;
+    req["file"] = request.file;
+    req["fromArgs"] = request.fromArgs;
+    req["attrPaths"] = request.attrPaths;
+    req["searchPath"] = request.searchPath;
+    req["autoArgs"] = request.autoArgs;
+    req["readOnly"] = request.readOnly;
+    req["storeUri"] = request.storeUri;
+    req["cwd"] = absPath(".");
+    req["env"] = getEnv();
+    req["settings"] = getEvalSettings();
+    req["storeSettings"] = getStoreSettings();
+
+    FdSink to(fd.get());
+    FdSource from(fd.get());
+
+    /* Anything going wrong with the server, rather than with the
+       evaluation, means we evaluate locally. */
+    std::optional<std::string> error;
+    DrvOutputs drvs;
+
+    try {
+        to << req.dump();
+        to.flush();
+
+        auto res = nlohmann::json::parse(readString(from));
+
+        if (res.count("unavailable")) {
+            debug("evaluation server cannot handle the request: %s", res["unavailable"].get<std::string>());
+            return {};
+        }
+
+        if (res.count("error"))
+            error = res["error"].get<std::string>();
+        else
+            for (auto & i : res.at("drvs"))
+                drvs.emplace_back(i.at(0).get<std::string>(), i.at(1).get<std::string>());
+    } catch (Interrupted &) {
+        throw;
+    } catch (EndOfFile &) {
+        printError("warning: the evaluation server closed the connection; evaluating locally");
+        return {};
+    } catch (std::exception & e) {
+        printError("warning: bad reply from the evaluation server (%s); evaluating locally", e.what());
+        return {};
+    }
+
+    if (error) throw Error("%s", *error);
+
+    return drvs;
+}
+
+
+struct EvalServer
+{
+    ref<Store> store;
+
+    std::unique_ptr<EvalState> state;
+
+    /* The search path and read-only mode that `state' was created
+       with.  In read-only mode, derivations are not written to the
+       store, so a state from a read-only request can't be reused to
+       answer a normal one, and vice versa. */
+    Strings stateSearchPath;
+    bool stateReadOnly = false;
+
+    /* The metadata of the files that are inputs of `state', so that
+       unchanged files don't have to be rehashed. */
+    std::map<std::string, std::string> inputStats;
+
+    /* The top-level values of the expressions evaluated so far,
+       called with their automatic arguments, keyed on the expression
+       and the arguments. */
+#if HAVE_BOEHMGC
+    typedef std::map<std::string, Value, std::less<std::string>,
+        traceable_allocator<std::pair<const std::string, Value> > > Roots;
+#else
+    typedef std::map<std::string, Value> Roots;
+#endif
+    Roots roots;
+
+    EvalServer(ref<Store> store) : store(store) { }
+
+    static std::string statInput(const std::string & input)
+    {
+        if (!hasPrefix(input, "file:")) return "";
+        struct stat st;
+        if (stat(input.c_str() + 5, &st) == -1) return "";
+        return fmt("%d:%d:%d.%d:%d.%d", st.st_ino, st.st_size,
+            st.st_mtim.tv_sec, st.st_mtim.tv_nsec, st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+    }
+
+    /* Return why `state' can't be used any more, if it can't. */
+    std::optional<std::string> isStale()
+    {
+        auto inputs = state->getEvalInputs();
+        if (!inputs) return std::string("evaluation was impure");
+
+        for (auto & i : *inputs) {
+            auto st = statInput(i.first);
+            if (st != "") {
+                auto j = inputStats.find(i.first);
+                if (j != inputStats.end() && j->second == st) continue;
+            }
+            if (fingerprintEvalInput(*state, i.first) != i.second)
+                return fmt("input '%s' has changed", i.first);
+            if (st != "") inputStats[i.first] = st;
+        }
+
+        return {};
+    }
+
+    void reset()
+    {
+        roots.clear();
+        inputStats.clear();
+        state.reset();
+    }
+
+    DrvOutputs handle(const nlohmann::json & req)
+    {
+        auto searchPath = req["searchPath"].get<Strings>();
+
+        if (state) {
+            std::optional<std::string> reason;
+            if (searchPath != stateSearchPath)
+                reason = "the search path has changed";
+            else if (settings.readOnlyMode != stateReadOnly)
+                reason = "the read-only mode has changed";
+            else
+                reason = isStale();
+            if (reason) {
+                printInfo("discarding evaluation state because %s", *reason);
+                reset();
+            }
+        }
+
+        if (!state) {
+            state = std::make_unique<EvalState>(searchPath, store);
+            state->trackEvalInputs = true;
+            state->batchTexts = true;
+            stateSearchPath = searchPath;
+            stateReadOnly = settings.readOnlyMode;
+        }
+
+        auto autoArgsRaw = req["autoArgs"].get<std::map<std::string, std::string>>();
+        Bindings & autoArgs = *state->allocBindings(autoArgsRaw.size());
+        for (auto & i : autoArgsRaw) {
+            Value * v = state->allocValue();
+            if (i.second[0] == 'E')
+                state->mkThunk_(*v, state->parseExprFromString(string(i.second, 1), absPath(".")));
+            else
+                mkString(*v, string(i.second, 1));
+            autoArgs.push_back(Attr(state->symbols.create(i.first), v));
+        }
+        autoArgs.sort();
+
+        auto file = req["file"].get<std::string>();
+        bool fromArgs = req["fromArgs"].get<bool>();
+
+        /* Expressions and relative --arg expressions depend on the
+           working directory. */
+        auto key = fmt("%s%c%s%c%s%c%s", fromArgs ? "expr" : "file", 0, file, 0,
+            absPath("."), 0, showAutoArgs(autoArgs));
+
+        auto i = roots.find(key);
+        if (i == roots.end()) {
+            Value vFile;
+            if (fromArgs)
+                state->eval(state->parseExprFromString(file, absPath(".")), vFile);
+            else
+                state->evalFile(resolveExprPath(state->checkSourcePath(lookupFileArg(*state, file))), vFile);
+            i = roots.emplace(key, Value()).first;
+            state->autoCallFunction(autoArgs, vFile, i->second);
+        }
+
+        DrvOutputs res;
+
+        for (auto & attrPath : req["attrPaths"].get<Strings>()) {
+            Value & v(*findAlongAttrPath(*state, attrPath, autoArgs, i->second));
+            state->forceValue(v);
+
+            DrvInfos drvs;
+            getDerivations(*state, v, "", autoArgs, drvs, false);
+            for (auto & drv : drvs) {
+                auto outputName = drv.queryOutputName();
+                if (outputName == "")
+                    throw Error("derivation '%s' lacks an 'outputName' attribute", drv.queryDrvPath());
+                res.emplace_back(drv.queryDrvPath(), outputName);
+            }
+        }
+
+        state->flushTexts();
+
+        return res;
+    }
+
+    void serve(int fd)
+    {
+        FdSink to(fd);
+        FdSource from(fd);
+
+        auto req = nlohmann::json::parse(readString(from));
+
+        nlohmann::json res;
+
+        auto settings2 = req["settings"].get<std::map<std::string, std::string>>();
+        if (settings2 != getEvalSettings())
+            res["unavailable"] = "the client's evaluation settings differ from the server's";
+
+        else if (req["storeSettings"].get<std::map<std::string, std::string>>() != getStoreSettings())
+            res["unavailable"] = "the client's store settings differ from the server's";
+
+        else if (req["storeUri"].get<std::string>() != store->getUri())
+            res["unavailable"] = fmt("the client uses store '%s' but the server uses '%s'",
+                req["storeUri"].get<std::string>(), store->getUri());
+
+        else {
+            /* Evaluate as the client would. Env inputs are checked
+               against the client's environment, so a change
+               invalidates the state like any other input. */
+            if (chdir(req["cwd"].get<std::string>().c_str()) == -1)
+                throw SysError("changing to the client's working directory");
+            clearEnv();
+            for (auto & i : req["env"].get<std::map<std::string, std::string>>())
+                setenv(i.first.c_str(), i.second.c_str(), 1);
+            settings.readOnlyMode = req["readOnly"].get<bool>();
+
+            try {
+                res["drvs"] = handle(req);
+            } catch (Interrupted &) {
+                throw;
+            } catch (Error & e) {
+                res["error"] = e.msg();
+                /* The state may be halfway through forcing values. */
+                reset();
+            } catch (std::exception & e) {
+                /* E.g. a malformed request. */
+                res["error"] = e.what();
+                reset();
+            }
+        }
+
+        to << res.dump();
+        to.flush();
+    }
+};
+
+
+/* How long to wait (in seconds) for a client to send its request or
+   to read the reply. */
+static const time_t clientTimeout = 10;
+
+
+void runEvalServer(ref<Store> store)
+{
+    auto socketPath = getEvalServerSocket();
+    createDirs(dirOf(socketPath));
+
+    struct sockaddr_un addr;
+    auto fdSocket = makeSocket(socketPath, addr);
+
+    unlink(socketPath.c_str());
+
+    /* Only the user may connect. */
+    mode_t oldMode = umask(0177);
+    int r = bind(fdSocket.get(), (struct sockaddr *) &addr, sizeof(addr));
+    umask(oldMode);
+    if (r == -1)
+        throw SysError("cannot bind to socket '%s'", socketPath);
+
+    if (listen(fdSocket.get(), 16) == -1)
+        throw SysError("cannot listen on socket '%s'", socketPath);
+
+    printInfo("evaluation server listening on '%s'", socketPath);
+
+    EvalServer server(store);
+
+    while (true) {
+        AutoCloseFD remote = accept(fdSocket.get(), nullptr, nullptr);
+        checkInterrupt();
+        if (!remote) {
+            if (errno == EINTR) continue;
+            throw SysError("accepting connection");
+        }
+        closeOnExec(remote.get());
+
+#if defined(SO_PEERCRED)
+        ucred cred;
+        socklen_t credLen = sizeof(cred);
+        if (getsockopt(remote.get(), SOL_SOCKET, SO_PEERCRED, &cred, &credLen) == -1
+            || cred.uid != getuid())
+        {
+            printError("rejecting connection from another user");
+            continue;
+        }
+#endif
+
+        /* Requests are handled one at a time, so don't let a client
+           that stops sending or reading hold up the others. */
+        struct timeval timeout{clientTimeout, 0};
+        if (setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1
+            || setsockopt(remote.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) == -1)
+            throw SysError("setting the timeout of an evaluation server connection");
+
+        try {
+            server.serve(remote.get());
+        } catch (Interrupted &) {
+            throw;
+        } catch (Error & e) {
+            printError("error handling evaluation request: %s", e.msg());
+        } catch (std::exception & e) {
+            printError("error handling evaluation request: %s", e.what());
+        }
+    }
+}
+
+}
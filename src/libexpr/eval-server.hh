@@ -0,0 +1,50 @@
+#pragma once
+
+#include "ref.hh"
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+class Store;
+
+/* A request to instantiate attributes of a Nix expression, sent by
+   nix-instantiate to the user's evaluation server (`nix eval-server')
+   if the 'eval-server' option is set.  The server evaluates it in
+   the client's working directory and environment, reusing the
+   parsed and evaluated files of earlier requests as long as none of
+   their inputs (see EvalState::addEvalInput()) have changed. */
+struct EvalRequest
+{
+    /* A file argument as accepted by lookupFileArg() (with relative
+       paths made absolute), or an expression if `fromArgs' is set. */
+    std::string file;
+    bool fromArgs = false;
+    Strings attrPaths;
+    Strings searchPath;
+    /* The --arg and --argstr arguments (see MixEvalArgs). */
+    std::map<std::string, std::string> autoArgs;
+    bool readOnly = false;
+    /* The URI of the client's store (see Store::getUri()). */
+    std::string storeUri;
+};
+
+typedef std::vector<std::pair<Path, std::string>> DrvOutputs;
+
+/* Return the path of the calling user's evaluation server socket. */
+Path getEvalServerSocket();
+
+/* Send `request' to the evaluation server and return the derivation
+   paths and output names it produced.  Returns nothing if there is
+   no server or it can't handle the request (e.g. because its
+   evaluation settings differ), in which case the caller should
+   evaluate the request itself.  Evaluation errors are rethrown. */
+std::optional<DrvOutputs> instantiateViaServer(const EvalRequest & request);
+
+/* Listen on getEvalServerSocket() and handle requests one at a time,
+   forever.  Clients that take too long to send a request or to read
+   the reply are disconnected. */
+void runEvalServer(ref<Store> store);
+
+}
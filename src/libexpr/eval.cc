@@ -1,4 +1,6 @@
 #include "eval.hh"
+#include "bytecode.hh"
+#include "eval-cache.hh"
 #include "hash.hh"
 #include "util.hh"
 #include "store-api.hh"
@@ -7,10 +9,17 @@
 #include "eval-inline.hh"
 #include "download.hh"
 #include "json.hh"
+#include "thread-pool.hh"
+#include "finally.hh"
+#include "sync.hh"
+#include "lru-cache.hh"
 
 #include <algorithm>
 #include <cstring>
+#include <cstddef>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <iostream>
@@ -188,6 +197,123 @@ static Symbol getName(const AttrName & name, EvalState & state, Env & env)
 }
 
 
+/* The elements of big lists are preceded by a header recording the
+   capacity of the buffer and how much of it is in use.  A list that
+   ends exactly at the end of the used part of its buffer can be
+   extended in place by '++', since no other list can see the unused
+   slots.  This makes repeated appends such as
+
+     foldl' (acc: x: acc ++ [x]) [] xs
+
+   take amortised linear rather than quadratic time. */
+struct ListBuffer
+{
+    size_t capacity;
+    std::atomic<size_t> used;
+    Value * elems[0];
+};
+
+
+static Value * * allocListElems(size_t size, size_t capacity)
+{
+    auto buf = new (allocBytes(sizeof(ListBuffer) + capacity * sizeof(Value *))) ListBuffer;
+    buf->capacity = capacity;
+    buf->used = size;
+    return buf->elems;
+}
+
+
+static ListBuffer * listBuffer(Value * * elems)
+{
+    return (ListBuffer *) ((char *) elems - sizeof(ListBuffer));
+}
+
+
+static const char * phaseNames[] = {
+    "eval", "parse", "bindVars", "derivationStrict", "writeDerivation", "copyPathToStore"
+};
+
+static_assert(sizeof(phaseNames) / sizeof(phaseNames[0]) == (size_t) EvalPhase::Count,
+    "missing phase names");
+
+struct PhaseStats
+{
+    std::atomic<uint64_t> wallTime{0}, cpuTime{0}; // in nanoseconds
+    std::atomic<uint64_t> count{0};
+};
+
+static PhaseStats phaseStats[(size_t) EvalPhase::Count];
+
+struct PhaseState
+{
+    EvalPhase phase = EvalPhase::Eval;
+    uint64_t wallTime = 0, cpuTime = 0;
+};
+
+static thread_local PhaseState phaseState;
+
+
+static uint64_t getTime(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+/* Charge the time since the last phase change to the current phase. */
+static void chargePhase()
+{
+    auto wallTime = getTime(CLOCK_MONOTONIC);
+    auto cpuTime = getTime(CLOCK_THREAD_CPUTIME_ID);
+    if (phaseState.wallTime) {
+        auto & stats(phaseStats[(size_t) phaseState.phase]);
+        stats.wallTime += wallTime - phaseState.wallTime;
+        stats.cpuTime += cpuTime - phaseState.cpuTime;
+    }
+    phaseState.wallTime = wallTime;
+    phaseState.cpuTime = cpuTime;
+}
+
+
+PhaseTimer::PhaseTimer(EvalPhase phase)
+{
+    chargePhase();
+    prev = phaseState.phase;
+    phaseState.phase = phase;
+    phaseStats[(size_t) phase].count++;
+}
+
+
+PhaseTimer::~PhaseTimer()
+{
+    chargePhase();
+    phaseState.phase = prev;
+}
+
+
+#if HAVE_BOEHMGC
+static std::atomic<uint64_t> nrGCs{0};
+static std::atomic<uint64_t> gcPauseTime{0}, gcMaxPause{0}; // in nanoseconds
+static uint64_t gcStart = 0;
+
+/* Called by the Boehm GC at the start and end of every collection,
+   with the world stopped. */
+static void onGCEvent(GC_EventType event)
+{
+    if (event == GC_EVENT_START)
+        gcStart = getTime(CLOCK_MONOTONIC);
+    else if (event == GC_EVENT_END && gcStart) {
+        auto pause = getTime(CLOCK_MONOTONIC) - gcStart;
+        nrGCs++;
+        gcPauseTime += pause;
+        if (pause > gcMaxPause) gcMaxPause = pause;
+        gcStart = 0;
+    }
+}
+#endif
+
+
 static bool gcInitialised = false;
 
 void initGC()
@@ -201,6 +327,9 @@ void initGC()
        misdetection a bit. */
     GC_set_all_interior_pointers(0);
 
+    /* Except for pointers to the elements of a ListBuffer. */
+    GC_register_displacement(sizeof(ListBuffer));
+
     /* We don't have any roots in data segments, so don't scan from
        there. */
     GC_set_no_dls(1);
@@ -209,6 +338,8 @@ void initGC()
 
     GC_set_oom_fn(oomHandler);
 
+    GC_set_on_collection_event(onGCEvent);
+
     /* Set the initial heap size to something fairly big (25% of
        physical RAM, up to a maximum of 384 MiB) so that in most cases
        we don't need to garbage collect at all.  (Collection has a
@@ -276,6 +407,358 @@ static Strings parseNixPath(const string & s)
 }
 
 
+/* Values and environments can be allocated either from the garbage
+   collected heap or, if 'eval-allocator' is set to 'arena', from a
+   bump allocator that never frees anything.  The latter is intended
+   for short-lived processes, where collection is mostly wasted
+   effort.  Since arena memory is not scanned by the garbage
+   collector, collection is disabled entirely in arena mode. */
+static bool useArena = false;
+
+static std::atomic<uint64_t> nrArenaChunks{0};
+static std::atomic<uint64_t> nrArenaBytes{0};
+static std::atomic<uint64_t> nrPoolRefills{0};
+
+static const size_t arenaChunkSize = 64 * 1024 * 1024;
+
+static void initAllocator()
+{
+    auto & kind(evalSettings.evalAllocator.get());
+    if (kind == "arena") {
+        if (!useArena) {
+#if HAVE_BOEHMGC
+            GC_disable();
+#endif
+            useArena = true;
+        }
+    } else if (kind != "gc")
+        throw Error("unknown evaluation allocator '%s'; expected 'gc' or 'arena'", kind);
+}
+
+/* Each thread allocates from its own chunk. */
+static thread_local char * arenaPtr = nullptr, * arenaEnd = nullptr;
+
+static void * arenaAlloc(size_t n)
+{
+    n = (n + 7) & ~(size_t) 7;
+
+    if ((size_t) (arenaEnd - arenaPtr) < n) {
+        auto size = std::max(n, arenaChunkSize);
+        /* Anonymous mappings are zero-filled, as the evaluator
+           expects, and only take up memory when they're touched. */
+        auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED) throw std::bad_alloc();
+        arenaPtr = (char *) p;
+        arenaEnd = arenaPtr + size;
+        nrArenaChunks++;
+    }
+
+    auto p = arenaPtr;
+    arenaPtr += n;
+    nrArenaBytes += n;
+    return p;
+}
+
+
+#if HAVE_BOEHMGC
+
+/* Small objects (Values and environments with a few elements) are
+   allocated from per-thread free lists, one per size class of
+   `poolGranule' bytes, that are refilled in bulk using
+   GC_malloc_many().  This is much cheaper than a GC_MALLOC() call per
+   object.  The list heads are kept in uncollectable memory so that
+   the collector considers the objects on the lists reachable. */
+static const size_t poolGranule = 16, nrPools = 5;
+
+static thread_local void * * pools = nullptr;
+
+static void * poolAlloc(size_t n)
+{
+    auto sizeClass = (n + poolGranule - 1) / poolGranule;
+    if (sizeClass >= nrPools) return allocBytes(n);
+
+    if (!pools) {
+        pools = (void * *) GC_MALLOC_UNCOLLECTABLE(nrPools * sizeof(void *));
+        if (!pools) throw std::bad_alloc();
+    }
+
+    auto & pool(pools[sizeClass]);
+
+    if (!pool) {
+        pool = GC_malloc_many(sizeClass * poolGranule);
+        if (!pool) throw std::bad_alloc();
+        nrPoolRefills++;
+    }
+
+    /* Objects returned by GC_malloc_many() are cleared, except for
+       the first word, which links them together. */
+    auto p = pool;
+    pool = GC_NEXT(p);
+    GC_NEXT(p) = nullptr;
+    return p;
+}
+
+#endif
+
+
+static void * allocSmall(size_t n)
+{
+    if (useArena) return arenaAlloc(n);
+#if HAVE_BOEHMGC
+    return poolAlloc(n);
+#else
+    return allocBytes(n);
+#endif
+}
+
+
+/* Speculatively parses the files referenced by path literals in
+   parsed files on a few background threads, so that by the time
+   evaluation reaches an `import ./foo.nix', the file has usually been
+   read and parsed already.  Workers check access to a file with
+   checkSourcePath() before reading it, and the results only become
+   visible to the evaluator through take(), i.e. once evalFile() has
+   done its own check; files that fail to parse are parsed again by
+   evalFile() to get the error. */
+struct Preparser
+{
+    EvalState & state;
+
+    /* Files are only parsed up to this many imports away from a file
+       parsed by the evaluator, so that e.g. importing a single
+       Nixpkgs module doesn't queue all of Nixpkgs. */
+    static const unsigned int maxDepth = 3;
+
+    /* The depth of the file being parsed on this thread. */
+    static thread_local unsigned int depth;
+
+    struct Entry
+    {
+        unsigned int depth;
+        bool started = false;
+        bool done = false;
+        Expr * e = nullptr;
+        string hash;
+    };
+
+#if HAVE_BOEHMGC
+    typedef std::map<Path, Entry, std::less<Path>, traceable_allocator<std::pair<const Path, Entry> > > Entries;
+#else
+    typedef std::map<Path, Entry> Entries;
+#endif
+
+    struct State
+    {
+        Entries entries;
+        std::list<Path> queue;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup, parsed;
+
+    std::vector<std::thread> workers;
+
+    Preparser(EvalState & state, unsigned int nrThreads)
+        : state(state)
+    {
+        for (unsigned int n = 0; n < nrThreads; ++n)
+            workers.emplace_back(&Preparser::worker, this);
+    }
+
+    ~Preparser()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thr : workers) thr.join();
+    }
+
+    void enqueue(const Path & path)
+    {
+        if (depth >= maxDepth) return;
+        auto st(state_.lock());
+        if (st->quit || !st->entries.emplace(path, Entry{depth + 1}).second) return;
+        st->queue.push_back(path);
+        wakeup.notify_one();
+    }
+
+    /* Return the parse tree of `path' and the hash of its contents,
+       waiting for it if it's being parsed.  Returns nullptr if `path'
+       was never queued, is still queued (in which case the caller
+       parses it, rather than waiting for the workers to get to it) or
+       couldn't be parsed. */
+    Expr * take(const Path & path, string & hash)
+    {
+        auto st(state_.lock());
+        while (true) {
+            auto i = st->entries.find(path);
+            if (i == st->entries.end()) return nullptr;
+            if (!i->second.started) {
+                /* The worker that dequeues it will skip it. */
+                st->entries.erase(i);
+                return nullptr;
+            }
+            if (i->second.done) break;
+            st.wait(parsed);
+        }
+        auto i = st->entries.find(path);
+        auto e = i->second.e;
+        hash = i->second.hash;
+        st->entries.erase(i);
+        return e;
+    }
+
+    void worker()
+    {
+        initEvalThread();
+
+        while (true) {
+            Path path;
+            {
+                auto st(state_.lock());
+                while (!st->quit && st->queue.empty()) st.wait(wakeup);
+                if (st->quit) return;
+                path = st->queue.front();
+                st->queue.pop_front();
+                auto i = st->entries.find(path);
+                if (i == st->entries.end() || i->second.started) continue;
+                i->second.started = true;
+                depth = i->second.depth;
+            }
+
+            Expr * e = nullptr;
+            string hash;
+            try {
+                /* Check access before looking at the file at all, and
+                   record the result under the name that evalFile()
+                   will look it up with. */
+                auto path2 = state.checkSourcePath(resolveExprPath(state.checkSourcePath(path)));
+                if (hasSuffix(path2, ".nix")) {
+                    if (path2 != path) {
+                        auto st(state_.lock());
+                        st->entries.erase(path);
+                        Entry entry{depth};
+                        entry.started = true;
+                        if (!st->entries.emplace(path2, entry).second) {
+                            parsed.notify_all();
+                            continue;
+                        }
+                        path = path2;
+                    }
+                    auto buffer = readFile(path);
+                    e = state.parse(buffer.c_str(), path, dirOf(path), state.staticBaseEnv, true);
+                    hash = hashString(htSHA256, buffer).to_string();
+                }
+            } catch (std::exception &) {
+                /* evalFile() will parse the file itself and report
+                   the error. */
+                e = nullptr;
+            }
+
+            {
+                auto st(state_.lock());
+                auto i = st->entries.find(path);
+                if (i != st->entries.end()) {
+                    i->second.done = true;
+                    i->second.e = e;
+                    i->second.hash = hash;
+                }
+            }
+            parsed.notify_all();
+        }
+    }
+};
+
+
+thread_local unsigned int Preparser::depth = 0;
+
+
+/* Runs the fetches started by EvalState::prefetch() on a few
+   background threads. A fetch that hasn't started by the time the
+   evaluator needs it is dropped, since the evaluator will do it
+   anyway. */
+struct Prefetcher
+{
+    struct State
+    {
+        /* The keys of the fetches that were started, mapped to
+           whether they have finished. */
+        std::map<string, bool> jobs;
+        std::list<std::pair<string, std::function<void()>>> queue;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup, finished;
+
+    std::vector<std::thread> workers;
+
+    Prefetcher(unsigned int nrThreads)
+    {
+        for (unsigned int n = 0; n < nrThreads; ++n)
+            workers.emplace_back(&Prefetcher::worker, this);
+    }
+
+    /* Waits for the fetches in progress, but not the queued ones. */
+    ~Prefetcher()
+    {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thr : workers) thr.join();
+    }
+
+    void enqueue(const string & key, std::function<void()> fetch)
+    {
+        auto st(state_.lock());
+        if (st->quit || !st->jobs.emplace(key, false).second) return;
+        st->queue.emplace_back(key, fetch);
+        wakeup.notify_one();
+    }
+
+    void wait(const string & key)
+    {
+        auto st(state_.lock());
+        auto i = st->jobs.find(key);
+        if (i == st->jobs.end()) return;
+
+        for (auto j = st->queue.begin(); j != st->queue.end(); ++j)
+            if (j->first == key) {
+                debug("cancelling prefetch '%s'", key);
+                st->queue.erase(j);
+                i->second = true;
+                return;
+            }
+
+        while (!i->second) st.wait(finished);
+    }
+
+    void worker()
+    {
+        while (true) {
+            std::pair<string, std::function<void()>> job;
+            {
+                auto st(state_.lock());
+                while (!st->quit && st->queue.empty()) st.wait(wakeup);
+                if (st->quit) return;
+                job = std::move(st->queue.front());
+                st->queue.pop_front();
+            }
+
+            try {
+                job.second();
+            } catch (std::exception & e) {
+                debug("prefetch '%s' failed: %s", job.first, e.what());
+            }
+
+            state_.lock()->jobs[job.first] = true;
+            finished.notify_all();
+        }
+    }
+};
+
+
 EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     : sWith(symbols.create("<with>"))
     , sOutPath(symbols.create("outPath"))
@@ -309,8 +792,15 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
 {
     countCalls = getEnv("NIX_COUNT_CALLS", "0") != "0";
 
+    if (evalSettings.evalProfileFile != "")
+        profiler = std::make_unique<EvalProfiler>(evalSettings.evalProfileFile);
+
+    chargePhase();
+
     assert(gcInitialised);
 
+    initAllocator();
+
     static_assert(sizeof(Env) <= 16, "environment must be <= 16 bytes");
 
     /* Initialise the Nix expression search path. */
@@ -344,12 +834,69 @@ EvalState::EvalState(const Strings & _searchPath, ref<Store> store)
     vEmptySet.type = tAttrs;
     vEmptySet.attrs = allocBindings(0);
 
+    mkBool(vTrue, true);
+    mkBool(vFalse, false);
+    mkNull(vNull);
+    for (NixInt n = 0; n < nrSmallInts; ++n)
+        mkInt(smallInts[n], n);
+
     createBaseEnv();
+
+    if (evalSettings.preparseThreads)
+        preparser = std::make_unique<Preparser>(*this, evalSettings.preparseThreads);
+
+    /* In restricted and pure mode, the preparser may parse files that
+       evaluation turns out not to be allowed to read, so don't let
+       them cause network traffic. */
+    if (evalSettings.prefetchThreads && !allowedPaths)
+        prefetcher = std::make_unique<Prefetcher>(evalSettings.prefetchThreads);
 }
 
 
 EvalState::~EvalState()
 {
+    /* Don't lose the texts if the caller forgot to flush them. */
+    try {
+        flushTexts();
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+Path EvalState::addTextToStore(const string & name, const string & contents,
+    const PathSet & references)
+{
+    if (settings.readOnlyMode)
+        return store->computeStorePathForText(name, contents, references);
+
+    if (!batchTexts || !evalSettings.writeBatchSize || repair)
+        return store->addTextToStore(name, contents, references, repair);
+
+    auto path = store->computeStorePathForText(name, contents, references);
+
+    bool full;
+    {
+        std::lock_guard<std::mutex> lock(pendingTextsLock);
+        if (!pendingTextPaths.insert(path).second) return path;
+        pendingTexts.push_back({name, contents, references});
+        full = pendingTexts.size() >= evalSettings.writeBatchSize;
+    }
+
+    if (full) flushTexts();
+
+    return path;
+}
+
+
+void EvalState::flushTexts()
+{
+    std::lock_guard<std::mutex> lock(pendingTextsLock);
+    if (pendingTexts.empty()) return;
+    debug("adding %d texts to the store", pendingTexts.size());
+    store->addTextsToStore(pendingTexts, repair);
+    pendingTexts.clear();
+    pendingTextPaths.clear();
 }
 
 
@@ -357,11 +904,12 @@ Path EvalState::checkSourcePath(const Path & path_)
 {
     if (!allowedPaths) return path_;
 
-    auto i = resolvedPaths.find(path_);
-    if (i != resolvedPaths.end())
-        return i->second;
-
-    bool found = false;
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        auto i = resolvedPaths.find(path_);
+        if (i != resolvedPaths.end())
+            return i->second;
+    }
 
     /* First canonicalize the path without symlinks, so we make sure an
      * attacker can't append ../../... to a path that would be in allowedPaths
@@ -369,28 +917,58 @@ Path EvalState::checkSourcePath(const Path & path_)
      */
     Path abspath = canonPath(path_);
 
-    for (auto & i : *allowedPaths) {
-        if (isDirOrInDir(abspath, i)) {
-            found = true;
-            break;
-        }
-    }
-
-    if (!found)
+    if (!isAllowedPath(abspath))
         throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", abspath);
 
     /* Resolve symlinks. */
     debug(format("checking access to '%s'") % abspath);
-    Path path = canonPath(abspath, true);
+    Path path = resolveSymlinks(abspath, false);
 
-    for (auto & i : *allowedPaths) {
-        if (isDirOrInDir(path, i)) {
-            resolvedPaths[path_] = path;
-            return path;
-        }
+    if (!isAllowedPath(path))
+        throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", path);
+
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    resolvedPaths[path_] = path;
+    return path;
+}
+
+
+/* Equivalent to canonPath(path, true) for a canonical path, but
+   remembers the resolution of the directories leading up to it, so
+   that paths in a directory seen before only cost an lstat() of their
+   last component. */
+Path EvalState::resolveSymlinks(const Path & path, bool cache)
+{
+    if (path == "/") return path;
+
+    if (cache) {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        auto i = resolvedDirs.find(path);
+        if (i != resolvedDirs.end()) return i->second;
+    }
+
+    auto parent = resolveSymlinks(dirOf(path), true);
+    auto res = (parent == "/" ? "" : parent) + "/" + baseNameOf(path);
+    if (isLink(res)) res = canonPath(res, true);
+
+    if (cache) {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        resolvedDirs[path] = res;
     }
 
-    throw RestrictedPathError("access to path '%1%' is forbidden in restricted mode", path);
+    return res;
+}
+
+
+/* Whether the canonical path `path' is equal to or inside one of the
+   allowed paths.  Rather than scanning allowedPaths, look up each of
+   the ancestors of `path'. */
+bool EvalState::isAllowedPath(const Path & path)
+{
+    if (allowedPaths->count(path)) return true;
+    for (size_t n = path.find('/', 1); n != string::npos; n = path.find('/', n + 1))
+        if (allowedPaths->count(string(path, 0, n))) return true;
+    return false;
 }
 
 
@@ -426,6 +1004,90 @@ void EvalState::checkURI(const std::string & uri)
 }
 
 
+std::string EvalState::evalInChild(std::function<std::string()> fun)
+{
+    Pipe pipe;
+    pipe.create();
+
+    ProcessOptions options;
+    options.allowVfork = false;
+
+    Pid pid;
+    {
+#if HAVE_BOEHMGC
+        /* Let the collector get into a consistent state for the
+           fork.  In the child, it then marks on a single thread,
+           since the marker threads aren't copied. */
+        GC_atfork_prepare();
+        Finally resumeGC([]() { GC_atfork_parent(); });
+#endif
+
+        pid = startProcess([&]() {
+#if HAVE_BOEHMGC
+            GC_atfork_child();
+#endif
+            pipe.readSide = -1;
+            /* The store's SQLite or daemon connection and those of
+               the caches belong to the parent. */
+            store = openStore(store->getUri());
+            evalSettings.evalCache = false;
+            evalSettings.sourceCache = false;
+            trackEvalInputs = true;
+            writeFull(pipe.writeSide.get(), fun());
+            _exit(0);
+        }, options);
+    }
+
+    pipe.writeSide = -1;
+    auto res = drainFD(pipe.readSide.get());
+
+    int status = pid.wait();
+    if (status)
+        throw Error("evaluation in a child process %s", statusToString(status));
+
+    return res;
+}
+
+
+void EvalState::addEvalInput(const string & kind, const string & arg,
+    std::function<string()> fingerprint)
+{
+    if (!evalSettings.evalCache && !trackEvalInputs) return;
+    if (kind != "env" && store->isInStore(arg)) return;
+
+    auto input = kind + ":" + arg;
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        if (evalInputs.count(input)) return;
+    }
+    auto fp = fingerprint ? fingerprint() : fingerprintEvalInput(*this, input);
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    evalInputs.emplace(input, fp);
+}
+
+
+void EvalState::addEvalInputs(const std::map<string, string> & inputs)
+{
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    evalInputs.insert(inputs.begin(), inputs.end());
+}
+
+
+void EvalState::markEvalImpure()
+{
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    evalImpure = true;
+}
+
+
+std::optional<std::map<string, string>> EvalState::getEvalInputs()
+{
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    if (evalImpure) return {};
+    return evalInputs;
+}
+
+
 Path EvalState::toRealPath(const Path & path, const PathSet & context)
 {
     // FIXME: check whether 'path' is in 'context'.
@@ -551,17 +1213,96 @@ void mkString(Value & v, const char * s)
 }
 
 
-Value & mkString(Value & v, const string & s, const PathSet & context)
+struct ContextTable
 {
-    mkString(v, s.c_str());
-    if (!context.empty()) {
+    /* Interned contexts, keyed on their elements separated by NUL
+       characters. */
+    std::unordered_map<std::string, const char * *> sets;
+};
+
+static RWSync<ContextTable> contextTable;
+
+/* Memoised results of unionContexts(). This is bounded, since a long
+   evaluation can combine many different pairs of contexts. It has its
+   own lock because a lookup updates the LRU order. */
+typedef LRUCache<std::pair<const char * *, const char * *>, const char * *> ContextUnions;
+static Sync<ContextUnions> contextUnions(ContextUnions(65536));
+
+static Counter nrContextSets;
+
+
+static std::string contextKey(const PathSet & context)
+{
+    std::string key;
+    for (auto & i : context) {
+        key += i;
+        key.push_back(0);
+    }
+    return key;
+}
+
+
+static const char * * internContext(ContextTable & table, const PathSet & context,
+    const std::string & key)
+{
+    auto & res = table.sets[key];
+    if (!res) {
+        /* These are allocated outside of the garbage-collected heap,
+           since the table isn't scanned by the collector. */
+        res = new const char * [context.size() + 1];
         size_t n = 0;
-        v.string.context = (const char * *)
-            allocBytes((context.size() + 1) * sizeof(char *));
         for (auto & i : context)
-            v.string.context[n++] = dupString(i.c_str());
-        v.string.context[n] = 0;
+            res[n++] = strdup(i.c_str());
+        res[n] = 0;
+        nrContextSets++;
     }
+
+    return res;
+}
+
+
+const char * * internContext(const PathSet & context)
+{
+    if (context.empty()) return 0;
+
+    auto key = contextKey(context);
+
+    /* Most contexts have been interned before, so try that under a
+       read lock first. */
+    {
+        auto table(contextTable.readLock());
+        auto i = table->sets.find(key);
+        if (i != table->sets.end()) return i->second;
+    }
+
+    return internContext(*contextTable.lock(), context, key);
+}
+
+
+const char * * unionContexts(const char * * c1, const char * * c2)
+{
+    if (!c1 || c1 == c2) return c2;
+    if (!c2) return c1;
+
+    if (c2 < c1) std::swap(c1, c2);
+
+    if (auto res = contextUnions.lock()->get({c1, c2}))
+        return *res;
+
+    PathSet context;
+    for (const char * * p = c1; *p; ++p) context.insert(*p);
+    for (const char * * p = c2; *p; ++p) context.insert(*p);
+
+    auto res = internContext(*contextTable.lock(), context, contextKey(context));
+    contextUnions.lock()->upsert({c1, c2}, res);
+    return res;
+}
+
+
+Value & mkString(Value & v, const string & s, const PathSet & context)
+{
+    mkString(v, s.c_str());
+    v.string.context = internContext(context);
     return v;
 }
 
@@ -578,19 +1319,37 @@ inline Value * EvalState::lookupVar(Env * env, const ExprVar & var, bool noEval)
 
     if (!var.fromWith) return env->values[var.displ];
 
+    bool first = true;
+
     while (1) {
         if (env->type == Env::HasWithExpr) {
             if (noEval) return 0;
             Value * v = allocValue();
             evalAttrs(*env->up, (Expr *) env->values[0], *v);
             env->values[0] = v;
+            /* Make sure other threads don't see the new type before
+               the new value. */
+            std::atomic_thread_fence(std::memory_order_release);
             env->type = Env::HasWithAttrs;
         }
-        Bindings::iterator j = env->values[0]->attrs->find(var.name);
-        if (j != env->values[0]->attrs->end()) {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        Bindings * attrs = env->values[0]->attrs;
+        if (first) {
+            /* The cached attribute is valid if it's an element of
+               this set with the right name. */
+            auto a = var.withCache.load(std::memory_order_relaxed);
+            if (a >= attrs->begin() && a < attrs->end() && a->name == var.name) {
+                if (countCalls && a->pos) attrSelects[*a->pos]++;
+                return a->value;
+            }
+        }
+        Bindings::iterator j = attrs->find(var.name);
+        if (j != attrs->end()) {
+            if (first) var.withCache.store(j, std::memory_order_relaxed);
             if (countCalls && j->pos) attrSelects[*j->pos]++;
             return j->value;
         }
+        first = false;
         if (!env->prevWith)
             throwUndefinedVarError("undefined variable '%1%' at %2%", var.name, var.pos);
         for (size_t l = env->prevWith; l; --l, env = env->up) ;
@@ -608,7 +1367,7 @@ void finalizeValue(void * obj, void * data)
 Value * EvalState::allocValue()
 {
     nrValues++;
-    auto v = (Value *) allocBytes(sizeof(Value));
+    auto v = (Value *) allocSmall(sizeof(Value));
     //GC_register_finalizer_no_order(v, finalizeValue, nullptr, nullptr, nullptr);
     return v;
 }
@@ -621,7 +1380,7 @@ Env & EvalState::allocEnv(size_t size)
 
     nrEnvs++;
     nrValuesInEnvs += size;
-    Env * env = (Env *) allocBytes(sizeof(Env) + size * sizeof(Value *));
+    Env * env = (Env *) allocSmall(sizeof(Env) + size * sizeof(Value *));
     env->size = (decltype(Env::size)) size;
     env->type = Env::Plain;
 
@@ -641,13 +1400,13 @@ void EvalState::mkList(Value & v, size_t size)
     else {
         v.type = tListN;
         v.bigList.size = size;
-        v.bigList.elems = size ? (Value * *) allocBytes(size * sizeof(Value *)) : 0;
+        v.bigList.elems = size ? allocListElems(size, size) : 0;
     }
     nrListElems += size;
 }
 
 
-unsigned long nrThunks = 0;
+Counter nrThunks;
 
 static inline void mkThunk(Value & v, Env & env, Expr * expr)
 {
@@ -669,8 +1428,8 @@ void EvalState::mkPos(Value & v, Pos * pos)
     if (pos && pos->file.set()) {
         mkAttrs(v, 3);
         mkString(*allocAttr(v, sFile), pos->file);
-        mkInt(*allocAttr(v, sLine), pos->line);
-        mkInt(*allocAttr(v, sColumn), pos->column);
+        v.attrs->push_back(Attr(sLine, intValue(pos->line)));
+        v.attrs->push_back(Attr(sColumn, intValue(pos->column)));
         v.attrs->sort();
     } else
         mkNull(v);
@@ -689,7 +1448,7 @@ Value * Expr::maybeThunk(EvalState & state, Env & env)
 }
 
 
-unsigned long nrAvoided = 0;
+Counter nrAvoided;
 
 Value * ExprVar::maybeThunk(EvalState & state, Env & env)
 {
@@ -731,28 +1490,41 @@ void EvalState::evalFile(const Path & path_, Value & v)
     auto path = checkSourcePath(path_);
 
     FileEvalCache::iterator i;
-    if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        if ((i = fileEvalCache.find(path)) != fileEvalCache.end()) {
+            v = i->second;
+            return;
+        }
     }
 
     Path path2 = resolveExprPath(path);
-    if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
-        v = i->second;
-        return;
-    }
-
-    printTalkative("evaluating file '%1%'", path2);
     Expr * e = nullptr;
 
-    auto j = fileParseCache.find(path2);
-    if (j != fileParseCache.end())
-        e = j->second;
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        if ((i = fileEvalCache.find(path2)) != fileEvalCache.end()) {
+            v = i->second;
+            return;
+        }
+
+        auto j = fileParseCache.find(path2);
+        if (j != fileParseCache.end())
+            e = j->second;
+    }
 
-    if (!e)
-        e = parseExprFromFile(checkSourcePath(path2));
+    printTalkative("evaluating file '%1%'", path2);
 
-    fileParseCache[path2] = e;
+    if (!e) {
+        auto path3 = checkSourcePath(path2);
+        string hash;
+        if (preparser && (e = preparser->take(path3, hash)))
+            addEvalInput("file", path3, [&]() { return hash; });
+        else
+            e = parseExprFromFile(path3);
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        fileParseCache[path2] = e;
+    }
 
     try {
         eval(e, v);
@@ -761,15 +1533,80 @@ void EvalState::evalFile(const Path & path_, Value & v)
         throw;
     }
 
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
     fileEvalCache[path2] = v;
     if (path != path2) fileEvalCache[path] = v;
 }
 
 
+void EvalState::preparseFile(const Path & path)
+{
+    preparser->enqueue(path);
+}
+
+
+void EvalState::prefetch(const string & key, std::function<void()> fetch)
+{
+    if (prefetcher) prefetcher->enqueue(key, fetch);
+}
+
+
+void EvalState::waitForPrefetch(const string & key)
+{
+    if (prefetcher) prefetcher->wait(key);
+}
+
+
+void EvalState::readDirCached(const Path & path, Value & v)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw SysError("getting status of '%1%'", path);
+
+    auto mtime = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+    auto ctime = (int64_t) st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        auto i = readDirCache.find(path);
+        if (i != readDirCache.end()
+            && i->second.dev == (uint64_t) st.st_dev
+            && i->second.ino == (uint64_t) st.st_ino
+            && i->second.mtime == mtime
+            && i->second.ctime == ctime)
+        {
+            v = i->second.v;
+            return;
+        }
+    }
+
+    DirEntries entries = readDirectory(path);
+    mkAttrs(v, entries.size());
+
+    for (auto & ent : entries) {
+        Value * ent_val = allocAttr(v, symbols.create(ent.name));
+        if (ent.type == DT_UNKNOWN)
+            ent.type = getFileType(path + "/" + ent.name);
+        mkStringNoCopy(*ent_val,
+            ent.type == DT_REG ? "regular" :
+            ent.type == DT_DIR ? "directory" :
+            ent.type == DT_LNK ? "symlink" :
+            "unknown");
+    }
+
+    v.attrs->sort();
+
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    readDirCache[path] = ReadDirEntry{(uint64_t) st.st_dev, (uint64_t) st.st_ino, mtime, ctime, v};
+}
+
+
 void EvalState::resetFileCache()
 {
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
     fileEvalCache.clear();
     fileParseCache.clear();
+    readDirCache.clear();
 }
 
 
@@ -918,7 +1755,7 @@ void ExprAttrs::eval(EvalState & state, Env & env, Value & v)
 }
 
 
-void ExprLet::eval(EvalState & state, Env & env, Value & v)
+Env & ExprLet::allocEnv(EvalState & state, Env & env)
 {
     /* Create a new environment that contains the attributes in this
        `let'. */
@@ -932,7 +1769,13 @@ void ExprLet::eval(EvalState & state, Env & env, Value & v)
     for (auto & i : attrs->attrs)
         env2.values[displ++] = i.second.e->maybeThunk(state, i.second.inherited ? env : env2);
 
-    body->eval(state, env2, v);
+    return env2;
+}
+
+
+void ExprLet::eval(EvalState & state, Env & env, Value & v)
+{
+    body->eval(state, allocEnv(state, env), v);
 }
 
 
@@ -969,16 +1812,21 @@ static string showAttrPath(EvalState & state, Env & env, const AttrPath & attrPa
 }
 
 
-unsigned long nrLookups = 0;
+Counter nrLookups;
 
 void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 {
     Value vTmp;
+    e->eval(state, env, vTmp);
+    evalFrom(state, env, vTmp, v);
+}
+
+
+void ExprSelect::evalFrom(EvalState & state, Env & env, Value & vTmp, Value & v)
+{
     Pos * pos2 = 0;
     Value * vAttrs = &vTmp;
 
-    e->eval(state, env, vTmp);
-
     try {
 
         for (auto & i : attrPath) {
@@ -1016,13 +1864,18 @@ void ExprSelect::eval(EvalState & state, Env & env, Value & v)
 }
 
 
-void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
+void ExprOpHasAttr::eval(EvalState & state, Env & env, Value & v)
+{
+    Value vTmp;
+    e->eval(state, env, vTmp);
+    evalFrom(state, env, vTmp, v);
+}
+
+
+void ExprOpHasAttr::evalFrom(EvalState & state, Env & env, Value & vTmp, Value & v)
 {
-    Value vTmp;
     Value * vAttrs = &vTmp;
 
-    e->eval(state, env, vTmp);
-
     for (auto & i : attrPath) {
         state.forceValue(*vAttrs);
         Bindings::iterator j;
@@ -1049,12 +1902,71 @@ void ExprLambda::eval(EvalState & state, Env & env, Value & v)
 }
 
 
+/* Evaluate the application `app' except for its last step: set `vFun'
+   to the function and `vArg' to the argument of the outermost call.
+   Returns false if the application has been evaluated completely into
+   `v' instead, which happens for saturated primop calls. */
+static bool evalAppHead(EvalState & state, ExprApp & app, Env & env, Value & vFun, Value * & vArg, Value & v)
+{
+    /* For an application to several arguments ('f a b ...'), evaluate
+       the function first, so that a saturated call of a primop can be
+       done directly, without allocating partial applications. */
+    const size_t maxArgs = 4;
+    ExprApp * apps[maxArgs];
+    size_t nrArgs = 0;
+    Expr * head = &app;
+    while (nrArgs < maxArgs && head->kind == Expr::kApp) {
+        auto app = static_cast<ExprApp *>(head);
+        apps[nrArgs++] = app;
+        head = app->e1;
+    }
+
+    head->eval(state, env, vFun);
+
+    if (nrArgs == 1) {
+        vArg = app.e2->maybeThunk(state, env);
+        return true;
+    }
+
+    /* apps[nrArgs - 1] is the innermost application. */
+    size_t n = nrArgs;
+    Value vTmp[2];
+    Value * vCur = &vFun;
+
+    if (vFun.type == tPrimOp && vFun.primOp->arity <= nrArgs) {
+        auto arity = vFun.primOp->arity;
+        Value * vArgs[maxArgs];
+        for (size_t i = 0; i < arity; ++i)
+            vArgs[i] = apps[n - 1 - i]->e2->maybeThunk(state, env);
+        n -= arity;
+        if (!n) {
+            state.callPrimOp(*vFun.primOp, vArgs, v, apps[0]->pos);
+            return false;
+        }
+        state.callPrimOp(*vFun.primOp, vArgs, vTmp[0], apps[n]->pos);
+        vCur = &vTmp[0];
+    }
+
+    /* Apply the remaining arguments one by one. */
+    while (n > 1) {
+        n--;
+        Value & vRes(vCur == &vTmp[0] ? vTmp[1] : vTmp[0]);
+        state.callFunction(*vCur, *(apps[n]->e2->maybeThunk(state, env)), vRes, apps[n]->pos);
+        vCur = &vRes;
+    }
+
+    if (vCur != &vFun) vFun = *vCur;
+    vArg = app.e2->maybeThunk(state, env);
+    return true;
+}
+
+
 void ExprApp::eval(EvalState & state, Env & env, Value & v)
 {
     /* FIXME: vFun prevents GCC from doing tail call optimisation. */
-    Value vFun;
-    e1->eval(state, env, vFun);
-    state.callFunction(vFun, *(e2->maybeThunk(state, env)), v, pos);
+    Value vFun, * vArg;
+    if (evalAppHead(state, *this, env, vFun, vArg, v))
+        state.callFunction(vFun, *vArg, v, pos);
 }
 
 
@@ -1082,9 +1994,7 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
             vArgs[n--] = arg->primOpApp.right;
 
         /* And call the primop. */
-        nrPrimOpCalls++;
-        if (countCalls) primOpCalls[primOp->primOp->name]++;
-        primOp->primOp->fun(*this, pos, vArgs, v);
+        callPrimOp(*primOp->primOp, vArgs, v, pos);
     } else {
         Value * fun2 = allocValue();
         *fun2 = fun;
@@ -1095,95 +2005,280 @@ void EvalState::callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos)
 }
 
 
-void EvalState::callFunction(Value & fun, Value & arg, Value & v, const Pos & pos)
+void EvalState::callPrimOp(PrimOp & primOp, Value * * args, Value & v, const Pos & pos)
 {
-    forceValue(fun, pos);
+    nrPrimOpCalls++;
+    if (countCalls) primOpCalls[primOp.name]++;
+    if (profiler) {
+        profiler->enter(primOp);
+        Finally leave([&]() { profiler->leave(); });
+        primOp.fun(*this, pos, args, v);
+    } else
+        primOp.fun(*this, pos, args, v);
+}
 
-    if (fun.type == tPrimOp || fun.type == tPrimOpApp) {
-        callPrimOp(fun, arg, v, pos);
-        return;
-    }
 
-    if (fun.type == tAttrs) {
-      auto found = fun.attrs->find(sFunctor);
-      if (found != fun.attrs->end()) {
-        /* fun may be allocated on the stack of the calling function,
-         * but for functors we may keep a reference, so heap-allocate
-         * a copy and use that instead.
-         */
-        auto & fun2 = *allocValue();
-        fun2 = fun;
-        /* !!! Should we use the attr pos here? */
-        Value v2;
-        callFunction(*found->value, fun2, v2, pos);
-        return callFunction(v2, arg, v, pos);
-      }
-    }
-
-    if (fun.type != tLambda)
-        throwTypeError("attempt to call something which is not a function but %1%, at %2%", fun, pos);
-
-    ExprLambda & lambda(*fun.lambda.fun);
-
-    auto size =
-        (lambda.arg.empty() ? 0 : 1) +
-        (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
-    Env & env2(allocEnv(size));
-    env2.up = fun.lambda.env;
+void EvalState::callFunction(Value & fun_, Value & arg_, Value & v, const Pos & pos_)
+{
+    /* Calls in tail position of a function body are done by iterating
+       rather than recursing (see below), so `fun', `arg' and `pos'
+       change from one iteration to the next. */
+    Value * fun = &fun_, * arg = &arg_;
+    const Pos * pos = &pos_;
+    Value vTail;
 
-    size_t displ = 0;
+    /* Since tail calls don't use C stack space, infinite tail recursion
+       wouldn't be caught by the stack overflow handler, so limit their
+       number. */
+    unsigned int tailCalls = 0;
 
-    if (!lambda.matchAttrs)
-        env2.values[displ++] = &arg;
+    while (true) {
+        checkInterrupt();
 
-    else {
-        forceAttrs(arg, pos);
-
-        if (!lambda.arg.empty())
-            env2.values[displ++] = &arg;
-
-        /* For each formal argument, get the actual argument.  If
-           there is no matching actual argument but the formal
-           argument has a default, use the default. */
-        size_t attrsUsed = 0;
-        for (auto & i : lambda.formals->formals) {
-            Bindings::iterator j = arg.attrs->find(i.name);
-            if (j == arg.attrs->end()) {
-                if (!i.def) throwTypeError("%1% called without required argument '%2%', at %3%",
-                    lambda, i.name, pos);
-                env2.values[displ++] = i.def->maybeThunk(*this, env2);
-            } else {
-                attrsUsed++;
-                env2.values[displ++] = j->value;
+        forceValue(*fun, *pos);
+
+        if (fun->type == tPrimOp || fun->type == tPrimOpApp) {
+            callPrimOp(*fun, *arg, v, *pos);
+            return;
+        }
+
+        if (fun->type == tAttrs) {
+          auto found = fun->attrs->find(sFunctor);
+          if (found != fun->attrs->end()) {
+            /* fun may be allocated on the stack of the calling function,
+             * but for functors we may keep a reference, so heap-allocate
+             * a copy and use that instead.
+             */
+            auto & fun2 = *allocValue();
+            fun2 = *fun;
+            /* !!! Should we use the attr pos here? */
+            callFunction(*found->value, fun2, vTail, *pos);
+            fun = &vTail;
+            continue;
+          }
+        }
+
+        if (fun->type != tLambda)
+            throwTypeError("attempt to call something which is not a function but %1%, at %2%", *fun, *pos);
+
+        ExprLambda & lambda(*fun->lambda.fun);
+
+        auto size =
+            (lambda.arg.empty() ? 0 : 1) +
+            (lambda.matchAttrs ? lambda.formals->formals.size() : 0);
+        Env & env2(allocEnv(size));
+        env2.up = fun->lambda.env;
+
+        size_t displ = 0;
+
+        if (!lambda.matchAttrs)
+            env2.values[displ++] = arg;
+
+        else {
+            forceAttrs(*arg, *pos);
+
+            if (!lambda.arg.empty())
+                env2.values[displ++] = arg;
+
+            /* For each formal argument, get the actual argument.  If
+               there is no matching actual argument but the formal
+               argument has a default, use the default. */
+            size_t attrsUsed = 0;
+            for (auto & i : lambda.formals->formals) {
+                Bindings::iterator j = arg->attrs->find(i.name);
+                if (j == arg->attrs->end()) {
+                    if (!i.def) throwTypeError("%1% called without required argument '%2%', at %3%",
+                        lambda, i.name, *pos);
+                    env2.values[displ++] = i.def->maybeThunk(*this, env2);
+                } else {
+                    attrsUsed++;
+                    env2.values[displ++] = j->value;
+                }
+            }
+
+            /* Check that each actual argument is listed as a formal
+               argument (unless the attribute match specifies a `...'). */
+            if (!lambda.formals->ellipsis && attrsUsed != arg->attrs->size()) {
+                /* Nope, so show the first unexpected argument to the
+                   user. */
+                for (auto & i : *arg->attrs)
+                    if (lambda.formals->argNames.find(i.name) == lambda.formals->argNames.end())
+                        throwTypeError("%1% called with unexpected argument '%2%', at %3%", lambda, i.name, *pos);
+                abort(); // can't happen
+            }
+        }
+
+        nrFunctionCalls++;
+        if (countCalls) incrFunctionCall(&lambda);
+
+        /* Evaluate the body.  This is conditional on showTrace, because
+           catching exceptions makes this function not tail-recursive. */
+        if (profiler) {
+            evalProfiled(lambda, env2, v, *pos);
+            return;
+        }
+
+        if (settings.showTrace) {
+            try {
+                lambda.body->eval(*this, env2, v);
+            } catch (Error & e) {
+                addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, *pos);
+                throw;
+            }
+            return;
+        }
+
+        /* Find the expression in tail position of the body, going
+           through conditionals, assertions, lets and withs.  If it is a
+           function application, do the call in the next iteration of
+           this loop rather than recursively, so that tail-recursive Nix
+           functions (like `go = n: acc: if n == 0 then acc else go (n -
+           1) (acc + n)') run in constant C stack space. */
+        Expr * body = lambda.body;
+        Env * env = &env2;
+        while (true) {
+            if (body->kind == Expr::kIf) {
+                auto e = static_cast<ExprIf *>(body);
+                body = evalBool(*env, e->cond) ? e->then : e->else_;
             }
+            else if (body->kind == Expr::kAssert) {
+                auto e = static_cast<ExprAssert *>(body);
+                if (!evalBool(*env, e->cond, e->pos))
+                    throwAssertionError("assertion failed at %1%", e->pos);
+                body = e->body;
+            }
+            else if (body->kind == Expr::kLet) {
+                auto e = static_cast<ExprLet *>(body);
+                env = &e->allocEnv(*this, *env);
+                body = e->body;
+            }
+            else if (body->kind == Expr::kWith) {
+                auto e = static_cast<ExprWith *>(body);
+                env = &e->allocEnv(*this, *env);
+                body = e->body;
+            }
+            else break;
+        }
+
+        if (body->kind != Expr::kApp) {
+            body->eval(*this, *env, v);
+            return;
         }
 
-        /* Check that each actual argument is listed as a formal
-           argument (unless the attribute match specifies a `...'). */
-        if (!lambda.formals->ellipsis && attrsUsed != arg.attrs->size()) {
-            /* Nope, so show the first unexpected argument to the
-               user. */
-            for (auto & i : *arg.attrs)
-                if (lambda.formals->argNames.find(i.name) == lambda.formals->argNames.end())
-                    throwTypeError("%1% called with unexpected argument '%2%', at %3%", lambda, i.name, pos);
-            abort(); // can't happen
+        auto app = static_cast<ExprApp *>(body);
+
+        if (++tailCalls > evalSettings.maxTailCalls)
+            throwEvalError("stack overflow (possible infinite recursion): more than %1% tail calls, at %2%",
+                std::to_string(evalSettings.maxTailCalls), app->pos);
+
+        if (!evalAppHead(*this, *app, *env, vTail, arg, v)) return;
+        fun = &vTail;
+        pos = &app->pos;
+    }
+}
+
+
+/* Append a serialisation of the deeply evaluated value `v' to `out',
+   such that structurally equal values have equal serialisations.
+   Functions, thunks inside function closures and external values are
+   identified by address, which is conservative.  The memo cache
+   keeps `v' alive, so that these addresses aren't reused while the
+   serialisation is in use. */
+static void serialiseForMemo(Value & v, std::string & out, std::vector<const void *> & active)
+{
+    auto addPtr = [&](const void * p) {
+        out.append((const char *) &p, sizeof(p));
+    };
+
+    auto addStr = [&](const char * s) {
+        out.append(s);
+        out.push_back(0);
+    };
+
+    /* Handle cycles by referring to the ancestor. */
+    if (v.type == tAttrs || v.isList()) {
+        const void * p = v.type == tAttrs ? (const void *) v.attrs : (const void *) v.listElems();
+        auto i = std::find(active.begin(), active.end(), p);
+        if (i != active.end()) {
+            out.push_back('@');
+            out += std::to_string(i - active.begin());
+            out.push_back(0);
+            return;
         }
+        active.push_back(p);
     }
 
-    nrFunctionCalls++;
-    if (countCalls) incrFunctionCall(&lambda);
+    out.push_back((char) (v.type == tList1 || v.type == tList2 ? tListN : v.type));
 
-    /* Evaluate the body.  This is conditional on showTrace, because
-       catching exceptions makes this function not tail-recursive. */
-    if (settings.showTrace)
-        try {
-            lambda.body->eval(*this, env2, v);
-        } catch (Error & e) {
-            addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
-            throw;
+    switch (v.type) {
+        case tInt: out.append((const char *) &v.integer, sizeof(v.integer)); break;
+        case tFloat: out.append((const char *) &v.fpoint, sizeof(v.fpoint)); break;
+        case tBool: out.push_back(v.boolean); break;
+        case tNull: break;
+        case tString:
+            addStr(v.string.s);
+            /* Contexts are interned. */
+            addPtr(v.string.context);
+            break;
+        case tPath: addStr(v.path); break;
+        case tAttrs:
+            out += std::to_string(v.attrs->size());
+            out.push_back(0);
+            for (auto & i : *v.attrs) {
+                addPtr(&(const string &) i.name);
+                serialiseForMemo(*i.value, out, active);
+            }
+            break;
+        case tList1: case tList2: case tListN:
+            out += std::to_string(v.listSize());
+            out.push_back(0);
+            for (size_t n = 0; n < v.listSize(); ++n)
+                serialiseForMemo(*v.listElems()[n], out, active);
+            break;
+        case tLambda:
+            addPtr(v.lambda.fun);
+            addPtr(v.lambda.env);
+            break;
+        case tPrimOp: addPtr(v.primOp); break;
+        case tPrimOpApp:
+            addPtr(v.primOpApp.left);
+            addPtr(v.primOpApp.right);
+            break;
+        case tExternal: addPtr(v.external); break;
+        default: addPtr(&v); break;
+    }
+
+    if (v.type == tAttrs || v.isList()) active.pop_back();
+}
+
+
+void EvalState::callMemoised(Value & fun, Value & arg, Value & v, const Pos & pos)
+{
+    forceValue(fun, pos);
+    forceValueDeep(arg);
+
+    std::string key;
+    std::vector<const void *> active;
+    serialiseForMemo(fun, key, active);
+    serialiseForMemo(arg, key, active);
+    key = hashString(htSHA256, key).to_string(Base16, false);
+
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        auto i = memoCache.find(key);
+        if (i != memoCache.end()) {
+            nrMemoHits++;
+            v = i->second.result;
+            return;
         }
-    else
-        fun.lambda.fun->body->eval(*this, env2, v);
+    }
+
+    callFunction(fun, arg, v, pos);
+    forceValue(v, pos);
+
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+    nrMemoMisses++;
+    memoCache.emplace(key, MemoEntry{fun, arg, v});
 }
 
 
@@ -1195,6 +2290,24 @@ void EvalState::incrFunctionCall(ExprLambda * fun)
 }
 
 
+// Likewise.
+void EvalState::evalProfiled(ExprLambda & lambda, Env & env, Value & v, const Pos & pos)
+{
+    profiler->enter(lambda);
+    Finally leave([&]() { profiler->leave(); });
+
+    if (settings.showTrace)
+        try {
+            lambda.body->eval(*this, env, v);
+        } catch (Error & e) {
+            addErrorPrefix(e, "while evaluating %1%, called from %2%:\n", lambda, pos);
+            throw;
+        }
+    else
+        lambda.body->eval(*this, env, v);
+}
+
+
 void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
 {
     forceValue(fun);
@@ -1231,15 +2344,20 @@ void EvalState::autoCallFunction(Bindings & args, Value & fun, Value & res)
 }
 
 
-void ExprWith::eval(EvalState & state, Env & env, Value & v)
+Env & ExprWith::allocEnv(EvalState & state, Env & env)
 {
     Env & env2(state.allocEnv(1));
     env2.up = &env;
     env2.prevWith = prevWith;
     env2.type = Env::HasWithExpr;
     env2.values[0] = (Value *) attrs;
+    return env2;
+}
 
-    body->eval(state, env2, v);
+
+void ExprWith::eval(EvalState & state, Env & env, Value & v)
+{
+    body->eval(state, allocEnv(state, env), v);
 }
 
 
@@ -1302,19 +2420,40 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     Value v1, v2;
     state.evalAttrs(env, e1, v1);
     state.evalAttrs(env, e2, v2);
+    state.updateAttrs(v1, v2, v);
+}
 
-    state.nrOpUpdates++;
+
+void EvalState::updateAttrs(Value & v1, Value & v2, Value & v)
+{
+    nrOpUpdates++;
 
     if (v1.attrs->size() == 0) { v = v2; return; }
     if (v2.attrs->size() == 0) { v = v1; return; }
 
-    state.mkAttrs(v, v1.attrs->size() + v2.attrs->size());
+    mkAttrs(v, v1.attrs->size() + v2.attrs->size());
 
     /* Merge the sets, preferring values from the second set.  Make
        sure to keep the resulting vector in sorted order. */
     Bindings::iterator i = v1.attrs->begin();
     Bindings::iterator j = v2.attrs->begin();
 
+    /* In the common case of a small set of overrides applied to a
+       large set (like 'pkgs // { foo = ...; }'), look up each
+       override in the first set and copy the ranges in between in
+       bulk, rather than comparing every attribute. */
+    if (v2.attrs->size() * 16 < v1.attrs->size()) {
+        for (; j != v2.attrs->end(); ++j) {
+            Bindings::iterator k = std::lower_bound(i, v1.attrs->end(), *j);
+            v.attrs->push_back(i, k);
+            v.attrs->push_back(*j);
+            i = k != v1.attrs->end() && k->name == j->name ? k + 1 : k;
+        }
+        v.attrs->push_back(i, v1.attrs->end());
+        nrOpUpdateValuesCopied += v.attrs->size();
+        return;
+    }
+
     while (i != v1.attrs->end() && j != v2.attrs->end()) {
         if (i->name == j->name) {
             v.attrs->push_back(*j);
@@ -1329,7 +2468,7 @@ void ExprOpUpdate::eval(EvalState & state, Env & env, Value & v)
     while (i != v1.attrs->end()) v.attrs->push_back(*i++);
     while (j != v2.attrs->end()) v.attrs->push_back(*j++);
 
-    state.nrOpUpdateValuesCopied += v.attrs->size();
+    nrOpUpdateValuesCopied += v.attrs->size();
 }
 
 
@@ -1360,20 +2499,59 @@ void EvalState::concatLists(Value & v, size_t nrLists, Value * * lists, const Po
         return;
     }
 
-    mkList(v, len);
-    auto out = v.listElems();
-    for (size_t n = 0, pos = 0; n < nrLists; ++n) {
-        auto l = lists[n]->listSize();
-        if (l)
-            memcpy(out + pos, lists[n]->listElems(), l * sizeof(Value *));
-        pos += l;
+    /* Copy lists[from...] to 'out'. */
+    auto copyLists = [&](Value * * out, size_t from) {
+        for (size_t n = from; n < nrLists; ++n) {
+            auto l = lists[n]->listSize();
+            if (l)
+                memcpy(out, lists[n]->listElems(), l * sizeof(Value *));
+            out += l;
+        }
+    };
+
+    auto setList = [&](Value * * elems) {
+        clearValue(v);
+        v.type = tListN;
+        v.bigList.size = len;
+        v.bigList.elems = elems;
+    };
+
+    /* If the first list is at the end of its buffer and there is room
+       left, append the other lists in place. */
+    Value * first = lists[0];
+    if (first->type == tListN && first->bigList.size) {
+        size_t size = first->bigList.size, expected = size;
+        Value * * elems = first->bigList.elems;
+        auto buf = listBuffer(elems);
+        if (len <= buf->capacity && buf->used.compare_exchange_strong(expected, len)) {
+            copyLists(elems + size, 1);
+            setList(elems);
+            nrListElems += len - size;
+            nrListsExtended++;
+            return;
+        }
+    }
+
+    /* Otherwise copy the lists.  If this looks like an append, leave
+       some room to extend the result later. */
+    size_t firstSize = first->listSize();
+    if (len > 2 && firstSize >= len - firstSize) {
+        Value * * elems = allocListElems(len, len + len / 2);
+        copyLists(elems, 0);
+        setList(elems);
+        nrListElems += len;
+        return;
     }
+
+    mkList(v, len);
+    copyLists(v.listElems(), 0);
 }
 
 
 void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
 {
     PathSet context;
+    const char * * stringContext = 0;
     std::ostringstream s;
     NixInt n = 0;
     NixFloat nf = 0;
@@ -1411,6 +2589,12 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
                 nf += vTmp.fpoint;
             } else
                 throwEvalError("cannot add %1% to a float, at %2%", showType(vTmp), pos);
+        } else if (firstType == tString && vTmp.type == tString) {
+            /* Since contexts are interned, we can usually take the
+               union of the contexts of string parts without going
+               through a PathSet. */
+            s << vTmp.string.s;
+            stringContext = unionContexts(stringContext, vTmp.string.context);
         } else
             s << state.coerceToString(pos, vTmp, context, false, firstType == tString);
     }
@@ -1424,8 +2608,10 @@ void ExprConcatStrings::eval(EvalState & state, Env & env, Value & v)
             throwEvalError("a string that refers to a store path cannot be appended to a path, at %1%", pos);
         auto path = canonPath(s.str());
         mkPath(v, path.c_str());
-    } else
+    } else {
         mkString(v, s.str(), context);
+        v.string.context = unionContexts(v.string.context, stringContext);
+    }
 }
 
 
@@ -1467,6 +2653,232 @@ void EvalState::forceValueDeep(Value & v)
 }
 
 
+/* Parallel evaluation. While forceParallel() runs, thunks are claimed
+   by atomically changing their type to tBlackhole, after which the
+   claiming thread stores a tagged pointer to its EvalThread in the
+   first word of the value. The result is written to the value's
+   payload before its type is published. A thread that finds a value
+   claimed by another thread waits for it, unless the chain of
+   threads waiting for each other leads back to itself, in which case
+   it abandons its work item. */
+
+/* Exception used to abandon a work item of forceParallel(). It does
+   not derive from Error, so evaluation code doesn't catch it. */
+struct EvalAbandoned { };
+
+/* Likewise, for work items that need an import from derivation while
+   builds are being deferred. */
+struct EvalDeferred { };
+
+struct EvalThread
+{
+    /* The value this thread is waiting for, if any. */
+    std::atomic<Value *> waitingFor{nullptr};
+};
+
+static thread_local EvalThread evalThread;
+
+static uintptr_t evalThreadToken(EvalThread & thread)
+{
+    return (uintptr_t) &thread | 1;
+}
+
+static EvalThread * blackholeOwner(Value & v)
+{
+    auto token = __atomic_load_n((uintptr_t *) &v.thunk.env, __ATOMIC_ACQUIRE);
+    /* An untagged pointer means that the owner hasn't stored its
+       token yet. */
+    return token & 1 ? (EvalThread *) (token & ~(uintptr_t) 1) : nullptr;
+}
+
+static void setPayload(Value & v, const Value & from)
+{
+    const size_t offset = offsetof(Value, integer);
+    memcpy((char *) &v + offset, (const char *) &from + offset, sizeof(Value) - offset);
+}
+
+
+void EvalState::forceValueParallel(Value & v, const Pos & pos)
+{
+    size_t spins = 0;
+
+    while (true) {
+        ValueType type = __atomic_load_n(&v.type, __ATOMIC_ACQUIRE);
+
+        if (type == tThunk || type == tApp) {
+            if (!__atomic_compare_exchange_n(&v.type, &type, tBlackhole,
+                    false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                continue;
+
+            Value saved = v;
+            saved.type = type;
+            __atomic_store_n((uintptr_t *) &v.thunk.env, evalThreadToken(evalThread), __ATOMIC_RELEASE);
+
+            try {
+                Value res;
+                if (type == tThunk)
+                    saved.thunk.expr->eval(*this, *saved.thunk.env, res);
+                else
+                    callFunction(*saved.app.left, *saved.app.right, res, noPos);
+                setPayload(v, res);
+                __atomic_store_n(&v.type, res.type, __ATOMIC_RELEASE);
+            } catch (...) {
+                setPayload(v, saved);
+                __atomic_store_n(&v.type, type, __ATOMIC_RELEASE);
+                throw;
+            }
+
+            return;
+        }
+
+        if (type != tBlackhole) return;
+
+        auto owner = blackholeOwner(v);
+
+        if (owner == &evalThread)
+            throwEvalError("infinite recursion encountered, at %1%", pos);
+
+        if (owner) {
+            /* Check whether waiting would close a cycle. */
+            size_t depth = 0;
+            for (auto t = owner; t && depth < 1024; ++depth) {
+                auto w = t->waitingFor.load();
+                if (!w) break;
+                t = blackholeOwner(*w);
+                if (t == &evalThread) throw EvalAbandoned();
+            }
+        }
+
+        /* A value that stays blackholed without an owner was claimed
+           before forceParallel() started, i.e. by this thread's
+           caller or by a thread that is not taking part. */
+        else if (++spins > 100000)
+            throw EvalAbandoned();
+
+        evalThread.waitingFor = &v;
+        std::this_thread::yield();
+        evalThread.waitingFor = nullptr;
+    }
+}
+
+
+#if HAVE_BOEHMGC
+/* Registers threads started by forceParallel() with the garbage
+   collector. */
+struct GCThread
+{
+    bool registered = false;
+
+    void ensureRegistered()
+    {
+        if (registered) return;
+        struct GC_stack_base sb;
+        if (GC_get_stack_base(&sb) != GC_SUCCESS)
+            throw Error("cannot determine the stack of an evaluator thread");
+        registered = GC_register_my_thread(&sb) == GC_SUCCESS;
+    }
+
+    ~GCThread()
+    {
+        if (registered) GC_unregister_my_thread();
+    }
+};
+
+static thread_local GCThread gcThread;
+#endif
+
+
+void initEvalThread()
+{
+#if HAVE_BOEHMGC
+    static std::once_flag allowThreads;
+    std::call_once(allowThreads, []() { GC_allow_register_threads(); });
+    gcThread.ensureRegistered();
+#endif
+}
+
+
+void EvalState::deferRealisation(const PathSet & drvs)
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingIFDLock);
+        pendingIFD.insert(drvs.begin(), drvs.end());
+    }
+    throw EvalDeferred();
+}
+
+
+void EvalState::forceParallel(size_t n, std::function<void(size_t)> work)
+{
+    size_t cores = evalSettings.evalCores;
+    if (!cores) cores = std::thread::hardware_concurrency();
+    bool batch = evalSettings.batchIFD && evalSettings.enableImportFromDerivation;
+    if ((cores <= 1 && !batch) || n <= 1 || parallel || deferIFD) return;
+
+    initEvalThread();
+
+    debug("evaluating %d items on %d threads", n, cores);
+
+    std::vector<size_t> items(n), deferred;
+    for (size_t i = 0; i < n; ++i) items[i] = i;
+    std::mutex deferredLock;
+
+    auto runItem = [&](size_t i) {
+        try {
+            work(i);
+        } catch (EvalDeferred &) {
+            std::lock_guard<std::mutex> lock(deferredLock);
+            deferred.push_back(i);
+        } catch (EvalAbandoned &) {
+        } catch (Error &) {
+            /* The sequential pass will evaluate the item again and
+               report the error. */
+        }
+    };
+
+    deferIFD = batch;
+    Finally resetDeferIFD([&]() { deferIFD = false; });
+
+    while (true) {
+
+        if (cores > 1) {
+            ThreadPool pool(cores);
+
+            parallel = true;
+            Finally resetParallel([&]() { parallel = false; });
+
+            for (auto i : items)
+                pool.enqueue([&, i]() {
+                    initEvalThread();
+                    runItem(i);
+                });
+
+            pool.process();
+        } else
+            for (auto i : items) runItem(i);
+
+        if (pendingIFD.empty()) break;
+
+        /* Build everything that the deferred items need in one go,
+           and retry them, since they may need further builds. */
+        PathSet drvs;
+        std::swap(drvs, pendingIFD);
+        printInfo("building %d paths needed by imports from derivations", drvs.size());
+        try {
+            flushTexts();
+            store->buildPaths(drvs);
+        } catch (Error & e) {
+            /* Leave it to the sequential pass to report the failure. */
+            debug("batched import from derivation failed: %s", e.what());
+            break;
+        }
+
+        std::swap(items, deferred);
+        deferred.clear();
+    }
+}
+
+
 NixInt EvalState::forceInt(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
@@ -1510,7 +2922,7 @@ void EvalState::forceFunction(Value & v, const Pos & pos)
 }
 
 
-string EvalState::forceString(Value & v, const Pos & pos)
+std::string_view EvalState::forceStringView(Value & v, const Pos & pos)
 {
     forceValue(v, pos);
     if (v.type != tString) {
@@ -1519,7 +2931,13 @@ string EvalState::forceString(Value & v, const Pos & pos)
         else
             throwTypeError("value is %1% while a string was expected", v);
     }
-    return string(v.string.s);
+    return v.string.s;
+}
+
+
+string EvalState::forceString(Value & v, const Pos & pos)
+{
+    return string(forceStringView(v, pos));
 }
 
 
@@ -1630,18 +3048,44 @@ string EvalState::copyPathToStore(PathSet & context, const Path & path)
     if (nix::isDerivation(path))
         throwEvalError("file names are not allowed to end in '%1%'", drvExtension);
 
+    PhaseTimer timer(EvalPhase::CopyPathToStore);
+
     Path dstPath;
-    if (srcToStore[path] != "")
-        dstPath = srcToStore[path];
-    else {
-        dstPath = settings.readOnlyMode
-            ? store->computeStorePathForPath(baseNameOf(path), checkSourcePath(path)).first
-            : store->addToStore(baseNameOf(path), checkSourcePath(path), true, htSHA256, defaultPathFilter, repair);
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        auto i = srcToStore.find(path);
+        if (i != srcToStore.end()) dstPath = i->second;
+    }
+    if (dstPath == "") {
+        Path srcPath = checkSourcePath(path);
+
+        /* Check whether we copied this source tree before in a
+           previous evaluation. */
+        auto sourceCache = getSourceCache();
+        std::string fingerprint;
+        if (sourceCache && !repair) {
+            fingerprint = baseNameOf(path) + ":" + fingerprintSourceTree(*this, srcPath);
+            auto storePath = sourceCache->lookupSource(*this, srcPath, fingerprint);
+            if (storePath && (settings.readOnlyMode || store->isValidPath(*storePath)))
+                dstPath = *storePath;
+        }
+
+        if (dstPath == "") {
+            dstPath = settings.readOnlyMode
+                ? store->computeStorePathForPath(baseNameOf(path), srcPath).first
+                : store->addToStore(baseNameOf(path), srcPath, true, htSHA256, defaultPathFilter, repair);
+            if (sourceCache && !repair)
+                sourceCache->insertSource(*this, srcPath, fingerprint, dstPath);
+        }
+
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
         srcToStore[path] = dstPath;
         printMsg(lvlChatty, format("copied source '%1%' -> '%2%'")
             % path % dstPath);
     }
 
+    addEvalInput("path", path, [&]() { return dstPath; });
+
     context.insert(dstPath);
     return dstPath;
 }
@@ -1740,11 +3184,21 @@ bool EvalState::eqValues(Value & v1, Value & v2)
 
 void EvalState::printStats()
 {
-    bool showStats = getEnv("NIX_SHOW_STATS", "0") != "0";
+    if (profiler) profiler->write();
+
+    bool showStats = getEnv("NIX_SHOW_STATS", "0") != "0" || evalSettings.evalStatsFile != "";
+
+    chargePhase();
 
     struct rusage buf;
     getrusage(RUSAGE_SELF, &buf);
     float cpuTime = buf.ru_utime.tv_sec + ((float) buf.ru_utime.tv_usec / 1000000);
+    float sysTime = buf.ru_stime.tv_sec + ((float) buf.ru_stime.tv_usec / 1000000);
+#if __APPLE__
+    uint64_t peakRSS = buf.ru_maxrss;
+#else
+    uint64_t peakRSS = (uint64_t) buf.ru_maxrss * 1024;
+#endif
 
     uint64_t bEnvs = nrEnvs * sizeof(Env) + nrValuesInEnvs * sizeof(Value *);
     uint64_t bLists = nrListElems * sizeof(Value *);
@@ -1756,27 +3210,41 @@ void EvalState::printStats()
     GC_get_heap_usage_safe(&heapSize, 0, 0, 0, &totalBytes);
 #endif
     if (showStats) {
-        auto outPath = getEnv("NIX_SHOW_STATS_PATH","-");
+        auto outPath = evalSettings.evalStatsFile != ""
+            ? evalSettings.evalStatsFile.get()
+            : getEnv("NIX_SHOW_STATS_PATH","-");
         std::fstream fs;
         if (outPath != "-")
             fs.open(outPath, std::fstream::out);
         JSONObject topObj(outPath == "-" ? std::cerr : fs, true);
         topObj.attr("cpuTime",cpuTime);
+        topObj.attr("sysTime", sysTime);
+        topObj.attr("peakRSS", peakRSS);
+        {
+            auto phases = topObj.object("phases");
+            for (size_t n = 0; n < (size_t) EvalPhase::Count; ++n) {
+                auto phase = phases.object(phaseNames[n]);
+                phase.attr("count", phaseStats[n].count.load());
+                phase.attr("wallTime", phaseStats[n].wallTime / 1e9);
+                phase.attr("cpuTime", phaseStats[n].cpuTime / 1e9);
+            }
+        }
         {
             auto envs = topObj.object("envs");
-            envs.attr("number", nrEnvs);
-            envs.attr("elements", nrValuesInEnvs);
+            envs.attr("number", nrEnvs.load());
+            envs.attr("elements", nrValuesInEnvs.load());
             envs.attr("bytes", bEnvs);
         }
         {
             auto lists = topObj.object("list");
-            lists.attr("elements", nrListElems);
+            lists.attr("elements", nrListElems.load());
             lists.attr("bytes", bLists);
-            lists.attr("concats", nrListConcats);
+            lists.attr("concats", nrListConcats.load());
+            lists.attr("extended", nrListsExtended.load());
         }
         {
             auto values = topObj.object("values");
-            values.attr("number", nrValues);
+            values.attr("number", nrValues.load());
             values.attr("bytes", bValues);
         }
         {
@@ -1786,9 +3254,9 @@ void EvalState::printStats()
         }
         {
             auto sets = topObj.object("sets");
-            sets.attr("number", nrAttrsets);
+            sets.attr("number", nrAttrsets.load());
             sets.attr("bytes", bAttrsets);
-            sets.attr("elements", nrAttrsInAttrsets);
+            sets.attr("elements", nrAttrsInAttrsets.load());
         }
         {
             auto sizes = topObj.object("sizes");
@@ -1797,18 +3265,41 @@ void EvalState::printStats()
             sizes.attr("Bindings", sizeof(Bindings));
             sizes.attr("Attr", sizeof(Attr));
         }
-        topObj.attr("nrOpUpdates", nrOpUpdates);
-        topObj.attr("nrOpUpdateValuesCopied", nrOpUpdateValuesCopied);
-        topObj.attr("nrThunks", nrThunks);
-        topObj.attr("nrAvoided", nrAvoided);
-        topObj.attr("nrLookups", nrLookups);
-        topObj.attr("nrPrimOpCalls", nrPrimOpCalls);
-        topObj.attr("nrFunctionCalls", nrFunctionCalls);
+        topObj.attr("nrOpUpdates", nrOpUpdates.load());
+        topObj.attr("nrOpUpdateValuesCopied", nrOpUpdateValuesCopied.load());
+        topObj.attr("nrThunks", nrThunks.load());
+        topObj.attr("nrAvoided", nrAvoided.load());
+        topObj.attr("nrLookups", nrLookups.load());
+        topObj.attr("nrPrimOpCalls", nrPrimOpCalls.load());
+        topObj.attr("nrFunctionCalls", nrFunctionCalls.load());
+        topObj.attr("nrContextSets", nrContextSets.load());
+        if (nrMemoHits || nrMemoMisses) {
+            auto memo = topObj.object("memoise");
+            memo.attr("hits", nrMemoHits.load());
+            memo.attr("misses", nrMemoMisses.load());
+            memo.attr("entries", memoCache.size());
+        }
+        if (evalSettings.useBytecode) {
+            auto bc = topObj.object("bytecode");
+            bc.attr("programs", nrBytecodePrograms.load());
+            bc.attr("instructions", nrBytecodeInstrs.load());
+            bc.attr("executed", nrBytecodeOps.load());
+        }
+        {
+            auto alloc = topObj.object("allocator");
+            alloc.attr("kind", useArena ? "arena" : "gc");
+            alloc.attr("arenaChunks", nrArenaChunks.load());
+            alloc.attr("arenaBytes", nrArenaBytes.load());
+            alloc.attr("poolRefills", nrPoolRefills.load());
+        }
 #if HAVE_BOEHMGC
         {
             auto gc = topObj.object("gc");
             gc.attr("heapSize", heapSize);
             gc.attr("totalBytes", totalBytes);
+            gc.attr("collections", nrGCs.load());
+            gc.attr("pauseTime", gcPauseTime / 1e9);
+            gc.attr("maxPause", gcMaxPause / 1e9);
         }
 #endif
 
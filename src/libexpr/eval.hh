@@ -6,8 +6,11 @@
 #include "symbol-table.hh"
 #include "hash.hh"
 #include "config.hh"
+#include "eval-profiler.hh"
 
 #include <map>
+#include <mutex>
+#include <atomic>
 #include <unordered_map>
 
 
@@ -15,7 +18,10 @@ namespace nix {
 
 
 class Store;
+struct StoreText;
 class EvalState;
+struct Preparser;
+struct Prefetcher;
 enum RepairFlag : bool;
 
 
@@ -46,6 +52,16 @@ Value & mkString(Value & v, const string & s, const PathSet & context = PathSet(
 
 void copyContext(const Value & v, PathSet & context);
 
+/* String contexts are hash-consed: every distinct set of context
+   elements is represented by a single, immutable, null-terminated
+   array that is never freed.  So two strings have the same context
+   iff their context pointers are equal. */
+const char * * internContext(const PathSet & context);
+
+/* Return the interned union of two interned contexts (either of which
+   may be null). */
+const char * * unionContexts(const char * * c1, const char * * c2);
+
 
 /* Cache for calls to addToStore(); maps source paths to the store
    paths. */
@@ -62,6 +78,35 @@ typedef std::list<SearchPathElem> SearchPath;
 /* Initialise the Boehm GC, if applicable. */
 void initGC();
 
+/* Prepare the calling thread for evaluation (i.e. register it with
+   the garbage collector).  Must be called first on the main thread. */
+void initEvalThread();
+
+
+/* Phases of evaluation for which NIX_SHOW_STATS reports timings. */
+enum class EvalPhase
+{
+    Eval,
+    Parse,
+    BindVars,
+    DerivationStrict,
+    WriteDerivation,
+    CopyPathToStore,
+    Count
+};
+
+
+/* Charge the wall and CPU time of the current thread to `phase' for
+   the lifetime of this object.  Phases nest: time spent in an inner
+   phase is not charged to the outer one. */
+class PhaseTimer
+{
+    EvalPhase prev;
+public:
+    PhaseTimer(EvalPhase phase);
+    ~PhaseTimer();
+};
+
 
 class EvalState
 {
@@ -85,9 +130,22 @@ public:
 
     Value vEmptySet;
 
-    const ref<Store> store;
+    /* Shared immutable values for Booleans, null and small integers.
+       Environments, lists and attribute sets can point to these
+       rather than to freshly allocated values, just like
+       ExprInt::maybeThunk() returns the value stored in the parse
+       tree.  They must never be overwritten. */
+    Value vTrue, vFalse, vNull;
+    static const NixInt nrSmallInts = 256;
+    Value smallInts[nrSmallInts];
+
+    /* Only replaced in the child process of evalInChild(). */
+    ref<Store> store;
 
 private:
+    /* Guards the caches below during parallel evaluation. */
+    std::recursive_mutex cacheMutex;
+
     SrcToStore srcToStore;
 
     /* A cache from path names to parse trees. */
@@ -106,12 +164,59 @@ private:
 #endif
     FileEvalCache fileEvalCache;
 
+    /* A cache of the results of builtins.memoise, keyed on the
+       identity of the function and a hash of its argument.  Since
+       the key identifies some objects (such as closures) by address,
+       each entry holds on to the function and the argument, so that
+       those objects can't be freed and their addresses reused. */
+    struct MemoEntry
+    {
+        Value fun, arg, result;
+    };
+#if HAVE_BOEHMGC
+    typedef std::unordered_map<std::string, MemoEntry, std::hash<std::string>, std::equal_to<std::string>,
+        traceable_allocator<std::pair<const std::string, MemoEntry> > > MemoCache;
+#else
+    typedef std::unordered_map<std::string, MemoEntry> MemoCache;
+#endif
+    MemoCache memoCache;
+
+    /* A cache of the results of builtins.readDir, together with the
+       identity and modification times of the directories when they
+       were read. */
+    struct ReadDirEntry
+    {
+        uint64_t dev, ino;
+        int64_t mtime, ctime; // in nanoseconds
+        Value v;
+    };
+#if HAVE_BOEHMGC
+    typedef std::map<Path, ReadDirEntry, std::less<Path>, traceable_allocator<std::pair<const Path, ReadDirEntry> > > ReadDirCache;
+#else
+    typedef std::map<Path, ReadDirEntry> ReadDirCache;
+#endif
+    ReadDirCache readDirCache;
+
     SearchPath searchPath;
 
     std::map<std::string, std::pair<bool, std::string>> searchPathResolved;
 
-    /* Cache used by checkSourcePath(). */
-    std::unordered_map<Path, Path> resolvedPaths;
+    /* Caches used by checkSourcePath(), mapping paths and the
+       directories containing them to their symlink-free forms. */
+    std::unordered_map<Path, Path> resolvedPaths, resolvedDirs;
+
+    Path resolveSymlinks(const Path & path, bool cache);
+
+    bool isAllowedPath(const Path & path);
+
+    /* The inputs read during evaluation, mapped to their fingerprints
+       (see eval-cache.hh).  Only maintained if the evaluation cache is
+       enabled or `trackEvalInputs' is set. */
+    std::map<string, string> evalInputs;
+
+    /* Whether evaluation has done something that cannot be captured
+       by `evalInputs'. */
+    bool evalImpure = false;
 
 public:
 
@@ -126,6 +231,25 @@ public:
 
     void checkURI(const std::string & uri);
 
+    /* Record that evaluation has read the input `arg' of the given
+       kind ("file", "dir", "exists", "path" or "env"), so that cached
+       results depending on it are invalidated when it changes.
+       Paths in the Nix store are immutable and are not recorded.  The
+       fingerprint is only computed if the evaluation cache is
+       enabled. */
+    void addEvalInput(const string & kind, const string & arg,
+        std::function<string()> fingerprint = {});
+
+    void addEvalInputs(const std::map<string, string> & inputs);
+
+    /* Record that evaluation has done something that cannot be
+       captured by its inputs, e.g. fetching a URL without a hash. */
+    void markEvalImpure();
+
+    /* Return the inputs recorded so far, or nothing if evaluation was
+       impure. */
+    std::optional<std::map<string, string>> getEvalInputs();
+
     /* When using a diverted store and 'path' is in the Nix store, map
        'path' to the diverted location (e.g. /nix/store/foo is mapped
        to /home/alice/my-nix/nix/store/foo). However, this is only
@@ -174,6 +298,69 @@ public:
        result.  Otherwise, this is a no-op. */
     inline void forceValue(Value & v, const Pos & pos = noPos);
 
+    /* Call `work(0)' ... `work(n - 1)' on up to `eval-cores' threads
+       (including the calling thread), with the thunk blackholing
+       protocol made safe for concurrent forcing. This is intended to
+       evaluate independent values ahead of a sequential pass over
+       them, so exceptions are discarded: a thunk whose evaluation
+       fails reverts to its unevaluated state, and will throw again
+       when the sequential pass forces it. Work items that would
+       deadlock on a value being forced by another thread are
+       abandoned in the same way. */
+    void forceParallel(size_t n, std::function<void(size_t)> work);
+
+    /* Run `fun' in a child process that has a copy-on-write snapshot
+       of this state, and return the string it returns.  Nothing that
+       the child forces or records (such as evaluation inputs, which
+       it always tracks) affects this state.  The child opens its own
+       connection to the store, since it can't share a database or
+       daemon connection with this process.  This state must not be
+       forcing values on other threads. */
+    std::string evalInChild(std::function<std::string()> fun);
+
+    /* Called by realiseContext() when it needs to build `drvs' while
+       forceParallel() is collecting imports from derivations (see
+       'eval-batch-ifd'): records the paths and abandons the current
+       work item, which will be retried once they have been built. */
+    [[noreturn]] void deferRealisation(const PathSet & drvs);
+
+    /* Whether realiseContext() should defer builds. */
+    bool deferIFD = false;
+
+    /* Whether addTextToStore() should only compute the paths of the
+       texts, leaving it to flushTexts() to add them to the store in
+       bulk. This is meant for commands that instantiate many
+       derivations; they must call flushTexts() before they use the
+       resulting store paths. */
+    bool batchTexts = false;
+
+    /* Whether addEvalInput() should record inputs even if the
+       evaluation cache is disabled, for callers that check them
+       themselves (such as the evaluation server). */
+    bool trackEvalInputs = false;
+
+    /* Add a text, i.e. a store derivation or the result of
+       builtins.toFile, to the store, or just compute its path in
+       read-only mode. */
+    Path addTextToStore(const string & name, const string & contents,
+        const PathSet & references);
+
+    /* Add the texts batched by addTextToStore() to the store. The
+       evaluator does this itself before anything that can observe
+       their validity, such as importing from a derivation. */
+    void flushTexts();
+
+    /* Run `fetch' in the background, unless a prefetch with the same
+       key was started before or prefetching is disabled. The fetch
+       should only fill the caches that the corresponding primop call
+       would use, so that the call itself is cheap. */
+    void prefetch(const string & key, std::function<void()> fetch);
+
+    /* Wait for the prefetch with key `key' to finish, if one was
+       started. Its errors are ignored: the caller fetches again to
+       get them. */
+    void waitForPrefetch(const string & key);
+
     /* Force a value, then recursively force list elements and
        attributes. */
     void forceValueDeep(Value & v);
@@ -188,6 +375,9 @@ public:
     inline void forceList(Value & v, const Pos & pos);
     void forceFunction(Value & v, const Pos & pos); // either lambda or primop
     string forceString(Value & v, const Pos & pos = noPos);
+    /* Like forceString(), but without copying the string, which stays
+       valid as long as `v'. */
+    std::string_view forceStringView(Value & v, const Pos & pos = noPos);
     string forceString(Value & v, PathSet & context, const Pos & pos = noPos);
     string forceStringNoCtx(Value & v, const Pos & pos = noPos);
 
@@ -237,12 +427,32 @@ private:
 
     inline Value * lookupVar(Env * env, const ExprVar & var, bool noEval);
 
+    /* Whether forceParallel() is running. */
+    bool parallel = false;
+
+    /* Derivations whose realisation was deferred by
+       deferRealisation(). */
+    std::mutex pendingIFDLock;
+    PathSet pendingIFD;
+
+    /* Texts batched by addTextToStore(), in the order in which they
+       were created, so references come before their referrers. The
+       lock is held while they're flushed. */
+    std::mutex pendingTextsLock;
+    std::vector<StoreText> pendingTexts;
+    PathSet pendingTextPaths;
+
+    void forceValueParallel(Value & v, const Pos & pos);
+
     friend struct ExprVar;
     friend struct ExprAttrs;
     friend struct ExprLet;
 
+    /* Parse `text'.  If `useCache' is set, `text' is the contents of
+       the file `path', so its parse tree can be stored in or loaded
+       from the AST cache. */
     Expr * parse(const char * text, const Path & path,
-        const Path & basePath, StaticEnv & staticEnv);
+        const Path & basePath, StaticEnv & staticEnv, bool useCache = false);
 
 public:
 
@@ -255,6 +465,14 @@ public:
     void callFunction(Value & fun, Value & arg, Value & v, const Pos & pos);
     void callPrimOp(Value & fun, Value & arg, Value & v, const Pos & pos);
 
+    /* Call a primop with all its arguments. */
+    void callPrimOp(PrimOp & primOp, Value * * args, Value & v, const Pos & pos);
+
+    /* Like callFunction(), but first evaluate `arg' deeply and look up
+       the result of a previous call of `fun' with a structurally
+       equal argument (builtins.memoise). */
+    void callMemoised(Value & fun, Value & arg, Value & v, const Pos & pos);
+
     /* Automatically call a function for which each argument has a
        default value or has a binding in the `args' map. */
     void autoCallFunction(Bindings & args, Value & fun, Value & res);
@@ -263,6 +481,37 @@ public:
     Value * allocValue();
     Env & allocEnv(size_t size);
 
+    /* Return a value equal to `v' (which must not be a thunk), shared
+       if it's a Boolean, null or a small integer. */
+    Value * shareValue(const Value & v)
+    {
+        switch (v.type) {
+            case tBool: return v.boolean ? &vTrue : &vFalse;
+            case tNull: return &vNull;
+            case tInt:
+                if (v.integer >= 0 && v.integer < nrSmallInts)
+                    return &smallInts[v.integer];
+                break;
+            default: break;
+        }
+        auto v2 = allocValue();
+        *v2 = v;
+        return v2;
+    }
+
+    Value * boolValue(bool b)
+    {
+        return b ? &vTrue : &vFalse;
+    }
+
+    Value * intValue(NixInt n)
+    {
+        if (n >= 0 && n < nrSmallInts) return &smallInts[n];
+        auto v = allocValue();
+        mkInt(*v, n);
+        return v;
+    }
+
     Value * allocAttr(Value & vAttrs, const Symbol & name);
 
     Bindings * allocBindings(size_t capacity);
@@ -274,24 +523,35 @@ public:
 
     void concatLists(Value & v, size_t nrLists, Value * * lists, const Pos & pos);
 
+    /* Compute `v1 // v2'. Both values must be sets. */
+    void updateAttrs(Value & v1, Value & v2, Value & v);
+
     /* Print statistics. */
     void printStats();
 
     void realiseContext(const PathSet & context);
 
+    /* Return the entries of the directory `path' and their types as
+       an attribute set, as builtins.readDir does. Directories that
+       haven't changed since they were last read aren't read again. */
+    void readDirCached(const Path & path, Value & v);
+
 private:
 
-    unsigned long nrEnvs = 0;
-    unsigned long nrValuesInEnvs = 0;
-    unsigned long nrValues = 0;
-    unsigned long nrListElems = 0;
-    unsigned long nrAttrsets = 0;
-    unsigned long nrAttrsInAttrsets = 0;
-    unsigned long nrOpUpdates = 0;
-    unsigned long nrOpUpdateValuesCopied = 0;
-    unsigned long nrListConcats = 0;
-    unsigned long nrPrimOpCalls = 0;
-    unsigned long nrFunctionCalls = 0;
+    Counter nrEnvs;
+    Counter nrValuesInEnvs;
+    Counter nrValues;
+    Counter nrListElems;
+    Counter nrAttrsets;
+    Counter nrAttrsInAttrsets;
+    Counter nrOpUpdates;
+    Counter nrOpUpdateValuesCopied;
+    Counter nrListConcats;
+    Counter nrListsExtended;
+    Counter nrPrimOpCalls;
+    Counter nrFunctionCalls;
+    Counter nrMemoHits;
+    Counter nrMemoMisses;
 
     bool countCalls;
 
@@ -303,6 +563,29 @@ private:
 
     void incrFunctionCall(ExprLambda * fun);
 
+    std::unique_ptr<EvalProfiler> profiler;
+
+    /* Parses files referenced by path literals in the background (see
+       'eval-preparse-threads'). */
+    std::unique_ptr<Preparser> preparser;
+    friend struct Preparser;
+
+    /* Queue the file denoted by the path literal `path' for parsing
+       by the preparser. */
+    void preparseFile(const Path & path);
+
+    /* Runs the fetches of fetch calls with constant arguments in the
+       background (see 'eval-prefetch-threads'). */
+    std::unique_ptr<Prefetcher> prefetcher;
+    friend struct Prefetcher;
+
+    /* Start prefetching for a call to the fetch primop `fun' (the
+       name of the builtin) with the constant string arguments `args',
+       found by the parser. */
+    void prefetchCall(const string & fun, const std::map<string, string> & args);
+
+    void evalProfiled(ExprLambda & lambda, Env & env, Value & v, const Pos & pos);
+
     typedef std::map<Pos, size_t> AttrSelects;
     AttrSelects attrSelects;
 
@@ -349,6 +632,76 @@ struct EvalSettings : Config
 
     Setting<Strings> allowedUris{this, {}, "allowed-uris",
         "Prefixes of URIs that builtin functions such as fetchurl and fetchGit are allowed to fetch."};
+
+    Setting<unsigned int> evalCores{this, 1, "eval-cores",
+        "Number of threads used to evaluate independent attributes in "
+        "parallel, e.g. in 'nix-env -qa'. 0 means the number of CPUs."};
+
+    Setting<unsigned int> preparseThreads{this, 0, "eval-preparse-threads",
+        "Number of threads used to parse the Nix files referenced by path "
+        "literals (such as 'import ./foo.nix') in the background, ahead "
+        "of their evaluation. 0 disables this."};
+
+    Setting<unsigned int> maxTailCalls{this, 10000000, "max-tail-calls",
+        "Maximum number of calls in tail position that a function call may "
+        "make in a row (such as the iterations of a tail-recursive function) "
+        "before evaluation fails with a stack overflow error."};
+
+    Setting<bool> useBytecode{this, false, "eval-bytecode",
+        "Whether to compile parsed expressions into bytecode and evaluate "
+        "them using the bytecode interpreter rather than the tree walker."};
+
+    Setting<bool> evalCache{this, false, "eval-cache",
+        "Whether to cache the results of evaluating attribute paths (such as "
+        "derivation paths and package metadata) in ~/.cache/nix, keyed on the "
+        "source files and environment variables read by the evaluation."};
+
+    Setting<bool> evalServer{this, false, "eval-server",
+        "Whether nix-instantiate should send requests to instantiate "
+        "attributes to the user's evaluation server ('nix eval-server'), if "
+        "it's running, which keeps evaluated files in memory between requests."};
+
+    Setting<bool> sourceCache{this, false, "eval-source-cache",
+        "Whether to remember in ~/.cache/nix the store paths to which source "
+        "trees were copied during evaluation, so that unchanged trees (as "
+        "determined from their files' metadata) don't need to be re-hashed."};
+
+    Setting<std::string> evalAllocator{this, "gc", "eval-allocator",
+        "How to allocate values and environments: 'gc' to use the garbage "
+        "collector, or 'arena' to use a faster bump allocator that never "
+        "frees memory, which is suitable for short-lived evaluations."};
+
+    Setting<bool> batchIFD{this, false, "eval-batch-ifd",
+        "Whether commands that evaluate many independent attributes (such as "
+        "'nix-env -qa') should first collect the derivations needed by "
+        "imports from derivations in all attributes, and build them in a "
+        "single parallel batch, rather than one by one as evaluation "
+        "reaches them."};
+
+    Setting<bool> astCache{this, false, "ast-cache",
+        "Whether to cache the parse trees of Nix expression files in "
+        "~/.cache/nix, to avoid re-parsing files that haven't changed."};
+
+    Setting<Path> evalStatsFile{this, "", "eval-stats-file",
+        "If set, evaluation statistics (as shown by NIX_SHOW_STATS) are "
+        "written to this file in JSON format."};
+
+    Setting<Path> evalProfileFile{this, "", "eval-profile-file",
+        "If set, the evaluator records the time spent in each Nix call stack "
+        "and writes it to this file in the collapsed stack format used by "
+        "flamegraph.pl and speedscope."};
+
+    Setting<unsigned int> prefetchThreads{this, 0, "eval-prefetch-threads",
+        "Number of threads used to start the downloads of calls to 'fetchurl', "
+        "'fetchTarball' and 'fetchGit' (with a 'rev') whose arguments are "
+        "string literals as soon as the file containing them is parsed, "
+        "so that independent downloads overlap. 0 disables this. Not "
+        "supported in restricted and pure evaluation mode."};
+
+    Setting<unsigned int> writeBatchSize{this, 10000, "eval-write-batch-size",
+        "Maximum number of store derivations and 'builtins.toFile' results "
+        "that commands such as 'nix-instantiate' collect during evaluation "
+        "to add them to the store in a single operation. 0 disables this."};
 };
 
 extern EvalSettings evalSettings;
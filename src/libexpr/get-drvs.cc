@@ -264,11 +264,11 @@ typedef set<Bindings *> Done;
 
 
 /* Evaluate value `v'.  If it evaluates to a set of type `derivation',
-   then put information about it in `drvs' (unless it's already in `done').
-   The result boolean indicates whether it makes sense
+   then pass information about it to `callback' (unless it's already in
+   `done').  The result boolean indicates whether it makes sense
    for the caller to recursively search for derivations in `v'. */
 static bool getDerivation(EvalState & state, Value & v,
-    const string & attrPath, DrvInfos & drvs, Done & done,
+    const string & attrPath, const DrvCallback & callback, Done & done,
     bool ignoreAssertionFailures)
 {
     try {
@@ -284,7 +284,7 @@ static bool getDerivation(EvalState & state, Value & v,
 
         drv.queryName();
 
-        drvs.push_back(drv);
+        callback(std::move(drv));
 
         return false;
 
@@ -300,7 +300,8 @@ std::optional<DrvInfo> getDerivation(EvalState & state, Value & v,
 {
     Done done;
     DrvInfos drvs;
-    getDerivation(state, v, "", drvs, done, ignoreAssertionFailures);
+    getDerivation(state, v, "", [&](DrvInfo && drv) { drvs.push_back(std::move(drv)); },
+        done, ignoreAssertionFailures);
     if (drvs.size() != 1) return {};
     return std::move(drvs.front());
 }
@@ -317,14 +318,14 @@ static std::regex attrRegex("[A-Za-z_][A-Za-z0-9-_+]*");
 
 static void getDerivations(EvalState & state, Value & vIn,
     const string & pathPrefix, Bindings & autoArgs,
-    DrvInfos & drvs, Done & done,
+    const DrvCallback & callback, Done & done,
     bool ignoreAssertionFailures)
 {
     Value v;
     state.autoCallFunction(autoArgs, vIn, v);
 
     /* Process the expression. */
-    if (!getDerivation(state, v, pathPrefix, drvs, done, ignoreAssertionFailures)) ;
+    if (!getDerivation(state, v, pathPrefix, callback, done, ignoreAssertionFailures)) ;
 
     else if (v.type == tAttrs) {
 
@@ -332,6 +333,23 @@ static void getDerivations(EvalState & state, Value & vIn,
            nix-env.cc. */
         bool combineChannels = v.attrs->find(state.symbols.create("_combineChannels")) != v.attrs->end();
 
+        /* Evaluate the attributes in parallel, if enabled, so that
+           the sequential pass below finds them evaluated. */
+        std::vector<Value *> values;
+        for (auto & i : *v.attrs)
+            if (std::regex_match(std::string(i.name), attrRegex))
+                values.push_back(i.value);
+        state.forceParallel(values.size(), [&](size_t n) {
+            Value & v(*values[n]);
+            state.forceValue(v);
+            if (state.isDerivation(v)) {
+                auto j = v.attrs->find(state.sName);
+                if (j != v.attrs->end()) state.forceValue(*j->value);
+                j = v.attrs->find(state.sMeta);
+                if (j != v.attrs->end()) state.forceValue(*j->value);
+            }
+        });
+
         /* Consider the attributes in sorted order to get more
            deterministic behaviour in nix-env operations (e.g. when
            there are names clashes between derivations, the derivation
@@ -343,15 +361,15 @@ static void getDerivations(EvalState & state, Value & vIn,
                 continue;
             string pathPrefix2 = addToPath(pathPrefix, i->name);
             if (combineChannels)
-                getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
-            else if (getDerivation(state, *i->value, pathPrefix2, drvs, done, ignoreAssertionFailures)) {
+                getDerivations(state, *i->value, pathPrefix2, autoArgs, callback, done, ignoreAssertionFailures);
+            else if (getDerivation(state, *i->value, pathPrefix2, callback, done, ignoreAssertionFailures)) {
                 /* If the value of this attribute is itself a set,
                    should we recurse into it?  => Only if it has a
                    `recurseForDerivations = true' attribute. */
                 if (i->value->type == tAttrs) {
                     Bindings::iterator j = i->value->attrs->find(state.symbols.create("recurseForDerivations"));
                     if (j != i->value->attrs->end() && state.forceBool(*j->value, *j->pos))
-                        getDerivations(state, *i->value, pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+                        getDerivations(state, *i->value, pathPrefix2, autoArgs, callback, done, ignoreAssertionFailures);
                 }
             }
         }
@@ -360,8 +378,8 @@ static void getDerivations(EvalState & state, Value & vIn,
     else if (v.isList()) {
         for (unsigned int n = 0; n < v.listSize(); ++n) {
             string pathPrefix2 = addToPath(pathPrefix, (format("%1%") % n).str());
-            if (getDerivation(state, *v.listElems()[n], pathPrefix2, drvs, done, ignoreAssertionFailures))
-                getDerivations(state, *v.listElems()[n], pathPrefix2, autoArgs, drvs, done, ignoreAssertionFailures);
+            if (getDerivation(state, *v.listElems()[n], pathPrefix2, callback, done, ignoreAssertionFailures))
+                getDerivations(state, *v.listElems()[n], pathPrefix2, autoArgs, callback, done, ignoreAssertionFailures);
         }
     }
 
@@ -370,10 +388,19 @@ static void getDerivations(EvalState & state, Value & vIn,
 
 
 void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
-    Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
+    Bindings & autoArgs, const DrvCallback & callback, bool ignoreAssertionFailures)
 {
     Done done;
-    getDerivations(state, v, pathPrefix, autoArgs, drvs, done, ignoreAssertionFailures);
+    getDerivations(state, v, pathPrefix, autoArgs, callback, done, ignoreAssertionFailures);
+}
+
+
+void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
+    Bindings & autoArgs, DrvInfos & drvs, bool ignoreAssertionFailures)
+{
+    getDerivations(state, v, pathPrefix, autoArgs,
+        [&](DrvInfo && drv) { drvs.push_back(std::move(drv)); },
+        ignoreAssertionFailures);
 }
 
 
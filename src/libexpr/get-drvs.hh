@@ -85,5 +85,15 @@ void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
     Bindings & autoArgs, DrvInfos & drvs,
     bool ignoreAssertionFailures);
 
+/* Like getDerivations(), but pass each derivation to `callback' as
+   soon as it's found (in the same order), rather than collecting them
+   all first.  This allows callers to process a large package set
+   incrementally. */
+typedef std::function<void(DrvInfo && drv)> DrvCallback;
+
+void getDerivations(EvalState & state, Value & v, const string & pathPrefix,
+    Bindings & autoArgs, const DrvCallback & callback,
+    bool ignoreAssertionFailures);
+
 
 }
@@ -1,148 +1,256 @@
 #include "json-to-value.hh"
 
+#include <charconv>
 #include <cstring>
+#include <string_view>
+#include <unordered_map>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace nix {
 
 
-static void skipWhitespace(const char * & s)
+static const char * copyString(std::string_view s)
 {
-    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
+#if HAVE_BOEHMGC
+    auto t = (char *) GC_MALLOC_ATOMIC(s.size() + 1);
+#else
+    auto t = (char *) malloc(s.size() + 1);
+#endif
+    if (!t) throw std::bad_alloc();
+    memcpy(t, s.data(), s.size());
+    t[s.size()] = 0;
+    return t;
 }
 
 
-static string parseJSONString(const char * & s)
+/* A single-pass JSON parser that produces Nix values directly.  The
+   hot loops (scanning strings and whitespace) avoid per-character
+   work where possible: string contents are located with SSE2 when
+   available and copied in one go, keys without escapes are looked up
+   in a per-parse cache before going to the symbol table, and the
+   elements of lists and sets are accumulated on shared stacks rather
+   than in per-container maps and vectors. */
+struct JSONParser
 {
-    string res;
-    if (*s++ != '"') throw JSONParseError("expected JSON string");
-    while (*s != '"') {
-        if (!*s) throw JSONParseError("got end-of-string in JSON string");
-        if (*s == '\\') {
-            s++;
-            if (*s == '"') res += '"';
-            else if (*s == '\\') res += '\\';
-            else if (*s == '/') res += '/';
-            else if (*s == '/') res += '/';
-            else if (*s == 'b') res += '\b';
-            else if (*s == 'f') res += '\f';
-            else if (*s == 'n') res += '\n';
-            else if (*s == 'r') res += '\r';
-            else if (*s == 't') res += '\t';
-            else if (*s == 'u') throw JSONParseError("\\u characters in JSON strings are currently not supported");
-            else throw JSONParseError("invalid escaped character in JSON string");
-            s++;
-        } else
-            res += *s++;
+    EvalState & state;
+    const char * s;
+
+    /* Elements of the lists and sets currently being parsed. */
+    ValueVector values;
+#if HAVE_BOEHMGC
+    std::vector<Attr, gc_allocator<Attr>> attrs;
+#else
+    std::vector<Attr> attrs;
+#endif
+
+    /* Symbols for keys seen so far.  The keys point into the input,
+       which outlives the parser. */
+    std::unordered_map<std::string_view, Symbol> keys;
+
+    std::string buf;
+
+    JSONParser(EvalState & state, const char * s) : state(state), s(s) { }
+
+    void skipWhitespace()
+    {
+        while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
     }
-    s++;
-    return res;
-}
 
+    /* Return a pointer to the first '"', '\\' or NUL at or after `p'. */
+    static const char * findSpecial(const char * p)
+    {
+#if __SSE2__
+        /* Don't read across a page boundary, since the string may
+           end on the current page. */
+        while (((uintptr_t) p & 4095) <= 4096 - 16) {
+            auto chunk = _mm_loadu_si128((const __m128i *) p);
+            auto mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(
+                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('"')),
+                _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\\'))),
+                _mm_cmpeq_epi8(chunk, _mm_setzero_si128())));
+            if (mask) return p + __builtin_ctz(mask);
+            p += 16;
+        }
+#endif
+        while (*p != '"' && *p != '\\' && *p) p++;
+        return p;
+    }
 
-static void parseJSON(EvalState & state, const char * & s, Value & v)
-{
-    skipWhitespace(s);
+    /* Parse a string.  If it contains no escapes, the result points
+       into the input; otherwise it points into `buf'. */
+    std::string_view parseString()
+    {
+        if (*s++ != '"') throw JSONParseError("expected JSON string");
 
-    if (!*s) throw JSONParseError("expected JSON value");
+        const char * start = s;
+        s = findSpecial(s);
+        if (*s == '"') return std::string_view(start, s++ - start);
 
-    if (*s == '[') {
+        buf.assign(start, s - start);
+        while (true) {
+            if (!*s) throw JSONParseError("got end-of-string in JSON string");
+            if (*s == '"') break;
+            if (*s == '\\') {
+                s++;
+                if (*s == '"') buf += '"';
+                else if (*s == '\\') buf += '\\';
+                else if (*s == '/') buf += '/';
+                else if (*s == 'b') buf += '\b';
+                else if (*s == 'f') buf += '\f';
+                else if (*s == 'n') buf += '\n';
+                else if (*s == 'r') buf += '\r';
+                else if (*s == 't') buf += '\t';
+                else if (*s == 'u') throw JSONParseError("\\u characters in JSON strings are currently not supported");
+                else throw JSONParseError("invalid escaped character in JSON string");
+                s++;
+            } else {
+                const char * p = findSpecial(s);
+                buf.append(s, p - s);
+                s = p;
+            }
+        }
         s++;
-        ValueVector values;
-        values.reserve(128);
-        skipWhitespace(s);
-        while (1) {
-            if (values.empty() && *s == ']') break;
-            Value * v2 = state.allocValue();
-            parseJSON(state, s, *v2);
-            values.push_back(v2);
-            skipWhitespace(s);
-            if (*s == ']') break;
-            if (*s != ',') throw JSONParseError("expected ',' or ']' after JSON array element");
+        return buf;
+    }
+
+    Symbol parseKey()
+    {
+        const char * start = s;
+        auto key = parseString();
+        if (key.data() != start + 1)
+            return state.symbols.create(key);
+        auto i = keys.find(key);
+        if (i != keys.end()) return i->second;
+        auto sym = state.symbols.create(key);
+        keys.emplace(key, sym);
+        return sym;
+    }
+
+    void parseNumber(Value & v)
+    {
+        const char * start = s;
+        bool isFloat = false;
+
+        while (isdigit(*s) || *s == '-' || *s == '+' || *s == '.' || *s == 'e' || *s == 'E') {
+            if (*s == '.' || *s == 'e' || *s == 'E') isFloat = true;
             s++;
         }
-        s++;
-        state.mkList(v, values.size());
-        for (size_t n = 0; n < values.size(); ++n)
-            v.listElems()[n] = values[n];
+
+        if (isFloat) {
+            char * end;
+            errno = 0;
+            double d = strtod(start, &end);
+            if (end != s) throw JSONParseError("invalid JSON number");
+            if (errno == ERANGE) throw JSONParseError("out-of-range JSON number");
+            mkFloat(v, d);
+        } else {
+            NixInt n;
+            auto res = std::from_chars(start, s, n);
+            if (res.ec == std::errc::result_out_of_range)
+                throw JSONParseError("out-of-range JSON number");
+            if (res.ec != std::errc() || res.ptr != s)
+                throw JSONParseError("invalid JSON number");
+            mkInt(v, n);
+        }
     }
 
-    else if (*s == '{') {
-        s++;
-        ValueMap attrs;
-        while (1) {
-            skipWhitespace(s);
-            if (attrs.empty() && *s == '}') break;
-            string name = parseJSONString(s);
-            skipWhitespace(s);
-            if (*s != ':') throw JSONParseError("expected ':' in JSON object");
+    void parse(Value & v)
+    {
+        skipWhitespace();
+
+        if (!*s) throw JSONParseError("expected JSON value");
+
+        if (*s == '[') {
             s++;
-            Value * v2 = state.allocValue();
-            parseJSON(state, s, *v2);
-            attrs[state.symbols.create(name)] = v2;
-            skipWhitespace(s);
-            if (*s == '}') break;
-            if (*s != ',') throw JSONParseError("expected ',' or '}' after JSON member");
+            size_t base = values.size();
+            skipWhitespace();
+            if (*s != ']')
+                while (1) {
+                    Value v2;
+                    parse(v2);
+                    values.push_back(state.shareValue(v2));
+                    skipWhitespace();
+                    if (*s == ']') break;
+                    if (*s != ',') throw JSONParseError("expected ',' or ']' after JSON array element");
+                    s++;
+                }
             s++;
+            state.mkList(v, values.size() - base);
+            std::copy(values.begin() + base, values.end(), v.listElems());
+            values.resize(base);
         }
-        state.mkAttrs(v, attrs.size());
-        for (auto & i : attrs)
-            v.attrs->push_back(Attr(i.first, i.second));
-        v.attrs->sort();
-        s++;
-    }
 
-    else if (*s == '"') {
-        mkString(v, parseJSONString(s));
-    }
+        else if (*s == '{') {
+            s++;
+            size_t base = attrs.size();
+            skipWhitespace();
+            if (*s != '}')
+                while (1) {
+                    skipWhitespace();
+                    auto name = parseKey();
+                    skipWhitespace();
+                    if (*s != ':') throw JSONParseError("expected ':' in JSON object");
+                    s++;
+                    Value v2;
+                    parse(v2);
+                    attrs.emplace_back(name, state.shareValue(v2));
+                    skipWhitespace();
+                    if (*s == '}') break;
+                    if (*s != ',') throw JSONParseError("expected ',' or '}' after JSON member");
+                    s++;
+                }
+            s++;
 
-    else if (isdigit(*s) || *s == '-' || *s == '.' ) {
-        // Buffer into a string first, then use built-in C++ conversions
-        std::string tmp_number;
-        ValueType number_type = tInt;
+            /* Sort the members, keeping only the last occurrence of
+               duplicate keys. */
+            auto first = attrs.begin() + base;
+            std::stable_sort(first, attrs.end());
+            size_t n = 0;
+            for (auto i = first; i != attrs.end(); ++i)
+                if (i + 1 == attrs.end() || i[1].name != i->name) n++;
+            state.mkAttrs(v, n);
+            for (auto i = first; i != attrs.end(); ++i)
+                if (i + 1 == attrs.end() || i[1].name != i->name)
+                    v.attrs->push_back(*i);
+            attrs.resize(base);
+        }
 
-        while (isdigit(*s) || *s == '-' || *s == '.' || *s == 'e' || *s == 'E') {
-            if (*s == '.' || *s == 'e' || *s == 'E')
-                number_type = tFloat;
-            tmp_number += *s++;
+        else if (*s == '"') {
+            mkStringNoCopy(v, copyString(parseString()));
         }
 
-        try {
-            if (number_type == tFloat)
-                mkFloat(v, stod(tmp_number));
-            else
-                mkInt(v, stol(tmp_number));
-        } catch (std::invalid_argument e) {
-            throw JSONParseError("invalid JSON number");
-        } catch (std::out_of_range e) {
-            throw JSONParseError("out-of-range JSON number");
+        else if (isdigit(*s) || *s == '-' || *s == '.')
+            parseNumber(v);
+
+        else if (strncmp(s, "true", 4) == 0) {
+            s += 4;
+            mkBool(v, true);
         }
-    }
 
-    else if (strncmp(s, "true", 4) == 0) {
-        s += 4;
-        mkBool(v, true);
-    }
+        else if (strncmp(s, "false", 5) == 0) {
+            s += 5;
+            mkBool(v, false);
+        }
 
-    else if (strncmp(s, "false", 5) == 0) {
-        s += 5;
-        mkBool(v, false);
-    }
+        else if (strncmp(s, "null", 4) == 0) {
+            s += 4;
+            mkNull(v);
+        }
 
-    else if (strncmp(s, "null", 4) == 0) {
-        s += 4;
-        mkNull(v);
+        else throw JSONParseError("unrecognised JSON value");
     }
-
-    else throw JSONParseError("unrecognised JSON value");
-}
+};
 
 
 void parseJSON(EvalState & state, const string & s_, Value & v)
 {
-    const char * s = s_.c_str();
-    parseJSON(state, s, v);
-    skipWhitespace(s);
-    if (*s) throw JSONParseError(format("expected end-of-string while parsing JSON value: %1%") % s);
+    JSONParser parser(state, s_.c_str());
+    parser.parse(v);
+    parser.skipWhitespace();
+    if (*parser.s) throw JSONParseError(format("expected end-of-string while parsing JSON value: %1%") % parser.s);
 }
 
 
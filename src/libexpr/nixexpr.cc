@@ -54,7 +54,7 @@ static void showId(std::ostream & str, const string & s)
 
 std::ostream & operator << (std::ostream & str, const Symbol & sym)
 {
-    showId(str, *sym.s);
+    showId(str, sym.d->s);
     return str;
 }
 
@@ -426,11 +426,53 @@ string ExprLambda::showNamePos() const
 
 /* Symbol table. */
 
+Symbol SymbolTable::create(std::string_view s)
+{
+    auto h = std::hash<std::string_view>()(s);
+    uint32_t hash = (uint32_t) (h ^ (h >> 32));
+
+    auto & shard(shards[hash >> 28]);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    size_t mask = shard.slots.size() - 1;
+
+    if (!shard.slots.empty())
+        for (size_t i = hash & mask; shard.slots[i]; i = (i + 1) & mask) {
+            auto d = shard.slots[i];
+            if (d->hash == hash && d->s == s) return Symbol(d);
+        }
+
+    /* Grow the table if it's more than half full. */
+    if (2 * (shard.data.size() + 1) > shard.slots.size()) {
+        std::vector<const SymbolData *> slots(std::max((size_t) 64, 2 * shard.slots.size()), nullptr);
+        mask = slots.size() - 1;
+        for (auto d : shard.slots)
+            if (d) {
+                size_t i = d->hash & mask;
+                while (slots[i]) i = (i + 1) & mask;
+                slots[i] = d;
+            }
+        shard.slots = std::move(slots);
+    }
+
+    shard.data.emplace_back(s, hash, nextId++);
+    auto d = &shard.data.back();
+
+    size_t i = hash & mask;
+    while (shard.slots[i]) i = (i + 1) & mask;
+    shard.slots[i] = d;
+
+    return Symbol(d);
+}
+
+
 size_t SymbolTable::totalSize() const
 {
     size_t n = 0;
-    for (auto & i : symbols)
-        n += i.size();
+    for (auto & shard : shards)
+        for (auto & d : shard.data)
+            n += d.s.size();
     return n;
 }
 
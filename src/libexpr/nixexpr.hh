@@ -3,6 +3,7 @@
 #include "value.hh"
 #include "symbol-table.hh"
 
+#include <atomic>
 #include <map>
 
 
@@ -51,6 +52,7 @@ std::ostream & operator << (std::ostream & str, const Pos & pos);
 
 
 struct Env;
+struct Attr;
 struct Value;
 class EvalState;
 struct StaticEnv;
@@ -74,6 +76,12 @@ string showAttrPath(const AttrPath & attrPath);
 
 struct Expr
 {
+    /* The kinds of expressions that EvalState::callFunction() looks
+       through to find a call in tail position, so that it can
+       recognise them without a dynamic_cast. */
+    enum Kind : uint8_t { kOther, kApp, kIf, kAssert, kLet, kWith };
+    Kind kind = kOther;
+
     virtual ~Expr() { };
     virtual void show(std::ostream & str) const;
     virtual void bindVars(const StaticEnv & env);
@@ -150,6 +158,12 @@ struct ExprVar : Expr
     unsigned int level;
     unsigned int displ;
 
+    /* For variables from a "with": the attribute found the last time
+       the variable was looked up, if it was found in the innermost
+       "with".  The next lookup through a "with" of the same set can
+       return it directly. */
+    mutable std::atomic<const Attr *> withCache{nullptr};
+
     ExprVar(const Symbol & name) : name(name) { };
     ExprVar(const Pos & pos, const Symbol & name) : pos(pos), name(name) { };
     COMMON_METHODS
@@ -164,6 +178,9 @@ struct ExprSelect : Expr
     ExprSelect(const Pos & pos, Expr * e, const AttrPath & attrPath, Expr * def) : pos(pos), e(e), def(def), attrPath(attrPath) { };
     ExprSelect(const Pos & pos, Expr * e, const Symbol & name) : pos(pos), e(e), def(0) { attrPath.push_back(AttrName(name)); };
     COMMON_METHODS
+    /* Select `attrPath' from `vAttrs', the already computed value of
+       `e'. */
+    void evalFrom(EvalState & state, Env & env, Value & vAttrs, Value & v);
 };
 
 struct ExprOpHasAttr : Expr
@@ -172,6 +189,7 @@ struct ExprOpHasAttr : Expr
     AttrPath attrPath;
     ExprOpHasAttr(Expr * e, const AttrPath & attrPath) : e(e), attrPath(attrPath) { };
     COMMON_METHODS
+    void evalFrom(EvalState & state, Env & env, Value & vAttrs, Value & v);
 };
 
 struct ExprAttrs : Expr
@@ -246,8 +264,10 @@ struct ExprLet : Expr
 {
     ExprAttrs * attrs;
     Expr * body;
-    ExprLet(ExprAttrs * attrs, Expr * body) : attrs(attrs), body(body) { };
+    ExprLet(ExprAttrs * attrs, Expr * body) : attrs(attrs), body(body) { kind = kLet; };
     COMMON_METHODS
+    /* Create the environment in which `body' is evaluated. */
+    Env & allocEnv(EvalState & state, Env & env);
 };
 
 struct ExprWith : Expr
@@ -255,14 +275,15 @@ struct ExprWith : Expr
     Pos pos;
     Expr * attrs, * body;
     size_t prevWith;
-    ExprWith(const Pos & pos, Expr * attrs, Expr * body) : pos(pos), attrs(attrs), body(body) { };
+    ExprWith(const Pos & pos, Expr * attrs, Expr * body) : pos(pos), attrs(attrs), body(body) { kind = kWith; };
     COMMON_METHODS
+    Env & allocEnv(EvalState & state, Env & env);
 };
 
 struct ExprIf : Expr
 {
     Expr * cond, * then, * else_;
-    ExprIf(Expr * cond, Expr * then, Expr * else_) : cond(cond), then(then), else_(else_) { };
+    ExprIf(Expr * cond, Expr * then, Expr * else_) : cond(cond), then(then), else_(else_) { kind = kIf; };
     COMMON_METHODS
 };
 
@@ -270,7 +291,7 @@ struct ExprAssert : Expr
 {
     Pos pos;
     Expr * cond, * body;
-    ExprAssert(const Pos & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { };
+    ExprAssert(const Pos & pos, Expr * cond, Expr * body) : pos(pos), cond(cond), body(body) { kind = kAssert; };
     COMMON_METHODS
 };
 
@@ -281,13 +302,13 @@ struct ExprOpNot : Expr
     COMMON_METHODS
 };
 
-#define MakeBinOp(name, s) \
+#define MakeBinOp(name, s, k) \
     struct name : Expr \
     { \
         Pos pos; \
         Expr * e1, * e2; \
-        name(Expr * e1, Expr * e2) : e1(e1), e2(e2) { }; \
-        name(const Pos & pos, Expr * e1, Expr * e2) : pos(pos), e1(e1), e2(e2) { }; \
+        name(Expr * e1, Expr * e2) : e1(e1), e2(e2) { kind = k; }; \
+        name(const Pos & pos, Expr * e1, Expr * e2) : pos(pos), e1(e1), e2(e2) { kind = k; }; \
         void show(std::ostream & str) const \
         { \
             str << "(" << *e1 << " " s " " << *e2 << ")";   \
@@ -299,14 +320,14 @@ struct ExprOpNot : Expr
         void eval(EvalState & state, Env & env, Value & v); \
     };
 
-MakeBinOp(ExprApp, "")
-MakeBinOp(ExprOpEq, "==")
-MakeBinOp(ExprOpNEq, "!=")
-MakeBinOp(ExprOpAnd, "&&")
-MakeBinOp(ExprOpOr, "||")
-MakeBinOp(ExprOpImpl, "->")
-MakeBinOp(ExprOpUpdate, "//")
-MakeBinOp(ExprOpConcatLists, "++")
+MakeBinOp(ExprApp, "", kApp)
+MakeBinOp(ExprOpEq, "==", kOther)
+MakeBinOp(ExprOpNEq, "!=", kOther)
+MakeBinOp(ExprOpAnd, "&&", kOther)
+MakeBinOp(ExprOpOr, "||", kOther)
+MakeBinOp(ExprOpImpl, "->", kOther)
+MakeBinOp(ExprOpUpdate, "//", kOther)
+MakeBinOp(ExprOpConcatLists, "++", kOther)
 
 struct ExprConcatStrings : Expr
 {
@@ -0,0 +1,173 @@
+#include "package-table.hh"
+#include "serialise.hh"
+
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+
+static uint64_t align8(uint64_t n)
+{
+    return (n + 7) & ~(uint64_t) 7;
+}
+
+
+PackageTableWriter::PackageTableWriter(const Strings & columns)
+    : columns(columns), cells(columns.size())
+{
+    for (auto & name : columns)
+        if (name.size() >= sizeof(PackageTableColumn::name))
+            throw Error("package table column name '%s' is too long", name);
+}
+
+
+void PackageTableWriter::add(const std::vector<std::optional<std::string>> & row)
+{
+    assert(row.size() == columns.size());
+
+    for (size_t i = 0; i < row.size(); ++i) {
+        if (!row[i]) {
+            cells[i].push_back({absentCell, 0});
+            continue;
+        }
+        auto j = poolIndex.find(*row[i]);
+        if (j == poolIndex.end()) {
+            j = poolIndex.emplace(*row[i], pool.size()).first;
+            pool += *row[i];
+            pool.push_back(0);
+        }
+        cells[i].push_back({j->second, row[i]->size()});
+    }
+
+    nrRows++;
+}
+
+
+void PackageTableWriter::write(const Path & path)
+{
+    PackageTableHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, packageTableMagic, sizeof(header.magic));
+    header.version = packageTableVersion;
+    header.nrColumns = columns.size();
+    header.nrRows = nrRows;
+
+    uint64_t columnsEnd = sizeof(header) + columns.size() * sizeof(PackageTableColumn);
+    uint64_t offset = align8(columnsEnd);
+
+    std::vector<PackageTableColumn> columnInfos;
+    for (auto & name : columns) {
+        PackageTableColumn column;
+        memset(&column, 0, sizeof(column));
+        memcpy(column.name, name.data(), name.size());
+        column.cellsOffset = offset;
+        offset += nrRows * sizeof(PackageTableCell);
+        columnInfos.push_back(column);
+    }
+
+    header.poolOffset = offset;
+    header.poolSize = pool.size();
+
+    Path tmpPath = path + ".tmp";
+    AutoCloseFD fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (!fd) throw SysError("creating '%s'", tmpPath);
+
+    FdSink sink(fd.get());
+    sink((const unsigned char *) &header, sizeof(header));
+    sink((const unsigned char *) columnInfos.data(), columnInfos.size() * sizeof(PackageTableColumn));
+    sink(std::string(align8(columnsEnd) - columnsEnd, 0));
+    for (auto & column : cells)
+        sink((const unsigned char *) column.data(), column.size() * sizeof(PackageTableCell));
+    sink(pool);
+    sink.flush();
+
+    fd = -1;
+
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmpPath, path);
+}
+
+
+PackageTable::PackageTable(const Path & path)
+{
+    fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening '%s'", path);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("getting status of '%s'", path);
+    size = st.st_size;
+
+    auto bad = [&]() { return Error("'%s' is not a valid package table", path); };
+
+    if (size < sizeof(PackageTableHeader)) throw bad();
+
+    auto p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (p == MAP_FAILED) throw SysError("mapping '%s'", path);
+    data = (const char *) p;
+
+    try {
+        header = (const PackageTableHeader *) data;
+        if (memcmp(header->magic, packageTableMagic, sizeof(header->magic)) != 0
+            || header->version != packageTableVersion)
+            throw bad();
+
+        uint64_t columnsEnd = sizeof(PackageTableHeader) + (uint64_t) header->nrColumns * sizeof(PackageTableColumn);
+        if (columnsEnd > size) throw bad();
+        columns = (const PackageTableColumn *) (data + sizeof(PackageTableHeader));
+
+        if (header->nrRows > size / sizeof(PackageTableCell)) throw bad();
+        for (size_t i = 0; i < header->nrColumns; ++i) {
+            auto & column(columns[i]);
+            if (column.cellsOffset % 8 || column.cellsOffset > size
+                || header->nrRows * sizeof(PackageTableCell) > size - column.cellsOffset
+                || !memchr(column.name, 0, sizeof(column.name)))
+                throw bad();
+        }
+
+        if (header->poolOffset > size || header->poolSize > size - header->poolOffset)
+            throw bad();
+    } catch (...) {
+        munmap((void *) data, size);
+        throw;
+    }
+}
+
+
+PackageTable::~PackageTable()
+{
+    munmap((void *) data, size);
+}
+
+
+std::string_view PackageTable::columnName(size_t column) const
+{
+    assert(column < header->nrColumns);
+    return columns[column].name;
+}
+
+
+std::optional<size_t> PackageTable::column(std::string_view name) const
+{
+    for (size_t i = 0; i < header->nrColumns; ++i)
+        if (name == columns[i].name) return i;
+    return {};
+}
+
+
+std::optional<std::string_view> PackageTable::get(size_t column, uint64_t row) const
+{
+    assert(column < header->nrColumns && row < header->nrRows);
+    auto & cell(((const PackageTableCell *) (data + columns[column].cellsOffset))[row]);
+    if (cell.offset == absentCell) return {};
+    if (cell.offset >= header->poolSize || cell.size >= header->poolSize - cell.offset)
+        throw Error("package table cell (%d, %d) is corrupt", column, row);
+    return std::string_view(data + header->poolOffset + cell.offset, cell.size);
+}
+
+
+}
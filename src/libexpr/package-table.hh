@@ -0,0 +1,115 @@
+#pragma once
+
+#include "types.hh"
+#include "util.hh"
+
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+
+namespace nix {
+
+/* A package table is a file of evaluated package metadata (as
+   exported by `nix-env -qa --export') that consumers can mmap() and
+   query without parsing.  It is a table of strings, with one row
+   per package and one column per field, laid out as follows (all
+   integers in host byte order; the offsets of the cell arrays and
+   the string pool are from the start of the file and 8-byte
+   aligned):
+
+     PackageTableHeader
+     PackageTableColumn[nrColumns]
+     for each column: PackageTableCell[nrRows]
+     the string pool
+
+   A cell refers to a string by its offset from the start of the
+   pool.  Each string is followed by a NUL byte so that it can be
+   used as a C string.  Equal strings are stored only once.  Cells without a value (e.g. a meta attribute
+   the package doesn't have) have offset `absentCell'.
+
+   nix-env writes the columns "attrPath", "name", "system",
+   "drvPath", "outputs" (lines of the form "<name>=<path>") and
+   "meta.<name>" for each requested meta attribute (string values
+   as-is, other values as JSON). */
+
+const char packageTableMagic[8] = {'N', 'I', 'X', 'P', 'K', 'G', 'T', 0};
+const uint32_t packageTableVersion = 1;
+
+struct PackageTableHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t nrColumns;
+    uint64_t nrRows;
+    uint64_t poolOffset;
+    uint64_t poolSize;
+};
+
+struct PackageTableColumn
+{
+    /* The name of the column, NUL-padded. */
+    char name[56];
+    uint64_t cellsOffset;
+};
+
+struct PackageTableCell
+{
+    uint64_t offset;
+    uint64_t size;
+};
+
+const uint64_t absentCell = UINT64_MAX;
+
+
+/* Builds a package table in memory and writes it to a file. */
+class PackageTableWriter
+{
+    Strings columns;
+    std::vector<std::vector<PackageTableCell>> cells;
+    std::string pool;
+    std::unordered_map<std::string, uint64_t> poolIndex;
+    uint64_t nrRows = 0;
+
+public:
+
+    PackageTableWriter(const Strings & columns);
+
+    /* Add a row with a value (or none) for each column. */
+    void add(const std::vector<std::optional<std::string>> & row);
+
+    /* Write the table to `path', atomically replacing it so that
+       existing mappings of the old table stay valid. */
+    void write(const Path & path);
+};
+
+
+/* A read-only mapping of a package table. */
+class PackageTable
+{
+    AutoCloseFD fd;
+    const char * data = nullptr;
+    size_t size = 0;
+    const PackageTableHeader * header;
+    const PackageTableColumn * columns;
+
+public:
+
+    PackageTable(const Path & path);
+
+    ~PackageTable();
+
+    PackageTable(const PackageTable &) = delete;
+
+    uint64_t nrRows() const { return header->nrRows; }
+
+    size_t nrColumns() const { return header->nrColumns; }
+
+    std::string_view columnName(size_t column) const;
+
+    /* Return the index of the column named `name', if any. */
+    std::optional<size_t> column(std::string_view name) const;
+
+    std::optional<std::string_view> get(size_t column, uint64_t row) const;
+};
+
+}
@@ -32,6 +32,11 @@ namespace nix {
         Symbol path;
         string error;
         Symbol sLetBody;
+        /* The path literals in the file, for EvalState::preparser. */
+        std::vector<Path> paths;
+        /* The calls to fetch primops with constant arguments, for
+           EvalState::prefetcher. */
+        std::vector<std::pair<string, std::map<string, string>>> fetches;
         ParseData(EvalState & state)
             : state(state)
             , symbols(state.symbols)
@@ -75,6 +80,47 @@ static void dupAttr(Symbol attr, const Pos & pos, const Pos & prevPos)
 }
 
 
+/* If `fun arg' calls a fetch primop with string literals as its
+   arguments, record it in `data->fetches'. */
+static void noteFetchCall(ParseData * data, Expr * fun, Expr * arg)
+{
+    /* A variable named `fetchurl' is usually Nixpkgs' fetchurl,
+       which takes different arguments. */
+    string name;
+    if (auto var = dynamic_cast<ExprVar *>(fun)) {
+        name = var->name;
+        if (name == "fetchurl") return;
+    } else if (auto select = dynamic_cast<ExprSelect *>(fun)) {
+        auto var = dynamic_cast<ExprVar *>(select->e);
+        if (!var || (const string &) var->name != "builtins"
+            || select->def || select->attrPath.size() != 1
+            || !select->attrPath[0].symbol.set())
+            return;
+        name = select->attrPath[0].symbol;
+    } else
+        return;
+
+    if (name != "fetchTarball" && name != "fetchGit" && name != "fetchurl")
+        return;
+
+    std::map<string, string> args;
+
+    if (auto s = dynamic_cast<ExprString *>(arg))
+        args["url"] = s->s;
+    else if (auto attrs = dynamic_cast<ExprAttrs *>(arg)) {
+        if (attrs->recursive || !attrs->dynamicAttrs.empty()) return;
+        for (auto & i : attrs->attrs) {
+            auto s = dynamic_cast<ExprString *>(i.second.e);
+            if (i.second.inherited || !s) return;
+            args[i.first] = s->s;
+        }
+    } else
+        return;
+
+    data->fetches.emplace_back(name, args);
+}
+
+
 static void addAttr(ExprAttrs * attrs, AttrPath & attrPath,
     Expr * e, const Pos & pos)
 {
@@ -364,7 +410,7 @@ expr_op
 
 expr_app
   : expr_app expr_select
-    { $$ = new ExprApp(CUR_POS, $1, $2); }
+    { $$ = new ExprApp(CUR_POS, $1, $2); noteFetchCall(data, $1, $2); }
   | expr_select { $$ = $1; }
   ;
 
@@ -393,7 +439,11 @@ expr_simple
   | IND_STRING_OPEN ind_string_parts IND_STRING_CLOSE {
       $$ = stripIndentation(CUR_POS, data->symbols, *$2);
   }
-  | PATH { $$ = new ExprPath(absPath($1, data->basePath)); }
+  | PATH {
+      Path path(absPath($1, data->basePath));
+      data->paths.push_back(path);
+      $$ = new ExprPath(path);
+  }
   | HPATH { $$ = new ExprPath(getHome() + string{$1 + 1}); }
   | SPATH {
       string path($1 + 1, strlen($1) - 2);
@@ -537,8 +587,11 @@ formal
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <optional>
 
 #include "eval.hh"
+#include "bytecode.hh"
+#include "ast-cache.hh"
 #include "download.hh"
 #include "store-api.hh"
 
@@ -547,22 +600,45 @@ namespace nix {
 
 
 Expr * EvalState::parse(const char * text,
-    const Path & path, const Path & basePath, StaticEnv & staticEnv)
+    const Path & path, const Path & basePath, StaticEnv & staticEnv,
+    bool useCache)
 {
-    yyscan_t scanner;
+    bool isFile = useCache;
+    useCache = useCache && evalSettings.astCache;
+
     ParseData data(*this);
-    data.basePath = basePath;
-    data.path = data.symbols.create(path);
 
-    yylex_init(&scanner);
-    yy_scan_string(text, scanner);
-    int res = yyparse(scanner, &data);
-    yylex_destroy(scanner);
+    std::optional<PhaseTimer> timer(EvalPhase::Parse);
+
+    if (!useCache || !(data.result = readASTCache(*this, path, text))) {
+        yyscan_t scanner;
+        data.basePath = basePath;
+        data.path = data.symbols.create(path);
 
-    if (res) throw ParseError(data.error);
+        yylex_init(&scanner);
+        yy_scan_string(text, scanner);
+        int res = yyparse(scanner, &data);
+        yylex_destroy(scanner);
+
+        if (res) throw ParseError(data.error);
+
+        if (useCache) writeASTCache(path, text, data.result);
+
+        if (isFile && preparser)
+            for (auto & p : data.paths) preparseFile(p);
+
+        if (isFile && prefetcher)
+            for (auto & [fun, args] : data.fetches)
+                prefetchCall(fun, args);
+    }
+
+    timer.emplace(EvalPhase::BindVars);
 
     data.result->bindVars(staticEnv);
 
+    if (evalSettings.useBytecode)
+        data.result = compileBytecode(data.result);
+
     return data.result;
 }
 
@@ -597,7 +673,9 @@ Expr * EvalState::parseExprFromFile(const Path & path)
 
 Expr * EvalState::parseExprFromFile(const Path & path, StaticEnv & staticEnv)
 {
-    return parse(readFile(path).c_str(), path, dirOf(path), staticEnv);
+    auto buffer = readFile(path);
+    addEvalInput("file", path, [&]() { return hashString(htSHA256, buffer).to_string(); });
+    return parse(buffer.c_str(), path, dirOf(path), staticEnv, true);
 }
 
 
@@ -658,6 +736,7 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
         auto r = resolveSearchPathElem(i);
         if (!r.first) continue;
         Path res = r.second + suffix;
+        addEvalInput("exists", res);
         if (pathExists(res)) return canonPath(res);
     }
     format f = format(
@@ -670,12 +749,16 @@ Path EvalState::findFile(SearchPath & searchPath, const string & path, const Pos
 
 std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathElem & elem)
 {
-    auto i = searchPathResolved.find(elem.second);
-    if (i != searchPathResolved.end()) return i->second;
+    {
+        std::lock_guard<std::recursive_mutex> lock(cacheMutex);
+        auto i = searchPathResolved.find(elem.second);
+        if (i != searchPathResolved.end()) return i->second;
+    }
 
     std::pair<bool, std::string> res;
 
     if (isUri(elem.second)) {
+        markEvalImpure();
         try {
             CachedDownloadRequest request(elem.second);
             request.unpack = true;
@@ -686,6 +769,7 @@ std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathEl
         }
     } else {
         auto path = absPath(elem.second);
+        addEvalInput("exists", path);
         if (pathExists(path))
             res = { true, path };
         else {
@@ -696,6 +780,7 @@ std::pair<bool, std::string> EvalState::resolveSearchPathElem(const SearchPathEl
 
     debug(format("resolved search path element '%s' to '%s'") % elem.second % res.second);
 
+    std::lock_guard<std::recursive_mutex> lock(cacheMutex);
     searchPathResolved[elem.second] = res;
     return res;
 }
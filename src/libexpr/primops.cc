@@ -15,11 +15,17 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <cmath>
 #include <cstring>
+#include <exception>
 #include <regex>
+#include <string_view>
+#include <thread>
+#include <unordered_set>
 #include <dlfcn.h>
 
 
@@ -48,6 +54,8 @@ InvalidPathError::InvalidPathError(const Path & path) :
 
 void EvalState::realiseContext(const PathSet & context)
 {
+    if (!context.empty()) flushTexts();
+
     PathSet drvs;
 
     for (auto & i : context) {
@@ -80,6 +88,8 @@ void EvalState::realiseContext(const PathSet & context)
     PathSet willBuild, willSubstitute, unknown;
     unsigned long long downloadSize, narSize;
     store->queryMissing(drvs, willBuild, willSubstitute, unknown, downloadSize, narSize);
+    if (deferIFD && (!willBuild.empty() || !willSubstitute.empty()))
+        deferRealisation(drvs);
     store->buildPaths(drvs);
 }
 
@@ -214,6 +224,8 @@ void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v)
             % program % e.path % pos);
     }
 
+    state.markEvalImpure();
+
     auto output = runProgram(program, true, commandArgs);
     Expr * parsed;
     try {
@@ -348,6 +360,49 @@ struct CompareValues
 };
 
 
+/* Hashing and equality of forced values that are consistent with
+   CompareValues, i.e. integers and floats that denote the same number
+   are equal. */
+static bool comparable(const Value * v1, const Value * v2)
+{
+    auto isNumber = [](const Value * v) { return v->type == tInt || v->type == tFloat; };
+    if (isNumber(v1)) return isNumber(v2);
+    return v1->type == v2->type && (v1->type == tString || v1->type == tPath);
+}
+
+
+struct HashValue
+{
+    size_t operator () (const Value * v) const
+    {
+        switch (v->type) {
+            case tInt:
+                return std::hash<NixInt>()(v->integer);
+            case tFloat:
+                if (std::fabs(v->fpoint) < 0x1p62 && v->fpoint == (NixFloat) (NixInt) v->fpoint)
+                    return std::hash<NixInt>()((NixInt) v->fpoint);
+                return std::hash<NixFloat>()(v->fpoint);
+            case tString:
+                return std::hash<std::string_view>()(v->string.s);
+            case tPath:
+                return std::hash<std::string_view>()(v->path);
+            default:
+                return 0;
+        }
+    }
+};
+
+
+struct EqualValues
+{
+    bool operator () (const Value * v1, const Value * v2) const
+    {
+        CompareValues lt;
+        return !lt(v1, v2) && !lt(v2, v1);
+    }
+};
+
+
 #if HAVE_BOEHMGC
 typedef list<Value *, gc_allocator<Value *> > ValueList;
 #else
@@ -383,7 +438,8 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
     ValueList res;
     // `doneKeys' doesn't need to be a GC root, because its values are
     // reachable from res.
-    set<Value *, CompareValues> doneKeys;
+    std::unordered_set<Value *, HashValue, EqualValues> doneKeys;
+    Value * firstKey = nullptr;
     while (!workSet.empty()) {
         Value * e = *(workSet.begin());
         workSet.pop_front();
@@ -396,8 +452,14 @@ static void prim_genericClosure(EvalState & state, const Pos & pos, Value * * ar
             throw EvalError(format("attribute 'key' required, at %1%") % pos);
         state.forceValue(*key->value);
 
-        if (doneKeys.find(key->value) != doneKeys.end()) continue;
-        doneKeys.insert(key->value);
+        /* Keys of different types are as incomparable as they were
+           when doneKeys was an ordered set. */
+        if (!firstKey)
+            firstKey = key->value;
+        else if (!comparable(firstKey, key->value))
+            throw EvalError(format("cannot compare %1% with %2%") % showType(*key->value) % showType(*firstKey));
+
+        if (!doneKeys.insert(key->value).second) continue;
         res.push_back(e);
 
         /* Call the `operator' function with `e' as argument. */
@@ -436,6 +498,16 @@ static void prim_throw(EvalState & state, const Pos & pos, Value * * args, Value
 }
 
 
+/* Return the current time. This is applied to a dummy argument when
+   `__currentTime' is first forced, so that reading the time marks
+   the evaluation as impure like other impure builtins. */
+static void prim_currentTime(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.markEvalImpure();
+    mkInt(v, time(0));
+}
+
+
 static void prim_addErrorContext(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     try {
@@ -457,10 +529,10 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
     try {
         state.forceValue(*args[0]);
         v.attrs->push_back(Attr(state.sValue, args[0]));
-        mkBool(*state.allocAttr(v, state.symbols.create("success")), true);
+        v.attrs->push_back(Attr(state.symbols.create("success"), &state.vTrue));
     } catch (AssertionError & e) {
-        mkBool(*state.allocAttr(v, state.sValue), false);
-        mkBool(*state.allocAttr(v, state.symbols.create("success")), false);
+        v.attrs->push_back(Attr(state.sValue, &state.vFalse));
+        v.attrs->push_back(Attr(state.symbols.create("success"), &state.vFalse));
     }
     v.attrs->sort();
 }
@@ -470,7 +542,13 @@ static void prim_tryEval(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_getEnv(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     string name = state.forceStringNoCtx(*args[0], pos);
-    mkString(v, evalSettings.restrictEval || evalSettings.pureEval ? "" : getEnv(name));
+    if (evalSettings.restrictEval || evalSettings.pureEval)
+        mkString(v, "");
+    else {
+        auto value = getEnv(name);
+        state.addEvalInput("env", name, [&]() { return value; });
+        mkString(v, value);
+    }
 }
 
 
@@ -493,6 +571,17 @@ static void prim_deepSeq(EvalState & state, const Pos & pos, Value * * args, Val
 }
 
 
+/* Apply the function in the first argument to the second argument,
+   remembering the result.  Later applications of the same function to
+   a structurally equal argument return the same result without
+   evaluating the function body again.  The argument is evaluated
+   deeply. */
+static void prim_memoise(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    state.callMemoised(*args[0], *args[1], v, pos);
+}
+
+
 /* Evaluate the first expression and print it on standard error.  Then
    return the second expression.  Useful for debugging. */
 static void prim_trace(EvalState & state, const Pos & pos, Value * * args, Value & v)
@@ -528,6 +617,8 @@ void prim_valueSize(EvalState & state, const Pos & pos, Value * * args, Value &
    derivation. */
 static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
+    PhaseTimer timer(EvalPhase::DerivationStrict);
+
     state.forceAttrs(*args[0], pos);
 
     /* Figure out the name first (for stack backtraces). */
@@ -684,6 +775,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
            runs. */
         if (path.at(0) == '=') {
             /* !!! This doesn't work if readOnlyMode is set. */
+            state.flushTexts();
             PathSet refs;
             state.store->computeFSClosure(string(path, 1), refs);
             for (auto & j : refs) {
@@ -755,7 +847,15 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     }
 
     /* Write the resulting term into the Nix store directory. */
-    Path drvPath = writeDerivation(state.store, drv, drvName, state.repair);
+    Path drvPath;
+    {
+        PhaseTimer timer(EvalPhase::WriteDerivation);
+        /* Like writeDerivation(), but possibly batched. */
+        PathSet references(drv.inputSrcs);
+        for (auto & i : drv.inputDrvs)
+            references.insert(i.first);
+        drvPath = state.addTextToStore(drvName + drvExtension, drv.unparse(), references);
+    }
 
     printMsg(lvlChatty, format("instantiated '%1%' -> '%2%'")
         % drvName % drvPath);
@@ -763,7 +863,7 @@ static void prim_derivationStrict(EvalState & state, const Pos & pos, Value * *
     /* Optimisation, but required in read-only mode! because in that
        case we don't actually write store derivations, so we can't
        read them later. */
-    drvHashes[drvPath] = hashDerivationModulo(*state.store, drv);
+    insertDrvHash(drvPath, hashDerivationModulo(*state.store, drv));
 
     state.mkAttrs(v, 1 + drv.outputs.size());
     mkString(*state.allocAttr(v, state.sDrvPath), drvPath, {"=" + drvPath});
@@ -821,8 +921,10 @@ static void prim_storePath(EvalState & state, const Pos & pos, Value * * args, V
     if (!state.store->isInStore(path))
         throw EvalError(format("path '%1%' is not in the Nix store, at %2%") % path % pos);
     Path path2 = state.store->toStorePath(path);
-    if (!settings.readOnlyMode)
+    if (!settings.readOnlyMode) {
+        state.flushTexts();
         state.store->ensurePath(path2);
+    }
     context.insert(path2);
     mkString(v, path, context);
 }
@@ -835,7 +937,9 @@ static void prim_pathExists(EvalState & state, const Pos & pos, Value * * args,
     if (!context.empty())
         throw EvalError(format("string '%1%' cannot refer to other paths, at %2%") % path % pos);
     try {
-        mkBool(v, pathExists(state.checkSourcePath(path)));
+        path = state.checkSourcePath(path);
+        state.addEvalInput("exists", path);
+        mkBool(v, pathExists(path));
     } catch (SysError & e) {
         /* Don't give away info from errors while canonicalising
            ‘path’ in restricted mode. */
@@ -877,10 +981,61 @@ static void prim_readFile(EvalState & state, const Pos & pos, Value * * args, Va
         throw EvalError(format("cannot read '%1%', since path '%2%' is not valid, at %3%")
             % path % e.path % pos);
     }
-    string s = readFile(state.checkSourcePath(state.toRealPath(path, context)));
-    if (s.find((char) 0) != string::npos)
+    Path realPath = state.checkSourcePath(state.toRealPath(path, context));
+
+    /* Read regular files straight into a string allocated by the
+       garbage collector, rather than via a std::string that would
+       then have to be copied. */
+    AutoCloseFD fd = open(realPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd)
+        throw SysError("opening file '%1%'", realPath);
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting file '%1%'", realPath);
+
+    char * s;
+    size_t size;
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        size = st.st_size;
+        s = allocString(size + 1);
+        size_t done = 0;
+        while (done < size) {
+            checkInterrupt();
+            auto n = read(fd.get(), s + done, size - done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading file '%1%'", realPath);
+            }
+            if (n == 0) break;
+            done += n;
+        }
+        /* The file may have changed size; read it the slow way. */
+        unsigned char c;
+        if (done != size || read(fd.get(), &c, 1) != 0) {
+            auto s2 = readFile(realPath);
+            size = s2.size();
+            s = allocString(size + 1);
+            memcpy(s, s2.data(), size);
+        }
+    } else {
+        /* Files such as those in /proc don't have a known size. */
+        auto s2 = readFile(fd.get());
+        size = s2.size();
+        s = allocString(size + 1);
+        memcpy(s, s2.data(), size);
+    }
+    s[size] = 0;
+
+    if (memchr(s, 0, size))
         throw Error(format("the contents of the file '%1%' cannot be represented as a Nix string") % path);
-    mkString(v, s.c_str());
+
+    state.addEvalInput("file", realPath, [&]() {
+        HashSink sink(htSHA256);
+        sink((const unsigned char *) s, size);
+        return sink.finish().first.to_string();
+    });
+
+    mkStringNoCopy(v, s);
 }
 
 
@@ -932,9 +1087,11 @@ static void prim_hashFile(EvalState & state, const Pos & pos, Value * * args, Va
       throw Error(format("unknown hash type '%1%', at %2%") % type % pos);
 
     PathSet context; // discarded
-    Path p = state.coerceToPath(pos, *args[1], context);
+    Path p = state.checkSourcePath(state.coerceToPath(pos, *args[1], context));
 
-    mkString(v, hashFile(ht, state.checkSourcePath(p)).to_string(Base16, false), context);
+    state.addEvalInput("file", p);
+
+    mkString(v, hashFile(ht, p).to_string(Base16, false), context);
 }
 
 /* Read a directory (without . or ..) */
@@ -949,21 +1106,8 @@ static void prim_readDir(EvalState & state, const Pos & pos, Value * * args, Val
             % path % e.path % pos);
     }
 
-    DirEntries entries = readDirectory(state.checkSourcePath(path));
-    state.mkAttrs(v, entries.size());
-
-    for (auto & ent : entries) {
-        Value * ent_val = state.allocAttr(v, state.symbols.create(ent.name));
-        if (ent.type == DT_UNKNOWN)
-            ent.type = getFileType(path + "/" + ent.name);
-        mkStringNoCopy(*ent_val,
-            ent.type == DT_REG ? "regular" :
-            ent.type == DT_DIR ? "directory" :
-            ent.type == DT_LNK ? "symlink" :
-            "unknown");
-    }
-
-    v.attrs->sort();
+    state.readDirCached(state.checkSourcePath(path), v);
+    state.addEvalInput("dir", path);
 }
 
 
@@ -1020,9 +1164,7 @@ static void prim_toFile(EvalState & state, const Pos & pos, Value * * args, Valu
         refs.insert(path);
     }
 
-    Path storePath = settings.readOnlyMode
-        ? state.store->computeStorePathForText(name, contents, refs)
-        : state.store->addTextToStore(name, contents, refs, state.repair);
+    Path storePath = state.addTextToStore(name, contents, refs);
 
     /* Note: we don't need to add `context' to the context of the
        result, since `storePath' itself has references to the paths
@@ -1066,12 +1208,35 @@ static void addPath(EvalState & state, const Pos & pos, const string & name, con
     if (expectedHash) {
         expectedStorePath =
             state.store->makeFixedOutputPath(recursive, expectedHash, name);
-    }
+    } else
+        /* The result depends on the filter, or on a name or ingestion
+           method that the "path" evaluation input doesn't cover. */
+        state.markEvalImpure();
     Path dstPath;
     if (!expectedHash || !state.store->isValidPath(expectedStorePath)) {
-        dstPath = settings.readOnlyMode
-            ? state.store->computeStorePathForPath(name, path, recursive, htSHA256, filter).first
-            : state.store->addToStore(name, path, recursive, htSHA256, filter, state.repair);
+        if (recursive) {
+            /* Evaluate the filter and hash the result first, reading
+               files in parallel, so that nothing needs to be copied
+               if the path already exists.  The copy then only needs
+               to consult the paths accepted by the filter. */
+            std::set<Path> accepted;
+            PathFilter recordingFilter = [&](const Path & p) {
+                if (!filter(p)) return false;
+                accepted.insert(p);
+                return true;
+            };
+            HashSink hashSink(htSHA256);
+            dumpPathParallel(path, hashSink, recordingFilter);
+            dstPath = state.store->makeFixedOutputPath(true, hashSink.finish().first, name);
+            if (!settings.readOnlyMode && (state.repair || !state.store->isValidPath(dstPath))) {
+                PathFilter acceptedFilter = [&](const Path & p) { return accepted.count(p) > 0; };
+                if (state.store->addToStore(name, path, true, htSHA256, acceptedFilter, state.repair) != dstPath)
+                    throw Error("path '%s' changed while it was being added to the store", path);
+            }
+        } else
+            dstPath = settings.readOnlyMode
+                ? state.store->computeStorePathForPath(name, path, recursive, htSHA256, filter).first
+                : state.store->addToStore(name, path, recursive, htSHA256, filter, state.repair);
         if (expectedHash && expectedStorePath != dstPath) {
             throw Error(format("store path mismatch in (possibly filtered) path added from '%1%'") % path);
         }
@@ -1354,8 +1519,7 @@ static void prim_functionArgs(EvalState & state, const Pos & pos, Value * * args
 
     state.mkAttrs(v, args[0]->lambda.fun->formals->formals.size());
     for (auto & i : args[0]->lambda.fun->formals->formals)
-        // !!! should optimise booleans (allocate only once)
-        mkBool(*state.allocAttr(v, i.name), i.def);
+        v.attrs->push_back(Attr(i.name, state.boolValue(i.def)));
     v.attrs->sort();
 }
 
@@ -1568,9 +1732,7 @@ static void prim_genList(EvalState & state, const Pos & pos, Value * * args, Val
     state.mkList(v, len);
 
     for (unsigned int n = 0; n < (unsigned int) len; ++n) {
-        Value * arg = state.allocValue();
-        mkInt(*arg, n);
-        mkApp(*(v.listElems()[n] = state.allocValue()), *args[0], *arg);
+        mkApp(*(v.listElems()[n] = state.allocValue()), *args[0], *state.intValue(n));
     }
 }
 
@@ -1578,6 +1740,50 @@ static void prim_genList(EvalState & state, const Pos & pos, Value * * args, Val
 static void prim_lessThan(EvalState & state, const Pos & pos, Value * * args, Value & v);
 
 
+/* Stable sort of forced values by CompareValues.  Large lists are cut
+   into chunks that are sorted on separate threads and then merged.
+   This doesn't call into the evaluator, so the threads don't need to
+   be registered with the garbage collector; the values stay reachable
+   from the list being sorted. */
+static void parallelSort(Value * * elems, size_t len)
+{
+    const size_t minChunk = 8192;
+
+    size_t nrThreads = evalSettings.evalCores;
+    if (!nrThreads) nrThreads = std::thread::hardware_concurrency();
+    nrThreads = std::max((size_t) 1, std::min(nrThreads, len / minChunk));
+
+    if (nrThreads == 1) {
+        std::stable_sort(elems, elems + len, CompareValues());
+        return;
+    }
+
+    std::vector<size_t> bounds;
+    for (size_t n = 0; n <= nrThreads; ++n)
+        bounds.push_back(len * n / nrThreads);
+
+    std::vector<std::exception_ptr> errors(nrThreads);
+    std::vector<std::thread> threads;
+    for (size_t n = 0; n < nrThreads; ++n)
+        threads.emplace_back([&, n]() {
+            try {
+                std::stable_sort(elems + bounds[n], elems + bounds[n + 1], CompareValues());
+            } catch (...) {
+                errors[n] = std::current_exception();
+            }
+        });
+    for (auto & thr : threads) thr.join();
+    for (auto & e : errors)
+        if (e) std::rethrow_exception(e);
+
+    /* Merge adjacent runs until there is one left. */
+    for (size_t step = 1; step < nrThreads; step *= 2)
+        for (size_t n = 0; n + step < nrThreads; n += 2 * step)
+            std::inplace_merge(elems + bounds[n], elems + bounds[n + step],
+                elems + bounds[std::min(n + 2 * step, nrThreads)], CompareValues());
+}
+
+
 static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     state.forceFunction(*args[0], pos);
@@ -1591,12 +1797,14 @@ static void prim_sort(EvalState & state, const Pos & pos, Value * * args, Value
     }
 
 
-    auto comparator = [&](Value * a, Value * b) {
-        /* Optimization: if the comparator is lessThan, bypass
-           callFunction. */
-        if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan)
-            return CompareValues()(a, b);
+    /* Optimization: if the comparator is lessThan, bypass
+       callFunction, and sort large lists in parallel. */
+    if (args[0]->type == tPrimOp && args[0]->primOp->fun == prim_lessThan) {
+        parallelSort(v.listElems(), len);
+        return;
+    }
 
+    auto comparator = [&](Value * a, Value * b) {
         Value vTmp1, vTmp2;
         state.callFunction(*args[0], *a, vTmp1, pos);
         state.callFunction(vTmp1, *b, vTmp2, pos);
@@ -1809,9 +2017,13 @@ static void prim_hashString(EvalState & state, const Pos & pos, Value * * args,
       throw Error(format("unknown hash type '%1%', at %2%") % type % pos);
 
     PathSet context; // discarded
-    string s = state.forceString(*args[1], context, pos);
+    auto s = state.forceStringView(*args[1], pos);
+    copyContext(*args[1], context);
+
+    HashSink sink(ht);
+    sink((const unsigned char *) s.data(), s.size());
 
-    mkString(v, hashString(ht, s).to_string(Base16, false), context);
+    mkString(v, sink.finish().first.to_string(Base16, false), context);
 }
 
 
@@ -1839,7 +2051,7 @@ static void prim_match(EvalState & state, const Pos & pos, Value * * args, Value
         state.mkList(v, len);
         for (size_t i = 0; i < len; ++i) {
             if (!match[i+1].matched)
-                mkNull(*(v.listElems()[i] = state.allocValue()));
+                v.listElems()[i] = &state.vNull;
             else
                 mkString(*(v.listElems()[i] = state.allocValue()), match[i + 1].str().c_str());
         }
@@ -1898,7 +2110,7 @@ static void prim_split(EvalState & state, const Pos & pos, Value * * args, Value
             state.mkList(*elem, slen);
             for (size_t si = 0; si < slen; ++si) {
                 if (!match[si + 1].matched)
-                    mkNull(*(elem->listElems()[si] = state.allocValue()));
+                    elem->listElems()[si] = &state.vNull;
                 else
                     mkString(*(elem->listElems()[si] = state.allocValue()), match[si + 1].str().c_str());
             }
@@ -2047,6 +2259,14 @@ static void prim_splitVersion(EvalState & state, const Pos & pos, Value * * args
  *************************************************************/
 
 
+/* The key of the prefetch of `request' by EvalState::prefetchCall(). */
+static string fetchKey(const string & who, const CachedDownloadRequest & request)
+{
+    return who + '\0' + request.uri + '\0' + request.name + '\0'
+        + (request.expectedHash ? request.expectedHash.to_string() : "");
+}
+
+
 void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     const string & who, bool unpack, const std::string & defaultName)
 {
@@ -2083,6 +2303,11 @@ void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
     if (evalSettings.pureEval && !request.expectedHash)
         throw Error("in pure evaluation mode, '%s' requires a 'sha256' argument", who);
 
+    if (!request.expectedHash)
+        state.markEvalImpure();
+
+    state.waitForPrefetch(fetchKey(who, request));
+
     Path res = getDownloader()->downloadCached(state.store, request).path;
 
     if (state.allowedPaths)
@@ -2092,6 +2317,40 @@ void fetch(EvalState & state, const Pos & pos, Value * * args, Value & v,
 }
 
 
+void EvalState::prefetchCall(const string & fun, const std::map<string, string> & args)
+{
+    if (fun == "fetchGit") {
+        prefetchGit(*this, args);
+        return;
+    }
+
+    CachedDownloadRequest request("");
+    request.unpack = fun == "fetchTarball";
+    request.name = request.unpack ? "source" : "";
+
+    try {
+        for (auto & [n, s] : args)
+            if (n == "url")
+                request.uri = s;
+            else if (n == "sha256")
+                request.expectedHash = Hash(s, htSHA256);
+            else if (n == "name")
+                request.name = s;
+            else
+                return;
+        checkURI(request.uri);
+    } catch (Error & e) {
+        return;
+    }
+
+    if (request.uri.empty()) return;
+
+    prefetch(fetchKey(fun, request), [this, request]() {
+        getDownloader()->downloadCached(store, request);
+    });
+}
+
+
 static void prim_fetchurl(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     fetch(state, pos, args, v, "fetchurl", false, "");
@@ -2149,7 +2408,10 @@ void EvalState::createBaseEnv()
     };
 
     if (!evalSettings.pureEval) {
-        mkInt(v, time(0));
+        Value * vCurrentTime = allocValue();
+        vCurrentTime->type = tPrimOp;
+        vCurrentTime->primOp = new PrimOp(prim_currentTime, 1, symbols.create("currentTime"));
+        mkApp(v, *vCurrentTime, *vCurrentTime);
         addConstant("__currentTime", v);
     }
 
@@ -2199,6 +2461,7 @@ void EvalState::createBaseEnv()
     // Strictness
     addPrimOp("__seq", 2, prim_seq);
     addPrimOp("__deepSeq", 2, prim_deepSeq);
+    addPrimOp("__memoise", 2, prim_memoise);
 
     // Debugging
     addPrimOp("__trace", 2, prim_trace);
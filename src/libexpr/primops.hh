@@ -23,4 +23,8 @@ void prim_importNative(EvalState & state, const Pos & pos, Value * * args, Value
 /* Execute a program and parse its output */
 void prim_exec(EvalState & state, const Pos & pos, Value * * args, Value & v);
 
+/* Start prefetching what a call to fetchGit with the constant
+   arguments `args' would fetch (see EvalState::prefetchCall()). */
+void prefetchGit(EvalState & state, const std::map<string, string> & args);
+
 }
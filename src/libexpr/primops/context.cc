@@ -111,9 +111,9 @@ static void prim_getContext(EvalState & state, const Pos & pos, Value * * args,
         auto & infoVal = *state.allocAttr(v, state.symbols.create(info.first));
         state.mkAttrs(infoVal, 3);
         if (info.second.path)
-            mkBool(*state.allocAttr(infoVal, sPath), true);
+            infoVal.attrs->push_back(Attr(sPath, &state.vTrue));
         if (info.second.allOutputs)
-            mkBool(*state.allocAttr(infoVal, sAllOutputs), true);
+            infoVal.attrs->push_back(Attr(sAllOutputs, &state.vTrue));
         if (!info.second.outputs.empty()) {
             auto & outputsVal = *state.allocAttr(infoVal, state.sOutputs);
             state.mkList(outputsVal, info.second.outputs.size());
@@ -147,8 +147,10 @@ static void prim_appendContext(EvalState & state, const Pos & pos, Value * * arg
     for (auto & i : *args[1]->attrs) {
         if (!state.store->isStorePath(i.name))
             throw EvalError("Context key '%s' is not a store path, at %s", i.name, i.pos);
-        if (!settings.readOnlyMode)
+        if (!settings.readOnlyMode) {
+            state.flushTexts();
             state.store->ensurePath(i.name);
+        }
         state.forceAttrs(*i.value, *i.pos);
         auto iter = i.value->attrs->find(sPath);
         if (iter != i.value->attrs->end()) {
@@ -4,9 +4,11 @@
 #include "store-api.hh"
 #include "pathlocks.hh"
 #include "hash.hh"
+#include "archive.hh"
 
 #include <sys/time.h>
 
+#include <mutex>
 #include <regex>
 
 #include <nlohmann/json.hpp>
@@ -25,6 +27,239 @@ struct GitInfo
 
 std::regex revRegex("^[0-9a-fA-F]{40}$");
 
+/* A Git tree, as listed by 'git ls-tree'. */
+struct GitTreeNode
+{
+    enum { tpRegular, tpExecutable, tpSymlink, tpDirectory } type = tpDirectory;
+    std::string object;
+    uint64_t size = 0;
+    std::string target;
+    std::map<std::string, GitTreeNode> entries;
+};
+
+/* Return the objects `objects' from the repository `repo', using 'git
+   cat-file --batch'. */
+static std::map<std::string, std::string> readGitObjects(const Path & repo,
+    const Strings & objects)
+{
+    std::map<std::string, std::string> res;
+    if (objects.empty()) return res;
+
+    std::string input;
+    for (auto & i : objects) input += i + "\n";
+
+    auto output = runProgram("git", true, { "-C", repo, "cat-file", "--batch" }, input);
+
+    size_t pos = 0;
+    for (auto & i : objects) {
+        auto eol = output.find('\n', pos);
+        if (eol == std::string::npos) throw Error("unexpected output from 'git cat-file'");
+        auto fields = tokenizeString<std::vector<std::string>>(std::string(output, pos, eol - pos), " ");
+        if (fields.size() != 3 || fields[0] != i)
+            throw Error("unexpected output from 'git cat-file': %s", std::string(output, pos, eol - pos));
+        auto size = std::stoull(fields[2]);
+        res[i] = std::string(output, eol + 1, size);
+        pos = eol + 1 + size + 1;
+    }
+
+    return res;
+}
+
+/* Read the tree of revision `rev' in `repo'.  Returns nothing if the
+   tree can't be exported faithfully without 'git archive', i.e. if
+   it has '.gitattributes' files, which may specify 'export-ignore'
+   or 'export-subst'. */
+static std::optional<GitTreeNode> readGitTree(const Path & repo, const std::string & rev)
+{
+    GitTreeNode root;
+    std::map<std::string, GitTreeNode *> symlinks;
+
+    auto listing = runProgram("git", true, { "-C", repo, "ls-tree", "-r", "-t", "-l", "-z", "--full-tree", rev });
+
+    for (auto & line : tokenizeString<Strings>(listing, "\0"s)) {
+        auto tab = line.find('\t');
+        if (tab == std::string::npos) throw Error("unexpected output from 'git ls-tree'");
+        auto fields = tokenizeString<std::vector<std::string>>(std::string(line, 0, tab), " ");
+        if (fields.size() != 4) throw Error("unexpected output from 'git ls-tree': %s", line);
+        auto & mode(fields[0]);
+
+        auto node = &root;
+        auto components = tokenizeString<std::vector<std::string>>(std::string(line, tab + 1), "/");
+        if (components.empty()) throw Error("unexpected output from 'git ls-tree': %s", line);
+        if (components.back() == ".gitattributes") return {};
+        for (auto & c : components) node = &node->entries[c];
+
+        node->object = fields[2];
+        if (mode == "100644" || mode == "100755") {
+            node->type = mode == "100755" ? GitTreeNode::tpExecutable : GitTreeNode::tpRegular;
+            node->size = std::stoull(fields[3]);
+        } else if (mode == "120000") {
+            node->type = GitTreeNode::tpSymlink;
+            symlinks[node->object] = node;
+        } else if (mode == "040000" || mode == "160000")
+            /* Submodules are exported as empty directories. */
+            node->type = GitTreeNode::tpDirectory;
+        else
+            throw Error("Git object '%s' has unsupported mode %s", fields[2], mode);
+    }
+
+    Strings objects;
+    for (auto & i : symlinks) objects.push_back(i.first);
+    for (auto & i : readGitObjects(repo, objects))
+        symlinks[i.first]->target = i.second;
+    /* Several symlinks may share an object. */
+    std::function<void(GitTreeNode &)> fixSymlinks;
+    fixSymlinks = [&](GitTreeNode & node) {
+        if (node.type == GitTreeNode::tpSymlink)
+            node.target = symlinks[node.object]->target;
+        for (auto & i : node.entries) fixSymlinks(i.second);
+    };
+    fixSymlinks(root);
+
+    return root;
+}
+
+/* Write `tree' as a NAR to `sink', streaming the contents of files
+   from the repository's object database. */
+static void dumpGitTree(const Path & repo, const GitTreeNode & tree, Sink & sink)
+{
+    /* Serialise everything but the contents of files, each of which
+       is preceded by the archive data leading up to it. */
+    struct Piece
+    {
+        std::string prefix;
+        uint64_t size;
+    };
+
+    std::vector<Piece> pieces;
+    std::string input;
+    StringSink meta;
+
+    std::function<void(const GitTreeNode &)> dumpNode;
+    dumpNode = [&](const GitTreeNode & node) {
+        meta << "(";
+        switch (node.type) {
+            case GitTreeNode::tpRegular:
+            case GitTreeNode::tpExecutable:
+                meta << "type" << "regular";
+                if (node.type == GitTreeNode::tpExecutable)
+                    meta << "executable" << "";
+                meta << "contents" << node.size;
+                pieces.push_back({*meta.s, node.size});
+                meta.s->clear();
+                input += node.object + "\n";
+                writePadding(node.size, meta);
+                break;
+            case GitTreeNode::tpSymlink:
+                meta << "type" << "symlink" << "target" << node.target;
+                break;
+            case GitTreeNode::tpDirectory:
+                meta << "type" << "directory";
+                for (auto & i : node.entries) {
+                    meta << "entry" << "(" << "name" << i.first << "node";
+                    dumpNode(i.second);
+                    meta << ")";
+                }
+                break;
+        }
+        meta << ")";
+    };
+
+    meta << narVersionMagic1;
+    dumpNode(tree);
+
+    /* Parse the output of 'git cat-file --batch', which consists of a
+       header line, the contents and a newline for every object. */
+    struct CatFileSink : Sink
+    {
+        Sink & sink;
+        const std::vector<Piece> & pieces;
+        size_t cur = 0;
+        enum { stHeader, stContents, stNewline } state = stHeader;
+        std::string header;
+        uint64_t left = 0;
+
+        CatFileSink(Sink & sink, const std::vector<Piece> & pieces)
+            : sink(sink), pieces(pieces) { }
+
+        void operator () (const unsigned char * data, size_t len) override
+        {
+            while (len) {
+                if (state == stHeader) {
+                    auto eol = (const unsigned char *) memchr(data, '\n', len);
+                    size_t n = eol ? eol - data : len;
+                    header.append((const char *) data, n);
+                    data += n; len -= n;
+                    if (!eol) continue;
+                    data++; len--;
+                    auto fields = tokenizeString<std::vector<std::string>>(header, " ");
+                    if (cur >= pieces.size() || fields.size() != 3 || fields[1] != "blob"
+                        || std::stoull(fields[2]) != pieces[cur].size)
+                        throw Error("unexpected output from 'git cat-file': %s", header);
+                    header.clear();
+                    sink(pieces[cur].prefix);
+                    left = pieces[cur].size;
+                    state = left ? stContents : stNewline;
+                } else if (state == stContents) {
+                    size_t n = std::min((uint64_t) len, left);
+                    sink(data, n);
+                    data += n; len -= n; left -= n;
+                    if (!left) state = stNewline;
+                } else {
+                    if (*data != '\n') throw Error("unexpected output from 'git cat-file'");
+                    data++; len--;
+                    cur++;
+                    state = stHeader;
+                }
+            }
+        }
+    };
+
+    CatFileSink catFileSink(sink, pieces);
+
+    if (!pieces.empty()) {
+        RunOptions options("git", { "-C", repo, "cat-file", "--batch" });
+        options.input = input;
+        options.standardOut = &catFileSink;
+        runProgram2(options);
+    }
+
+    if (catFileSink.cur != pieces.size())
+        throw Error("unexpected end of output from 'git cat-file'");
+
+    sink(*meta.s);
+}
+
+/* Add the tree of revision `rev' to the store, without writing it to
+   disk if the resulting path already exists.  Returns nothing if the
+   tree has to be exported with 'git archive'. */
+static std::optional<Path> addGitTreeToStore(ref<Store> store, const Path & repo,
+    const std::string & rev, const std::string & name)
+{
+    auto tree = readGitTree(repo, rev);
+    if (!tree) return {};
+
+    HashSink hashSink(htSHA256);
+    dumpGitTree(repo, *tree, hashSink);
+    auto hash = hashSink.finish();
+
+    ValidPathInfo info;
+    info.path = store->makeFixedOutputPath(true, hash.first, name);
+    if (store->isValidPath(info.path)) return info.path;
+
+    info.narHash = hash.first;
+    info.narSize = hash.second;
+    info.ca = makeFixedOutputCA(true, hash.first);
+    info.ultimate = true;
+
+    auto source = sinkToSource([&](Sink & sink) {
+        dumpGitTree(repo, *tree, sink);
+    });
+    store->addToStore(info, *source, NoRepair, NoCheckSigs);
+
+    return info.path;
+}
+
 GitInfo exportGit(ref<Store> store, const std::string & uri,
     std::optional<std::string> ref, std::string rev,
     const std::string & name)
@@ -89,6 +324,41 @@ GitInfo exportGit(ref<Store> store, const std::string & uri,
 
     Path cacheDir = getCacheDir() + "/nix/gitv2/" + hashString(htSHA256, uri).to_string(Base32, false);
 
+    auto getStoreLink = [&](const std::string & rev) {
+        return cacheDir + "/" + hashString(htSHA512, name + std::string("\0"s) + rev).to_string(Base32, false) + ".link";
+    };
+
+    /* Look up the store path recorded for the revision. */
+    auto lookupStoreLink = [&](const Path & storeLink, GitInfo & gitInfo) {
+        try {
+            auto json = nlohmann::json::parse(readFile(storeLink));
+
+            assert(json["name"] == name && json["rev"] == gitInfo.rev);
+
+            gitInfo.storePath = json["storePath"];
+
+            if (store->isValidPath(gitInfo.storePath)) {
+                gitInfo.revCount = json["revCount"];
+                return true;
+            }
+
+        } catch (SysError & e) {
+            if (e.errNo != ENOENT) throw;
+        }
+        return false;
+    };
+
+    /* If the revision is known, we may not need to run Git at all. */
+    if (rev != "") {
+        GitInfo gitInfo;
+        gitInfo.rev = rev;
+        gitInfo.shortRev = std::string(gitInfo.rev, 0, 7);
+        if (lookupStoreLink(getStoreLink(rev), gitInfo)) {
+            printTalkative("using cached revision %s of repo '%s'", gitInfo.rev, uri);
+            return gitInfo;
+        }
+    }
+
     if (!pathExists(cacheDir)) {
         createDirs(dirOf(cacheDir));
         runProgram("git", true, { "init", "--bare", cacheDir });
@@ -146,36 +416,24 @@ GitInfo exportGit(ref<Store> store, const std::string & uri,
 
     printTalkative("using revision %s of repo '%s'", gitInfo.rev, uri);
 
-    std::string storeLinkName = hashString(htSHA512, name + std::string("\0"s) + gitInfo.rev).to_string(Base32, false);
-    Path storeLink = cacheDir + "/" + storeLinkName + ".link";
+    Path storeLink = getStoreLink(gitInfo.rev);
     PathLocks storeLinkLock({storeLink}, fmt("waiting for lock on '%1%'...", storeLink)); // FIXME: broken
 
-    try {
-        auto json = nlohmann::json::parse(readFile(storeLink));
-
-        assert(json["name"] == name && json["rev"] == gitInfo.rev);
-
-        gitInfo.storePath = json["storePath"];
-
-        if (store->isValidPath(gitInfo.storePath)) {
-            gitInfo.revCount = json["revCount"];
-            return gitInfo;
-        }
+    if (lookupStoreLink(storeLink, gitInfo)) return gitInfo;
 
-    } catch (SysError & e) {
-        if (e.errNo != ENOENT) throw;
-    }
+    if (auto storePath = addGitTreeToStore(store, cacheDir, gitInfo.rev, name))
+        gitInfo.storePath = *storePath;
 
-    // FIXME: should pipe this, or find some better way to extract a
-    // revision.
-    auto tar = runProgram("git", true, { "-C", cacheDir, "archive", gitInfo.rev });
+    else {
+        auto tar = runProgram("git", true, { "-C", cacheDir, "archive", gitInfo.rev });
 
-    Path tmpDir = createTempDir();
-    AutoDelete delTmpDir(tmpDir, true);
+        Path tmpDir = createTempDir();
+        AutoDelete delTmpDir(tmpDir, true);
 
-    runProgram("tar", true, { "x", "-C", tmpDir }, tar);
+        runProgram("tar", true, { "x", "-C", tmpDir }, tar);
 
-    gitInfo.storePath = store->addToStore(name, tmpDir);
+        gitInfo.storePath = store->addToStore(name, tmpDir);
+    }
 
     gitInfo.revCount = std::stoull(runProgram("git", true, { "-C", cacheDir, "rev-list", "--count", gitInfo.rev }));
 
@@ -191,6 +449,54 @@ GitInfo exportGit(ref<Store> store, const std::string & uri,
     return gitInfo;
 }
 
+/* The key of the prefetch of a fetchGit call. */
+static std::string fetchGitKey(const std::string & url,
+    const std::optional<std::string> & ref, const std::string & rev,
+    const std::string & name)
+{
+    return "fetchGit\0"s + url + '\0' + (ref ? *ref : "") + '\0' + rev + '\0' + name;
+}
+
+/* exportGit() doesn't lock the Git cache of a repository, so
+   serialise the calls for the same repository in this process, now
+   that prefetches can run them concurrently. */
+static std::mutex & repoLock(const std::string & url)
+{
+    static std::mutex lock;
+    static std::map<std::string, std::mutex> repoLocks;
+    std::lock_guard<std::mutex> guard(lock);
+    return repoLocks[url];
+}
+
+void prefetchGit(EvalState & state, const std::map<string, string> & args)
+{
+    std::string url, rev, name = "source";
+    std::optional<std::string> ref;
+
+    for (auto & [n, s] : args)
+        if (n == "url") url = s;
+        else if (n == "ref") ref = s;
+        else if (n == "rev") rev = s;
+        else if (n == "name") name = s;
+        else return;
+
+    /* Without a revision, the result depends on the time of the
+       fetch, and may be a copy of a local working tree. */
+    if (url.empty() || rev.empty()) return;
+
+    try {
+        state.checkURI(url);
+    } catch (Error & e) {
+        return;
+    }
+
+    auto store = state.store;
+    state.prefetch(fetchGitKey(url, ref, rev, name), [store, url, ref, rev, name]() {
+        std::lock_guard<std::mutex> lock(repoLock(url));
+        exportGit(store, url, ref, rev, name);
+    });
+}
+
 static void prim_fetchGit(EvalState & state, const Pos & pos, Value * * args, Value & v)
 {
     std::string url;
@@ -229,7 +535,18 @@ static void prim_fetchGit(EvalState & state, const Pos & pos, Value * * args, Va
     // whitelist. Ah well.
     state.checkURI(url);
 
-    auto gitInfo = exportGit(state.store, url, ref, rev, name);
+    /* Without a revision, the result depends on the current state of
+       the repository. */
+    if (rev == "")
+        state.markEvalImpure();
+
+    state.waitForPrefetch(fetchGitKey(url, ref, rev, name));
+
+    GitInfo gitInfo;
+    {
+        std::lock_guard<std::mutex> lock(repoLock(url));
+        gitInfo = exportGit(state.store, url, ref, rev, name);
+    }
 
     state.mkAttrs(v, 8);
     mkString(*state.allocAttr(v, state.sOutPath), gitInfo.storePath, PathSet({gitInfo.storePath}));
@@ -200,6 +200,11 @@ static void prim_fetchMercurial(EvalState & state, const Pos & pos, Value * * ar
     // whitelist. Ah well.
     state.checkURI(url);
 
+    /* Without a revision, the result depends on the current state of
+       the repository. */
+    if (rev == "")
+        state.markEvalImpure();
+
     auto hgInfo = exportMercurial(state.store, url, rev, name);
 
     state.mkAttrs(v, 8);
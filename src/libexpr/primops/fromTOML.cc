@@ -1,87 +1,599 @@
 #include "primops.hh"
 #include "eval-inline.hh"
 
-#include "cpptoml/cpptoml.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <deque>
+#include <locale>
+#include <sstream>
+#include <string_view>
+#include <unordered_map>
 
 namespace nix {
 
-static void prim_fromTOML(EvalState & state, const Pos & pos, Value * * args, Value & v)
+
+MakeError(TOMLParseError, Error)
+
+
+static const char * copyString(std::string_view s)
 {
-    using namespace cpptoml;
+#if HAVE_BOEHMGC
+    auto t = (char *) GC_MALLOC_ATOMIC(s.size() + 1);
+#else
+    auto t = (char *) malloc(s.size() + 1);
+#endif
+    if (!t) throw std::bad_alloc();
+    memcpy(t, s.data(), s.size());
+    t[s.size()] = 0;
+    return t;
+}
 
-    auto toml = state.forceStringNoCtx(*args[0], pos);
 
-    std::istringstream tomlStream(toml);
+/* A single-pass TOML parser that produces Nix values directly.
+   Scalars, arrays and inline tables are turned into values as soon
+   as they have been parsed.  Only tables that may still be extended
+   by later headers or dotted keys are kept in an intermediate form,
+   which is a vector of members per table rather than a map, and
+   which is converted into attribute sets at the end.  As in the JSON
+   parser, keys without escapes are looked up in a per-parse cache
+   before going to the symbol table. */
+struct TOMLParser
+{
+    struct Table;
+
+#if HAVE_BOEHMGC
+    typedef std::vector<Table *, gc_allocator<Table *>> Tables;
+#else
+    typedef std::vector<Table *> Tables;
+#endif
 
-    std::function<void(Value &, std::shared_ptr<base>)> visit;
+    struct Node
+    {
+        enum { tValue, tTable, tTableArray } type;
+        Value * value = nullptr;
+        Table * table = nullptr;
+        Tables tables;
+    };
 
-    visit = [&](Value & v, std::shared_ptr<base> t) {
+    struct Table
+    {
+#if HAVE_BOEHMGC
+        std::vector<std::pair<Symbol, Node>, gc_allocator<std::pair<Symbol, Node>>> members;
+#else
+        std::vector<std::pair<Symbol, Node>> members;
+#endif
 
-        if (auto t2 = t->as_table()) {
+        /* Index of `members', only built for large tables. */
+        std::unordered_map<uint32_t, size_t> index;
 
-            size_t size = 0;
-            for (auto & i : *t2) { (void) i; size++; }
+        /* Whether this table has appeared in a [header], or was
+           created by a dotted key.  Neither kind may be extended by
+           the other. */
+        bool defined = false;
+        bool dotted = false;
 
-            state.mkAttrs(v, size);
+        Node * find(Symbol name)
+        {
+            if (members.size() <= 16) {
+                for (auto & i : members)
+                    if (i.first == name) return &i.second;
+                return nullptr;
+            }
+            if (index.size() != members.size())
+                for (size_t n = index.size(); n < members.size(); ++n)
+                    index.emplace(members[n].first.id(), n);
+            auto i = index.find(name.id());
+            return i == index.end() ? nullptr : &members[i->second].second;
+        }
 
-            for (auto & i : *t2) {
-                auto & v2 = *state.allocAttr(v, state.symbols.create(i.first));
+        Node & add(Symbol name)
+        {
+            members.emplace_back(name, Node());
+            return members.back().second;
+        }
+    };
 
-                if (auto i2 = i.second->as_table_array()) {
-                    size_t size2 = i2->get().size();
-                    state.mkList(v2, size2);
-                    for (size_t j = 0; j < size2; ++j)
-                        visit(*(v2.listElems()[j] = state.allocValue()), i2->get()[j]);
-                }
-                else
-                    visit(v2, i.second);
+    EvalState & state;
+    const char * start;
+    const char * s;
+
+#if HAVE_BOEHMGC
+    std::deque<Table, gc_allocator<Table>> tables;
+#else
+    std::deque<Table> tables;
+#endif
+
+    /* Elements of the arrays currently being parsed. */
+    ValueVector values;
+
+    /* Symbols for keys seen so far.  The keys point into the input,
+       which outlives the parser. */
+    std::unordered_map<std::string_view, Symbol> keys;
+
+    std::string buf;
+
+    TOMLParser(EvalState & state, const char * s) : state(state), start(s), s(s) { }
+
+    [[noreturn]] void fail(const std::string & msg)
+    {
+        throw TOMLParseError("%s on line %d", msg, 1 + std::count(start, s, '\n'));
+    }
+
+    Table * newTable()
+    {
+        tables.emplace_back();
+        return &tables.back();
+    }
+
+    void skipSpaces()
+    {
+        while (*s == ' ' || *s == '\t') s++;
+    }
+
+    /* Skip whitespace, newlines and comments. */
+    void skipWhitespace()
+    {
+        while (true) {
+            if (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
+            else if (*s == '#') skipComment();
+            else break;
+        }
+    }
+
+    void skipComment()
+    {
+        while (*s && *s != '\n') s++;
+    }
+
+    /* Skip the rest of a line, which may only contain a comment. */
+    void expectNewline()
+    {
+        skipSpaces();
+        if (*s == '#') skipComment();
+        if (*s == '\r') s++;
+        if (*s == '\n') s++;
+        else if (*s) fail("expected a newline");
+    }
+
+    static bool isBareKeyChar(char c)
+    {
+        return isalnum((unsigned char) c) || c == '_' || c == '-';
+    }
+
+    void appendUTF8(uint32_t c)
+    {
+        if (c < 0x80)
+            buf += (char) c;
+        else if (c < 0x800) {
+            buf += (char) (0xc0 | (c >> 6));
+            buf += (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            if (c >= 0xd800 && c < 0xe000) fail("invalid Unicode escape in TOML string");
+            buf += (char) (0xe0 | (c >> 12));
+            buf += (char) (0x80 | ((c >> 6) & 0x3f));
+            buf += (char) (0x80 | (c & 0x3f));
+        } else if (c < 0x110000) {
+            buf += (char) (0xf0 | (c >> 18));
+            buf += (char) (0x80 | ((c >> 12) & 0x3f));
+            buf += (char) (0x80 | ((c >> 6) & 0x3f));
+            buf += (char) (0x80 | (c & 0x3f));
+        } else
+            fail("invalid Unicode escape in TOML string");
+    }
+
+    void parseEscape()
+    {
+        s++;
+        switch (*s++) {
+            case 'b': buf += '\b'; break;
+            case 't': buf += '\t'; break;
+            case 'n': buf += '\n'; break;
+            case 'f': buf += '\f'; break;
+            case 'r': buf += '\r'; break;
+            case '"': buf += '"'; break;
+            case '\\': buf += '\\'; break;
+            case 'u': case 'U': {
+                size_t len = s[-1] == 'u' ? 4 : 8;
+                uint32_t c;
+                auto res = std::from_chars(s, s + len, c, 16);
+                if (res.ec != std::errc() || res.ptr != s + len)
+                    fail("invalid Unicode escape in TOML string");
+                s += len;
+                appendUTF8(c);
+                break;
             }
+            default:
+                s--;
+                fail("invalid escape in TOML string");
+        }
+    }
 
-            v.attrs->sort();
+    /* Parse a string starting at `s'.  If it can be returned as is,
+       the result points into the input; otherwise it points into
+       `buf'. */
+    std::string_view parseString()
+    {
+        char quote = *s;
+        bool multiline = s[1] == quote && s[2] == quote;
+
+        if (!multiline) {
+            const char * begin = ++s;
+            while (*s != quote && (*s != '\\' || quote == '\'') && *s && *s != '\n') s++;
+            if (*s == quote)
+                return std::string_view(begin, s++ - begin);
+            if (*s != '\\')
+                fail("unterminated TOML string");
+            buf.assign(begin, s - begin);
+            while (*s != quote) {
+                if (!*s || *s == '\n') fail("unterminated TOML string");
+                if (*s == '\\') parseEscape();
+                else buf += *s++;
+            }
+            s++;
+            return buf;
         }
 
-        else if (auto t2 = t->as_array()) {
-            size_t size = t2->get().size();
+        /* Multi-line strings.  A newline right after the opening
+           delimiter is ignored. */
+        s += 3;
+        if (*s == '\r' && s[1] == '\n') s += 2;
+        else if (*s == '\n') s++;
 
-            state.mkList(v, size);
+        buf.clear();
+        while (true) {
+            if (!*s) fail("unterminated TOML string");
+            if (s[0] == quote && s[1] == quote && s[2] == quote) {
+                /* Up to two quotes may precede the closing
+                   delimiter. */
+                size_t extra = 0;
+                while (extra < 2 && s[3 + extra] == quote) extra++;
+                buf.append(s, extra);
+                s += 3 + extra;
+                return buf;
+            }
+            if (*s == '\\' && quote == '"') {
+                /* A backslash at the end of a line removes the
+                   newline and any whitespace after it. */
+                const char * p = s + 1;
+                while (*p == ' ' || *p == '\t') p++;
+                if (*p == '\r') p++;
+                if (*p == '\n') {
+                    s = p;
+                    while (*s == ' ' || *s == '\t' || *s == '\n' || *s == '\r') s++;
+                } else
+                    parseEscape();
+            } else
+                buf += *s++;
+        }
+    }
 
-            for (size_t i = 0; i < size; ++i)
-                visit(*(v.listElems()[i] = state.allocValue()), t2->get()[i]);
+    Symbol parseSimpleKey()
+    {
+        if (*s == '"' || *s == '\'') {
+            const char * begin = s;
+            auto key = parseString();
+            if (key.data() != begin + 1)
+                return state.symbols.create(key);
+            return lookupKey(key);
         }
 
-        // Handle cases like 'a = [[{ a = true }]]', which IMHO should be
-        // parsed as a array containing an array containing a table,
-        // but instead are parsed as an array containing a table array
-        // containing a table.
-        else if (auto t2 = t->as_table_array()) {
-            size_t size = t2->get().size();
+        const char * begin = s;
+        while (isBareKeyChar(*s)) s++;
+        if (s == begin) fail("expected a TOML key");
+        return lookupKey(std::string_view(begin, s - begin));
+    }
 
-            state.mkList(v, size);
+    Symbol lookupKey(std::string_view key)
+    {
+        auto i = keys.find(key);
+        if (i != keys.end()) return i->second;
+        auto sym = state.symbols.create(key);
+        keys.emplace(key, sym);
+        return sym;
+    }
 
-            for (size_t j = 0; j < size; ++j)
-                visit(*(v.listElems()[j] = state.allocValue()), t2->get()[j]);
+    /* Parse a possibly dotted key. */
+    void parseKey(std::vector<Symbol> & path)
+    {
+        path.clear();
+        while (true) {
+            skipSpaces();
+            path.push_back(parseSimpleKey());
+            skipSpaces();
+            if (*s != '.') break;
+            s++;
         }
+    }
 
-        else if (t->is_value()) {
-            if (auto val = t->as<int64_t>())
-                mkInt(v, val->get());
-            else if (auto val = t->as<NixFloat>())
-                mkFloat(v, val->get());
-            else if (auto val = t->as<bool>())
-                mkBool(v, val->get());
-            else if (auto val = t->as<std::string>())
-                mkString(v, val->get());
-            else
-                throw EvalError("unsupported value type in TOML");
+    /* Return the table `name' in `table', creating it if necessary.
+       For an array of tables, this is its last element.  If `dotted',
+       `name' is part of a dotted key, which can't extend tables
+       defined by headers. */
+    Table * descend(Table * table, Symbol name, bool dotted)
+    {
+        auto node = table->find(name);
+        if (!node) {
+            auto & node2 = table->add(name);
+            node2.type = Node::tTable;
+            node2.table = newTable();
+            node2.table->dotted = dotted;
+            return node2.table;
         }
+        if (node->type == Node::tTable && !(dotted && node->table->defined))
+            return node->table;
+        if (node->type == Node::tTableArray && !dotted)
+            return node->tables.back();
+        if (node->type != Node::tValue)
+            fail(fmt("table '%s' is defined more than once", name));
+        fail(fmt("key '%s' is not a table", name));
+    }
 
-        else abort();
-    };
+    void parseHeader(Table * & current)
+    {
+        bool array = s[1] == '[';
+        s += array ? 2 : 1;
+
+        std::vector<Symbol> path;
+        parseKey(path);
+
+        if (*s++ != ']' || (array && *s++ != ']'))
+            fail("expected ']' after TOML table header");
+
+        Table * table = &tables.front();
+        for (size_t n = 0; n + 1 < path.size(); ++n)
+            table = descend(table, path[n], false);
+
+        auto name = path.back();
+        auto node = table->find(name);
+
+        if (array) {
+            if (!node) {
+                node = &table->add(name);
+                node->type = Node::tTableArray;
+            } else if (node->type != Node::tTableArray)
+                fail(fmt("key '%s' is not an array of tables", name));
+            node->tables.push_back(newTable());
+            current = node->tables.back();
+        }
+
+        else {
+            if (!node) {
+                node = &table->add(name);
+                node->type = Node::tTable;
+                node->table = newTable();
+            } else if (node->type != Node::tTable || node->table->defined || node->table->dotted)
+                fail(fmt("table '%s' is defined more than once", name));
+            current = node->table;
+            current->defined = true;
+        }
+
+        expectNewline();
+    }
+
+    void parseKeyValue(Table * table, std::vector<Symbol> & path)
+    {
+        parseKey(path);
+        if (*s++ != '=') fail("expected '=' after TOML key");
+        skipSpaces();
+
+        for (size_t n = 0; n + 1 < path.size(); ++n)
+            table = descend(table, path[n], true);
+
+        auto name = path.back();
+        if (table->find(name))
+            fail(fmt("key '%s' is defined more than once", name));
+
+        Value v;
+        parseValue(v);
+
+        /* Add the member after parsing the value, since that may add
+           members to other tables. */
+        auto & node = table->add(name);
+        node.type = Node::tValue;
+        node.value = state.shareValue(v);
+    }
+
+    void parseNumber(Value & v)
+    {
+        const char * begin = s;
+        while (isalnum((unsigned char) *s) || *s == '_' || *s == '+' || *s == '-' || *s == '.' || *s == ':')
+            s++;
+        std::string_view token(begin, s - begin);
+
+        /* Nix has no date or time type. */
+        if (token.find(':') != token.npos ||
+            (token.size() >= 10 && token[4] == '-' && token[7] == '-'))
+            throw TOMLParseError("unsupported value type in TOML");
+
+        auto sign = token[0] == '+' || token[0] == '-' ? token.substr(0, 1) : "";
+        auto body = token.substr(sign.size());
+
+        if (body == "inf" || body == "nan") {
+            mkFloat(v, body == "inf"
+                ? (sign == "-" ? -1 : 1) * std::numeric_limits<NixFloat>::infinity()
+                : std::numeric_limits<NixFloat>::quiet_NaN());
+            return;
+        }
+
+        int base = 10;
+        if (body.size() > 2 && body[0] == '0' && (body[1] == 'x' || body[1] == 'o' || body[1] == 'b')) {
+            if (!sign.empty()) fail("invalid TOML number");
+            base = body[1] == 'x' ? 16 : body[1] == 'o' ? 8 : 2;
+            body = body.substr(2);
+        }
+
+        /* Remove underscores, which must be between digits. */
+        auto isDigit = [&](char c) {
+            return base == 10 ? isdigit((unsigned char) c) : isxdigit((unsigned char) c);
+        };
+        buf.assign(sign);
+        for (size_t n = 0; n < body.size(); ++n) {
+            if (body[n] != '_') { buf += body[n]; continue; }
+            if (n == 0 || n + 1 == body.size() || !isDigit(body[n - 1]) || !isDigit(body[n + 1]))
+                fail("invalid TOML number");
+        }
+
+        /* Check decimal numbers against the TOML grammar, which is
+           stricter than that of strtod() or from_chars(): the integer
+           part has no leading zeros, and the fraction and exponent
+           have at least one digit. */
+        bool isFloat = false;
+        if (base == 10) {
+            size_t n = sign.size();
+            auto digits = [&]() {
+                auto begin = n;
+                while (n < buf.size() && isdigit((unsigned char) buf[n])) n++;
+                return n - begin;
+            };
+            auto intDigits = digits();
+            if (!intDigits || (intDigits > 1 && buf[sign.size()] == '0'))
+                fail("invalid TOML number");
+            if (n < buf.size() && buf[n] == '.') {
+                n++;
+                if (!digits()) fail("invalid TOML number");
+                isFloat = true;
+            }
+            if (n < buf.size() && (buf[n] == 'e' || buf[n] == 'E')) {
+                n++;
+                if (n < buf.size() && (buf[n] == '+' || buf[n] == '-')) n++;
+                if (!digits()) fail("invalid TOML number");
+                isFloat = true;
+            }
+            if (n != buf.size()) fail("invalid TOML number");
+        }
+
+        if (isFloat) {
+            /* Not strtod(), which uses the decimal point of the
+               current locale. */
+            std::istringstream str(buf);
+            str.imbue(std::locale::classic());
+            NixFloat d;
+            str >> d;
+            if (str.fail())
+                fail("out-of-range TOML number");
+            mkFloat(v, d);
+        } else {
+            NixInt n;
+            const char * p = buf.c_str() + (buf[0] == '+');
+            auto res = std::from_chars(p, buf.c_str() + buf.size(), n, base);
+            if (res.ec == std::errc::result_out_of_range)
+                fail("out-of-range TOML number");
+            if (res.ec != std::errc() || res.ptr != buf.c_str() + buf.size())
+                fail("invalid TOML number");
+            mkInt(v, n);
+        }
+    }
+
+    void parseValue(Value & v)
+    {
+        if (*s == '"' || *s == '\'')
+            mkStringNoCopy(v, copyString(parseString()));
+
+        else if (*s == '[') {
+            s++;
+            size_t base = values.size();
+            while (true) {
+                skipWhitespace();
+                if (*s == ']') break;
+                Value v2;
+                parseValue(v2);
+                values.push_back(state.shareValue(v2));
+                skipWhitespace();
+                if (*s == ']') break;
+                if (*s++ != ',') fail("expected ',' or ']' after TOML array element");
+            }
+            s++;
+            state.mkList(v, values.size() - base);
+            std::copy(values.begin() + base, values.end(), v.listElems());
+            values.resize(base);
+        }
+
+        else if (*s == '{') {
+            s++;
+            auto table = newTable();
+            std::vector<Symbol> path;
+            skipSpaces();
+            if (*s != '}')
+                while (true) {
+                    parseKeyValue(table, path);
+                    skipSpaces();
+                    if (*s == '}') break;
+                    if (*s++ != ',') fail("expected ',' or '}' after TOML inline table member");
+                }
+            s++;
+            build(v, *table);
+        }
+
+        else if (strncmp(s, "true", 4) == 0 && !isBareKeyChar(s[4])) {
+            s += 4;
+            mkBool(v, true);
+        }
+
+        else if (strncmp(s, "false", 5) == 0 && !isBareKeyChar(s[5])) {
+            s += 5;
+            mkBool(v, false);
+        }
+
+        else if (isdigit((unsigned char) *s) || *s == '+' || *s == '-' || *s == 'i' || *s == 'n')
+            parseNumber(v);
+
+        else
+            fail("expected a TOML value");
+    }
+
+    void build(Value & v, Table & table)
+    {
+        state.mkAttrs(v, table.members.size());
+        for (auto & [name, node] : table.members) {
+            Value * v2 = node.value;
+            if (node.type == Node::tTable) {
+                v2 = state.allocValue();
+                build(*v2, *node.table);
+            } else if (node.type == Node::tTableArray) {
+                v2 = state.allocValue();
+                state.mkList(*v2, node.tables.size());
+                for (size_t n = 0; n < node.tables.size(); ++n)
+                    build(*(v2->listElems()[n] = state.allocValue()), *node.tables[n]);
+            }
+            v.attrs->push_back(Attr(name, v2));
+        }
+        v.attrs->sort();
+    }
+
+    void parse(Value & v)
+    {
+        Table * current = newTable();
+        std::vector<Symbol> path;
+
+        while (true) {
+            skipWhitespace();
+            if (!*s) break;
+            if (*s == '[')
+                parseHeader(current);
+            else {
+                parseKeyValue(current, path);
+                expectNewline();
+            }
+        }
+
+        build(v, tables.front());
+    }
+};
+
+
+static void prim_fromTOML(EvalState & state, const Pos & pos, Value * * args, Value & v)
+{
+    auto toml = state.forceStringNoCtx(*args[0], pos);
+
+    TOMLParser parser(state, toml.c_str());
 
     try {
-        visit(v, parser(tomlStream).parse());
-    } catch (std::runtime_error & e) {
-        throw EvalError("while parsing a TOML string at %s: %s", pos, e.what());
+        parser.parse(v);
+        if (parser.s != toml.c_str() + toml.size())
+            parser.fail("unexpected NUL character");
+    } catch (TOMLParseError & e) {
+        throw EvalError("while parsing a TOML string at %s: %s", pos, e.msg());
     }
 }
 
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
 #include <map>
-#include <unordered_set>
+#include <mutex>
+#include <string_view>
+#include <vector>
 
 #include "types.hh"
 
@@ -13,44 +17,67 @@ namespace nix {
    they can be compared efficiently (using a pointer equality test),
    because the symbol table stores only one copy of each string. */
 
+/* The data of a symbol, stored in the symbol table: its string, a
+   precomputed hash and a dense integer id (symbols are numbered
+   0, 1, ... in order of creation). */
+struct SymbolData
+{
+    const string s;
+    const uint32_t hash;
+    const uint32_t id;
+    SymbolData(std::string_view s, uint32_t hash, uint32_t id)
+        : s(s), hash(hash), id(id) { }
+};
+
 class Symbol
 {
 private:
-    const string * s; // pointer into SymbolTable
-    Symbol(const string * s) : s(s) { };
+    const SymbolData * d; // pointer into SymbolTable
+    Symbol(const SymbolData * d) : d(d) { };
     friend class SymbolTable;
 
 public:
-    Symbol() : s(0) { };
+    Symbol() : d(0) { };
 
     bool operator == (const Symbol & s2) const
     {
-        return s == s2.s;
+        return d == s2.d;
     }
 
     bool operator != (const Symbol & s2) const
     {
-        return s != s2.s;
+        return d != s2.d;
     }
 
     bool operator < (const Symbol & s2) const
     {
-        return s < s2.s;
+        return d < s2.d;
     }
 
     operator const string & () const
     {
-        return *s;
+        return d->s;
     }
 
     bool set() const
     {
-        return s;
+        return d;
     }
 
     bool empty() const
     {
-        return s->empty();
+        return d->s.empty();
+    }
+
+    /* A hash of the symbol, for use in hash tables. */
+    uint32_t hash() const
+    {
+        return d->hash;
+    }
+
+    uint32_t id() const
+    {
+        return d->id;
     }
 
     friend std::ostream & operator << (std::ostream & str, const Symbol & sym);
@@ -59,19 +86,41 @@ public:
 class SymbolTable
 {
 private:
-    typedef std::unordered_set<string> Symbols;
-    Symbols symbols;
+    /* The table is split into shards, selected by the high bits of
+       the hash, so that threads creating symbols during parallel
+       evaluation rarely contend for the same lock.  Each shard is an
+       open addressing hash table of pointers to SymbolData objects,
+       which are stored in a deque so that their addresses are
+       stable. */
+    static const size_t nrShards = 16;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::vector<const SymbolData *> slots;
+        std::deque<SymbolData> data;
+    };
+
+    Shard shards[nrShards];
+
+    std::atomic<uint32_t> nextId{0};
 
 public:
+    Symbol create(std::string_view s);
+
     Symbol create(const string & s)
     {
-        std::pair<Symbols::iterator, bool> res = symbols.insert(s);
-        return Symbol(&*res.first);
+        return create(std::string_view(s));
+    }
+
+    Symbol create(const char * s)
+    {
+        return create(std::string_view(s));
     }
 
     size_t size() const
     {
-        return symbols.size();
+        return nextId;
     }
 
     size_t totalSize() const;
@@ -79,8 +128,11 @@ public:
     template<typename T>
     void dump(T callback)
     {
-        for (auto & s : symbols)
-            callback(s);
+        for (auto & shard : shards) {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            for (auto & d : shard.data)
+                callback(d.s);
+        }
     }
 };
 
@@ -32,21 +32,14 @@ static void posToXML(XMLAttrs & xmlAttrs, const Pos & pos)
 static void showAttrs(EvalState & state, bool strict, bool location,
     Bindings & attrs, XMLWriter & doc, PathSet & context, PathSet & drvsSeen)
 {
-    StringSet names;
-
-    for (auto & i : attrs)
-        names.insert(i.name);
-
-    for (auto & i : names) {
-        Attr & a(*attrs.find(state.symbols.create(i)));
-
+    for (auto & a : attrs.lexicographicOrder()) {
         XMLAttrs xmlAttrs;
-        xmlAttrs["name"] = i;
-        if (location && a.pos != &noPos) posToXML(xmlAttrs, *a.pos);
+        xmlAttrs["name"] = a->name;
+        if (location && a->pos != &noPos) posToXML(xmlAttrs, *a->pos);
 
         XMLOpenElement _(doc, "attr", xmlAttrs);
         printValueAsXML(state, strict, location,
-            *a.value, doc, context, drvsSeen);
+            *a->value, doc, context, drvsSeen);
     }
 }
 
@@ -357,10 +357,16 @@ string showBytes(unsigned long long bytes)
 
 PrintFreed::~PrintFreed()
 {
-    if (show)
-        std::cout << format("%1% store paths deleted, %2% freed\n")
+    if (show) {
+        std::cout << format("%1% store paths deleted, %2% freed")
             % results.paths.size()
             % showBytes(results.bytesFreed);
+        if (results.deletionTime > 0)
+            std::cout << format(" (%1% files, %2$.0f files/s)")
+                % results.filesDeleted
+                % (results.filesDeleted / results.deletionTime);
+        std::cout << "\n";
+    }
 }
 
 Exit::~Exit() { }
@@ -2,6 +2,7 @@
 #include "binary-cache-store.hh"
 #include "compression.hh"
 #include "derivations.hh"
+#include "download.hh"
 #include "fs-accessor.hh"
 #include "globals.hh"
 #include "nar-info.hh"
@@ -10,11 +11,15 @@
 #include "nar-info-disk-cache.hh"
 #include "nar-accessor.hh"
 #include "json.hh"
+#include "nar-chunks.hh"
+#include "thread-pool.hh"
 
 #include <chrono>
 
 #include <future>
 
+#include <fcntl.h>
+
 namespace nix {
 
 BinaryCacheStore::BinaryCacheStore(const Params & params)
@@ -28,30 +33,65 @@ BinaryCacheStore::BinaryCacheStore(const Params & params)
     narMagic = *sink.s;
 }
 
-void BinaryCacheStore::init()
+static const std::string cacheInfoFile = "nix-cache-info";
+
+/* The length of the hash prefix by which new .narinfo indexes are
+   sharded, giving 1024 shards. */
+static const int defaultNarInfoIndexPrefix = 2;
+
+static std::map<std::string, std::string> parseCacheInfo(const std::string & s)
+{
+    std::map<std::string, std::string> res;
+    for (auto & line : tokenizeString<Strings>(s, "\n")) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        res[line.substr(0, colon)] = trim(line.substr(colon + 1, std::string::npos));
+    }
+    return res;
+}
+
+static int getNarInfoIndexPrefix(const std::map<std::string, std::string> & cacheInfo)
 {
-    std::string cacheInfoFile = "nix-cache-info";
+    int prefix = 0;
+    auto i = cacheInfo.find("NarInfoIndex");
+    if (i != cacheInfo.end() && (!string2Int(i->second, prefix) || prefix < 0 || prefix > 32))
+        prefix = 0;
+    return prefix;
+}
 
+void BinaryCacheStore::init()
+{
     auto cacheInfo = getFile(cacheInfoFile);
     if (!cacheInfo) {
-        upsertFile(cacheInfoFile, "StoreDir: " + storeDir + "\n", "text/x-nix-cache-info");
-    } else {
-        for (auto & line : tokenizeString<Strings>(*cacheInfo, "\n")) {
-            size_t colon = line.find(':');
-            if (colon == std::string::npos) continue;
-            auto name = line.substr(0, colon);
-            auto value = trim(line.substr(colon + 1, std::string::npos));
-            if (name == "StoreDir") {
-                if (value != storeDir)
-                    throw Error(format("binary cache '%s' is for Nix stores with prefix '%s', not '%s'")
-                        % getUri() % value % storeDir);
-            } else if (name == "WantMassQuery") {
-                wantMassQuery_ = value == "1";
-            } else if (name == "Priority") {
-                string2Int(value, priority);
-            }
+        cacheInfo = std::make_shared<std::string>("StoreDir: " + storeDir + "\n");
+        upsertFile(cacheInfoFile, *cacheInfo, "text/x-nix-cache-info");
+    }
+
+    auto fields = parseCacheInfo(*cacheInfo);
+
+    for (auto & i : fields) {
+        if (i.first == "StoreDir") {
+            if (i.second != storeDir)
+                throw Error(format("binary cache '%s' is for Nix stores with prefix '%s', not '%s'")
+                    % getUri() % i.second % storeDir);
+        } else if (i.first == "WantMassQuery") {
+            wantMassQuery_ = i.second == "1";
+        } else if (i.first == "Priority") {
+            string2Int(i.second, priority);
         }
     }
+
+    narInfoIndexPrefix = getNarInfoIndexPrefix(fields);
+
+    /* Advertise the index to clients. Paths added before it was
+       enabled aren't in it, but clients fall back to the individual
+       .narinfo files. */
+    if (writeNarInfoIndex && !narInfoIndexPrefix) {
+        narInfoIndexPrefix = defaultNarInfoIndexPrefix;
+        upsertFile(cacheInfoFile,
+            *cacheInfo + fmt("NarInfoIndex: %d\n", defaultNarInfoIndexPrefix),
+            "text/x-nix-cache-info");
+    }
 }
 
 void BinaryCacheStore::getFile(const std::string & path,
@@ -77,6 +117,24 @@ void BinaryCacheStore::getFile(const std::string & path, Sink & sink)
     sink((unsigned char *) data->data(), data->size());
 }
 
+std::string BinaryCacheStore::getFileRange(const std::string & path,
+    uint64_t offset, uint64_t length)
+{
+    auto data = getFile(path);
+    if (!data)
+        throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+    if (offset + length > data->size())
+        throw Error("range %d-%d is outside of file '%s' in binary cache '%s'",
+            offset, offset + length, path, getUri());
+    return std::string(*data, offset, length);
+}
+
+void BinaryCacheStore::upsertFileFromPath(const std::string & path,
+    const Path & srcPath, const std::string & mimeType)
+{
+    upsertFile(path, readFile(srcPath), mimeType);
+}
+
 std::shared_ptr<std::string> BinaryCacheStore::getFile(const std::string & path)
 {
     StringSink sink;
@@ -94,28 +152,218 @@ Path BinaryCacheStore::narInfoFileFor(const Path & storePath)
     return storePathToHash(storePath) + ".narinfo";
 }
 
+/* The .narinfo index consists of xz-compressed files containing the
+   .narinfo files of all paths whose hash part starts with a given
+   prefix, separated by empty lines. */
+static std::string narInfoIndexFileFor(const std::string & shard)
+{
+    return "narinfo-index/" + shard + ".xz";
+}
+
+/* Split a .narinfo index shard into the .narinfo files it contains,
+   keyed by hash part. */
+static std::map<std::string, std::string> splitNarInfoShard(const std::string & s)
+{
+    std::map<std::string, std::string> res;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        auto end = s.find("\n\n", pos);
+        auto entry = s.substr(pos, end == std::string::npos ? std::string::npos : end + 1 - pos);
+        pos = end == std::string::npos ? s.size() : end + 2;
+        if (!hasPrefix(entry, "StorePath: ")) continue;
+        auto path = entry.substr(11, entry.find('\n') - 11);
+        auto slash = path.rfind('/');
+        if (slash == std::string::npos) continue;
+        res[std::string(path, slash + 1, storePathHashLen)] = entry;
+    }
+    return res;
+}
+
+void BinaryCacheStore::lookupNarInfoIndex(const std::string & hashPart,
+    std::function<void(std::shared_ptr<NarInfo>)> done)
+{
+    int prefix = narInfoIndexPrefix;
+
+    if (prefix == -1) {
+        /* nix-cache-info wasn't read because the cache's properties
+           were cached, so fetch it now. */
+        try {
+            getFile(cacheInfoFile,
+                {[this, hashPart, done](std::future<std::shared_ptr<std::string>> fut) {
+                    int prefix = 0;
+                    try {
+                        auto data = fut.get();
+                        if (data) prefix = getNarInfoIndexPrefix(parseCacheInfo(*data));
+                    } catch (std::exception & e) {
+                        printError("warning: not using the .narinfo index of '%s': %s", getUri(), e.what());
+                    }
+                    narInfoIndexPrefix = prefix;
+                    lookupNarInfoIndex(hashPart, done);
+                }});
+            return;
+        } catch (std::exception & e) {
+            printError("warning: not using the .narinfo index of '%s': %s", getUri(), e.what());
+            narInfoIndexPrefix = prefix = 0;
+        }
+    }
+
+    if (prefix == 0 || (size_t) prefix > hashPart.size()) return done(nullptr);
+
+    auto shard = hashPart.substr(0, prefix);
+
+    {
+        auto state(narInfoIndexState.lock());
+        if (!state->fetched.count(shard)) {
+            auto & waiters = state->pending[shard];
+            waiters.push_back([hashPart, done](const NarInfoShard & entries) {
+                auto i = entries.find(hashPart);
+                done(i == entries.end() ? nullptr : i->second);
+            });
+            /* Somebody else is already fetching this shard. */
+            if (waiters.size() > 1) return;
+        } else
+            shard = "";
+    }
+
+    if (shard == "") return done(nullptr);
+
+    debug("fetching .narinfo index shard '%s' from '%s'", shard, getUri());
+
+    auto finish = [this, shard](const NarInfoShard & entries) {
+        /* Put the entire shard in the path info caches, so that
+           queries for the other paths in it are answered locally. */
+        std::map<std::string, std::shared_ptr<ValidPathInfo>> infos;
+        for (auto & i : entries) {
+            if (auto hash = storePathHash(i.second->path))
+                pathInfoCache.upsert(*hash, std::shared_ptr<ValidPathInfo>(i.second));
+            infos.emplace(i.first, i.second);
+        }
+        if (diskCache)
+            diskCache->upsertNarInfos(getUri(), infos);
+
+        std::vector<std::function<void(const NarInfoShard &)>> waiters;
+        {
+            auto state(narInfoIndexState.lock());
+            state->fetched.insert(shard);
+            waiters = std::move(state->pending[shard]);
+            state->pending.erase(shard);
+        }
+
+        for (auto & waiter : waiters)
+            waiter(entries);
+    };
+
+    try {
+        getFile(narInfoIndexFileFor(shard),
+            {[this, shard, finish](std::future<std::shared_ptr<std::string>> fut) {
+                NarInfoShard entries;
+
+                try {
+                    auto data = fut.get();
+                    if (data) {
+                        auto whence = narInfoIndexFileFor(shard);
+                        for (auto & i : splitNarInfoShard(*decompress("xz", *data)))
+                            try {
+                                entries[i.first] = std::make_shared<NarInfo>(*this, i.second, whence);
+                            } catch (Error & e) {
+                                printError("ignoring invalid entry in '%s': %s", whence, e.what());
+                            }
+                    }
+                } catch (std::exception & e) {
+                    printError("warning: cannot read .narinfo index shard '%s' of '%s', "
+                        "using individual .narinfo files instead: %s", shard, getUri(), e.what());
+                }
+
+                finish(entries);
+            }});
+    } catch (std::exception & e) {
+        printError("warning: cannot read .narinfo index shard '%s' of '%s', "
+            "using individual .narinfo files instead: %s", shard, getUri(), e.what());
+        finish({});
+    }
+}
+
+void BinaryCacheStore::updateNarInfoIndex(ref<NarInfo> narInfo)
+{
+    auto hashPart = storePathToHash(narInfo->path);
+    auto shard = hashPart.substr(0, narInfoIndexPrefix);
+
+    /* Rewriting a shard costs the same for one new entry as for
+       many, so batch the updates: a writer that finds nobody writing
+       the shard writes all entries queued for it so far, and the
+       others wait for that write to finish. */
+    std::shared_ptr<NarInfoIndexBatch> batch;
+    {
+        auto writes(narInfoIndexWrites_.lock());
+        auto & s(writes->shards[shard]);
+        if (!s.next) s.next = std::make_shared<NarInfoIndexBatch>();
+        batch = s.next;
+        batch->entries[hashPart] = narInfo->to_string();
+        while (!batch->done && s.writing)
+            writes.wait(narInfoIndexWritten);
+        if (batch->done) {
+            if (batch->error) std::rethrow_exception(batch->error);
+            return;
+        }
+        s.next = nullptr;
+        s.writing = true;
+    }
+
+    try {
+        auto shardFile = narInfoIndexFileFor(shard);
+
+        /* Note: like addSignatures(), this is racy if several
+           processes write to the cache at the same time. */
+        auto data = getFile(shardFile);
+        auto entries = data ? splitNarInfoShard(*decompress("xz", *data)) : std::map<std::string, std::string>();
+
+        for (auto & i : batch->entries)
+            entries[i.first] = i.second;
+
+        std::string s;
+        for (auto & i : entries) {
+            if (!s.empty()) s += "\n";
+            s += i.second;
+        }
+
+        debug("writing %d new entries to .narinfo index shard '%s' of '%s'",
+            batch->entries.size(), shard, getUri());
+
+        upsertFile(shardFile, *compress("xz", s), "application/x-xz");
+    } catch (...) {
+        batch->error = std::current_exception();
+    }
+
+    {
+        auto writes(narInfoIndexWrites_.lock());
+        batch->done = true;
+        writes->shards[shard].writing = false;
+    }
+    narInfoIndexWritten.notify_all();
+
+    if (batch->error) std::rethrow_exception(batch->error);
+}
+
 void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 {
     auto narInfoFile = narInfoFileFor(narInfo->path);
 
     upsertFile(narInfoFile, narInfo->to_string(), "text/x-nix-narinfo");
 
+    if (writeNarInfoIndex && narInfoIndexPrefix > 0)
+        updateNarInfoIndex(narInfo);
+
     auto hashPart = storePathToHash(narInfo->path);
 
-    {
-        auto state_(state.lock());
-        state_->pathInfoCache.upsert(hashPart, std::shared_ptr<NarInfo>(narInfo));
-    }
+    if (auto hash = storePathHash(narInfo->path))
+        pathInfoCache.upsert(*hash, std::shared_ptr<NarInfo>(narInfo));
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), hashPart, std::shared_ptr<NarInfo>(narInfo));
 }
 
-void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
-    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+void BinaryCacheStore::checkReferencesValid(const ValidPathInfo & info)
 {
-    if (!repair && isValidPath(info.path)) return;
-
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
     for (auto & ref : info.references)
@@ -126,51 +374,370 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
             throw Error(format("cannot add '%s' to the binary cache because the reference '%s' is not valid")
                 % info.path % ref);
         }
+}
 
-    assert(nar->compare(0, narMagic.size(), narMagic) == 0);
+static std::string narFileFor(const Hash & fileHash, const std::string & compression)
+{
+    return "nar/" + fileHash.to_string(Base32, false) + ".nar"
+        + (compression == "xz" ? ".xz" :
+           compression == "bzip2" ? ".bz2" :
+           compression == "br" ? ".br" :
+           compression == "zstd" ? ".zst" :
+           "");
+}
+
+void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    /* The accessor cache needs the entire NAR in memory. So does a
+       listing of a chunked NAR. */
+    if ((narChunking && writeNARListing) || std::dynamic_pointer_cast<RemoteFSAccessor>(accessor)) {
+        addToStore(info, make_ref<std::string>(narSource.drain()), repair, checkSigs, accessor);
+        return;
+    }
+
+    if (!repair && isValidPath(info.path)) return;
+
+    checkReferencesValid(info);
+
+    if (narChunking) {
+        addChunkedNar(info, narSource, repair);
+        return;
+    }
 
     auto narInfo = make_ref<NarInfo>(info);
+    narInfo->compression = compression;
 
-    narInfo->narSize = nar->size();
-    narInfo->narHash = hashString(htSHA256, *nar);
+    /* Compress the NAR into a temporary file, hashing the NAR and the
+       compressed NAR on the fly. We can't upload it directly since
+       its name depends on the hash of the compressed NAR. */
+    AutoDelete tmpDir(createTempDir("", "nix-upload"), true);
+    Path tmpFile = (Path) tmpDir + "/nar";
+    AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if (!fd) throw SysError("creating '%s'", tmpFile);
+
+    HashSink narHashSink(htSHA256), fileHashSink(htSHA256);
+    FdSink fileSink(fd.get());
+
+    LambdaSink compressedSink([&](const unsigned char * data, size_t len) {
+        fileHashSink(data, len);
+        fileSink(data, len);
+    });
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    std::shared_ptr<FSAccessor> narIndex;
+
+    {
+        auto compressionSink = makeCompressionSink(compression, compressedSink, parallelCompression, compressionLevel);
+
+        LambdaSource teeSource([&](unsigned char * data, size_t len) {
+            auto n = narSource.read(data, len);
+            narHashSink(data, n);
+            (*compressionSink)(data, n);
+            return n;
+        });
+
+        /* Parse the NAR while copying it, to check that it is one and
+           to get its listing. */
+        try {
+            narIndex = makeNarIndex(teeSource).get_ptr();
+        } catch (SerialisationError & e) {
+            throw Error("cannot add '%s' to the binary cache because it is not a valid NAR: %s", info.path, e.what());
+        }
+
+        compressionSink->finish();
+    }
+
+    fileSink.flush();
+    fd = -1;
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    auto narHash = narHashSink.finish();
+    narInfo->narHash = narHash.first;
+    narInfo->narSize = narHash.second;
 
     if (info.narHash && info.narHash != narInfo->narHash)
         throw Error(format("refusing to copy corrupted path '%1%' to binary cache") % info.path);
 
-    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
+    auto fileHash = fileHashSink.finish();
+    narInfo->fileHash = fileHash.first;
+    narInfo->fileSize = fileHash.second;
 
-    /* Optionally write a JSON file containing a listing of the
-       contents of the NAR. */
-    if (writeNARListing) {
-        std::ostringstream jsonOut;
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+    printMsg(lvlTalkative, format("copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache")
+        % narInfo->path % narInfo->narSize
+        % ((1.0 - (double) narInfo->fileSize / narInfo->narSize) * 100.0)
+        % duration);
 
-        {
-            JSONObject jsonRoot(jsonOut);
-            jsonRoot.attr("version", 1);
+    if (wantNarListing())
+        writeNarListing(info.path, ref<FSAccessor>(narIndex));
+
+    /* Atomically write the NAR file. */
+    narInfo->url = narFileFor(narInfo->fileHash, compression);
+    if (repair || !fileExists(narInfo->url)) {
+        stats.narWrite++;
+        upsertFileFromPath(narInfo->url, tmpFile, "application/x-nix-nar");
+    } else
+        stats.narWriteAverted++;
+
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += narInfo->fileSize;
+    stats.narWriteCompressionTimeMs += duration;
+
+    /* Write the NAR info file last, so that the path doesn't become
+       valid before the NAR has been uploaded. */
+    if (secretKey) narInfo->sign(*secretKey);
+
+    writeNarInfo(narInfo);
 
-            auto narAccessor = makeNarAccessor(nar);
+    stats.narInfoWrite++;
+}
+
+void BinaryCacheStore::addChunkedNar(const ValidPathInfo & info, Source & narSource, RepairFlag repair)
+{
+    auto narInfo = make_ref<NarInfo>(info);
+
+    ChunkList list;
+    list.compression = compression;
+
+    struct State
+    {
+        size_t inProgress = 0;
+        uint64_t fileSize = 0, newChunks = 0, newBytes = 0;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Compress and upload the chunks in parallel, but don't get too
+       far ahead of the uploads. */
+    ThreadPool pool(std::max(4U, std::thread::hardware_concurrency()));
+    const size_t maxInProgress = 16;
 
-            if (accessor_)
-                accessor_->addToCache(info.path, *nar, narAccessor);
+    auto now1 = std::chrono::steady_clock::now();
+
+    ChunkingSink chunker(narChunkSize, [&](std::string && data) {
+        auto hash = hashString(htSHA256, data);
+        list.chunks.push_back({hash, data.size()});
+
+        {
+            auto state(state_.lock());
+            while (state->inProgress >= maxInProgress && !state->exc)
+                state.wait(wakeup);
+            if (state->exc) std::rethrow_exception(state->exc);
+            state->inProgress++;
+        }
 
-            {
-                auto res = jsonRoot.placeholder("root");
-                listNar(res, narAccessor, "", true);
+        auto chunk = std::make_shared<std::string>(std::move(data));
+
+        pool.enqueue([this, &state_, &wakeup, hash, chunk, repair]() {
+            try {
+                /* Always compress the chunk, since the .narinfo
+                   records the total compressed size. */
+                auto compressed = nix::compress(compression, *chunk, parallelCompression, compressionLevel);
+                auto file = chunkFileFor(hash, compression);
+                bool upload = repair || !fileExists(file);
+                if (upload)
+                    upsertFile(file, *compressed, "application/octet-stream");
+                auto state(state_.lock());
+                state->fileSize += compressed->size();
+                if (upload) {
+                    state->newChunks++;
+                    state->newBytes += compressed->size();
+                }
+                state->inProgress--;
+            } catch (...) {
+                auto state(state_.lock());
+                if (!state->exc) state->exc = std::current_exception();
+                state->inProgress--;
             }
+            wakeup.notify_one();
+        });
+    });
+
+    HashSink narHashSink(htSHA256);
+
+    std::string magic;
+    std::vector<unsigned char> buf(65536);
+    while (true) {
+        size_t n;
+        try {
+            n = narSource.read(buf.data(), buf.size());
+        } catch (EndOfFile &) {
+            break;
+        }
+        if (magic.size() < narMagic.size())
+            magic.append((char *) buf.data(), std::min(n, narMagic.size() - magic.size()));
+        narHashSink(buf.data(), n);
+        chunker(buf.data(), n);
+    }
+
+    if (magic != narMagic)
+        throw Error("cannot add '%s' to the binary cache because it is not a valid NAR", info.path);
+
+    chunker.finish();
+
+    pool.process();
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    auto state(state_.lock());
+    if (state->exc) std::rethrow_exception(state->exc);
+
+    auto narHash = narHashSink.finish();
+    narInfo->narHash = narHash.first;
+    narInfo->narSize = narHash.second;
+
+    if (info.narHash && info.narHash != narInfo->narHash)
+        throw Error(format("refusing to copy corrupted path '%1%' to binary cache") % info.path);
+
+    auto listData = list.to_string();
+
+    narInfo->compression = "chunked";
+    narInfo->fileHash = hashString(htSHA256, listData);
+    narInfo->fileSize = state->fileSize + listData.size();
+    narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".chunks";
+
+    auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+    printMsg(lvlTalkative, "copying path '%s' (%d bytes, %d chunks, %d new chunks of %d compressed bytes, in %d ms) to binary cache",
+        narInfo->path, narInfo->narSize, list.chunks.size(), state->newChunks, state->newBytes, duration);
+
+    if (repair || !fileExists(narInfo->url)) {
+        stats.narWrite++;
+        upsertFile(narInfo->url, listData, "text/x-nix-chunk-list");
+    } else
+        stats.narWriteAverted++;
+
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += state->newBytes;
+    stats.narWriteCompressionTimeMs += duration;
+
+    if (secretKey) narInfo->sign(*secretKey);
+
+    writeNarInfo(narInfo);
+
+    stats.narInfoWrite++;
+}
+
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    auto data = getFile(info.url);
+    if (!data)
+        throw SubstituteGone("file '%s' does not exist in binary cache '%s'", info.url, getUri());
+
+    ChunkList list(*data, info.url);
+
+    if (localChunkCache != "") createDirs(localChunkCache);
+
+    /* Fetch a window of chunks ahead of the one being written. */
+    struct Fetch
+    {
+        const ChunkList::Chunk & chunk;
+        Path cacheFile;
+        bool cached;
+        std::future<std::shared_ptr<std::string>> data;
+    };
+
+    std::list<Fetch> fetches;
+    auto next = list.chunks.begin();
+    const size_t window = 16;
+
+    auto startFetch = [&]() {
+        auto & chunk = *next++;
+        auto promise = std::make_shared<std::promise<std::shared_ptr<std::string>>>();
+        Path cacheFile = localChunkCache == "" ? "" : localChunkCache.get() + "/" + chunk.hash.to_string(Base32, false);
+        bool cached = cacheFile != "" && pathExists(cacheFile);
+        fetches.push_back(Fetch{chunk, cacheFile, cached, promise->get_future()});
+        if (cached)
+            promise->set_value(std::make_shared<std::string>(readFile(cacheFile)));
+        else
+            getFile(chunkFileFor(chunk.hash, list.compression),
+                {[promise](std::future<std::shared_ptr<std::string>> fut) {
+                    try {
+                        promise->set_value(fut.get());
+                    } catch (...) {
+                        promise->set_exception(std::current_exception());
+                    }
+                }});
+    };
+
+    while (next != list.chunks.end() || !fetches.empty()) {
+        while (next != list.chunks.end() && fetches.size() < window)
+            startFetch();
+
+        auto & fetch(fetches.front());
+
+        auto data = fetch.data.get();
+        if (!data)
+            throw SubstituteGone("chunk '%s' does not exist in binary cache '%s'",
+                fetch.chunk.hash.to_string(Base32, false), getUri());
+
+        auto chunk = fetch.cached ? data : decompress(list.compression, *data).get_ptr();
+
+        if (chunk->size() != fetch.chunk.size || hashString(htSHA256, *chunk) != fetch.chunk.hash)
+            throw Error("chunk '%s' from binary cache '%s' is corrupt",
+                fetch.chunk.hash.to_string(Base32, false), getUri());
+
+        if (!fetch.cached && fetch.cacheFile != "") {
+            Path tmp = fetch.cacheFile + ".tmp." + std::to_string(getpid());
+            writeFile(tmp, *chunk);
+            if (rename(tmp.c_str(), fetch.cacheFile.c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", tmp, fetch.cacheFile);
         }
 
-        upsertFile(storePathToHash(info.path) + ".ls", jsonOut.str(), "application/json");
+        if (!fetch.cached)
+            stats.narReadCompressedBytes += data->size();
+
+        sink((unsigned char *) chunk->data(), chunk->size());
+
+        fetches.pop_front();
     }
+}
+
+void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    if (!repair && isValidPath(info.path)) return;
+
+    checkReferencesValid(info);
+
+    assert(nar->compare(0, narMagic.size(), narMagic) == 0);
+
+    auto narInfo = make_ref<NarInfo>(info);
+
+    narInfo->narSize = nar->size();
+    narInfo->narHash = hashString(htSHA256, *nar);
+
+    if (info.narHash && info.narHash != narInfo->narHash)
+        throw Error(format("refusing to copy corrupted path '%1%' to binary cache") % info.path);
+
+    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
+
+    /* Optionally write a JSON file containing a listing of the
+       contents of the NAR. */
+    if (wantNarListing() || accessor_) {
+        auto narAccessor = makeNarAccessor(nar);
 
-    else {
         if (accessor_)
-            accessor_->addToCache(info.path, *nar, makeNarAccessor(nar));
+            accessor_->addToCache(info.path, *nar, narAccessor);
+
+        if (wantNarListing())
+            writeNarListing(info.path, narAccessor);
+    }
+
+    if (narChunking) {
+        StringSource source(*nar);
+        addChunkedNar(info, source, repair);
+        return;
     }
 
     /* Compress the NAR. */
     narInfo->compression = compression;
     auto now1 = std::chrono::steady_clock::now();
-    auto narCompressed = compress(compression, *nar, parallelCompression);
+    auto narCompressed = compress(compression, *nar, parallelCompression, compressionLevel);
     auto now2 = std::chrono::steady_clock::now();
     narInfo->fileHash = hashString(htSHA256, *narCompressed);
     narInfo->fileSize = narCompressed->size();
@@ -182,11 +749,7 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
         % duration);
 
     /* Atomically write the NAR file. */
-    narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".nar"
-        + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "br" ? ".br" :
-           "");
+    narInfo->url = narFileFor(narInfo->fileHash, compression);
     if (repair || !fileExists(narInfo->url)) {
         stats.narWrite++;
         upsertFile(narInfo->url, *narCompressed, "application/x-nix-nar");
@@ -207,6 +770,15 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
 
 bool BinaryCacheStore::isValidPathUncached(const Path & storePath)
 {
+    if (narInfoIndexPrefix) {
+        std::promise<std::shared_ptr<NarInfo>> promise;
+        lookupNarInfoIndex(storePathToHash(storePath), [&](std::shared_ptr<NarInfo> info) {
+            promise.set_value(info);
+        });
+        auto info = promise.get_future().get();
+        if (info && info->path == storePath) return true;
+    }
+
     // FIXME: this only checks whether a .narinfo with a matching hash
     // part exists. So ‘f4kb...-foo’ matches ‘f4kb...-bar’, even
     // though they shouldn't. Not easily fixed.
@@ -224,21 +796,153 @@ void BinaryCacheStore::narFromPath(const Path & storePath, Sink & sink)
         narSize += len;
     });
 
-    auto decompressor = makeDecompressionSink(info->compression, wrapperSink);
+    if (info->compression == "chunked")
+        narFromChunks(*info, wrapperSink);
 
-    try {
-        getFile(info->url, *decompressor);
-    } catch (NoSuchBinaryCacheFile & e) {
-        throw SubstituteGone(e.what());
-    }
+    else {
+        auto fetch = [&](Sink & sink) {
+            auto decompressor = makeDecompressionSink(info->compression, sink);
 
-    decompressor->finish();
+            try {
+                getFile(info->url, *decompressor);
+            } catch (NoSuchBinaryCacheFile & e) {
+                throw SubstituteGone(e.what());
+            }
+
+            decompressor->finish();
+        };
+
+        if (info->compression == "none" || info->compression == "")
+            fetch(wrapperSink);
+
+        else {
+            /* Download and decompress in a separate thread, so that
+               decompression overlaps with whatever `sink' does with
+               the NAR (such as unpacking it). `sink' is still only
+               called from this thread. */
+            auto act = getCurActivity();
+            bool finished = false;
+
+            auto source = sinkToSourceThreaded([&](Sink & sink) {
+                PushActivity pact(act);
+                fetch(sink);
+            }, [&]() {
+                finished = true;
+                throw EndOfFile("NAR has been read");
+            });
+
+            std::vector<unsigned char> buf(65536);
+            try {
+                while (true) {
+                    auto n = source->read(buf.data(), buf.size());
+                    wrapperSink(buf.data(), n);
+                }
+            } catch (EndOfFile &) {
+                if (!finished) throw;
+            }
+        }
+    }
 
     stats.narRead++;
     //stats.narReadCompressedBytes += nar->size(); // FIXME
     stats.narReadBytes += narSize;
 }
 
+std::shared_ptr<std::string> BinaryCacheStore::narFromDelta(const NarInfo & info, Store & baseStore)
+{
+    if (info.narSize > maxDeltaNarSize) return nullptr;
+
+    const NarInfo::Delta * best = nullptr;
+
+    for (auto & delta : info.deltas) {
+        if (best && best->fileSize <= delta.fileSize) continue;
+        try {
+            if (!baseStore.isValidPath(delta.base)
+                || baseStore.queryPathInfo(delta.base)->narSize > maxDeltaNarSize)
+                continue;
+        } catch (Error & e) {
+            debug("cannot use delta base '%s': %s", delta.base, e.what());
+            continue;
+        }
+        best = &delta;
+    }
+
+    if (!best) return nullptr;
+
+    /* Any failure here is recoverable by fetching the full NAR, and
+       since the result is checked against the NAR hash, a bad delta
+       can't do any harm. */
+    try {
+        debug("reconstructing NAR of '%s' from delta against '%s'", info.path, best->base);
+
+        StringSink base;
+        baseStore.narFromPath(best->base, base);
+
+        StringSink nar;
+        auto patcher = makeDeltaDecompressionSink(best->method, nar, *base.s);
+        try {
+            getFile(best->url, *patcher);
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(e.what());
+        }
+        patcher->finish();
+
+        if (hashString(htSHA256, *nar.s) != info.narHash)
+            throw Error("NAR reconstructed from delta '%s' has the wrong hash", best->url);
+
+        stats.narRead++;
+        stats.narReadBytes += nar.s->size();
+
+        return nar.s;
+    } catch (Error & e) {
+        printError("warning: cannot use delta '%s' for '%s', fetching the full NAR: %s",
+            best->url, info.path, e.what());
+        return nullptr;
+    }
+}
+
+std::unique_ptr<Source> BinaryCacheStore::narSourceFromPath(const Path & storePath,
+    Store * deltaBaseStore)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    if (deltaBaseStore && useDeltas && !info->deltas.empty())
+        if (auto nar = narFromDelta(*info, *deltaBaseStore))
+            return sinkToSource([nar](Sink & sink) { sink(*nar); });
+
+    if (info->compression == "chunked")
+        return Store::narSourceFromPath(storePath);
+
+    /* Download and decompress straight into the source's buffer,
+       rather than going through narFromPath(), which would copy the
+       decompressed NAR through another thread. */
+    auto act = getCurActivity();
+    return sinkToSourceThreaded([this, info, act](Sink & sink) {
+        PushActivity pact(act);
+
+        uint64_t narSize = 0;
+        LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
+            sink(data, len);
+            narSize += len;
+        });
+
+        auto decompressor = makeDecompressionSink(info->compression, wrapperSink);
+
+        try {
+            getFile(info->url, *decompressor);
+        } catch (NoSuchBinaryCacheFile & e) {
+            throw SubstituteGone(e.what());
+        }
+
+        decompressor->finish();
+
+        stats.narRead++;
+        stats.narReadBytes += narSize;
+    }, [this, storePath]() {
+        throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", storePath, getUri());
+    });
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const Path & storePath,
     Callback<std::shared_ptr<ValidPathInfo>> callback)
 {
@@ -249,23 +953,103 @@ void BinaryCacheStore::queryPathInfoUncached(const Path & storePath,
 
     auto narInfoFile = narInfoFileFor(storePath);
 
-    getFile(narInfoFile,
-        {[=](std::future<std::shared_ptr<std::string>> fut) {
-            try {
-                auto data = fut.get();
+    auto fetchNarInfo = [=]() {
+        getFile(narInfoFile,
+            {[=](std::future<std::shared_ptr<std::string>> fut) {
+                try {
+                    auto data = fut.get();
 
-                if (!data) return callback(nullptr);
+                    if (!data) return callback(nullptr);
 
-                stats.narInfoRead++;
+                    stats.narInfoRead++;
 
-                callback((std::shared_ptr<ValidPathInfo>)
-                    std::make_shared<NarInfo>(*this, *data, narInfoFile));
+                    auto narInfo = std::make_shared<NarInfo>(*this, *data, narInfoFile);
 
-                (void) act; // force Activity into this lambda to ensure it stays alive
-            } catch (...) {
-                callback.rethrow();
+                    prefetchReferences(*narInfo);
+
+                    callback((std::shared_ptr<ValidPathInfo>) narInfo);
+
+                    (void) act; // force Activity into this lambda to ensure it stays alive
+                } catch (...) {
+                    callback.rethrow();
+                }
+            }});
+    };
+
+    if (!narInfoIndexPrefix) return fetchNarInfo();
+
+    lookupNarInfoIndex(storePathToHash(storePath), [=](std::shared_ptr<NarInfo> info) {
+        try {
+            if (info) {
+                prefetchReferences(*info);
+                callback((std::shared_ptr<ValidPathInfo>) info);
+            } else
+                fetchNarInfo();
+        } catch (...) {
+            callback.rethrow();
+        }
+    });
+}
+
+void BinaryCacheStore::prefetchReferences(const ValidPathInfo & info)
+{
+    /* Bound the number of outstanding prefetches, since each
+       prefetched .narinfo triggers prefetches of its own. */
+    const size_t maxPrefetches = 256;
+
+    if (!asyncGetFile) return;
+
+    {
+        auto state(prefetchState_.lock());
+        size_t n = 0;
+        for (auto & path : info.references) {
+            if (path == info.path) continue;
+            if (n++ >= narInfoPrefetch || state->inProgress + state->queue.size() >= maxPrefetches) break;
+            state->queue.push_back(path);
+        }
+        /* If a prefetch that some thread is starting completes right
+           away (e.g. from the .narinfo index), we get here again
+           from the callback.  Leave the new paths to that thread
+           rather than recursing. */
+        if (state->starting || state->queue.empty()) return;
+        state->starting = true;
+    }
+
+    auto self(shared_from_this());
+
+    while (true) {
+        Path path;
+        {
+            auto state(prefetchState_.lock());
+            if (state->queue.empty()) {
+                state->starting = false;
+                return;
             }
-        }});
+            path = state->queue.front();
+            state->queue.pop_front();
+            state->inProgress++;
+        }
+
+        auto finish = [self, this]() {
+            auto state(prefetchState_.lock());
+            assert(state->inProgress);
+            state->inProgress--;
+        };
+
+        try {
+            SpeculativeDownloads speculative;
+            /* The callback keeps the store alive, since nobody may be
+               waiting for this query. */
+            queryPathInfo(path, {[finish](std::future<ref<ValidPathInfo>> fut) {
+                finish();
+                /* Errors will show up when the path is really
+                   queried. */
+                try { fut.get(); } catch (...) { }
+            }});
+        } catch (...) {
+            finish();
+        }
+    }
 }
 
 Path BinaryCacheStore::addToStore(const string & name, const Path & srcPath,
@@ -311,6 +1095,40 @@ Path BinaryCacheStore::addTextToStore(const string & name, const string & s,
     return info.path;
 }
 
+void BinaryCacheStore::writeNarListing(const Path & storePath, ref<FSAccessor> narAccessor)
+{
+    std::ostringstream jsonOut;
+
+    {
+        JSONObject jsonRoot(jsonOut);
+        jsonRoot.attr("version", 1);
+
+        {
+            auto res = jsonRoot.placeholder("root");
+            listNar(res, narAccessor, "", true);
+        }
+    }
+
+    upsertFile(storePathToHash(storePath) + ".ls", jsonOut.str(), "application/json");
+}
+
+std::shared_ptr<FSAccessor> BinaryCacheStore::getNarAccessor(const Path & storePath)
+{
+    auto info = std::dynamic_pointer_cast<const NarInfo>(queryPathInfo(storePath).get_ptr());
+    if (!info || info->compression != "none") return nullptr;
+
+    auto listing = getFile(storePathToHash(storePath) + ".ls");
+    if (!listing) return nullptr;
+
+    auto store = std::dynamic_pointer_cast<BinaryCacheStore>(shared_from_this());
+    auto url = info->url;
+
+    return makeLazyNarAccessor(*listing,
+        [store, url](uint64_t offset, uint64_t length) {
+            return store->getFileRange(url, offset, length);
+        }).get_ptr();
+}
+
 ref<FSAccessor> BinaryCacheStore::getFSAccessor()
 {
     return make_ref<RemoteFSAccessor>(ref<Store>(shared_from_this()), localNarCache);
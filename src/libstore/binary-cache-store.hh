@@ -6,6 +6,7 @@
 #include "pool.hh"
 
 #include <atomic>
+#include <deque>
 
 namespace nix {
 
@@ -15,17 +16,38 @@ class BinaryCacheStore : public Store
 {
 public:
 
-    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', or 'none')"};
+    const Setting<std::string> compression{this, "xz", "compression",
+        "NAR compression method ('xz', 'bzip2', 'br', 'zstd' (if Nix was built with libzstd), or 'none')"};
     const Setting<bool> writeNARListing{this, false, "write-nar-listing", "whether to write a JSON file listing the files in each NAR"};
     const Setting<Path> secretKeyFile{this, "", "secret-key", "path to secret key used to sign the binary cache"};
     const Setting<Path> localNarCache{this, "", "local-nar-cache", "path to a local cache of NARs"};
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
-        "enable multi-threading compression, available for xz only currently"};
+        "enable multi-threading compression, available for xz and zstd only currently"};
+    const Setting<int> compressionLevel{this, -1, "compression-level",
+        "NAR compression level; its meaning depends on the compression method (-1 selects the default)"};
+    const Setting<unsigned int> narInfoPrefetch{this, 16, "narinfo-prefetch",
+        "number of references of a path whose .narinfo files to fetch speculatively when its .narinfo arrives"};
+    const Setting<bool> narChunking{this, false, "nar-chunking",
+        "whether to store NARs as lists of content-defined chunks, so that data shared between NARs is stored once"};
+    const Setting<unsigned int> narChunkSize{this, 1 << 20, "nar-chunk-size", "average size of NAR chunks"};
+    const Setting<Path> localChunkCache{this, "", "local-chunk-cache",
+        "path to a local cache of NAR chunks, so that chunks shared with previously fetched NARs aren't fetched again"};
+    const Setting<bool> writeNarInfoIndex{this, false, "write-narinfo-index",
+        "whether to maintain an index of .narinfo files, sharded by hash prefix, for clients to fetch in bulk"};
+    const Setting<bool> useDeltas{this, true, "use-deltas",
+        "whether to reconstruct NARs from the binary deltas advertised in .narinfo files if their base path is valid locally"};
+    const Setting<uint64_t> maxDeltaNarSize{this, 256 << 20, "max-delta-nar-size",
+        "maximum size of a NAR, and of the NAR of its delta base, for deltas to be used (both are kept in memory)"};
 
 private:
 
     std::unique_ptr<SecretKey> secretKey;
 
+    /* Reconstruct the NAR of `info' from the smallest of its deltas
+       whose base is valid in `baseStore'. Returns null if no delta
+       can be used. */
+    std::shared_ptr<std::string> narFromDelta(const NarInfo & info, Store & baseStore);
+
 protected:
 
     BinaryCacheStore(const Params & params);
@@ -38,6 +60,13 @@ public:
         const std::string & data,
         const std::string & mimeType) = 0;
 
+    /* Upload the contents of the local file `srcPath' to `path'. The
+       default implementation reads the file into memory; subclasses
+       should override this to stream it. */
+    virtual void upsertFileFromPath(const std::string & path,
+        const Path & srcPath,
+        const std::string & mimeType);
+
     /* Note: subclasses must implement at least one of the two
        following getFile() methods. */
 
@@ -51,11 +80,21 @@ public:
 
     std::shared_ptr<std::string> getFile(const std::string & path);
 
+    /* Return `length' bytes of the specified file starting at
+       `offset'. The default implementation fetches the entire file;
+       subclasses should override this to fetch only the range. */
+    virtual std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length);
+
 protected:
 
     bool wantMassQuery_ = false;
     int priority = 50;
 
+    /* Whether getFile() with a callback is asynchronous. Prefetching
+       references is pointless otherwise. */
+    bool asyncGetFile = false;
+
 public:
 
     virtual void init();
@@ -64,10 +103,109 @@ private:
 
     std::string narMagic;
 
+    typedef std::map<std::string, std::shared_ptr<NarInfo>> NarInfoShard;
+
+    /* Length of the hash prefix by which the .narinfo index of this
+       cache is sharded, 0 if it has no index, or -1 if we don't know
+       yet (because nix-cache-info wasn't read). */
+    std::atomic<int> narInfoIndexPrefix{-1};
+
+    struct NarInfoIndexState
+    {
+        /* Shards that have been fetched and put in the path info
+           caches. */
+        std::set<std::string> fetched;
+
+        /* Lookups waiting for a shard to be fetched. */
+        std::map<std::string, std::vector<std::function<void(const NarInfoShard &)>>> pending;
+    };
+
+    Sync<NarInfoIndexState> narInfoIndexState;
+
+    /* Entries to be written to a shard of the .narinfo index in one
+       go (see updateNarInfoIndex()). */
+    struct NarInfoIndexBatch
+    {
+        std::map<std::string, std::string> entries;
+        bool done = false;
+        std::exception_ptr error;
+    };
+
+    struct NarInfoIndexWrites
+    {
+        struct Shard
+        {
+            /* Whether a batch of this shard is being written. */
+            bool writing = false;
+
+            /* The batch that new entries are added to. */
+            std::shared_ptr<NarInfoIndexBatch> next;
+        };
+
+        std::map<std::string, Shard> shards;
+    };
+
+    Sync<NarInfoIndexWrites> narInfoIndexWrites_;
+    std::condition_variable narInfoIndexWritten;
+
     std::string narInfoFileFor(const Path & storePath);
 
     void writeNarInfo(ref<NarInfo> narInfo);
 
+    /* Look up the .narinfo of `hashPart' in the .narinfo index. This
+       calls `done' with nullptr if the index doesn't have it or the
+       shard containing it was already fetched before. */
+    void lookupNarInfoIndex(const std::string & hashPart,
+        std::function<void(std::shared_ptr<NarInfo>)> done);
+
+    void updateNarInfoIndex(ref<NarInfo> narInfo);
+
+    void checkReferencesValid(const ValidPathInfo & info);
+
+    /* Add a NAR as a list of chunks (see nar-chunks.hh). */
+    void addChunkedNar(const ValidPathInfo & info, Source & narSource, RepairFlag repair);
+
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
+    struct PrefetchState
+    {
+        /* Paths waiting to be prefetched. */
+        std::deque<Path> queue;
+
+        /* Number of prefetches that have been started but haven't
+           finished yet. */
+        size_t inProgress = 0;
+
+        /* Whether some thread is starting the prefetches in `queue'. */
+        bool starting = false;
+    };
+
+    Sync<PrefetchState> prefetchState_;
+
+    /* Start fetching the .narinfo files of the references of `info'
+       into the path info caches, in the expectation that they'll be
+       queried soon (e.g. when substituting a closure).  Prefetched
+       .narinfo files prefetch their own references, which are queued
+       rather than started recursively. */
+    void prefetchReferences(const ValidPathInfo & info);
+
+    /* Whether to write a '.ls' listing of the NAR of a path. Listings
+       of uncompressed NARs are always written, since they allow
+       reading files with range requests (see getNarAccessor()). */
+    bool wantNarListing()
+    {
+        return writeNARListing || (compression == "none" && !narChunking);
+    }
+
+    void writeNarListing(const Path & storePath, ref<FSAccessor> narAccessor);
+
+    /* Return an accessor for the NAR of `storePath' that reads its
+       files with range requests, if the NAR is uncompressed and has
+       a listing. Otherwise, return nullptr. */
+    std::shared_ptr<FSAccessor> getNarAccessor(const Path & storePath);
+
+    friend class RemoteFSAccessor;
+
 public:
 
     bool isValidPathUncached(const Path & path) override;
@@ -80,6 +218,10 @@ public:
 
     bool wantMassQuery() override { return wantMassQuery_; }
 
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override;
+
     void addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
@@ -93,6 +235,9 @@ public:
 
     void narFromPath(const Path & path, Sink & sink) override;
 
+    std::unique_ptr<Source> narSourceFromPath(const Path & path,
+        Store * deltaBaseStore = nullptr) override;
+
     BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
         BuildMode buildMode) override
     { unsupported("buildDerivation"); }
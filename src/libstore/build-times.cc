@@ -0,0 +1,162 @@
+#include "build-times.hh"
+#include "sqlite.hh"
+#include "sync.hh"
+#include "util.hh"
+
+namespace nix {
+
+static const char * schema = R"sql(
+
+create table if not exists BuildTimes (
+    name       text not null,
+    system     text not null,
+    wallTime   integer not null, -- milliseconds
+    cpuTime    integer not null, -- milliseconds
+    peakMemory integer not null,
+    count      integer not null,
+    timestamp  integer not null,
+    primary key (name, system)
+);
+
+)sql";
+
+/* The weight of a new build in the averages. */
+static const double newWeight = 0.3;
+
+class BuildTimesImpl : public BuildTimes
+{
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt query, update;
+    };
+
+    Sync<State> _state;
+
+public:
+
+    BuildTimesImpl(const Path & dbPath)
+    {
+        auto state(_state.lock());
+
+        state->db = SQLite(dbPath);
+        state->db.setBusyTimeout(60 * 1000);
+
+        // This is only used for estimates, so it can be lost.
+        state->db.exec("pragma synchronous = off");
+        state->db.exec("pragma main.journal_mode = truncate");
+
+        state->db.exec(schema);
+
+        state->query.create(state->db,
+            "select wallTime, cpuTime, peakMemory, count from BuildTimes where name = ? and system = ?");
+
+        state->update.create(state->db,
+            "insert or replace into BuildTimes(name, system, wallTime, cpuTime, peakMemory, count, timestamp) "
+            "values (?, ?, ?, ?, ?, ?, ?)");
+    }
+
+    std::optional<Estimate> lookup(State & state, const string & name, const string & system)
+    {
+        auto use(state.query.use()(name)(system));
+        if (!use.next()) return {};
+        Estimate estimate;
+        estimate.wallTime = use.getInt(0) / 1000.0;
+        estimate.cpuTime = use.getInt(1) / 1000.0;
+        estimate.peakMemory = use.getInt(2);
+        estimate.count = use.getInt(3);
+        return estimate;
+    }
+
+    std::optional<Estimate> lookup(const string & name, const string & system) override
+    {
+        return retrySQLite<std::optional<Estimate>>([&]() {
+            auto state(_state.lock());
+            return lookup(*state, name, system);
+        });
+    }
+
+    void record(const string & name, const string & system,
+        double wallTime, double cpuTime, uint64_t peakMemory) override
+    {
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+
+            SQLiteTxn txn(state->db);
+
+            Estimate estimate;
+            if (auto prev = lookup(*state, name, system)) {
+                auto avg = [](double prev, double cur) {
+                    return prev && cur ? (1 - newWeight) * prev + newWeight * cur : cur;
+                };
+                estimate.wallTime = avg(prev->wallTime, wallTime);
+                estimate.cpuTime = avg(prev->cpuTime, cpuTime);
+                estimate.peakMemory = avg(prev->peakMemory, peakMemory);
+                estimate.count = prev->count + 1;
+            } else {
+                estimate.wallTime = wallTime;
+                estimate.cpuTime = cpuTime;
+                estimate.peakMemory = peakMemory;
+                estimate.count = 1;
+            }
+
+            state->update.use()
+                (name)
+                (system)
+                ((int64_t) (estimate.wallTime * 1000))
+                ((int64_t) (estimate.cpuTime * 1000))
+                ((int64_t) estimate.peakMemory)
+                ((int64_t) estimate.count)
+                (time(0))
+                .exec();
+
+            txn.commit();
+        });
+    }
+};
+
+class NoBuildTimes : public BuildTimes
+{
+    void record(const string & name, const string & system,
+        double wallTime, double cpuTime, uint64_t peakMemory) override
+    {
+    }
+
+    std::optional<Estimate> lookup(const string & name, const string & system) override
+    {
+        return {};
+    }
+};
+
+ref<BuildTimes> openBuildTimes(const Path & dbDir)
+{
+    static Sync<std::map<Path, ref<BuildTimes>>> cache;
+
+    auto cache_(cache.lock());
+
+    auto i = cache_->find(dbDir);
+    if (i != cache_->end()) return i->second;
+
+    std::shared_ptr<BuildTimes> buildTimes;
+    try {
+        buildTimes = std::make_shared<BuildTimesImpl>(dbDir + "/build-times.sqlite");
+    } catch (Error & e) {
+        debug("cannot open the build times database: %s", e.what());
+        buildTimes = std::make_shared<NoBuildTimes>();
+    }
+
+    cache_->emplace(dbDir, ref<BuildTimes>(buildTimes));
+    return ref<BuildTimes>(buildTimes);
+}
+
+string buildTimesKey(const string & drvName)
+{
+    /* Same rule as DrvName: the version starts at the first dash
+       followed by a non-letter. */
+    for (size_t i = 0; i + 1 < drvName.size(); ++i)
+        if (drvName[i] == '-' && !isalpha(drvName[i + 1]))
+            return string(drvName, 0, i);
+    return drvName;
+}
+
+}
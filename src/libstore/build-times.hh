@@ -0,0 +1,46 @@
+#pragma once
+
+#include "types.hh"
+
+#include <optional>
+
+namespace nix {
+
+/* A record of the resources used by past builds, kept in
+   $stateDir/db/build-times.sqlite. It's used to estimate how long a
+   build will take. Builds are identified by the name of the
+   derivation without its version and by its platform, so that
+   an update of a package gets the estimate of its previous
+   version. */
+class BuildTimes
+{
+public:
+
+    struct Estimate
+    {
+        /* Averages, weighted towards recent builds. */
+        double wallTime = 0; // seconds
+        double cpuTime = 0; // seconds, or 0 if unknown
+        uint64_t peakMemory = 0; // bytes, or 0 if unknown
+
+        /* The number of builds this is based on. */
+        uint64_t count = 0;
+    };
+
+    virtual ~BuildTimes() { }
+
+    virtual void record(const string & name, const string & system,
+        double wallTime, double cpuTime, uint64_t peakMemory) = 0;
+
+    virtual std::optional<Estimate> lookup(const string & name, const string & system) = 0;
+};
+
+/* Return the build times database in `dbDir'. If it can't be
+   opened, the result always returns no estimate. */
+ref<BuildTimes> openBuildTimes(const Path & dbDir);
+
+/* Return the name under which builds of `drvName' are recorded,
+   i.e. without the version. */
+string buildTimesKey(const string & drvName);
+
+}
@@ -13,16 +13,23 @@
 #include "nar-info.hh"
 #include "parsed-derivations.hh"
 #include "machines.hh"
+#include "cgroup.hh"
+#include "thread-pool.hh"
+#include "build-times.hh"
+#include "rewrite.hh"
 
 #include <algorithm>
+#include <array>
 #include <iostream>
 #include <map>
 #include <sstream>
 #include <thread>
+#include <condition_variable>
 #include <future>
 #include <chrono>
 #include <regex>
 #include <queue>
+#include <unordered_set>
 
 #include <limits.h>
 #include <sys/time.h>
@@ -30,7 +37,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/utsname.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/resource.h>
 #include <sys/socket.h>
 #include <fcntl.h>
@@ -55,6 +62,8 @@
 #include <sys/param.h>
 #include <sys/mount.h>
 #include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 #if HAVE_SECCOMP
 #include <seccomp.h>
 #endif
@@ -99,6 +108,29 @@ typedef list<WeakGoalPtr> WeakGoals;
 typedef map<Path, WeakGoalPtr> WeakGoalMap;
 
 
+typedef std::chrono::time_point<std::chrono::steady_clock> steady_time_point;
+
+
+/* Why a goal is sleeping, for the scheduling statistics that the
+   worker reports at the end of run(). */
+typedef enum {
+    wrBuildSlot,
+    wrSubstitutionSlot,
+    wrLocks,
+    wrHookPostponed,
+    wrAdmission,
+    nrWaitReasons
+} WaitReason;
+
+static const char * waitReasonNames[nrWaitReasons] = {
+    "buildSlot",
+    "substitutionSlot",
+    "locks",
+    "hookPostponed",
+    "admission",
+};
+
+
 
 class Goal : public std::enable_shared_from_this<Goal>
 {
@@ -134,6 +166,22 @@ protected:
     /* Whether the goal is finished. */
     ExitCode exitCode;
 
+public:
+
+    /* When the goal was created, and, if it's sleeping, why and
+       since when. `waitTime' is the total time it has slept for
+       each reason. */
+    const steady_time_point timeCreated = steady_time_point::clock::now();
+    std::optional<std::pair<WaitReason, steady_time_point>> sleeping;
+    std::array<steady_time_point::duration, nrWaitReasons> waitTime{};
+
+    void startWaiting(WaitReason reason)
+    {
+        if (!sleeping) sleeping = std::make_pair(reason, steady_time_point::clock::now());
+    }
+
+protected:
+
     Goal(Worker & worker) : worker(worker)
     {
         nrFailed = nrNoSubstituters = nrIncompleteClosure = 0;
@@ -181,6 +229,11 @@ public:
 
     virtual string key() = 0;
 
+    /* Return the length of the longest chain of goals waiting,
+       directly or indirectly, for this one.  `depths' caches the
+       result for every goal visited. */
+    size_t getDepth(std::map<Goal *, size_t> & depths);
+
 protected:
 
     virtual void amDone(ExitCode result);
@@ -194,9 +247,6 @@ bool CompareGoalPtrs::operator() (const GoalPtr & a, const GoalPtr & b) const {
 }
 
 
-typedef std::chrono::time_point<std::chrono::steady_clock> steady_time_point;
-
-
 /* A mapping used to remember for each child process to what goal it
    belongs, and file descriptors for receiving log data and output
    path creation commands. */
@@ -226,14 +276,14 @@ private:
     /* Goals that are ready to do some work. */
     WeakGoals awake;
 
-    /* Goals waiting for a build slot. */
+    /* Goals waiting for a build or substitution slot. */
     WeakGoals wantingToBuild;
 
     /* Child processes currently running. */
     std::list<Child> children;
 
-    /* Number of build slots occupied.  This includes local builds and
-       substitutions but not remote builds via the build hook. */
+    /* Number of build slots occupied.  This includes local builds
+       but not substitutions or remote builds via the build hook. */
     unsigned int nrLocalBuilds;
 
     /* Maps used to prevent multiple instantiations of a goal for the
@@ -253,8 +303,61 @@ private:
     /* Cache for pathContentsGood(). */
     std::map<Path, bool> pathContentsGoodCache;
 
+    /* The post-processing of registered build outputs that hasn't
+       finished yet (see postProcess()), and the first error thrown
+       by a post-processing function, rethrown by run(). */
+    struct PostProcessingState
+    {
+        std::list<std::function<void()>> queue;
+        size_t running = 0;
+        std::exception_ptr error;
+    };
+
+    Sync<PostProcessingState> postProcessingState_;
+
+    /* The threads running the functions in the queue.  Each one
+       exits once the queue is empty. */
+    std::list<std::future<void>> postProcessing;
+
+    void runPostProcessing();
+
+    /* The input prefetches that haven't run yet (see
+       prefetchInputs()), and the thread that runs them. */
+    struct PrefetchJob
+    {
+        std::weak_ptr<Goal> goal;
+        Paths paths;
+        uint64_t limit;
+    };
+
+    struct PrefetchState
+    {
+        std::list<PrefetchJob> queue;
+        bool quit = false;
+    };
+
+    Sync<PrefetchState> prefetchState_;
+    std::condition_variable prefetchWakeup;
+    std::thread prefetchThread;
+
+    void prefetchWorker();
+
 public:
 
+    /* The memory in bytes that the tmpfs build directories of running
+       builds may still take up (see `build-dir-tmpfs'). */
+    uint64_t buildDirReserved = 0;
+
+    /* The substituters that planMissing() found for the paths to be
+       substituted. */
+    std::map<Path, ref<Store>> plannedSubstituters;
+
+    /* The graphs exported for `exportReferencesGraph', keyed on the
+       exported paths and whether the graph is in JSON.  Image builds
+       tend to export the same large closures, so each is only
+       computed once per worker. */
+    std::map<std::pair<PathSet, bool>, std::string> exportedGraphs;
+
     const Activity act;
     const Activity actDerivations;
     const Activity actSubstitutions;
@@ -281,6 +384,12 @@ public:
     uint64_t failedBuilds = 0;
     uint64_t runningBuilds = 0;
 
+    /* Sum of the estimated durations (in seconds) of the builds that
+       haven't finished yet, as far as they're known. */
+    uint64_t expectedBuildTime = 0;
+
+    ref<BuildTimes> buildTimes;
+
     uint64_t expectedSubstitutions = 0;
     uint64_t doneSubstitutions = 0;
     uint64_t failedSubstitutions = 0;
@@ -294,6 +403,39 @@ public:
        it answers with "decline-permanently", we don't try again. */
     bool tryBuildHook = true;
 
+    /* Counters for finding scheduling bottlenecks, reported at the
+       end of run(). */
+    const steady_time_point timeCreated = steady_time_point::clock::now();
+    struct {
+        std::array<steady_time_point::duration, nrWaitReasons> waitTime{};
+        std::array<uint64_t, nrWaitReasons> waits{};
+        steady_time_point::duration workTime{}, pollTime{}, hookTime{};
+        steady_time_point::duration localBuildTime{}, remoteBuildTime{}, substitutionTime{};
+        uint64_t hookAccepted = 0, hookDeclined = 0, hookPostponed = 0;
+        uint64_t lockFailures = 0;
+    } schedStats;
+
+    /* The lifetime and sleeping times of the goals that have
+       finished, for the same report.  A worker can run hundreds of
+       thousands of goals, so we only keep totals and the
+       `maxSlowGoals' goals that lived longest. */
+    struct GoalTimes
+    {
+        string name;
+        steady_time_point created, finished;
+        std::array<steady_time_point::duration, nrWaitReasons> waitTime;
+    };
+    static const size_t maxSlowGoals = 10;
+    struct
+    {
+        uint64_t count = 0;
+        steady_time_point::duration lifetime{}, maxLifetime{};
+        std::array<steady_time_point::duration, nrWaitReasons> waitTime{};
+        std::vector<GoalTimes> slowest;
+    } goalTimes;
+
+    void goalFinished(GoalTimes && times);
+
     Worker(LocalStore & store);
     ~Worker();
 
@@ -309,11 +451,16 @@ public:
     /* Wake up a goal (i.e., there is something for it to do). */
     void wakeUp(GoalPtr goal);
 
-    /* Return the number of local build and substitution processes
-       currently running (but not remote builds via the build
+    /* Return the number of local build processes currently running
+       (but not substitutions or remote builds via the build
        hook). */
     unsigned int getNrLocalBuilds();
 
+    /* Return why a local build of `drv' shouldn't be started right
+       now given the load of the machine, or an empty string if it
+       can be started. */
+    string getAdmissionBlocker(const BasicDerivation & drv, uint64_t expectedMemory = 0);
+
     /* Registers a running child process.  `inBuildSlot' means that
        the process counts towards the jobs limit. */
     void childStarted(GoalPtr goal, const set<int> & fds,
@@ -329,19 +476,47 @@ public:
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Likewise for a substitution slot. */
+    void waitForSubstitutionSlot(GoalPtr goal);
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
-    void waitForAnyGoal(GoalPtr goal);
+    void waitForAnyGoal(GoalPtr goal, WaitReason reason);
+
+    /* Run `fun' in the background.  This is for work on outputs that
+       have already been registered as valid, which dependent goals
+       don't need to wait for (such as optimising and signing them).
+       The first error is rethrown by run() once the goals have
+       finished; later ones are printed.  At most `max-jobs' such
+       functions run at the same time; the others are queued, so
+       this never blocks. */
+    void postProcess(std::function<void()> fun);
+
+    /* Wait until all functions passed to postProcess() have
+       finished. */
+    void waitForPostProcessing();
+
+    /* Start reading up to `limit' bytes of the regular files in
+       `paths' (real paths of store paths) into the page cache in the
+       background, so that the build of `goal' doesn't wait for cold
+       inputs one file at a time.  Prefetches run one at a time, since
+       concurrent ones would just make (spinning) disks seek, and are
+       dropped once `goal' has gone away. */
+    void prefetchInputs(GoalPtr goal, Paths paths, uint64_t limit);
 
     /* Wait for a few seconds and then retry this goal.  Used when
        waiting for a lock held by another process.  This kind of
        polling is inefficient, but POSIX doesn't really provide a way
-       to wait for multiple locks in the main select() loop. */
-    void waitForAWhile(GoalPtr goal);
+       to wait for multiple locks in the main poll() loop. */
+    void waitForAWhile(GoalPtr goal, WaitReason reason);
 
     /* Loop until the specified top-level goals have finished. */
     void run(const Goals & topGoals);
 
+    /* Log `schedStats' and `goalTimes', as a `resWorkerStats' result
+       and, with `-v', as text. */
+    void reportSchedulingStats();
+
     /* Wait for input to become available. */
     void waitForInput();
 
@@ -353,9 +528,33 @@ public:
 
     void markContentsGood(const Path & path);
 
+    /* The counts last added to `workerStats'. */
+    struct {
+        uint64_t runningBuilds = 0, doneBuilds = 0, failedBuilds = 0;
+        uint64_t runningSubstitutions = 0, doneSubstitutions = 0, failedSubstitutions = 0;
+        uint64_t doneNarSize = 0;
+    } reported;
+
+    void reportStats(bool finished = false)
+    {
+        auto report = [](std::atomic<uint64_t> & total, uint64_t & reported, uint64_t value) {
+            total += value - reported;
+            reported = value;
+        };
+        report(workerStats->runningBuilds, reported.runningBuilds, finished ? 0 : runningBuilds);
+        report(workerStats->doneBuilds, reported.doneBuilds, doneBuilds);
+        report(workerStats->failedBuilds, reported.failedBuilds, failedBuilds);
+        report(workerStats->runningSubstitutions, reported.runningSubstitutions, finished ? 0 : runningSubstitutions);
+        report(workerStats->doneSubstitutions, reported.doneSubstitutions, doneSubstitutions);
+        report(workerStats->failedSubstitutions, reported.failedSubstitutions, failedSubstitutions);
+        report(workerStats->substitutedNarSize, reported.doneNarSize, doneNarSize);
+    }
+
     void updateProgress()
     {
+        reportStats();
         actDerivations.progress(doneBuilds, expectedBuilds + doneBuilds, runningBuilds, failedBuilds);
+        actDerivations.setEstimate(expectedBuildTime / std::max(1U, (unsigned int) settings.maxBuildJobs));
         actSubstitutions.progress(doneSubstitutions, expectedSubstitutions + doneSubstitutions, runningSubstitutions, failedSubstitutions);
         act.setExpected(actDownload, expectedDownloadSize + doneDownloadSize);
         act.setExpected(actCopyPath, expectedNarSize + doneNarSize);
@@ -425,10 +624,29 @@ void Goal::amDone(ExitCode result)
         if (goal) goal->waiteeDone(shared_from_this(), result);
     }
     waiters.clear();
+    worker.goalFinished({name, timeCreated, steady_time_point::clock::now(), waitTime});
     worker.removeGoal(shared_from_this());
 }
 
 
+size_t Goal::getDepth(std::map<Goal *, size_t> & depths)
+{
+    auto i = depths.find(this);
+    if (i != depths.end()) return i->second;
+
+    /* Guard against cycles, which shouldn't exist anyway. */
+    depths[this] = 0;
+
+    size_t depth = 0;
+    for (auto & j : waiters) {
+        GoalPtr goal = j.lock();
+        if (goal) depth = std::max(depth, goal->getDepth(depths) + 1);
+    }
+
+    return depths[this] = depth;
+}
+
+
 void Goal::trace(const FormatOrString & fs)
 {
     debug("%1%: %2%", name, fs.s);
@@ -728,17 +946,40 @@ HookInstance::~HookInstance()
 //////////////////////////////////////////////////////////////////////
 
 
-typedef map<std::string, std::string> StringRewrites;
+/* Return the content hash of the valid path `path', i.e. the SHA-256
+   hash of its NAR in which the hash part of `path' has been zeroed
+   and those of its references have been replaced by their content
+   hashes.  Paths that differ only in the hash parts of equivalent
+   inputs thus get the same content hash.  Computed recursively and
+   cached in the database. */
+static Hash queryContentHash(LocalStore & store, const Path & path);
 
+static std::string contentHashPart(LocalStore & store, const Path & path)
+{
+    return string(queryContentHash(store, path).to_string(Base32, false), 0, storePathHashLen);
+}
 
-std::string rewriteStrings(std::string s, const StringRewrites & rewrites)
+static Hash queryContentHash(LocalStore & store, const Path & path)
 {
-    for (auto & i : rewrites) {
-        size_t j = 0;
-        while ((j = s.find(i.first, j)) != string::npos)
-            s.replace(j, i.first.size(), i.second);
-    }
-    return s;
+    if (auto hash = store.queryContentHash(path)) return *hash;
+
+    auto info = store.queryPathInfo(path);
+
+    StringRewrites rewrites;
+    for (auto & i : info->references)
+        if (i != path)
+            rewrites[storePathToHash(i)] = contentHashPart(store, i);
+    rewrites[storePathToHash(path)] = string(storePathHashLen, '0');
+
+    HashSink hashSink(htSHA256);
+    StringRewriter rewriter(rewrites);
+    RewritingSink sink(rewriter, hashSink);
+    store.narFromPath(path, sink);
+    sink.finish();
+    auto hash = hashSink.finish().first;
+
+    store.setContentHash(path, hash);
+    return hash;
 }
 
 
@@ -799,12 +1040,40 @@ private:
     /* The process ID of the builder. */
     Pid pid;
 
+#if __linux__
+    /* The cgroup of the builder, if `use-cgroups' is enabled. */
+    Path cgroup;
+#endif
+
     /* The temporary directory. */
     Path tmpDir;
 
     /* The path of the temporary directory in the sandbox. */
     Path tmpDirInSandbox;
 
+#if __linux__
+    /* The size of the tmpfs that the builder mounts on `tmpDir' in
+       its own mount namespace, or 0 to build on disk (see
+       `build-dir-tmpfs'). */
+    uint64_t buildDirTmpfsSize = 0;
+
+    /* Our share of `Worker::buildDirReserved'. */
+    uint64_t buildDirReserved = 0;
+
+    /* Set our share of `Worker::buildDirReserved' to `bytes'. */
+    void reserveBuildDir(uint64_t bytes);
+
+    /* Mount the tmpfs on `tmpDir'.  Called in the child. */
+    void mountBuildDirTmpfs();
+
+    /* Record the tmpfs usage of the build directory in
+       `result.peakBuildDirUsage', and release the part of our
+       reservation that is in use.  This is sampled through
+       /proc/<pid>/root whenever the builder writes to its log, so
+       writes made after the last log line are missed. */
+    void sampleBuildDirUsage();
+#endif
+
     /* File descriptor for the log file. */
     AutoCloseFD fdLogFile;
     std::shared_ptr<BufferedSink> logFileSink, logSink;
@@ -857,6 +1126,12 @@ private:
     typedef map<Path, ChrootPath> DirsInChroot; // maps target path to source path
     DirsInChroot dirsInChroot;
 
+    /* The entries of `dirsInChroot' that are input store paths.
+       Their mount points are created by the parent, and since store
+       paths don't contain mount points, they don't need a recursive
+       bind mount. */
+    PathSet inputDirsInChroot;
+
     typedef map<string, string> Environment;
     Environment env;
 
@@ -879,6 +1154,9 @@ private:
 
     BuildResult result;
 
+    /* Why we last postponed starting the build, if we did. */
+    string admissionBlocker;
+
     /* The current round, if we're building multiple times. */
     size_t curRound = 1;
 
@@ -890,12 +1168,29 @@ private:
        result. */
     std::map<Path, ValidPathInfo> prevInfos;
 
+    /* If nonzero, this goal is one of several rounds of a check
+       build, run concurrently by the goal in `checkRounds'. */
+    size_t checkRound = 0;
+
+    /* The goals running the rounds of a check build. */
+    std::vector<std::shared_ptr<DerivationGoal>> checkRounds;
+
     const uid_t sandboxUid = 1000;
     const gid_t sandboxGid = 100;
 
     const static Path homeDir;
 
-    std::unique_ptr<MaintainCount<uint64_t>> mcExpectedBuilds, mcRunningBuilds;
+    std::unique_ptr<MaintainCount<uint64_t>> mcExpectedBuilds, mcRunningBuilds, mcExpectedBuildTime;
+
+    /* How long the build is expected to take, based on previous
+       builds. */
+    std::optional<BuildTimes::Estimate> estimate;
+
+    /* When the current round of the build started. */
+    steady_time_point buildStarted;
+
+    /* When we first failed to acquire the output locks. */
+    std::optional<steady_time_point> lockWaitStarted;
 
     std::unique_ptr<Activity> act;
 
@@ -947,6 +1242,23 @@ private:
     void inputsRealised();
     void tryToBuild();
     void buildDone();
+    void checkRoundsDone();
+
+    /* The name under which the build times of this derivation are
+       recorded. */
+    string buildTimesName()
+    {
+        auto name = storePathToName(drvPath);
+        if (hasSuffix(name, drvExtension))
+            name.resize(name.size() - drvExtension.size());
+        return buildTimesKey(name);
+    }
+
+    /* Suffix distinguishing the files of concurrent check rounds. */
+    string roundSuffix()
+    {
+        return checkRound ? fmt("-%d", checkRound) : "";
+    }
 
     /* Is the build hook willing to perform the build? */
     HookReply tryBuildHook();
@@ -972,6 +1284,17 @@ private:
        as valid. */
     void registerOutputs();
 
+    /* Return the hash of the derivation in which the input
+       derivations have been replaced by the outputs they produced,
+       the paths of all inputs by their content hashes, and the
+       output paths by zeros (see `early-cutoff'). */
+    Hash resolvedHash();
+
+    /* Try to produce the outputs by rewriting those of an earlier
+       build of a derivation with the same resolved hash.  Returns
+       false if there is no such build. */
+    bool reuseEquivalentOutputs();
+
     /* Check that an output meets the requirements specified by the
        'outputChecks' attribute (or the legacy
        '{allowed,disallowed}{References,Requisites}' attributes). */
@@ -1011,7 +1334,16 @@ private:
 
     void done(BuildResult::Status status, const string & msg = "");
 
-    PathSet exportReferences(PathSet storePaths);
+    /* Return the closure of `storePaths' (which must be store paths
+       in the input closure), including the closures of the outputs
+       of derivations in it. */
+    PathSet exportReferences(const PathSet & storePaths);
+
+    /* Check the paths of an `exportReferencesGraph' entry, and return
+       the contents of the file (or, if `json' is set, of the
+       structured attribute) describing the graph of their
+       closure. */
+    const std::string & exportReferencesGraph(const PathSet & storePaths, bool json);
 };
 
 
@@ -1079,6 +1411,17 @@ inline bool DerivationGoal::needsHashRewrite()
 
 void DerivationGoal::killChild()
 {
+#if __linux__
+    if (cgroup != "") {
+        try {
+            destroyCgroup(cgroup);
+        } catch (...) {
+            ignoreException();
+        }
+        cgroup = "";
+    }
+#endif
+
     if (pid != -1) {
         worker.childTerminated(this);
 
@@ -1180,8 +1523,7 @@ void DerivationGoal::haveDerivation()
 
     retrySubstitution = false;
 
-    for (auto & i : drv->outputs)
-        worker.store.addTempRoot(i.second.path);
+    worker.store.addTempRoots(drv->outputPaths());
 
     /* Check what outputs paths are not already valid. */
     PathSet invalidOutputs = checkPathValidity(false, buildMode == bmRepair);
@@ -1208,6 +1550,25 @@ void DerivationGoal::haveDerivation()
 }
 
 
+/* Add temporary roots for `paths' (store paths, or derivations in
+   the form accepted by queryBuiltDerivations()) and the outputs of
+   the derivations, as their goals would.  This must be done before
+   checking whether they can be skipped, so that the garbage
+   collector can't delete what we've found to be there. */
+static void addSkipTempRoots(LocalStore & store, const PathSet & paths)
+{
+    PathSet roots;
+    for (auto & i : paths) {
+        auto path = parseDrvPathWithOutputs(i).first;
+        roots.insert(path);
+        if (isDerivation(path))
+            for (auto & j : store.queryDerivationOutputs(path))
+                roots.insert(j);
+    }
+    store.addTempRoots(roots);
+}
+
+
 void DerivationGoal::outputsSubstituted()
 {
     trace("all outputs substituted (maybe)");
@@ -1249,10 +1610,28 @@ void DerivationGoal::outputsSubstituted()
        outputs. */
     wantedOutputs = PathSet();
 
-    /* The inputs must be built before we can build this goal. */
-    if (useDerivation)
-        for (auto & i : dynamic_cast<Derivation *>(drv.get())->inputDrvs)
-            addWaitee(worker.makeDerivationGoal(i.first, i.second, buildMode == bmRepair ? bmRepair : bmNormal));
+    estimate = worker.buildTimes->lookup(buildTimesName(), drv->platform);
+    if (estimate)
+        mcExpectedBuildTime = std::make_unique<MaintainCount<uint64_t>>(
+            worker.expectedBuildTime, (long) estimate->wallTime);
+
+    /* The inputs must be built before we can build this goal. Skip
+       those that have already been built, without creating goals
+       for them. */
+    if (useDerivation) {
+        auto & inputDrvs(dynamic_cast<Derivation *>(drv.get())->inputDrvs);
+        PathSet built;
+        if (buildMode != bmRepair) {
+            PathSet inputs;
+            for (auto & i : inputDrvs)
+                inputs.insert(makeDrvPathWithOutputs(i.first, i.second));
+            addSkipTempRoots(worker.store, inputs);
+            built = worker.store.queryBuiltDerivations(inputs);
+        }
+        for (auto & i : inputDrvs)
+            if (!built.count(makeDrvPathWithOutputs(i.first, i.second)))
+                addWaitee(worker.makeDerivationGoal(i.first, i.second, buildMode == bmRepair ? bmRepair : bmNormal));
+    }
 
     for (auto & i : drv->inputSrcs) {
         if (worker.store.isValidPath(i)) continue;
@@ -1391,6 +1770,24 @@ void DerivationGoal::inputsRealised()
        verified by their output hash.*/
     nrRounds = fixedOutput ? 1 : settings.buildRepeat + 1;
 
+    /* All rounds of a check build are compared against the
+       registered outputs rather than against each other, so they
+       can run in parallel (each in its own sandbox and subject to
+       the usual job limits). */
+    if (buildMode == bmCheck && nrRounds > 1 && !checkRound) {
+        for (size_t n = 1; n <= nrRounds; ++n) {
+            auto goal = std::make_shared<DerivationGoal>(drvPath, wantedOutputs, worker, bmCheck);
+            goal->checkRound = n;
+            checkRounds.push_back(goal);
+            addWaitee(goal);
+            worker.wakeUp(goal);
+        }
+        state = &DerivationGoal::checkRoundsDone;
+        return;
+    }
+
+    if (checkRound) curRound = checkRound;
+
     /* Okay, try to build.  Note that here we don't wait for a build
        slot to become available, since we don't need one if there is a
        build hook. */
@@ -1411,14 +1808,34 @@ void DerivationGoal::tryToBuild()
        goal can start a build, and if not, the main loop will sleep a
        few seconds and then retry this goal. */
     PathSet lockFiles;
-    for (auto & outPath : drv->outputPaths())
-        lockFiles.insert(worker.store.toRealPath(outPath));
+    /* Concurrent check rounds don't lock the outputs, since they
+       don't write to them. */
+    if (!checkRound)
+        for (auto & outPath : drv->outputPaths())
+            lockFiles.insert(worker.store.toRealPath(outPath));
 
     if (!outputLocks.lockPaths(lockFiles, "", false)) {
-        worker.waitForAWhile(shared_from_this());
+        if (!lockWaitStarted) lockWaitStarted = steady_time_point::clock::now();
+        worker.schedStats.lockFailures++;
+        /* If another goal holds the locks, retry as soon as some
+           goal finishes rather than after the poll interval. */
+        for (auto & i : lockFiles)
+            if (pathIsLockedByMe(i)) {
+                worker.waitForAnyGoal(shared_from_this(), wrLocks);
+                break;
+            }
+        worker.waitForAWhile(shared_from_this(), wrLocks);
         return;
     }
 
+    if (lockWaitStarted) {
+        result.lockWaitTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+            steady_time_point::clock::now() - *lockWaitStarted).count();
+        lockWaitStarted.reset();
+        printMsg(lvlChatty, "waited %.1f s for the output locks of '%s'",
+            result.lockWaitTime / 1e3, drvPath);
+    }
+
     /* Now check again whether the outputs are valid.  This is because
        another process may have started building in parallel.  After
        it has finished and released the locks, we can (and should)
@@ -1447,6 +1864,29 @@ void DerivationGoal::tryToBuild()
         deletePath(worker.store.toRealPath(path));
     }
 
+    /* If an equivalent derivation has been built before, reuse its
+       outputs.  If that fails (e.g. because the old outputs are
+       damaged), just do the build. */
+    if (settings.earlyCutoff && buildMode == bmNormal && useDerivation
+        && !drv->isFixedOutput() && validPaths.empty())
+    {
+        bool reused = false;
+        try {
+            reused = reuseEquivalentOutputs();
+        } catch (Error & e) {
+            printError("warning: could not reuse the outputs of an equivalent build of '%s', building it instead: %s",
+                drvPath, e.msg());
+            for (auto & i : drv->outputs)
+                if (!worker.store.isValidPath(i.second.path))
+                    deletePath(worker.store.toRealPath(i.second.path));
+        }
+        if (reused) {
+            outputLocks.setDeletion(true);
+            done(BuildResult::Substituted);
+            return;
+        }
+    }
+
     /* Don't do a remote build if the derivation has the attribute
        `preferLocalBuild' set.  Also, check and repair modes are only
        supported for local builds. */
@@ -1455,6 +1895,7 @@ void DerivationGoal::tryToBuild()
     auto started = [&]() {
         auto msg = fmt(
             buildMode == bmRepair ? "repairing outputs of '%s'" :
+            buildMode == bmCheck && nrRounds > 1 ? "checking outputs of '%s' (round %d/%d)" :
             buildMode == bmCheck ? "checking outputs of '%s'" :
             nrRounds > 1 ? "building '%s' (round %d/%d)" :
             "building '%s'", drvPath, curRound, nrRounds);
@@ -1463,15 +1904,21 @@ void DerivationGoal::tryToBuild()
         act = std::make_unique<Activity>(*logger, lvlInfo, actBuild, msg,
             Logger::Fields{drvPath, hook ? machineName : "", curRound, nrRounds});
         mcRunningBuilds = std::make_unique<MaintainCount<uint64_t>>(worker.runningBuilds);
+        buildStarted = steady_time_point::clock::now();
+        if (estimate) act->setEstimate(estimate->wallTime);
         worker.updateProgress();
     };
 
     /* Is the build hook willing to accept this job? */
     if (!buildLocally) {
-        switch (tryBuildHook()) {
+        auto hookStarted = steady_time_point::clock::now();
+        auto reply = tryBuildHook();
+        worker.schedStats.hookTime += steady_time_point::clock::now() - hookStarted;
+        switch (reply) {
             case rpAccept:
                 /* Yes, it has started doing so.  Wait until we get
                    EOF from the hook. */
+                worker.schedStats.hookAccepted++;
                 result.startTime = time(0); // inexact
                 state = &DerivationGoal::buildDone;
                 started();
@@ -1479,11 +1926,13 @@ void DerivationGoal::tryToBuild()
             case rpPostpone:
                 /* Not now; wait until at least one child finishes or
                    the wake-up timeout expires. */
-                worker.waitForAWhile(shared_from_this());
+                worker.schedStats.hookPostponed++;
+                worker.waitForAWhile(shared_from_this(), wrHookPostponed);
                 outputLocks.unlock();
                 return;
             case rpDecline:
                 /* We should do it ourselves. */
+                worker.schedStats.hookDeclined++;
                 break;
         }
     }
@@ -1498,6 +1947,21 @@ void DerivationGoal::tryToBuild()
         return;
     }
 
+    /* Don't start the build if the machine is overloaded, unless
+       nothing else is building, in which case waiting won't help. */
+    if (curBuilds > 0) {
+        auto blocker = worker.getAdmissionBlocker(*drv, estimate ? estimate->peakMemory : 0);
+        if (blocker != "") {
+            if (blocker != admissionBlocker)
+                printInfo("waiting to build '%s': %s", drvPath, blocker);
+            admissionBlocker = blocker;
+            worker.waitForAWhile(shared_from_this(), wrAdmission);
+            outputLocks.unlock();
+            return;
+        }
+    }
+    admissionBlocker = "";
+
     try {
 
         /* Okay, we have to build. */
@@ -1568,6 +2032,34 @@ void DerivationGoal::buildDone()
     } else
         builderOut.readSide = -1;
 
+#if __linux__
+    /* Record the resource usage of the build and get rid of any
+       processes it left behind. */
+    if (cgroup != "") {
+        auto stats = getCgroupStats(cgroup);
+        result.cpuUser = stats.cpuUser;
+        result.cpuSystem = stats.cpuSystem;
+        result.peakMemory = stats.peakMemory;
+        result.ioRead = stats.ioRead;
+        result.ioWrite = stats.ioWrite;
+        auto msg = fmt("resource usage: %.2f s user, %.2f s system, %d MiB peak memory, "
+            "%d MiB read, %d MiB written",
+            stats.cpuUser / 1e6, stats.cpuSystem / 1e6, stats.peakMemory >> 20,
+            stats.ioRead >> 20, stats.ioWrite >> 20);
+        debug("%s: %s", drvPath, msg);
+        if (logSink) (*logSink)("\n" + msg + "\n");
+        destroyCgroup(cgroup);
+        cgroup = "";
+    }
+
+    if (buildDirTmpfsSize) {
+        reserveBuildDir(0);
+        auto msg = fmt("build directory: %d MiB peak tmpfs usage", result.peakBuildDirUsage >> 20);
+        debug("%s: %s", drvPath, msg);
+        if (logSink) (*logSink)("\n" + msg + "\n");
+    }
+#endif
+
     /* Close the log file. */
     closeLogFile();
 
@@ -1629,6 +2121,19 @@ void DerivationGoal::buildDone()
            being valid. */
         registerOutputs();
 
+        /* Remember how long the build took, for estimating later
+           builds. Remote builds aren't recorded since their duration
+           depends on the machine. */
+        if (!hook) {
+            double wallTime = std::chrono::duration<double>(steady_time_point::clock::now() - buildStarted).count();
+            try {
+                worker.buildTimes->record(buildTimesName(), drv->platform,
+                    wallTime, (result.cpuUser + result.cpuSystem) / 1e6, result.peakMemory);
+            } catch (Error & e) {
+                debug("cannot record build time of '%s': %s", drvPath, e.what());
+            }
+        }
+
         if (buildMode == bmCheck) {
             done(BuildResult::Built);
             return;
@@ -1687,6 +2192,32 @@ void DerivationGoal::buildDone()
 }
 
 
+void DerivationGoal::checkRoundsDone()
+{
+    trace("check rounds done");
+
+    /* Report the most interesting failure, preferring a difference
+       in the outputs over other errors. */
+    const BuildResult * failure = nullptr;
+    for (auto & goal : checkRounds) {
+        if (goal->getExitCode() == ecBusy) continue;
+        auto & res(goal->result);
+        if (res.success()) continue;
+        if (!failure || res.status == BuildResult::NotDeterministic)
+            failure = &res;
+    }
+
+    if (failure)
+        done(failure->status, failure->errorMsg);
+    else if (nrFailed)
+        done(BuildResult::MiscFailure, fmt("some rounds of checking '%s' failed", drvPath));
+    else
+        done(BuildResult::Built);
+
+    checkRounds.clear();
+}
+
+
 HookReply DerivationGoal::tryBuildHook()
 {
     if (!worker.tryBuildHook || !useDerivation) return rpDecline;
@@ -1787,40 +2318,70 @@ int childEntry(void * arg)
 }
 
 
-PathSet DerivationGoal::exportReferences(PathSet storePaths)
+PathSet DerivationGoal::exportReferences(const PathSet & storePaths)
 {
+    /* Compute the closure of all paths at once, so that the local
+       store can do it with a single query. */
     PathSet paths;
+    worker.store.computeFSClosure(storePaths, paths);
+
+    /* If there are derivations in the graph, then include their
+       outputs as well.  This is useful if you want to do things
+       like passing all build-time dependencies of some path to a
+       derivation that builds a NixOS DVD image. */
+    PathSet outputs;
+    for (auto & j : paths)
+        if (isDerivation(j)) {
+            Derivation drv = worker.store.derivationFromPath(j);
+            for (auto & k : drv.outputs)
+                if (!paths.count(k.second.path))
+                    outputs.insert(k.second.path);
+        }
+
+    if (!outputs.empty())
+        worker.store.computeFSClosure(outputs, paths);
+
+    return paths;
+}
 
-    for (auto storePath : storePaths) {
 
-        /* Check that the store path is valid. */
+const std::string & DerivationGoal::exportReferencesGraph(const PathSet & storePaths, bool json)
+{
+    /* The paths are checked before consulting the cache, since what
+       may be exported depends on the inputs of this derivation. */
+    PathSet paths;
+    for (auto & storePath : storePaths) {
         if (!worker.store.isInStore(storePath))
             throw BuildError(format("'exportReferencesGraph' contains a non-store path '%1%'")
                 % storePath);
 
-        storePath = worker.store.toStorePath(storePath);
+        auto storePath2 = worker.store.toStorePath(storePath);
 
-        if (!inputPaths.count(storePath))
-            throw BuildError("cannot export references of path '%s' because it is not in the input closure of the derivation", storePath);
+        if (!inputPaths.count(storePath2))
+            throw BuildError("cannot export references of path '%s' because it is not in the input closure of the derivation", storePath2);
 
-        worker.store.computeFSClosure(storePath, paths);
+        paths.insert(storePath2);
     }
 
-    /* If there are derivations in the graph, then include their
-       outputs as well.  This is useful if you want to do things
-       like passing all build-time dependencies of some path to a
-       derivation that builds a NixOS DVD image. */
-    PathSet paths2(paths);
+    auto key = std::make_pair(paths, json);
 
-    for (auto & j : paths2) {
-        if (isDerivation(j)) {
-            Derivation drv = worker.store.derivationFromPath(j);
-            for (auto & k : drv.outputs)
-                worker.store.computeFSClosure(k.second.path, paths);
+    auto i = worker.exportedGraphs.find(key);
+    if (i != worker.exportedGraphs.end()) return i->second;
+
+    auto closure = exportReferences(paths);
+
+    std::string graph;
+    if (json) {
+        std::ostringstream str;
+        {
+            JSONPlaceholder jsonRoot(str, true);
+            worker.store.pathInfoToJSON(jsonRoot, closure, false, true);
         }
-    }
+        graph = str.str();
+    } else
+        graph = worker.store.makeValidityRegistration(closure, false, false);
 
-    return paths;
+    return worker.exportedGraphs.emplace(key, std::move(graph)).first->second;
 }
 
 static std::once_flag dns_resolve_flag;
@@ -1839,8 +2400,112 @@ static void preloadNSS() {
     });
 }
 
+/* Read up to `limit' bytes of the regular files in `paths' (real
+   paths of store paths) into the page cache, most recently accessed
+   files first, stopping early if `cancelled' returns true. */
+static void prefetchFiles(const Paths & paths, uint64_t limit, std::function<bool()> cancelled)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    struct File
+    {
+        Path path;
+        off_t size;
+        time_t atime;
+    };
+
+    std::vector<File> files;
+
+    std::function<void(const Path &)> walk;
+    walk = [&](const Path & path) {
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1) return;
+        if (S_ISDIR(st.st_mode)) {
+            for (auto & entry : readDirectory(path))
+                walk(path + "/" + entry.name);
+        } else if (S_ISREG(st.st_mode) && st.st_size)
+            files.push_back({path, st.st_size, st.st_atime});
+    };
+
+    for (auto & path : paths) {
+        if (cancelled()) return;
+        walk(path);
+    }
+
+    /* Access times (even with `relatime') are the only record of
+       which files builds actually use. */
+    std::stable_sort(files.begin(), files.end(), [](const File & a, const File & b) {
+        return a.atime > b.atime;
+    });
+
+    uint64_t bytes = 0;
+    size_t n = 0;
+    for (auto & file : files) {
+        if (bytes + file.size > limit || cancelled()) break;
+        /* Don't let the prefetch itself count as an access. */
+        AutoCloseFD fd;
+#ifdef O_NOATIME
+        fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC | O_NOATIME);
+#endif
+        if (!fd) fd = open(file.path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) continue;
+#ifdef POSIX_FADV_WILLNEED
+        posix_fadvise(fd.get(), 0, 0, POSIX_FADV_WILLNEED);
+#endif
+        bytes += file.size;
+        n++;
+    }
+
+    debug("prefetched %d of %d input files (%d MiB) in %.1f s",
+        n, files.size(), bytes >> 20,
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
+
+
+#if __linux__
+/* Return the scratch space in bytes that `drv' declares in
+   `__scratchHint' (in MiB), or 0. */
+static uint64_t getScratchHint(const BasicDerivation & drv)
+{
+    auto i = drv.env.find("__scratchHint");
+    uint64_t hint;
+    return i != drv.env.end() && string2Int(i->second, hint) ? hint * 1024 * 1024 : 0;
+}
+
+
+/* Return the maximum size in bytes of a tmpfs build directory (see
+   `build-dir-tmpfs') for `drv', or 0 if its build directory should
+   be on disk.  Derivations that need more scratch space than the
+   maximum get a directory on disk.  So do all derivations if
+   `keep-failed' is set, since the tmpfs goes away with the build's
+   mount namespace. */
+static uint64_t getBuildDirTmpfsSize(const BasicDerivation & drv)
+{
+    if (!settings.buildDirTmpfs || settings.keepFailed || getuid() != 0) return 0;
+
+    auto size = (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE)
+        / 100 * std::min((unsigned int) settings.buildDirTmpfs, 100U);
+
+    return getScratchHint(drv) > size ? 0 : size;
+}
+
+
+/* Return the memory in bytes that the tmpfs build directory of `drv'
+   may take up: its declared scratch space, or else all of the tmpfs. */
+static uint64_t getBuildDirReservation(const BasicDerivation & drv)
+{
+    auto size = getBuildDirTmpfsSize(drv);
+    if (!size) return 0;
+    auto hint = getScratchHint(drv);
+    return hint ? hint : size;
+}
+#endif
+
+
 void DerivationGoal::startBuilder()
 {
+    auto setupStart = std::chrono::steady_clock::now();
+
     /* Right platform? */
     if (!parsedDrv->canBuildLocally())
         throw Error("a '%s' with features {%s} is required to build '%s', but I am a '%s' with features {%s}",
@@ -1853,6 +2518,15 @@ void DerivationGoal::startBuilder()
     if (drv->isBuiltin())
         preloadNSS();
 
+    /* Warm up the input closure while the build environment is set
+       up. */
+    if (settings.prefetchBuildInputs) {
+        Paths paths;
+        for (auto & i : inputPaths)
+            paths.push_back(worker.store.toRealPath(i));
+        worker.prefetchInputs(shared_from_this(), std::move(paths), settings.prefetchBuildInputs);
+    }
+
 #if __APPLE__
     additionalSandboxProfile = parsedDrv->getStringAttr("__sandboxProfile").value_or("");
 #endif
@@ -1906,6 +2580,16 @@ void DerivationGoal::startBuilder()
     auto drvName = storePathToName(drvPath);
     tmpDir = createTempDir("", "nix-build-" + drvName, false, false, 0700);
 
+#if __linux__
+    /* Put the build directory on a tmpfs of its own, if enabled.
+       The child mounts it in its own mount namespace, so that it
+       goes away with the builder, even if we don't get to clean up.
+       Until then, hold back the memory that it may take up from
+       other builds. */
+    if ((buildDirTmpfsSize = getBuildDirTmpfsSize(*drv)))
+        reserveBuildDir(getBuildDirReservation(*drv));
+#endif
+
     /* In a sandbox, for determinism, always use the same temporary
        directory. */
 #if __linux__
@@ -1944,8 +2628,7 @@ void DerivationGoal::startBuilder()
 
             /* Write closure info to <fileName>. */
             writeFile(tmpDir + "/" + fileName,
-                worker.store.makeValidityRegistration(
-                    exportReferences({storePath}), false, false));
+                exportReferencesGraph({storePath}, false));
         }
     }
 
@@ -2017,7 +2700,7 @@ void DerivationGoal::startBuilder()
            environment using bind-mounts.  We put it in the Nix store
            to ensure that we can create hard-links to non-directory
            inputs in the fake Nix store in the chroot (see below). */
-        chrootRootDir = worker.store.toRealPath(drvPath) + ".chroot";
+        chrootRootDir = worker.store.toRealPath(drvPath) + ".chroot" + roundSuffix();
         deletePath(chrootRootDir);
 
         /* Clean up the chroot directory automatically. */
@@ -2075,14 +2758,17 @@ void DerivationGoal::startBuilder()
         if (buildUser && chown(chrootStoreDir.c_str(), 0, buildUser->getGID()) == -1)
             throw SysError(format("cannot change ownership of '%1%'") % chrootStoreDir);
 
+        inputDirsInChroot.clear();
+
         for (auto & i : inputPaths) {
             Path r = worker.store.toRealPath(i);
             struct stat st;
             if (lstat(r.c_str(), &st))
                 throw SysError(format("getting attributes of path '%1%'") % i);
-            if (S_ISDIR(st.st_mode))
+            if (S_ISDIR(st.st_mode)) {
                 dirsInChroot[i] = r;
-            else {
+                inputDirsInChroot.insert(i);
+            } else {
                 Path p = chrootRootDir + i;
                 debug("linking '%1%' to '%2%'", p, r);
                 if (link(r.c_str(), p.c_str()) == -1) {
@@ -2105,8 +2791,14 @@ void DerivationGoal::startBuilder()
            rebuilding a path that is in settings.dirsInChroot
            (typically the dependencies of /bin/sh).  Throw them
            out. */
-        for (auto & i : drv->outputs)
+        for (auto & i : drv->outputs) {
             dirsInChroot.erase(i.second.path);
+            inputDirsInChroot.erase(i.second.path);
+        }
+
+        for (auto & i : inputDirsInChroot)
+            if (mkdir((chrootRootDir + i).c_str(), 0755) == -1)
+                throw SysError("creating directory '%s'", chrootRootDir + i);
 
 #elif __APPLE__
         /* We don't really have any parent prep work to do (yet?)
@@ -2335,6 +3027,18 @@ void DerivationGoal::startBuilder()
         writeFile("/proc/" + std::to_string(pid) + "/gid_map",
             (format("%d %d 1") % sandboxGid % hostGid).str());
 
+        /* Move the builder into its own cgroup before it can fork. */
+        if (settings.useCgroups) {
+            auto ourCgroup = getOwnCgroup();
+            if (ourCgroup == "")
+                throw Error("'use-cgroups' requires the cgroup v2 hierarchy to be mounted on /sys/fs/cgroup");
+            cgroup = fmt("%s/nix-build-%d-%s%s", ourCgroup, getpid(), storePathToHash(drvPath), roundSuffix());
+            destroyCgroup(cgroup);
+            if (mkdir(cgroup.c_str(), 0755) == -1)
+                throw SysError("creating cgroup '%s'", cgroup);
+            writeFile(cgroup + "/cgroup.procs", std::to_string(pid));
+        }
+
         /* Signal the builder that we've updated its user
            namespace. */
         writeFull(userNamespaceSync.writeSide.get(), "1");
@@ -2363,6 +3067,11 @@ void DerivationGoal::startBuilder()
         }
         debug(msg);
     }
+
+    auto setupTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - setupStart).count();
+    printMsg(lvlChatty, "setting up the build environment of '%s' took %d ms (%d bind mounts)",
+        drvPath, setupTime, useChroot ? dirsInChroot.size() : 0);
 }
 
 
@@ -2468,32 +3177,75 @@ void DerivationGoal::writeStructuredAttrs()
     auto & structuredAttrs = parsedDrv->getStructuredAttrs();
     if (!structuredAttrs) return;
 
-    auto json = *structuredAttrs;
+    if (!structuredAttrs->is_object())
+        throw BuildError("the structured attributes of '%s' are not an object", drvPath);
+
+    /* The attributes added to (or replacing) those of the
+       derivation.  The others are written straight from
+       `structuredAttrs', so that large attribute sets aren't copied
+       or serialised into strings. */
+    nlohmann::json extraAttrs;
 
     /* Add an "outputs" object containing the output paths. */
     nlohmann::json outputs;
     for (auto & i : drv->outputs)
-        outputs[i.first] = rewriteStrings(i.second.path, inputRewrites);
-    json["outputs"] = outputs;
+        outputs[i.first] = i.second.path;
+    extraAttrs["outputs"] = outputs;
 
     /* Handle exportReferencesGraph. */
-    auto e = json.find("exportReferencesGraph");
-    if (e != json.end() && e->is_object()) {
+    auto e = structuredAttrs->find("exportReferencesGraph");
+    if (e != structuredAttrs->end() && e->is_object()) {
         for (auto i = e->begin(); i != e->end(); ++i) {
-            std::ostringstream str;
-            {
-                JSONPlaceholder jsonRoot(str, true);
-                PathSet storePaths;
-                for (auto & p : *i)
-                    storePaths.insert(p.get<std::string>());
-                worker.store.pathInfoToJSON(jsonRoot,
-                    exportReferences(storePaths), false, true);
-            }
-            json[i.key()] = nlohmann::json::parse(str.str()); // urgh
+            PathSet storePaths;
+            for (auto & p : *i)
+                storePaths.insert(p.get<std::string>());
+            extraAttrs[i.key()] = nlohmann::json::parse(exportReferencesGraph(storePaths, true)); // urgh
         }
     }
 
-    writeFile(tmpDir + "/.attrs.json", rewriteStrings(json.dump(), inputRewrites));
+    /* Call `f' on the attributes in order, as if `extraAttrs' had
+       been merged into `structuredAttrs'. */
+    auto forEachAttr = [&](std::function<void(const std::string &, const nlohmann::json &)> f) {
+        auto i = structuredAttrs->cbegin();
+        auto j = extraAttrs.cbegin();
+        while (i != structuredAttrs->cend() || j != extraAttrs.cend()) {
+            if (j == extraAttrs.cend() || (i != structuredAttrs->cend() && i.key() < j.key())) {
+                f(i.key(), i.value());
+                ++i;
+            } else {
+                if (i != structuredAttrs->cend() && i.key() == j.key()) ++i;
+                f(j.key(), j.value());
+                ++j;
+            }
+        }
+    };
+
+    /* Write a file in the build directory, replacing the output
+       placeholders on the way. */
+    StringRewriter rewriter(inputRewrites);
+
+    auto writeAttrsFile = [&](const std::string & name, std::function<void(std::ostream &)> write) {
+        Path path = tmpDir + "/" + name;
+        AutoCloseFD fd = open(path.c_str(), O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("opening file '%1%'", path);
+        FdSink fdSink(fd.get());
+        RewritingSink sink(rewriter, fdSink);
+        SinkStream str(sink);
+        write(str);
+        sink.finish();
+        fdSink.flush();
+    };
+
+    writeAttrsFile(".attrs.json", [&](std::ostream & str) {
+        str << '{';
+        bool first = true;
+        forEachAttr([&](const std::string & name, const nlohmann::json & value) {
+            if (!first) str << ',';
+            first = false;
+            str << nlohmann::json(name) << ':' << value;
+        });
+        str << '}';
+    });
 
     /* As a convenience to bash scripts, write a shell file that
        maps all attributes that are representable in bash -
@@ -2501,67 +3253,60 @@ void DerivationGoal::writeStructuredAttrs()
        objects consisting entirely of those values. (So nested
        arrays or objects are not supported.) */
 
-    auto handleSimpleType = [](const nlohmann::json & value) -> std::optional<std::string> {
-        if (value.is_string())
-            return shellEscape(value);
-
+    auto isSimpleType = [](const nlohmann::json & value) {
         if (value.is_number()) {
             auto f = value.get<float>();
-            if (std::ceil(f) == f)
-                return std::to_string(value.get<int>());
+            return std::ceil(f) == f;
         }
-
-        if (value.is_null())
-            return std::string("''");
-
-        if (value.is_boolean())
-            return value.get<bool>() ? std::string("1") : std::string("");
-
-        return {};
+        return value.is_string() || value.is_null() || value.is_boolean();
     };
 
-    std::string jsonSh;
-
-    for (auto i = json.begin(); i != json.end(); ++i) {
-
-        if (!std::regex_match(i.key(), shVarName)) continue;
+    auto writeSimpleType = [](std::ostream & str, const nlohmann::json & value) {
+        if (value.is_string())
+            str << shellEscape(value);
+        else if (value.is_number())
+            str << value.get<int>();
+        else if (value.is_null())
+            str << "''";
+        else if (value.get<bool>())
+            str << '1';
+    };
 
-        auto & value = i.value();
+    auto allSimple = [&](const nlohmann::json & value) {
+        return std::all_of(value.begin(), value.end(), isSimpleType);
+    };
 
-        auto s = handleSimpleType(value);
-        if (s)
-            jsonSh += fmt("declare %s=%s\n", i.key(), *s);
+    writeAttrsFile(".attrs.sh", [&](std::ostream & str) {
+        forEachAttr([&](const std::string & name, const nlohmann::json & value) {
 
-        else if (value.is_array()) {
-            std::string s2;
-            bool good = true;
+            if (!std::regex_match(name, shVarName)) return;
 
-            for (auto i = value.begin(); i != value.end(); ++i) {
-                auto s3 = handleSimpleType(i.value());
-                if (!s3) { good = false; break; }
-                s2 += *s3; s2 += ' ';
+            if (isSimpleType(value)) {
+                str << "declare " << name << '=';
+                writeSimpleType(str, value);
+                str << '\n';
             }
 
-            if (good)
-                jsonSh += fmt("declare -a %s=(%s)\n", i.key(), s2);
-        }
-
-        else if (value.is_object()) {
-            std::string s2;
-            bool good = true;
-
-            for (auto i = value.begin(); i != value.end(); ++i) {
-                auto s3 = handleSimpleType(i.value());
-                if (!s3) { good = false; break; }
-                s2 += fmt("[%s]=%s ", shellEscape(i.key()), *s3);
+            else if (value.is_array() && allSimple(value)) {
+                str << "declare -a " << name << "=(";
+                for (auto & i : value) {
+                    writeSimpleType(str, i);
+                    str << ' ';
+                }
+                str << ")\n";
             }
 
-            if (good)
-                jsonSh += fmt("declare -A %s=(%s)\n", i.key(), s2);
-        }
-    }
-
-    writeFile(tmpDir + "/.attrs.sh", rewriteStrings(jsonSh, inputRewrites));
+            else if (value.is_object() && allSimple(value)) {
+                str << "declare -A " << name << "=(";
+                for (auto i = value.begin(); i != value.end(); ++i) {
+                    str << '[' << shellEscape(i.key()) << "]=";
+                    writeSimpleType(str, i.value());
+                    str << ' ';
+                }
+                str << ")\n";
+            }
+        });
+    });
 }
 
 
@@ -2704,6 +3449,10 @@ void DerivationGoal::runChild()
                 throw SysError("unable to make '/' private mount");
             }
 
+            /* Put the build directory on a tmpfs (before it gets
+               bind-mounted into the chroot). */
+            if (buildDirTmpfsSize) mountBuildDirTmpfs();
+
             /* Bind-mount chroot directory to itself, to treat it as a
                different filesystem from /, as needed for pivot_root. */
             if (mount(chrootRootDir.c_str(), chrootRootDir.c_str(), 0, MS_BIND, 0) == -1)
@@ -2773,6 +3522,12 @@ void DerivationGoal::runChild()
 
             for (auto & i : dirsInChroot) {
                 if (i.second.source == "/proc") continue; // backwards compatibility
+                if (inputDirsInChroot.count(i.first)) {
+                    auto target = chrootRootDir + i.first;
+                    if (mount(i.second.source.c_str(), target.c_str(), "", MS_BIND, 0) == -1)
+                        throw SysError("bind mount from '%1%' to '%2%' failed", i.second.source, target);
+                    continue;
+                }
                 doBind(i.second.source, chrootRootDir + i.first, i.second.optional);
             }
 
@@ -2839,6 +3594,16 @@ void DerivationGoal::runChild()
 
             setUser = false;
         }
+
+        /* Without a sandbox, the builder needs a mount namespace of
+           its own for the tmpfs. */
+        else if (buildDirTmpfsSize) {
+            if (unshare(CLONE_NEWNS) == -1)
+                throw SysError("setting up a private mount namespace");
+            if (mount(0, "/", 0, MS_REC|MS_PRIVATE, 0) == -1)
+                throw SysError("unable to make '/' private mount");
+            mountBuildDirTmpfs();
+        }
 #endif
 
         if (chdir(tmpDirInSandbox.c_str()) == -1)
@@ -2878,10 +3643,12 @@ void DerivationGoal::runChild()
 
         // FIXME: set other limits to deterministic values?
 
+        StringRewriter rewriter(inputRewrites);
+
         /* Fill in the environment. */
         Strings envStrs;
         for (auto & i : env)
-            envStrs.push_back(rewriteStrings(i.first + "=" + i.second, inputRewrites));
+            envStrs.push_back(rewriter.rewrite(i.first + "=" + i.second));
 
         /* If we are running in `build-users' mode, then switch to the
            user we allocated above.  Make sure that we drop all root
@@ -3046,7 +3813,7 @@ void DerivationGoal::runChild()
         }
 
         for (auto & i : drv->args)
-            args.push_back(rewriteStrings(i, inputRewrites));
+            args.push_back(rewriter.rewrite(i));
 
         /* Indicate that we managed to set up the build environment. */
         writeFull(STDERR_FILENO, string("\1\n"));
@@ -3058,12 +3825,16 @@ void DerivationGoal::runChild()
 
                 BasicDerivation drv2(*drv);
                 for (auto & e : drv2.env)
-                    e.second = rewriteStrings(e.second, inputRewrites);
+                    e.second = rewriter.rewrite(e.second);
 
                 if (drv->builder == "builtin:fetchurl")
                     builtinFetchurl(drv2, netrcData);
                 else if (drv->builder == "builtin:buildenv")
                     builtinBuildenv(drv2);
+                else if (drv->builder == "builtin:unpack-channel")
+                    builtinUnpackChannel(drv2);
+                else if (drv->builder == "builtin:pack-closure")
+                    builtinPackClosure(drv2);
                 else
                     throw Error(format("unsupported builtin function '%1%'") % string(drv->builder, 8));
                 _exit(0);
@@ -3119,21 +3890,39 @@ void DerivationGoal::registerOutputs()
     /* Set of inodes seen during calls to canonicalisePathMetaData()
        for this build's outputs.  This needs to be shared between
        outputs to allow hard links between outputs. */
-    InodesSeen inodesSeen;
+    Sync<InodesSeen> inodesSeen;
 
-    Path checkSuffix = ".check";
+    Path checkSuffix = ".check" + roundSuffix();
     bool keepPreviousRound = settings.keepFailed || settings.runDiffHook;
 
     std::exception_ptr delayedException;
 
-    /* Check whether the output paths were created, and grep each
-       output path to determine what other paths it references.  Also make all
+    /* The outputs being registered.  Each output is read only once
+       after the build: the NAR serialisation is scanned for
+       references, hashed and (for fixed-output derivations) checked
+       against the expected hash in a single pass. */
+    struct Output
+    {
+        string name;
+        Path path, actualPath;
+        ValidPathInfo info;
+        uid_t fromUid;
+        bool scanned = false;
+        PathSet references;
+        HashResult hash;
+    };
+    std::vector<Output> outputs;
+
+    /* Check whether the output paths were created, and make all
        output paths read-only. */
     for (auto & i : drv->outputs) {
         Path path = i.second.path;
         if (missingPaths.find(path) == missingPaths.end()) continue;
 
         ValidPathInfo info;
+        PathSet references;
+        HashResult hash;
+        bool scanned = false;
 
         Path actualPath = path;
         if (useChroot) {
@@ -3186,15 +3975,27 @@ void DerivationGoal::registerOutputs()
             /* Canonicalise first.  This ensures that the path we're
                rewriting doesn't contain a hard link to /etc/shadow or
                something like that. */
-            canonicalisePathMetaData(actualPath, buildUser ? buildUser->getUID() : -1, inodesSeen);
+            {
+                ThreadPool pool;
+                canonicalisePathMetaData(actualPath, buildUser ? buildUser->getUID() : -1, inodesSeen, pool);
+                pool.process();
+            }
 
-            /* FIXME: this is in-memory. */
-            StringSink sink;
-            dumpPath(actualPath, sink);
-            deletePath(actualPath);
-            sink.s = make_ref<std::string>(rewriteStrings(*sink.s, outputRewrites));
-            StringSource source(*sink.s);
-            restorePath(actualPath, source);
+            /* Stream the output through the rewriter into a fresh
+               copy. */
+            Path tmpPath = actualPath + ".rewrite";
+            deletePath(tmpPath);
+            if (rename(actualPath.c_str(), tmpPath.c_str()) == -1)
+                throw SysError("renaming '%s' to '%s'", actualPath, tmpPath);
+
+            StringRewriter rewriter(outputRewrites);
+            auto source = sinkToSource([&](Sink & nextSink) {
+                RewritingSink sink(rewriter, nextSink);
+                dumpPath(tmpPath, sink);
+                sink.finish();
+            });
+            restorePath(actualPath, *source);
+            deletePath(tmpPath);
 
             rewritten = true;
         }
@@ -3216,8 +4017,19 @@ void DerivationGoal::registerOutputs()
             }
 
             /* Check the hash. In hash mode, move the path produced by
-               the derivation to its content-addressed location. */
-            Hash h2 = recursive ? hashPath(h.type, actualPath).first : hashFile(h.type, actualPath);
+               the derivation to its content-addressed location.  In
+               recursive mode, the hash is computed while scanning for
+               references. */
+            Hash h2(h.type);
+            if (recursive) {
+                debug("scanning for references inside '%1%'", path);
+                HashSink hashSink(h.type);
+                references = scanForReferences(actualPath, allPaths, hash,
+                    h.type == htSHA256 ? nullptr : &hashSink);
+                h2 = h.type == htSHA256 ? hash.first : hashSink.finish().first;
+                scanned = true;
+            } else
+                h2 = hashFile(h.type, actualPath);
 
             Path dest = worker.store.makeFixedOutputPath(recursive, h2, storePathToName(path));
 
@@ -3251,18 +4063,41 @@ void DerivationGoal::registerOutputs()
             info.ca = makeFixedOutputCA(recursive, h2);
         }
 
-        /* Get rid of all weird permissions.  This also checks that
-           all files are owned by the build user, if applicable. */
-        canonicalisePathMetaData(actualPath,
-            buildUser && !rewritten ? buildUser->getUID() : -1, inodesSeen);
+        outputs.push_back({i.first, path, actualPath, info,
+            buildUser && !rewritten ? buildUser->getUID() : (uid_t) -1,
+            scanned, references, hash});
+    }
 
-        /* For this output path, find the references to other paths
-           contained in it.  Compute the SHA-256 NAR hash at the same
-           time.  The hash is stored in the database so that we can
-           verify later on whether nobody has messed with the store. */
-        debug("scanning for references inside '%1%'", path);
-        HashResult hash;
-        PathSet references = scanForReferences(actualPath, allPaths, hash);
+    /* Get rid of all weird permissions.  This also checks that all
+       files are owned by the build user, if applicable.  Then, for
+       each output path, find the references to other paths contained
+       in it.  Compute the SHA-256 NAR hash at the same time.  The
+       hash is stored in the database so that we can verify later on
+       whether nobody has messed with the store.  All outputs go
+       through both steps in parallel, and each directory tree is
+       canonicalised in parallel; an output is scanned once its
+       canonicalisation is done, since that may make its files
+       readable. */
+    {
+        ThreadPool pool;
+        for (auto & output : outputs)
+            canonicalisePathMetaData(output.actualPath, output.fromUid, inodesSeen, pool,
+                [this, &pool, o = &output]() {
+                    if (o->scanned) return;
+                    pool.enqueue([this, o]() {
+                        debug("scanning for references inside '%1%'", o->path);
+                        o->references = scanForReferences(o->actualPath, allPaths, o->hash);
+                    });
+                });
+        pool.process();
+    }
+
+    for (auto & output : outputs) {
+        auto & path(output.path);
+        auto & actualPath(output.actualPath);
+        auto & info(output.info);
+        auto & references(output.references);
+        auto & hash(output.hash);
 
         if (buildMode == bmCheck) {
             if (!worker.store.isValidPath(path)) continue;
@@ -3308,10 +4143,8 @@ void DerivationGoal::registerOutputs()
                 debug(format("referenced input: '%1%'") % i);
         }
 
-        if (curRound == nrRounds) {
-            worker.store.optimisePath(actualPath); // FIXME: combine with scanForReferences()
+        if (curRound == nrRounds)
             worker.markContentsGood(path);
-        }
 
         info.path = path;
         info.narHash = hash.first;
@@ -3319,11 +4152,10 @@ void DerivationGoal::registerOutputs()
         info.references = references;
         info.deriver = drvPath;
         info.ultimate = true;
-        worker.store.signPathInfo(info);
 
         if (!info.references.empty()) info.ca.clear();
 
-        infos[i.first] = info;
+        infos[output.name] = info;
     }
 
     if (buildMode == bmCheck) return;
@@ -3385,13 +4217,39 @@ void DerivationGoal::registerOutputs()
 
     /* Register each output path as valid, and register the sets of
        paths referenced by each of them.  If there are cycles in the
-       outputs, this will fail. */
+       outputs, this will fail.  Signing is cheap, and other clients
+       may copy the outputs as soon as they are valid, so it's done
+       first. */
     {
         ValidPathInfos infos2;
-        for (auto & i : infos) infos2.push_back(i.second);
+        for (auto & i : infos) {
+            worker.store.signPathInfo(i.second);
+            infos2.push_back(i.second);
+        }
         worker.store.registerValidPaths(infos2);
     }
 
+    /* Optimising the outputs doesn't affect their contents or
+       references, so it's done in the background after registration,
+       allowing dependent builds to start right away. */
+    if (settings.autoOptimiseStore) {
+        auto & store(worker.store);
+        for (auto & i : infos) {
+            auto path = i.second.path;
+            worker.postProcess([&store, path]() {
+                store.optimisePath(store.toRealPath(path));
+            });
+        }
+    }
+
+    /* Remember the outputs so that builds of equivalent derivations
+       can reuse them. */
+    if (settings.earlyCutoff && useDerivation && !fixedOutput) {
+        std::map<string, Path> outputs;
+        for (auto & i : drv->outputs) outputs[i.first] = i.second.path;
+        worker.store.registerEquivalentOutputs(resolvedHash(), outputs);
+    }
+
     /* In case of a fixed-output derivation hash mismatch, throw an
        exception now that we have registered the output as valid. */
     if (delayedException)
@@ -3399,6 +4257,123 @@ void DerivationGoal::registerOutputs()
 }
 
 
+Hash DerivationGoal::resolvedHash()
+{
+    Derivation resolved(*dynamic_cast<Derivation *>(drv.get()));
+
+    for (auto & i : resolved.inputDrvs) {
+        Derivation inDrv = worker.store.derivationFromPath(i.first);
+        for (auto & j : i.second)
+            resolved.inputSrcs.insert(inDrv.outputs.at(j).path);
+    }
+    resolved.inputDrvs.clear();
+
+    StringRewrites rewrites;
+    for (auto & i : resolved.inputSrcs)
+        rewrites[storePathToHash(i)] = contentHashPart(worker.store, i);
+    for (auto & i : resolved.outputs)
+        rewrites[storePathToHash(i.second.path)] = string(storePathHashLen, '0');
+
+    return hashString(htSHA256, rewriteStrings(resolved.unparse(), rewrites));
+}
+
+
+bool DerivationGoal::reuseEquivalentOutputs()
+{
+    auto equivalent = worker.store.queryEquivalentOutputs(resolvedHash());
+
+    std::map<string, Path> oldOutputs;
+    std::map<Path, Path> pathRewrites;
+    for (auto & i : drv->outputs) {
+        auto j = equivalent.find(i.first);
+        if (j == equivalent.end() || j->second == i.second.path)
+            return false;
+        oldOutputs[i.first] = j->second;
+        pathRewrites[j->second] = i.second.path;
+    }
+
+    /* The old outputs must still be valid.  Keep them from being
+       garbage-collected until they have been copied. */
+    PathSet oldPaths;
+    for (auto & i : oldOutputs) oldPaths.insert(i.second);
+    worker.store.addTempRoots(oldPaths);
+    for (auto & i : oldPaths)
+        if (!worker.store.isValidPath(i)) return false;
+
+    /* Map every other reference of the old outputs to the input with
+       the same name and contents. */
+    std::map<std::pair<string, string>, Path> inputsByContent;
+    for (auto & i : inputPaths)
+        inputsByContent.emplace(std::make_pair(storePathToName(i), contentHashPart(worker.store, i)), i);
+
+    std::map<Path, std::shared_ptr<const ValidPathInfo>> oldInfos;
+    for (auto & i : oldOutputs) {
+        auto info = worker.store.queryPathInfo(i.second).get_ptr();
+        for (auto & ref : info->references) {
+            if (pathRewrites.count(ref)) continue;
+            auto j = inputsByContent.find(std::make_pair(storePathToName(ref), contentHashPart(worker.store, ref)));
+            if (j == inputsByContent.end()) {
+                debug("not reusing '%s' for '%s' since its reference '%s' has no equivalent input",
+                    i.second, drvPath, ref);
+                return false;
+            }
+            pathRewrites[ref] = j->second;
+        }
+        oldInfos[i.second] = info;
+    }
+
+    StringRewrites rewrites;
+    for (auto & i : pathRewrites)
+        if (i.first != i.second)
+            rewrites[storePathToHash(i.first)] = storePathToHash(i.second);
+
+    printInfo("reusing the outputs of an equivalent build of '%s'", drvPath);
+
+    StringRewriter rewriter(rewrites);
+
+    ValidPathInfos infos;
+    InodesSeen inodesSeen;
+    for (auto & i : drv->outputs) {
+        auto & oldPath(oldOutputs[i.first]);
+        auto & oldInfo(oldInfos[oldPath]);
+        Path actualPath = worker.store.toRealPath(i.second.path);
+
+        HashSink hashSink(htSHA256);
+        auto source = sinkToSource([&](Sink & nextSink) {
+            LambdaSink tee([&](const unsigned char * data, size_t len) {
+                hashSink(data, len);
+                nextSink(data, len);
+            });
+            RewritingSink sink(rewriter, tee);
+            worker.store.narFromPath(oldPath, sink);
+            sink.finish();
+        });
+        restorePath(actualPath, *source);
+        auto hash = hashSink.finish();
+        canonicalisePathMetaData(actualPath, -1, inodesSeen);
+
+        worker.store.optimisePath(actualPath);
+        worker.markContentsGood(i.second.path);
+
+        ValidPathInfo info;
+        info.path = i.second.path;
+        info.narHash = hash.first;
+        info.narSize = hash.second;
+        for (auto & ref : oldInfo->references)
+            info.references.insert(pathRewrites.at(ref));
+        info.deriver = drvPath;
+        info.ultimate = true;
+        worker.store.signPathInfo(info);
+
+        infos.push_back(info);
+    }
+
+    worker.store.registerValidPaths(infos);
+
+    return true;
+}
+
+
 void DerivationGoal::checkOutputs(const std::map<Path, ValidPathInfo> & outputs)
 {
     std::map<Path, const ValidPathInfo &> outputsByPath;
@@ -3551,11 +4526,116 @@ void DerivationGoal::checkOutputs(const std::map<Path, ValidPathInfo> & outputs)
 }
 
 
+/* A sink that passes data to the next sink (typically a compressor)
+   from a background thread, so that compressing build logs doesn't
+   stall the worker's event loop.  Writers block while more than
+   `maxPending' bytes are queued. */
+struct AsyncCompressionSink : CompressionSink
+{
+    static const size_t maxPending = 4 * 1024 * 1024;
+
+    ref<CompressionSink> nextSink;
+
+    struct State
+    {
+        std::list<string> queue;
+        size_t pending = 0;
+        bool done = false;
+        std::exception_ptr ex;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup, drained;
+
+    std::thread thread;
+
+    AsyncCompressionSink(ref<CompressionSink> nextSink)
+        : nextSink(nextSink)
+        , thread([this]() { run(); })
+    { }
+
+    ~AsyncCompressionSink()
+    {
+        stop();
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        auto state(state_.lock());
+        while (state->pending >= maxPending && !state->ex)
+            state.wait(drained);
+        if (state->ex) std::rethrow_exception(state->ex);
+        state->queue.emplace_back((const char *) data, len);
+        state->pending += len;
+        wakeup.notify_one();
+    }
+
+    void finish() override
+    {
+        flush();
+        stop();
+        {
+            auto state(state_.lock());
+            if (state->ex) std::rethrow_exception(state->ex);
+        }
+        nextSink->finish();
+    }
+
+private:
+
+    void stop()
+    {
+        if (!thread.joinable()) return;
+        state_.lock()->done = true;
+        wakeup.notify_one();
+        thread.join();
+    }
+
+    void run()
+    {
+        while (true) {
+            string data;
+            {
+                auto state(state_.lock());
+                while (state->queue.empty() && !state->done)
+                    state.wait(wakeup);
+                if (state->queue.empty()) return;
+                data = std::move(state->queue.front());
+                state->queue.pop_front();
+                state->pending -= data.size();
+                drained.notify_one();
+            }
+            try {
+                (*nextSink)(data);
+            } catch (...) {
+                auto state(state_.lock());
+                state->ex = std::current_exception();
+                drained.notify_one();
+                return;
+            }
+        }
+    }
+};
+
+
+/* Return the file name extension of build logs compressed with
+   `method'. */
+static string logExtension(const string & method)
+{
+    if (method == "bzip2") return ".bz2";
+    if (method == "zstd") return ".zst";
+    throw Error("unsupported build log compression method '%s'", method);
+}
+
+
 Path DerivationGoal::openLogFile()
 {
     logSize = 0;
 
-    if (!settings.keepLog) return "";
+    /* Only the first of several concurrent check rounds writes the
+       log file. */
+    if (!settings.keepLog || checkRound > 1) return "";
 
     string baseName = baseNameOf(drvPath);
 
@@ -3564,7 +4644,7 @@ Path DerivationGoal::openLogFile()
     createDirs(dir);
 
     Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+        settings.compressLog ? logExtension(settings.logCompression) : "");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError(format("creating log file '%1%'") % logFileName);
@@ -3572,7 +4652,8 @@ Path DerivationGoal::openLogFile()
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
     if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+        logSink = std::make_shared<AsyncCompressionSink>(
+            makeCompressionSink(settings.logCompression, *logFileSink));
     else
         logSink = logFileSink;
 
@@ -3585,7 +4666,10 @@ void DerivationGoal::closeLogFile()
     auto logSink2 = std::dynamic_pointer_cast<CompressionSink>(logSink);
     if (logSink2) logSink2->finish();
     if (logFileSink) logFileSink->flush();
-    logSink = logFileSink = 0;
+    /* Destroy `logSink' first, since it may still refer to
+       `logFileSink'. */
+    logSink = 0;
+    logFileSink = 0;
     fdLogFile = -1;
 }
 
@@ -3602,17 +4686,86 @@ void DerivationGoal::deleteTmpDir(bool force)
             chmod(tmpDir.c_str(), 0755);
         }
         else
-            deletePath(tmpDir);
+            deletePathParallel(tmpDir);
         tmpDir = "";
     }
+#if __linux__
+    reserveBuildDir(0);
+#endif
 }
 
 
+#if __linux__
+void DerivationGoal::reserveBuildDir(uint64_t bytes)
+{
+    worker.buildDirReserved -= buildDirReserved;
+    worker.buildDirReserved += bytes;
+    buildDirReserved = bytes;
+}
+
+
+void DerivationGoal::mountBuildDirTmpfs()
+{
+    /* Keep a handle on the directory on disk, so that we can copy
+       the files that we've already put there (like `.attrs.json')
+       onto the tmpfs that hides them. */
+    AutoCloseFD dirFd = open(tmpDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!dirFd) throw SysError("opening '%s'", tmpDir);
+
+    struct stat st;
+    if (fstat(dirFd.get(), &st) == -1)
+        throw SysError("getting attributes of '%s'", tmpDir);
+
+    if (mount("none", tmpDir.c_str(), "tmpfs", MS_NOSUID | MS_NODEV,
+            fmt("size=%d,mode=0700,uid=%d,gid=%d", buildDirTmpfsSize, st.st_uid, st.st_gid).c_str()) == -1)
+        throw SysError("mounting a tmpfs on '%s'", tmpDir);
+
+    AutoCloseDir dir(fdopendir(dup(dirFd.get())));
+    if (!dir) throw SysError("opening directory '%s'", tmpDir);
+
+    struct dirent * dirent;
+    while (errno = 0, dirent = readdir(dir.get())) {
+        string name = dirent->d_name;
+        if (name == "." || name == "..") continue;
+        AutoCloseFD fd = openat(dirFd.get(), name.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+        if (!fd) throw SysError("opening '%s/%s'", tmpDir, name);
+        if (fstat(fd.get(), &st) == -1)
+            throw SysError("getting attributes of '%s/%s'", tmpDir, name);
+        if (!S_ISREG(st.st_mode)) continue;
+        Path dst = tmpDir + "/" + name;
+        writeFile(dst, readFile(fd.get()), st.st_mode & 07777);
+        if (chown(dst.c_str(), st.st_uid, st.st_gid) == -1)
+            throw SysError("changing owner of '%s'", dst);
+    }
+    if (errno) throw SysError("reading directory '%s'", tmpDir);
+}
+
+
+void DerivationGoal::sampleBuildDirUsage()
+{
+    struct statfs st;
+    if (buildDirTmpfsSize && pid != -1
+        && statfs(fmt("/proc/%d/root%s", (pid_t) pid, tmpDirInSandbox).c_str(), &st) == 0
+        && st.f_type == TMPFS_MAGIC)
+    {
+        result.peakBuildDirUsage = std::max(result.peakBuildDirUsage,
+            (uint64_t) (st.f_blocks - st.f_bfree) * st.f_bsize);
+        auto reservation = getBuildDirReservation(*drv);
+        reserveBuildDir(reservation - std::min(reservation, result.peakBuildDirUsage));
+    }
+}
+#endif
+
+
 void DerivationGoal::handleChildOutput(int fd, const string & data)
 {
     if ((hook && fd == hook->builderOut.readSide.get()) ||
         (!hook && fd == builderOut.readSide.get()))
     {
+#if __linux__
+        sampleBuildDirUsage();
+#endif
+
         logSize += data.size();
         if (settings.maxLogSize && logSize > settings.maxLogSize) {
             printError(
@@ -3694,7 +4847,7 @@ PathSet DerivationGoal::checkPathValidity(bool returnValid, bool checkHash)
 Path DerivationGoal::addHashRewrite(const Path & path)
 {
     string h1 = string(path, worker.store.storeDir.size() + 1, 32);
-    string h2 = string(hashString(htSHA256, "rewrite:" + drvPath + ":" + path).to_string(Base32, false), 0, 32);
+    string h2 = string(hashString(htSHA256, "rewrite:" + drvPath + ":" + path + roundSuffix()).to_string(Base32, false), 0, 32);
     Path p = worker.store.storeDir + "/" + h2 + string(path, worker.store.storeDir.size() + 33);
     deletePath(p);
     assert(path.size() == p.size());
@@ -3717,6 +4870,7 @@ void DerivationGoal::done(BuildResult::Status status, const string & msg)
 
     mcExpectedBuilds.reset();
     mcRunningBuilds.reset();
+    mcExpectedBuildTime.reset();
 
     if (result.success()) {
         if (status == BuildResult::Built)
@@ -3753,6 +4907,18 @@ private:
     /* Path info returned by the substituter's query info operation. */
     std::shared_ptr<const ValidPathInfo> info;
 
+    /* The result of the query info operation, which is done
+       asynchronously. Its callback closes the write side of
+       `outPipe' when it's done. It may run after this goal is gone,
+       so it only uses this state, which it shares. */
+    struct InfoQuery
+    {
+        std::promise<ref<ValidPathInfo>> promise;
+        AutoCloseFD writeSide;
+    };
+    std::future<ref<ValidPathInfo>> infoFuture;
+    bool querying = false;
+
     /* Pipe for the substituter's standard output. */
     Pipe outPipe;
 
@@ -3768,6 +4934,13 @@ private:
        storePath when doing a repair. */
     Path destPath;
 
+    /* Lock in `substitutionLocksDir' held while we're working on this
+       path, and the activity shown while waiting for another process
+       holding it. */
+    PathLocks substLock;
+    bool substLocked = false;
+    std::unique_ptr<Activity> waitAct;
+
     std::unique_ptr<MaintainCount<uint64_t>> maintainExpectedSubstitutions,
         maintainRunningSubstitutions, maintainExpectedNar, maintainExpectedDownload;
 
@@ -3805,8 +4978,18 @@ public:
 
     void amDone(ExitCode result) override
     {
+        waitAct.reset();
+        substLock.setDeletion(true);
+        substLock.unlock();
+        substLocked = false;
         Goal::amDone(result);
     }
+
+private:
+
+    /* Return false if another process is already substituting or
+       building this path. */
+    bool lockPath();
 };
 
 
@@ -3825,6 +5008,8 @@ SubstitutionGoal::SubstitutionGoal(const Path & storePath, Worker & worker, Repa
 SubstitutionGoal::~SubstitutionGoal()
 {
     try {
+        if (querying)
+            worker.childTerminated(this);
         if (thr.joinable()) {
             // FIXME: signal worker thread to quit.
             thr.join();
@@ -3857,12 +5042,68 @@ void SubstitutionGoal::init()
     if (settings.readOnlyMode)
         throw Error(format("cannot substitute path '%1%' - no write access to the Nix store") % storePath);
 
+    /* If another process, e.g. a daemon serving another client, is
+       already working on this path, wait until it's done and then
+       check again, rather than querying the substituters and
+       downloading the same path concurrently. */
+    if (!lockPath()) {
+        worker.schedStats.lockFailures++;
+        worker.waitForAWhile(shared_from_this(), wrLocks);
+        return;
+    }
+
     subs = settings.useSubstitutes ? getDefaultSubstituters() : std::list<ref<Store>>();
 
+    /* If we already know which substituter has the path, skip the
+       ones before it, which don't. */
+    auto planned = worker.plannedSubstituters.find(storePath);
+    if (planned != worker.plannedSubstituters.end()) {
+        auto i = std::find_if(subs.begin(), subs.end(),
+            [&](const ref<Store> & sub) { return &*sub == &*planned->second; });
+        if (i != subs.end()) subs.erase(subs.begin(), i);
+    }
+
+    /* Start querying the lower-priority substituters now, so that if
+       the first one doesn't have the path, we don't have to wait for
+       another round trip. Concurrent queries for the same path are
+       merged by queryPathInfo(). */
+    for (auto i = std::next(subs.begin(), std::min<size_t>(1, subs.size())); i != subs.end(); ++i)
+        if ((*i)->storeDir == worker.store.storeDir)
+            (*i)->queryPathInfo(storePath, {[](std::future<ref<ValidPathInfo>> fut) {
+                try { fut.get(); } catch (...) { }
+            }});
+
     tryNext();
 }
 
 
+bool SubstitutionGoal::lockPath()
+{
+    if (substLocked) return true;
+
+    auto lockPath = worker.store.substitutionLocksDir + "/" + baseNameOf(storePath);
+
+    pid_t holder = lockHolder(worker.store.toRealPath(storePath));
+
+    if (!holder) {
+        if (substLock.lockPaths({lockPath}, "", false)) {
+            substLocked = true;
+            waitAct.reset();
+            return true;
+        }
+        holder = lockHolder(lockPath);
+    }
+
+    if (!waitAct)
+        waitAct = std::make_unique<Activity>(*logger, lvlInfo, actUnknown,
+            holder
+            ? fmt("waiting for process %d to finish with '%s'", holder, storePath)
+            : fmt("waiting for another process to finish with '%s'", storePath));
+
+    return false;
+}
+
+
 void SubstitutionGoal::tryNext()
 {
     trace("trying next substituter");
@@ -3893,9 +5134,40 @@ void SubstitutionGoal::tryNext()
         return;
     }
 
+    /* Query the substituter without blocking the worker, so that it
+       can get on with other goals (e.g. start the queries of other
+       substitution goals) while waiting for the answer. */
+    auto query = std::make_shared<InfoQuery>();
+    outPipe.create();
+    query->writeSide = std::move(outPipe.writeSide);
+    infoFuture = query->promise.get_future();
+
+    sub->queryPathInfo(storePath, {[query](std::future<ref<ValidPathInfo>> fut) {
+        try {
+            query->promise.set_value(fut.get());
+        } catch (...) {
+            query->promise.set_exception(std::current_exception());
+        }
+        query->writeSide = -1;
+    }});
+
+    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, false, false);
+    querying = true;
+
+    state = &SubstitutionGoal::gotInfo;
+}
+
+
+void SubstitutionGoal::gotInfo()
+{
+    trace("got path info");
+
+    worker.childTerminated(this);
+    querying = false;
+    outPipe.readSide = -1;
+
     try {
-        // FIXME: make async
-        info = sub->queryPathInfo(storePath);
+        info = infoFuture.get().get_ptr();
     } catch (InvalidPath &) {
         tryNext();
         return;
@@ -3975,12 +5247,12 @@ void SubstitutionGoal::tryToRun()
 {
     trace("trying to run");
 
-    /* Make sure that we are allowed to start a build.  Note that even
-       if maxBuildJobs == 0 (no local builds allowed), we still allow
-       a substituter to run.  This is because substitutions cannot be
-       distributed to another machine via the build hook. */
-    if (worker.getNrLocalBuilds() >= std::max(1U, (unsigned int) settings.maxBuildJobs)) {
-        worker.waitForBuildSlot(shared_from_this());
+    /* Make sure that we are allowed to start a substitution.  These
+       have their own limit rather than taking a build slot, since
+       they're mostly waiting for the network.  Note that even if
+       maxSubstitutionJobs == 0, we still allow one to run. */
+    if (worker.runningSubstitutions >= std::max(1U, settings.maxSubstitutionJobs.get())) {
+        worker.waitForSubstitutionSlot(shared_from_this());
         return;
     }
 
@@ -3991,7 +5263,7 @@ void SubstitutionGoal::tryToRun()
        here is just an optimisation to prevent having to redo a
        download due to a locked path. */
     if (pathIsLockedByMe(worker.store.toRealPath(storePath))) {
-        worker.waitForAWhile(shared_from_this());
+        worker.waitForAWhile(shared_from_this(), wrLocks);
         return;
     }
 
@@ -4019,7 +5291,7 @@ void SubstitutionGoal::tryToRun()
         }
     });
 
-    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, true, false);
+    worker.childStarted(shared_from_this(), {outPipe.readSide.get()}, false, false);
 
     state = &SubstitutionGoal::finished;
 }
@@ -4030,6 +5302,7 @@ void SubstitutionGoal::finished()
     trace("substitute finished");
 
     thr.join();
+    maintainRunningSubstitutions.reset();
     worker.childTerminated(this);
 
     try {
@@ -4038,7 +5311,7 @@ void SubstitutionGoal::finished()
         /* Probably a DerivationGoal is already building this store
            path. Sleep for a while and try again. */
         state = &SubstitutionGoal::init;
-        worker.waitForAWhile(shared_from_this());
+        worker.waitForAWhile(shared_from_this(), wrLocks);
         return;
     } catch (std::exception & e) {
         printError(e.what());
@@ -4065,8 +5338,6 @@ void SubstitutionGoal::finished()
     printMsg(lvlChatty,
         format("substitution of path '%1%' succeeded") % storePath);
 
-    maintainRunningSubstitutions.reset();
-
     maintainExpectedSubstitutions.reset();
     worker.doneSubstitutions++;
 
@@ -4102,11 +5373,17 @@ void SubstitutionGoal::handleEOF(int fd)
 static bool working = false;
 
 
+static WorkerStats localWorkerStats;
+
+WorkerStats * workerStats = &localWorkerStats;
+
+
 Worker::Worker(LocalStore & store)
     : act(*logger, actRealise)
     , actDerivations(*logger, actBuilds)
     , actSubstitutions(*logger, actCopyPaths)
     , store(store)
+    , buildTimes(openBuildTimes(store.dbDir))
 {
     /* Debugging: prevent recursive workers. */
     if (working) abort();
@@ -4130,6 +5407,16 @@ Worker::~Worker()
        their destructors). */
     topGoals.clear();
 
+    if (prefetchThread.joinable()) {
+        prefetchState_.lock()->quit = true;
+        prefetchWakeup.notify_one();
+        prefetchThread.join();
+    }
+
+    waitForPostProcessing();
+
+    reportStats(true);
+
     assert(expectedSubstitutions == 0);
     assert(expectedDownloadSize == 0);
     assert(expectedNarSize == 0);
@@ -4210,6 +5497,14 @@ void Worker::removeGoal(GoalPtr goal)
 void Worker::wakeUp(GoalPtr goal)
 {
     goal->trace("woken up");
+    if (goal->sleeping) {
+        auto reason = goal->sleeping->first;
+        auto d = steady_time_point::clock::now() - goal->sleeping->second;
+        goal->waitTime[reason] += d;
+        schedStats.waitTime[reason] += d;
+        schedStats.waits[reason]++;
+        goal->sleeping.reset();
+    }
     addToWeakGoals(awake, goal);
 }
 
@@ -4220,6 +5515,79 @@ unsigned Worker::getNrLocalBuilds()
 }
 
 
+#if __linux__
+/* Return the `avg10' value of the `some' line of the memory pressure
+   stall information, or -1 if it's not available. */
+static double getMemoryPressure()
+{
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile("/proc/pressure/memory"), "\n"))
+            if (hasPrefix(line, "some "))
+                for (auto & field : tokenizeString<Strings>(line, " "))
+                    if (hasPrefix(field, "avg10="))
+                        return std::stod(field.substr(6));
+    } catch (...) {
+    }
+    return -1;
+}
+
+
+/* Return the amount of available memory in bytes, or 0 if unknown. */
+static uint64_t getAvailableMemory()
+{
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile("/proc/meminfo"), "\n")) {
+            auto fields = tokenizeString<std::vector<string>>(line, " ");
+            uint64_t n;
+            if (fields.size() >= 2 && fields[0] == "MemAvailable:" && string2Int(fields[1], n))
+                return n * 1024;
+        }
+    } catch (...) {
+    }
+    return 0;
+}
+#endif
+
+
+string Worker::getAdmissionBlocker(const BasicDerivation & drv, uint64_t expectedMemory)
+{
+    if (settings.maxLoadAverage) {
+        double load;
+        if (getloadavg(&load, 1) == 1 && load >= settings.maxLoadAverage)
+            return fmt("load average %.2f exceeds 'max-load-average'", load);
+    }
+
+#if __linux__
+    if (settings.maxMemoryPressure) {
+        auto pressure = getMemoryPressure();
+        if (pressure >= settings.maxMemoryPressure)
+            return fmt("memory pressure %.2f%% exceeds 'max-memory-pressure'", pressure);
+    }
+
+    /* The derivation can say how much memory (in MiB) it needs.
+       Otherwise go by what previous builds used. */
+    auto i = drv.env.find("__memoryHint");
+    uint64_t hint;
+    if (!(i != drv.env.end() && string2Int(i->second, hint)))
+        hint = expectedMemory / (1024 * 1024);
+
+    /* A tmpfs build directory takes memory as well, and so may those
+       of the builds that are already running. */
+    hint += getBuildDirReservation(drv) / (1024 * 1024);
+    if (hint) {
+        auto available = getAvailableMemory();
+        auto reserved = buildDirReserved / (1024 * 1024);
+        if (available && (hint + reserved) * 1024 * 1024 > available)
+            return fmt("needs %d MiB of memory, but only %d MiB is available "
+                "(of which %d MiB is reserved for tmpfs build directories)",
+                hint, available / (1024 * 1024), reserved);
+    }
+#endif
+
+    return "";
+}
+
+
 void Worker::childStarted(GoalPtr goal, const set<int> & fds,
     bool inBuildSlot, bool respectTimeouts)
 {
@@ -4246,6 +5614,14 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
         nrLocalBuilds--;
     }
 
+    auto d = steady_time_point::clock::now() - i->timeStarted;
+    if (i->inBuildSlot)
+        schedStats.localBuildTime += d;
+    else if (dynamic_cast<SubstitutionGoal *>(goal))
+        schedStats.substitutionTime += d;
+    else
+        schedStats.remoteBuildTime += d;
+
     children.erase(i);
 
     if (wakeSleepers) {
@@ -4266,21 +5642,126 @@ void Worker::waitForBuildSlot(GoalPtr goal)
     debug("wait for build slot");
     if (getNrLocalBuilds() < settings.maxBuildJobs)
         wakeUp(goal); /* we can do it right away */
-    else
+    else {
+        goal->startWaiting(wrBuildSlot);
+        addToWeakGoals(wantingToBuild, goal);
+    }
+}
+
+
+void Worker::waitForSubstitutionSlot(GoalPtr goal)
+{
+    debug("wait for substitution slot");
+    if (runningSubstitutions < std::max(1U, settings.maxSubstitutionJobs.get()))
+        wakeUp(goal);
+    else {
+        goal->startWaiting(wrSubstitutionSlot);
         addToWeakGoals(wantingToBuild, goal);
+    }
 }
 
 
-void Worker::waitForAnyGoal(GoalPtr goal)
+void Worker::waitForAnyGoal(GoalPtr goal, WaitReason reason)
 {
     debug("wait for any goal");
+    goal->startWaiting(reason);
     addToWeakGoals(waitingForAnyGoal, goal);
 }
 
 
-void Worker::waitForAWhile(GoalPtr goal)
+void Worker::postProcess(std::function<void()> fun)
+{
+    /* Forget about the threads that have exited. */
+    for (auto i = postProcessing.begin(); i != postProcessing.end(); )
+        if (i->wait_for(std::chrono::seconds(0)) == std::future_status::ready) {
+            i->get();
+            i = postProcessing.erase(i);
+        } else
+            ++i;
+
+    auto state(postProcessingState_.lock());
+    state->queue.push_back(std::move(fun));
+    size_t max = std::max(1U, (unsigned int) settings.maxBuildJobs);
+    if (state->running < max) {
+        state->running++;
+        postProcessing.push_back(std::async(std::launch::async, [this]() { runPostProcessing(); }));
+    }
+}
+
+
+void Worker::runPostProcessing()
+{
+    while (true) {
+        std::function<void()> fun;
+        {
+            auto state(postProcessingState_.lock());
+            if (state->queue.empty()) {
+                state->running--;
+                return;
+            }
+            fun = std::move(state->queue.front());
+            state->queue.pop_front();
+        }
+
+        try {
+            fun();
+        } catch (std::exception & e) {
+            auto state(postProcessingState_.lock());
+            if (!state->error)
+                state->error = std::current_exception();
+            else
+                printError("error post-processing build outputs: %s", e.what());
+        }
+    }
+}
+
+
+void Worker::waitForPostProcessing()
+{
+    for (auto & i : postProcessing) i.get();
+    postProcessing.clear();
+}
+
+
+void Worker::prefetchInputs(GoalPtr goal, Paths paths, uint64_t limit)
+{
+    prefetchState_.lock()->queue.push_back({goal, std::move(paths), limit});
+    prefetchWakeup.notify_one();
+    if (!prefetchThread.joinable())
+        prefetchThread = std::thread(&Worker::prefetchWorker, this);
+}
+
+
+void Worker::prefetchWorker()
+{
+    while (true) {
+        PrefetchJob job;
+        {
+            auto state(prefetchState_.lock());
+            while (!state->quit && state->queue.empty())
+                state.wait(prefetchWakeup);
+            if (state->quit) return;
+            job = std::move(state->queue.front());
+            state->queue.pop_front();
+        }
+
+        if (job.goal.expired()) continue;
+
+        try {
+            prefetchFiles(job.paths, job.limit, [&]() {
+                return job.goal.expired() || prefetchState_.lock()->quit;
+            });
+        } catch (...) {
+            ignoreException();
+        }
+    }
+}
+
+
+void Worker::waitForAWhile(GoalPtr goal, WaitReason reason)
 {
     debug("wait for a while");
+    goal->startWaiting(reason);
     addToWeakGoals(waitingForAWhile, goal);
 }
 
@@ -4297,18 +5778,30 @@ void Worker::run(const Goals & _topGoals)
 
         store.autoGC(false);
 
-        /* Call every wake goal (in the ordering established by
-           CompareGoalPtrs). */
+        /* Call every wake goal.  Goals that the most other goals are
+           (transitively) waiting for go first, since they're on the
+           critical path: if several goals are waiting for a build
+           slot, the one blocking the longest chain of dependent
+           builds gets it.  Ties are broken by the ordering
+           established by CompareGoalPtrs. */
         while (!awake.empty() && !topGoals.empty()) {
-            Goals awake2;
+            Goals awake3;
             for (auto & i : awake) {
                 GoalPtr goal = i.lock();
-                if (goal) awake2.insert(goal);
+                if (goal) awake3.insert(goal);
             }
             awake.clear();
+            std::map<Goal *, size_t> depths;
+            std::vector<GoalPtr> awake2(awake3.begin(), awake3.end());
+            std::stable_sort(awake2.begin(), awake2.end(),
+                [&](const GoalPtr & a, const GoalPtr & b) {
+                    return a->getDepth(depths) > b->getDepth(depths);
+                });
             for (auto & goal : awake2) {
                 checkInterrupt();
+                auto before = steady_time_point::clock::now();
                 goal->work();
+                schedStats.workTime += steady_time_point::clock::now() - before;
                 if (topGoals.empty()) break; // stuff may have been cancelled
             }
         }
@@ -4332,6 +5825,112 @@ void Worker::run(const Goals & _topGoals)
     assert(!settings.keepGoing || awake.empty());
     assert(!settings.keepGoing || wantingToBuild.empty());
     assert(!settings.keepGoing || children.empty());
+
+    /* Callers expect the outputs to be optimised and signed once
+       we return. */
+    waitForPostProcessing();
+
+    reportSchedulingStats();
+
+    if (auto err = std::exchange(postProcessingState_.lock()->error, nullptr))
+        std::rethrow_exception(err);
+}
+
+
+void Worker::goalFinished(GoalTimes && times)
+{
+    auto lifetime = times.finished - times.created;
+
+    goalTimes.count++;
+    goalTimes.lifetime += lifetime;
+    goalTimes.maxLifetime = std::max(goalTimes.maxLifetime, lifetime);
+    for (size_t r = 0; r < nrWaitReasons; ++r)
+        goalTimes.waitTime[r] += times.waitTime[r];
+
+    /* `slowest' is a min-heap on the lifetime, so the shortest-lived
+       of the kept goals is the one to drop. */
+    auto longer = [](const GoalTimes & a, const GoalTimes & b) {
+        return a.finished - a.created > b.finished - b.created;
+    };
+    auto & slowest(goalTimes.slowest);
+    if (slowest.size() < maxSlowGoals) {
+        slowest.push_back(std::move(times));
+        std::push_heap(slowest.begin(), slowest.end(), longer);
+    } else if (lifetime > slowest.front().finished - slowest.front().created) {
+        std::pop_heap(slowest.begin(), slowest.end(), longer);
+        slowest.back() = std::move(times);
+        std::push_heap(slowest.begin(), slowest.end(), longer);
+    }
+}
+
+
+void Worker::reportSchedulingStats()
+{
+    auto ms = [](steady_time_point::duration d) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(d).count();
+    };
+
+    nlohmann::json json;
+    json["workTime"] = ms(schedStats.workTime);
+    json["pollTime"] = ms(schedStats.pollTime);
+    json["localBuildTime"] = ms(schedStats.localBuildTime);
+    json["remoteBuildTime"] = ms(schedStats.remoteBuildTime);
+    json["substitutionTime"] = ms(schedStats.substitutionTime);
+    json["lockFailures"] = schedStats.lockFailures;
+    json["hook"] = {
+        {"time", ms(schedStats.hookTime)},
+        {"accepted", schedStats.hookAccepted},
+        {"declined", schedStats.hookDeclined},
+        {"postponed", schedStats.hookPostponed},
+    };
+
+    auto & waits = json["waits"] = nlohmann::json::object();
+    for (size_t r = 0; r < nrWaitReasons; ++r)
+        waits[waitReasonNames[r]] = {
+            {"count", schedStats.waits[r]},
+            {"time", ms(schedStats.waitTime[r])},
+        };
+
+    auto goalWaits = nlohmann::json::object();
+    for (size_t r = 0; r < nrWaitReasons; ++r)
+        if (goalTimes.waitTime[r].count())
+            goalWaits[waitReasonNames[r]] = ms(goalTimes.waitTime[r]);
+    json["goals"] = {
+        {"count", goalTimes.count},
+        {"lifetime", ms(goalTimes.lifetime)},
+        {"maxLifetime", ms(goalTimes.maxLifetime)},
+        {"waits", goalWaits},
+    };
+
+    /* Longest-lived first. Times are relative to the creation of the
+       worker. */
+    auto slowest = goalTimes.slowest;
+    std::sort(slowest.begin(), slowest.end(), [](const GoalTimes & a, const GoalTimes & b) {
+        return a.finished - a.created > b.finished - b.created;
+    });
+    auto & goals = json["slowestGoals"] = nlohmann::json::array();
+    for (auto & g : slowest) {
+        nlohmann::json goal = {
+            {"name", g.name},
+            {"created", ms(g.created - timeCreated)},
+            {"finished", ms(g.finished - timeCreated)},
+        };
+        for (size_t r = 0; r < nrWaitReasons; ++r)
+            if (g.waitTime[r].count())
+                goal["waits"][waitReasonNames[r]] = ms(g.waitTime[r]);
+        goals.push_back(goal);
+    }
+
+    act.result(resWorkerStats, json.dump());
+
+    printMsg(lvlTalkative, "worker: %.1f s in goals, %.1f s waiting for events, %.1f s in the build hook (%d accepted, %d declined, %d postponed), %d lock failures",
+        ms(schedStats.workTime) / 1e3, ms(schedStats.pollTime) / 1e3, ms(schedStats.hookTime) / 1e3,
+        schedStats.hookAccepted, schedStats.hookDeclined, schedStats.hookPostponed,
+        schedStats.lockFailures);
+    for (size_t r = 0; r < nrWaitReasons; ++r)
+        if (schedStats.waits[r])
+            printMsg(lvlTalkative, "worker: goals waited %.1f s in total for '%s' (%d times)",
+                ms(schedStats.waitTime[r]) / 1e3, waitReasonNames[r], schedStats.waits[r]);
 }
 
 
@@ -4384,30 +5983,29 @@ void Worker::waitForInput()
     if (useTimeout)
         vomit("sleeping %d seconds", timeout.tv_sec);
 
-    /* Use select() to wait for the input side of any logger pipe to
+    /* Use poll() to wait for the input side of any logger pipe to
        become `available'.  Note that `available' (i.e., non-blocking)
-       includes EOF. */
-    fd_set fds;
-    FD_ZERO(&fds);
-    int fdMax = 0;
-    for (auto & i : children) {
-        for (auto & j : i.fds) {
-            if (j >= FD_SETSIZE)
-                throw Error("reached FD_SETSIZE limit");
-            FD_SET(j, &fds);
-            if (j >= fdMax) fdMax = j + 1;
-        }
-    }
-
-    if (select(fdMax, &fds, 0, 0, useTimeout ? &timeout : 0) == -1) {
+       includes EOF.  Unlike select(), this isn't limited to
+       FD_SETSIZE file descriptors. */
+    std::vector<struct pollfd> pollFds;
+    for (auto & i : children)
+        for (auto & j : i.fds)
+            pollFds.push_back({j, POLLIN, 0});
+
+    if (poll(pollFds.data(), pollFds.size(), useTimeout ? timeout.tv_sec * 1000 : -1) == -1) {
         if (errno == EINTR) return;
         throw SysError("waiting for input");
     }
 
     auto after = steady_time_point::clock::now();
+    schedStats.pollTime += after - before;
 
-    /* Process all available file descriptors. FIXME: this is
-       O(children * fds). */
+    std::unordered_set<int> readyFds;
+    for (auto & i : pollFds)
+        if (i.revents) readyFds.insert(i.fd);
+
+    /* Process all available file descriptors. */
+    std::vector<unsigned char> buffer(4096);
     decltype(children)::iterator i;
     for (auto j = children.begin(); j != children.end(); j = i) {
         i = std::next(j);
@@ -4417,10 +6015,10 @@ void Worker::waitForInput()
         GoalPtr goal = j->goal.lock();
         assert(goal);
 
-        set<int> fds2(j->fds);
-        std::vector<unsigned char> buffer(4096);
-        for (auto & k : fds2) {
-            if (FD_ISSET(k, &fds)) {
+        if (!readyFds.empty()) {
+            set<int> fds2(j->fds);
+            for (auto & k : fds2) {
+                if (!readyFds.count(k)) continue;
                 ssize_t rd = read(k, buffer.data(), buffer.size());
                 // FIXME: is there a cleaner way to handle pt close
                 // than EIO? Is this even standard?
@@ -4532,24 +6130,44 @@ void Worker::markContentsGood(const Path & path)
 //////////////////////////////////////////////////////////////////////
 
 
-static void primeCache(Store & store, const PathSet & paths)
+static void primeCache(Store & store, const PathSet & paths, Worker & worker)
 {
-    PathSet willBuild, willSubstitute, unknown;
-    unsigned long long downloadSize, narSize;
-    store.queryMissing(paths, willBuild, willSubstitute, unknown, downloadSize, narSize);
+    auto plan = store.planMissing(paths);
 
-    if (!willBuild.empty() && 0 == settings.maxBuildJobs && getMachines().empty())
+    if (!plan.willBuild.empty() && 0 == settings.maxBuildJobs && getMachines().empty())
         throw Error(
             "%d derivations need to be built, but neither local builds ('--max-jobs') "
-            "nor remote builds ('--builders') are enabled", willBuild.size());
+            "nor remote builds ('--builders') are enabled", plan.willBuild.size());
+
+    worker.plannedSubstituters = std::move(plan.substituters);
 }
 
 
-void LocalStore::buildPaths(const PathSet & drvPaths, BuildMode buildMode)
+void LocalStore::buildPaths(const PathSet & drvPaths_, BuildMode buildMode)
 {
+    /* Don't create goals for derivations that have already been
+       built or paths that are already valid. This avoids reading,
+       locking and checking every derivation when building a closure
+       that's already there. */
+    PathSet drvPaths;
+    if (buildMode == bmNormal) {
+        addSkipTempRoots(*this, drvPaths_);
+        auto built = queryBuiltDerivations(drvPaths_);
+        PathSet others;
+        for (auto & i : drvPaths_)
+            if (!built.count(i) && !isDerivation(parseDrvPathWithOutputs(i).first))
+                others.insert(i);
+        auto valid = queryValidPaths(others);
+        for (auto & i : drvPaths_)
+            if (!built.count(i) && !valid.count(i))
+                drvPaths.insert(i);
+        if (drvPaths.empty()) return;
+    } else
+        drvPaths = drvPaths_;
+
     Worker worker(*this);
 
-    primeCache(*this, drvPaths);
+    primeCache(*this, drvPaths, worker);
 
     Goals goals;
     for (auto & i : drvPaths) {
@@ -4601,9 +6219,9 @@ void LocalStore::ensurePath(const Path & path)
     /* If the path is already valid, we're done. */
     if (isValidPath(path)) return;
 
-    primeCache(*this, {path});
-
     Worker worker(*this);
+
+    primeCache(*this, {path}, worker);
     GoalPtr goal = worker.makeSubstitutionGoal(path);
     Goals goals = {goal};
 
@@ -1,31 +1,54 @@
 #include "builtins.hh"
+#include "thread-pool.hh"
+#include "sync.hh"
 
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <fcntl.h>
 #include <algorithm>
+#include <unordered_map>
 
 namespace nix {
 
-typedef std::map<Path,int> Priorities;
-
-// FIXME: change into local variables.
+/* A file in the user environment: either a symlink to `target', or a
+   directory that merges the contents of the `contributors'
+   directories, in that order. */
+struct EnvNode
+{
+    bool isDir = false;
+    Path target;
+    int priority = 0;
+    bool targetIsDir = false;
+    std::vector<std::pair<Path, int>> contributors;
+    std::map<string, EnvNode> entries;
+};
 
-static Priorities priorities;
+/* The contents of a directory in some package. */
+struct SrcEntry
+{
+    string name;
+    bool exists; // false for dangling symlinks
+    bool isDir;
+};
 
-static unsigned long symlinks;
+struct SrcListing
+{
+    bool notDir = false;
+    std::vector<SrcEntry> entries;
+};
 
-/* For each activated package, create symlinks */
-static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
+static SrcListing listSrcDir(const Path & srcDir)
 {
+    SrcListing listing;
+
     DirEntries srcFiles;
 
     try {
         srcFiles = readDirectory(srcDir);
     } catch (SysError & e) {
         if (e.errNo == ENOTDIR) {
-            printError("warning: not including '%s' in the user environment because it's not a directory", srcDir);
-            return;
+            listing.notDir = true;
+            return listing;
         }
         throw;
     }
@@ -35,105 +58,159 @@ static void createLinks(const Path & srcDir, const Path & dstDir, int priority)
             /* not matched by glob */
             continue;
         auto srcFile = srcDir + "/" + ent.name;
-        auto dstFile = dstDir + "/" + ent.name;
 
         struct stat srcSt;
-        try {
-            if (stat(srcFile.c_str(), &srcSt) == -1)
-                throw SysError("getting status of '%1%'", srcFile);
-        } catch (SysError & e) {
-            if (e.errNo == ENOENT || e.errNo == ENOTDIR) {
-                printError("warning: skipping dangling symlink '%s'", dstFile);
+        if (stat(srcFile.c_str(), &srcSt) == -1) {
+            if (errno == ENOENT || errno == ENOTDIR) {
+                listing.entries.push_back({ent.name, false, false});
                 continue;
             }
-            throw;
+            throw SysError("getting status of '%1%'", srcFile);
         }
 
-        /* The files below are special-cased to that they don't show up
-         * in user profiles, either because they are useless, or
-         * because they would cauase pointless collisions (e.g., each
-         * Python package brings its own
-         * `$out/lib/pythonX.Y/site-packages/easy-install.pth'.)
-         */
-        if (hasSuffix(srcFile, "/propagated-build-inputs") ||
-            hasSuffix(srcFile, "/nix-support") ||
-            hasSuffix(srcFile, "/perllocal.pod") ||
-            hasSuffix(srcFile, "/info/dir") ||
-            hasSuffix(srcFile, "/log"))
+        listing.entries.push_back({ent.name, true, (bool) S_ISDIR(srcSt.st_mode)});
+    }
+
+    return listing;
+}
+
+/* Merge the contributors of the directory `node' into its entries. A
+   symlink to a directory that collides with another directory is
+   turned into a directory merging both; such directories are
+   appended to `newDirs'. */
+static void mergeDir(const Path & dstDir, EnvNode & node,
+    const std::unordered_map<Path, SrcListing> & listings,
+    std::vector<std::pair<Path, EnvNode *>> & newDirs)
+{
+    for (auto & [srcDir, priority] : node.contributors) {
+        auto & listing(listings.at(srcDir));
+
+        if (listing.notDir) {
+            printError("warning: not including '%s' in the user environment because it's not a directory", srcDir);
             continue;
+        }
 
-        else if (S_ISDIR(srcSt.st_mode)) {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISDIR(dstSt.st_mode)) {
-                    createLinks(srcFile, dstFile, priority);
-                    continue;
-                } else if (S_ISLNK(dstSt.st_mode)) {
-                    auto target = canonPath(dstFile, true);
-                    if (!S_ISDIR(lstat(target).st_mode))
+        for (auto & ent : listing.entries) {
+            auto srcFile = srcDir + "/" + ent.name;
+            auto dstFile = dstDir + "/" + ent.name;
+
+            if (!ent.exists) {
+                printError("warning: skipping dangling symlink '%s'", dstFile);
+                continue;
+            }
+
+            /* The files below are special-cased to that they don't show up
+             * in user profiles, either because they are useless, or
+             * because they would cauase pointless collisions (e.g., each
+             * Python package brings its own
+             * `$out/lib/pythonX.Y/site-packages/easy-install.pth'.)
+             */
+            if (hasSuffix(srcFile, "/propagated-build-inputs") ||
+                hasSuffix(srcFile, "/nix-support") ||
+                hasSuffix(srcFile, "/perllocal.pod") ||
+                hasSuffix(srcFile, "/info/dir") ||
+                hasSuffix(srcFile, "/log"))
+                continue;
+
+            auto i = node.entries.find(ent.name);
+
+            if (i == node.entries.end()) {
+                auto & dst(node.entries[ent.name]);
+                dst.target = srcFile;
+                dst.priority = priority;
+                dst.targetIsDir = ent.isDir;
+                continue;
+            }
+
+            auto & dst(i->second);
+
+            if (ent.isDir) {
+                if (dst.isDir) {
+                    dst.contributors.emplace_back(srcFile, priority);
+                } else {
+                    auto target = canonPath(dst.target, true);
+                    if (!dst.targetIsDir)
                         throw Error("collision between '%1%' and non-directory '%2%'", srcFile, target);
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError(format("unlinking '%1%'") % dstFile);
-                    if (mkdir(dstFile.c_str(), 0755) == -1)
-                        throw SysError(format("creating directory '%1%'"));
-                    createLinks(target, dstFile, priorities[dstFile]);
-                    createLinks(srcFile, dstFile, priority);
-                    continue;
+                    dst.isDir = true;
+                    dst.contributors.emplace_back(target, dst.priority);
+                    dst.contributors.emplace_back(srcFile, priority);
+                    newDirs.emplace_back(dstFile, &dst);
                 }
-            } else if (errno != ENOENT)
-                throw SysError(format("getting status of '%1%'") % dstFile);
-        }
+            }
 
-        else {
-            struct stat dstSt;
-            auto res = lstat(dstFile.c_str(), &dstSt);
-            if (res == 0) {
-                if (S_ISLNK(dstSt.st_mode)) {
-                    auto prevPriority = priorities[dstFile];
-                    if (prevPriority == priority)
-                        throw Error(
-                                "packages '%1%' and '%2%' have the same priority %3%; "
-                                "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
-                                "to change the priority of one of the conflicting packages"
-                                " (0 being the highest priority)",
-                                srcFile, readLink(dstFile), priority);
-                    if (prevPriority < priority)
-                        continue;
-                    if (unlink(dstFile.c_str()) == -1)
-                        throw SysError(format("unlinking '%1%'") % dstFile);
-                } else if (S_ISDIR(dstSt.st_mode))
+            else {
+                if (dst.isDir)
                     throw Error("collision between non-directory '%1%' and directory '%2%'", srcFile, dstFile);
-            } else if (errno != ENOENT)
-                throw SysError(format("getting status of '%1%'") % dstFile);
+                if (dst.priority == priority)
+                    throw Error(
+                            "packages '%1%' and '%2%' have the same priority %3%; "
+                            "use 'nix-env --set-flag priority NUMBER INSTALLED_PKGNAME' "
+                            "to change the priority of one of the conflicting packages"
+                            " (0 being the highest priority)",
+                            srcFile, dst.target, priority);
+                if (dst.priority < priority)
+                    continue;
+                dst.target = srcFile;
+                dst.priority = priority;
+                dst.targetIsDir = false;
+            }
         }
-
-        createSymlink(srcFile, dstFile);
-        priorities[dstFile] = priority;
-        symlinks++;
     }
 }
 
-typedef std::set<Path> FileProp;
+/* Build the merged tree of the packages in `root.contributors'. The
+   tree is built one level at a time; the directories of each level
+   are read in parallel. */
+static void buildTree(const Path & out, EnvNode & root)
+{
+    std::vector<std::pair<Path, EnvNode *>> dirs{{out, &root}};
 
-static FileProp done;
-static FileProp postponed = FileProp{};
+    while (!dirs.empty()) {
 
-static Path out;
+        Sync<std::unordered_map<Path, SrcListing>> listings_;
 
-static void addPkg(const Path & pkgDir, int priority)
-{
-    if (done.count(pkgDir)) return;
-    done.insert(pkgDir);
-    createLinks(pkgDir, out, priority);
+        {
+            ThreadPool pool;
+            PathSet srcDirs;
+            for (auto & dir : dirs)
+                for (auto & c : dir.second->contributors)
+                    if (srcDirs.insert(c.first).second)
+                        pool.enqueue([&listings_, srcDir{c.first}]() {
+                            auto listing = listSrcDir(srcDir);
+                            listings_.lock()->emplace(srcDir, std::move(listing));
+                        });
+            pool.process();
+        }
 
-    try {
-        for (const auto & p : tokenizeString<std::vector<string>>(
-                readFile(pkgDir + "/nix-support/propagated-user-env-packages"), " \n"))
-            if (!done.count(p))
-                postponed.insert(p);
-    } catch (SysError & e) {
-        if (e.errNo != ENOENT && e.errNo != ENOTDIR) throw;
+        auto listings(listings_.lock());
+
+        std::vector<std::pair<Path, EnvNode *>> newDirs;
+        for (auto & dir : dirs)
+            mergeDir(dir.first, *dir.second, *listings, newDirs);
+
+        dirs = std::move(newDirs);
+    }
+}
+
+/* Create the symlinks and directories of `node' in the directory
+   `dirFd'. */
+static void materialise(int dirFd, const Path & dir, const EnvNode & node,
+    unsigned long & symlinks)
+{
+    for (auto & [name, child] : node.entries) {
+        auto dstFile = dir + "/" + name;
+        if (child.isDir) {
+            if (mkdirat(dirFd, name.c_str(), 0755) == -1)
+                throw SysError("creating directory '%1%'", dstFile);
+            AutoCloseFD fd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (!fd)
+                throw SysError("opening directory '%1%'", dstFile);
+            materialise(fd.get(), dstFile, child, symlinks);
+        } else {
+            if (symlinkat(child.target.c_str(), dirFd, name.c_str()) == -1)
+                throw SysError("creating symlink from '%1%' to '%2%'", dstFile, child.target);
+            symlinks++;
+        }
     }
 }
 
@@ -154,7 +231,7 @@ void builtinBuildenv(const BasicDerivation & drv)
         return i->second;
     };
 
-    out = getAttr("out");
+    Path out = getAttr("out");
     createDirs(out);
 
     /* Convert the stuff we get from the environment back into a
@@ -172,6 +249,25 @@ void builtinBuildenv(const BasicDerivation & drv)
         }
     }
 
+    EnvNode root;
+    root.isDir = true;
+
+    std::set<Path> done, postponed;
+
+    auto addPkg = [&](const Path & pkgDir, int priority) {
+        if (!done.insert(pkgDir).second) return;
+        root.contributors.emplace_back(pkgDir, priority);
+
+        try {
+            for (const auto & p : tokenizeString<std::vector<string>>(
+                    readFile(pkgDir + "/nix-support/propagated-user-env-packages"), " \n"))
+                if (!done.count(p))
+                    postponed.insert(p);
+        } catch (SysError & e) {
+            if (e.errNo != ENOENT && e.errNo != ENOTDIR) throw;
+        }
+    };
+
     /* Symlink to the packages that have been installed explicitly by the
      * user. Process in priority order to reduce unnecessary
      * symlink/unlink steps.
@@ -191,11 +287,22 @@ void builtinBuildenv(const BasicDerivation & drv)
     auto priorityCounter = 1000;
     while (!postponed.empty()) {
         auto pkgDirs = postponed;
-        postponed = FileProp{};
+        postponed.clear();
         for (const auto & pkgDir : pkgDirs)
             addPkg(pkgDir, priorityCounter++);
     }
 
+    /* Resolve all collisions in memory, then create the symlinks in
+       one pass. */
+    buildTree(out, root);
+
+    AutoCloseFD outFd = open(out.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!outFd)
+        throw SysError("opening directory '%1%'", out);
+
+    unsigned long symlinks = 0;
+    materialise(outFd.get(), out, root, symlinks);
+
     printError("created %d symlinks in user environment", symlinks);
 
     createSymlink(getAttr("manifest"), out + "/manifest.nix");
@@ -30,19 +30,30 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
        a forked process. */
     auto downloader = makeDownloader();
 
-    auto fetch = [&](const std::string & url) {
+    /* Fetch the first of `urls' that works. */
+    auto fetch = [&](const std::vector<std::string> & urls) {
 
-        auto source = sinkToSource([&](Sink & sink) {
+        /* Download and decompress in a separate thread, in parallel
+           with unpacking. */
+        auto source = sinkToSourceThreaded([&](Sink & sink) {
 
             /* No need to do TLS verification, because we check the hash of
                the result anyway. */
-            DownloadRequest request(url);
-            request.verifyTLS = false;
-            request.decompress = false;
+            std::vector<DownloadRequest> requests;
+            for (auto & url : urls) {
+                DownloadRequest request(url);
+                request.verifyTLS = false;
+                request.decompress = false;
+                requests.push_back(request);
+            }
 
             auto decompressor = makeDecompressionSink(
                 unpack && hasSuffix(mainUrl, ".xz") ? "xz" : "none", sink);
-            downloader->download(std::move(request), *decompressor);
+            if (requests.size() == 1)
+                downloader->download(std::move(requests[0]), *decompressor);
+            else
+                downloader->downloadFirst(std::move(requests),
+                    std::chrono::milliseconds(downloadSettings.hedgeDelay), *decompressor);
             decompressor->finish();
         });
 
@@ -58,21 +69,37 @@ void builtinFetchurl(const BasicDerivation & drv, const std::string & netrcData)
         }
     };
 
-    /* Try the hashed mirrors first. */
+    std::vector<std::string> mirrorUrls;
     if (getAttr("outputHashMode") == "flat")
-        for (auto hashedMirror : settings.hashedMirrors.get())
-            try {
+        try {
+            auto ht = parseHashType(getAttr("outputHashAlgo"));
+            auto h = Hash(getAttr("outputHash"), ht);
+            for (auto hashedMirror : settings.hashedMirrors.get()) {
                 if (!hasSuffix(hashedMirror, "/")) hashedMirror += '/';
-                auto ht = parseHashType(getAttr("outputHashAlgo"));
-                auto h = Hash(getAttr("outputHash"), ht);
-                fetch(hashedMirror + printHashType(h.type) + "/" + h.to_string(Base16, false));
-                return;
-            } catch (Error & e) {
-                debug(e.what());
+                mirrorUrls.push_back(hashedMirror + printHashType(h.type) + "/" + h.to_string(Base16, false));
             }
+        } catch (Error & e) {
+            debug(e.what());
+        }
+
+    /* Race the specified URL against the hashed mirrors. */
+    if (downloadSettings.hedgeDelay >= 0 && !mirrorUrls.empty()) {
+        mirrorUrls.insert(mirrorUrls.begin(), mainUrl);
+        fetch(mirrorUrls);
+        return;
+    }
+
+    /* Try the hashed mirrors first. */
+    for (auto & url : mirrorUrls)
+        try {
+            fetch({url});
+            return;
+        } catch (Error & e) {
+            debug(e.what());
+        }
 
     /* Otherwise try the specified URL. */
-    fetch(mainUrl);
+    fetch({mainUrl});
 }
 
 }
@@ -0,0 +1,223 @@
+#include "builtins.hh"
+#include "compression.hh"
+#include "globals.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <sstream>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+
+namespace nix {
+
+/* A writer of tar archives in the POSIX (pax) format, which has no
+   limits on the length of file names and the size of files.  All
+   entries are owned by root and have the modification time of
+   files in the store, so the archive only depends on the contents
+   of the store paths. */
+struct TarWriter
+{
+    Sink & sink;
+
+    TarWriter(Sink & sink) : sink(sink) { }
+
+    static void setField(char * field, size_t size, const std::string & s)
+    {
+        memcpy(field, s.data(), std::min(size, s.size()));
+    }
+
+    static void setOctal(char * field, size_t size, uint64_t n)
+    {
+        /* Zero-padded, followed by a NUL. */
+        for (size_t i = size - 1; i-- > 0; n >>= 3)
+            field[i] = '0' + (n & 7);
+        field[size - 1] = 0;
+    }
+
+    static std::string paxRecord(const std::string & key, const std::string & value)
+    {
+        /* The length of a record includes the length itself. */
+        auto body = " " + key + "=" + value + "\n";
+        size_t len = body.size() + 1;
+        while (std::to_string(len).size() + body.size() != len)
+            len = std::to_string(len).size() + body.size();
+        return std::to_string(len) + body;
+    }
+
+    void pad(uint64_t size)
+    {
+        static const unsigned char zeroes[512] = {0};
+        if (size % 512) sink(zeroes, 512 - size % 512);
+    }
+
+    void writeRawHeader(const std::string & name, char type, mode_t mode,
+        uint64_t size, const std::string & linkName)
+    {
+        char h[512];
+        memset(h, 0, sizeof(h));
+
+        setField(h, 100, name);
+        setOctal(h + 100, 8, mode);
+        setOctal(h + 108, 8, 0);
+        setOctal(h + 116, 8, 0);
+        setOctal(h + 124, 12, size < 077777777777ULL ? size : 0);
+        setOctal(h + 136, 12, 1);
+        memset(h + 148, ' ', 8);
+        h[156] = type;
+        setField(h + 157, 100, linkName);
+        memcpy(h + 257, "ustar", 6);
+        memcpy(h + 263, "00", 2);
+        setField(h + 265, 32, "root");
+        setField(h + 297, 32, "root");
+
+        unsigned int sum = 0;
+        for (auto c : h) sum += (unsigned char) c;
+        setOctal(h + 148, 7, sum);
+        h[155] = ' ';
+
+        sink((unsigned char *) h, sizeof(h));
+    }
+
+    void writeHeader(const std::string & name, char type, mode_t mode,
+        uint64_t size = 0, const std::string & linkName = "")
+    {
+        std::string pax;
+        if (name.size() > 100) pax += paxRecord("path", name);
+        if (linkName.size() > 100) pax += paxRecord("linkpath", linkName);
+        if (size >= 077777777777ULL) pax += paxRecord("size", std::to_string(size));
+
+        if (!pax.empty()) {
+            writeRawHeader("././@PaxHeader", 'x', 0644, pax.size(), "");
+            sink(pax);
+            pad(pax.size());
+        }
+
+        writeRawHeader(name, type, mode, size, linkName);
+    }
+
+    void finish()
+    {
+        static const unsigned char zeroes[1024] = {0};
+        sink(zeroes, sizeof(zeroes));
+    }
+};
+
+
+/* Add `path' to the archive as `name', reading it in the same way as
+   dumpPath(): directory entries in sorted order, and the contents of
+   regular files straight from the file system. */
+static void packPath(TarWriter & tar, const Path & path, const std::string & name)
+{
+    checkInterrupt();
+
+    auto st = lstat(path);
+
+    if (S_ISREG(st.st_mode)) {
+        AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) throw SysError("opening file '%1%'", path);
+
+        tar.writeHeader(name, '0', st.st_mode & S_IXUSR ? 0555 : 0444, st.st_size);
+
+        std::vector<unsigned char> buf(1 << 20);
+        uint64_t left = st.st_size;
+        while (left) {
+            checkInterrupt();
+            auto n = std::min(left, (uint64_t) buf.size());
+            readFull(fd.get(), buf.data(), n);
+            tar.sink(buf.data(), n);
+            left -= n;
+        }
+
+        tar.pad(st.st_size);
+    }
+
+    else if (S_ISDIR(st.st_mode)) {
+        tar.writeHeader(name + "/", '5', 0555);
+
+        auto entries = readDirectory(path);
+        std::sort(entries.begin(), entries.end(),
+            [](const DirEntry & a, const DirEntry & b) { return a.name < b.name; });
+
+        for (auto & i : entries)
+            packPath(tar, path + "/" + i.name, name + "/" + i.name);
+    }
+
+    else if (S_ISLNK(st.st_mode))
+        tar.writeHeader(name, '2', 0777, 0, readLink(path));
+
+    else throw Error("file '%1%' has an unsupported type", path);
+}
+
+
+/* Read the store paths from a file written for an
+   `exportReferencesGraph' attribute. */
+static PathSet readClosureInfo(const Path & fileName)
+{
+    PathSet paths;
+
+    std::istringstream str(readFile(fileName));
+    std::string path, deriver, count;
+    while (std::getline(str, path) && !path.empty()) {
+        size_t nrRefs;
+        if (!std::getline(str, deriver) || !std::getline(str, count) || !string2Int(count, nrRefs))
+            throw Error("closure info file '%s' is corrupt", fileName);
+        std::string ref;
+        for (size_t i = 0; i < nrRefs; ++i)
+            if (!std::getline(str, ref))
+                throw Error("closure info file '%s' is corrupt", fileName);
+        paths.insert(path);
+    }
+
+    return paths;
+}
+
+
+void builtinPackClosure(const BasicDerivation & drv)
+{
+    auto getAttr = [&](const string & name, const string & def = "") {
+        auto i = drv.env.find(name);
+        if (i != drv.env.end()) return i->second;
+        if (def.empty()) throw Error("attribute '%s' missing", name);
+        return def;
+    };
+
+    Path out = getAttr("out");
+
+    /* Only tar archives are supported for now; file system images
+       can still be made from them. */
+    auto format = getAttr("format", "tar");
+    if (format != "tar")
+        throw Error("unsupported image format '%s'", format);
+
+    /* The paths to pack are the closure described by the file that
+       `exportReferencesGraph' wrote in the build directory, which is
+       the current directory. */
+    auto paths = readClosureInfo(getAttr("closureInfo"));
+
+    AutoCloseFD fd = open(out.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (!fd) throw SysError("creating '%s'", out);
+
+    FdSink fdSink(fd.get());
+    auto sink = makeCompressionSink(getAttr("compression", "none"), fdSink, true);
+
+    TarWriter tar(*sink);
+
+    /* The directories containing the store, e.g. "nix/" and
+       "nix/store/". */
+    std::string name;
+    for (auto & component : tokenizeString<Strings>(settings.nixStore, "/")) {
+        name += (name.empty() ? "" : "/") + component;
+        tar.writeHeader(name + "/", '5', 0555);
+    }
+
+    for (auto & path : paths)
+        packPath(tar, path, std::string(path, 1));
+
+    tar.finish();
+
+    sink->finish();
+    fdSink.flush();
+}
+
+}
@@ -0,0 +1,32 @@
+#include "builtins.hh"
+#include "tarfile.hh"
+
+namespace nix {
+
+void builtinUnpackChannel(const BasicDerivation & drv)
+{
+    auto getAttr = [&](const string & name) {
+        auto i = drv.env.find(name);
+        if (i == drv.env.end()) throw Error("attribute '%s' missing", name);
+        return i->second;
+    };
+
+    Path out = getAttr("out");
+    auto channelName = getAttr("channelName");
+    auto src = getAttr("src");
+
+    createDirs(out);
+
+    unpackTarfile(src, out);
+
+    /* Make the channel appear under its name. */
+    auto entries = readDirectory(out);
+    if (entries.size() == 1 && entries[0].name != channelName) {
+        auto from = out + "/" + entries[0].name;
+        auto to = out + "/" + channelName;
+        if (rename(from.c_str(), to.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", from, to);
+    }
+}
+
+}
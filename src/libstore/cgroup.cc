@@ -0,0 +1,109 @@
+#if __linux__
+
+#include "cgroup.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <thread>
+
+#include <dirent.h>
+#include <signal.h>
+
+namespace nix {
+
+static const Path cgroupFS = "/sys/fs/cgroup";
+
+
+Path getOwnCgroup()
+{
+    if (!pathExists(cgroupFS + "/cgroup.controllers")) return "";
+
+    /* In the unified hierarchy, /proc/self/cgroup has a single line
+       of the form "0::<path>". */
+    for (auto & line : tokenizeString<Strings>(readFile("/proc/self/cgroup"), "\n"))
+        if (hasPrefix(line, "0::"))
+            return canonPath(cgroupFS + "/" + string(line, 3));
+
+    return "";
+}
+
+
+/* Parse the "key value" lines of a file like cpu.stat. */
+static std::map<string, string> readKeyValues(const Path & path)
+{
+    std::map<string, string> res;
+    for (auto & line : tokenizeString<Strings>(readFile(path), "\n")) {
+        auto sp = line.find(' ');
+        if (sp != string::npos) res.emplace(string(line, 0, sp), string(line, sp + 1));
+    }
+    return res;
+}
+
+
+CgroupStats getCgroupStats(const Path & cgroup)
+{
+    CgroupStats stats;
+
+    try {
+        auto cpu = readKeyValues(cgroup + "/cpu.stat");
+        string2Int(cpu["user_usec"], stats.cpuUser);
+        string2Int(cpu["system_usec"], stats.cpuSystem);
+    } catch (SysError &) { }
+
+    try {
+        string2Int(trim(readFile(cgroup + "/memory.peak")), stats.peakMemory);
+    } catch (SysError &) { }
+
+    /* io.stat has a line per device, like
+       "8:0 rbytes=1459200 wbytes=314773504 rios=192 wios=353 ...". */
+    try {
+        for (auto & line : tokenizeString<Strings>(readFile(cgroup + "/io.stat"), "\n"))
+            for (auto & field : tokenizeString<Strings>(line, " ")) {
+                uint64_t n;
+                if (hasPrefix(field, "rbytes=") && string2Int(string(field, 7), n))
+                    stats.ioRead += n;
+                else if (hasPrefix(field, "wbytes=") && string2Int(string(field, 7), n))
+                    stats.ioWrite += n;
+            }
+    } catch (SysError &) { }
+
+    return stats;
+}
+
+
+void destroyCgroup(const Path & cgroup)
+{
+    if (!pathExists(cgroup)) return;
+
+    for (auto & entry : readDirectory(cgroup))
+        if (entry.type == DT_DIR)
+            destroyCgroup(cgroup + "/" + entry.name);
+
+    /* Kill the processes in the cgroup, using cgroup.kill if the
+       kernel has it (5.14+), and wait for them to be gone.  Since
+       nothing outside the cgroup can see its processes, this also
+       gets rid of processes that escaped from the builder's process
+       group. */
+    auto killFile = cgroup + "/cgroup.kill";
+    if (pathExists(killFile))
+        writeFile(killFile, "1");
+
+    for (unsigned int n = 0; ; ++n) {
+        auto pids = tokenizeString<Strings>(readFile(cgroup + "/cgroup.procs"), "\n");
+        if (pids.empty()) break;
+        if (n == 1000)
+            throw Error("cannot kill the processes in cgroup '%s'", cgroup);
+        for (auto & s : pids) {
+            pid_t pid;
+            if (string2Int(s, pid)) kill(pid, SIGKILL);
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (rmdir(cgroup.c_str()) == -1)
+        throw SysError("deleting cgroup '%s'", cgroup);
+}
+
+}
+
+#endif
@@ -0,0 +1,29 @@
+#pragma once
+
+#if __linux__
+
+#include "types.hh"
+
+namespace nix {
+
+/* Resource usage of the processes in a cgroup.  Fields are 0 if the
+   corresponding controller isn't enabled for the cgroup. */
+struct CgroupStats
+{
+    uint64_t cpuUser = 0, cpuSystem = 0; // microseconds
+    uint64_t peakMemory = 0; // bytes
+    uint64_t ioRead = 0, ioWrite = 0; // bytes
+};
+
+/* Return the directory of the cgroup v2 of the current process, or
+   an empty string if the unified hierarchy isn't mounted. */
+Path getOwnCgroup();
+
+CgroupStats getCgroupStats(const Path & cgroup);
+
+/* Kill all processes in `cgroup' and its descendants, and remove it. */
+void destroyCgroup(const Path & cgroup);
+
+}
+
+#endif
@@ -1,6 +1,9 @@
 #include "crypto.hh"
 #include "util.hh"
 #include "globals.hh"
+#include "hash.hh"
+#include "lru-cache.hh"
+#include "sync.hh"
 
 #if HAVE_SODIUM
 #include <sodium.h>
@@ -87,13 +90,32 @@ bool verifyDetached(const std::string & data, const std::string & sig,
     auto key = publicKeys.find(ss.first);
     if (key == publicKeys.end()) return false;
 
+    /* The same signature tends to be checked several times, e.g. when
+       substituting a path: once when the .narinfo arrives and once
+       when the path is added to the store. So remember the ones that
+       were good. */
+    static Sync<LRUCache<std::string, bool>> goodSigs(65536);
+
     auto sig2 = base64Decode(ss.second);
     if (sig2.size() != crypto_sign_BYTES)
         throw Error("signature is not valid");
 
-    return crypto_sign_verify_detached((unsigned char *) sig2.data(),
-        (unsigned char *) data.data(), data.size(),
-        (unsigned char *) key->second.key.data()) == 0;
+    /* The fields are length-prefixed so that different combinations
+       can't produce the same key. */
+    auto cacheKey = hashString(htSHA256,
+        fmt("%d:%s%d:%s%d:%s",
+            key->second.key.size(), key->second.key,
+            sig2.size(), sig2,
+            data.size(), data)).to_string(Base32, false);
+    if (goodSigs.lock()->get(cacheKey)) return true;
+
+    if (crypto_sign_verify_detached((unsigned char *) sig2.data(),
+            (unsigned char *) data.data(), data.size(),
+            (unsigned char *) key->second.key.data()) != 0)
+        return false;
+
+    goodSigs.lock()->upsert(cacheKey, true);
+    return true;
 #else
     noSodium();
 #endif
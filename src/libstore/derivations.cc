@@ -4,7 +4,10 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "fs-accessor.hh"
-#include "istringstream_nocopy.hh"
+#include "sqlite.hh"
+#include "lru-cache.hh"
+
+#include <sqlite3.h>
 
 namespace nix {
 
@@ -66,117 +69,174 @@ Path writeDerivation(ref<Store> store,
 }
 
 
-/* Read string `s' from stream `str'. */
-static void expect(std::istream & str, const string & s)
+/* A cursor over the ATerm representation of a derivation. */
+struct DrvParser
 {
-    char s2[s.size()];
-    str.read(s2, s.size());
-    if (string(s2, s.size()) != s)
-        throw FormatError(format("expected string '%1%'") % s);
-}
+    const char * pos, * end;
 
+    DrvParser(std::string_view s) : pos(s.data()), end(s.data() + s.size()) { }
 
-/* Read a C-style string from stream `str'. */
-static string parseString(std::istream & str)
-{
-    string res;
-    expect(str, "\"");
-    int c;
-    while ((c = str.get()) != '"')
-        if (c == '\\') {
-            c = str.get();
-            if (c == 'n') res += '\n';
-            else if (c == 'r') res += '\r';
-            else if (c == 't') res += '\t';
-            else res += c;
-        }
-        else res += c;
-    return res;
-}
+    [[noreturn]] void unexpectedEnd()
+    {
+        throw FormatError("unexpected end of derivation");
+    }
 
+    char peek()
+    {
+        if (pos == end) unexpectedEnd();
+        return *pos;
+    }
 
-static Path parsePath(std::istream & str)
-{
-    string s = parseString(str);
-    if (s.size() == 0 || s[0] != '/')
-        throw FormatError(format("bad path '%1%' in derivation") % s);
-    return s;
-}
+    char get()
+    {
+        if (pos == end) unexpectedEnd();
+        return *pos++;
+    }
 
+    /* Read string `s'. */
+    void expect(std::string_view s)
+    {
+        if ((size_t) (end - pos) < s.size() || std::string_view(pos, s.size()) != s)
+            throw FormatError(format("expected string '%1%'") % s);
+        pos += s.size();
+    }
 
-static bool endOfList(std::istream & str)
-{
-    if (str.peek() == ',') {
-        str.get();
-        return false;
+    /* Read a C-style string. */
+    string parseString()
+    {
+        expect("\"");
+
+        /* Most strings have no escapes, so copy them in one go. */
+        auto start = pos;
+        while (pos != end && *pos != '"' && *pos != '\\') ++pos;
+        string res(start, pos);
+
+        while (true) {
+            char c = get();
+            if (c == '"') break;
+            if (c == '\\') {
+                c = get();
+                if (c == 'n') res += '\n';
+                else if (c == 'r') res += '\r';
+                else if (c == 't') res += '\t';
+                else res += c;
+            }
+            else res += c;
+        }
+
+        return res;
     }
-    if (str.peek() == ']') {
-        str.get();
-        return true;
+
+    Path parsePath()
+    {
+        string s = parseString();
+        if (s.size() == 0 || s[0] != '/')
+            throw FormatError(format("bad path '%1%' in derivation") % s);
+        return s;
     }
-    return false;
-}
 
+    bool endOfList()
+    {
+        if (peek() == ',') {
+            pos++;
+            return false;
+        }
+        if (peek() == ']') {
+            pos++;
+            return true;
+        }
+        return false;
+    }
 
-static StringSet parseStrings(std::istream & str, bool arePaths)
-{
-    StringSet res;
-    while (!endOfList(str))
-        res.insert(arePaths ? parsePath(str) : parseString(str));
-    return res;
-}
+    StringSet parseStrings(bool arePaths)
+    {
+        StringSet res;
+        while (!endOfList())
+            res.insert(res.end(), arePaths ? parsePath() : parseString());
+        return res;
+    }
+};
 
 
-static Derivation parseDerivation(const string & s)
+static Derivation parseDerivation(std::string_view s)
 {
     Derivation drv;
-    istringstream_nocopy str(s);
-    expect(str, "Derive([");
+    DrvParser str(s);
+    str.expect("Derive([");
 
     /* Parse the list of outputs. */
-    while (!endOfList(str)) {
+    while (!str.endOfList()) {
         DerivationOutput out;
-        expect(str, "("); string id = parseString(str);
-        expect(str, ","); out.path = parsePath(str);
-        expect(str, ","); out.hashAlgo = parseString(str);
-        expect(str, ","); out.hash = parseString(str);
-        expect(str, ")");
+        str.expect("("); string id = str.parseString();
+        str.expect(","); out.path = str.parsePath();
+        str.expect(","); out.hashAlgo = str.parseString();
+        str.expect(","); out.hash = str.parseString();
+        str.expect(")");
         drv.outputs[id] = out;
     }
 
     /* Parse the list of input derivations. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "(");
-        Path drvPath = parsePath(str);
-        expect(str, ",[");
-        drv.inputDrvs[drvPath] = parseStrings(str, false);
-        expect(str, ")");
+    str.expect(",[");
+    while (!str.endOfList()) {
+        str.expect("(");
+        Path drvPath = str.parsePath();
+        str.expect(",[");
+        drv.inputDrvs[drvPath] = str.parseStrings(false);
+        str.expect(")");
     }
 
-    expect(str, ",["); drv.inputSrcs = parseStrings(str, true);
-    expect(str, ","); drv.platform = parseString(str);
-    expect(str, ","); drv.builder = parseString(str);
+    str.expect(",["); drv.inputSrcs = str.parseStrings(true);
+    str.expect(","); drv.platform = str.parseString();
+    str.expect(","); drv.builder = str.parseString();
 
     /* Parse the builder arguments. */
-    expect(str, ",[");
-    while (!endOfList(str))
-        drv.args.push_back(parseString(str));
+    str.expect(",[");
+    while (!str.endOfList())
+        drv.args.push_back(str.parseString());
 
     /* Parse the environment variables. */
-    expect(str, ",[");
-    while (!endOfList(str)) {
-        expect(str, "("); string name = parseString(str);
-        expect(str, ","); string value = parseString(str);
-        expect(str, ")");
-        drv.env[name] = value;
+    str.expect(",[");
+    while (!str.endOfList()) {
+        str.expect("("); string name = str.parseString();
+        str.expect(","); string value = str.parseString();
+        str.expect(")");
+        drv.env.insert_or_assign(drv.env.end(), std::move(name), std::move(value));
     }
 
-    expect(str, ")");
+    str.expect(")");
     return drv;
 }
 
 
+/* Derivations parsed so far, keyed by store path. Since the path of
+   a derivation is determined by its contents, entries never become
+   stale. */
+static ShardedLRUCache<Path, std::shared_ptr<const Derivation>> & getParsedDrvs()
+{
+    static ShardedLRUCache<Path, std::shared_ptr<const Derivation>> parsedDrvs(settings.derivationCacheSize);
+    return parsedDrvs;
+}
+
+
+/* Return the derivation `drvPath', calling `read' to get its contents
+   if it's not in the cache. */
+static Derivation readDerivationCached(const Path & drvPath, std::function<std::string()> read)
+{
+    auto & cache(getParsedDrvs());
+
+    if (auto drv = cache.get(drvPath))
+        return **drv;
+
+    try {
+        auto drv = std::make_shared<const Derivation>(parseDerivation(read()));
+        cache.upsert(drvPath, drv);
+        return *drv;
+    } catch (FormatError & e) {
+        throw Error(format("error parsing derivation '%1%': %2%") % drvPath % e.msg());
+    }
+}
+
+
 Derivation readDerivation(const Path & drvPath)
 {
     try {
@@ -191,12 +251,9 @@ Derivation Store::derivationFromPath(const Path & drvPath)
 {
     assertStorePath(drvPath);
     ensurePath(drvPath);
-    auto accessor = getFSAccessor();
-    try {
-        return parseDerivation(accessor->readFile(drvPath));
-    } catch (FormatError & e) {
-        throw Error(format("error parsing derivation '%1%': %2%") % drvPath % e.msg());
-    }
+    return readDerivationCached(drvPath, [&]() {
+        return getFSAccessor()->readFile(drvPath);
+    });
 }
 
 
@@ -287,7 +344,100 @@ bool BasicDerivation::isFixedOutput() const
 }
 
 
-DrvHashes drvHashes;
+RWSync<DrvHashes> drvHashes;
+
+
+/* An on-disk cache of the results of hashDerivationModulo(). Since a
+   derivation's store path determines its contents, entries never
+   become stale. */
+struct DrvHashCache
+{
+    SQLite db;
+    SQLiteStmt query, insert;
+};
+
+static Sync<std::unique_ptr<DrvHashCache>> drvHashCache;
+
+static std::once_flag drvHashCacheInit;
+
+static Sync<std::unique_ptr<DrvHashCache>> & getDrvHashCache()
+{
+    std::call_once(drvHashCacheInit, []() {
+        if (!settings.drvHashCache) return;
+        try {
+            auto cache = std::make_unique<DrvHashCache>();
+
+            Path dbPath = getCacheDir() + "/nix/drv-hashes-v1.sqlite";
+            createDirs(dirOf(dbPath));
+
+            cache->db = SQLite(dbPath);
+
+            if (sqlite3_busy_timeout(cache->db, 60 * 60 * 1000) != SQLITE_OK)
+                throwSQLiteError(cache->db, "setting timeout");
+
+            // We can always reproduce the cache.
+            cache->db.exec("pragma synchronous = off");
+            cache->db.exec("pragma main.journal_mode = truncate");
+
+            cache->db.exec(
+                "create table if not exists DrvHashes ("
+                "    path text primary key not null,"
+                "    hash text not null"
+                ");");
+
+            cache->query.create(cache->db, "select hash from DrvHashes where path = ?");
+            cache->insert.create(cache->db, "insert or replace into DrvHashes(path, hash) values (?, ?)");
+
+            *drvHashCache.lock() = std::move(cache);
+        } catch (Error & e) {
+            debug("not using the derivation hash cache: %s", e.what());
+        }
+    });
+    return drvHashCache;
+}
+
+
+std::optional<Hash> lookupDrvHash(const Path & drvPath)
+{
+    {
+        auto drvHashes_(drvHashes.readLock());
+        auto i = drvHashes_->find(drvPath);
+        if (i != drvHashes_->end()) return i->second;
+    }
+
+    auto cache(getDrvHashCache().lock());
+    if (!*cache) return {};
+
+    try {
+        auto h = retrySQLite<std::optional<Hash>>([&]() -> std::optional<Hash> {
+            auto query((*cache)->query.use()(drvPath));
+            if (!query.next()) return {};
+            return Hash(query.getStr(0));
+        });
+        if (h) (*drvHashes.lock())[drvPath] = *h;
+        return h;
+    } catch (Error & e) {
+        debug("cannot query the derivation hash cache: %s", e.what());
+        return {};
+    }
+}
+
+
+void insertDrvHash(const Path & drvPath, const Hash & h)
+{
+    (*drvHashes.lock())[drvPath] = h;
+
+    auto cache(getDrvHashCache().lock());
+    if (!*cache) return;
+
+    try {
+        retrySQLite<void>([&]() {
+            (*cache)->insert.use()(drvPath)(h.to_string(Base16, true)).exec();
+        });
+    } catch (Error & e) {
+        debug("cannot update the derivation hash cache: %s", e.what());
+    }
+}
 
 
 /* Returns the hash of a derivation modulo fixed-output
@@ -325,14 +475,16 @@ Hash hashDerivationModulo(Store & store, Derivation drv)
        calls to this function.*/
     DerivationInputs inputs2;
     for (auto & i : drv.inputDrvs) {
-        Hash h = drvHashes[i.first];
+        auto h = lookupDrvHash(i.first);
         if (!h) {
             assert(store.isValidPath(i.first));
-            Derivation drv2 = readDerivation(store.toRealPath(i.first));
+            Derivation drv2 = readDerivationCached(i.first, [&]() {
+                return readFile(store.toRealPath(i.first));
+            });
             h = hashDerivationModulo(store, drv2);
-            drvHashes[i.first] = h;
+            insertDrvHash(i.first, *h);
         }
-        inputs2[h.to_string(Base16, false)] = i.second;
+        inputs2[h->to_string(Base16, false)] = i.second;
     }
     drv.inputDrvs = inputs2;
 
@@ -5,6 +5,7 @@
 #include "store-api.hh"
 
 #include <map>
+#include <optional>
 
 
 namespace nix {
@@ -96,7 +97,13 @@ Hash hashDerivationModulo(Store & store, Derivation drv);
 /* Memoisation of hashDerivationModulo(). */
 typedef std::map<Path, Hash> DrvHashes;
 
-extern DrvHashes drvHashes; // FIXME: global, not thread-safe
+extern RWSync<DrvHashes> drvHashes;
+
+/* Look up or record the result of hashDerivationModulo() for the
+   derivation `drvPath', in memory and in the on-disk cache (if
+   enabled by the 'derivation-hash-cache' setting). */
+std::optional<Hash> lookupDrvHash(const Path & drvPath);
+void insertDrvHash(const Path & drvPath, const Hash & h);
 
 /* Split a string specifying a derivation and a set of outputs
    (/nix/store/hash-foo!out1,out2,...) into the derivation path and
@@ -6,6 +6,7 @@
 #include "archive.hh"
 #include "s3.hh"
 #include "compression.hh"
+#include "tarfile.hh"
 #include "pathlocks.hh"
 #include "finally.hh"
 
@@ -57,6 +58,8 @@ struct CurlDownloader : public Downloader
         Activity act;
         bool done = false; // whether either the success or failure function has been called
         Callback<DownloadResult> callback;
+        std::string host;
+        uint64_t seq = 0; // order of enqueueing, for FIFO within a priority class
         CURL * req = 0;
         bool active = false; // whether the handle has been added to the multi object
         std::string status;
@@ -69,21 +72,60 @@ struct CurlDownloader : public Downloader
 
         struct curl_slist * requestHeaders = 0;
 
-        std::string encoding;
+        /* The Content-Encoding of the current response, and of the
+           data received so far. */
+        std::string encoding, bodyEncoding;
 
         bool acceptRanges = false;
 
         curl_off_t writtenToSink = 0;
 
+        /* Content-Length and the start of Content-Range of the
+           current response, or -1 if absent. */
+        curl_off_t contentLength = -1, contentRangeStart = -1;
+
+        /* Number of bytes received in previous attempts that the
+           current attempt asks the server to skip. */
+        curl_off_t resumeOffset = 0;
+
+        bool sentRange = false, bodyStarted = false, ignoreBody = false;
+
+        /* Whether the transfer is paused because `request.dataFull()'
+           returned true. */
+        bool paused = false;
+
+        /* If `rangeEnd' is non-zero, this item only fetches the bytes
+           [rangeStart, rangeEnd) of the file. */
+        curl_off_t rangeStart = 0, rangeEnd = 0;
+        bool rangeFull = false;
+
+        /* State of a download that has been split into ranges. The
+           first range is fetched by this item, the others by
+           separate items whose data are passed to `finalSink' in
+           order. At most `download-ranges' ranges are in flight or
+           buffered at any time. */
+        struct Ranges
+        {
+            curl_off_t total, rangeSize, window;
+            curl_off_t delivered = 0, next = 0;
+            bool headDone = false;
+            std::map<curl_off_t, std::shared_ptr<std::string>> received;
+        };
+
+        std::unique_ptr<Ranges> ranges;
+
         DownloadItem(CurlDownloader & downloader,
             const DownloadRequest & request,
             Callback<DownloadResult> callback)
             : downloader(downloader)
             , request(request)
             , act(*logger, lvlTalkative, actDownload,
-                fmt(request.data ? "uploading '%s'" : "downloading '%s'", request.uri),
+                fmt(request.verb() == "upload" ? "uploading '%s'" : "downloading '%s'", request.uri),
                 {request.uri}, request.parentAct)
             , callback(callback)
+            , host(downloadHost(request.uri))
+            , rangeStart(request.rangeStart)
+            , rangeEnd(request.rangeEnd)
             , finalSink([this](const unsigned char * data, size_t len) {
                 if (this->request.dataCallback) {
                     writtenToSink += len;
@@ -132,17 +174,179 @@ struct CurlDownloader : public Downloader
 
         std::exception_ptr writeException;
 
+        curl_off_t received()
+        {
+            return request.dataCallback ? writtenToSink : result.data->size();
+        }
+
+        bool isPlainDownload()
+        {
+            return request.verb() == "download" && !request.head
+                && (hasPrefix(request.uri, "http://") || hasPrefix(request.uri, "https://"));
+        }
+
+        /* Called when the first data of a response body arrive, at
+           which point all its headers are known. */
+        void startBody()
+        {
+            bool success = status.size() == 3 && status[0] == '2';
+
+            /* Don't pass error pages to the sink. */
+            if (request.dataCallback && !status.empty() && !success)
+                ignoreBody = true;
+
+            else if (sentRange && status != "206") {
+                if (!success)
+                    /* Don't mix an error page into the data. */
+                    ignoreBody = true;
+                else if (!request.dataCallback && rangeStart == 0) {
+                    debug("server ignored the range request for '%s'; restarting", request.uri);
+                    result.data = std::make_shared<std::string>();
+                    resumeOffset = 0;
+                } else
+                    throw DownloadError(Misc, fmt("server ignored the range request for '%s'", request.uri));
+            }
+
+            else if (sentRange && contentRangeStart != rangeStart + resumeOffset)
+                throw DownloadError(Misc, fmt("server returned the wrong range for '%s'", request.uri));
+
+            else if (!ranges && !rangeEnd && status == "200"
+                && downloadSettings.rangeConnections > 1
+                && acceptRanges && encoding.empty()
+                && contentLength > (curl_off_t) downloadSettings.rangeSize
+                && isPlainDownload())
+                startRanges();
+        }
+
+        void startRanges()
+        {
+            ranges = std::make_unique<Ranges>();
+            ranges->total = contentLength;
+            ranges->rangeSize = downloadSettings.rangeSize;
+            ranges->window = ranges->rangeSize * downloadSettings.rangeConnections;
+            ranges->next = rangeEnd = ranges->rangeSize;
+
+            debug("splitting download of '%s' (%d bytes) into ranges of %d bytes",
+                request.uri, ranges->total, ranges->rangeSize);
+
+            fetchRanges();
+        }
+
+        void fetchRanges()
+        {
+            char * effectiveUri = nullptr;
+            curl_easy_getinfo(req, CURLINFO_EFFECTIVE_URL, &effectiveUri);
+
+            while (ranges->next < ranges->total
+                && ranges->next < ranges->delivered + ranges->window)
+            {
+                auto start = ranges->next;
+                auto end = std::min(start + ranges->rangeSize, ranges->total);
+                ranges->next = end;
+
+                DownloadRequest request2(effectiveUri ? effectiveUri : request.uri);
+                request2.verifyTLS = request.verifyTLS;
+                request2.tries = request.tries;
+                request2.baseRetryTimeMs = request.baseRetryTimeMs;
+                request2.parentAct = act.id;
+                request2.priority = request.priority;
+                request2.promotion = request.promotion;
+
+                auto self(shared_from_this());
+
+                auto item = std::make_shared<DownloadItem>(downloader, request2,
+                    Callback<DownloadResult>([self, start, end](std::future<DownloadResult> fut) {
+                        if (self->done) return;
+                        try {
+                            auto data = fut.get().data;
+                            if ((curl_off_t) data->size() != end - start)
+                                throw DownloadError(Misc, fmt("got a truncated range while downloading '%s'", self->request.uri));
+                            self->ranges->received[start] = data;
+                            self->flushRanges();
+                        } catch (...) {
+                            if (!self->done) self->failEx(std::current_exception());
+                        }
+                    }));
+
+                item->rangeStart = start;
+                item->rangeEnd = end;
+                downloader.enqueueItem(item);
+            }
+        }
+
+        /* Pass the ranges that can be passed in order to the sink,
+           and start fetching the next ones. */
+        void flushRanges()
+        {
+            if (!ranges->headDone) return;
+
+            while (true) {
+                auto i = ranges->received.find(ranges->delivered);
+                if (i == ranges->received.end()) break;
+                auto data = i->second;
+                ranges->received.erase(i);
+                finalSink((unsigned char *) data->data(), data->size());
+                ranges->delivered += data->size();
+            }
+
+            act.progress(ranges->delivered, ranges->total);
+
+            if (ranges->delivered == ranges->total) {
+                result.bodySize = ranges->total;
+                done = true;
+                try {
+                    callback(std::move(result));
+                } catch (...) {
+                    callback.rethrow();
+                }
+            } else
+                fetchRanges();
+        }
+
         size_t writeCallback(void * contents, size_t size, size_t nmemb)
         {
             try {
+                /* If the consumer can't keep up, let curl hold on to
+                   the data and stop reading from the socket. */
+                if (request.dataFull && request.dataFull()) {
+                    paused = true;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+
                 size_t realSize = size * nmemb;
                 result.bodySize += realSize;
 
-                if (!decompressionSink)
+                if (!bodyStarted) {
+                    bodyStarted = true;
+                    startBody();
+                }
+
+                if (done) return 0;
+
+                if (ignoreBody) return realSize;
+
+                if (!decompressionSink) {
                     decompressionSink = makeDecompressionSink(encoding, finalSink);
+                    bodyEncoding = encoding;
+                }
+
+                /* Stop when we have reached the end of our range. The
+                   server may send more if this was the initial request
+                   of a split download. */
+                if (rangeEnd) {
+                    size_t left = rangeEnd - rangeStart - received();
+                    if (realSize > left) {
+                        (*decompressionSink)((unsigned char *) contents, left);
+                        rangeFull = true;
+                        return 0;
+                    }
+                }
 
                 (*decompressionSink)((unsigned char *) contents, realSize);
 
+                if (rangeEnd && received() == rangeEnd - rangeStart)
+                    rangeFull = true;
+
                 return realSize;
             } catch (...) {
                 writeException = std::current_exception();
@@ -164,10 +368,11 @@ struct CurlDownloader : public Downloader
                 result.etag = "";
                 auto ss = tokenizeString<vector<string>>(line, " ");
                 status = ss.size() >= 2 ? ss[1] : "";
-                result.data = std::make_shared<std::string>();
                 result.bodySize = 0;
-                acceptRanges = false;
+                if (status == "206") acceptRanges = true;
                 encoding = "";
+                contentLength = contentRangeStart = -1;
+                bodyStarted = ignoreBody = false;
             } else {
                 auto i = line.find(':');
                 if (i != string::npos) {
@@ -187,6 +392,15 @@ struct CurlDownloader : public Downloader
                         encoding = trim(string(line, i + 1));
                     else if (name == "accept-ranges" && toLower(trim(std::string(line, i + 1))) == "bytes")
                         acceptRanges = true;
+                    else if (name == "content-length")
+                        string2Int(trim(std::string(line, i + 1)), contentLength);
+                    else if (name == "content-range") {
+                        /* E.g. "bytes 100-199/1000". */
+                        auto value = trim(std::string(line, i + 1));
+                        auto dash = value.find('-');
+                        if (hasPrefix(value, "bytes ") && dash != std::string::npos)
+                            string2Int(std::string(value, 6, dash - 6), contentRangeStart);
+                    }
                 }
             }
             return realSize;
@@ -220,8 +434,17 @@ struct CurlDownloader : public Downloader
         }
 
         size_t readOffset = 0;
+        AutoCloseFD dataFd;
+        uint64_t dataFileSize = 0;
+
         size_t readCallback(char *buffer, size_t size, size_t nitems)
         {
+            if (dataFd) {
+                auto n = pread(dataFd.get(), buffer, size * nitems, readOffset);
+                if (n == -1) return CURL_READFUNC_ABORT;
+                readOffset += n;
+                return n;
+            }
             if (readOffset == request.data->length())
                 return 0;
             auto count = std::min(size * nitems, request.data->length() - readOffset);
@@ -279,11 +502,23 @@ struct CurlDownloader : public Downloader
             if (request.head)
                 curl_easy_setopt(req, CURLOPT_NOBODY, 1);
 
-            if (request.data) {
+            readOffset = 0;
+
+            if (request.dataFile != "" && !dataFd) {
+                dataFd = open(request.dataFile.c_str(), O_RDONLY | O_CLOEXEC);
+                if (!dataFd) throw SysError("opening '%s'", request.dataFile);
+                struct stat st;
+                if (fstat(dataFd.get(), &st) == -1)
+                    throw SysError("statting '%s'", request.dataFile);
+                dataFileSize = st.st_size;
+            }
+
+            if (request.data || dataFd) {
                 curl_easy_setopt(req, CURLOPT_UPLOAD, 1L);
                 curl_easy_setopt(req, CURLOPT_READFUNCTION, readCallbackWrapper);
                 curl_easy_setopt(req, CURLOPT_READDATA, this);
-                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE, (curl_off_t) request.data->length());
+                curl_easy_setopt(req, CURLOPT_INFILESIZE_LARGE,
+                    (curl_off_t) (dataFd ? dataFileSize : request.data->length()));
             }
 
             if (request.verifyTLS) {
@@ -304,11 +539,40 @@ struct CurlDownloader : public Downloader
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
-            if (writtenToSink)
-                curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, writtenToSink);
+            sentRange = rangeEnd || resumeOffset;
+            if (rangeEnd)
+                curl_easy_setopt(req, CURLOPT_RANGE,
+                    fmt("%d-%d", rangeStart + resumeOffset, rangeEnd - 1).c_str());
+            else if (resumeOffset)
+                curl_easy_setopt(req, CURLOPT_RESUME_FROM_LARGE, resumeOffset);
 
-            result.data = std::make_shared<std::string>();
+            if (!resumeOffset) {
+                result.data = std::make_shared<std::string>();
+                writtenToSink = 0;
+            }
             result.bodySize = 0;
+            decompressionSink.reset();
+            rangeFull = false;
+            paused = false;
+        }
+
+        void updateStats(CURLcode code, long httpStatus)
+        {
+            long connects = 0;
+            curl_easy_getinfo(req, CURLINFO_NUM_CONNECTS, &connects);
+            double firstByte = 0;
+            curl_easy_getinfo(req, CURLINFO_STARTTRANSFER_TIME, &firstByte);
+
+            auto hostStats(downloader.hostStats.lock());
+            auto & stats = (*hostStats)[host];
+            stats.requests++;
+            if (code != CURLE_OK || httpStatus >= 400) stats.failures++;
+            stats.bytes += result.bodySize;
+            if (connects == 0) stats.reused++;
+            size_t bucket = 0;
+            for (uint64_t ms = firstByte * 1000; ms && bucket < stats.latency.size() - 1; ms >>= 1)
+                bucket++;
+            stats.latency[bucket]++;
         }
 
         void finish(CURLcode code)
@@ -324,6 +588,8 @@ struct CurlDownloader : public Downloader
             debug("finished %s of '%s'; curl status = %d, HTTP status = %d, body = %d bytes",
                 request.verb(), request.uri, code, httpStatus, result.bodySize);
 
+            updateStats(code, httpStatus);
+
             if (decompressionSink) {
                 try {
                     decompressionSink->finish();
@@ -332,7 +598,14 @@ struct CurlDownloader : public Downloader
                 }
             }
 
-            if (code == CURLE_WRITE_ERROR && result.etag == request.expectedETag) {
+            /* A split download may have failed while this item was
+               still fetching its range. */
+            if (done) return;
+
+            if (code == CURLE_WRITE_ERROR && rangeFull && !writeException)
+                code = CURLE_OK;
+
+            else if (code == CURLE_WRITE_ERROR && result.etag == request.expectedETag) {
                 code = CURLE_OK;
                 httpStatus = 304;
             }
@@ -340,6 +613,20 @@ struct CurlDownloader : public Downloader
             if (writeException)
                 failEx(writeException);
 
+            else if (code == CURLE_OK && ranges) {
+                if (!rangeFull)
+                    fail(DownloadError(Misc, fmt("got a truncated response while downloading '%s'", request.uri)));
+                else {
+                    ranges->headDone = true;
+                    ranges->delivered = rangeEnd;
+                    try {
+                        flushRanges();
+                    } catch (...) {
+                        if (!done) failEx(std::current_exception());
+                    }
+                }
+            }
+
             else if (code == CURLE_OK &&
                 (httpStatus == 200 || httpStatus == 201 || httpStatus == 204 || httpStatus == 206 || httpStatus == 304 || httpStatus == 226 /* FTP */ || httpStatus == 0 /* other protocol */))
             {
@@ -414,18 +701,23 @@ struct CurlDownloader : public Downloader
                             request.verb(), request.uri, curl_easy_strerror(code), code));
 
                 /* If this is a transient error, then maybe retry the
-                   download after a while. If we're writing to a
-                   sink, we can only retry if the server supports
-                   ranged requests. */
+                   download after a while. If the server supports
+                   ranged requests, continue where we left off;
+                   otherwise we have to start from scratch, which we
+                   can't do if we're writing to a sink that already
+                   got some data. */
+                bool canResume = acceptRanges && bodyEncoding.empty() && isPlainDownload();
+
                 if (err == Transient
                     && attempt < request.tries
                     && (!this->request.dataCallback
                         || writtenToSink == 0
-                        || (acceptRanges && encoding.empty())))
+                        || canResume))
                 {
                     int ms = request.baseRetryTimeMs * std::pow(2.0f, attempt - 1 + std::uniform_real_distribution<>(0.0, 0.5)(downloader.mt19937));
-                    if (writtenToSink)
-                        warn("%s; retrying from offset %d in %d ms", exc.what(), writtenToSink, ms);
+                    resumeOffset = canResume ? received() : 0;
+                    if (resumeOffset)
+                        warn("%s; retrying from offset %d in %d ms", exc.what(), rangeStart + resumeOffset, ms);
                     else
                         warn("%s; retrying in %d ms", exc.what(), ms);
                     embargo = std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
@@ -446,10 +738,15 @@ struct CurlDownloader : public Downloader
         };
         bool quit = false;
         std::priority_queue<std::shared_ptr<DownloadItem>, std::vector<std::shared_ptr<DownloadItem>>, EmbargoComparator> incoming;
+        uint64_t nextSeq = 0;
+        bool checkPaused = false;
+        bool reprioritise = false;
     };
 
     Sync<State> state_;
 
+    Sync<std::map<std::string, DownloadHostStats>> hostStats;
+
     /* We can't use a std::condition_variable to wake up the curl
        thread, because it only monitors file descriptors. So use a
        pipe instead. */
@@ -471,6 +768,9 @@ struct CurlDownloader : public Downloader
         #if LIBCURL_VERSION_NUM >= 0x071e00 // Max connections requires >= 7.30.0
         curl_multi_setopt(curlm, CURLMOPT_MAX_TOTAL_CONNECTIONS,
             downloadSettings.httpConnections.get());
+        if (downloadSettings.httpConnectionsPerHost)
+            curl_multi_setopt(curlm, CURLMOPT_MAX_HOST_CONNECTIONS,
+                downloadSettings.httpConnectionsPerHost.get());
         #endif
 
         wakeupPipe.create();
@@ -507,7 +807,24 @@ struct CurlDownloader : public Downloader
 
         std::map<CURL *, std::shared_ptr<DownloadItem>> items;
 
-        bool quit = false;
+        /* Requests that are ready to start, per host, in order of
+           priority. */
+        struct PriorityComparator {
+            bool operator() (const std::shared_ptr<DownloadItem> & i1, const std::shared_ptr<DownloadItem> & i2) {
+                return std::make_pair(i1->request.effectivePriority(), i1->seq)
+                    > std::make_pair(i2->request.effectivePriority(), i2->seq);
+            }
+        };
+
+        struct Host
+        {
+            size_t active = 0;
+            std::priority_queue<std::shared_ptr<DownloadItem>, std::vector<std::shared_ptr<DownloadItem>>, PriorityComparator> ready;
+        };
+
+        std::map<std::string, Host> hosts;
+
+        bool quit = false, checkPaused = false, reprioritise = false;
 
         std::chrono::steady_clock::time_point nextWakeup;
 
@@ -530,6 +847,7 @@ struct CurlDownloader : public Downloader
                     i->second->finish(msg->data.result);
                     curl_multi_remove_handle(curlm, i->second->req);
                     i->second->active = false;
+                    hosts[i->second->host].active--;
                     items.erase(i);
                 }
             }
@@ -580,14 +898,53 @@ struct CurlDownloader : public Downloader
                     }
                 }
                 quit = state->quit;
+                checkPaused = state->checkPaused;
+                state->checkPaused = false;
+                reprioritise = state->reprioritise;
+                state->reprioritise = false;
             }
 
-            for (auto & item : incoming) {
-                debug("starting %s of %s", item->request.verb(), item->request.uri);
-                item->init();
-                curl_multi_add_handle(curlm, item->req);
-                item->active = true;
-                items[item->req] = item;
+            /* Resume paused transfers whose consumer has room again.
+               Note that curl_easy_pause() may call the write callback,
+               which may pause the transfer again. */
+            if (checkPaused)
+                for (auto & i : items) {
+                    auto & item(i.second);
+                    if (item->paused && !item->request.dataFull()) {
+                        item->paused = false;
+                        curl_easy_pause(item->req, CURLPAUSE_CONT);
+                    }
+                }
+
+            /* Promoted requests have moved in the order, so rebuild
+               the queues. */
+            if (reprioritise)
+                for (auto & i : hosts) {
+                    decltype(i.second.ready) ready;
+                    for (; !i.second.ready.empty(); i.second.ready.pop())
+                        ready.push(i.second.ready.top());
+                    i.second.ready = std::move(ready);
+                }
+
+            for (auto & item : incoming)
+                hosts[item->host].ready.push(item);
+
+            /* Start the highest-priority requests of each host that
+               doesn't have too many requests in progress. */
+            for (auto & i : hosts) {
+                auto & host(i.second);
+                while (!host.ready.empty()
+                    && (!downloadSettings.httpRequestsPerHost || host.active < downloadSettings.httpRequestsPerHost))
+                {
+                    auto item = host.ready.top();
+                    host.ready.pop();
+                    debug("starting %s of %s", item->request.verb(), item->request.uri);
+                    item->init();
+                    curl_multi_add_handle(curlm, item->req);
+                    item->active = true;
+                    items[item->req] = item;
+                    host.active++;
+                }
             }
         }
 
@@ -612,7 +969,7 @@ struct CurlDownloader : public Downloader
 
     void enqueueItem(std::shared_ptr<DownloadItem> item)
     {
-        if (item->request.data
+        if ((item->request.data || item->request.dataFile != "")
             && !hasPrefix(item->request.uri, "http://")
             && !hasPrefix(item->request.uri, "https://"))
             throw nix::Error("uploading to '%s' is not supported", item->request.uri);
@@ -621,6 +978,7 @@ struct CurlDownloader : public Downloader
             auto state(state_.lock());
             if (state->quit)
                 throw nix::Error("cannot enqueue download request because the download thread is shutting down");
+            item->seq = state->nextSeq++;
             state->incoming.push(item);
         }
         writeFull(wakeupPipe.writeSide.get(), " ");
@@ -675,8 +1033,72 @@ struct CurlDownloader : public Downloader
 
         enqueueItem(std::make_shared<DownloadItem>(*this, request, callback));
     }
+
+    void resumeDownloads() override
+    {
+        {
+            auto state(state_.lock());
+            state->checkPaused = true;
+        }
+        writeFull(wakeupPipe.writeSide.get(), " ", false);
+    }
+
+    void reprioritise() override
+    {
+        {
+            auto state(state_.lock());
+            state->reprioritise = true;
+        }
+        writeFull(wakeupPipe.writeSide.get(), " ", false);
+    }
+
+    std::map<std::string, DownloadHostStats> getHostStats() override
+    {
+        return *hostStats.lock();
+    }
 };
 
+void DownloadPromotion::promote()
+{
+    if (!promoted.exchange(true))
+        getDownloader()->reprioritise();
+}
+
+static thread_local SpeculativeDownloads * curSpeculative = nullptr;
+
+SpeculativeDownloads::SpeculativeDownloads()
+    : promotion(std::make_shared<DownloadPromotion>())
+    , prev(curSpeculative)
+{
+    curSpeculative = this;
+}
+
+SpeculativeDownloads::~SpeculativeDownloads()
+{
+    curSpeculative = prev;
+}
+
+DownloadPriority getDefaultDownloadPriority()
+{
+    return curSpeculative ? DownloadPriority::Speculative : DownloadPriority::Metadata;
+}
+
+std::shared_ptr<DownloadPromotion> getCurrentDownloadPromotion()
+{
+    return curSpeculative ? curSpeculative->promotion : nullptr;
+}
+
+std::string downloadHost(const std::string & uri)
+{
+    auto start = uri.find("://");
+    if (start == std::string::npos) return "";
+    start += 3;
+    auto end = uri.find('/', start);
+    auto authority = std::string(uri, start, end == std::string::npos ? std::string::npos : end - start);
+    auto at = authority.rfind('@');
+    return at == std::string::npos ? authority : std::string(authority, at + 1);
+}
+
 ref<Downloader> getDownloader()
 {
     static ref<Downloader> downloader = makeDownloader();
@@ -715,40 +1137,39 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
        sink is expensive (e.g. one that does decompression and writing
        to the Nix store), it would stall the download thread too much.
        Therefore we use a buffer to communicate data between the
-       download thread and the calling thread. */
+       download thread and the calling thread. When the buffer is
+       full, the transfer is paused until the calling thread has
+       emptied it, so memory use is bounded no matter how slow the
+       sink is. */
+
+    const size_t maxBuffer = 1024 * 1024;
 
     struct State {
         bool quit = false;
         std::exception_ptr exc;
         std::string data;
-        std::condition_variable avail, request;
+        std::condition_variable avail;
     };
 
     auto _state = std::make_shared<Sync<State>>();
 
-    /* In case of an exception, wake up the download thread. FIXME:
-       abort the download request. */
+    /* In case of an exception, make the download thread abort the
+       transfer. */
     Finally finally([&]() {
-        auto state(_state->lock());
-        state->quit = true;
-        state->request.notify_one();
+        {
+            auto state(_state->lock());
+            if (state->quit) return;
+            state->quit = true;
+        }
+        resumeDownloads();
     });
 
     request.dataCallback = [_state](char * buf, size_t len) {
 
         auto state(_state->lock());
 
-        if (state->quit) return;
-
-        /* If the buffer is full, then go to sleep until the calling
-           thread wakes us up (i.e. when it has removed data from the
-           buffer). We don't wait forever to prevent stalling the
-           download thread. (Hopefully sleeping will throttle the
-           sender.) */
-        if (state->data.size() > 1024 * 1024) {
-            debug("download buffer is full; going to sleep");
-            state.wait_for(state->request, std::chrono::seconds(10));
-        }
+        if (state->quit)
+            throw DownloadError(Interrupted, "download was cancelled");
 
         /* Append data to the buffer and wake up the calling
            thread. */
@@ -756,6 +1177,11 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
         state->avail.notify_one();
     };
 
+    request.dataFull = [_state, maxBuffer]() {
+        auto state(_state->lock());
+        return !state->quit && state->data.size() >= maxBuffer;
+    };
+
     enqueueDownload(request,
         {[_state](std::future<DownloadResult> fut) {
             auto state(_state->lock());
@@ -766,7 +1192,6 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
                 state->exc = std::current_exception();
             }
             state->avail.notify_one();
-            state->request.notify_one();
         }});
 
     while (true) {
@@ -790,14 +1215,154 @@ void Downloader::download(DownloadRequest && request, Sink & sink)
             }
 
             chunk = std::move(state->data);
+            state->data.clear();
+        }
+
+        /* If the transfer was paused because the buffer was full,
+           let it continue. */
+        if (chunk.size() >= maxBuffer) resumeDownloads();
+
+        /* Flush the data to the sink. We don't hold the state lock
+           while doing this to prevent blocking the download thread
+           if sink() takes a long time. */
+        sink((unsigned char *) chunk.data(), chunk.size());
+    }
+}
+
+void Downloader::downloadFirst(std::vector<DownloadRequest> requests,
+    std::chrono::milliseconds hedgeDelay, Sink & sink)
+{
+    assert(!requests.empty());
+
+    /* A request wins once it has delivered this much data, or all
+       of its data. Until then, its data is kept aside. */
+    const size_t winThreshold = 64 * 1024;
+
+    const size_t maxBuffer = 1024 * 1024;
+
+    struct State {
+        bool quit = false;
+        std::optional<size_t> winner;
+        bool done = false; // whether the winner has finished
+        size_t failed = 0;
+        std::exception_ptr exc;
+        std::vector<std::string> prefixes;
+        std::string data; // data of the winner not yet passed to the sink
+        std::condition_variable avail;
+    };
 
-            state->request.notify_one();
+    auto _state = std::make_shared<Sync<State>>();
+    _state->lock()->prefixes.resize(requests.size());
+
+    Finally finally([&]() {
+        {
+            auto state(_state->lock());
+            if (state->done) return;
+            state->quit = true;
         }
+        resumeDownloads();
+    });
+
+    auto start = [&](size_t i) {
+        auto & request(requests[i]);
+
+        request.dataCallback = [_state, i, winThreshold](char * buf, size_t len) {
+            auto state(_state->lock());
+            if (state->quit || (state->winner && *state->winner != i))
+                throw DownloadError(Interrupted, "download was cancelled");
+            if (state->winner)
+                state->data.append(buf, len);
+            else {
+                auto & prefix(state->prefixes[i]);
+                prefix.append(buf, len);
+                if (prefix.size() < winThreshold) return;
+                state->winner = i;
+                state->data = std::move(prefix);
+            }
+            state->avail.notify_one();
+        };
+
+        request.dataFull = [_state, i, maxBuffer]() {
+            auto state(_state->lock());
+            return !state->quit && state->winner == i && state->data.size() >= maxBuffer;
+        };
+
+        debug("racing download of '%s'", request.uri);
+
+        enqueueDownload(request,
+            {[_state, i](std::future<DownloadResult> fut) {
+                auto state(_state->lock());
+                try {
+                    fut.get();
+                    if (!state->winner) {
+                        state->winner = i;
+                        state->data = std::move(state->prefixes[i]);
+                    }
+                    if (*state->winner == i) state->done = true;
+                } catch (...) {
+                    if (state->winner == i) {
+                        state->done = true;
+                        state->exc = std::current_exception();
+                    } else if (!state->winner) {
+                        state->failed++;
+                        state->exc = std::current_exception();
+                    }
+                }
+                state->avail.notify_one();
+            }});
+    };
+
+    size_t started = 0;
+    start(started++);
+    auto hedgeTime = std::chrono::steady_clock::now() + hedgeDelay;
+
+    while (true) {
+        checkInterrupt();
+
+        std::string chunk;
+        bool startMore = false;
+
+        {
+            auto state(_state->lock());
+
+            while (state->data.empty()) {
+
+                if (state->done) {
+                    if (state->exc) std::rethrow_exception(state->exc);
+                    return;
+                }
+
+                if (!state->winner && state->failed == started) {
+                    if (started == requests.size())
+                        std::rethrow_exception(state->exc);
+                    startMore = true;
+                    break;
+                }
+
+                if (!state->winner && started < requests.size()) {
+                    if (std::chrono::steady_clock::now() >= hedgeTime) {
+                        startMore = true;
+                        break;
+                    }
+                    state.wait_until(state->avail, hedgeTime);
+                } else
+                    state.wait(state->avail);
+            }
+
+            if (!startMore) {
+                chunk = std::move(state->data);
+                state->data.clear();
+            }
+        }
+
+        if (startMore) {
+            while (started < requests.size())
+                start(started++);
+            continue;
+        }
+
+        if (chunk.size() >= maxBuffer) resumeDownloads();
 
-        /* Flush the data to the sink and wake up the download thread
-           if it's blocked on a full buffer. We don't hold the state
-           lock while doing this to prevent blocking the download
-           thread if sink() takes a long time. */
         sink((unsigned char *) chunk.data(), chunk.size());
     }
 }
@@ -907,11 +1472,17 @@ CachedDownloadResult Downloader::downloadCached(
         }
         if (unpackedStorePath.empty()) {
             printInfo(format("unpacking '%1%'...") % url);
-            Path tmpDir = createTempDir();
-            AutoDelete autoDelete(tmpDir, true);
-            // FIXME: this requires GNU tar for decompression.
-            runProgram("tar", true, {"xf", store->toRealPath(storePath), "-C", tmpDir, "--strip-components", "1"});
-            unpackedStorePath = store->addToStore(name, tmpDir, true, htSHA256, defaultPathFilter, NoRepair);
+            /* Convert the tarball straight into a NAR, rather than
+               unpacking it and then serialising the result. */
+            StringSink sink;
+            tarToNar(store->toRealPath(storePath), sink, tarStripTopDirs);
+            ValidPathInfo info;
+            info.narHash = hashString(htSHA256, *sink.s);
+            info.narSize = sink.s->size();
+            info.path = store->makeFixedOutputPath(true, info.narHash, name);
+            info.ca = makeFixedOutputCA(true, info.narHash);
+            store->addToStore(info, sink.s, NoRepair, NoCheckSigs);
+            unpackedStorePath = info.path;
         }
         replaceSymlink(unpackedStorePath, unpackedLink);
         storePath = unpackedStorePath;
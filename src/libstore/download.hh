@@ -4,6 +4,7 @@
 #include "hash.hh"
 #include "globals.hh"
 
+#include <array>
 #include <string>
 #include <future>
 
@@ -21,15 +22,72 @@ struct DownloadSettings : Config
         "Number of parallel HTTP connections.",
         {"binary-caches-parallel-connections"}};
 
+    Setting<size_t> httpConnectionsPerHost{this, 0, "http-connections-per-host",
+        "Maximum number of parallel HTTP connections to a single host. "
+        "0 means that only http-connections applies."};
+
+    Setting<size_t> httpRequestsPerHost{this, 64, "http-requests-per-host",
+        "Maximum number of HTTP requests to a single host that are in progress "
+        "at the same time. Further requests wait in order of priority."};
+
     Setting<unsigned long> connectTimeout{this, 0, "connect-timeout",
         "Timeout for connecting to servers during downloads. 0 means use curl's builtin default."};
 
     Setting<unsigned int> tries{this, 5, "download-attempts",
         "How often Nix will attempt to download a file before giving up."};
+
+    Setting<unsigned int> rangeConnections{this, 1, "download-ranges",
+        "Number of parallel ranged requests used to download a large file "
+        "from a server that supports them. 1 disables splitting downloads."};
+
+    Setting<uint64_t> rangeSize{this, 16 * 1024 * 1024, "download-range-size",
+        "Size in bytes of the ranges into which large downloads are split."};
+
+    Setting<int> hedgeDelay{this, -1, "download-hedge-delay",
+        "If not negative, builtins.fetchurl starts downloading from the main URL "
+        "and, after this many milliseconds, from the hashed mirrors as well, "
+        "keeping whichever delivers data first. By default, the hashed mirrors "
+        "are tried one after another before the main URL."};
 };
 
 extern DownloadSettings downloadSettings;
 
+/* Priority classes of download requests. When a host has too many
+   requests in progress, waiting requests are started in this order. */
+enum class DownloadPriority
+{
+    Metadata,    // small files that someone is waiting for, e.g. .narinfo files
+    Bulk,        // large files, e.g. NARs
+    Speculative, // prefetches that may turn out to be unnecessary
+};
+
+/* Speculative requests that somebody has started waiting for are
+   promoted to `Metadata', including those already enqueued. */
+struct DownloadPromotion
+{
+    std::atomic<bool> promoted{false};
+
+    void promote();
+};
+
+/* While an instance of this exists, download requests created on
+   the current thread have priority `Speculative', and share the
+   promotion of the innermost instance. */
+struct SpeculativeDownloads
+{
+    std::shared_ptr<DownloadPromotion> promotion;
+    SpeculativeDownloads * prev;
+
+    SpeculativeDownloads();
+    ~SpeculativeDownloads();
+};
+
+DownloadPriority getDefaultDownloadPriority();
+
+/* Return the promotion of the innermost SpeculativeDownloads on the
+   current thread, or nullptr. */
+std::shared_ptr<DownloadPromotion> getCurrentDownloadPromotion();
+
 struct DownloadRequest
 {
     std::string uri;
@@ -41,15 +99,35 @@ struct DownloadRequest
     ActivityId parentAct;
     bool decompress = true;
     std::shared_ptr<std::string> data;
+    /* If set, upload the contents of this file rather than `data'. */
+    Path dataFile;
     std::string mimeType;
     std::function<void(char *, size_t)> dataCallback;
+    /* If set, the transfer is paused while this returns true,
+       i.e. while the consumer of `dataCallback' has no room for more
+       data. The consumer must call Downloader::resumeDownloads()
+       when that may have changed. Called on the download thread. */
+    std::function<bool()> dataFull;
+    DownloadPriority priority;
+    std::shared_ptr<DownloadPromotion> promotion;
+    /* If `rangeEnd' is non-zero, only fetch the bytes [rangeStart,
+       rangeEnd) of the file. */
+    uint64_t rangeStart = 0, rangeEnd = 0;
 
     DownloadRequest(const std::string & uri)
-        : uri(uri), parentAct(getCurActivity()) { }
+        : uri(uri), parentAct(getCurActivity())
+        , priority(getDefaultDownloadPriority())
+        , promotion(getCurrentDownloadPromotion()) { }
+
+    DownloadPriority effectivePriority() const
+    {
+        return priority == DownloadPriority::Speculative && promotion && promotion->promoted
+            ? DownloadPriority::Metadata : priority;
+    }
 
-    std::string verb()
+    std::string verb() const
     {
-        return data ? "upload" : "download";
+        return data || dataFile != "" ? "upload" : "download";
     }
 };
 
@@ -84,6 +162,22 @@ struct CachedDownloadResult
     std::string effectiveUri;
 };
 
+/* Statistics about the requests to a host. */
+struct DownloadHostStats
+{
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    uint64_t bytes = 0;
+
+    /* Number of requests that reused an existing connection. */
+    uint64_t reused = 0;
+
+    /* Histogram of the time to the first byte of the response:
+       latency[i] is the number of requests that took less than 2^i
+       milliseconds (the last bucket has the slower ones). */
+    std::array<uint64_t, 16> latency{};
+};
+
 class Store;
 
 struct Downloader
@@ -103,15 +197,39 @@ struct Downloader
        invoked on the thread of the caller. */
     void download(DownloadRequest && request, Sink & sink);
 
+    /* Download the same file from several sources, writing the data
+       of the first one to deliver a reasonable amount of it to a
+       sink, and cancelling the others. The first request is started
+       immediately, the others after `hedgeDelay' or as soon as the
+       requests started so far have failed. */
+    void downloadFirst(std::vector<DownloadRequest> requests,
+        std::chrono::milliseconds hedgeDelay, Sink & sink);
+
     /* Check if the specified file is already in ~/.cache/nix/tarballs
        and is more recent than ‘tarball-ttl’ seconds. Otherwise,
        use the recorded ETag to verify if the server has a more
        recent version, and if so, download it to the Nix store. */
     CachedDownloadResult downloadCached(ref<Store> store, const CachedDownloadRequest & request);
 
+    /* Continue paused transfers whose `dataFull()' no longer
+       returns true. */
+    virtual void resumeDownloads() = 0;
+
+    /* Reorder the requests that are waiting to start, because the
+       priority of some has changed (see DownloadPromotion). */
+    virtual void reprioritise() = 0;
+
+    /* Return statistics about the requests to each host, keyed by
+       the host part of the URI (see downloadHost()). */
+    virtual std::map<std::string, DownloadHostStats> getHostStats() = 0;
+
     enum Error { NotFound, Forbidden, Misc, Transient, Interrupted };
 };
 
+/* Return the host (and port, if any) of a URI, e.g. 'example.org:8080'
+   for 'https://user@example.org:8080/foo'. */
+std::string downloadHost(const std::string & uri);
+
 /* Return a shared Downloader object. Using this object is preferred
    because it enables connection reuse and HTTP/2 multiplexing. */
 ref<Downloader> getDownloader();
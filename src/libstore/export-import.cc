@@ -1,6 +1,7 @@
 #include "store-api.hh"
 #include "archive.hh"
 #include "worker-protocol.hh"
+#include "globals.hh"
 
 #include <algorithm>
 
@@ -24,11 +25,70 @@ struct HashAndWriteSink : Sink
     }
 };
 
-void Store::exportPaths(const Paths & paths, Sink & sink)
+/* An indexed export consists of exportIndexMagic, the number of
+   paths, the path, deriver, NAR size, NAR hash and references of each
+   path in topological order, and then the NARs in the same order. */
+static void exportIndexed(Store & store, const Paths & sorted, Sink & sink)
+{
+    std::vector<ref<const ValidPathInfo>> infos;
+
+    for (auto & path : sorted) {
+        auto info = store.queryPathInfo(path);
+        if (!info->narSize || info->narHash == Hash(info->narHash.type)) {
+            HashSink hashSink(htSHA256);
+            store.narFromPath(path, hashSink);
+            auto info2 = make_ref<ValidPathInfo>(*info);
+            std::tie(info2->narHash, info2->narSize) = hashSink.finish();
+            info = info2;
+        }
+        infos.push_back(info);
+    }
+
+    sink << exportIndexMagic << infos.size();
+
+    for (auto & info : infos)
+        sink << info->path << info->deriver << info->narSize
+             << info->narHash.to_string() << info->references;
+
+    for (auto & info : infos) {
+        HashAndWriteSink hashAndWriteSink(sink);
+        store.narFromPath(info->path, hashAndWriteSink);
+        auto hash = hashAndWriteSink.hashSink.finish();
+        if (hash.first != info->narHash || hash.second != info->narSize)
+            throw Error("contents of path '%s' have changed while exporting it", info->path);
+    }
+}
+
+static ValidPathInfos readExportIndex(Store & store, Source & source)
+{
+    ValidPathInfos infos;
+
+    auto count = readNum<uint64_t>(source);
+
+    for (uint64_t i = 0; i < count; ++i) {
+        ValidPathInfo info;
+        info.path = readStorePath(store, source);
+        info.deriver = readString(source);
+        if (info.deriver != "") store.assertStorePath(info.deriver);
+        info.narSize = readNum<uint64_t>(source);
+        info.narHash = Hash(readString(source), htSHA256);
+        info.references = readStorePaths<PathSet>(store, source);
+        infos.push_back(info);
+    }
+
+    return infos;
+}
+
+void Store::exportPaths(const Paths & paths, Sink & sink, bool index)
 {
     Paths sorted = topoSortPaths(PathSet(paths.begin(), paths.end()));
     std::reverse(sorted.begin(), sorted.end());
 
+    if (index) {
+        exportIndexed(*this, sorted, sink);
+        return;
+    }
+
     std::string doneLabel("paths exported");
     //logger->incExpected(doneLabel, sorted.size());
 
@@ -64,9 +124,61 @@ void Store::exportPath(const Path & path, Sink & sink)
 Paths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor, CheckSigsFlag checkSigs)
 {
     Paths res;
-    while (true) {
-        auto n = readNum<uint64_t>(source);
-        if (n == 0) break;
+
+    /* Collect the NARs in memory and hand them to
+       addMultipleToStore() in batches. The export format is in
+       topological order, so each batch only refers to itself and
+       earlier batches. */
+    ValidPathInfos batch;
+    std::map<Path, ref<std::string>> nars;
+    uint64_t batchBytes = 0;
+
+    auto flush = [&]() {
+        if (batch.empty()) return;
+        addMultipleToStore(batch,
+            [&](const ValidPathInfo & info, Sink & sink) {
+                sink(*nars.at(info.path));
+            },
+            NoRepair, checkSigs);
+        batch.clear();
+        nars.clear();
+        batchBytes = 0;
+    };
+
+    auto add = [&](const ValidPathInfo & info, ref<std::string> nar) {
+        if (accessor) {
+            addToStore(info, nar, NoRepair, checkSigs, accessor);
+            res.push_back(info.path);
+            return;
+        }
+
+        nars.emplace(info.path, nar);
+        batchBytes += info.narSize;
+        batch.push_back(info);
+
+        if (batch.size() >= settings.importBatchSize || batchBytes >= 256 * 1024 * 1024)
+            flush();
+
+        res.push_back(info.path);
+    };
+
+    auto n = readNum<uint64_t>(source);
+
+    if (n == exportIndexMagic) {
+        for (auto & info : readExportIndex(*this, source)) {
+            /* Don't trust the NAR size in the index for allocating
+               the buffer, since it comes from the client. */
+            TeeSink tee(source);
+            parseDump(tee, tee.source);
+            if (tee.source.data->size() != info.narSize)
+                throw Error("size mismatch importing path '%s'; expected %d, got %d",
+                    info.path, info.narSize, tee.source.data->size());
+            add(info, tee.source.data);
+        }
+        n = 0;
+    }
+
+    for (; n != 0; n = readNum<uint64_t>(source)) {
         if (n != 1) throw Error("input doesn't look like something created by 'nix-store --export'");
 
         /* Extract the NAR from the source. */
@@ -95,11 +207,86 @@ Paths Store::importPaths(Source & source, std::shared_ptr<FSAccessor> accessor,
         if (readInt(source) == 1)
             readString(source);
 
-        addToStore(info, tee.source.data, NoRepair, checkSigs, accessor);
+        add(info, tee.source.data);
+    }
 
-        res.push_back(info.path);
+    flush();
+
+    return res;
+}
+
+Paths Store::importPathsFromFile(int fd, const PathSet & paths, CheckSigsFlag checkSigs)
+{
+    off_t start = lseek(fd, 0, SEEK_CUR);
+
+    std::string magic(8, 0);
+    StringSource magicSource(magic);
+    if (start == -1 || pread(fd, &magic[0], magic.size(), start) != (ssize_t) magic.size()
+        || readNum<uint64_t>(magicSource) != exportIndexMagic)
+    {
+        if (!paths.empty())
+            throw Error("selecting paths requires an indexed export in a file");
+        FdSource source(fd);
+        return importPaths(source, nullptr, checkSigs);
+    }
+
+    FdSource source(fd);
+    readNum<uint64_t>(source);
+    auto infos = readExportIndex(*this, source);
+
+    /* Compute the offset of each NAR in the file. */
+    std::map<Path, off_t> offsets;
+    off_t offset = start + source.read - (source.bufPosIn - source.bufPosOut);
+    for (auto & info : infos) {
+        offsets.emplace(info.path, offset);
+        offset += info.narSize;
     }
 
+    if (!paths.empty()) {
+        std::map<Path, const ValidPathInfo *> byPath;
+        for (auto & info : infos) byPath.emplace(info.path, &info);
+
+        PathSet closure;
+        Paths todo(paths.begin(), paths.end());
+        while (!todo.empty()) {
+            auto path = todo.front();
+            todo.pop_front();
+            auto i = byPath.find(path);
+            if (i == byPath.end()) {
+                if (paths.count(path))
+                    throw Error("path '%s' is not in the export", path);
+                continue;
+            }
+            if (!closure.insert(path).second) continue;
+            for (auto & ref : i->second->references) todo.push_back(ref);
+        }
+
+        infos.remove_if([&](const ValidPathInfo & info) { return !closure.count(info.path); });
+    }
+
+    addMultipleToStore(infos,
+        [&](const ValidPathInfo & info, Sink & sink) {
+            auto pos = offsets.at(info.path);
+            auto left = info.narSize;
+            std::vector<unsigned char> buf(64 * 1024);
+            while (left) {
+                checkInterrupt();
+                auto n = pread(fd, buf.data(), std::min((uint64_t) buf.size(), left), pos);
+                if (n == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("reading the NAR of '%s'", info.path);
+                }
+                if (n == 0)
+                    throw EndOfFile("export ends in the NAR of '%s'", info.path);
+                sink(buf.data(), n);
+                pos += n;
+                left -= n;
+            }
+        },
+        NoRepair, checkSigs);
+
+    Paths res;
+    for (auto & info : infos) res.push_back(info.path);
     return res;
 }
 
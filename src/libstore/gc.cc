@@ -2,12 +2,16 @@
 #include "globals.hh"
 #include "local-store.hh"
 #include "finally.hh"
+#include "refs-graph.hh"
+#include "thread-pool.hh"
 
 #include <functional>
 #include <queue>
 #include <algorithm>
 #include <regex>
 #include <random>
+#include <atomic>
+#include <unordered_set>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -17,6 +21,8 @@
 #include <unistd.h>
 #include <climits>
 
+#include <sqlite3.h>
+
 namespace nix {
 
 
@@ -24,6 +30,9 @@ static string gcLockName = "gc.lock";
 static string gcRootsDir = "gcroots";
 
 
+PathLockStats gcLockStats;
+
+
 /* Acquire the global GC lock.  This is used to prevent new Nix
    processes from starting after the temporary root files have been
    read.  To be precise: when they try to create a new temporary root
@@ -42,7 +51,11 @@ int LocalStore::openGCLock(LockType lockType)
 
     if (!lockFile(fdGCLock.get(), lockType, false)) {
         printError(format("waiting for the big garbage collector lock..."));
+        auto start = std::chrono::steady_clock::now();
         lockFile(fdGCLock.get(), lockType, true);
+        gcLockStats.waits++;
+        gcLockStats.waitTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
     }
 
     /* !!! Restrict read permission on the GC root.  Otherwise any
@@ -148,9 +161,26 @@ Path LocalFSStore::addPermRoot(const Path & _storePath,
 
 
 void LocalStore::addTempRoot(const Path & path)
+{
+    addTempRoots({path});
+}
+
+
+void LocalStore::addTempRoots(const PathSet & paths)
 {
     auto state(_state.lock());
 
+    /* A root stays in our file until we exit, so there is no need to
+       write it again. */
+    Paths added;
+    string s;
+    for (auto & path : paths)
+        if (!state->tempRoots.count(path)) {
+            added.push_back(path);
+            s += path + '\0';
+        }
+    if (added.empty()) return;
+
     /* Create the temporary roots file for this process. */
     if (!state->fdTempRoots) {
 
@@ -188,12 +218,13 @@ void LocalStore::addTempRoot(const Path & path)
     debug(format("acquiring write lock on '%1%'") % fnTempRoots);
     lockFile(state->fdTempRoots.get(), ltWrite, true);
 
-    string s = path + '\0';
     writeFull(state->fdTempRoots.get(), s);
 
     /* Downgrade to a read lock. */
     debug(format("downgrading to read lock on '%1%'") % fnTempRoots);
     lockFile(state->fdTempRoots.get(), ltRead, true);
+
+    state->tempRoots.insert(added.begin(), added.end());
 }
 
 
@@ -262,60 +293,86 @@ void LocalStore::findTempRoots(FDs & fds, Roots & tempRoots, bool censor)
 
 void LocalStore::findRoots(const Path & path, unsigned char type, Roots & roots)
 {
-    auto foundRoot = [&](const Path & path, const Path & target) {
-        Path storePath = toStorePath(target);
-        if (isStorePath(storePath) && isValidPath(storePath))
-            roots[storePath].emplace(path);
-        else
-            printInfo(format("skipping invalid root from '%1%' to '%2%'") % path % storePath);
-    };
+    /* The roots found, as (link, store path, whether to complain if
+       the store path is invalid). Their validity is checked in bulk
+       at the end rather than with a query per root. */
+    std::vector<std::tuple<Path, Path, bool>> found;
 
-    try {
+    /* Walk the tree relative to directory file descriptors, so that
+       the kernel doesn't have to resolve the full path of every
+       entry. */
+    std::function<void(int, const Path &, const string &, unsigned char)> walk;
 
-        if (type == DT_UNKNOWN)
-            type = getFileType(path);
+    walk = [&](int dirFd, const Path & path, const string & name, unsigned char type) {
+        try {
 
-        if (type == DT_DIR) {
-            for (auto & i : readDirectory(path))
-                findRoots(path + "/" + i.name, i.type, roots);
-        }
+            if (type == DT_UNKNOWN) {
+                struct stat st;
+                if (fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1)
+                    throw SysError("getting status of '%1%'", path);
+                type =
+                    S_ISDIR(st.st_mode) ? DT_DIR :
+                    S_ISLNK(st.st_mode) ? DT_LNK :
+                    S_ISREG(st.st_mode) ? DT_REG :
+                    DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                AutoCloseFD fd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+                if (!fd) throw SysError("opening directory '%1%'", path);
+                for (auto & i : readDirectory(fd.get(), path))
+                    walk(fd.get(), path + "/" + i.name, i.name, i.type);
+            }
 
-        else if (type == DT_LNK) {
-            Path target = readLink(path);
-            if (isInStore(target))
-                foundRoot(path, target);
-
-            /* Handle indirect roots. */
-            else {
-                target = absPath(target, dirOf(path));
-                if (!pathExists(target)) {
-                    if (isInDir(path, stateDir + "/" + gcRootsDir + "/auto")) {
-                        printInfo(format("removing stale link from '%1%' to '%2%'") % path % target);
-                        unlink(path.c_str());
+            else if (type == DT_LNK) {
+                Path target = readLinkAt(dirFd, name, path);
+                if (isInStore(target))
+                    found.emplace_back(path, toStorePath(target), true);
+
+                /* Handle indirect roots. */
+                else {
+                    target = absPath(target, dirOf(path));
+                    if (!pathExists(target)) {
+                        if (isInDir(path, stateDir + "/" + gcRootsDir + "/auto")) {
+                            printInfo(format("removing stale link from '%1%' to '%2%'") % path % target);
+                            unlinkat(dirFd, name.c_str(), 0);
+                        }
+                    } else {
+                        struct stat st2 = lstat(target);
+                        if (!S_ISLNK(st2.st_mode)) return;
+                        Path target2 = readLink(target);
+                        if (isInStore(target2)) found.emplace_back(target, toStorePath(target2), true);
                     }
-                } else {
-                    struct stat st2 = lstat(target);
-                    if (!S_ISLNK(st2.st_mode)) return;
-                    Path target2 = readLink(target);
-                    if (isInStore(target2)) foundRoot(target, target2);
                 }
             }
+
+            else if (type == DT_REG)
+                found.emplace_back(path, storeDir + "/" + baseNameOf(path), false);
+
         }
 
-        else if (type == DT_REG) {
-            Path storePath = storeDir + "/" + baseNameOf(path);
-            if (isStorePath(storePath) && isValidPath(storePath))
-                roots[storePath].emplace(path);
+        catch (SysError & e) {
+            /* We only ignore permanent failures. */
+            if (e.errNo == EACCES || e.errNo == ENOENT || e.errNo == ENOTDIR)
+                printInfo(format("cannot read potential root '%1%'") % path);
+            else
+                throw;
         }
+    };
 
-    }
+    walk(AT_FDCWD, path, path, type);
 
-    catch (SysError & e) {
-        /* We only ignore permanent failures. */
-        if (e.errNo == EACCES || e.errNo == ENOENT || e.errNo == ENOTDIR)
-            printInfo(format("cannot read potential root '%1%'") % path);
-        else
-            throw;
+    PathSet storePaths;
+    for (auto & [link, storePath, complain] : found)
+        if (isStorePath(storePath)) storePaths.insert(storePath);
+
+    auto valid = queryValidPaths(storePaths);
+
+    for (auto & [link, storePath, complain] : found) {
+        if (valid.count(storePath))
+            roots[storePath].emplace(link);
+        else if (complain)
+            printInfo(format("skipping invalid root from '%1%' to '%2%'") % link % storePath);
     }
 }
 
@@ -367,10 +424,31 @@ try_again:
             .emplace(file);
 }
 
-static string quoteRegexChars(const string & raw)
+/* Add the store paths occurring in `s' to `roots'.  This matches
+   what the regular expression `<storeDir>/[0-9a-z]+[0-9a-zA-Z+._?=-]*'
+   would, but is a lot faster on large inputs such as the environment
+   or memory maps of a process. */
+static void scanForStorePaths(const string & storeDir, const string & s,
+    const string & file, Roots & roots)
 {
-    static auto specialRegex = std::regex(R"([.^$\\*+?()\[\]{}|])");
-    return std::regex_replace(raw, specialRegex, R"(\$&)");
+    auto isHashChar = [](char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z');
+    };
+    auto isNameChar = [&](char c) {
+        return isHashChar(c) || (c >= 'A' && c <= 'Z')
+            || c == '+' || c == '-' || c == '.' || c == '_' || c == '?' || c == '=';
+    };
+
+    auto prefix = storeDir + "/";
+    size_t pos = 0;
+    while ((pos = s.find(prefix, pos)) != string::npos) {
+        auto end = pos + prefix.size();
+        if (end < s.size() && isHashChar(s[end])) {
+            while (end < s.size() && isNameChar(s[end])) end++;
+            roots[string(s, pos, end - pos)].emplace(file);
+        }
+        pos = end;
+    }
 }
 
 static void readFileRoots(const char * path, Roots & roots)
@@ -383,64 +461,118 @@ static void readFileRoots(const char * path, Roots & roots)
     }
 }
 
+/* Return the start time of process `pid' (field 22 of
+   /proc/<pid>/stat), which together with the pid identifies the
+   process, or an empty string if it has gone away. */
+static string getProcessStartTime(const string & pid)
+{
+    string stat;
+    try {
+        stat = readFile(fmt("/proc/%s/stat", pid));
+    } catch (SysError & e) {
+        if (e.errNo == ENOENT || e.errNo == EACCES || e.errNo == ESRCH)
+            return "";
+        throw;
+    }
+    /* Skip the command name, which may contain spaces. */
+    auto fields = tokenizeString<std::vector<string>>(string(stat, stat.rfind(')') + 1));
+    return fields.size() > 19 ? fields[19] : "";
+}
+
+/* Find the runtime roots of a single process. */
+void LocalStore::findProcessRoots(const string & pid, Roots & roots)
+{
+    readProcLink(fmt("/proc/%s/exe", pid), roots);
+    readProcLink(fmt("/proc/%s/cwd", pid), roots);
+
+    auto fdStr = fmt("/proc/%s/fd", pid);
+    auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
+    if (!fdDir) {
+        if (errno == ENOENT || errno == EACCES)
+            return;
+        throw SysError(format("opening %1%") % fdStr);
+    }
+    struct dirent * fd_ent;
+    while (errno = 0, fd_ent = readdir(fdDir.get())) {
+        if (fd_ent->d_name[0] != '.')
+            readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), roots);
+    }
+    if (errno) {
+        if (errno == ESRCH)
+            return;
+        throw SysError(format("iterating /proc/%1%/fd") % pid);
+    }
+    fdDir.reset();
+
+    try {
+        auto mapFile = fmt("/proc/%s/maps", pid);
+        scanForStorePaths(storeDir, readFile(mapFile, true), mapFile, roots);
+
+        /* The environment of a process is fixed when it starts, so
+           scan it only once per process. */
+        auto startTime = getProcessStartTime(pid);
+        {
+            auto cache(procEnvRoots.lock());
+            auto i = cache->find(pid);
+            if (i != cache->end() && i->second.first == startTime && startTime != "") {
+                for (auto & [path, links] : i->second.second)
+                    roots[path].insert(links.begin(), links.end());
+                return;
+            }
+        }
+
+        auto envFile = fmt("/proc/%s/environ", pid);
+        Roots envRoots;
+        scanForStorePaths(storeDir, readFile(envFile, true), envFile, envRoots);
+        for (auto & [path, links] : envRoots)
+            roots[path].insert(links.begin(), links.end());
+        procEnvRoots.lock()->insert_or_assign(pid, std::make_pair(startTime, std::move(envRoots)));
+    } catch (SysError & e) {
+        if (e.errNo == ENOENT || e.errNo == EACCES || e.errNo == ESRCH)
+            return;
+        throw;
+    }
+}
+
 void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 {
     Roots unchecked;
 
     auto procDir = AutoCloseDir{opendir("/proc")};
     if (procDir) {
+        std::set<string> pids;
         struct dirent * ent;
-        auto digitsRegex = std::regex(R"(^\d+$)");
-        auto mapRegex = std::regex(R"(^\s*\S+\s+\S+\s+\S+\s+\S+\s+\S+\s+(/\S+)\s*$)");
-        auto storePathRegex = std::regex(quoteRegexChars(storeDir) + R"(/[0-9a-z]+[0-9a-zA-Z\+\-\._\?=]*)");
         while (errno = 0, ent = readdir(procDir.get())) {
             checkInterrupt();
-            if (std::regex_match(ent->d_name, digitsRegex)) {
-                readProcLink(fmt("/proc/%s/exe" ,ent->d_name), unchecked);
-                readProcLink(fmt("/proc/%s/cwd", ent->d_name), unchecked);
-
-                auto fdStr = fmt("/proc/%s/fd", ent->d_name);
-                auto fdDir = AutoCloseDir(opendir(fdStr.c_str()));
-                if (!fdDir) {
-                    if (errno == ENOENT || errno == EACCES)
-                        continue;
-                    throw SysError(format("opening %1%") % fdStr);
-                }
-                struct dirent * fd_ent;
-                while (errno = 0, fd_ent = readdir(fdDir.get())) {
-                    if (fd_ent->d_name[0] != '.')
-                        readProcLink(fmt("%s/%s", fdStr, fd_ent->d_name), unchecked);
-                }
-                if (errno) {
-                    if (errno == ESRCH)
-                        continue;
-                    throw SysError(format("iterating /proc/%1%/fd") % ent->d_name);
-                }
-                fdDir.reset();
-
-                try {
-                    auto mapFile = fmt("/proc/%s/maps", ent->d_name);
-                    auto mapLines = tokenizeString<std::vector<string>>(readFile(mapFile, true), "\n");
-                    for (const auto & line : mapLines) {
-                        auto match = std::smatch{};
-                        if (std::regex_match(line, match, mapRegex))
-                            unchecked[match[1]].emplace(mapFile);
-                    }
-
-                    auto envFile = fmt("/proc/%s/environ", ent->d_name);
-                    auto envString = readFile(envFile, true);
-                    auto env_end = std::sregex_iterator{};
-                    for (auto i = std::sregex_iterator{envString.begin(), envString.end(), storePathRegex}; i != env_end; ++i)
-                        unchecked[i->str()].emplace(envFile);
-                } catch (SysError & e) {
-                    if (errno == ENOENT || errno == EACCES || errno == ESRCH)
-                        continue;
-                    throw;
-                }
-            }
+            string name = ent->d_name;
+            if (!name.empty() && std::all_of(name.begin(), name.end(), ::isdigit))
+                pids.insert(name);
         }
         if (errno)
             throw SysError("iterating /proc");
+        procDir.reset();
+
+        /* Forget about processes that have exited. */
+        {
+            auto cache(procEnvRoots.lock());
+            for (auto i = cache->begin(); i != cache->end(); )
+                if (pids.count(i->first)) ++i; else i = cache->erase(i);
+        }
+
+        /* Reading /proc is mostly waiting for the kernel, so do it
+           for many processes in parallel. */
+        Sync<Roots> unchecked_;
+        ThreadPool pool;
+        for (auto & pid : pids)
+            pool.enqueue([&, pid]() {
+                Roots procRoots;
+                findProcessRoots(pid, procRoots);
+                auto unchecked(unchecked_.lock());
+                for (auto & [path, links] : procRoots)
+                    (*unchecked)[path].insert(links.begin(), links.end());
+            });
+        pool.process();
+        unchecked = std::move(*unchecked_.lock());
     }
 
 #if !defined(__linux__)
@@ -482,20 +614,102 @@ void LocalStore::findRuntimeRoots(Roots & roots, bool censor)
 struct GCLimitReached { };
 
 
+struct DeletionStats
+{
+    std::atomic<unsigned long long> bytesFreed{0}, filesDeleted{0};
+
+    /* The inodes of deleted files that had more than one link.  The
+       remaining link may be an unused one in the links directory. */
+    Sync<std::unordered_set<ino_t>> linkedInodes;
+};
+
+
+/* Delete `name' in the directory `dirfd' recursively.  This is like
+   deletePath(), but works relative to directory file descriptors, so
+   that the kernel doesn't have to resolve the full path of every
+   file. */
+static void deleteAt(int dirfd, const string & name, DeletionStats & stats)
+{
+    checkInterrupt();
+
+    struct stat st;
+    if (fstatat(dirfd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+        if (errno == ENOENT) return;
+        throw SysError(format("getting status of '%1%'") % name);
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        /* Make the directory accessible. */
+        const auto PERM_MASK = S_IRUSR | S_IWUSR | S_IXUSR;
+        if ((st.st_mode & PERM_MASK) != PERM_MASK
+            && fchmodat(dirfd, name.c_str(), st.st_mode | PERM_MASK, 0) == -1)
+            throw SysError(format("chmod '%1%'") % name);
+
+        AutoCloseFD fd = openat(dirfd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (!fd) throw SysError(format("opening directory '%1%'") % name);
+
+        for (auto & i : readDirectory(fd.get(), name))
+            deleteAt(fd.get(), i.name, stats);
+    }
+
+    else if (st.st_nlink == 1)
+        stats.bytesFreed += st.st_blocks * 512ULL;
+
+    else
+        stats.linkedInodes.lock()->insert(st.st_ino);
+
+    if (unlinkat(dirfd, name.c_str(), S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) == -1) {
+        if (errno == ENOENT) return;
+        throw SysError(format("cannot unlink '%1%'") % name);
+    }
+
+    stats.filesDeleted++;
+}
+
+
 struct LocalStore::GCState
 {
     GCOptions options;
     GCResults & results;
     PathSet roots;
     PathSet tempRoots;
-    PathSet dead;
-    PathSet alive;
+    /* The paths we've looked at, and which of them are garbage and
+       which are reachable from a root. */
+    PathTable paths;
+    PathIdSet dead;
+    PathIdSet alive;
     bool gcKeepOutputs;
     bool gcKeepDerivations;
     unsigned long long bytesInvalidated;
     bool moveToTrash = true;
     bool shouldDelete;
+    /* Snapshot of the reference graph taken after acquiring the GC
+       lock, or nullptr to query the database. */
+    std::shared_ptr<RefsGraph> graph;
+    /* The real store directory, relative to which paths are deleted. */
+    AutoCloseFD storeFd;
+    DeletionStats deleted;
+    /* Paths are invalidated in the calling thread, but removed from
+       the file system by this pool.  Deletions must be waited for
+       with drain() before releasing the GC lock. */
+    std::unique_ptr<ThreadPool> pool;
+
     GCState(GCResults & results_) : results(results_), bytesInvalidated(0) { }
+
+    void enqueue(const ThreadPool::work_t & work)
+    {
+        if (!pool) pool = std::make_unique<ThreadPool>(settings.gcDeleteThreads);
+        pool->enqueue(work);
+    }
+
+    void drain()
+    {
+        if (pool) {
+            auto pool2 = std::move(pool);
+            pool2->process();
+        }
+        results.bytesFreed += deleted.bytesFreed.exchange(0);
+    }
 };
 
 
@@ -509,9 +723,23 @@ bool LocalStore::isActiveTempFile(const GCState & state,
 
 void LocalStore::deleteGarbage(GCState & state, const Path & path)
 {
-    unsigned long long bytesFreed;
-    deletePath(path, bytesFreed);
-    state.results.bytesFreed += bytesFreed;
+    /* Delete the entries of a directory (typically the trash
+       directory) in parallel. */
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd) {
+        auto fd2 = std::make_shared<AutoCloseFD>(std::move(fd));
+        if (fchmod(fd2->get(), 0755) == -1)
+            throw SysError(format("making '%1%' writable") % path);
+        for (auto & i : readDirectory(path))
+            state.enqueue([&state, fd2, name{i.name}]() {
+                deleteAt(fd2->get(), name, state.deleted);
+            });
+    }
+
+    state.drain();
+
+    deleteAt(AT_FDCWD, path, state.deleted);
+    state.results.bytesFreed += state.deleted.bytesFreed.exchange(0);
 }
 
 
@@ -523,7 +751,10 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
 
     if (isStorePath(path) && isValidPath(path)) {
         PathSet referrers;
-        queryReferrers(path, referrers);
+        if (state.graph)
+            state.graph->queryReferrers(path, referrers);
+        else
+            queryReferrers(path, referrers);
         for (auto & i : referrers)
             if (i != path) deletePathRecursive(state, i);
         size = queryPathInfo(path)->narSize;
@@ -546,56 +777,66 @@ void LocalStore::deletePathRecursive(GCState & state, const Path & path)
        trash directory.  The move is to ensure that later (when we're
        not holding the global GC lock) we can delete the path without
        being afraid that the path has become alive again.  Otherwise
-       delete it right away. */
+       delete it right away.  Since the path has been invalidated
+       already, both happen in the background. */
+    string name = baseNameOf(path);
     if (state.moveToTrash && S_ISDIR(st.st_mode)) {
         // Estimate the amount freed using the narSize field.  FIXME:
         // if the path was not valid, need to determine the actual
         // size.
-        try {
-            if (chmod(realPath.c_str(), st.st_mode | S_IWUSR) == -1)
-                throw SysError(format("making '%1%' writable") % realPath);
-            Path tmp = trashDir + "/" + baseNameOf(path);
-            if (rename(realPath.c_str(), tmp.c_str()))
-                throw SysError(format("unable to rename '%1%' to '%2%'") % realPath % tmp);
-            state.bytesInvalidated += size;
-        } catch (SysError & e) {
-            if (e.errNo == ENOSPC) {
-                printInfo(format("note: can't create move '%1%': %2%") % realPath % e.msg());
-                deleteGarbage(state, realPath);
+        state.bytesInvalidated += size;
+        state.enqueue([&state, name, mode{st.st_mode}, tmp{trashDir + "/" + name}]() {
+            try {
+                if (fchmodat(state.storeFd.get(), name.c_str(), mode | S_IWUSR, 0) == -1)
+                    throw SysError(format("making '%1%' writable") % name);
+                if (renameat(state.storeFd.get(), name.c_str(), AT_FDCWD, tmp.c_str()))
+                    throw SysError(format("unable to rename '%1%' to '%2%'") % name % tmp);
+            } catch (SysError & e) {
+                if (e.errNo == ENOSPC) {
+                    printInfo(format("note: can't create move '%1%': %2%") % name % e.msg());
+                    deleteAt(state.storeFd.get(), name, state.deleted);
+                }
             }
-        }
+        });
     } else
-        deleteGarbage(state, realPath);
+        state.enqueue([&state, name]() {
+            deleteAt(state.storeFd.get(), name, state.deleted);
+        });
 
-    if (state.results.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
+    if (state.results.bytesFreed + state.deleted.bytesFreed + state.bytesInvalidated > state.options.maxFreed) {
         printInfo(format("deleted or invalidated more than %1% bytes; stopping") % state.options.maxFreed);
         throw GCLimitReached();
     }
 }
 
 
-bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & path)
+bool LocalStore::canReachRoot(GCState & state, PathIdSet & visited, const Path & path)
 {
-    if (visited.count(path)) return false;
+    auto id = state.paths.intern(path);
 
-    if (state.alive.count(path)) return true;
+    if (visited.count(id)) return false;
 
-    if (state.dead.count(path)) return false;
+    if (state.alive.count(id)) return true;
+
+    if (state.dead.count(id)) return false;
 
     if (state.roots.count(path)) {
         debug(format("cannot delete '%1%' because it's a root") % path);
-        state.alive.insert(path);
+        state.alive.insert(id);
         return true;
     }
 
-    visited.insert(path);
+    visited.insert(id);
 
     if (!isStorePath(path) || !isValidPath(path)) return false;
 
     PathSet incoming;
 
     /* Don't delete this path if any of its referrers are alive. */
-    queryReferrers(path, incoming);
+    if (state.graph)
+        state.graph->queryReferrers(path, incoming);
+    else
+        queryReferrers(path, incoming);
 
     /* If keep-derivations is set and this is a derivation, then
        don't delete the derivation if any of the outputs are alive. */
@@ -617,7 +858,7 @@ bool LocalStore::canReachRoot(GCState & state, PathSet & visited, const Path & p
     for (auto & i : incoming)
         if (i != path)
             if (canReachRoot(state, visited, i)) {
-                state.alive.insert(path);
+                state.alive.insert(id);
                 return true;
             }
 
@@ -649,7 +890,7 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
         if (isActiveTempFile(state, path, ".check")) return;
     }
 
-    PathSet visited;
+    PathIdSet visited;
 
     if (canReachRoot(state, visited, path)) {
         debug(format("cannot delete '%1%' because it's still reachable") % path);
@@ -665,51 +906,142 @@ void LocalStore::tryToDelete(GCState & state, const Path & path)
 }
 
 
-/* Unlink all files in /nix/store/.links that have a link count of 1,
-   which indicates that there are no other links and so they can be
-   safely deleted.  FIXME: race condition with optimisePath(): we
-   might see a link count of 1 just before optimisePath() increases
-   the link count. */
-void LocalStore::removeUnusedLinks(const GCState & state)
+/* Mark `path' and everything it keeps alive as alive.  This is used
+   by the incremental collector for roots that appeared after the
+   dead set was computed.  The closure of a path that was already
+   alive is alive as well, so the traversal stops there. */
+void LocalStore::markAlive(GCState & state, const Path & path)
 {
-    AutoCloseDir dir(opendir(linksDir.c_str()));
-    if (!dir) throw SysError(format("opening directory '%1%'") % linksDir);
+    Paths todo{path};
 
-    long long actualSize = 0, unsharedSize = 0;
+    while (!todo.empty()) {
+        auto p = todo.front();
+        todo.pop_front();
 
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) {
-        checkInterrupt();
-        string name = dirent->d_name;
-        if (name == "." || name == "..") continue;
-        Path path = linksDir + "/" + name;
-
-        struct stat st;
-        if (lstat(path.c_str(), &st) == -1)
-            throw SysError(format("statting '%1%'") % path);
-
-        if (st.st_nlink != 1) {
-            unsigned long long size = st.st_blocks * 512ULL;
-            actualSize += size;
-            unsharedSize += (st.st_nlink - 1) * size;
-            continue;
+        auto id = state.paths.intern(p);
+        if (!state.alive.insert(id).second) continue;
+        if (state.dead.erase(id))
+            debug(format("path '%1%' has become alive again") % p);
+
+        if (!isStorePath(p) || !isValidPath(p)) continue;
+
+        auto info = queryPathInfo(p);
+        PathSet next = info->references;
+
+        /* The inverse of the keep-derivations and keep-outputs
+           edges followed by canReachRoot(). */
+        if (state.gcKeepDerivations && info->deriver != "" && isValidPath(info->deriver))
+            next.insert(info->deriver);
+
+        if (state.gcKeepOutputs && isDerivation(p))
+            for (auto & i : queryDerivationOutputs(p))
+                if (isValidPath(i)) next.insert(i);
+
+        for (auto & i : next) {
+            auto id = state.paths.lookup(i);
+            if (!id || !state.alive.count(*id)) todo.push_back(i);
         }
+    }
+}
+
+
+/* Delete the garbage in `candidates' in slices of at most
+   `gc-slice-time' milliseconds, so that other processes can add
+   temporary roots and register paths in between.  At the start of
+   each slice we reacquire the GC lock and the temporary roots, and
+   resurrect whatever the new roots reach: a process can only start
+   using a path after making it a temporary root, so paths that are
+   still dead are safe to delete.  Directories are moved to the trash
+   while holding the lock, and removed after releasing it. */
+void LocalStore::deleteGarbageIncremental(GCState & state, const std::vector<Path> & candidates,
+    AutoCloseFD & fdGCLock, FDs & fds)
+{
+    /* The snapshot doesn't include paths registered after we release
+       the lock. */
+    state.graph = nullptr;
+    state.shouldDelete = true;
+
+    auto next = candidates.begin();
 
-        printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
+    while (next != candidates.end()) {
 
-        if (unlink(path.c_str()) == -1)
-            throw SysError(format("deleting '%1%'") % path);
+        state.drain();
+        fdGCLock = -1;
+        fds.clear();
 
-        state.results.bytesFreed += st.st_blocks * 512ULL;
+        if (state.moveToTrash) {
+            deleteGarbage(state, trashDir);
+            state.bytesInvalidated = 0;
+            createDirs(trashDir);
+        }
+
+        fdGCLock = openGCLock(ltWrite);
+
+        /* Find the roots that appeared since the last slice.  Runtime
+           roots are not rescanned, since a process can only get hold
+           of a dead path by adding a temporary root for it first. */
+        Roots rootMap, tempRoots;
+        findRoots(stateDir + "/" + gcRootsDir, DT_UNKNOWN, rootMap);
+        findRoots(stateDir + "/profiles", DT_UNKNOWN, rootMap);
+        findTempRoots(fds, tempRoots, true);
+
+        state.tempRoots.clear();
+        for (auto & root : tempRoots) {
+            state.tempRoots.insert(root.first);
+            rootMap.emplace(root.first, root.second);
+        }
+
+        for (auto & root : rootMap)
+            if (state.roots.insert(root.first).second)
+                markAlive(state, root.first);
+
+        auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(settings.gcSliceTime);
+
+        do {
+            tryToDelete(state, *next++);
+        } while (next != candidates.end() && std::chrono::steady_clock::now() < deadline);
     }
+}
 
-    struct stat st;
-    if (stat(linksDir.c_str(), &st) == -1)
-        throw SysError(format("statting '%1%'") % linksDir);
-    long long overhead = st.st_blocks * 512ULL;
 
-    printInfo(format("note: currently hard linking saves %.2f MiB")
-        % ((unsharedSize - actualSize - overhead) / (1024.0 * 1024.0)));
+/* Unlink the files in /nix/store/.links that have a link count of 1,
+   which indicates that there are no other links and so they can be
+   safely deleted.  Only the links of files that we deleted can have
+   become unused, so look those up in the Links table rather than
+   reading the links directory.  FIXME: race condition with
+   optimisePath(): we might see a link count of 1 just before
+   optimisePath() increases the link count. */
+void LocalStore::removeUnusedLinks(GCState & state)
+{
+    auto inodes(std::move(*state.deleted.linkedInodes.lock()));
+
+    debug("checking the links of %d deleted files", inodes.size());
+
+    for (auto inode : inodes) {
+        for (auto & hash : queryLinks(inode)) {
+            checkInterrupt();
+            Path path = linksDir + "/" + hash;
+
+            struct stat st;
+            if (lstat(path.c_str(), &st) == -1) {
+                if (errno != ENOENT)
+                    throw SysError(format("statting '%1%'") % path);
+                removeLink(hash);
+                continue;
+            }
+
+            if (st.st_ino != inode || st.st_nlink != 1) continue;
+
+            printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
+
+            if (unlink(path.c_str()) == -1)
+                throw SysError(format("deleting '%1%'") % path);
+            removeLink(hash);
+
+            state.results.bytesFreed += st.st_blocks * 512ULL;
+        }
+    }
 }
 
 
@@ -731,8 +1063,12 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     state.shouldDelete = options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific;
 
-    if (state.shouldDelete)
+    if (state.shouldDelete) {
         deletePath(reservedPath);
+        state.storeFd = open(realStoreDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (!state.storeFd)
+            throw SysError(format("opening directory '%1%'") % realStoreDir);
+    }
 
     /* Acquire the global GC root.  This prevents
        a) New roots from being added.
@@ -762,6 +1098,12 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
        increase, since we hold locks on everything.  So everything
        that is not reachable from `roots' is garbage. */
 
+    /* Since no new temporary roots can appear, paths registered from
+       now on can only refer to paths that are already alive, so a
+       snapshot of the reference graph suffices.  Don't build one just
+       to delete a few specific paths, though. */
+    state.graph = getRefsGraph(options.action != GCOptions::gcDeleteSpecific);
+
     if (state.shouldDelete) {
         if (pathExists(trashDir)) deleteGarbage(state, trashDir);
         try {
@@ -777,17 +1119,26 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
     /* Now either delete all garbage paths, or just the specified
        paths (for gcDeleteSpecific). */
 
+    auto startTime = std::chrono::steady_clock::now();
+
+    bool incremental = settings.gcIncremental && options.action == GCOptions::gcDeleteDead;
+
     if (options.action == GCOptions::gcDeleteSpecific) {
 
         for (auto & i : options.pathsToDelete) {
             assertStorePath(i);
             tryToDelete(state, i);
-            if (state.dead.find(i) == state.dead.end())
+            auto id = state.paths.lookup(i);
+            if (!id || !state.dead.count(*id))
                 throw Error(format("cannot delete path '%1%' since it is still alive") % i);
         }
 
     } else if (options.maxFreed > 0) {
 
+        /* In incremental mode, only determine the dead paths while
+           holding the GC lock, and delete them afterwards. */
+        if (incremental) state.shouldDelete = false;
+
         if (state.shouldDelete)
             printError(format("deleting garbage..."));
         else
@@ -805,6 +1156,7 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                again.  We don't use readDirectory() here so that GCing
                can start faster. */
             Paths entries;
+            std::vector<Path> candidates;
             struct dirent * dirent;
             while (errno = 0, dirent = readdir(dir.get())) {
                 checkInterrupt();
@@ -813,8 +1165,10 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
                 Path path = storeDir + "/" + name;
                 if (isStorePath(path) && isValidPath(path))
                     entries.push_back(path);
-                else
+                else {
                     tryToDelete(state, path);
+                    if (incremental) candidates.push_back(path);
+                }
             }
 
             dir.reset();
@@ -831,28 +1185,48 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
             for (auto & i : entries_)
                 tryToDelete(state, i);
 
+            if (incremental) {
+                candidates.insert(candidates.end(), entries_.begin(), entries_.end());
+                printError(format("deleting garbage incrementally..."));
+                deleteGarbageIncremental(state, candidates, fdGCLock, fds);
+            }
+
         } catch (GCLimitReached & e) {
         }
     }
 
     if (state.options.action == GCOptions::gcReturnLive) {
-        state.results.paths = state.alive;
+        for (auto id : state.alive)
+            state.results.paths.insert(state.paths[id]);
         return;
     }
 
     if (state.options.action == GCOptions::gcReturnDead) {
-        state.results.paths = state.dead;
+        for (auto id : state.dead)
+            state.results.paths.insert(state.paths[id]);
         return;
     }
 
-    /* Allow other processes to add to the store from here on. */
+    /* Wait for the paths we deleted to be gone from the store
+       directory, then allow other processes to add to the store from
+       here on. */
+    state.drain();
     fdGCLock = -1;
     fds.clear();
 
+    /* Invalidated paths make the reference graph image stale, which
+       disables it for queries, so bring it up to date now. */
+    if ((state.graph || incremental) && !state.results.paths.empty())
+        getRefsGraph();
+
     /* Delete the trash directory. */
     printInfo(format("deleting '%1%'") % trashDir);
     deleteGarbage(state, trashDir);
 
+    results.filesDeleted = state.deleted.filesDeleted;
+    results.deletionTime = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - startTime).count();
+
     /* Clean up the links directory. */
     if (options.action == GCOptions::gcDeleteDead || options.action == GCOptions::gcDeleteSpecific) {
         printError(format("deleting unused links..."));
@@ -864,6 +1238,129 @@ void LocalStore::collectGarbage(const GCOptions & options, GCResults & results)
 }
 
 
+GCPlan LocalStore::planGarbage(bool censor)
+{
+    GCPlan plan;
+
+    /* The graph of the valid paths under the edges that keep paths
+       alive: references, and the keep-outputs and keep-derivations
+       edges followed by canReachRoot(). It's read with a few bulk
+       queries rather than a query per path. */
+    struct Graph
+    {
+        PathTable paths;
+        std::vector<uint64_t> narSizes;
+        std::vector<std::vector<PathTable::Id>> edges;
+    };
+
+    /* Scan the database through a connection of our own rather than
+       state->db, so that other operations on this store (e.g. those
+       of other clients of the same daemon worker) aren't held up for
+       the duration of the scan. */
+    SQLite db;
+    Path dbPath = dbDir + "/db.sqlite";
+    if (sqlite3_open_v2(dbPath.c_str(), &db.db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK)
+        throw Error("cannot open Nix database '%s' for reading", dbPath);
+    db.setBusyTimeout(settings.sqliteBusyTimeout);
+
+    auto graph = retrySQLite<std::unique_ptr<Graph>>([&]() {
+        auto graph = std::make_unique<Graph>();
+        SQLiteTxn txn(db);
+
+        std::unordered_map<int64_t, PathTable::Id> ids;
+        std::vector<Path> derivers;
+
+        SQLiteStmt queryPaths(db, "select id, path, narSize, deriver from ValidPaths");
+        auto usePaths(queryPaths.use());
+        while (usePaths.next()) {
+            ids[usePaths.getInt(0)] = graph->paths.intern(usePaths.getStr(1));
+            graph->narSizes.push_back(usePaths.isNull(2) ? 0 : usePaths.getInt(2));
+            derivers.push_back(usePaths.isNull(3) ? "" : usePaths.getStr(3));
+        }
+
+        graph->edges.resize(graph->paths.size());
+
+        SQLiteStmt queryRefs(db, "select referrer, reference from Refs where referrer != reference");
+        auto useRefs(queryRefs.use());
+        while (useRefs.next())
+            graph->edges[ids.at(useRefs.getInt(0))].push_back(ids.at(useRefs.getInt(1)));
+
+        SQLiteStmt queryOutputs(db, "select drv, path from DerivationOutputs");
+        auto useOutputs(queryOutputs.use());
+        while (useOutputs.next()) {
+            auto drv = ids.at(useOutputs.getInt(0));
+            auto output = graph->paths.lookup(useOutputs.getStr(1));
+            if (!output || *output == drv) continue;
+            if (settings.gcKeepOutputs)
+                graph->edges[drv].push_back(*output);
+            if (settings.gcKeepDerivations && derivers[*output] == graph->paths[drv])
+                graph->edges[*output].push_back(drv);
+        }
+
+        txn.commit();
+        return graph;
+    });
+
+    /* Find the roots, including the temporary roots of running
+       processes, only now. A process adds a temporary root for a path
+       before it registers the path, so every path in the graph that
+       is in use by then is kept alive by a root. (Roots found before
+       reading the graph would miss the paths registered in between,
+       which the plan would then wrongly list as dead.) */
+    Roots rootMap = findRoots(censor);
+
+    /* Determine for each path which root keeps it alive: none (it's
+       garbage), exactly one, or several. Every path changes its owner
+       at most twice (from none to a root, and from a root to
+       several), so this is linear in the size of the graph. */
+    const uint32_t noRoot = std::numeric_limits<uint32_t>::max(), severalRoots = noRoot - 1;
+
+    std::vector<uint32_t> owner(graph->paths.size(), noRoot);
+    std::vector<Path> rootPaths;
+    std::vector<PathTable::Id> todo;
+
+    auto setOwner = [&](PathTable::Id id, uint32_t root) {
+        auto & o(owner[id]);
+        if (o == root || o == severalRoots) return;
+        o = o == noRoot ? root : severalRoots;
+        todo.push_back(id);
+    };
+
+    for (auto & [path, links] : rootMap) {
+        plan.roots[path].links = StringSet(links.begin(), links.end());
+        if (auto id = graph->paths.lookup(path)) {
+            setOwner(*id, rootPaths.size());
+            rootPaths.push_back(path);
+        }
+    }
+
+    while (!todo.empty()) {
+        checkInterrupt();
+        auto id = todo.back();
+        todo.pop_back();
+        for (auto next : graph->edges[id])
+            setOwner(next, owner[id]);
+    }
+
+    for (PathTable::Id id = 0; id < graph->paths.size(); ++id) {
+        auto narSize = graph->narSizes[id];
+        if (owner[id] == noRoot) {
+            plan.dead.emplace(graph->paths[id], narSize);
+            plan.deadSize += narSize;
+        } else {
+            plan.liveSize += narSize;
+            if (owner[id] != severalRoots)
+                plan.roots[rootPaths[owner[id]]].exclusiveSize += narSize;
+        }
+    }
+
+    for (auto & path : rootPaths)
+        plan.roots[path].closureSize = queryClosureSize(path).first;
+
+    return plan;
+}
+
+
 void LocalStore::autoGC(bool sync)
 {
     auto getAvail = [this]() {
@@ -90,12 +90,27 @@ public:
         "Maximum number of parallel build jobs. \"auto\" means use number of cores.",
         {"build-max-jobs"}};
 
+    Setting<unsigned int> maxSubstitutionJobs{this, 16, "max-substitution-jobs",
+        "Maximum number of substitutions to run in parallel. Unlike "
+        "builds, substitutions are mostly limited by the network, so "
+        "they don't count towards 'max-jobs'."};
+
     Setting<unsigned int> buildCores{this, getDefaultCores(), "cores",
         "Number of CPU cores to utilize in parallel within a build, "
         "i.e. by passing this number to Make via '-j'. 0 means that the "
         "number of actual CPU cores on the local host ought to be "
         "auto-detected.", {"build-cores"}};
 
+    Setting<unsigned int> maxLoadAverage{this, 0, "max-load-average",
+        "Don't start another local build while the one-minute load "
+        "average is at least this high. 0 means no limit."};
+
+    Setting<unsigned int> maxMemoryPressure{this, 0, "max-memory-pressure",
+        "Don't start another local build while the share of time in "
+        "which some tasks were stalled on memory over the last ten "
+        "seconds (Linux pressure stall information) is at least this "
+        "percentage. 0 means no limit."};
+
     /* Read-only mode.  Don't copy stuff to the store, don't change
        the database. */
     bool readOnlyMode = false;
@@ -124,6 +139,18 @@ public:
         "build dependencies if possible, rather than waiting for this host to "
         "upload them."};
 
+    Setting<unsigned int> sshControlPersist{this, 0, "ssh-control-persist",
+        "If non-zero, the SSH connections of SSH stores are multiplexed over "
+        "control sockets in the user's runtime directory that stay open for "
+        "this many seconds when idle, so that subsequent Nix commands "
+        "connecting to the same host can skip the SSH handshake."};
+
+    Setting<uint64_t> buildersUploadBandwidth{this, 10 * 1024 * 1024, "builders-upload-bandwidth",
+        "The expected upload bandwidth to build machines, in bytes per second. "
+        "When choosing a build machine, the time needed to upload the inputs it "
+        "doesn't have yet is added to its expected build time, so that machines "
+        "that already have most of the inputs are preferred. 0 disables this."};
+
     Setting<off_t> reservedSize{this, 8 * 1024 * 1024, "gc-reserved-space",
         "Amount of reserved disk space for the garbage collector."};
 
@@ -133,9 +160,31 @@ public:
     Setting<bool> useSQLiteWAL{this, true, "use-sqlite-wal",
         "Whether SQLite should use WAL mode."};
 
+    Setting<uint64_t> sqliteMmapSize{this, 0, "sqlite-mmap-size",
+        "Maximum number of bytes of the Nix database that SQLite may "
+        "access through memory-mapped I/O. 0 disables memory mapping."};
+
+    Setting<int64_t> sqliteCacheSize{this, 0, "sqlite-cache-size",
+        "Size of SQLite's page cache for the Nix database, in KiB. "
+        "0 means SQLite's default."};
+
+    Setting<unsigned long> sqliteBusyTimeout{this, 60 * 60 * 1000, "sqlite-busy-timeout",
+        "Number of milliseconds to wait for a lock on the Nix database "
+        "held by another process before retrying the transaction."};
+
     Setting<bool> syncBeforeRegistering{this, false, "sync-before-registering",
         "Whether to call sync() before registering a path as valid."};
 
+    Setting<unsigned int> importBatchSize{this, 256, "import-batch-size",
+        "Maximum number of paths that are unpacked in parallel and "
+        "registered in a single database transaction when copying or "
+        "importing a set of paths into the local store."};
+
+    Setting<uint64_t> copyBytesInFlight{this, 256 * 1024 * 1024, "copy-bytes-in-flight",
+        "Maximum total NAR size of the paths that are copied at the same time "
+        "when copying a set of paths between stores. A path that is larger "
+        "is copied when no other path is in flight."};
+
     Setting<bool> useSubstitutes{this, true, "substitute",
         "Whether to use substitutes.",
         {"build-use-substitutes"}};
@@ -155,6 +204,10 @@ public:
         "Whether to compress logs.",
         {"build-compress-log"}};
 
+    Setting<std::string> logCompression{this, "bzip2", "build-log-compression",
+        "The method used to compress build logs if 'compress-build-log' "
+        "is enabled: 'bzip2' or (if Nix was built with libzstd) 'zstd'."};
+
     Setting<unsigned long> maxLogSize{this, 0, "max-build-log-size",
         "Maximum number of bytes a builder can write to stdout/stderr "
         "before being killed (0 means no limit).",
@@ -165,6 +218,11 @@ public:
        stderr. Hack to prevent Hydra logs from being polluted. */
     bool printRepeatedBuilds = true;
 
+    Setting<uint64_t> prefetchBuildInputs{this, 0, "prefetch-build-inputs",
+        "If non-zero, read up to this many bytes of the input closure of "
+        "each local build into the page cache in the background while the "
+        "build environment is set up, most recently accessed files first."};
+
     Setting<unsigned int> pollInterval{this, 5, "build-poll-interval",
         "How often (in seconds) to poll for locks."};
 
@@ -180,9 +238,54 @@ public:
         "Whether the garbage collector should keep derivers of live paths.",
         {"gc-keep-derivations"}};
 
+    Setting<bool> gcIncremental{this, false, "gc-incremental",
+        "Whether the garbage collector should release the GC lock after "
+        "determining the garbage, and delete it in slices during which "
+        "it takes new roots into account."};
+
+    Setting<unsigned int> gcSliceTime{this, 1000, "gc-slice-time",
+        "Maximum time (in milliseconds) for which the incremental garbage "
+        "collector holds the GC lock while deleting paths."};
+
+    Setting<unsigned int> gcDeleteThreads{this, 0, "gc-delete-threads",
+        "Number of threads the garbage collector uses to delete paths. "
+        "0 means the number of CPUs."};
+
+    Setting<unsigned int> optimiseThreads{this, 0, "optimise-threads",
+        "Number of threads that nix-store --optimise uses to hash files. "
+        "0 means the number of CPUs."};
+
+    Setting<unsigned int> verifyInterval{this, 0, "verify-interval",
+        "If non-zero, nix-store --verify --check-contents skips paths "
+        "whose contents were verified less than this many days ago."};
+
+    Setting<bool> verifyTreeHash{this, false, "verify-tree-hash",
+        "Whether nix-store --verify --check-contents records a tree hash of "
+        "each path it has checked, and on later runs accepts a path as "
+        "unchanged if its tree hash still matches. Tree hashes are computed "
+        "on multiple threads even for a single large file."};
+
+    Setting<unsigned int> verifyThreads{this, 0, "verify-threads",
+        "Number of threads that nix-store --verify --check-contents uses "
+        "to hash paths. 0 means the number of CPUs."};
+
+    Setting<std::string> optimiseMethod{this, "hardlink", "optimise-method",
+        "How nix-store --optimise and auto-optimise-store deduplicate "
+        "identical files: 'hardlink' replaces them by hard links to a file "
+        "in /nix/store/.links; 'reflink' makes them share extents "
+        "(on file systems that support it, such as btrfs and XFS), so "
+        "that they keep their own inodes."};
+
     Setting<bool> autoOptimiseStore{this, false, "auto-optimise-store",
         "Whether to automatically replace files with identical contents with hard links."};
 
+    Setting<bool> restoreDedup{this, false, "restore-dedup",
+        "Whether to reuse identical files that are already in the store when "
+        "unpacking a NAR (e.g. when substituting), by hard-linking or "
+        "reflinking them (according to 'optimise-method') instead of "
+        "writing the file again. Only files known to 'nix-store --optimise' "
+        "or 'auto-optimise-store' are found."};
+
     Setting<bool> envKeepDerivations{this, false, "keep-env-derivations",
         "Whether to add derivations as a dependency of user environments "
         "(to prevent them from being GCed).",
@@ -217,12 +320,36 @@ public:
         "The number of times to repeat a build in order to verify determinism.",
         {"build-repeat"}};
 
+    Setting<bool> earlyCutoff{this, false, "early-cutoff",
+        "Whether to reuse the outputs of a previous build of an equivalent "
+        "derivation, i.e. one that differs only in the paths of inputs "
+        "with the same contents, instead of building the derivation. "
+        "The outputs are copied with their hash parts rewritten; "
+        "dependents of a changed derivation whose output turned out "
+        "identical are then not rebuilt."};
+
 #if __linux__
     Setting<std::string> sandboxShmSize{this, "50%", "sandbox-dev-shm-size",
         "The size of /dev/shm in the build sandbox."};
 
     Setting<Path> sandboxBuildDir{this, "/build", "sandbox-build-dir",
         "The build directory inside the sandbox."};
+
+    Setting<unsigned int> buildDirTmpfs{this, 0, "build-dir-tmpfs",
+        "If non-zero, put the build directory of each local build on a "
+        "tmpfs of its own, limited to this percentage of RAM. Derivations "
+        "that declare more scratch space (in MiB) in '__scratchHint' than "
+        "that are built on disk, as are all derivations if 'keep-failed' "
+        "is set. A build without '__scratchHint' holds back the whole "
+        "limit from the memory that other builds are admitted with. "
+        "Requires root."};
+
+    Setting<bool> useCgroups{this, false, "use-cgroups",
+        "Whether to run each sandboxed build in its own cgroup (v2) below "
+        "the cgroup of the Nix daemon, to record its resource usage and "
+        "reliably kill its processes. Memory and I/O usage are only "
+        "recorded if the memory and io controllers are enabled for the "
+        "children of the daemon's cgroup."};
 #endif
 
     Setting<PathSet> allowedImpureHostPrefixes{this, {}, "allowed-impure-host-deps",
@@ -257,6 +384,12 @@ public:
     Setting<unsigned int> tarballTtl{this, 60 * 60, "tarball-ttl",
         "How long downloaded files are considered up-to-date."};
 
+    Setting<Path> traceFile{this, "", "trace-file",
+        "If set, the 'nix' command writes the start and end of every "
+        "activity (such as builds, substitutions and downloads) to this "
+        "file in the Chrome trace event format, for viewing in Perfetto "
+        "or chrome://tracing."};
+
     Setting<bool> requireSigs{this, true, "require-sigs",
         "Whether to check that any non-content-addressed path added to the "
         "Nix store has a valid signature (that is, one signed using a key "
@@ -299,10 +432,52 @@ public:
         "The TTL in seconds for positive lookups in the disk cache i.e binary cache lookups that "
         "return a valid path result."};
 
+    Setting<unsigned int> ttlStaleNarInfoCache{this, 24 * 3600, "narinfo-cache-stale-ttl",
+        "How long in seconds after its positive TTL has expired a positive "
+        "lookup in the disk cache is still used. Such an entry is refreshed "
+        "in the background. Expired negative lookups are never used, since "
+        "they become wrong as soon as the path is uploaded."};
+
+    Setting<bool> drvHashCache{this, true, "derivation-hash-cache",
+        "Whether to cache the hashes used to compute the output paths of "
+        "derivations in ~/.cache/nix, so that evaluations don't need to "
+        "read and hash the input derivations that are already in the store."};
+
+    Setting<bool> shellEnvCache{this, false, "nix-shell-env-cache",
+        "Whether nix-shell saves the variables and functions defined by "
+        "$stdenv/setup in ~/.cache/nix/shell-env and restores them from "
+        "there when it's started again for the same derivation, rather than "
+        "running the setup script every time."};
+
+    Setting<size_t> derivationCacheSize{this, 4096, "derivation-cache-size",
+        "The number of parsed derivations to keep in memory, so that "
+        "derivations read repeatedly (e.g. while computing output paths "
+        "or building) are only parsed once."};
+
     /* ?Who we trust to use the daemon in safe ways */
     Setting<Strings> allowedUsers{this, {"*"}, "allowed-users",
         "Which users or groups are allowed to connect to the daemon."};
 
+    Setting<bool> daemonThreads{this, false, "daemon-threads",
+        "Whether the daemon serves connections in threads of a single process "
+        "that share one store, rather than in a process per connection. A "
+        "connection is moved to a process of its own when it performs an "
+        "operation other than a query, such as a build."};
+
+    Setting<unsigned int> daemonMaxThreads{this, 64, "daemon-max-threads",
+        "With 'daemon-threads', the maximum number of connections that the "
+        "daemon serves in threads at the same time. Connections beyond this "
+        "number are served in processes of their own."};
+
+    Setting<unsigned int> daemonMetricsPort{this, 0, "daemon-metrics-port",
+        "If non-zero, the daemon serves metrics in the Prometheus text format "
+        "over HTTP on this port of the loopback interface."};
+
+    Setting<unsigned int> narInfoRefreshInterval{this, 3600, "narinfo-refresh-interval",
+        "If non-zero, the daemon refreshes the positive lookups in the disk cache "
+        "of its substituters that were used in the last day and that expire "
+        "within twice this many seconds, every this many seconds."};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -31,6 +31,8 @@ public:
         if (cacheUri.back() == '/')
             cacheUri.pop_back();
 
+        asyncGetFile = true;
+
         diskCache = getNarInfoDiskCache();
     }
 
@@ -39,6 +41,15 @@ public:
         return cacheUri;
     }
 
+    const Stats & getStats() override
+    {
+        auto hosts = getDownloader()->getHostStats();
+        auto i = hosts.find(downloadHost(cacheUri));
+        if (i != hosts.end())
+            *stats.downloadHostStats.lock() = i->second;
+        return BinaryCacheStore::getStats();
+    }
+
     void init() override
     {
         // FIXME: do this lazily?
@@ -110,9 +121,26 @@ protected:
         }
     }
 
+    void upsertFileFromPath(const std::string & path,
+        const Path & srcPath,
+        const std::string & mimeType) override
+    {
+        auto req = DownloadRequest(cacheUri + "/" + path);
+        req.dataFile = srcPath;
+        req.mimeType = mimeType;
+        try {
+            getDownloader()->download(req);
+        } catch (DownloadError & e) {
+            throw UploadToHTTP("while uploading to HTTP binary cache at '%s': %s", cacheUri, e.msg());
+        }
+    }
+
     DownloadRequest makeRequest(const std::string & path)
     {
         DownloadRequest request(cacheUri + "/" + path);
+        if (request.priority == DownloadPriority::Metadata
+            && (hasPrefix(path, "nar/") || hasPrefix(path, "chunks/") || hasPrefix(path, "log/")))
+            request.priority = DownloadPriority::Bulk;
         return request;
     }
 
@@ -130,6 +158,27 @@ protected:
         }
     }
 
+    std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override
+    {
+        if (!length) return "";
+        checkEnabled();
+        auto request(makeRequest(path));
+        request.rangeStart = offset;
+        request.rangeEnd = offset + length;
+        try {
+            auto data = getDownloader()->download(request).data;
+            if (data->size() != length)
+                throw Error("got a truncated range of file '%s' in binary cache '%s'", path, getUri());
+            return *data;
+        } catch (DownloadError & e) {
+            if (e.error == Downloader::NotFound || e.error == Downloader::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            maybeDisable();
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         Callback<std::shared_ptr<std::string>> callback) override
     {
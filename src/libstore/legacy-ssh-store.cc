@@ -1,4 +1,5 @@
 #include "archive.hh"
+#include "compression.hh"
 #include "pool.hh"
 #include "remote-store.hh"
 #include "serve-protocol.hh"
@@ -16,8 +17,11 @@ struct LegacySSHStore : public Store
     const Setting<int> maxConnections{this, 1, "max-connections", "maximum number of concurrent SSH connections"};
     const Setting<Path> sshKey{this, "", "ssh-key", "path to an SSH private key"};
     const Setting<bool> compress{this, false, "compress", "whether to compress the connection"};
+    const Setting<std::string> narCompression{this, "", "nar-compression", "compression method for NARs sent over the connection, e.g. 'zstd', if the remote side supports it"};
     const Setting<Path> remoteProgram{this, "nix-store", "remote-program", "path to the nix-store executable on the remote system"};
     const Setting<std::string> remoteStore{this, "", "remote-store", "URI of the store on the remote system"};
+    const Setting<Path> controlPath{this, "", "control-path", "path of an SSH control socket to share with other processes"};
+    const Setting<unsigned int> controlPersist{this, 600, "control-persist", "number of seconds the shared SSH connection stays open when idle (0 to not share it)"};
 
     // Hack for getting remote build log output.
     const Setting<int> logFD{this, -1, "log-fd", "file descriptor to which SSH's stderr is connected"};
@@ -29,6 +33,8 @@ struct LegacySSHStore : public Store
         FdSource from;
         int remoteVersion;
         bool good = true;
+        /* The NAR compression method that the remote side agreed to. */
+        std::string narCompression;
     };
 
     std::string host;
@@ -51,7 +57,9 @@ struct LegacySSHStore : public Store
             // Use SSH master only if using more than 1 connection.
             connections->capacity() > 1,
             compress,
-            logFD)
+            logFD,
+            controlPersist ? controlPath.get() : "",
+            controlPersist)
     {
     }
 
@@ -75,6 +83,17 @@ struct LegacySSHStore : public Store
             if (GET_PROTOCOL_MAJOR(conn->remoteVersion) != 0x200)
                 throw Error("unsupported 'nix-store --serve' protocol version on '%s'", host);
 
+            if (narCompression.get() != "" && narCompression.get() != "none") {
+                if (GET_PROTOCOL_MINOR(conn->remoteVersion) >= 6) {
+                    conn->to << cmdSetNarCompression << narCompression.get();
+                    conn->to.flush();
+                    if (readInt(conn->from))
+                        conn->narCompression = narCompression;
+                }
+                if (conn->narCompression.empty())
+                    debug("'%s' doesn't support NAR compression method '%s'", host, narCompression);
+            }
+
         } catch (EndOfFile & e) {
             throw Error("cannot connect to '%1%'", host);
         }
@@ -145,7 +164,12 @@ struct LegacySSHStore : public Store
                 << info.sigs
                 << info.ca;
             try {
-                copyNAR(source, conn->to);
+                if (conn->narCompression.empty())
+                    copyNAR(source, conn->to);
+                else
+                    writeCompressedFrames(conn->narCompression, conn->to, [&](Sink & sink) {
+                        copyNAR(source, sink);
+                    });
             } catch (...) {
                 conn->good = false;
                 throw;
@@ -184,7 +208,10 @@ struct LegacySSHStore : public Store
 
         conn->to << cmdDumpStorePath << path;
         conn->to.flush();
-        copyNAR(conn->from, sink);
+        if (conn->narCompression.empty())
+            copyNAR(conn->from, sink);
+        else
+            readCompressedFrames(conn->narCompression, conn->from, sink);
     }
 
     Path queryPathFromHashPart(const string & hashPart) override
@@ -2,6 +2,12 @@
 #include "globals.hh"
 #include "nar-info-disk-cache.hh"
 
+#include <fcntl.h>
+
+#if __linux__
+#include <sys/syscall.h>
+#endif
+
 namespace nix {
 
 class LocalBinaryCacheStore : public BinaryCacheStore
@@ -34,15 +40,14 @@ protected:
         const std::string & data,
         const std::string & mimeType) override;
 
-    void getFile(const std::string & path, Sink & sink) override
-    {
-        try {
-            readFile(binaryCacheDir + "/" + path, sink);
-        } catch (SysError & e) {
-            if (e.errNo == ENOENT)
-                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
-        }
-    }
+    void upsertFileFromPath(const std::string & path,
+        const Path & srcPath,
+        const std::string & mimeType) override;
+
+    void getFile(const std::string & path, Sink & sink) override;
+
+    std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override;
 
     PathSet queryAllValidPaths() override
     {
@@ -76,6 +81,68 @@ static void atomicWrite(const Path & path, const std::string & s)
     del.cancel();
 }
 
+void LocalBinaryCacheStore::getFile(const std::string & path, Sink & sink)
+{
+    Path fileName = binaryCacheDir + "/" + path;
+
+    AutoCloseFD fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        if (errno == ENOENT)
+            throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+        throw SysError("opening file '%s'", fileName);
+    }
+
+    /* Read the file in large pieces to keep the number of read()
+       calls and sink invocations low. (We don't map the file, since
+       accessing the mapping would crash with SIGBUS if the file were
+       truncated concurrently, e.g. by a garbage collector of the
+       cache.) */
+#ifdef POSIX_FADV_SEQUENTIAL
+    posix_fadvise(fd.get(), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    std::vector<unsigned char> buf(1 << 20);
+    while (true) {
+        checkInterrupt();
+        auto n = read(fd.get(), buf.data(), buf.size());
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading file '%s'", fileName);
+        }
+        if (n == 0) break;
+        sink(buf.data(), n);
+    }
+}
+
+std::string LocalBinaryCacheStore::getFileRange(const std::string & path,
+    uint64_t offset, uint64_t length)
+{
+    Path fileName = binaryCacheDir + "/" + path;
+
+    AutoCloseFD fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) {
+        if (errno == ENOENT)
+            throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+        throw SysError("opening file '%s'", fileName);
+    }
+
+    std::string buf(length, 0);
+    size_t done = 0;
+    while (done < length) {
+        checkInterrupt();
+        auto n = pread(fd.get(), &buf[done], length - done, offset + done);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("reading file '%s'", fileName);
+        }
+        if (n == 0)
+            throw Error("range %d-%d is outside of file '%s'", offset, offset + length, fileName);
+        done += n;
+    }
+
+    return buf;
+}
+
 bool LocalBinaryCacheStore::fileExists(const std::string & path)
 {
     return pathExists(binaryCacheDir + "/" + path);
@@ -88,6 +155,60 @@ void LocalBinaryCacheStore::upsertFile(const std::string & path,
     atomicWrite(binaryCacheDir + "/" + path, data);
 }
 
+/* Copy the contents of `srcFd' to a new file `dstPath', letting the
+   kernel do the copying if possible. (This is only used when the
+   source is on another file system, so cloning the file with FICLONE
+   isn't an option.) */
+static void copyFile(int srcFd, const Path & dstPath)
+{
+    AutoCloseFD dstFd = open(dstPath.c_str(), O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, 0666);
+    if (!dstFd) throw SysError("creating file '%s'", dstPath);
+
+#ifdef SYS_copy_file_range
+    bool copied = false;
+    while (true) {
+        auto n = syscall(SYS_copy_file_range, srcFd, nullptr, dstFd.get(), nullptr, 1 << 30, 0);
+        if (n == 0) return;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* Not supported for these files; copy them ourselves if
+               nothing has been copied yet. */
+            if ((errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP)
+                && !copied)
+                break;
+            throw SysError("copying to '%s'", dstPath);
+        }
+        copied = true;
+    }
+#endif
+
+    FdSink sink(dstFd.get());
+    drainFD(srcFd, sink);
+    sink.flush();
+}
+
+void LocalBinaryCacheStore::upsertFileFromPath(const std::string & path,
+    const Path & srcPath,
+    const std::string & mimeType)
+{
+    Path dstPath = binaryCacheDir + "/" + path;
+
+    /* Move the file into place if it's on the same file system,
+       otherwise copy it. */
+    if (rename(srcPath.c_str(), dstPath.c_str()) == 0) return;
+    if (errno != EXDEV)
+        throw SysError(format("renaming '%1%' to '%2%'") % srcPath % dstPath);
+
+    Path tmp = dstPath + ".tmp." + std::to_string(getpid());
+    AutoDelete del(tmp, false);
+    AutoCloseFD fd = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError(format("opening '%1%'") % srcPath);
+    copyFile(fd.get(), tmp);
+    if (rename(tmp.c_str(), dstPath.c_str()))
+        throw SysError(format("renaming '%1%' to '%2%'") % tmp % dstPath);
+    del.cancel();
+}
+
 static RegisterStoreImplementation regStore([](
     const std::string & uri, const Store::Params & params)
     -> std::shared_ptr<Store>
@@ -0,0 +1,139 @@
+#include "local-db-reader.hh"
+#include "local-store.hh"
+
+#include <sqlite3.h>
+
+namespace nix {
+
+
+LocalDBReader::LocalDBReader(const Path & stateDir)
+    : dbDir(stateDir + "/db")
+{
+    /* A daemon running a different version may have a different
+       schema, so only use a database in the schema we know. */
+    auto schema = trim(readFile(dbDir + "/schema"));
+    int curSchema;
+    if (!string2Int(schema, curSchema) || curSchema != nixSchemaVersion)
+        throw Error("Nix database '%s' has schema version '%s', but I need version %d",
+            dbDir, schema, nixSchemaVersion);
+
+    auto state(_state.lock());
+
+    Path dbPath = dbDir + "/db.sqlite";
+    if (sqlite3_open_v2(dbPath.c_str(), &state->db.db, SQLITE_OPEN_READONLY, 0) != SQLITE_OK)
+        throw Error("cannot open Nix database '%s' for reading", dbPath);
+
+    state->db.setBusyTimeout(settings.sqliteBusyTimeout);
+
+    /* Reading a database in WAL mode may require access to its
+       shared-memory file, so find out now whether we can. */
+    SQLiteStmt(state->db, "select 1 from ValidPaths limit 1;").use().next();
+
+    state->stmtQueryPathInfo.create(state->db,
+        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+    state->stmtQueryReferences.create(state->db,
+        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+    state->stmtQueryReferrers.create(state->db,
+        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+    state->stmtQueryValidDerivers.create(state->db,
+        "select v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
+    state->stmtQueryDerivationOutputs.create(state->db,
+        "select d.id, d.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where v.path = ?;");
+    state->stmtQueryPathFromHashPart.create(state->db,
+        "select path from ValidPaths where hashPart = ?;");
+}
+
+
+std::shared_ptr<ValidPathInfo> LocalDBReader::queryPathInfo(const Path & path)
+{
+    return retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() -> std::shared_ptr<ValidPathInfo> {
+        auto state(_state.lock());
+
+        auto useQueryPathInfo(state->stmtQueryPathInfo.use()(path));
+
+        if (!useQueryPathInfo.next()) return nullptr;
+
+        auto info = std::make_shared<ValidPathInfo>();
+        info->path = path;
+        info->id = useQueryPathInfo.getInt(0);
+
+        try {
+            info->narHash = Hash(useQueryPathInfo.getStr(1));
+        } catch (BadHash & e) {
+            throw Error("in valid-path entry for '%s': %s", path, e.what());
+        }
+
+        info->registrationTime = useQueryPathInfo.getInt(2);
+        if (!useQueryPathInfo.isNull(3)) info->deriver = useQueryPathInfo.getStr(3);
+        info->narSize = useQueryPathInfo.getInt(4);
+        info->ultimate = useQueryPathInfo.getInt(5) == 1;
+        if (!useQueryPathInfo.isNull(6))
+            info->sigs = tokenizeString<StringSet>(useQueryPathInfo.getStr(6), " ");
+        if (!useQueryPathInfo.isNull(7)) info->ca = useQueryPathInfo.getStr(7);
+
+        auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
+        while (useQueryReferences.next())
+            info->references.insert(useQueryReferences.getStr(0));
+
+        return info;
+    });
+}
+
+
+bool LocalDBReader::isValidPath(const Path & path)
+{
+    return retrySQLite<bool>([&]() {
+        auto state(_state.lock());
+        return state->stmtQueryPathInfo.use()(path).next();
+    });
+}
+
+
+void LocalDBReader::queryReferrers(const Path & path, PathSet & referrers)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmtQueryReferrers.use()(path));
+        while (use.next())
+            referrers.insert(use.getStr(0));
+    });
+}
+
+
+PathSet LocalDBReader::queryValidDerivers(const Path & path)
+{
+    return retrySQLite<PathSet>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmtQueryValidDerivers.use()(path));
+        PathSet derivers;
+        while (use.next())
+            derivers.insert(use.getStr(0));
+        return derivers;
+    });
+}
+
+
+std::map<string, Path> LocalDBReader::queryDerivationOutputs(const Path & path)
+{
+    return retrySQLite<std::map<string, Path>>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmtQueryDerivationOutputs.use()(path));
+        std::map<string, Path> outputs;
+        while (use.next())
+            outputs.emplace(use.getStr(0), use.getStr(1));
+        return outputs;
+    });
+}
+
+
+Path LocalDBReader::queryPathFromHashPart(const string & hashPart)
+{
+    return retrySQLite<Path>([&]() -> Path {
+        auto state(_state.lock());
+        auto use(state->stmtQueryPathFromHashPart.use()(hashPart));
+        return use.next() ? use.getStr(0) : "";
+    });
+}
+
+
+}
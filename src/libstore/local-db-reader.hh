@@ -0,0 +1,53 @@
+#pragma once
+
+#include "sqlite.hh"
+#include "sync.hh"
+#include "store-api.hh"
+
+namespace nix {
+
+/* Read-only access to the database of a local store that we can't
+   write to, e.g. the store of a multi-user installation, which is
+   owned by the daemon. This saves a round trip to the daemon for
+   queries about path metadata. */
+class LocalDBReader
+{
+    const Path dbDir;
+
+    struct State
+    {
+        SQLite db;
+        SQLiteStmt stmtQueryPathInfo;
+        SQLiteStmt stmtQueryReferences;
+        SQLiteStmt stmtQueryReferrers;
+        SQLiteStmt stmtQueryValidDerivers;
+        SQLiteStmt stmtQueryDerivationOutputs;
+        SQLiteStmt stmtQueryPathFromHashPart;
+    };
+
+    Sync<State> _state;
+
+public:
+
+    /* Open the database in `stateDir'. Throws an exception if it
+       doesn't exist, isn't readable or has a schema that we don't
+       know. */
+    LocalDBReader(const Path & stateDir);
+
+    std::shared_ptr<ValidPathInfo> queryPathInfo(const Path & path);
+
+    bool isValidPath(const Path & path);
+
+    void queryReferrers(const Path & path, PathSet & referrers);
+
+    PathSet queryValidDerivers(const Path & path);
+
+    /* Return the outputs of a derivation as a map from output names
+       to paths. */
+    std::map<string, Path> queryDerivationOutputs(const Path & path);
+
+    /* Return the valid path with the given hash part, or "". */
+    Path queryPathFromHashPart(const string & hashPart);
+};
+
+}
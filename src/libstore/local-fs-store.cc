@@ -5,6 +5,8 @@
 #include "compression.hh"
 #include "derivations.hh"
 
+#include <fcntl.h>
+
 namespace nix {
 
 LocalFSStore::LocalFSStore(const Params & params)
@@ -81,14 +83,22 @@ void LocalFSStore::narFromPath(const Path & path, Sink & sink)
 {
     if (!isValidPath(path))
         throw Error(format("path '%s' is not valid") % path);
-    dumpPath(getRealStoreDir() + std::string(path, storeDir.size()), sink);
+    dumpPathParallel(getRealStoreDir() + std::string(path, storeDir.size()), sink);
 }
 
 const string LocalFSStore::drvsLogDir = "drvs";
 
 
 
-std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path_)
+std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path)
+{
+    StringSink sink;
+    if (!readBuildLog(path, sink)) return nullptr;
+    return sink.s;
+}
+
+
+bool LocalFSStore::readBuildLog(const Path & path_, Sink & sink)
 {
     auto path(path_);
 
@@ -99,9 +109,9 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path_)
         try {
             path = queryPathInfo(path)->deriver;
         } catch (InvalidPath &) {
-            return nullptr;
+            return false;
         }
-        if (path == "") return nullptr;
+        if (path == "") return false;
     }
 
     string baseName = baseNameOf(path);
@@ -112,20 +122,35 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path_)
             j == 0
             ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, string(baseName, 0, 2), string(baseName, 2))
             : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
-        Path logBz2Path = logPath + ".bz2";
-
-        if (pathExists(logPath))
-            return std::make_shared<std::string>(readFile(logPath));
 
-        else if (pathExists(logBz2Path)) {
-            try {
-                return decompress("bzip2", readFile(logBz2Path));
-            } catch (Error &) { }
+        for (auto & method : {"none", "bzip2", "zstd"}) {
+            auto fileName = logPath + (
+                method == string("bzip2") ? ".bz2" :
+                method == string("zstd") ? ".zst" : "");
+
+            AutoCloseFD fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!fd) continue;
+
+            /* Decompress the log as we read it. */
+            auto decompressor = makeDecompressionSink(method, sink);
+            std::vector<unsigned char> buf(65536);
+            while (true) {
+                checkInterrupt();
+                auto n = read(fd.get(), buf.data(), buf.size());
+                if (n == -1) {
+                    if (errno == EINTR) continue;
+                    throw SysError("reading file '%s'", fileName);
+                }
+                if (n == 0) break;
+                (*decompressor)(buf.data(), n);
+            }
+            decompressor->finish();
+            return true;
         }
 
     }
 
-    return nullptr;
+    return false;
 }
 
 }
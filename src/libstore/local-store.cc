@@ -5,6 +5,8 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "nar-info.hh"
+#include "thread-pool.hh"
+#include "refs-graph.hh"
 
 #include <iostream>
 #include <algorithm>
@@ -53,6 +55,7 @@ LocalStore::LocalStore(const Params & params)
     , trashDir(realStoreDir + "/trash")
     , tempRootsDir(stateDir + "/temproots")
     , fnTempRoots(fmt("%s/%d", tempRootsDir, getpid()))
+    , substitutionLocksDir(stateDir + "/substitutions")
 {
     auto state(_state.lock());
 
@@ -63,6 +66,7 @@ LocalStore::LocalStore(const Params & params)
     Path profilesDir = stateDir + "/profiles";
     createDirs(profilesDir);
     createDirs(tempRootsDir);
+    createDirs(substitutionLocksDir);
     createDirs(dbDir);
     Path gcRootsDir = stateDir + "/gcroots";
     if (!pathExists(gcRootsDir)) {
@@ -205,6 +209,43 @@ LocalStore::LocalStore(const Params & params)
             txn.commit();
         }
 
+        /* Everything added since Nix 2.3 is done in one step, so
+           that these stores only have one schema version more. */
+        if (curSchema < 11) {
+            SQLiteTxn txn(state->db);
+
+            state->db.exec("alter table ValidPaths add column closureSize integer");
+            state->db.exec("alter table ValidPaths add column closureCount integer");
+            state->db.exec("alter table ValidPaths add column hashPart text");
+            state->db.exec(fmt("update ValidPaths set hashPart = substr(path, %d, %d)",
+                    storeDir.size() + 2, storePathHashLen));
+            state->db.exec("create index if not exists IndexHashPart on ValidPaths(hashPart)");
+            state->db.exec("alter table ValidPaths add column lastVerified integer");
+            state->db.exec("alter table ValidPaths add column treeHash text");
+            state->db.exec("alter table ValidPaths add column contentHash text");
+            state->db.exec("create table if not exists DedupSources (hash text primary key not null, path text not null)");
+            state->db.exec("create table if not exists EquivalentOutputs (resolvedHash text not null, id text not null, path text not null, primary key (resolvedHash, id))");
+
+            /* Index the existing links.  This is the last time we
+               read the links directory. */
+            printError("indexing '%s'...", linksDir);
+            state->db.exec("create table if not exists Links (hash text primary key not null, inode integer not null)");
+            state->db.exec("create index if not exists IndexLinksInode on Links(inode)");
+            SQLiteStmt stmt(state->db, "insert or replace into Links (hash, inode) values (?, ?);");
+            AutoCloseDir dir(opendir(linksDir.c_str()));
+            if (!dir) throw SysError(format("opening directory '%1%'") % linksDir);
+            struct dirent * dirent;
+            while (errno = 0, dirent = readdir(dir.get())) {
+                checkInterrupt();
+                string name = dirent->d_name;
+                if (name == "." || name == "..") continue;
+                stmt.use()(name)((int64_t) dirent->d_ino).exec();
+            }
+            if (errno) throw SysError(format("reading directory '%1%'") % linksDir);
+
+            txn.commit();
+        }
+
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock.get(), ltRead, true);
@@ -214,7 +255,7 @@ LocalStore::LocalStore(const Params & params)
 
     /* Prepare SQL statements. */
     state->stmtRegisterValidPath.create(state->db,
-        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
+        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca, hashPart) values (?, ?, ?, ?, ?, ?, ?, ?, ?);");
     state->stmtUpdatePathInfo.create(state->db,
         "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
     state->stmtAddReference.create(state->db,
@@ -233,11 +274,63 @@ LocalStore::LocalStore(const Params & params)
         "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
     state->stmtQueryDerivationOutputs.create(state->db,
         "select id, path from DerivationOutputs where drv = ?;");
-    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
-    // ensure efficient lookup.
     state->stmtQueryPathFromHashPart.create(state->db,
-        "select path from ValidPaths where path >= ? limit 1;");
+        "select path from ValidPaths where hashPart = ?;");
     state->stmtQueryValidPaths.create(state->db, "select path from ValidPaths");
+
+    /* The start of closure queries. This is a temporary table, so it
+       lives outside of the database file, even in read-only mode. */
+    state->db.exec("create temp table if not exists ClosureRoots (id integer primary key not null)");
+    state->stmtClearClosureRoots.create(state->db,
+        "delete from temp.ClosureRoots;");
+    state->stmtAddClosureRoot.create(state->db,
+        "insert or ignore into temp.ClosureRoots (id) values (?);");
+    state->stmtQueryClosure.create(state->db,
+        "with recursive Closure(id) as (select id from temp.ClosureRoots union select reference from Refs join Closure on referrer = Closure.id) "
+        "select v.path, v.narSize from Closure c join ValidPaths v on v.id = c.id;");
+    state->stmtQueryReverseClosure.create(state->db,
+        "with recursive Closure(id) as (select id from temp.ClosureRoots union select referrer from Refs join Closure on reference = Closure.id) "
+        "select v.path, v.narSize from Closure c join ValidPaths v on v.id = c.id;");
+    state->stmtQueryClosureSize.create(state->db,
+        "select id, closureSize, closureCount from ValidPaths where path = ?;");
+    state->stmtSetClosureSize.create(state->db,
+        "update ValidPaths set closureSize = ?, closureCount = ? where id = ?;");
+    /* If the NAR size of a path changes, forget the cached closure
+       sizes of the paths that refer to it. */
+    state->stmtResetClosureSizes.create(state->db,
+        "with recursive Closure(id) as (select id from ValidPaths where path = ? and coalesce(narSize, 0) != ? union select referrer from Refs join Closure on reference = Closure.id) "
+        "update ValidPaths set closureSize = null, closureCount = null where id in Closure;");
+    /* Likewise for the paths in temp.ClosureRoots and their
+       referrers, if references are added to them. */
+    state->stmtResetClosureSize.create(state->db,
+        "with recursive Closure(id) as (select id from temp.ClosureRoots union select referrer from Refs join Closure on reference = Closure.id) "
+        "update ValidPaths set closureSize = null, closureCount = null where id in Closure;");
+    state->stmtAddLink.create(state->db,
+        "insert or replace into Links (hash, inode) values (?, ?);");
+    state->stmtRemoveLink.create(state->db,
+        "delete from Links where hash = ?;");
+    state->stmtQueryLinks.create(state->db,
+        "select hash from Links where inode = ?;");
+    state->stmtQueryDedupSource.create(state->db,
+        "select path from DedupSources where hash = ?;");
+    state->stmtSetDedupSource.create(state->db,
+        "insert or replace into DedupSources (hash, path) values (?, ?);");
+    state->stmtSetLastVerified.create(state->db,
+        "update ValidPaths set lastVerified = ? where path = ?;");
+    state->stmtQueryRecentlyVerified.create(state->db,
+        "select path from ValidPaths where lastVerified >= ?;");
+    state->stmtQueryTreeHash.create(state->db,
+        "select treeHash from ValidPaths where path = ?;");
+    state->stmtSetTreeHash.create(state->db,
+        "update ValidPaths set treeHash = ? where path = ?;");
+    state->stmtQueryContentHash.create(state->db,
+        "select contentHash from ValidPaths where path = ?;");
+    state->stmtSetContentHash.create(state->db,
+        "update ValidPaths set contentHash = ? where path = ?;");
+    state->stmtQueryEquivalentOutputs.create(state->db,
+        "select id, path from EquivalentOutputs where resolvedHash = ?;");
+    state->stmtAddEquivalentOutput.create(state->db,
+        "insert or replace into EquivalentOutputs (resolvedHash, id, path) values (?, ?, ?);");
 }
 
 
@@ -308,11 +401,18 @@ void LocalStore::openDB(State & state, bool create)
     SetDllDirectoryW(L"");
 #endif
 
-    if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
-        throwSQLiteError(db, "setting timeout");
+    db.setBusyTimeout(settings.sqliteBusyTimeout);
 
     db.exec("pragma foreign_keys = 1");
 
+    /* Memory-mapped I/O avoids copying pages from the OS page cache,
+       and a larger page cache avoids re-reading them at all; both
+       help with big stores and many concurrent readers. */
+    if (settings.sqliteMmapSize)
+        db.exec(fmt("pragma mmap_size = %d", settings.sqliteMmapSize.get()));
+    if (settings.sqliteCacheSize)
+        db.exec(fmt("pragma cache_size = %d", -settings.sqliteCacheSize.get()));
+
     /* !!! check whether sqlite has been built with foreign key
        support */
 
@@ -379,7 +479,11 @@ void LocalStore::makeStoreWritable()
 const time_t mtimeStore = 1; /* 1 second into the epoch */
 
 
-static void canonicaliseTimestampAndPermissions(const Path & path, const struct stat & st)
+/* Canonicalise the permissions and modification time of `name' in
+   the directory `dirFd', whose attributes are `st'.  `path' is only
+   used in error messages. */
+static void canonicaliseTimestampAndPermissions(int dirFd, const std::string & name,
+    const Path & path, const struct stat & st)
 {
     if (!S_ISLNK(st.st_mode)) {
 
@@ -387,28 +491,22 @@ static void canonicaliseTimestampAndPermissions(const Path & path, const struct
         mode_t mode = st.st_mode & ~S_IFMT;
 
         if (mode != 0444 && mode != 0555) {
-            mode = (st.st_mode & S_IFMT)
-                 | 0444
-                 | (st.st_mode & S_IXUSR ? 0111 : 0);
-            if (chmod(path.c_str(), mode) == -1)
+            mode = 0444 | (st.st_mode & S_IXUSR ? 0111 : 0);
+            if (fchmodat(dirFd, name.c_str(), mode, 0) == -1)
                 throw SysError(format("changing mode of '%1%' to %2$o") % path % mode);
         }
 
     }
 
     if (st.st_mtime != mtimeStore) {
-        struct timeval times[2];
-        times[0].tv_sec = st.st_atime;
-        times[0].tv_usec = 0;
+        struct timespec times[2];
+        times[0].tv_sec = 0;
+        times[0].tv_nsec = UTIME_OMIT;
         times[1].tv_sec = mtimeStore;
-        times[1].tv_usec = 0;
-#if HAVE_LUTIMES
-        if (lutimes(path.c_str(), times) == -1)
-            if (errno != ENOSYS ||
-                (!S_ISLNK(st.st_mode) && utimes(path.c_str(), times) == -1))
-#else
-        if (!S_ISLNK(st.st_mode) && utimes(path.c_str(), times) == -1)
-#endif
+        times[1].tv_nsec = 0;
+        if (utimensat(dirFd, name.c_str(), times, AT_SYMLINK_NOFOLLOW) == -1
+            /* Some file systems can't set the time of symlinks. */
+            && !(S_ISLNK(st.st_mode) && (errno == ENOSYS || errno == EOPNOTSUPP)))
             throw SysError(format("changing modification time of '%1%'") % path);
     }
 }
@@ -419,11 +517,48 @@ void canonicaliseTimestampAndPermissions(const Path & path)
     struct stat st;
     if (lstat(path.c_str(), &st))
         throw SysError(format("getting attributes of path '%1%'") % path);
-    canonicaliseTimestampAndPermissions(path, st);
+    canonicaliseTimestampAndPermissions(AT_FDCWD, path, path, st);
 }
 
 
-static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+/* The state shared by the work items of a canonicalisePathMetaData()
+   call. */
+struct CanonicaliseWalk
+{
+    uid_t fromUid;
+    Sync<InodesSeen> & inodesSeen;
+    ThreadPool & pool;
+    std::function<void()> onDone;
+
+    /* The number of directories that are still being processed. */
+    std::atomic<size_t> pending{1};
+
+    /* Every queued directory keeps its parent open, so beyond this
+       many, subdirectories are processed depth-first on the current
+       thread instead. This bounds the number of open file
+       descriptors by this limit plus the depth of the tree on each
+       worker, rather than by the width of the tree. */
+    static const size_t maxQueued = 64;
+
+    CanonicaliseWalk(uid_t fromUid, Sync<InodesSeen> & inodesSeen,
+        ThreadPool & pool, std::function<void()> onDone)
+        : fromUid(fromUid), inodesSeen(inodesSeen), pool(pool), onDone(onDone)
+    { }
+
+    void finishDir()
+    {
+        if (--pending == 0 && onDone) onDone();
+    }
+};
+
+
+/* Canonicalise `name' in the directory `dirFd'.  Subdirectories are
+   processed by work items in `walk->pool' (up to a limit), so that
+   large trees are canonicalised in parallel.  Everything is done relative to
+   directory file descriptors, so the kernel doesn't have to resolve
+   the full path of every entry. */
+static void canonicalisePathMetaData_(std::shared_ptr<CanonicaliseWalk> walk,
+    int dirFd, const std::string & name, const Path & path, unsigned char type)
 {
     checkInterrupt();
 
@@ -438,7 +573,7 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
 #endif
 
     struct stat st;
-    if (lstat(path.c_str(), &st))
+    if (fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW))
         throw SysError(format("getting attributes of path '%1%'") % path);
 
     /* Really make sure that the path is of a supported type. */
@@ -446,7 +581,8 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
         throw Error(format("file '%1%' has an unsupported type") % path);
 
 #if __linux__
-    /* Remove extended attributes / ACLs. */
+    /* Remove extended attributes / ACLs.  There are no fd-relative
+       variants of these calls. */
     ssize_t eaSize = llistxattr(path.c_str(), nullptr, 0);
 
     if (eaSize < 0) {
@@ -473,52 +609,66 @@ static void canonicalisePathMetaData_(const Path & path, uid_t fromUid, InodesSe
        hard-linked into the output (e.g. "ln /etc/shadow $out/foo").
        However, ignore files that we chown'ed ourselves previously to
        ensure that we don't fail on hard links within the same build
-       (i.e. "touch $out/foo; ln $out/foo $out/bar"). */
-    if (fromUid != (uid_t) -1 && st.st_uid != fromUid) {
+       (i.e. "touch $out/foo; ln $out/foo $out/bar").  Since the inode
+       is recorded before it is chown'ed, and chown'ing is the last
+       change, this also holds if the links are processed
+       concurrently. */
+    if (walk->fromUid != (uid_t) -1 && st.st_uid != walk->fromUid) {
         assert(!S_ISDIR(st.st_mode));
-        if (inodesSeen.find(Inode(st.st_dev, st.st_ino)) == inodesSeen.end())
+        if (!walk->inodesSeen.lock()->count(Inode(st.st_dev, st.st_ino)))
             throw BuildError(format("invalid ownership on file '%1%'") % path);
         mode_t mode = st.st_mode & ~S_IFMT;
         assert(S_ISLNK(st.st_mode) || (st.st_uid == geteuid() && (mode == 0444 || mode == 0555) && st.st_mtime == mtimeStore));
         return;
     }
 
-    inodesSeen.insert(Inode(st.st_dev, st.st_ino));
+    walk->inodesSeen.lock()->insert(Inode(st.st_dev, st.st_ino));
 
-    canonicaliseTimestampAndPermissions(path, st);
+    canonicaliseTimestampAndPermissions(dirFd, name, path, st);
 
-    /* Change ownership to the current uid.  If it's a symlink, use
-       lchown if available, otherwise don't bother.  Wrong ownership
-       of a symlink doesn't matter, since the owning user can't change
-       the symlink and can't delete it because the directory is not
-       writable.  The only exception is top-level paths in the Nix
-       store (since that directory is group-writable for the Nix build
-       users group); we check for this case below. */
+    /* Change ownership to the current uid.  Wrong ownership of a
+       symlink doesn't matter much, since the owning user can't
+       change the symlink and can't delete it because the directory is
+       not writable, but we change it anyway.  The only exception is
+       top-level paths in the Nix store (since that directory is
+       group-writable for the Nix build users group); we check for
+       this case in canonicalisePathMetaData(). */
     if (st.st_uid != geteuid()) {
-#if HAVE_LCHOWN
-        if (lchown(path.c_str(), geteuid(), getegid()) == -1)
-#else
-        if (!S_ISLNK(st.st_mode) &&
-            chown(path.c_str(), geteuid(), getegid()) == -1)
-#endif
+        if (fchownat(dirFd, name.c_str(), geteuid(), getegid(), AT_SYMLINK_NOFOLLOW) == -1
+            && !(S_ISLNK(st.st_mode) && errno == EOPNOTSUPP))
             throw SysError(format("changing owner of '%1%' to %2%")
                 % path % geteuid());
     }
 
     if (S_ISDIR(st.st_mode)) {
-        DirEntries entries = readDirectory(path);
-        for (auto & i : entries)
-            canonicalisePathMetaData_(path + "/" + i.name, fromUid, inodesSeen);
+        auto fd = std::make_shared<AutoCloseFD>(
+            openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC));
+        if (!*fd) throw SysError(format("opening directory '%1%'") % path);
+
+        for (auto & i : readDirectory(fd->get(), path)) {
+            auto path2 = path + "/" + i.name;
+            if (i.type == DT_DIR && walk->pending < CanonicaliseWalk::maxQueued) {
+                walk->pending++;
+                walk->pool.enqueue([walk, fd, i, path2]() {
+                    canonicalisePathMetaData_(walk, fd->get(), i.name, path2, i.type);
+                    walk->finishDir();
+                });
+            } else
+                canonicalisePathMetaData_(walk, fd->get(), i.name, path2, i.type);
+        }
     }
 }
 
 
-void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+void canonicalisePathMetaData(const Path & path, uid_t fromUid,
+    Sync<InodesSeen> & inodesSeen, ThreadPool & pool, std::function<void()> onDone)
 {
-    canonicalisePathMetaData_(path, fromUid, inodesSeen);
+    auto walk = std::make_shared<CanonicaliseWalk>(fromUid, inodesSeen, pool, onDone);
+
+    canonicalisePathMetaData_(walk, AT_FDCWD, path, path, DT_UNKNOWN);
 
-    /* On platforms that don't have lchown(), the top-level path can't
-       be a symlink, since we can't change its ownership. */
+    /* The top-level path can't be a symlink on platforms that can't
+       change its ownership. */
     struct stat st;
     if (lstat(path.c_str(), &st))
         throw SysError(format("getting attributes of path '%1%'") % path);
@@ -527,6 +677,18 @@ void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & ino
         assert(S_ISLNK(st.st_mode));
         throw Error(format("wrong ownership of top-level store path '%1%'") % path);
     }
+
+    walk->finishDir();
+}
+
+
+void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & inodesSeen)
+{
+    Sync<InodesSeen> inodesSeen_(std::move(inodesSeen));
+    ThreadPool pool;
+    canonicalisePathMetaData(path, fromUid, inodesSeen_, pool);
+    pool.process();
+    inodesSeen = std::move(*inodesSeen_.lock());
 }
 
 
@@ -593,6 +755,7 @@ uint64_t LocalStore::addValidPath(State & state,
         (info.ultimate ? 1 : 0, info.ultimate)
         (concatStringsSep(" ", info.sigs), !info.sigs.empty())
         (info.ca, !info.ca.empty())
+        (storePathToHash(info.path))
         .exec();
     uint64_t id = sqlite3_last_insert_rowid(state.db);
 
@@ -619,10 +782,8 @@ uint64_t LocalStore::addValidPath(State & state,
         }
     }
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.upsert(storePathToHash(info.path), std::make_shared<ValidPathInfo>(info));
-    }
+    if (auto hash = storePathHash(info.path))
+        pathInfoCache.upsert(*hash, std::make_shared<ValidPathInfo>(info));
 
     return id;
 }
@@ -686,6 +847,8 @@ void LocalStore::queryPathInfoUncached(const Path & path,
 /* Update path info in the database. */
 void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
+    state.stmtResetClosureSizes.use()(info.path)(info.narSize).exec();
+
     state.stmtUpdatePathInfo.use()
         (info.narSize, info.narSize != 0)
         (info.narHash.to_string(Base16))
@@ -723,10 +886,16 @@ bool LocalStore::isValidPathUncached(const Path & path)
 
 PathSet LocalStore::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
-    PathSet res;
-    for (auto & i : paths)
-        if (isValidPath(i)) res.insert(i);
-    return res;
+    /* Check all paths in one transaction. */
+    return retrySQLite<PathSet>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        PathSet res;
+        for (auto & i : paths)
+            if (isValidPath_(*state, i)) res.insert(i);
+        txn.commit();
+        return res;
+    });
 }
 
 
@@ -761,6 +930,98 @@ void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 }
 
 
+void LocalStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection,
+    bool includeOutputs, bool includeDerivers)
+{
+    if (includeOutputs || includeDerivers)
+        Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+    else if (auto graph = flipDirection ? getRefsGraph(false) : nullptr)
+        /* Referrer closures tend to be large, so prefer the graph if
+           it's available. */
+        graph->computeClosure(paths, out, true);
+    else
+        queryClosure(paths, out, flipDirection);
+}
+
+
+uint64_t LocalStore::queryClosure(const PathSet & startPaths, PathSet & paths,
+    bool flipDirection)
+{
+    for (auto & path : startPaths) assertStorePath(path);
+
+    return retrySQLite<uint64_t>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        auto narSize = queryClosure(*state, startPaths, paths, flipDirection);
+        txn.commit();
+        return narSize;
+    });
+}
+
+
+uint64_t LocalStore::queryClosure(State & state, const PathSet & startPaths, PathSet & paths,
+    bool flipDirection)
+{
+    state.stmtClearClosureRoots.use().exec();
+
+    for (auto & path : startPaths) {
+        auto use(state.stmtQueryPathInfo.use()(path));
+        if (!use.next())
+            throw InvalidPath("path '%s' is not valid", path);
+        state.stmtAddClosureRoot.use()(use.getInt(0)).exec();
+    }
+
+    uint64_t narSize = 0;
+
+    auto use((flipDirection ? state.stmtQueryReverseClosure : state.stmtQueryClosure).use());
+    while (use.next()) {
+        paths.insert(use.getStr(0));
+        narSize += use.getInt(1);
+    }
+
+    return narSize;
+}
+
+
+std::pair<uint64_t, uint64_t> LocalStore::queryClosureSize(const Path & path)
+{
+    assertStorePath(path);
+
+    return retrySQLite<std::pair<uint64_t, uint64_t>>([&]() {
+        auto state(_state.lock());
+
+        SQLiteTxn txn(state->db);
+
+        uint64_t id;
+        {
+            auto use(state->stmtQueryClosureSize.use()(path));
+            if (!use.next())
+                throw InvalidPath("path '%s' is not valid", path);
+            if (!use.isNull(1) && !use.isNull(2))
+                return std::make_pair((uint64_t) use.getInt(1), (uint64_t) use.getInt(2));
+            id = use.getInt(0);
+        }
+
+        PathSet closure;
+        auto narSize = queryClosure(*state, {path}, closure, false);
+
+        if (!settings.readOnlyMode)
+            state->stmtSetClosureSize.use()(narSize)(closure.size())(id).exec();
+
+        txn.commit();
+
+        return std::make_pair(narSize, (uint64_t) closure.size());
+    });
+}
+
+
+std::pair<uint64_t, uint64_t> LocalStore::getClosureSize(const Path & storePath)
+{
+    return {queryClosureSize(storePath).first, 0};
+}
+
+
 PathSet LocalStore::queryValidDerivers(const Path & path)
 {
     assertStorePath(path);
@@ -813,21 +1074,74 @@ StringSet LocalStore::queryDerivationOutputNames(const Path & path)
 }
 
 
+PathSet LocalStore::queryBuiltDerivations(const PathSet & paths)
+{
+    return retrySQLite<PathSet>([&]() {
+        auto state(_state.lock());
+
+        SQLiteTxn txn(state->db);
+
+        SQLiteStmt stmt(state->db,
+            "select d.id, exists (select 1 from ValidPaths v where v.path = d.path) "
+            "from DerivationOutputs d join ValidPaths p on p.id = d.drv where p.path = ?;");
+
+        PathSet built;
+
+        for (auto & path : paths) {
+            auto i = parseDrvPathWithOutputs(path);
+            if (!isDerivation(i.first)) continue;
+
+            auto use(stmt.use()(i.first));
+            StringSet found;
+            bool allValid = true;
+            while (use.next()) {
+                auto name = use.getStr(0);
+                if (!wantOutput(name, i.second)) continue;
+                found.insert(name);
+                if (!use.getInt(1)) allValid = false;
+            }
+
+            if (allValid && !found.empty() && (i.second.empty() || found.size() == i.second.size()))
+                built.insert(path);
+        }
+
+        return built;
+    });
+}
+
+
 Path LocalStore::queryPathFromHashPart(const string & hashPart)
 {
     if (hashPart.size() != storePathHashLen) throw Error("invalid hash part");
 
-    Path prefix = storeDir + "/" + hashPart;
-
     return retrySQLite<Path>([&]() -> std::string {
         auto state(_state.lock());
 
-        auto useQueryPathFromHashPart(state->stmtQueryPathFromHashPart.use()(prefix));
+        auto useQueryPathFromHashPart(state->stmtQueryPathFromHashPart.use()(hashPart));
+
+        return useQueryPathFromHashPart.next() ? useQueryPathFromHashPart.getStr(0) : "";
+    });
+}
+
+
+std::map<string, Path> LocalStore::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    for (auto & hashPart : hashParts)
+        if (hashPart.size() != storePathHashLen) throw Error("invalid hash part");
+
+    return retrySQLite<std::map<string, Path>>([&]() {
+        auto state(_state.lock());
 
-        if (!useQueryPathFromHashPart.next()) return "";
+        std::map<string, Path> res;
 
-        const char * s = (const char *) sqlite3_column_text(state->stmtQueryPathFromHashPart, 0);
-        return s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0 ? s : "";
+        SQLiteTxn txn(state->db);
+
+        for (auto & hashPart : hashParts) {
+            auto use(state->stmtQueryPathFromHashPart.use()(hashPart));
+            if (use.next()) res.emplace(hashPart, use.getStr(0));
+        }
+
+        return res;
     });
 }
 
@@ -864,31 +1178,90 @@ void LocalStore::querySubstitutablePathInfos(const PathSet & paths,
     SubstitutablePathInfos & infos)
 {
     if (!settings.useSubstitutes) return;
-    for (auto & sub : getDefaultSubstituters()) {
-        if (sub->storeDir != storeDir) continue;
-        for (auto & path : paths) {
-            if (infos.count(path)) continue;
-            debug(format("checking substituter '%s' for path '%s'")
-                % sub->getUri() % path);
+
+    std::vector<ref<Store>> subs;
+    for (auto & sub : getDefaultSubstituters())
+        if (sub->storeDir == storeDir) subs.push_back(sub);
+
+    /* Query all substituters for all paths at the same time, then
+       take the answer of the substituter with the highest priority
+       (i.e. the first one in the list). */
+    struct State
+    {
+        size_t left = 0;
+        std::map<Path, std::vector<std::shared_ptr<const ValidPathInfo>>> results;
+        std::exception_ptr exc;
+    };
+
+    /* The state is shared with the callbacks, which may still run
+       after we've returned if a query throws synchronously or we're
+       interrupted. */
+    auto state_ = std::make_shared<Sync<State>>();
+    auto wakeup = std::make_shared<std::condition_variable>();
+
+    for (auto & path : paths)
+        if (!infos.count(path)) {
+            auto state(state_->lock());
+            state->results[path].resize(subs.size());
+            state->left += subs.size();
+        }
+
+    ThreadPool pool;
+
+    auto doQuery = [&](const Path & path, size_t n) {
+        checkInterrupt();
+        debug(format("checking substituter '%s' for path '%s'")
+            % subs[n]->getUri() % path);
+        subs[n]->queryPathInfo(path, {[path, n, state_, wakeup](std::future<ref<ValidPathInfo>> fut) {
+            auto state(state_->lock());
             try {
-                auto info = sub->queryPathInfo(path);
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos[path] = SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize};
-            } catch (InvalidPath) {
-            } catch (SubstituterDisabled) {
+                state->results[path][n] = fut.get().get_ptr();
+            } catch (InvalidPath &) {
+            } catch (SubstituterDisabled &) {
             } catch (Error & e) {
                 if (settings.tryFallback)
                     printError(e.what());
-                else
-                    throw;
+                else if (!state->exc)
+                    state->exc = std::current_exception();
+            } catch (...) {
+                if (!state->exc)
+                    state->exc = std::current_exception();
             }
+            assert(state->left);
+            if (!--state->left)
+                wakeup->notify_one();
+        }});
+    };
+
+    for (auto & sub : subs)
+        sub->preloadPathInfoCache(paths);
+
+    for (auto & path : paths)
+        if (!infos.count(path))
+            for (size_t n = 0; n < subs.size(); ++n)
+                pool.enqueue(std::bind(doQuery, path, n));
+
+    pool.process();
+
+    auto state(state_->lock());
+    while (state->left)
+        state.wait(*wakeup);
+
+    if (state->exc) std::rethrow_exception(state->exc);
+
+    for (auto & i : state->results)
+        for (size_t n = 0; n < subs.size(); ++n) {
+            auto & info = i.second[n];
+            if (!info) continue;
+            auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+            infos[i.first] = SubstitutablePathInfo{
+                info->deriver,
+                info->references,
+                narInfo ? narInfo->fileSize : 0,
+                info->narSize,
+                subs[n]};
+            break;
         }
-    }
 }
 
 
@@ -905,8 +1278,15 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
     /* SQLite will fsync by default, but the new valid paths may not
        be fsync-ed.  So some may want to fsync them before registering
        the validity, at the expense of some speed of the path
-       registering operation. */
-    if (settings.syncBeforeRegistering) sync();
+       registering operation. On Linux, only the file system
+       containing the store is flushed. */
+    if (settings.syncBeforeRegistering) {
+#if __linux__
+        AutoCloseFD fd = open(realStoreDir.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd || syncfs(fd.get()) == -1)
+#endif
+            sync();
+    }
 
     return retrySQLite<void>([&]() {
         auto state(_state.lock());
@@ -914,11 +1294,21 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         SQLiteTxn txn(state->db);
         PathSet paths;
 
+        /* The valid paths that gain references by being registered
+           again. */
+        std::vector<uint64_t> grown;
+
         for (auto & i : infos) {
             assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
+            if (isValidPath_(*state, i.path)) {
+                auto id = queryValidPathId(*state, i.path);
+                PathSet oldRefs;
+                auto use(state->stmtQueryReferences.use()(id));
+                while (use.next()) oldRefs.insert(use.getStr(0));
+                if (!std::includes(oldRefs.begin(), oldRefs.end(), i.references.begin(), i.references.end()))
+                    grown.push_back(id);
                 updatePathInfo(*state, i);
-            else
+            } else
                 addValidPath(*state, i, false);
             paths.insert(i.path);
         }
@@ -929,6 +1319,17 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
                 state->stmtAddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
         }
 
+        /* The cached closure sizes of those paths and their
+           referrers are stale.  Reset them in one pass, since doing
+           it per path would be quadratic when e.g. loading a whole
+           database dump. */
+        if (!grown.empty()) {
+            state->stmtClearClosureRoots.use().exec();
+            for (auto id : grown)
+                state->stmtAddClosureRoot.use()(id).exec();
+            state->stmtResetClosureSize.use().exec();
+        }
+
         /* Check that the derivation outputs are correct.  We can't do
            this in addValidPath() above, because the references might
            not be valid yet. */
@@ -947,6 +1348,55 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
         topoSortPaths(paths);
 
         txn.commit();
+
+        if (!grown.empty()) invalidateRefsGraph(*state);
+    });
+}
+
+
+std::optional<Hash> LocalStore::queryContentHash(const Path & path)
+{
+    return retrySQLite<std::optional<Hash>>([&]() -> std::optional<Hash> {
+        auto state(_state.lock());
+        auto use(state->stmtQueryContentHash.use()(path));
+        if (!use.next() || use.isNull(0)) return {};
+        return Hash(use.getStr(0), htSHA256);
+    });
+}
+
+
+void LocalStore::setContentHash(const Path & path, const Hash & hash)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtSetContentHash.use()(hash.to_string(Base16))(path).exec();
+    });
+}
+
+
+std::map<string, Path> LocalStore::queryEquivalentOutputs(const Hash & resolvedHash)
+{
+    return retrySQLite<std::map<string, Path>>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmtQueryEquivalentOutputs.use()(resolvedHash.to_string(Base16)));
+        std::map<string, Path> outputs;
+        while (use.next())
+            outputs[use.getStr(0)] = use.getStr(1);
+        return outputs;
+    });
+}
+
+
+void LocalStore::registerEquivalentOutputs(const Hash & resolvedHash,
+    const std::map<string, Path> & outputs)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        SQLiteTxn txn(state->db);
+        for (auto & i : outputs)
+            state->stmtAddEquivalentOutput.use()
+                (resolvedHash.to_string(Base16))(i.first)(i.second).exec();
+        txn.commit();
     });
 }
 
@@ -962,10 +1412,10 @@ void LocalStore::invalidatePath(State & state, const Path & path)
     /* Note that the foreign key constraints on the Refs table take
        care of deleting the references entries for `path'. */
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.erase(storePathToHash(path));
-    }
+    if (auto hash = storePathHash(path))
+        pathInfoCache.erase(*hash);
+
+    invalidateRefsGraph(state);
 }
 
 
@@ -1003,38 +1453,126 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 
         if (repair || !isValidPath(info.path)) {
 
-            deletePath(realPath);
+            restoreFromNar(info, source);
 
-            /* While restoring the path from the NAR, compute the hash
-               of the NAR. */
-            HashSink hashSink(htSHA256);
+            autoGC();
 
-            LambdaSource wrapperSource([&](unsigned char * data, size_t len) -> size_t {
-                size_t n = source.read(data, len);
-                hashSink(data, n);
-                return n;
-            });
+            registerValidPath(info);
+        }
 
-            restorePath(realPath, wrapperSource);
+        outputLock.setDeletion(true);
+    }
+}
 
-            auto hashResult = hashSink.finish();
 
-            if (hashResult.first != info.narHash)
-                throw Error("hash mismatch importing path '%s';\n  wanted: %s\n  got:    %s",
-                    info.path, info.narHash.to_string(), hashResult.first.to_string());
+void LocalStore::restoreFromNar(const ValidPathInfo & info, Source & source)
+{
+    Path realPath = realStoreDir + "/" + baseNameOf(info.path);
 
-            if (hashResult.second != info.narSize)
-                throw Error("size mismatch importing path '%s';\n  wanted: %s\n  got:   %s",
-                    info.path, info.narSize, hashResult.second);
+    deletePath(realPath);
 
-            autoGC();
+    /* While restoring the path from the NAR, compute the hash
+       of the NAR. */
+    HashSink hashSink(htSHA256);
 
-            canonicalisePathMetaData(realPath, -1);
+    LambdaSource wrapperSource([&](unsigned char * data, size_t len) -> size_t {
+        size_t n = source.read(data, len);
+        hashSink(data, n);
+        return n;
+    });
 
-            optimisePath(realPath); // FIXME: combine with hashPath()
+    if (settings.restoreDedup)
+        restorePath(realPath, wrapperSource, [&](const Path & path, const Hash & hash) {
+            return reuseStoreFile(path, hash);
+        });
+    else
+        restorePath(realPath, wrapperSource);
 
-            registerValidPath(info);
-        }
+    auto hashResult = hashSink.finish();
+
+    if (hashResult.first != info.narHash)
+        throw Error("hash mismatch importing path '%s';\n  wanted: %s\n  got:    %s",
+            info.path, info.narHash.to_string(), hashResult.first.to_string());
+
+    if (hashResult.second != info.narSize)
+        throw Error("size mismatch importing path '%s';\n  wanted: %s\n  got:   %s",
+            info.path, info.narSize, hashResult.second);
+
+    canonicalisePathMetaData(realPath, -1);
+
+    optimisePath(realPath); // FIXME: combine with hashPath()
+}
+
+
+void LocalStore::addMultipleToStore(const ValidPathInfos & infos,
+    std::function<void(const ValidPathInfo & info, Sink & sink)> narFromPath,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    for (auto & info : infos)
+        if (!info.narHash)
+            throw Error("cannot add path '%s' because it lacks a hash", info.path);
+
+    /* Signature verification dominates the CPU time of importing
+       many small paths, so do it in parallel. */
+    if (requireSigs && checkSigs) {
+        auto publicKeys = getPublicKeys();
+        ThreadPool pool;
+        for (auto & info : infos)
+            pool.enqueue([&]() {
+                if (!info.checkSignatures(*this, publicKeys))
+                    throw Error("cannot add path '%s' because it lacks a valid signature", info.path);
+            });
+        pool.process();
+    }
+
+    PathSet paths;
+    for (auto & info : infos)
+        paths.insert(info.path);
+    addTempRoots(paths);
+
+    /* Since the paths are in topological order, every batch only
+       refers to paths that are either valid already or in the
+       batch. */
+    size_t batchSize = std::max((unsigned int) 1, settings.importBatchSize.get());
+
+    for (auto i = infos.begin(); i != infos.end(); ) {
+
+        ValidPathInfos batch;
+        for (; i != infos.end() && batch.size() < batchSize; ++i)
+            if (repair || !isValidPath(i->path))
+                batch.push_back(*i);
+
+        if (batch.empty()) continue;
+
+        /* Lock the output paths, except those locked by our parent
+           (see addToStore()). */
+        PathSet lockPaths;
+        for (auto & info : batch)
+            if (!locksHeld.count(info.path))
+                lockPaths.insert(realStoreDir + "/" + baseNameOf(info.path));
+        PathLocks outputLock(lockPaths);
+
+        /* The paths may have become valid while we were waiting for
+           the locks. */
+        if (!repair)
+            batch.remove_if([&](const ValidPathInfo & info) { return isValidPath(info.path); });
+
+        ThreadPool pool;
+
+        for (auto & info : batch)
+            pool.enqueue([&]() {
+                checkInterrupt();
+                auto source = sinkToSource([&](Sink & sink) {
+                    narFromPath(info, sink);
+                });
+                restoreFromNar(info, *source);
+            });
+
+        pool.process();
+
+        autoGC();
+
+        registerValidPaths(batch);
 
         outputLock.setDeletion(true);
     }
@@ -1044,7 +1582,19 @@ void LocalStore::addToStore(const ValidPathInfo & info, Source & source,
 Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
     bool recursive, HashType hashAlgo, RepairFlag repair)
 {
-    Hash h = hashString(hashAlgo, dump);
+    /* In recursive mode, the SHA-256 hash of the dump is its NAR
+       hash, so compute both in one pass. */
+    Hash h, narHash;
+    if (recursive && hashAlgo != htSHA256) {
+        MultiHashSink sink({hashAlgo, htSHA256});
+        sink((const unsigned char *) dump.data(), dump.size());
+        auto hashes = sink.finish().first;
+        h = hashes[0];
+        narHash = hashes[1];
+    } else {
+        h = hashString(hashAlgo, dump);
+        if (recursive) narHash = h;
+    }
 
     Path dstPath = makeFixedOutputPath(recursive, h, name);
 
@@ -1074,12 +1624,11 @@ Path LocalStore::addToStoreFromDump(const string & dump, const string & name,
             canonicalisePathMetaData(realPath, -1);
 
             /* Register the SHA-256 hash of the NAR serialisation of
-               the path in the database.  We may just have computed it
-               above (if called with recursive == true and hashAlgo ==
-               sha256); otherwise, compute it here. */
+               the path in the database.  In recursive mode we
+               computed it above; otherwise, compute it here. */
             HashResult hash;
             if (recursive) {
-                hash.first = hashAlgo == htSHA256 ? h : hashString(htSHA256, dump);
+                hash.first = narHash;
                 hash.second = dump.size();
             } else
                 hash = hashPath(htSHA256, realPath);
@@ -1106,19 +1655,109 @@ Path LocalStore::addToStore(const string & name, const Path & _srcPath,
 {
     Path srcPath(absPath(_srcPath));
 
+    if (!recursive) return addFlatFileToStore(name, srcPath, hashAlgo, repair);
+
     /* Read the whole path into memory. This is not a very scalable
        method for very large paths, but `copyPath' is mainly used for
        small files. */
     StringSink sink;
-    if (recursive)
-        dumpPath(srcPath, sink, filter);
-    else
-        sink.s = make_ref<std::string>(readFile(srcPath));
+    dumpPath(srcPath, sink, filter);
 
     return addToStoreFromDump(*sink.s, name, recursive, hashAlgo, repair);
 }
 
 
+Path LocalStore::addFlatFileToStore(const string & name, const Path & srcPath,
+    HashType hashAlgo, RepairFlag repair)
+{
+    AutoCloseFD fdSrc = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdSrc) throw SysError("opening file '%s'", srcPath);
+
+    struct stat st;
+    if (fstat(fdSrc.get(), &st))
+        throw SysError("getting attributes of path '%s'", srcPath);
+    if (!S_ISREG(st.st_mode))
+        throw Error("path '%s' is not a regular file", srcPath);
+
+    autoGC();
+
+    /* Copy the file into a temporary file in the store, computing its
+       hash and the hash of its NAR serialisation on the way, so that
+       memory use doesn't depend on the size of the file.  The
+       temporary file is named like a store path and registered as a
+       temporary root, so the garbage collector leaves it alone. */
+    Path tmpPath = makeStorePath("tmp",
+        hashString(htSHA256, fmt("%s-%d-%d", srcPath, getpid(), random())), name);
+    addTempRoot(tmpPath);
+    Path realTmpPath = realStoreDir + "/" + baseNameOf(tmpPath);
+    AutoDelete delTmp(realTmpPath, false);
+
+    HashSink hashSink(hashAlgo);
+    HashSink narHashSink(htSHA256);
+    narHashSink << narVersionMagic1 << "(" << "type" << "regular"
+        << "contents" << (uint64_t) st.st_size;
+
+    {
+        AutoCloseFD fdTmp = open(realTmpPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (!fdTmp) throw SysError("creating file '%s'", realTmpPath);
+
+        std::vector<unsigned char> buf(65536);
+        uint64_t left = st.st_size;
+
+        while (left > 0) {
+            checkInterrupt();
+            auto n = std::min<uint64_t>(left, buf.size());
+            readFull(fdSrc.get(), buf.data(), n);
+            left -= n;
+            hashSink(buf.data(), n);
+            narHashSink(buf.data(), n);
+            writeFull(fdTmp.get(), buf.data(), n);
+        }
+    }
+
+    writePadding(st.st_size, narHashSink);
+    narHashSink << ")";
+
+    Hash h = hashSink.finish().first;
+    auto narHash = narHashSink.finish();
+
+    Path dstPath = makeFixedOutputPath(false, h, name);
+
+    addTempRoot(dstPath);
+
+    if (repair || !isValidPath(dstPath)) {
+
+        Path realPath = realStoreDir + "/" + baseNameOf(dstPath);
+
+        PathLocks outputLock({realPath});
+
+        if (repair || !isValidPath(dstPath)) {
+
+            deletePath(realPath);
+
+            if (rename(realTmpPath.c_str(), realPath.c_str()) == -1)
+                throw SysError("moving '%s' to '%s'", realTmpPath, realPath);
+            delTmp.cancel();
+
+            canonicalisePathMetaData(realPath, -1);
+
+            optimisePath(realPath);
+
+            ValidPathInfo info;
+            info.path = dstPath;
+            info.narHash = narHash.first;
+            info.narSize = narHash.second;
+            info.ca = makeFixedOutputCA(false, h);
+            registerValidPath(info);
+        }
+
+        outputLock.setDeletion(true);
+    }
+
+    return dstPath;
+}
+
+
 Path LocalStore::addTextToStore(const string & name, const string & s,
     const PathSet & references, RepairFlag repair)
 {
@@ -1165,6 +1804,41 @@ Path LocalStore::addTextToStore(const string & name, const string & s,
 }
 
 
+Paths LocalStore::addTextsToStore(const std::vector<StoreText> & texts,
+    RepairFlag repair)
+{
+    Paths res;
+    ValidPathInfos infos;
+    std::map<Path, const StoreText *> contents;
+
+    for (auto & text : texts) {
+        auto hash = hashString(htSHA256, text.contents);
+        auto dstPath = makeTextPath(text.name, hash, text.references);
+        res.push_back(dstPath);
+        if (!contents.emplace(dstPath, &text).second) continue;
+
+        StringSink sink;
+        dumpString(text.contents, sink);
+
+        ValidPathInfo info;
+        info.path = dstPath;
+        info.narHash = hashString(htSHA256, *sink.s);
+        info.narSize = sink.s->size();
+        info.references = text.references;
+        info.ca = "text:" + hash.to_string();
+        infos.push_back(info);
+    }
+
+    addMultipleToStore(infos,
+        [&](const ValidPathInfo & info, Sink & sink) {
+            dumpString(contents.at(info.path)->contents, sink);
+        },
+        repair, NoCheckSigs);
+
+    return res;
+}
+
+
 /* Create a temporary directory in the store that won't be
    garbage-collected. */
 Path LocalStore::createTempDirInStore()
@@ -1232,56 +1906,135 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     if (checkContents) {
         printInfo("checking hashes...");
 
-        Hash nullHash(htSHA256);
+        /* Skip paths that were checked recently. */
+        if (settings.verifyInterval) {
+            auto state(_state.lock());
+            auto use(state->stmtQueryRecentlyVerified.use()
+                ((int64_t) (time(0) - (time_t) settings.verifyInterval * 24 * 60 * 60)));
+            size_t skipped = 0;
+            while (use.next())
+                skipped += validPaths.erase(use.getStr(0));
+            printInfo("skipping %d paths verified in the last %d days", skipped, settings.verifyInterval.get());
+        }
 
+        /* Hash the largest paths first, so that a single big path
+           doesn't end up serialising the tail of the run. */
+        std::vector<std::pair<uint64_t, Path>> todo;
         for (auto & i : validPaths) {
+            uint64_t narSize = 0;
             try {
-                auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
-
-                /* Check the content hash (optionally - slow). */
-                printMsg(lvlTalkative, format("checking contents of '%1%'") % i);
-                HashResult current = hashPath(info->narHash.type, toRealPath(i));
-
-                if (info->narHash != nullHash && info->narHash != current.first) {
-                    printError(format("path '%1%' was modified! "
-                            "expected hash '%2%', got '%3%'")
-                        % i % info->narHash.to_string() % current.first.to_string());
-                    if (repair) repairPath(i); else errors = true;
-                } else {
-
-                    bool update = false;
-
-                    /* Fill in missing hashes. */
-                    if (info->narHash == nullHash) {
-                        printError(format("fixing missing hash on '%1%'") % i);
-                        info->narHash = current.first;
-                        update = true;
-                    }
+                narSize = queryPathInfo(i)->narSize;
+            } catch (InvalidPath &) {
+            }
+            todo.emplace_back(narSize, i);
+        }
+        std::sort(todo.rbegin(), todo.rend());
 
-                    /* Fill in missing narSize fields (from old stores). */
-                    if (info->narSize == 0) {
-                        printError(format("updating size field on '%1%' to %2%") % i % current.second);
-                        info->narSize = current.second;
-                        update = true;
+        Hash nullHash(htSHA256);
+
+        std::atomic<bool> hashErrors{false};
+        Sync<PathSet> toRepair;
+
+        ThreadPool pool(settings.verifyThreads);
+
+        /* Divide the cores between the paths being hashed in
+           parallel. */
+        size_t treeThreads = std::max(1U, std::thread::hardware_concurrency() / (unsigned int) pool.getMaxThreads());
+
+        /* A recorded tree hash only vouches for the contents that
+           were checked against the current `hash'. */
+        auto bindTreeHash = [](const Hash & narHash, const Hash & treeHash) {
+            return hashString(htSHA256, narHash.to_string() + " " + treeHash.to_string()).to_string();
+        };
+
+        for (auto & p : todo) {
+            auto & i = p.second;
+            pool.enqueue([&, i]() {
+                try {
+                    auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
+
+                    /* If the contents still have the tree hash they
+                       had when they were last found to match `hash',
+                       they're fine. This is much faster than
+                       computing the NAR hash since it's parallel. */
+                    std::optional<std::string> treeHash;
+                    if (settings.verifyTreeHash && info->narHash != nullHash && info->narSize) {
+                        auto recorded = retrySQLite<std::string>([&]() {
+                            auto state(_state.lock());
+                            auto use(state->stmtQueryTreeHash.use()(i));
+                            return use.next() && !use.isNull(0) ? use.getStr(0) : "";
+                        });
+                        if (recorded != "") {
+                            printMsg(lvlTalkative, format("checking tree hash of '%1%'") % i);
+                            treeHash = bindTreeHash(info->narHash, hashPathTree(toRealPath(i), defaultPathFilter, treeThreads));
+                            if (*treeHash == recorded) {
+                                retrySQLite<void>([&]() {
+                                    auto state(_state.lock());
+                                    state->stmtSetLastVerified.use()((int64_t) time(0))(i).exec();
+                                });
+                                return;
+                            }
+                        }
                     }
 
-                    if (update) {
-                        auto state(_state.lock());
-                        updatePathInfo(*state, *info);
+                    /* Check the content hash (optionally - slow). */
+                    printMsg(lvlTalkative, format("checking contents of '%1%'") % i);
+                    HashResult current = hashPath(info->narHash.type, toRealPath(i));
+
+                    if (info->narHash != nullHash && info->narHash != current.first) {
+                        printError(format("path '%1%' was modified! "
+                                "expected hash '%2%', got '%3%'")
+                            % i % info->narHash.to_string() % current.first.to_string());
+                        if (repair) toRepair.lock()->insert(i); else hashErrors = true;
+                    } else {
+
+                        bool update = false;
+
+                        /* Fill in missing hashes. */
+                        if (info->narHash == nullHash) {
+                            printError(format("fixing missing hash on '%1%'") % i);
+                            info->narHash = current.first;
+                            update = true;
+                        }
+
+                        /* Fill in missing narSize fields (from old stores). */
+                        if (info->narSize == 0) {
+                            printError(format("updating size field on '%1%' to %2%") % i % current.second);
+                            info->narSize = current.second;
+                            update = true;
+                        }
+
+                        if (settings.verifyTreeHash && (!treeHash || update))
+                            treeHash = bindTreeHash(info->narHash, hashPathTree(toRealPath(i), defaultPathFilter, treeThreads));
+
+                        retrySQLite<void>([&]() {
+                            auto state(_state.lock());
+                            if (update) updatePathInfo(*state, *info);
+                            state->stmtSetLastVerified.use()((int64_t) time(0))(i).exec();
+                            if (treeHash)
+                                state->stmtSetTreeHash.use()(*treeHash)(i).exec();
+                        });
+
                     }
 
+                } catch (Error & e) {
+                    /* It's possible that the path got GC'ed, so ignore
+                       errors on invalid paths. */
+                    if (isValidPath(i))
+                        printError(format("error: %1%") % e.msg());
+                    else
+                        printError(format("warning: %1%") % e.msg());
+                    hashErrors = true;
                 }
-
-            } catch (Error & e) {
-                /* It's possible that the path got GC'ed, so ignore
-                   errors on invalid paths. */
-                if (isValidPath(i))
-                    printError(format("error: %1%") % e.msg());
-                else
-                    printError(format("warning: %1%") % e.msg());
-                errors = true;
-            }
+            });
         }
+
+        pool.process();
+
+        if (hashErrors) errors = true;
+
+        for (auto & i : *toRepair.lock())
+            repairPath(i);
     }
 
     return errors;
@@ -3,12 +3,15 @@
 #include "sqlite.hh"
 
 #include "pathlocks.hh"
+#include "path-table.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
 
 #include <chrono>
 #include <future>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <unordered_set>
 
@@ -19,11 +22,14 @@ namespace nix {
 /* Nix store and database schema version.  Version 1 (or 0) was Nix <=
    0.7.  Version 2 was Nix 0.8 and 0.9.  Version 3 is Nix 0.10.
    Version 4 is Nix 0.11.  Version 5 is Nix 0.12-0.16.  Version 6 is
-   Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0. */
-const int nixSchemaVersion = 10;
+   Nix 1.0.  Version 7 is Nix 1.3. Version 10 is 2.0.  Version 11
+   adds cached closure sizes, the hash part and link indexes, tree
+   and content hashes, and equivalent outputs. */
+const int nixSchemaVersion = 11;
 
 
 struct Derivation;
+class RefsGraph;
 
 
 struct OptimiseStats
@@ -31,6 +37,7 @@ struct OptimiseStats
     unsigned long filesLinked = 0;
     unsigned long long bytesFreed = 0;
     unsigned long long blocksFreed = 0;
+    std::atomic<unsigned long long> filesHashed{0}, bytesHashed{0};
 };
 
 
@@ -59,10 +66,34 @@ private:
         SQLiteStmt stmtQueryDerivationOutputs;
         SQLiteStmt stmtQueryPathFromHashPart;
         SQLiteStmt stmtQueryValidPaths;
+        SQLiteStmt stmtClearClosureRoots;
+        SQLiteStmt stmtAddClosureRoot;
+        SQLiteStmt stmtQueryClosure;
+        SQLiteStmt stmtQueryReverseClosure;
+        SQLiteStmt stmtQueryClosureSize;
+        SQLiteStmt stmtSetClosureSize;
+        SQLiteStmt stmtResetClosureSizes;
+        SQLiteStmt stmtResetClosureSize;
+        SQLiteStmt stmtAddLink;
+        SQLiteStmt stmtRemoveLink;
+        SQLiteStmt stmtQueryLinks;
+        SQLiteStmt stmtQueryDedupSource;
+        SQLiteStmt stmtSetDedupSource;
+        SQLiteStmt stmtSetLastVerified;
+        SQLiteStmt stmtQueryRecentlyVerified;
+        SQLiteStmt stmtQueryTreeHash;
+        SQLiteStmt stmtSetTreeHash;
+        SQLiteStmt stmtQueryContentHash;
+        SQLiteStmt stmtSetContentHash;
+        SQLiteStmt stmtQueryEquivalentOutputs;
+        SQLiteStmt stmtAddEquivalentOutput;
 
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
 
+        /* The roots written to `fdTempRoots' so far. */
+        std::unordered_set<Path> tempRoots;
+
         /* The last time we checked whether to do an auto-GC, or an
            auto-GC finished. */
         std::chrono::time_point<std::chrono::steady_clock> lastGCCheck;
@@ -78,6 +109,10 @@ private:
            point in starting a new GC. */
         uint64_t availAfterGC = std::numeric_limits<uint64_t>::max();
 
+        /* Incremented by invalidateRefsGraph(), so that a reference
+           graph read before doesn't get written out afterwards. */
+        uint64_t refsGraphGeneration = 0;
+
         std::unique_ptr<PublicKeys> publicKeys;
     };
 
@@ -96,6 +131,10 @@ public:
     const Path tempRootsDir;
     const Path fnTempRoots;
 
+    /* Lock files held by the processes that are substituting a
+       path, so that others can wait for them instead. */
+    const Path substitutionLocksDir;
+
 private:
 
     Setting<bool> requireSigs{(Store*) this,
@@ -131,14 +170,43 @@ public:
 
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
+    /* Add the closure of `startPaths' (or, if `flipDirection' is set,
+       the set of paths that can reach them) to `paths', using a
+       single recursive query.  Returns the sum of the NAR sizes of
+       the paths in the closure. */
+    uint64_t queryClosure(const PathSet & startPaths, PathSet & paths,
+        bool flipDirection = false);
+
+    /* Return the sum of the NAR sizes of the paths in the closure of
+       `path', and the number of paths in it.  These are cached in the
+       database, since closures don't change once a path is valid. */
+    std::pair<uint64_t, uint64_t> queryClosureSize(const Path & path);
+
+    std::pair<uint64_t, uint64_t> getClosureSize(const Path & storePath) override;
+
+    /* Return a snapshot of the reference graph (see refs-graph.hh).
+       If the on-disk image is missing or out of date and `rebuild' is
+       false, return nullptr rather than rebuilding it. */
+    std::shared_ptr<RefsGraph> getRefsGraph(bool rebuild = true);
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
 
     StringSet queryDerivationOutputNames(const Path & path) override;
 
+    PathSet queryBuiltDerivations(const PathSet & paths) override;
+
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    std::map<string, Path> queryPathsFromHashParts(const StringSet & hashParts) override;
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
@@ -148,6 +216,13 @@ public:
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
 
+    /* Restores the NARs of up to `import-batch-size' paths at a time
+       in parallel, and registers each batch in a single
+       transaction. */
+    void addMultipleToStore(const ValidPathInfos & infos,
+        std::function<void(const ValidPathInfo & info, Sink & sink)> narFromPath,
+        RepairFlag repair, CheckSigsFlag checkSigs) override;
+
     Path addToStore(const string & name, const Path & srcPath,
         bool recursive, HashType hashAlgo,
         PathFilter & filter, RepairFlag repair) override;
@@ -162,6 +237,11 @@ public:
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair) override;
 
+    /* Adds the texts through addMultipleToStore(), i.e. registers up
+       to `import-batch-size' of them in a single transaction. */
+    Paths addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair) override;
+
     void buildPaths(const PathSet & paths, BuildMode buildMode) override;
 
     BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
@@ -171,6 +251,10 @@ public:
 
     void addTempRoot(const Path & path) override;
 
+    /* Writes all new roots to the temporary roots file under a single
+       write lock. */
+    void addTempRoots(const PathSet & paths) override;
+
     void addIndirectRoot(const Path & path) override;
 
     void syncWithGC() override;
@@ -188,6 +272,8 @@ public:
 
     void collectGarbage(const GCOptions & options, GCResults & results) override;
 
+    GCPlan planGarbage(bool censor) override;
+
     /* Optimise the disk space usage of the Nix store by hard-linking
        files with the same contents. */
     void optimiseStore(OptimiseStats & stats);
@@ -209,6 +295,20 @@ public:
 
     void registerValidPaths(const ValidPathInfos & infos);
 
+    /* Return or record the content hash of a valid path, i.e. the
+       hash of its NAR modulo the hash parts of the path itself and
+       of its references (see `early-cutoff'). */
+    std::optional<Hash> queryContentHash(const Path & path);
+
+    void setContentHash(const Path & path, const Hash & hash);
+
+    /* Return or record the outputs produced by a derivation with the
+       given resolved hash. */
+    std::map<string, Path> queryEquivalentOutputs(const Hash & resolvedHash);
+
+    void registerEquivalentOutputs(const Hash & resolvedHash,
+        const std::map<string, Path> & outputs);
+
     unsigned int getProtocol() override;
 
     void vacuumDB();
@@ -237,6 +337,21 @@ private:
 
     void invalidatePath(State & state, const Path & path);
 
+    /* Delete the reference graph image because paths have been
+       invalidated or have gained references, which it can't tell
+       from the ValidPaths table. */
+    void invalidateRefsGraph(State & state);
+
+    /* Unpack the NAR of `info' from `source' into the store, check
+       it against the NAR hash and size, and canonicalise it.  Does
+       not register the path. */
+    void restoreFromNar(const ValidPathInfo & info, Source & source);
+
+    /* Implementation of addToStore() for flat files, which streams
+       the file into the store. */
+    Path addFlatFileToStore(const string & name, const Path & srcPath,
+        HashType hashAlgo, RepairFlag repair);
+
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const Path & path);
 
@@ -256,10 +371,15 @@ private:
 
     void tryToDelete(GCState & state, const Path & path);
 
-    bool canReachRoot(GCState & state, PathSet & visited, const Path & path);
+    bool canReachRoot(GCState & state, PathIdSet & visited, const Path & path);
 
     void deletePathRecursive(GCState & state, const Path & path);
 
+    void markAlive(GCState & state, const Path & path);
+
+    void deleteGarbageIncremental(GCState & state, const std::vector<Path> & candidates,
+        AutoCloseFD & fdGCLock, FDs & fds);
+
     bool isActiveTempFile(const GCState & state,
         const Path & path, const string & suffix);
 
@@ -271,15 +391,52 @@ private:
 
     void findRuntimeRoots(Roots & roots, bool censor);
 
-    void removeUnusedLinks(const GCState & state);
+    void findProcessRoots(const string & pid, Roots & roots);
+
+    /* The store paths in the environment of each process seen by
+       findRuntimeRoots(), keyed by pid and tagged with the process's
+       start time, so that the next GC in this process doesn't have to
+       scan them again. */
+    Sync<std::map<string, std::pair<string, Roots>>> procEnvRoots;
+
+    void removeUnusedLinks(GCState & state);
 
     Path createTempDirInStore();
 
     void checkDerivationOutputs(const Path & drvPath, const Derivation & drv);
 
-    typedef std::unordered_set<ino_t> InodeHash;
+    /* The inodes of the files in the links directory.  This is shared
+       between the threads of optimiseStore(), which also use
+       `linkMutex' to serialise changes to the links directory. */
+    struct InodeHash
+    {
+        std::unordered_set<ino_t> inodes;
+        mutable std::shared_mutex mutex;
+        std::mutex linkMutex;
+
+        bool count(ino_t ino) const
+        {
+            std::shared_lock<std::shared_mutex> lock(mutex);
+            return inodes.count(ino);
+        }
+
+        void insert(ino_t ino)
+        {
+            std::unique_lock<std::shared_mutex> lock(mutex);
+            inodes.insert(ino);
+        }
+    };
 
-    InodeHash loadInodeHash();
+    void loadInodeHash(InodeHash & inodeHash);
+    void addLink(const string & hash, ino_t inode);
+    void removeLink(const string & hash);
+    /* Return the names of the links with the given inode number. */
+    Strings queryLinks(ino_t inode);
+    void checkLinks();
+    string queryDedupSource(const string & hash);
+    void setDedupSource(const string & hash, const Path & path);
+    bool dedupeFile(const Path & path, const struct stat & st, const string & hash);
+    bool reuseStoreFile(const Path & path, const Hash & hash);
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
     void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
 
@@ -287,6 +444,9 @@ private:
     bool isValidPath_(State & state, const Path & path);
     void queryReferrers(State & state, const Path & path, PathSet & referrers);
 
+    uint64_t queryClosure(State & state, const PathSet & startPaths, PathSet & paths,
+        bool flipDirection);
+
     /* Add signatures to a ValidPathInfo using the secret keys
        specified by the ‘secret-key-files’ option. */
     void signPathInfo(ValidPathInfo & info);
@@ -313,8 +473,36 @@ typedef set<Inode> InodesSeen;
 void canonicalisePathMetaData(const Path & path, uid_t fromUid, InodesSeen & inodesSeen);
 void canonicalisePathMetaData(const Path & path, uid_t fromUid);
 
+class ThreadPool;
+
+/* Like canonicalisePathMetaData(), but only the top-level path is
+   processed by the caller; the subdirectories are processed by work
+   items added to `pool', after which `onDone' is called (from one of
+   them, or from the caller if `path' has no subdirectories).  The
+   caller must call pool.process(), which rethrows any error. */
+void canonicalisePathMetaData(const Path & path, uid_t fromUid,
+    Sync<InodesSeen> & inodesSeen, ThreadPool & pool,
+    std::function<void()> onDone = {});
+
 void canonicaliseTimestampAndPermissions(const Path & path);
 
+/* Totals of the goal counts of the build workers (see
+   LocalStore::buildPaths()) of this process. nix-daemon points
+   `workerStats' to memory that it shares with the processes it
+   forks, to get the totals of all of them. */
+struct WorkerStats
+{
+    std::atomic<uint64_t> runningBuilds{0};
+    std::atomic<uint64_t> doneBuilds{0};
+    std::atomic<uint64_t> failedBuilds{0};
+    std::atomic<uint64_t> runningSubstitutions{0};
+    std::atomic<uint64_t> doneSubstitutions{0};
+    std::atomic<uint64_t> failedSubstitutions{0};
+    std::atomic<uint64_t> substitutedNarSize{0};
+};
+
+extern WorkerStats * workerStats;
+
 MakeError(PathInUse, Error);
 
 }
@@ -1,9 +1,12 @@
 #include "derivations.hh"
 #include "globals.hh"
 #include "local-store.hh"
+#include "path-table.hh"
 #include "store-api.hh"
 #include "thread-pool.hh"
 
+#include <unordered_set>
+
 
 namespace nix {
 
@@ -11,25 +14,57 @@ namespace nix {
 void Store::computeFSClosure(const PathSet & startPaths,
     PathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
+    /* Keep track of the paths seen so far by their binary hash
+       part, and add them to `paths_' in one go at the end. */
     struct State
     {
         size_t pending;
-        PathSet & paths;
+        std::unordered_set<StorePathHash> seen;
+        Paths paths;
         std::exception_ptr exc;
     };
 
-    Sync<State> state_(State{0, paths_, 0});
+    Sync<State> state_(State{0, {}, {}, 0});
+
+    {
+        auto state(state_.lock());
+        state->seen.reserve(paths_.size() + startPaths.size());
+        for (auto & path : paths_)
+            if (isStorePath(path))
+                if (auto hash = storePathHash(path))
+                    state->seen.insert(*hash);
+    }
 
     std::function<void(const Path &)> enqueue;
+    std::function<void(const Path &, const Path &)> enqueueOutput;
 
     std::condition_variable done;
 
+    auto finish = [&](std::exception_ptr exc) {
+        auto state(state_.lock());
+        if (exc && !state->exc) state->exc = exc;
+        assert(state->pending);
+        if (!--state->pending) done.notify_one();
+    };
+
     enqueue = [&](const Path & path) -> void {
+        std::optional<StorePathHash> hash;
+        try {
+            assertStorePath(path);
+            hash = storePathHash(path);
+            if (!hash)
+                throw InvalidPath("path '%s' is not valid", path);
+        } catch (...) {
+            auto state(state_.lock());
+            if (!state->exc) state->exc = std::current_exception();
+            return;
+        }
+
         {
             auto state(state_.lock());
             if (state->exc) return;
-            if (state->paths.count(path)) return;
-            state->paths.insert(path);
+            if (!state->seen.insert(*hash).second) return;
+            state->paths.push_back(path);
             state->pending++;
         }
 
@@ -53,8 +88,8 @@ void Store::computeFSClosure(const PathSet & startPaths,
 
                     if (includeDerivers && isDerivation(path))
                         for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i) && queryPathInfo(i)->deriver == path)
-                                enqueue(i);
+                            if (isValidPath(i))
+                                enqueueOutput(i, path);
 
                 } else {
 
@@ -71,21 +106,35 @@ void Store::computeFSClosure(const PathSet & startPaths,
 
                 }
 
-                {
-                    auto state(state_.lock());
-                    assert(state->pending);
-                    if (!--state->pending) done.notify_one();
-                }
+                finish(nullptr);
 
             } catch (...) {
-                auto state(state_.lock());
-                if (!state->exc) state->exc = std::current_exception();
-                assert(state->pending);
-                if (!--state->pending) done.notify_one();
+                finish(std::current_exception());
             };
         }});
     };
 
+    /* Enqueue `path' if it was produced by `drvPath'. This doesn't
+       block in the callback that calls it, since some stores run all
+       callbacks on a single thread that must also handle the query. */
+    enqueueOutput = [&](const Path & path, const Path & drvPath) -> void {
+        {
+            auto state(state_.lock());
+            if (state->exc) return;
+            state->pending++;
+        }
+
+        queryPathInfo(path, {[&, path, drvPath](std::future<ref<ValidPathInfo>> fut) {
+            try {
+                if (fut.get()->deriver == drvPath)
+                    enqueue(path);
+                finish(nullptr);
+            } catch (...) {
+                finish(std::current_exception());
+            }
+        }});
+    };
+
     for (auto & startPath : startPaths)
         enqueue(startPath);
 
@@ -93,6 +142,7 @@ void Store::computeFSClosure(const PathSet & startPaths,
         auto state(state_.lock());
         while (state->pending) state.wait(done);
         if (state->exc) std::rethrow_exception(state->exc);
+        paths_.insert(state->paths.begin(), state->paths.end());
     }
 }
 
@@ -105,21 +155,28 @@ void Store::computeFSClosure(const Path & startPath,
 
 
 void Store::queryMissing(const PathSet & targets,
-    PathSet & willBuild_, PathSet & willSubstitute_, PathSet & unknown_,
-    unsigned long long & downloadSize_, unsigned long long & narSize_)
+    PathSet & willBuild, PathSet & willSubstitute, PathSet & unknown,
+    unsigned long long & downloadSize, unsigned long long & narSize)
 {
-    Activity act(*logger, lvlDebug, actUnknown, "querying info about missing paths");
+    auto plan = planMissing(targets);
+    willBuild = std::move(plan.willBuild);
+    willSubstitute = std::move(plan.willSubstitute);
+    unknown = std::move(plan.unknown);
+    downloadSize = plan.downloadSize;
+    narSize = plan.narSize;
+}
+
 
-    downloadSize_ = narSize_ = 0;
+BuildPlan Store::planMissing(const PathSet & targets)
+{
+    Activity act(*logger, lvlDebug, actUnknown, "querying info about missing paths");
 
     ThreadPool pool;
 
     struct State
     {
-        PathSet done;
-        PathSet & unknown, & willSubstitute, & willBuild;
-        unsigned long long & downloadSize;
-        unsigned long long & narSize;
+        std::unordered_set<Path> done;
+        BuildPlan plan;
     };
 
     struct DrvState
@@ -130,18 +187,26 @@ void Store::queryMissing(const PathSet & targets,
         DrvState(size_t left) : left(left) { }
     };
 
-    Sync<State> state_(State{PathSet(), unknown_, willSubstitute_, willBuild_, downloadSize_, narSize_});
+    Sync<State> state_;
 
     std::function<void(Path)> doPath;
 
     auto mustBuildDrv = [&](const Path & drvPath, const Derivation & drv) {
         {
             auto state(state_.lock());
-            state->willBuild.insert(drvPath);
+            state->plan.willBuild.insert(drvPath);
         }
 
+        PathSet inputs;
         for (auto & i : drv.inputDrvs)
-            pool.enqueue(std::bind(doPath, makeDrvPathWithOutputs(i.first, i.second)));
+            inputs.insert(makeDrvPathWithOutputs(i.first, i.second));
+
+        /* Don't bother reading inputs that have already been built. */
+        auto built = queryBuiltDerivations(inputs);
+
+        for (auto & i : inputs)
+            if (!built.count(i))
+                pool.enqueue(std::bind(doPath, i));
     };
 
     auto checkOutput = [&](
@@ -174,8 +239,7 @@ void Store::queryMissing(const PathSet & targets,
 
         {
             auto state(state_.lock());
-            if (state->done.count(path)) return;
-            state->done.insert(path);
+            if (!state->done.insert(path).second) return;
         }
 
         DrvPathWithOutputs i2 = parseDrvPathWithOutputs(path);
@@ -184,7 +248,7 @@ void Store::queryMissing(const PathSet & targets,
             if (!isValidPath(i2.first)) {
                 // FIXME: we could try to substitute the derivation.
                 auto state(state_.lock());
-                state->unknown.insert(path);
+                state->plan.unknown.insert(path);
                 return;
             }
 
@@ -213,7 +277,7 @@ void Store::queryMissing(const PathSet & targets,
 
             if (infos.empty()) {
                 auto state(state_.lock());
-                state->unknown.insert(path);
+                state->plan.unknown.insert(path);
                 return;
             }
 
@@ -222,9 +286,11 @@ void Store::queryMissing(const PathSet & targets,
 
             {
                 auto state(state_.lock());
-                state->willSubstitute.insert(path);
-                state->downloadSize += info->second.downloadSize;
-                state->narSize += info->second.narSize;
+                state->plan.willSubstitute.insert(path);
+                state->plan.downloadSize += info->second.downloadSize;
+                state->plan.narSize += info->second.narSize;
+                if (info->second.substituter)
+                    state->plan.substituters.emplace(path, ref<Store>(info->second.substituter));
             }
 
             for (auto & ref : info->second.references)
@@ -232,46 +298,77 @@ void Store::queryMissing(const PathSet & targets,
         }
     };
 
+    auto built = queryBuiltDerivations(targets);
+
     for (auto & path : targets)
-        pool.enqueue(std::bind(doPath, path));
+        if (!built.count(path))
+            pool.enqueue(std::bind(doPath, path));
 
     pool.process();
+
+    return std::move(state_.lock()->plan);
 }
 
 
 Paths Store::topoSortPaths(const PathSet & paths)
 {
-    Paths sorted;
-    PathSet visited, parents;
-
-    std::function<void(const Path & path, const Path * parent)> dfsVisit;
-
-    dfsVisit = [&](const Path & path, const Path * parent) {
-        if (parents.find(path) != parents.end())
-            throw BuildError(format("cycle detected in the references of '%1%' from '%2%'") % path % *parent);
+    /* Number the paths, so that the state of each is a vector
+       element rather than an entry in a set of strings. */
+    PathTable table;
+    for (auto & i : paths) table.intern(i);
 
-        if (visited.find(path) != visited.end()) return;
-        visited.insert(path);
-        parents.insert(path);
+    /* Get the references within `paths' of every path up front, in
+       bulk where the store supports it. */
+    preloadPathInfoCache(paths);
 
-        PathSet references;
+    std::vector<std::vector<PathTable::Id>> references(table.size());
+    for (PathTable::Id id = 0; id < table.size(); ++id) {
         try {
-            references = queryPathInfo(path)->references;
+            for (auto & i : queryPathInfo(table[id])->references) {
+                /* Don't traverse into paths that don't exist.  That
+                   can happen due to substitutes for non-existent
+                   paths. */
+                auto ref = table.lookup(i);
+                if (ref && *ref != id)
+                    references[id].push_back(*ref);
+            }
         } catch (InvalidPath &) {
         }
+    }
 
-        for (auto & i : references)
-            /* Don't traverse into paths that don't exist.  That can
-               happen due to substitutes for non-existent paths. */
-            if (i != path && paths.find(i) != paths.end())
-                dfsVisit(i, &path);
-
-        sorted.push_front(path);
-        parents.erase(path);
-    };
+    /* Do an iterative depth-first search, so that deep graphs (like
+       long chains of references) can't overflow the stack. Each
+       stack entry is a path and the position of the next reference
+       to visit. */
+    Paths sorted;
+    std::vector<bool> visited(table.size()), parents(table.size());
+    std::vector<std::pair<PathTable::Id, size_t>> stack;
+
+    for (PathTable::Id start = 0; start < table.size(); ++start) {
+        if (visited[start]) continue;
+
+        visited[start] = parents[start] = true;
+        stack.emplace_back(start, 0);
+
+        while (!stack.empty()) {
+            auto & top(stack.back());
+            auto id = top.first;
+
+            if (top.second < references[id].size()) {
+                auto ref = references[id][top.second++];
+                if (parents[ref])
+                    throw BuildError(format("cycle detected in the references of '%1%' from '%2%'") % table[ref] % table[id]);
+                if (visited[ref]) continue;
+                visited[ref] = parents[ref] = true;
+                stack.emplace_back(ref, 0);
+                continue;
+            }
 
-    for (auto & i : paths)
-        dfsVisit(i, nullptr);
+            sorted.push_front(table[id]);
+            parents[id] = false;
+            stack.pop_back();
+        }
+    }
 
     return sorted;
 }
@@ -5,6 +5,11 @@
 #include <map>
 #include <stack>
 #include <algorithm>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <nlohmann/json.hpp>
 
@@ -34,19 +39,30 @@ struct NarAccessor : public FSAccessor
 
     NarMember root;
 
-    struct NarIndexer : ParseSink, StringSource
+    struct NarIndexer : ParseSink, Source
     {
         NarAccessor & acc;
+        Source & source;
 
         std::stack<NarMember *> parents;
 
         std::string currentStart;
         bool isExec = false;
 
-        NarIndexer(NarAccessor & acc, const std::string & nar)
-            : StringSource(nar), acc(acc)
+        /* Position in the NAR. */
+        uint64_t pos = 0;
+
+        NarIndexer(NarAccessor & acc, Source & source)
+            : acc(acc), source(source)
         { }
 
+        size_t read(unsigned char * data, size_t len) override
+        {
+            auto n = source.read(data, len);
+            pos += n;
+            return n;
+        }
+
         void createMember(const Path & path, NarMember member) {
             size_t level = std::count(path.begin(), path.end(), '/');
             while (parents.size() > level) parents.pop();
@@ -79,7 +95,7 @@ struct NarAccessor : public FSAccessor
 
         void preallocateContents(unsigned long long size) override
         {
-            currentStart = string(s, pos, 16);
+            if (acc.nar) currentStart = string(*acc.nar, pos, 16);
             assert(size <= std::numeric_limits<size_t>::max());
             parents.top()->size = (size_t)size;
             parents.top()->start = pos;
@@ -103,7 +119,15 @@ struct NarAccessor : public FSAccessor
 
     NarAccessor(ref<const std::string> nar) : nar(nar)
     {
-        NarIndexer indexer(*this, *nar);
+        StringSource source(*nar);
+        NarIndexer indexer(*this, source);
+        parseDump(indexer, indexer);
+    }
+
+    NarAccessor(Source & source, GetNarBytes getNarBytes = {})
+        : getNarBytes(getNarBytes)
+    {
+        NarIndexer indexer(*this, source);
         parseDump(indexer, indexer);
     }
 
@@ -134,8 +158,10 @@ struct NarAccessor : public FSAccessor
             } else return;
         };
 
+        /* Accept both the listings written by listNar() and the
+           '.ls' files of binary caches, which wrap them. */
         json v = json::parse(listing);
-        recurse(root, v);
+        recurse(root, v.count("root") ? v["root"] : v);
     }
 
     NarMember * find(const Path & path)
@@ -201,7 +227,8 @@ struct NarAccessor : public FSAccessor
 
         if (getNarBytes) return getNarBytes(i.start, i.size);
 
-        assert(nar);
+        if (!nar)
+            throw Error("contents of path '%s' inside NAR file are not available", path);
         return std::string(*nar, i.start, i.size);
     }
 
@@ -219,12 +246,72 @@ ref<FSAccessor> makeNarAccessor(ref<const std::string> nar)
     return make_ref<NarAccessor>(nar);
 }
 
+ref<FSAccessor> makeNarIndex(Source & source)
+{
+    return make_ref<NarAccessor>(source);
+}
+
 ref<FSAccessor> makeLazyNarAccessor(const std::string & listing,
     GetNarBytes getNarBytes)
 {
     return make_ref<NarAccessor>(listing, getNarBytes);
 }
 
+/* A NAR file mapped into memory. */
+struct MappedNar
+{
+    void * data = MAP_FAILED;
+    size_t size = 0;
+
+    ~MappedNar()
+    {
+        if (data != MAP_FAILED) munmap(data, size);
+    }
+};
+
+ref<FSAccessor> openNarFile(const Path & narFile, const Path & listingFile)
+{
+    AutoCloseFD fd = open(narFile.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening NAR file '%s'", narFile);
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting NAR file '%s'", narFile);
+
+    auto map = std::make_shared<MappedNar>();
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        map->size = st.st_size;
+        map->data = mmap(nullptr, map->size, PROT_READ, MAP_SHARED, fd.get(), 0);
+    }
+
+    if (map->data == MAP_FAILED)
+        return makeNarAccessor(make_ref<std::string>(drainFD(fd.get())));
+
+    GetNarBytes getNarBytes = [map, narFile](uint64_t offset, uint64_t length) {
+        if (offset > map->size || length > map->size - offset)
+            throw Error("NAR file '%s' is truncated", narFile);
+        return std::string((const char *) map->data + offset, length);
+    };
+
+    if (listingFile != "" && pathExists(listingFile))
+        return makeLazyNarAccessor(readFile(listingFile), getNarBytes);
+
+    size_t pos = 0;
+    LambdaSource source([&](unsigned char * data, size_t len) {
+        if (pos == map->size) throw EndOfFile("NAR file '%s' is truncated", narFile);
+        len = std::min(len, map->size - pos);
+        memcpy(data, (const char *) map->data + pos, len);
+        pos += len;
+        return len;
+    });
+
+    madvise(map->data, map->size, MADV_SEQUENTIAL);
+    auto accessor = make_ref<NarAccessor>(source, getNarBytes);
+    madvise(map->data, map->size, MADV_RANDOM);
+
+    return accessor;
+}
+
 void listNar(JSONPlaceholder & res, ref<FSAccessor> accessor,
     const Path & path, bool recurse)
 {
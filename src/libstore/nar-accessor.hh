@@ -10,8 +10,15 @@ namespace nix {
    file. */
 ref<FSAccessor> makeNarAccessor(ref<const std::string> nar);
 
+struct Source;
+
+/* Return an object that provides the listing of a NAR read from
+   `source', but not the contents of its files. */
+ref<FSAccessor> makeNarIndex(Source & source);
+
 /* Create a NAR accessor from a NAR listing (in the format produced by
-   listNar()). The callback getNarBytes(offset, length) is used by the
+   listNar(), possibly wrapped as in the '.ls' files of binary
+   caches). The callback getNarBytes(offset, length) is used by the
    readFile() method of the accessor to get the contents of files
    inside the NAR. */
 typedef std::function<std::string(uint64_t, uint64_t)> GetNarBytes;
@@ -20,6 +27,14 @@ ref<FSAccessor> makeLazyNarAccessor(
     const std::string & listing,
     GetNarBytes getNarBytes);
 
+/* Return an object that provides access to the contents of the NAR
+   file `narFile'.  The file is mapped into memory rather than read,
+   so only the parts that are accessed are loaded.  If `listingFile'
+   exists, it is used as the listing of the NAR, so the NAR doesn't
+   have to be parsed at all.  Files that can't be mapped (e.g. pipes)
+   are read into memory. */
+ref<FSAccessor> openNarFile(const Path & narFile, const Path & listingFile = "");
+
 class JSONPlaceholder;
 
 /* Write a JSON representation of the contents of a NAR (except file
@@ -0,0 +1,131 @@
+#include "nar-chunks.hh"
+
+#include <array>
+
+namespace nix {
+
+
+/* The gear table of the rolling hash. This must never change, since
+   chunk boundaries would move. */
+static const std::array<uint64_t, 256> gearTable = []() {
+    std::array<uint64_t, 256> table;
+    uint64_t x = 0x6e6978636875636bULL;
+    for (auto & i : table) {
+        /* splitmix64 */
+        uint64_t z = (x += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        i = z ^ (z >> 31);
+    }
+    return table;
+}();
+
+
+ChunkingSink::ChunkingSink(size_t avgSize, ChunkFun chunkFun)
+    : chunkFun(chunkFun)
+{
+    bits = 0;
+    while (bits < 40 && ((size_t) 1 << (bits + 1)) <= avgSize) bits++;
+    if (bits < 8) bits = 8;
+    minSize = ((size_t) 1 << bits) / 4;
+    maxSize = ((size_t) 1 << bits) * 4;
+}
+
+
+void ChunkingSink::operator () (const unsigned char * data, size_t len)
+{
+    while (len) {
+        /* Don't look for a boundary before the minimum size. */
+        if (buf.size() < minSize) {
+            auto n = std::min(len, minSize - buf.size());
+            buf.append((const char *) data, n);
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        /* A boundary is where the top `bits' bits of the hash are
+           zero, so chunks are about 2^bits bytes after the minimum
+           size. */
+        size_t n = std::min(len, maxSize - buf.size());
+        size_t i = 0;
+        bool cut = false;
+        while (i < n) {
+            hash = (hash << 1) + gearTable[data[i++]];
+            if (!(hash >> (64 - bits))) { cut = true; break; }
+        }
+
+        buf.append((const char *) data, i);
+        data += i;
+        len -= i;
+
+        if (cut || buf.size() >= maxSize) emit();
+    }
+}
+
+
+void ChunkingSink::finish()
+{
+    if (!buf.empty()) emit();
+}
+
+
+void ChunkingSink::emit()
+{
+    chunkFun(std::move(buf));
+    buf.clear();
+    hash = 0;
+}
+
+
+ChunkList::ChunkList(const std::string & s, const std::string & whence)
+{
+    auto corrupt = [&]() {
+        throw Error("chunk list '%s' is corrupt", whence);
+    };
+
+    auto lines = tokenizeString<Strings>(s, "\n");
+
+    if (lines.empty() || lines.front() != "Version: 1") corrupt();
+    lines.pop_front();
+
+    if (lines.empty() || !hasPrefix(lines.front(), "Compression: ")) corrupt();
+    compression = std::string(lines.front(), 13);
+    lines.pop_front();
+
+    for (auto & line : lines) {
+        auto space = line.find(' ');
+        if (space == std::string::npos) corrupt();
+        Chunk chunk;
+        try {
+            chunk.hash = Hash(std::string(line, 0, space), htSHA256);
+        } catch (BadHash &) {
+            corrupt();
+        }
+        if (!string2Int(std::string(line, space + 1), chunk.size)) corrupt();
+        chunks.push_back(chunk);
+    }
+}
+
+
+std::string ChunkList::to_string() const
+{
+    std::string res = "Version: 1\nCompression: " + compression + "\n";
+    for (auto & chunk : chunks)
+        res += chunk.hash.to_string(Base32, false) + " " + std::to_string(chunk.size) + "\n";
+    return res;
+}
+
+
+std::string chunkFileFor(const Hash & hash, const std::string & compression)
+{
+    return "chunks/" + hash.to_string(Base32, false)
+        + (compression == "xz" ? ".xz" :
+           compression == "bzip2" ? ".bz2" :
+           compression == "br" ? ".br" :
+           compression == "zstd" ? ".zst" :
+           "");
+}
+
+
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "types.hh"
+#include "hash.hh"
+#include "serialise.hh"
+
+#include <functional>
+
+namespace nix {
+
+/* Support for storing NARs in binary caches as lists of
+   content-defined chunks (see the `nar-chunking' store setting), so
+   that the parts shared between NARs are stored only once. */
+
+/* A sink that splits its input into chunks at positions determined by
+   a rolling hash of the preceding bytes. Thus an insertion or deletion
+   only affects the chunks around it. The chunks are between
+   avgSize / 4 and avgSize * 4 bytes. */
+struct ChunkingSink : Sink
+{
+    typedef std::function<void(std::string && chunk)> ChunkFun;
+
+    ChunkingSink(size_t avgSize, ChunkFun chunkFun);
+
+    void operator () (const unsigned char * data, size_t len) override;
+
+    /* Pass the last chunk, if any, to `chunkFun'. */
+    void finish();
+
+private:
+
+    size_t minSize, maxSize;
+    unsigned int bits;
+    uint64_t hash = 0;
+    std::string buf;
+    ChunkFun chunkFun;
+
+    void emit();
+};
+
+/* The file describing a chunked NAR. */
+struct ChunkList
+{
+    struct Chunk
+    {
+        Hash hash; // SHA-256 of the uncompressed chunk
+        uint64_t size;
+    };
+
+    /* How the chunks are compressed. */
+    std::string compression;
+
+    std::vector<Chunk> chunks;
+
+    ChunkList() { }
+    ChunkList(const std::string & s, const std::string & whence);
+
+    std::string to_string() const;
+};
+
+/* The name of the file containing the chunk with the given hash,
+   compressed using `compression'. */
+std::string chunkFileFor(const Hash & hash, const std::string & compression);
+
+}
@@ -2,6 +2,9 @@
 #include "sync.hh"
 #include "sqlite.hh"
 #include "globals.hh"
+#include "lru-cache.hh"
+
+#include <thread>
 
 #include <sqlite3.h>
 
@@ -34,6 +37,8 @@ create table if not exists NARs (
     ca               text,
     timestamp        integer not null,
     present          integer not null,
+    deltas           text,
+    lastUsed         integer,
     primary key (cache, hashPart),
     foreign key (cache) references BinaryCaches(id) on delete cascade
 );
@@ -52,6 +57,9 @@ public:
     /* How often to purge expired entries from the cache. */
     const int purgeInterval = 24 * 3600;
 
+    /* How often to record that an entry is still being used. */
+    const int touchInterval = 3600;
+
     struct Cache
     {
         int id;
@@ -63,17 +71,49 @@ public:
     struct State
     {
         SQLite db;
-        SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, purgeCache;
+        SQLiteStmt insertCache, queryCache, insertNAR, insertMissingNAR, queryNAR, touchNAR, purgeCache;
         std::map<std::string, Cache> caches;
     };
 
     Sync<State> _state;
 
+    /* In-memory cache in front of the database. Entries are added
+       by lookups and upserts; upserts reach the database
+       asynchronously. */
+    struct Entry
+    {
+        std::shared_ptr<NarInfo> narInfo; // null if the path is invalid
+        time_t timestamp;
+        time_t lastUsed;
+    };
+
+    Sync<LRUCache<std::string, Entry>> recent{LRUCache<std::string, Entry>(65536)};
+
+    struct PendingWrite
+    {
+        std::string uri, hashPart;
+        std::shared_ptr<ValidPathInfo> info;
+        time_t timestamp;
+        /* Whether to only record that the entry was used at
+           `timestamp'. */
+        bool touch = false;
+    };
+
+    struct WriterState
+    {
+        bool quit = false;
+        std::vector<PendingWrite> pending;
+    };
+
+    Sync<WriterState> writer_;
+    std::condition_variable writerWakeup;
+    std::thread writerThread;
+
     NarInfoDiskCacheImpl()
     {
         auto state(_state.lock());
 
-        Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite";
+        Path dbPath = getCacheDir() + "/nix/binary-cache-v8.sqlite";
         createDirs(dirOf(dbPath));
 
         state->db = SQLite(dbPath);
@@ -95,13 +135,16 @@ public:
 
         state->insertNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, namePart, url, compression, fileHash, fileSize, narHash, "
-            "narSize, refs, deriver, sigs, ca, timestamp, present) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1)");
+            "narSize, refs, deriver, sigs, ca, timestamp, present, deltas, lastUsed) values (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, 1, ?, ?)");
 
         state->insertMissingNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, timestamp, present) values (?, ?, ?, 0)");
 
         state->queryNAR.create(state->db,
-            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+            "select present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca, timestamp, deltas, lastUsed from NARs where cache = ? and hashPart = ? and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+
+        state->touchNAR.create(state->db,
+            "update NARs set lastUsed = ? where cache = ? and hashPart = ?");
 
         /* Periodically purge expired entries from the database. */
         retrySQLite<void>([&]() {
@@ -115,7 +158,7 @@ public:
                     "delete from NARs where ((present = 0 and timestamp < ?) or (present = 1 and timestamp < ?))")
                     .use()
                     (now - settings.ttlNegativeNarInfoCache)
-                    (now - settings.ttlPositiveNarInfoCache)
+                    (now - settings.ttlPositiveNarInfoCache - settings.ttlStaleNarInfoCache)
                     .exec();
 
                 debug("deleted %d entries from the NAR info disk cache", sqlite3_changes(state->db));
@@ -127,6 +170,14 @@ public:
         });
     }
 
+    ~NarInfoDiskCacheImpl()
+    {
+        /* Flush pending writes. */
+        writer_.lock()->quit = true;
+        writerWakeup.notify_one();
+        if (writerThread.joinable()) writerThread.join();
+    }
+
     Cache & getCache(State & state, const std::string & uri)
     {
         auto i = state.caches.find(uri);
@@ -170,50 +221,224 @@ public:
         });
     }
 
+    /* Whether `entry' has expired, and if so, whether it's a valid
+       entry that may still be used while it's being refreshed. */
+    static bool isExpired(const Entry & entry, time_t now)
+    {
+        return entry.timestamp <= now - (entry.narInfo ? settings.ttlPositiveNarInfoCache : settings.ttlNegativeNarInfoCache);
+    }
+
+    static bool isUsable(const Entry & entry, time_t now, bool * stale)
+    {
+        if (!isExpired(entry, now)) return true;
+        return stale && entry.narInfo
+            && entry.timestamp > now - settings.ttlPositiveNarInfoCache - settings.ttlStaleNarInfoCache;
+    }
+
+    /* Record that the valid entry for `hashPart' in the in-memory
+       cache was used, if that hasn't been done recently. */
+    void touch(const std::string & uri, const std::string & hashPart, time_t now)
+    {
+        {
+            auto recent_(recent.lock());
+            auto key = uri + " " + hashPart;
+            auto entry = recent_->get(key);
+            if (!entry || !entry->narInfo || entry->lastUsed > now - touchInterval) return;
+            entry->lastUsed = now;
+            recent_->upsert(key, *entry);
+        }
+
+        {
+            auto writer(writer_.lock());
+            writer->pending.push_back({uri, hashPart, nullptr, now, true});
+            if (!writerThread.joinable())
+                writerThread = std::thread([this]() { writerThreadMain(); });
+        }
+        writerWakeup.notify_one();
+    }
+
+    /* Return the entry for `hashPart' in the in-memory cache, if it
+       hasn't expired (or is allowed to be stale). */
+    std::optional<std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupRecent(
+        const std::string & uri, const std::string & hashPart, time_t now, bool * stale = nullptr)
+    {
+        auto entry = recent.lock()->get(uri + " " + hashPart);
+        if (!entry || !isUsable(*entry, now, stale)) return {};
+        touch(uri, hashPart, now);
+        if (stale) *stale = isExpired(*entry, now);
+        return std::make_pair(entry->narInfo ? oValid : oInvalid, entry->narInfo);
+    }
+
+    /* Decode a row of a NARs query, starting at column `col', and
+       add it to the in-memory cache. */
+    Entry decodeNarInfo(
+        const std::string & uri, Cache & cache,
+        const std::string & hashPart, SQLiteStmt::Use & queryNAR, int col)
+    {
+        time_t timestamp = queryNAR.getInt(col + 12);
+        time_t lastUsed = queryNAR.isNull(col + 14) ? 0 : queryNAR.getInt(col + 14);
+
+        if (!queryNAR.getInt(col)) {
+            Entry entry{nullptr, timestamp, lastUsed};
+            recent.lock()->upsert(uri + " " + hashPart, entry);
+            return entry;
+        }
+
+        auto narInfo = make_ref<NarInfo>();
+
+        auto namePart = queryNAR.getStr(col + 1);
+        narInfo->path = cache.storeDir + "/" +
+            hashPart + (namePart.empty() ? "" : "-" + namePart);
+        narInfo->url = queryNAR.getStr(col + 2);
+        narInfo->compression = queryNAR.getStr(col + 3);
+        if (!queryNAR.isNull(col + 4))
+            narInfo->fileHash = Hash(queryNAR.getStr(col + 4));
+        narInfo->fileSize = queryNAR.getInt(col + 5);
+        narInfo->narHash = Hash(queryNAR.getStr(col + 6));
+        narInfo->narSize = queryNAR.getInt(col + 7);
+        for (auto & r : tokenizeString<Strings>(queryNAR.getStr(col + 8), " "))
+            narInfo->references.insert(cache.storeDir + "/" + r);
+        if (!queryNAR.isNull(col + 9))
+            narInfo->deriver = cache.storeDir + "/" + queryNAR.getStr(col + 9);
+        for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(col + 10), " "))
+            narInfo->sigs.insert(sig);
+        narInfo->ca = queryNAR.getStr(col + 11);
+        if (!queryNAR.isNull(col + 13))
+            for (auto & s : tokenizeString<Strings>(queryNAR.getStr(col + 13), "\n"))
+                if (auto delta = NarInfo::Delta::parse(cache.storeDir, s))
+                    narInfo->deltas.push_back(*delta);
+
+        Entry entry{narInfo, timestamp, lastUsed};
+        recent.lock()->upsert(uri + " " + hashPart, entry);
+
+        return entry;
+    }
+
     std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
-        const std::string & uri, const std::string & hashPart) override
+        const std::string & uri, const std::string & hashPart, bool * stale) override
     {
-        return retrySQLite<std::pair<Outcome, std::shared_ptr<NarInfo>>>(
-            [&]() -> std::pair<Outcome, std::shared_ptr<NarInfo>> {
+        auto now = time(0);
+
+        if (stale) *stale = false;
+
+        auto res = lookupRecent(uri, hashPart, now, stale);
+        if (res) return *res;
+
+        auto entry = retrySQLite<std::optional<Entry>>([&]() -> std::optional<Entry> {
             auto state(_state.lock());
 
             auto & cache(getCache(*state, uri));
 
-            auto now = time(0);
-
             auto queryNAR(state->queryNAR.use()
                 (cache.id)
                 (hashPart)
                 (now - settings.ttlNegativeNarInfoCache)
-                (now - settings.ttlPositiveNarInfoCache));
+                (now - settings.ttlPositiveNarInfoCache - (stale ? settings.ttlStaleNarInfoCache : 0)));
 
             if (!queryNAR.next())
-                return {oUnknown, 0};
-
-            if (!queryNAR.getInt(0))
-                return {oInvalid, 0};
-
-            auto narInfo = make_ref<NarInfo>();
-
-            auto namePart = queryNAR.getStr(1);
-            narInfo->path = cache.storeDir + "/" +
-                hashPart + (namePart.empty() ? "" : "-" + namePart);
-            narInfo->url = queryNAR.getStr(2);
-            narInfo->compression = queryNAR.getStr(3);
-            if (!queryNAR.isNull(4))
-                narInfo->fileHash = Hash(queryNAR.getStr(4));
-            narInfo->fileSize = queryNAR.getInt(5);
-            narInfo->narHash = Hash(queryNAR.getStr(6));
-            narInfo->narSize = queryNAR.getInt(7);
-            for (auto & r : tokenizeString<Strings>(queryNAR.getStr(8), " "))
-                narInfo->references.insert(cache.storeDir + "/" + r);
-            if (!queryNAR.isNull(9))
-                narInfo->deriver = cache.storeDir + "/" + queryNAR.getStr(9);
-            for (auto & sig : tokenizeString<Strings>(queryNAR.getStr(10), " "))
-                narInfo->sigs.insert(sig);
-            narInfo->ca = queryNAR.getStr(11);
-
-            return {oValid, narInfo};
+                return {};
+
+            return decodeNarInfo(uri, cache, hashPart, queryNAR, 0);
+        });
+
+        if (!entry) return {oUnknown, 0};
+
+        touch(uri, hashPart, now);
+        if (stale) *stale = isExpired(*entry, now);
+
+        return {entry->narInfo ? oValid : oInvalid, entry->narInfo};
+    }
+
+    std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const StringSet & hashParts) override
+    {
+        auto now = time(0);
+
+        std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> res;
+
+        std::vector<std::string> touched;
+
+        std::vector<std::string> todo;
+        for (auto & hashPart : hashParts) {
+            auto r = lookupRecent(uri, hashPart, now);
+            if (r)
+                res.emplace(hashPart, *r);
+            else
+                todo.push_back(hashPart);
+        }
+
+        /* Query the rest with one statement per batch, staying below
+           SQLite's limit on the number of parameters. */
+        const size_t batchSize = 500;
+
+        for (size_t i = 0; i < todo.size(); i += batchSize) {
+            auto n = std::min(batchSize, todo.size() - i);
+
+            retrySQLite<void>([&]() {
+                auto state(_state.lock());
+
+                auto & cache(getCache(*state, uri));
+
+                std::string params = "?";
+                for (size_t j = 1; j < n; ++j) params += ", ?";
+
+                SQLiteStmt stmt(state->db,
+                    "select hashPart, present, namePart, url, compression, fileHash, fileSize, narHash, narSize, refs, deriver, sigs, ca, timestamp, deltas, lastUsed from NARs "
+                    "where cache = ? and hashPart in (" + params + ") and ((present = 0 and timestamp > ?) or (present = 1 and timestamp > ?))");
+
+                auto query(stmt.use());
+                query(cache.id);
+                for (size_t j = 0; j < n; ++j)
+                    query(todo[i + j]);
+                query(now - settings.ttlNegativeNarInfoCache);
+                query(now - settings.ttlPositiveNarInfoCache);
+
+                while (query.next()) {
+                    auto hashPart = query.getStr(0);
+                    auto entry = decodeNarInfo(uri, cache, hashPart, query, 1);
+                    res[hashPart] = {entry.narInfo ? oValid : oInvalid, entry.narInfo};
+                    touched.push_back(hashPart);
+                }
+            });
+        }
+
+        for (auto & hashPart : touched)
+            touch(uri, hashPart, now);
+
+        return res;
+    }
+
+    PathSet queryHotNarInfos(const std::string & uri,
+        time_t usedSince, time_t expiresBefore, size_t max) override
+    {
+        auto now = time(0);
+
+        return retrySQLite<PathSet>([&]() {
+            auto state(_state.lock());
+
+            PathSet res;
+
+            auto i = state->caches.find(uri);
+            if (i == state->caches.end()) return res;
+            auto & cache(i->second);
+
+            SQLiteStmt stmt(state->db,
+                "select hashPart, namePart from NARs where cache = ? and present = 1 "
+                "and lastUsed >= ? and timestamp <= ? and timestamp > ? order by lastUsed desc limit ?");
+
+            auto query(stmt.use()
+                (cache.id)
+                (usedSince)
+                (expiresBefore - settings.ttlPositiveNarInfoCache)
+                (now - settings.ttlPositiveNarInfoCache - settings.ttlStaleNarInfoCache)
+                (max));
+
+            while (query.next()) {
+                auto namePart = query.getStr(1);
+                res.insert(cache.storeDir + "/" + query.getStr(0) + (namePart.empty() ? "" : "-" + namePart));
+            }
+
+            return res;
         });
     }
 
@@ -221,40 +446,120 @@ public:
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<ValidPathInfo> info) override
     {
-        retrySQLite<void>([&]() {
-            auto state(_state.lock());
+        upsertNarInfos(uri, {{hashPart, info}});
+    }
 
-            auto & cache(getCache(*state, uri));
+    void upsertNarInfos(const std::string & uri,
+        const std::map<std::string, std::shared_ptr<ValidPathInfo>> & infos) override
+    {
+        auto now = time(0);
+
+        {
+            auto recent_(recent.lock());
+            for (auto & i : infos) {
+                std::shared_ptr<NarInfo> narInfo;
+                if (i.second) {
+                    assert(i.first == storePathToHash(i.second->path));
+                    narInfo = std::dynamic_pointer_cast<NarInfo>(i.second);
+                    if (!narInfo) narInfo = std::make_shared<NarInfo>(*i.second);
+                }
+                recent_->upsert(uri + " " + i.first, Entry{narInfo, now, now});
+            }
+        }
 
-            if (info) {
-
-                auto narInfo = std::dynamic_pointer_cast<NarInfo>(info);
-
-                assert(hashPart == storePathToHash(info->path));
-
-                state->insertNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (storePathToName(info->path))
-                    (narInfo ? narInfo->url : "", narInfo != 0)
-                    (narInfo ? narInfo->compression : "", narInfo != 0)
-                    (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "", narInfo && narInfo->fileHash)
-                    (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
-                    (info->narHash.to_string())
-                    (info->narSize)
-                    (concatStringsSep(" ", info->shortRefs()))
-                    (info->deriver != "" ? baseNameOf(info->deriver) : "", info->deriver != "")
-                    (concatStringsSep(" ", info->sigs))
-                    (info->ca)
-                    (time(0)).exec();
-
-            } else {
-                state->insertMissingNAR.use()
-                    (cache.id)
-                    (hashPart)
-                    (time(0)).exec();
+        {
+            auto writer(writer_.lock());
+            for (auto & i : infos)
+                writer->pending.push_back({uri, i.first, i.second, now});
+            if (!writerThread.joinable())
+                writerThread = std::thread([this]() { writerThreadMain(); });
+        }
+
+        writerWakeup.notify_one();
+    }
+
+    /* Write pending upserts to the database in a single transaction
+       per batch, so that callers (typically network threads) don't
+       wait for SQLite. */
+    void writerThreadMain()
+    {
+        while (true) {
+            std::vector<PendingWrite> batch;
+
+            {
+                auto writer(writer_.lock());
+                while (writer->pending.empty() && !writer->quit)
+                    writer.wait(writerWakeup);
+                if (writer->pending.empty()) return;
+                batch = std::move(writer->pending);
+                writer->pending.clear();
             }
-        });
+
+            try {
+                retrySQLite<void>([&]() {
+                    auto state(_state.lock());
+
+                    SQLiteTxn txn(state->db);
+
+                    for (auto & i : batch)
+                        writeNarInfo(*state, i);
+
+                    txn.commit();
+                });
+            } catch (...) {
+                ignoreException();
+            }
+        }
+    }
+
+    static Strings deltaStrings(const NarInfo & narInfo)
+    {
+        Strings res;
+        for (auto & delta : narInfo.deltas)
+            res.push_back(delta.to_string());
+        return res;
+    }
+
+    void writeNarInfo(State & state, const PendingWrite & write)
+    {
+        auto & cache(getCache(state, write.uri));
+        auto & info(write.info);
+
+        if (write.touch)
+            state.touchNAR.use()
+                (write.timestamp)
+                (cache.id)
+                (write.hashPart).exec();
+
+        else if (info) {
+
+            auto narInfo = std::dynamic_pointer_cast<NarInfo>(info);
+
+            state.insertNAR.use()
+                (cache.id)
+                (write.hashPart)
+                (storePathToName(info->path))
+                (narInfo ? narInfo->url : "", narInfo != 0)
+                (narInfo ? narInfo->compression : "", narInfo != 0)
+                (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "", narInfo && narInfo->fileHash)
+                (narInfo ? narInfo->fileSize : 0, narInfo != 0 && narInfo->fileSize)
+                (info->narHash.to_string())
+                (info->narSize)
+                (concatStringsSep(" ", info->shortRefs()))
+                (info->deriver != "" ? baseNameOf(info->deriver) : "", info->deriver != "")
+                (concatStringsSep(" ", info->sigs))
+                (info->ca)
+                (write.timestamp)
+                (narInfo ? concatStringsSep("\n", deltaStrings(*narInfo)) : "", narInfo && !narInfo->deltas.empty())
+                (write.timestamp)
+                .exec();
+
+        } else {
+            state.insertMissingNAR.use()
+                (cache.id)
+                (write.hashPart)
+                (write.timestamp).exec();
+        }
     }
 };
 
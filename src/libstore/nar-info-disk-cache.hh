@@ -16,12 +16,34 @@ public:
     virtual bool cacheExists(const std::string & uri,
         bool & wantMassQuery, int & priority) = 0;
 
+    /* Look up `hashPart'.  If `stale' is not null, a valid entry that
+       expired less than `narinfo-cache-stale-ttl' seconds ago is
+       returned as well, and `*stale' is set to whether it expired; the
+       caller is then expected to refresh it. */
     virtual std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
-        const std::string & uri, const std::string & hashPart) = 0;
+        const std::string & uri, const std::string & hashPart,
+        bool * stale = nullptr) = 0;
 
     virtual void upsertNarInfo(
         const std::string & uri, const std::string & hashPart,
         std::shared_ptr<ValidPathInfo> info) = 0;
+
+    /* Look up many hash parts at once. Hash parts for which the
+       outcome is unknown are omitted from the result. */
+    virtual std::map<std::string, std::pair<Outcome, std::shared_ptr<NarInfo>>> lookupNarInfos(
+        const std::string & uri, const StringSet & hashParts) = 0;
+
+    /* Upsert many entries at once. Like upsertNarInfo(), this doesn't
+       wait for the database to be updated. */
+    virtual void upsertNarInfos(const std::string & uri,
+        const std::map<std::string, std::shared_ptr<ValidPathInfo>> & infos) = 0;
+
+    /* Return the store paths of at most `max' valid entries that were
+       used since `usedSince' and expire before `expiresBefore', most
+       recently used first, so that they can be refreshed ahead of
+       time. */
+    virtual PathSet queryHotNarInfos(const std::string & uri,
+        time_t usedSince, time_t expiresBefore, size_t max) = 0;
 };
 
 /* Return a singleton cache object that can be used concurrently by
@@ -69,6 +69,11 @@ NarInfo::NarInfo(const Store & store, const std::string & s, const std::string &
             system = value;
         else if (name == "Sig")
             sigs.insert(value);
+        else if (name == "Delta") {
+            auto delta = Delta::parse(store.storeDir, value);
+            if (!delta || !store.isStorePath(delta->base)) corrupt();
+            deltas.push_back(*delta);
+        }
         else if (name == "CA") {
             if (!ca.empty()) corrupt();
             ca = value;
@@ -110,7 +115,26 @@ std::string NarInfo::to_string() const
     if (!ca.empty())
         res += "CA: " + ca + "\n";
 
+    for (auto & delta : deltas)
+        res += "Delta: " + delta.to_string() + "\n";
+
     return res;
 }
 
+std::string NarInfo::Delta::to_string() const
+{
+    return fmt("%s %s %s %d", baseNameOf(base), method, url, fileSize);
+}
+
+std::optional<NarInfo::Delta> NarInfo::Delta::parse(const Path & storeDir, const std::string & s)
+{
+    auto fields = tokenizeString<std::vector<std::string>>(s, " ");
+    Delta delta;
+    if (fields.size() != 4 || !string2Int(fields[3], delta.fileSize)) return {};
+    delta.base = storeDir + "/" + fields[0];
+    delta.method = fields[1];
+    delta.url = fields[2];
+    return delta;
+}
+
 }
@@ -14,6 +14,25 @@ struct NarInfo : ValidPathInfo
     uint64_t fileSize = 0;
     std::string system;
 
+    /* A binary delta from which the NAR can be reconstructed, given
+       the NAR of the store path `base'. Written to the narinfo as
+       `Delta: <base> <method> <url> <size>'. */
+    struct Delta
+    {
+        Path base;
+        std::string method;
+        std::string url;
+        uint64_t fileSize = 0;
+
+        std::string to_string() const;
+
+        /* Parse the value of a `Delta' field. Returns an empty
+           optional if it's malformed. */
+        static std::optional<Delta> parse(const Path & storeDir, const std::string & s);
+    };
+
+    std::vector<Delta> deltas;
+
     NarInfo() { }
     NarInfo(const ValidPathInfo & info) : ValidPathInfo(info) { }
     NarInfo(const Store & store, const std::string & s, const std::string & whence);
@@ -1,16 +1,23 @@
 #include "util.hh"
 #include "local-store.hh"
 #include "globals.hh"
+#include "thread-pool.hh"
 
 #include <cstdlib>
 #include <cstring>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <regex>
 
+#if __linux__
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
 
 namespace nix {
 
@@ -41,25 +48,132 @@ struct MakeReadOnly
 };
 
 
-LocalStore::InodeHash LocalStore::loadInodeHash()
+void LocalStore::loadInodeHash(InodeHash & inodeHash)
 {
     debug("loading hash inodes in memory");
-    InodeHash inodeHash;
 
-    AutoCloseDir dir(opendir(linksDir.c_str()));
-    if (!dir) throw SysError(format("opening directory '%1%'") % linksDir);
+    /* The Links table has the inodes of the files in the links
+       directory, so we don't have to read it. */
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        inodeHash.inodes.clear();
+        SQLiteStmt stmt(state->db, "select inode from Links;");
+        auto use(stmt.use());
+        while (use.next())
+            inodeHash.inodes.insert(use.getInt(0));
+    });
+
+    printMsg(lvlTalkative, format("loaded %1% hash inodes") % inodeHash.inodes.size());
+}
 
-    struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
+
+void LocalStore::addLink(const string & hash, ino_t inode)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtAddLink.use()(hash)((int64_t) inode).exec();
+    });
+}
+
+
+void LocalStore::removeLink(const string & hash)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtRemoveLink.use()(hash).exec();
+    });
+}
+
+
+Strings LocalStore::queryLinks(ino_t inode)
+{
+    return retrySQLite<Strings>([&]() {
+        auto state(_state.lock());
+        Strings hashes;
+        auto use(state->stmtQueryLinks.use()((int64_t) inode));
+        while (use.next())
+            hashes.push_back(use.getStr(0));
+        return hashes;
+    });
+}
+
+
+/* Check every link in the Links table, forgetting the ones that have
+   disappeared and deleting the ones that are no longer used by any
+   store path (i.e. have a link count of 1).  The garbage collector
+   only checks the links of the files it deletes, so this catches
+   links that became unused in some other way.  FIXME: same race with
+   optimisePath_() as in the garbage collector. */
+void LocalStore::checkLinks()
+{
+    std::vector<std::pair<string, ino_t>> links;
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        links.clear();
+        SQLiteStmt stmt(state->db, "select hash, inode from Links;");
+        auto use(stmt.use());
+        while (use.next())
+            links.emplace_back(use.getStr(0), use.getInt(1));
+    });
+
+    long long actualSize = 0, unsharedSize = 0;
+    unsigned long long bytesFreed = 0;
+
+    for (auto & [hash, inode] : links) {
         checkInterrupt();
-        // We don't care if we hit non-hash files, anything goes
-        inodeHash.insert(dirent->d_ino);
+        Path path = linksDir + "/" + hash;
+
+        struct stat st;
+        if (lstat(path.c_str(), &st) == -1) {
+            if (errno != ENOENT)
+                throw SysError(format("statting '%1%'") % path);
+            removeLink(hash);
+            continue;
+        }
+
+        if (st.st_ino != inode) addLink(hash, st.st_ino);
+
+        if (st.st_nlink != 1) {
+            unsigned long long size = st.st_blocks * 512ULL;
+            actualSize += size;
+            unsharedSize += (st.st_nlink - 1) * size;
+            continue;
+        }
+
+        printMsg(lvlTalkative, format("deleting unused link '%1%'") % path);
+
+        if (unlink(path.c_str()) == -1)
+            throw SysError(format("deleting '%1%'") % path);
+        removeLink(hash);
+
+        bytesFreed += st.st_blocks * 512ULL;
     }
-    if (errno) throw SysError(format("reading directory '%1%'") % linksDir);
 
-    printMsg(lvlTalkative, format("loaded %1% hash inodes") % inodeHash.size());
+    if (bytesFreed)
+        printInfo(format("deleting unused links freed %.2f MiB") % (bytesFreed / (1024.0 * 1024.0)));
+
+    /* Likewise, forget dedupe sources that have been deleted. */
+    Strings sources;
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        sources.clear();
+        SQLiteStmt stmt(state->db, "select path from DedupSources;");
+        auto use(stmt.use());
+        while (use.next())
+            sources.push_back(use.getStr(0));
+    });
+
+    for (auto & path : sources) {
+        checkInterrupt();
+        if (pathExists(realStoreDir + "/" + path)) continue;
+        retrySQLite<void>([&]() {
+            auto state(_state.lock());
+            SQLiteStmt(state->db, "delete from DedupSources where path = ?;").use()(path).exec();
+        });
+    }
 
-    return inodeHash;
+    printInfo(format("note: currently hard linking saves %.2f MiB")
+        % ((unsharedSize - actualSize) / (1024.0 * 1024.0)));
 }
 
 
@@ -118,7 +232,12 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
-    /* We can hard link regular files and maybe symlinks. */
+    bool reflink = settings.optimiseMethod == "reflink";
+
+    /* We can hard link regular files and maybe symlinks, and share
+       the extents of non-empty regular files. */
+    if (reflink && (!S_ISREG(st.st_mode) || st.st_size == 0)) return;
+
     if (!S_ISREG(st.st_mode)
 #if CAN_LINK_SYMLINK
         && !S_ISLNK(st.st_mode)
@@ -152,6 +271,25 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     Hash hash = hashPath(htSHA256, path).first;
     debug(format("'%1%' has hash '%2%'") % path % hash.to_string());
 
+    stats.filesHashed++;
+    stats.bytesHashed += st.st_size;
+
+    if (reflink) {
+        if (dedupeFile(path, st, hash.to_string(Base32, false))) {
+            std::lock_guard<std::mutex> lock(inodeHash.linkMutex);
+            stats.filesLinked++;
+            stats.bytesFreed += st.st_size;
+            stats.blocksFreed += st.st_blocks;
+            if (act)
+                act->result(resFileLinked, st.st_size, st.st_blocks);
+        }
+        return;
+    }
+
+    /* Only hashing happens in parallel; changes to the links
+       directory are made by one thread at a time. */
+    std::lock_guard<std::mutex> linkLock(inodeHash.linkMutex);
+
     /* Check if this is a known hash. */
     Path linkPath = linksDir + "/" + hash.to_string(Base32, false);
 
@@ -160,6 +298,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         /* Nope, create a hard link in the links directory. */
         if (link(path.c_str(), linkPath.c_str()) == 0) {
             inodeHash.insert(st.st_ino);
+            addLink(baseNameOf(linkPath), st.st_ino);
             return;
         }
 
@@ -196,6 +335,7 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
     if (st.st_size != stLink.st_size) {
         printError(format("removing corrupted link '%1%'") % linkPath);
         unlink(linkPath.c_str());
+        removeLink(baseNameOf(linkPath));
         goto retry;
     }
 
@@ -250,27 +390,194 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 }
 
 
+string LocalStore::queryDedupSource(const string & hash)
+{
+    return retrySQLite<string>([&]() {
+        auto state(_state.lock());
+        auto use(state->stmtQueryDedupSource.use()(hash));
+        return use.next() ? use.getStr(0) : "";
+    });
+}
+
+
+void LocalStore::setDedupSource(const string & hash, const Path & path)
+{
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        state->stmtSetDedupSource.use()(hash)(string(path, realStoreDir.size() + 1)).exec();
+    });
+}
+
+
+/* Create `path' (which must not exist) as a copy of a file already
+   in the store whose NAR hash is `hash', without writing its
+   contents: with `optimise-method = reflink', by cloning the
+   DedupSources entry, otherwise by hard-linking to the file in
+   .links.  Returns false if there is no such file or it can't be
+   used. */
+bool LocalStore::reuseStoreFile(const Path & path, const Hash & hash)
+{
+    auto hashStr = hash.to_string(Base32, false);
+
+    if (settings.optimiseMethod.get() == "reflink") {
+#if __linux__ && defined(FICLONE)
+        auto source = queryDedupSource(hashStr);
+        if (source == "") return false;
+
+        Path srcPath = realStoreDir + "/" + source;
+        AutoCloseFD srcFd = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (!srcFd || fstat(srcFd.get(), &st) == -1 || !S_ISREG(st.st_mode))
+            return false;
+
+        AutoCloseFD fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+            st.st_mode & S_IXUSR ? 0777 : 0666);
+        if (!fd) return false;
+
+        /* Unlike FIDEDUPERANGE, FICLONE doesn't compare the contents,
+           and the DedupSources entry may be outdated, so check the
+           clone.  This reads the file but doesn't write it. */
+        bool ok = ioctl(fd.get(), FICLONE, srcFd.get()) == 0;
+        if (!ok)
+            debug("cannot clone '%s' to '%s': %s", srcPath, path, strerror(errno));
+        fd = -1;
+        if (ok && hashPath(htSHA256, path).first == hash) return true;
+
+        if (unlink(path.c_str()) == -1)
+            throw SysError(format("removing '%1%'") % path);
+#endif
+        return false;
+    }
+
+    Path linkPath = linksDir + "/" + hashStr;
+    if (link(linkPath.c_str(), path.c_str()) == -1) {
+        /* ENOENT: no such file; EMLINK: the link has too many
+           links. */
+        if (errno != ENOENT && errno != EMLINK)
+            debug("cannot link '%s' to '%s': %s", path, linkPath, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+
+/* Make `path' share its extents with an earlier file with the same
+   contents, without changing its inode or metadata.  The kernel
+   compares the contents itself, so an outdated DedupSources entry
+   can't cause corruption; we just pick `path' as the new source for
+   its hash.  Returns whether any extents were shared. */
+bool LocalStore::dedupeFile(const Path & path, const struct stat & st, const string & hash)
+{
+#if __linux__ && defined(FIDEDUPERANGE)
+    auto source = queryDedupSource(hash);
+    if (source == "") {
+        setDedupSource(hash, path);
+        return false;
+    }
+
+    Path srcPath = realStoreDir + "/" + source;
+    if (srcPath == path) return false;
+
+    AutoCloseFD srcFd = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat stSrc;
+    if (!srcFd || fstat(srcFd.get(), &stSrc) == -1
+        || !S_ISREG(stSrc.st_mode) || stSrc.st_size != st.st_size)
+    {
+        setDedupSource(hash, path);
+        return false;
+    }
+
+    if (stSrc.st_dev == st.st_dev && stSrc.st_ino == st.st_ino) return false;
+
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError(format("opening '%1%'") % path);
+
+    std::vector<char> buf(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info));
+    auto range = (file_dedupe_range *) buf.data();
+
+    off_t offset = 0;
+    while (offset < st.st_size) {
+        checkInterrupt();
+
+        /* File systems may dedupe less than requested (btrfs does at
+           most 16 MiB per call), so loop. */
+        memset(buf.data(), 0, buf.size());
+        range->src_offset = offset;
+        range->src_length = st.st_size - offset;
+        range->dest_count = 1;
+        range->info[0].dest_fd = fd.get();
+        range->info[0].dest_offset = offset;
+
+        if (ioctl(srcFd.get(), FIDEDUPERANGE, range) == -1) {
+            if (errno == EOPNOTSUPP || errno == EINVAL || errno == EXDEV || errno == ENOTTY) {
+                debug("cannot share extents of '%s' with '%s': %s", path, srcPath, strerror(errno));
+                return false;
+            }
+            throw SysError(format("sharing extents of '%1%' with '%2%'") % path % srcPath);
+        }
+
+        auto & info = range->info[0];
+        if (info.status == FILE_DEDUPE_RANGE_DIFFERS) {
+            printError(format("'%1%' differs from '%2%' although they have the same hash") % path % srcPath);
+            setDedupSource(hash, path);
+            return false;
+        }
+        if (info.status < 0) {
+            errno = -info.status;
+            throw SysError(format("sharing extents of '%1%' with '%2%'") % path % srcPath);
+        }
+        if (info.bytes_deduped == 0) break;
+
+        offset += info.bytes_deduped;
+    }
+
+    printMsg(lvlTalkative, format("shared extents of '%1%' with '%2%'") % path % srcPath);
+
+    return offset > 0;
+#else
+    throw Error("'optimise-method = reflink' is not supported on this platform");
+#endif
+}
+
+
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
 
     PathSet paths = queryAllValidPaths();
-    InodeHash inodeHash = loadInodeHash();
+    addTempRoots(paths);
+    InodeHash inodeHash;
+    loadInodeHash(inodeHash);
 
     act.progress(0, paths.size());
 
-    uint64_t done = 0;
+    std::atomic<uint64_t> done{0};
 
-    for (auto & i : paths) {
-        addTempRoot(i);
-        if (!isValidPath(i)) continue; /* path was GC'ed, probably */
-        {
-            Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", i));
-            optimisePath_(&act, stats, realStoreDir + "/" + baseNameOf(i), inodeHash);
-        }
-        done++;
-        act.progress(done, paths.size());
-    }
+    /* Optimise the paths in parallel.  Most of the time goes to
+       reading and hashing files. */
+    ThreadPool pool(settings.optimiseThreads);
+
+    auto startTime = std::chrono::steady_clock::now();
+
+    for (auto & i : paths)
+        pool.enqueue([&, i]() {
+            if (!isValidPath(i)) return; /* path was GC'ed, probably */
+            {
+                Activity act(*logger, lvlTalkative, actUnknown, fmt("optimising path '%s'", i));
+                optimisePath_(&act, stats, realStoreDir + "/" + baseNameOf(i), inodeHash);
+            }
+            act.progress(++done, paths.size());
+        });
+
+    pool.process();
+
+    auto duration = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    double mib = stats.bytesHashed / (1024.0 * 1024.0);
+    printInfo("hashed %d files (%.2f MiB) in %.1f s, %.2f MiB/s",
+        stats.filesHashed.load(), mib, duration, mib / std::max(duration, 1e-3));
+
+    checkLinks();
 }
 
 static string showBytes(unsigned long long bytes)
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "types.hh"
+
+#include <deque>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace nix {
+
+/* A table that interns paths, giving each distinct path a dense
+   32-bit id (the first one gets 0, the next 1, and so on). Graph
+   traversals over many paths, such as garbage collection and
+   topological sorting, can then keep hashed sets of ids or vectors
+   indexed by id instead of ordered sets of full path strings.  Not
+   thread-safe. */
+class PathTable
+{
+public:
+
+    typedef uint32_t Id;
+
+private:
+
+    /* A deque doesn't move its elements when it grows, so the keys
+       of `ids' can point into it. */
+    std::deque<Path> paths;
+    std::unordered_map<std::string_view, Id> ids;
+
+public:
+
+    /* Return the id of `path', adding it if it's not in the table
+       yet. */
+    Id intern(const Path & path)
+    {
+        auto i = ids.find(path);
+        if (i != ids.end()) return i->second;
+        Id id = paths.size();
+        paths.push_back(path);
+        ids.emplace(paths.back(), id);
+        return id;
+    }
+
+    /* Return the id of `path', if it's in the table. */
+    std::optional<Id> lookup(const Path & path) const
+    {
+        auto i = ids.find(path);
+        if (i == ids.end()) return {};
+        return i->second;
+    }
+
+    const Path & operator [] (Id id) const
+    {
+        return paths[id];
+    }
+
+    size_t size() const
+    {
+        return paths.size();
+    }
+};
+
+typedef std::unordered_set<PathTable::Id> PathIdSet;
+
+}
@@ -4,6 +4,9 @@
 
 #include <cerrno>
 #include <cstdlib>
+#include <chrono>
+#include <condition_variable>
+#include <thread>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -70,12 +73,43 @@ bool lockFile(int fd, LockType lockType, bool wait)
 }
 
 
-/* This enables us to check whether are not already holding a lock on
+/* The locks held by this process, and the threads holding them.
+   This enables us to check whether are not already holding a lock on
    a file ourselves.  POSIX locks (fcntl) suck in this respect: if we
    close a descriptor, the previous lock will be closed as well.  And
    there is no way to query whether we already have a lock (F_GETLK
-   only works on locks held by other processes). */
-static Sync<StringSet> lockedPaths_;
+   only works on locks held by other processes).
+
+   It also serves as the lock table between threads of this process:
+   a thread that wants a lock held by another thread waits on
+   `lockReleased' rather than polling the lock file, which only
+   works between processes. */
+static Sync<std::map<Path, std::thread::id>> lockedPaths_;
+
+static std::condition_variable lockReleased;
+
+PathLockStats pathLockStats;
+
+
+/* Record the time spent waiting for a lock. */
+struct LockWaitTimer
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    ~LockWaitTimer()
+    {
+        pathLockStats.waits++;
+        pathLockStats.waitTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+};
+
+
+static void releaseLock(const Path & lockPath)
+{
+    lockedPaths_.lock()->erase(lockPath);
+    lockReleased.notify_all();
+}
 
 
 PathLocks::PathLocks()
@@ -113,11 +147,22 @@ bool PathLocks::lockPaths(const PathSet & _paths,
 
         {
             auto lockedPaths(lockedPaths_.lock());
-            if (lockedPaths->count(lockPath)) {
-                if (!wait) return false;
-                throw AlreadyLocked("deadlock: trying to re-acquire self-held lock '%s'", lockPath);
+            auto i = lockedPaths->find(lockPath);
+            if (i != lockedPaths->end()) {
+                if (!wait) {
+                    unlock();
+                    return false;
+                }
+                if (i->second == std::this_thread::get_id())
+                    throw AlreadyLocked("deadlock: trying to re-acquire self-held lock '%s'", lockPath);
+                if (waitMsg != "") printError(waitMsg);
+                LockWaitTimer timer;
+                while (lockedPaths->count(lockPath)) {
+                    checkInterrupt();
+                    lockedPaths.wait_for(lockReleased, std::chrono::seconds(1));
+                }
             }
-            lockedPaths->insert(lockPath);
+            lockedPaths->emplace(lockPath, std::this_thread::get_id());
         }
 
         try {
@@ -133,12 +178,13 @@ bool PathLocks::lockPaths(const PathSet & _paths,
                 if (!lockFile(fd.get(), ltWrite, false)) {
                     if (wait) {
                         if (waitMsg != "") printError(waitMsg);
+                        LockWaitTimer timer;
                         lockFile(fd.get(), ltWrite, true);
                     } else {
                         /* Failed to lock this path; release all other
                            locks. */
                         unlock();
-                        lockedPaths_.lock()->erase(lockPath);
+                        releaseLock(lockPath);
                         return false;
                     }
                 }
@@ -164,7 +210,7 @@ bool PathLocks::lockPaths(const PathSet & _paths,
             fds.push_back(FDPair(fd.release(), lockPath));
 
         } catch (...) {
-            lockedPaths_.lock()->erase(lockPath);
+            releaseLock(lockPath);
             throw;
         }
 
@@ -189,12 +235,12 @@ void PathLocks::unlock()
     for (auto & i : fds) {
         if (deletePaths) deleteLockFile(i.second, i.first);
 
-        lockedPaths_.lock()->erase(i.second);
-
         if (close(i.first) == -1)
             printError(
                 format("error (ignored): cannot close lock file on '%1%'") % i.second);
 
+        releaseLock(i.second);
+
         debug(format("lock released on '%1%'") % i.second);
     }
 
@@ -215,4 +261,29 @@ bool pathIsLockedByMe(const Path & path)
 }
 
 
+pid_t lockHolder(const Path & path)
+{
+    Path lockPath = path + ".lock";
+
+    /* Keep other threads from locking the file while we have it
+       open, since closing our descriptor would release their lock. */
+    auto lockedPaths(lockedPaths_.lock());
+    if (lockedPaths->count(lockPath)) return 0;
+
+    AutoCloseFD fd = open(lockPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) return 0;
+
+    struct flock lock;
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = 0;
+    lock.l_len = 0; /* entire file */
+
+    if (fcntl(fd.get(), F_GETLK, &lock) == -1)
+        throw SysError("querying lock '%s'", lockPath);
+
+    return lock.l_type == F_UNLCK ? 0 : lock.l_pid;
+}
+
+
 }
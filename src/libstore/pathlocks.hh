@@ -2,6 +2,8 @@
 
 #include "util.hh"
 
+#include <atomic>
+
 namespace nix {
 
 /* Open (possibly create) a lock file and return the file descriptor.
@@ -39,4 +41,20 @@ public:
 
 bool pathIsLockedByMe(const Path & path);
 
+/* Return the process ID of another process that holds the lock on
+   `path' (as acquired by PathLocks), or 0 if there is none. */
+pid_t lockHolder(const Path & path);
+
+/* Time spent by this process waiting for path locks. */
+struct PathLockStats
+{
+    std::atomic<uint64_t> waits{0};
+    std::atomic<uint64_t> waitTimeMs{0};
+};
+
+extern PathLockStats pathLockStats;
+
+/* Likewise for the global GC lock (see LocalStore::openGCLock()). */
+extern PathLockStats gcLockStats;
+
 }
@@ -0,0 +1,274 @@
+#include "store-api.hh"
+#include "crypto.hh"
+#include "globals.hh"
+#include "lru-cache.hh"
+#include "sync.hh"
+
+#include <sys/stat.h>
+
+namespace nix {
+
+static std::string uriScheme = "peers://";
+
+/* A substituter that fetches paths from other machines on the local
+   network, each of which serves its store as a binary cache (e.g.
+   with nix-serve), rather than from upstream. All peers are asked
+   for a path concurrently and the NAR is fetched from one that has
+   it. Since this store isn't trusted by default, paths from peers
+   must still be signed by a key in `trusted-public-keys'.
+
+   The peers are given by the `peers' setting and by `peers-file',
+   which is reread whenever it changes, so that it can be maintained
+   by a service discovery daemon (e.g. from mDNS announcements). */
+class PeerStore : public Store
+{
+public:
+
+    const Setting<std::string> peers{this, "", "peers",
+        "comma- or space-separated URIs of the binary caches served by peers"};
+    const Setting<Path> peersFile{this, "", "peers-file",
+        "file listing the URIs of the binary caches served by peers, one per line, reread when it changes"};
+    const Setting<int> priority{this, 30, "priority",
+        "priority of this substituter (lower value means higher priority)"};
+
+private:
+
+    struct State
+    {
+        /* The peer stores by URI; null if opening the store failed. */
+        std::map<std::string, std::shared_ptr<Store>> opened;
+        std::vector<ref<Store>> peers;
+        bool initialised = false;
+        time_t peersFileMTime = 0;
+
+        /* The peers that have a path, with the NAR hash of the info
+           returned for it. */
+        LRUCache<Path, std::vector<ref<Store>>> owners{65536};
+    };
+
+    Sync<State> state_;
+
+    /* The keys that the info returned by a peer must be signed
+       with, unless the peer is trusted or signatures aren't
+       required. */
+    PublicKeys publicKeys;
+
+public:
+
+    PeerStore(const Params & params)
+        : Store(params)
+        , publicKeys(getDefaultPublicKeys())
+    {
+    }
+
+    std::string getUri() override
+    {
+        return uriScheme;
+    }
+
+    int getPriority() override
+    {
+        return priority;
+    }
+
+private:
+
+    /* Return the current peers, (re)opening them if the list of peers
+       has changed. */
+    std::vector<ref<Store>> getPeers()
+    {
+        auto state(state_.lock());
+
+        time_t mtime = 0;
+        if (peersFile != "") {
+            struct stat st;
+            if (stat(peersFile.get().c_str(), &st) == 0)
+                mtime = st.st_mtime;
+        }
+
+        if (state->initialised && mtime == state->peersFileMTime)
+            return state->peers;
+
+        auto uris = tokenizeString<Strings>(peers.get(), ", \t\n");
+        if (mtime)
+            for (auto & uri : tokenizeString<Strings>(readFile(peersFile), " \t\n"))
+                uris.push_back(uri);
+
+        std::map<std::string, std::shared_ptr<Store>> opened;
+        std::vector<ref<Store>> res;
+
+        for (auto & uri : uris) {
+            if (hasPrefix(uri, uriScheme) || opened.count(uri)) continue;
+            auto i = state->opened.find(uri);
+            std::shared_ptr<Store> store;
+            /* Peers that couldn't be opened are retried when the list
+               changes. */
+            if (i != state->opened.end() && i->second)
+                store = i->second;
+            else
+                try {
+                    store = openStore(uri);
+                } catch (Error & e) {
+                    printError("warning: cannot use peer '%s': %s", uri, e.what());
+                }
+            opened[uri] = store;
+            if (store) res.push_back(ref<Store>(store));
+        }
+
+        debug("using %d peers", res.size());
+
+        state->opened = std::move(opened);
+        state->peers = res;
+        state->peersFileMTime = mtime;
+        state->initialised = true;
+
+        return res;
+    }
+
+    void addOwner(const Path & path, ref<Store> peer)
+    {
+        auto state(state_.lock());
+        auto owners = state->owners.get(path);
+        std::vector<ref<Store>> res;
+        if (owners) res = *owners;
+        res.push_back(peer);
+        state->owners.upsert(path, res);
+    }
+
+public:
+
+    void queryPathInfoUncached(const Path & path,
+        Callback<std::shared_ptr<ValidPathInfo>> callback) override
+    {
+        auto peers = getPeers();
+        if (peers.empty()) return callback(nullptr);
+
+        state_.lock()->owners.erase(path);
+
+        struct Query
+        {
+            size_t left;
+            /* The NAR hash of the first answer. Peers that return a
+               different one (e.g. from a non-deterministic build)
+               aren't used. */
+            Hash narHash;
+        };
+
+        auto query = std::make_shared<Sync<Query>>();
+        query->lock()->left = peers.size();
+
+        /* The peers may answer after this store has been released by
+           everybody else, so keep it alive until they have. */
+        auto self = std::dynamic_pointer_cast<PeerStore>(shared_from_this());
+
+        for (auto & peer : peers)
+            peer->queryPathInfo(path,
+                {[self, path, peer, query, callback](std::future<ref<ValidPathInfo>> fut) {
+                    std::shared_ptr<ValidPathInfo> info;
+                    try {
+                        info = fut.get().get_ptr();
+                    } catch (InvalidPath &) {
+                    } catch (Error & e) {
+                        debug("cannot query peer '%s' about '%s': %s", peer->getUri(), path, e.what());
+                    }
+
+                    /* Check the signatures before the answer can fix
+                       the NAR hash, so that an untrusted peer can't
+                       keep the others from being used. */
+                    if (info && settings.requireSigs && !peer->isTrusted
+                        && !info->checkSignatures(*self, self->publicKeys))
+                    {
+                        printError("warning: ignoring unsigned info about '%s' from peer '%s'", path, peer->getUri());
+                        info = nullptr;
+                    }
+
+                    bool answer = false, missing = false;
+                    {
+                        auto q(query->lock());
+                        q->left--;
+                        if (info && (!q->narHash || info->narHash == q->narHash)) {
+                            answer = !q->narHash;
+                            q->narHash = info->narHash;
+                            self->addOwner(path, peer);
+                        }
+                        missing = !q->left && !q->narHash;
+                    }
+
+                    try {
+                        if (answer)
+                            callback(std::make_shared<ValidPathInfo>(*info));
+                        else if (missing)
+                            callback(nullptr);
+                    } catch (...) {
+                        ignoreException();
+                    }
+                }});
+    }
+
+    Path queryPathFromHashPart(const string & hashPart) override
+    { unsupported("queryPathFromHashPart"); }
+
+    void narFromPath(const Path & path, Sink & sink) override
+    {
+        queryPathInfo(path);
+
+        std::vector<ref<Store>> owners;
+        {
+            auto state(state_.lock());
+            if (auto o = state->owners.get(path)) owners = *o;
+        }
+
+        uint64_t narSize = 0;
+        LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
+            sink(data, len);
+            narSize += len;
+        });
+
+        /* Try the peers in turn, as long as nothing has been written
+           to `sink'. */
+        for (auto & peer : owners) {
+            try {
+                peer->narFromPath(path, wrapperSink);
+                stats.narRead++;
+                stats.narReadBytes += narSize;
+                return;
+            } catch (Error & e) {
+                if (narSize) throw;
+                printError("warning: cannot fetch '%s' from peer '%s': %s", path, peer->getUri(), e.what());
+            }
+        }
+
+        throw SubstituteGone("no peer can provide '%s' any more", path);
+    }
+
+    Path addToStore(const string & name, const Path & srcPath,
+        bool recursive, HashType hashAlgo,
+        PathFilter & filter, RepairFlag repair) override
+    { unsupported("addToStore"); }
+
+    Path addTextToStore(const string & name, const string & s,
+        const PathSet & references, RepairFlag repair) override
+    { unsupported("addTextToStore"); }
+
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override
+    { unsupported("addToStore"); }
+
+    BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
+        BuildMode buildMode) override
+    { unsupported("buildDerivation"); }
+
+    void ensurePath(const Path & path) override
+    { unsupported("ensurePath"); }
+};
+
+static RegisterStoreImplementation regStore([](
+    const std::string & uri, const Store::Params & params)
+    -> std::shared_ptr<Store>
+{
+    if (uri != uriScheme) return 0;
+    return std::make_shared<PeerStore>(params);
+});
+
+}
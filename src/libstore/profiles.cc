@@ -4,6 +4,7 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <errno.h>
 #include <stdio.h>
@@ -34,35 +35,87 @@ static int parseName(const string & profileName, const string & name)
 }
 
 
+/* Split a generation name of the format `<profilename>-<number>-link'
+   into the profile name and the number. */
+static std::optional<std::pair<string, int>> parseGenerationName(const string & name)
+{
+    if (!hasSuffix(name, "-link")) return {};
+    string s(name, 0, name.size() - 5);
+    auto dash = s.rfind('-');
+    if (dash == string::npos) return {};
+    int n;
+    if (!string2Int(string(s, dash + 1), n) || n < 0) return {};
+    return std::make_pair(string(s, 0, dash), n);
+}
 
-Generations findGenerations(Path profile, int & curGen)
+
+/* Read the generations of the profiles in `profileDir', or only those
+   of `profileName' if it's set. The directory is read once, and the
+   generation links are stat'ed relative to it. */
+static std::map<string, Generations> readGenerations(const Path & profileDir,
+    const std::optional<string> & profileName)
 {
-    Generations gens;
+    std::map<string, Generations> res;
 
-    Path profileDir = dirOf(profile);
-    string profileName = baseNameOf(profile);
+    AutoCloseFD fd = open(profileDir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!fd) throw SysError("opening directory '%s'", profileDir);
 
-    for (auto & i : readDirectory(profileDir)) {
+    for (auto & i : readDirectory(fd.get(), profileDir)) {
+        string name;
         int n;
-        if ((n = parseName(profileName, i.name)) != -1) {
-            Generation gen;
-            gen.path = profileDir + "/" + i.name;
-            gen.number = n;
-            struct stat st;
-            if (lstat(gen.path.c_str(), &st) != 0)
-                throw SysError(format("statting '%1%'") % gen.path);
-            gen.creationTime = st.st_mtime;
-            gens.push_back(gen);
+        if (profileName) {
+            name = *profileName;
+            n = parseName(name, i.name);
+        } else if (auto gen = parseGenerationName(i.name)) {
+            name = gen->first;
+            n = gen->second;
+        } else
+            continue;
+        if (n == -1) continue;
+
+        Generation gen;
+        gen.path = profileDir + "/" + i.name;
+        gen.number = n;
+        struct stat st;
+        if (fstatat(fd.get(), i.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            /* Deleted by a concurrent nix-collect-garbage. */
+            if (errno == ENOENT && !profileName) continue;
+            throw SysError(format("statting '%1%'") % gen.path);
         }
+        gen.creationTime = st.st_mtime;
+        res[name].push_back(gen);
     }
 
-    gens.sort(cmpGensByNumber);
+    for (auto & i : res)
+        i.second.sort(cmpGensByNumber);
+
+    return res;
+}
+
 
-    curGen = pathExists(profile)
-        ? parseName(profileName, readLink(profile))
+static int currentGeneration(const Path & profile)
+{
+    return pathExists(profile)
+        ? parseName(baseNameOf(profile), readLink(profile))
         : -1;
+}
+
+
+Generations findGenerations(Path profile, int & curGen)
+{
+    string profileName = baseNameOf(profile);
+
+    auto gens = readGenerations(dirOf(profile), profileName);
+
+    curGen = currentGeneration(profile);
+
+    return std::move(gens[profileName]);
+}
+
 
-    return gens;
+std::map<string, Generations> findAllGenerations(const Path & profileDir)
+{
+    return readGenerations(profileDir, {});
 }
 
 
@@ -132,10 +185,16 @@ void deleteGeneration(const Path & profile, unsigned int gen)
 static void deleteGeneration2(const Path & profile, unsigned int gen, bool dryRun)
 {
     if (dryRun)
-        printInfo(format("would remove generation %1%") % gen);
+        printInfo(format("would remove generation %1% of '%2%'") % gen % profile);
     else {
-        printInfo(format("removing generation %1%") % gen);
-        deleteGeneration(profile, gen);
+        printInfo(format("removing generation %1% of '%2%'") % gen % profile);
+        try {
+            deleteGeneration(profile, gen);
+        } catch (SysError & e) {
+            /* The generation may have been listed before we acquired
+               the lock, and deleted by another process since. */
+            if (e.errNo != ENOENT) throw;
+        }
     }
 }
 
@@ -181,6 +240,15 @@ void deleteGenerationsGreaterThan(const Path & profile, int max, bool dryRun)
     }
 }
 
+static void deleteOldGenerations(const Path & profile, const Generations & gens,
+    int curGen, bool dryRun)
+{
+    for (auto & i : gens)
+        if (i.number != curGen)
+            deleteGeneration2(profile, i.number, dryRun);
+}
+
+
 void deleteOldGenerations(const Path & profile, bool dryRun)
 {
     PathLocks lock;
@@ -189,20 +257,22 @@ void deleteOldGenerations(const Path & profile, bool dryRun)
     int curGen;
     Generations gens = findGenerations(profile, curGen);
 
-    for (auto & i : gens)
-        if (i.number != curGen)
-            deleteGeneration2(profile, i.number, dryRun);
+    deleteOldGenerations(profile, gens, curGen, dryRun);
 }
 
 
-void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun)
+void deleteOldGenerations(const Path & profile, const Generations & gens, bool dryRun)
 {
     PathLocks lock;
     lockProfile(lock, profile);
 
-    int curGen;
-    Generations gens = findGenerations(profile, curGen);
+    deleteOldGenerations(profile, gens, currentGeneration(profile), dryRun);
+}
 
+
+static void deleteGenerationsOlderThan(const Path & profile, const Generations & gens,
+    int curGen, time_t t, bool dryRun)
+{
     bool canDelete = false;
     for (auto i = gens.rbegin(); i != gens.rend(); ++i)
         if (canDelete) {
@@ -219,7 +289,29 @@ void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun)
 }
 
 
-void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, bool dryRun)
+void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun)
+{
+    PathLocks lock;
+    lockProfile(lock, profile);
+
+    int curGen;
+    Generations gens = findGenerations(profile, curGen);
+
+    deleteGenerationsOlderThan(profile, gens, curGen, t, dryRun);
+}
+
+
+void deleteGenerationsOlderThan(const Path & profile, const Generations & gens,
+    time_t t, bool dryRun)
+{
+    PathLocks lock;
+    lockProfile(lock, profile);
+
+    deleteGenerationsOlderThan(profile, gens, currentGeneration(profile), t, dryRun);
+}
+
+
+time_t parseOlderThanTimeSpec(const string & timeSpec)
 {
     time_t curTime = time(0);
     string strDays = string(timeSpec, 0, timeSpec.size() - 1);
@@ -228,9 +320,13 @@ void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, b
     if (!string2Int(strDays, days) || days < 1)
         throw Error(format("invalid number of days specifier '%1%'") % timeSpec);
 
-    time_t oldTime = curTime - days * 24 * 3600;
+    return curTime - days * 24 * 3600;
+}
 
-    deleteGenerationsOlderThan(profile, oldTime, dryRun);
+
+void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, bool dryRun)
+{
+    deleteGenerationsOlderThan(profile, parseOlderThanTimeSpec(timeSpec), dryRun);
 }
 
 
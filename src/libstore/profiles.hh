@@ -31,6 +31,10 @@ typedef list<Generation> Generations;
    profile, sorted by generation number. */
 Generations findGenerations(Path profile, int & curGen);
 
+/* Returns the generations of all profiles in `profileDir', keyed by
+   the name of the profile, reading the directory only once. */
+std::map<string, Generations> findAllGenerations(const Path & profileDir);
+
 class LocalFSStore;
 
 Path createGeneration(ref<LocalFSStore> store, Path profile, Path outPath);
@@ -47,6 +51,17 @@ void deleteGenerationsOlderThan(const Path & profile, time_t t, bool dryRun);
 
 void deleteGenerationsOlderThan(const Path & profile, const string & timeSpec, bool dryRun);
 
+/* Like the functions above, but using the generations `gens' of
+   `profile' previously returned by findAllGenerations() rather than
+   reading the profile directory again. */
+void deleteOldGenerations(const Path & profile, const Generations & gens, bool dryRun);
+
+void deleteGenerationsOlderThan(const Path & profile, const Generations & gens,
+    time_t t, bool dryRun);
+
+/* Parse the argument of `--delete-older-than', e.g. `30d'. */
+time_t parseOlderThanTimeSpec(const string & timeSpec);
+
 void switchLink(Path link, Path target);
 
 /* Ensure exclusive access to a profile.  Any command that modifies
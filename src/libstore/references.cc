@@ -3,88 +3,208 @@
 #include "util.hh"
 #include "archive.hh"
 
+#include <array>
 #include <map>
 #include <cstdlib>
+#include <cstring>
+
+#if __SSE2__
+#include <emmintrin.h>
+#endif
 
 
 namespace nix {
 
 
-static unsigned int refLength = 32; /* characters */
+static const size_t refLength = 32; /* characters */
 
 
-static void search(const unsigned char * s, size_t len,
-    StringSet & hashes, StringSet & seen)
+/* An open-addressing hash table of the hash parts we're looking for,
+   so that checking a candidate doesn't allocate. It isn't modified
+   by a search, so it can be shared by concurrent searches; each one
+   keeps track of the slots it has seen in its own vector. */
+struct RefTable
 {
-    static bool initialised = false;
-    static bool isBase32[256];
-    if (!initialised) {
-        for (unsigned int i = 0; i < 256; ++i) isBase32[i] = false;
-        for (unsigned int i = 0; i < base32Chars.size(); ++i)
-            isBase32[(unsigned char) base32Chars[i]] = true;
-        initialised = true;
+    std::vector<std::array<char, refLength>> slots;
+    std::vector<unsigned char> state; // 0 = empty, 1 = in use
+    size_t mask = 0;
+
+    void init(const StringSet & hashes)
+    {
+        size_t size = 16;
+        while (size < hashes.size() * 2) size *= 2;
+        slots.resize(size);
+        state.assign(size, 0);
+        mask = size - 1;
+        for (auto & h : hashes) {
+            auto i = find((const unsigned char *) h.data());
+            memcpy(slots[i].data(), h.data(), refLength);
+            state[i] = 1;
+        }
     }
 
-    for (size_t i = 0; i + refLength <= len; ) {
-        int j;
-        bool match = true;
-        for (j = refLength - 1; j >= 0; --j)
-            if (!isBase32[(unsigned char) s[i + j]]) {
-                i += j + 1;
-                match = false;
-                break;
-            }
-        if (!match) continue;
-        string ref((const char *) s + i, refLength);
-        if (hashes.find(ref) != hashes.end()) {
-            debug(format("found reference to '%1%' at offset '%2%'")
-                  % ref % i);
-            seen.insert(ref);
-            hashes.erase(ref);
+    /* Return the slot containing `s', or the empty slot where it
+       would go. */
+    size_t find(const unsigned char * s) const
+    {
+        uint64_t h;
+        memcpy(&h, s, sizeof(h));
+        size_t i = (h * 0x9e3779b97f4a7c15ULL) >> 32 & mask;
+        while (state[i] && memcmp(slots[i].data(), s, refLength) != 0)
+            i = (i + 1) & mask;
+        return i;
+    }
+};
+
+
+static bool isBase32[256];
+
+static bool initIsBase32()
+{
+    for (auto c : base32Chars) isBase32[(unsigned char) c] = true;
+    return true;
+}
+
+
+#if __SSE2__
+/* Return a mask of the bytes of s[0..15] that are base-32 digits,
+   i.e. '0'-'9' or 'a'-'z' except 'e', 'o', 'u' and 't'. */
+static unsigned int base32Mask(const unsigned char * s)
+{
+    auto c = _mm_loadu_si128((const __m128i *) s);
+    auto inRange = [&](char lo, char hi) {
+        return _mm_and_si128(
+            _mm_cmpgt_epi8(c, _mm_set1_epi8(lo - 1)),
+            _mm_cmplt_epi8(c, _mm_set1_epi8(hi + 1)));
+    };
+    auto excluded = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('e')), _mm_cmpeq_epi8(c, _mm_set1_epi8('o'))),
+        _mm_or_si128(_mm_cmpeq_epi8(c, _mm_set1_epi8('u')), _mm_cmpeq_epi8(c, _mm_set1_epi8('t'))));
+    return _mm_movemask_epi8(_mm_andnot_si128(excluded,
+        _mm_or_si128(inRange('0', '9'), inRange('a', 'z'))));
+}
+#endif
+
+
+/* Look up every window of `refLength' characters in the run of
+   base-32 digits s[start..end), calling `found(offset)' for the first
+   occurrence of each hash part not marked in `seen' yet. */
+template<typename F>
+static void checkRun(const unsigned char * s, size_t start, size_t end,
+    const RefTable & hashes, std::vector<bool> & seen, F & found)
+{
+    for (size_t i = start; i + refLength <= end; ++i) {
+        auto j = hashes.find(s + i);
+        if (hashes.state[j] && !seen[j]) {
+            seen[j] = true;
+            found(i);
         }
-        ++i;
     }
 }
 
 
+/* Find the runs of at least `refLength' base-32 digits in `s' and
+   look up the hash parts in them. */
+template<typename F>
+static void search(const unsigned char * s, size_t len,
+    const RefTable & hashes, std::vector<bool> & seen, F && found)
+{
+    static bool initialised = initIsBase32();
+    (void) initialised;
+
+    size_t runStart = 0, i = 0;
+
+#if __SSE2__
+    /* Find the non-base-32 bytes 16 at a time.  Runs between two of
+       them within a block are too short to matter, so only the first
+       and the last one in each block are relevant. */
+    for (; i + 16 <= len; i += 16) {
+        unsigned int bad = ~base32Mask(s + i) & 0xffff;
+        if (!bad) continue;
+        size_t first = i + __builtin_ctz(bad);
+        if (first - runStart >= refLength)
+            checkRun(s, runStart, first, hashes, seen, found);
+        runStart = i + 32 - __builtin_clz(bad);
+    }
+#endif
+
+    for (; i < len; ++i)
+        if (!isBase32[s[i]]) {
+            if (i - runStart >= refLength)
+                checkRun(s, runStart, i, hashes, seen, found);
+            runStart = i + 1;
+        }
+
+    if (len - runStart >= refLength)
+        checkRun(s, runStart, len, hashes, seen, found);
+}
+
+
 struct RefScanSink : Sink
 {
     HashSink hashSink;
-    StringSet hashes;
+    RefTable hashes;
+    std::vector<bool> seenSlots;
     StringSet seen;
 
-    string tail;
+    /* The last `refLength' bytes of the previous fragments. */
+    unsigned char tail[refLength];
+    size_t tailLen = 0;
+
+    Sink * tee = nullptr;
 
     RefScanSink() : hashSink(htSHA256) { }
 
     void operator () (const unsigned char * data, size_t len);
+
+    void search(const unsigned char * s, size_t len)
+    {
+        nix::search(s, len, hashes, seenSlots, [&](size_t offset) {
+            string ref((const char *) s + offset, refLength);
+            debug(format("found reference to '%1%' at offset '%2%'")
+                  % ref % offset);
+            seen.insert(ref);
+        });
+    }
 };
 
 
 void RefScanSink::operator () (const unsigned char * data, size_t len)
 {
     hashSink(data, len);
+    if (tee) (*tee)(data, len);
 
     /* It's possible that a reference spans the previous and current
        fragment, so search in the concatenation of the tail of the
        previous fragment and the start of the current fragment. */
-    string s = tail + string((const char *) data, len > refLength ? refLength : len);
-    search((const unsigned char *) s.data(), s.size(), hashes, seen);
+    unsigned char buf[2 * refLength];
+    size_t headLen = std::min(len, refLength);
+    memcpy(buf, tail, tailLen);
+    memcpy(buf + tailLen, data, headLen);
+    search(buf, tailLen + headLen);
 
-    search(data, len, hashes, seen);
+    search(data, len);
 
-    size_t tailLen = len <= refLength ? len : refLength;
-    tail =
-        string(tail, tail.size() < refLength - tailLen ? 0 : tail.size() - (refLength - tailLen)) +
-        string((const char *) data + len - tailLen, tailLen);
+    /* Keep the last `refLength' bytes of tail + data. */
+    if (len >= refLength) {
+        memcpy(tail, data + len - refLength, refLength);
+        tailLen = refLength;
+    } else {
+        size_t keep = std::min(tailLen, refLength - len);
+        memmove(tail, tail + tailLen - keep, keep);
+        memcpy(tail + keep, data, len);
+        tailLen = keep + len;
+    }
 }
 
 
 PathSet scanForReferences(const string & path,
-    const PathSet & refs, HashResult & hash)
+    const PathSet & refs, HashResult & hash, Sink * tee)
 {
     RefScanSink sink;
+    sink.tee = tee;
     std::map<string, Path> backMap;
+    StringSet hashes;
 
     /* For efficiency (and a higher hit rate), just search for the
        hash part of the file name.  (This assumes that all references
@@ -98,9 +218,11 @@ PathSet scanForReferences(const string & path,
         assert(s.size() == refLength);
         assert(backMap.find(s) == backMap.end());
         // parseHash(htSHA256, s);
-        sink.hashes.insert(s);
+        hashes.insert(s);
         backMap[s] = i;
     }
+    sink.hashes.init(hashes);
+    sink.seenSlots.resize(sink.hashes.slots.size());
 
     /* Look for the hashes in the NAR dump of the path. */
     dumpPath(path, sink);
@@ -119,4 +241,33 @@ PathSet scanForReferences(const string & path,
 }
 
 
+struct RefScanner::Table : RefTable { };
+
+
+RefScanner::RefScanner(const StringSet & hashes)
+    : table(std::make_unique<Table>())
+{
+    for (auto & h : hashes)
+        assert(h.size() == refLength);
+    table->init(hashes);
+}
+
+
+RefScanner::~RefScanner()
+{
+}
+
+
+std::map<std::string, size_t> RefScanner::scan(std::string_view data) const
+{
+    std::vector<bool> seen(table->slots.size());
+    std::map<std::string, size_t> res;
+    auto s = (const unsigned char *) data.data();
+    search(s, data.size(), *table, seen, [&](size_t offset) {
+        res.emplace(std::string((const char *) s + offset, refLength), offset);
+    });
+    return res;
+}
+
+
 }
@@ -5,7 +5,29 @@
 
 namespace nix {
 
+/* Return the elements of `refs' referenced by the NAR serialisation
+   of `path', and set `hash' to its SHA-256 hash.  If `tee' is set,
+   the serialisation is also written to it. */
 PathSet scanForReferences(const Path & path, const PathSet & refs,
-    HashResult & hash);
-    
+    HashResult & hash, Sink * tee = nullptr);
+
+/* Finds occurrences of a set of base-32 hash parts in strings, using
+   the same scanner as scanForReferences(). scan() may be called from
+   several threads at once. */
+class RefScanner
+{
+    struct Table;
+    std::unique_ptr<Table> table;
+
+public:
+
+    RefScanner(const StringSet & hashes);
+
+    ~RefScanner();
+
+    /* Return the offset of the first occurrence in `data' of each
+       hash part that occurs in it. */
+    std::map<std::string, size_t> scan(std::string_view data) const;
+};
+
 }
@@ -0,0 +1,374 @@
+#include "refs-graph.hh"
+#include "local-store.hh"
+#include "globals.hh"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <string_view>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+
+static const char refsGraphMagic[8] = {'N', 'I', 'X', 'R', 'E', 'F', 'S', '1'};
+
+
+struct RefsGraphHeader
+{
+    char magic[8];
+    uint64_t maxId; // highest ValidPaths id when the image was written
+    uint64_t nrPaths;
+    uint64_t nrEdges;
+    uint64_t poolSize;
+};
+
+
+/* The image consists of the header followed by these arrays, each
+   starting at a multiple of 8 bytes:
+
+     uint64_t pathOffsets[nrPaths + 1]   offsets of the paths in `pool'
+     uint64_t fwdStart[nrPaths + 1]      references of path i are
+     uint32_t fwdEdges[nrEdges]            fwdEdges[fwdStart[i] .. fwdStart[i + 1]]
+     uint64_t revStart[nrPaths + 1]      likewise for referrers
+     uint32_t revEdges[nrEdges]
+     char pool[poolSize]                 the paths, in sorted order */
+struct RefsGraph::Image
+{
+    std::string buf;
+    void * map = nullptr;
+    size_t mapSize = 0;
+
+    const RefsGraphHeader * header = nullptr;
+    const uint64_t * pathOffsets, * fwdStart, * revStart;
+    const uint32_t * fwdEdges, * revEdges;
+    const char * pool;
+
+    ~Image()
+    {
+        if (map) munmap(map, mapSize);
+    }
+
+    static size_t align(size_t n) { return (n + 7) & ~(size_t) 7; }
+
+    static size_t imageSize(uint64_t nrPaths, uint64_t nrEdges, uint64_t poolSize)
+    {
+        return sizeof(RefsGraphHeader)
+            + 3 * align((nrPaths + 1) * sizeof(uint64_t))
+            + 2 * align(nrEdges * sizeof(uint32_t))
+            + poolSize;
+    }
+
+    /* Set up the array pointers for the image at `data'. Returns
+       false if it isn't a valid image. */
+    bool init(const char * data, size_t size)
+    {
+        if (size < sizeof(RefsGraphHeader)) return false;
+        header = (const RefsGraphHeader *) data;
+        if (memcmp(header->magic, refsGraphMagic, sizeof(refsGraphMagic)) != 0
+            || header->nrPaths >= UINT32_MAX
+            || size != imageSize(header->nrPaths, header->nrEdges, header->poolSize))
+            return false;
+
+        auto p = data + sizeof(RefsGraphHeader);
+        auto nodes = align((header->nrPaths + 1) * sizeof(uint64_t));
+        auto edges = align(header->nrEdges * sizeof(uint32_t));
+        pathOffsets = (const uint64_t *) p; p += nodes;
+        fwdStart = (const uint64_t *) p; p += nodes;
+        fwdEdges = (const uint32_t *) p; p += edges;
+        revStart = (const uint64_t *) p; p += nodes;
+        revEdges = (const uint32_t *) p; p += edges;
+        pool = p;
+        return true;
+    }
+
+    std::string_view pathAt(uint32_t i) const
+    {
+        return std::string_view(pool + pathOffsets[i], pathOffsets[i + 1] - pathOffsets[i]);
+    }
+
+    /* Return the index of `path', or -1 if it's not in the image. */
+    int64_t find(const Path & path) const
+    {
+        uint64_t lo = 0, hi = header->nrPaths;
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            auto c = pathAt(mid).compare(path);
+            if (c == 0) return mid;
+            if (c < 0) lo = mid + 1; else hi = mid;
+        }
+        return -1;
+    }
+};
+
+
+RefsGraph::RefsGraph(std::shared_ptr<Image> image)
+    : image(image)
+{
+}
+
+
+RefsGraph::~RefsGraph()
+{
+}
+
+
+bool RefsGraph::isValidPath(const Path & path) const
+{
+    return image->find(path) != -1 || extraPaths.count(path);
+}
+
+
+void RefsGraph::queryReferences(const Path & path, PathSet & references) const
+{
+    auto i = image->find(path);
+    if (i != -1)
+        for (auto j = image->fwdStart[i]; j < image->fwdStart[i + 1]; ++j)
+            references.insert(Path(image->pathAt(image->fwdEdges[j])));
+
+    auto j = extraReferences.find(path);
+    if (j != extraReferences.end())
+        references.insert(j->second.begin(), j->second.end());
+}
+
+
+void RefsGraph::queryReferrers(const Path & path, PathSet & referrers) const
+{
+    auto i = image->find(path);
+    if (i != -1)
+        for (auto j = image->revStart[i]; j < image->revStart[i + 1]; ++j)
+            referrers.insert(Path(image->pathAt(image->revEdges[j])));
+
+    auto j = extraReferrers.find(path);
+    if (j != extraReferrers.end())
+        referrers.insert(j->second.begin(), j->second.end());
+}
+
+
+void RefsGraph::computeClosure(const PathSet & startPaths, PathSet & paths,
+    bool flipDirection) const
+{
+    Paths todo;
+
+    for (auto & path : startPaths) {
+        if (!isValidPath(path))
+            throw InvalidPath("path '%s' is not valid", path);
+        if (paths.insert(path).second) todo.push_back(path);
+    }
+
+    while (!todo.empty()) {
+        auto path = todo.front();
+        todo.pop_front();
+
+        PathSet next;
+        if (flipDirection)
+            queryReferrers(path, next);
+        else
+            queryReferences(path, next);
+
+        for (auto & p : next)
+            if (paths.insert(p).second) todo.push_back(p);
+    }
+}
+
+
+size_t RefsGraph::size() const
+{
+    return image->header->nrPaths + extraPaths.size();
+}
+
+
+static std::shared_ptr<RefsGraph::Image> loadRefsGraphImage(const Path & fileName)
+{
+    AutoCloseFD fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) return nullptr;
+
+    struct stat st;
+    if (fstat(fd.get(), &st) == -1)
+        throw SysError("statting '%s'", fileName);
+
+    auto image = std::make_shared<RefsGraph::Image>();
+
+    if (st.st_size == 0) return nullptr;
+    image->mapSize = st.st_size;
+    image->map = mmap(nullptr, image->mapSize, PROT_READ, MAP_SHARED, fd.get(), 0);
+    if (image->map == MAP_FAILED) {
+        image->map = nullptr;
+        throw SysError("mapping '%s'", fileName);
+    }
+
+    if (!image->init((const char *) image->map, image->mapSize)) {
+        printError("ignoring corrupt reference graph '%s'", fileName);
+        return nullptr;
+    }
+
+    return image;
+}
+
+
+void LocalStore::invalidateRefsGraph(State & state)
+{
+    state.refsGraphGeneration++;
+    auto fileName = dbDir + "/refs-graph";
+    if (unlink(fileName.c_str()) == -1 && errno != ENOENT)
+        printError("warning: cannot delete '%s': %s", fileName, strerror(errno));
+}
+
+
+std::shared_ptr<RefsGraph> LocalStore::getRefsGraph(bool rebuild)
+{
+    auto fileName = dbDir + "/refs-graph";
+
+    /* The contents of a new image, read from the database. */
+    uint64_t maxId, nrValid;
+    std::vector<uint64_t> pathOffsets;
+    std::string pool;
+    std::vector<std::pair<uint32_t, uint32_t>> edges;
+    uint64_t generation;
+
+    auto result = retrySQLite<std::shared_ptr<RefsGraph>>([&]() -> std::shared_ptr<RefsGraph> {
+        auto state(_state.lock());
+
+        generation = state->refsGraphGeneration;
+
+        /* Read everything in one transaction so that the image and
+           the paths added since are consistent. */
+        SQLiteTxn txn(state->db);
+
+        {
+            SQLiteStmt stmt(state->db, "select coalesce(max(id), 0), count(*) from ValidPaths;");
+            auto use(stmt.use());
+            use.next();
+            maxId = use.getInt(0);
+            nrValid = use.getInt(1);
+        }
+
+        auto image = loadRefsGraphImage(fileName);
+
+        if (image) {
+            auto header = image->header;
+
+            if (header->maxId == maxId && header->nrPaths == nrValid)
+                return std::make_shared<RefsGraph>(image);
+
+            /* If no paths have been invalidated since the image was
+               written and not too many have been added, read the new
+               ones from the database. */
+            auto graph = std::make_shared<RefsGraph>(image);
+
+            SQLiteStmt stmtNew(state->db, "select path from ValidPaths where id > ?;");
+            auto use(stmtNew.use()((int64_t) header->maxId));
+            while (use.next())
+                graph->extraPaths.insert(use.getStr(0));
+
+            if (header->maxId <= maxId
+                && header->nrPaths + graph->extraPaths.size() == nrValid
+                && graph->extraPaths.size() <= header->nrPaths / 8)
+            {
+                SQLiteStmt stmtRefs(state->db,
+                    "select a.path, b.path from Refs r join ValidPaths a on a.id = r.referrer "
+                    "join ValidPaths b on b.id = r.reference where r.referrer > ?;");
+                auto use(stmtRefs.use()((int64_t) header->maxId));
+                while (use.next()) {
+                    auto referrer = use.getStr(0), reference = use.getStr(1);
+                    graph->extraReferences[referrer].insert(reference);
+                    graph->extraReferrers[reference].insert(referrer);
+                }
+                return graph;
+            }
+        }
+
+        if (!rebuild) return nullptr;
+
+        debug("rebuilding the reference graph of %d paths", nrValid);
+
+        /* Number the valid paths in sorted order. */
+        std::unordered_map<int64_t, uint32_t> ids;
+        pathOffsets.clear();
+        pool.clear();
+        edges.clear();
+        {
+            SQLiteStmt stmt(state->db, "select id, path from ValidPaths order by path;");
+            auto use(stmt.use());
+            while (use.next()) {
+                ids.emplace(use.getInt(0), pathOffsets.size());
+                pathOffsets.push_back(pool.size());
+                pool += use.getStr(1);
+            }
+        }
+        {
+            SQLiteStmt stmt(state->db, "select referrer, reference from Refs;");
+            auto use(stmt.use());
+            while (use.next()) {
+                auto i = ids.find(use.getInt(0));
+                auto j = ids.find(use.getInt(1));
+                if (i != ids.end() && j != ids.end())
+                    edges.emplace_back(i->second, j->second);
+            }
+        }
+
+        txn.commit();
+
+        return nullptr;
+    });
+
+    if (result || !rebuild) return result;
+
+    /* Lay out the image without holding the database lock. */
+    uint64_t nrPaths = pathOffsets.size();
+    pathOffsets.push_back(pool.size());
+
+    auto image = std::make_shared<RefsGraph::Image>();
+    image->buf.assign(RefsGraph::Image::imageSize(nrPaths, edges.size(), pool.size()), 0);
+
+    RefsGraphHeader header;
+    memcpy(header.magic, refsGraphMagic, sizeof(refsGraphMagic));
+    header.maxId = maxId;
+    header.nrPaths = nrPaths;
+    header.nrEdges = edges.size();
+    header.poolSize = pool.size();
+    memcpy(&image->buf[0], &header, sizeof(header));
+
+    if (!image->init(image->buf.data(), image->buf.size())) abort();
+
+    memcpy((uint64_t *) image->pathOffsets, pathOffsets.data(), pathOffsets.size() * sizeof(uint64_t));
+    memcpy((char *) image->pool, pool.data(), pool.size());
+
+    auto fill = [&](uint64_t * start, uint32_t * out, bool reverse) {
+        for (auto & e : edges)
+            start[(reverse ? e.second : e.first) + 1]++;
+        for (uint64_t i = 0; i < nrPaths; ++i)
+            start[i + 1] += start[i];
+        std::vector<uint64_t> pos(start, start + nrPaths);
+        for (auto & e : edges)
+            if (reverse)
+                out[pos[e.second]++] = e.first;
+            else
+                out[pos[e.first]++] = e.second;
+    };
+
+    fill((uint64_t *) image->fwdStart, (uint32_t *) image->fwdEdges, false);
+    fill((uint64_t *) image->revStart, (uint32_t *) image->revEdges, true);
+
+    /* Write the image for the next process, if we can, and unless
+       the graph has been invalidated while we were laying it out. */
+    if (!settings.readOnlyMode && access(dbDir.c_str(), W_OK) == 0) {
+        static std::atomic<unsigned int> counter{0};
+        Path tmp = fmt("%s.tmp-%d-%d", fileName, getpid(), counter++);
+        writeFile(tmp, image->buf);
+        auto state(_state.lock());
+        if (state->refsGraphGeneration != generation)
+            deletePath(tmp);
+        else if (rename(tmp.c_str(), fileName.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, fileName);
+    }
+
+    return std::make_shared<RefsGraph>(image);
+}
+
+
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "types.hh"
+
+namespace nix {
+
+/* A read-only snapshot of the reference graph of the local store
+   (the Refs table), for traversals that would otherwise do an SQLite
+   query per path, such as garbage collection.
+
+   The graph is stored in $stateDir/db/refs-graph as an image that is
+   mapped into memory: the valid paths in sorted order (so a path's
+   position is its index) and the references and referrers of each
+   path in compressed sparse row form. Paths registered since the
+   image was written are read from the database and kept on the side;
+   if paths have been invalidated since, the image is rebuilt. */
+class RefsGraph
+{
+public:
+
+    struct Image;
+
+    RefsGraph(std::shared_ptr<Image> image);
+
+    ~RefsGraph();
+
+    bool isValidPath(const Path & path) const;
+
+    void queryReferences(const Path & path, PathSet & references) const;
+
+    void queryReferrers(const Path & path, PathSet & referrers) const;
+
+    /* Add the closure of `startPaths' under the references (or, if
+       `flipDirection' is set, the referrers) relation to `paths'. */
+    void computeClosure(const PathSet & startPaths, PathSet & paths,
+        bool flipDirection = false) const;
+
+    size_t size() const;
+
+private:
+
+    std::shared_ptr<Image> image;
+
+    /* Paths registered after the image was written. */
+    PathSet extraPaths;
+    std::map<Path, PathSet> extraReferences, extraReferrers;
+
+    friend class LocalStore;
+};
+
+}
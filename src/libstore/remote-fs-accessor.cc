@@ -1,5 +1,6 @@
 #include "remote-fs-accessor.hh"
 #include "nar-accessor.hh"
+#include "binary-cache-store.hh"
 #include "json.hh"
 
 #include <sys/types.h>
@@ -22,20 +23,35 @@ Path RemoteFSAccessor::makeCacheFile(const Path & storePath, const std::string &
     return fmt("%s/%s.%s", cacheDir, storePathToHash(storePath), ext);
 }
 
+/* Replace `path' atomically, since other processes may have mapped
+   the old file (see openNarFile()). Rewriting it in place would
+   change the data under them, or make them crash if it shrinks. */
+static void writeCacheFile(const Path & path, const std::string & s)
+{
+    auto tmpPath = fmt("%s.tmp-%d", path, getpid());
+    try {
+        writeFile(tmpPath, s);
+        if (rename(tmpPath.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, path);
+    } catch (...) {
+        unlink(tmpPath.c_str());
+        throw;
+    }
+}
+
 void RemoteFSAccessor::addToCache(const Path & storePath, const std::string & nar,
     ref<FSAccessor> narAccessor)
 {
-    nars.emplace(storePath, narAccessor);
+    nars_.lock()->emplace(storePath, narAccessor);
 
     if (cacheDir != "") {
         try {
-            std::ostringstream str;
-            JSONPlaceholder jsonRoot(str);
-            listNar(jsonRoot, narAccessor, "", true);
-            writeFile(makeCacheFile(storePath, "ls"), str.str());
-
             /* FIXME: do this asynchronously. */
-            writeFile(makeCacheFile(storePath, "nar"), nar);
+            writeCacheFile(makeCacheFile(storePath, "nar"), nar);
+
+            /* Write the listing last, since a listing means that the
+               NAR doesn't need to be checked. */
+            writeListing(storePath, narAccessor);
 
         } catch (...) {
             ignoreException();
@@ -43,6 +59,27 @@ void RemoteFSAccessor::addToCache(const Path & storePath, const std::string & na
     }
 }
 
+void RemoteFSAccessor::writeListing(const Path & storePath, ref<FSAccessor> narAccessor)
+{
+    std::ostringstream str;
+    JSONPlaceholder jsonRoot(str);
+    listNar(jsonRoot, narAccessor, "", true);
+    writeCacheFile(makeCacheFile(storePath, "ls"), str.str());
+}
+
+/* Check that the NAR of `storePath' has the hash recorded in its
+   path info, so that a corrupt download or cache file is never
+   served. */
+static std::optional<Hash> badNarHash(Store & store, const Path & storePath,
+    std::function<Hash(HashType)> hashNar)
+{
+    auto info = store.queryPathInfo(storePath);
+    if (!info->narHash) return {};
+    auto hash = hashNar(info->narHash.type);
+    if (hash == info->narHash) return {};
+    return hash;
+}
+
 std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
 {
     auto path = canonPath(path_);
@@ -53,50 +90,62 @@ std::pair<ref<FSAccessor>, Path> RemoteFSAccessor::fetch(const Path & path_)
     if (!store->isValidPath(storePath))
         throw InvalidPath(format("path '%1%' is not a valid store path") % storePath);
 
-    auto i = nars.find(storePath);
-    if (i != nars.end()) return {i->second, restPath};
+    {
+        auto nars(nars_.lock());
+        auto i = nars->find(storePath);
+        if (i != nars->end()) return {i->second, restPath};
+    }
 
     StringSink sink;
-    std::string listing;
     Path cacheFile;
 
     if (cacheDir != "" && pathExists(cacheFile = makeCacheFile(storePath, "nar"))) {
 
-        try {
-            listing = nix::readFile(makeCacheFile(storePath, "ls"));
-
-            auto narAccessor = makeLazyNarAccessor(listing,
-                [cacheFile](uint64_t offset, uint64_t length) {
-
-                    AutoCloseFD fd = open(cacheFile.c_str(), O_RDONLY | O_CLOEXEC);
-                    if (!fd)
-                        throw SysError("opening NAR cache file '%s'", cacheFile);
-
-                    if (lseek(fd.get(), offset, SEEK_SET) != (off_t) offset)
-                        throw SysError("seeking in '%s'", cacheFile);
-
-                    std::string buf(length, 0);
-                    readFull(fd.get(), (unsigned char *) buf.data(), length);
-
-                    return buf;
-                });
-
-            nars.emplace(storePath, narAccessor);
-            return {narAccessor, restPath};
-
-        } catch (SysError &) { }
+        /* Cached NARs are mapped rather than read, and their files
+           are found from the listing stored next to them. */
+        auto listingFile = makeCacheFile(storePath, "ls");
 
         try {
-            *sink.s = nix::readFile(cacheFile);
-
-            auto narAccessor = makeNarAccessor(sink.s);
-            nars.emplace(storePath, narAccessor);
-            return {narAccessor, restPath};
+            if (pathExists(listingFile)) {
+                auto narAccessor = openNarFile(cacheFile, listingFile);
+                nars_.lock()->emplace(storePath, narAccessor);
+                return {narAccessor, restPath};
+            }
+
+            /* A NAR without a listing may be incomplete, so check it,
+               and then store its listing for next time. */
+            if (!badNarHash(*store, storePath,
+                    [&](HashType ht) { return hashFile(ht, cacheFile); }))
+            {
+                auto narAccessor = openNarFile(cacheFile);
+                nars_.lock()->emplace(storePath, narAccessor);
+                try {
+                    writeListing(storePath, narAccessor);
+                } catch (...) {
+                    ignoreException();
+                }
+                return {narAccessor, restPath};
+            }
+
+            printError("ignoring corrupt NAR cache file '%s'", cacheFile);
 
         } catch (SysError &) { }
     }
 
+    /* Read the files of uncompressed NARs in binary caches with
+       range requests, rather than fetching the entire NAR. */
+    if (auto binaryCache = store.dynamic_pointer_cast<BinaryCacheStore>()) {
+        if (auto narAccessor = binaryCache->getNarAccessor(storePath)) {
+            nars_.lock()->emplace(storePath, ref<FSAccessor>(narAccessor));
+            return {ref<FSAccessor>(narAccessor), restPath};
+        }
+    }
+
     store->narFromPath(storePath, sink);
+    if (auto hash = badNarHash(*store, storePath,
+            [&](HashType ht) { return hashString(ht, *sink.s); }))
+        throw Error("NAR of path '%s' has hash '%s', but '%s' was expected",
+            storePath, hash->to_string(), store->queryPathInfo(storePath)->narHash.to_string());
     auto narAccessor = makeNarAccessor(sink.s);
     addToCache(storePath, *sink.s, narAccessor);
     return {narAccessor, restPath};
@@ -3,6 +3,7 @@
 #include "fs-accessor.hh"
 #include "ref.hh"
 #include "store-api.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -10,7 +11,10 @@ class RemoteFSAccessor : public FSAccessor
 {
     ref<Store> store;
 
-    std::map<Path, ref<FSAccessor>> nars;
+    /* The accessors of the NARs fetched so far. Callers like `nix
+       why-depends' read files from several threads, so this is
+       locked. The lock is not held while fetching. */
+    Sync<std::map<Path, ref<FSAccessor>>> nars_;
 
     Path cacheDir;
 
@@ -23,6 +27,8 @@ class RemoteFSAccessor : public FSAccessor
     void addToCache(const Path & storePath, const std::string & nar,
         ref<FSAccessor> narAccessor);
 
+    void writeListing(const Path & storePath, ref<FSAccessor> narAccessor);
+
 public:
 
     RemoteFSAccessor(ref<Store> store,
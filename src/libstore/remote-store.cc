@@ -8,16 +8,19 @@
 #include "derivations.hh"
 #include "pool.hh"
 #include "finally.hh"
+#include "local-db-reader.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <errno.h>
+#include <poll.h>
 #include <fcntl.h>
 #include <unistd.h>
 
 #include <cstring>
+#include <thread>
 
 namespace nix {
 
@@ -51,10 +54,44 @@ RemoteStore::RemoteStore(const Params & params)
                     r->to.good()
                     && r->from.good()
                     && std::chrono::duration_cast<std::chrono::seconds>(
-                        std::chrono::steady_clock::now() - r->startTime).count() < maxConnectionAge;
+                        std::chrono::steady_clock::now() - r->startTime).count() < maxConnectionAge
+                    && isIdle(*r);
             }
             ))
 {
+    connections->setGrowth(1, std::chrono::milliseconds(connectionGrowthDelay));
+    connections->setMaxIdleTime(std::chrono::seconds(maxConnectionIdle));
+}
+
+
+/* Check that the daemon hasn't sent anything on or closed an idle
+   connection, which would mean that it (or the tunnel to it) is
+   gone. This is cheaper than finding out when the next operation
+   fails or hangs. */
+bool RemoteStore::isIdle(Connection & conn)
+{
+    if (conn.from.hasData()) return false;
+    struct pollfd fd{conn.from.fd, POLLIN, 0};
+    auto res = poll(&fd, 1, 0);
+    if (res == -1) return errno == EINTR;
+    if (res == 1) {
+        debug("closing daemon connection that is no longer idle");
+        return false;
+    }
+    return true;
+}
+
+
+const Store::Stats & RemoteStore::getStats()
+{
+    auto poolStats = connections->getStats();
+    stats.connectionsOpened = poolStats.created;
+    stats.connectionsReaped = poolStats.reaped;
+    stats.connectionsInvalid = poolStats.invalid;
+    stats.connectionWaits = poolStats.waits;
+    stats.connectionWaitMs = poolStats.waitTimeMs;
+    stats.connectionLimit = poolStats.limit;
+    return Store::getStats();
 }
 
 
@@ -76,6 +113,7 @@ UDSRemoteStore::UDSRemoteStore(const Params & params)
     , LocalFSStore(params)
     , RemoteStore(params)
 {
+    openDB();
 }
 
 
@@ -85,6 +123,109 @@ UDSRemoteStore::UDSRemoteStore(std::string socket_path, const Params & params)
     , RemoteStore(params)
     , path(socket_path)
 {
+    openDB();
+}
+
+
+UDSRemoteStore::~UDSRemoteStore()
+{
+}
+
+
+void UDSRemoteStore::openDB()
+{
+    /* The database only belongs to the daemon if we're talking to
+       the daemon of this store. */
+    if (!directReads || path) return;
+    try {
+        db = std::make_unique<LocalDBReader>(stateDir);
+    } catch (Error & e) {
+        debug("not reading the Nix database directly: %s", e.what());
+    }
+}
+
+
+bool UDSRemoteStore::isValidPathUncached(const Path & path)
+{
+    if (!db) return RemoteStore::isValidPathUncached(path);
+    return db->isValidPath(path);
+}
+
+
+PathSet UDSRemoteStore::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
+{
+    if (!db || maybeSubstitute) return RemoteStore::queryValidPaths(paths, maybeSubstitute);
+    PathSet res;
+    for (auto & path : paths)
+        if (isValidPath(path)) res.insert(path);
+    return res;
+}
+
+
+void UDSRemoteStore::queryPathInfoUncached(const Path & path,
+    Callback<std::shared_ptr<ValidPathInfo>> callback)
+{
+    if (!db) return RemoteStore::queryPathInfoUncached(path, std::move(callback));
+    try {
+        callback(db->queryPathInfo(path));
+    } catch (...) { callback.rethrow(); }
+}
+
+
+void UDSRemoteStore::queryReferrers(const Path & path, PathSet & referrers)
+{
+    if (!db) return RemoteStore::queryReferrers(path, referrers);
+    db->queryReferrers(path, referrers);
+}
+
+
+PathSet UDSRemoteStore::queryValidDerivers(const Path & path)
+{
+    if (!db) return RemoteStore::queryValidDerivers(path);
+    return db->queryValidDerivers(path);
+}
+
+
+PathSet UDSRemoteStore::queryDerivationOutputs(const Path & path)
+{
+    if (!db) return RemoteStore::queryDerivationOutputs(path);
+    PathSet outputs;
+    for (auto & i : db->queryDerivationOutputs(path))
+        outputs.insert(i.second);
+    if (outputs.empty() && !isValidPath(path))
+        throw Error("path '%s' is not valid", path);
+    return outputs;
+}
+
+
+StringSet UDSRemoteStore::queryDerivationOutputNames(const Path & path)
+{
+    if (!db) return RemoteStore::queryDerivationOutputNames(path);
+    StringSet names;
+    for (auto & i : db->queryDerivationOutputs(path))
+        names.insert(i.first);
+    if (names.empty() && !isValidPath(path))
+        throw Error("path '%s' is not valid", path);
+    return names;
+}
+
+
+Path UDSRemoteStore::queryPathFromHashPart(const string & hashPart)
+{
+    if (!db) return RemoteStore::queryPathFromHashPart(hashPart);
+    if (hashPart.size() != storePathHashLen) throw Error("invalid hash part");
+    return db->queryPathFromHashPart(hashPart);
+}
+
+
+void UDSRemoteStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection, bool includeOutputs, bool includeDerivers)
+{
+    /* With local queries, traversing the graph ourselves is cheaper
+       than a round trip. */
+    if (!db)
+        return RemoteStore::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+    Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
 }
 
 
@@ -136,10 +277,42 @@ ref<RemoteStore::Connection> UDSRemoteStore::openConnection()
 
 void RemoteStore::initConnection(Connection & conn)
 {
+    /* What we send after the daemon's version only depends on
+       whether it's at least 1.14. The daemon reads its input in
+       order, so if the previous daemon was that recent, we can send
+       everything, including our options, right away. Then setting
+       up the connection takes just one round trip. */
+    bool sentOptions = false;
+
+    auto sendHello = [&](unsigned int daemonVersion) {
+        conn.to << PROTOCOL_VERSION;
+
+        if (GET_PROTOCOL_MINOR(daemonVersion) >= 14) {
+            int cpu = settings.lockCPU ? lockToCurrentCPU() : -1;
+            if (cpu != -1)
+                conn.to << 1 << cpu;
+            else
+                conn.to << 0;
+        }
+
+        if (GET_PROTOCOL_MINOR(daemonVersion) >= 11)
+            conn.to << false;
+    };
+
     /* Send the magic greeting, check for the reply. */
     try {
+        auto assumedVersion = lastDaemonVersion.load();
+        bool early = GET_PROTOCOL_MAJOR(assumedVersion) == GET_PROTOCOL_MAJOR(PROTOCOL_VERSION)
+            && GET_PROTOCOL_MINOR(assumedVersion) >= 14;
+
         conn.to << WORKER_MAGIC_1;
+        if (early) {
+            conn.daemonVersion = assumedVersion;
+            sendHello(assumedVersion);
+            sentOptions = sendOptions(conn);
+        }
         conn.to.flush();
+
         unsigned int magic = readInt(conn.from);
         if (magic != WORKER_MAGIC_2) throw Error("protocol mismatch");
 
@@ -148,18 +321,16 @@ void RemoteStore::initConnection(Connection & conn)
             throw Error("Nix daemon protocol version not supported");
         if (GET_PROTOCOL_MINOR(conn.daemonVersion) < 10)
             throw Error("the Nix daemon version is too old");
-        conn.to << PROTOCOL_VERSION;
 
-        if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 14) {
-            int cpu = settings.lockCPU ? lockToCurrentCPU() : -1;
-            if (cpu != -1)
-                conn.to << 1 << cpu;
-            else
-                conn.to << 0;
-        }
+        lastDaemonVersion = conn.daemonVersion;
 
-        if (GET_PROTOCOL_MINOR(conn.daemonVersion) >= 11)
-            conn.to << false;
+        if (early && GET_PROTOCOL_MINOR(conn.daemonVersion) < 14)
+            throw Error("the Nix daemon has been replaced by an older version");
+
+        if (!early) {
+            sendHello(conn.daemonVersion);
+            sentOptions = sendOptions(conn);
+        }
 
         auto ex = conn.processStderr();
         if (ex) std::rethrow_exception(ex);
@@ -168,11 +339,25 @@ void RemoteStore::initConnection(Connection & conn)
         throw Error("cannot open connection to remote store '%s': %s", getUri(), e.what());
     }
 
-    setOptions(conn);
+    /* If sent early, the options were encoded for the assumed
+       version, but the encoding is the same for all versions since
+       1.12. */
+    if (sentOptions) {
+        auto ex = conn.processStderr();
+        if (ex) std::rethrow_exception(ex);
+    }
 }
 
 
 void RemoteStore::setOptions(Connection & conn)
+{
+    if (!sendOptions(conn)) return;
+    auto ex = conn.processStderr();
+    if (ex) std::rethrow_exception(ex);
+}
+
+
+bool RemoteStore::sendOptions(Connection & conn)
 {
     conn.to << wopSetOptions
        << settings.keepFailed
@@ -196,8 +381,7 @@ void RemoteStore::setOptions(Connection & conn)
             conn.to << i.first << i.second.value;
     }
 
-    auto ex = conn.processStderr();
-    if (ex) std::rethrow_exception(ex);
+    return true;
 }
 
 
@@ -209,18 +393,32 @@ void RemoteStore::setOptions(Connection & conn)
 struct ConnectionHandle
 {
     Pool<RemoteStore::Connection>::Handle handle;
+    Store::Stats & stats;
+    bool valid = true;
     bool daemonException = false;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
 
-    ConnectionHandle(Pool<RemoteStore::Connection>::Handle && handle)
-        : handle(std::move(handle))
+    ConnectionHandle(Pool<RemoteStore::Connection>::Handle && handle, Store::Stats & stats)
+        : handle(std::move(handle)), stats(stats)
     { }
 
     ConnectionHandle(ConnectionHandle && h)
-        : handle(std::move(h.handle))
-    { }
+        : handle(std::move(h.handle)), stats(h.stats), start(h.start)
+    {
+        h.valid = false;
+    }
 
     ~ConnectionHandle()
     {
+        if (!valid) return;
+
+        auto opTime = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start);
+        handle->ops++;
+        handle->opTime += opTime;
+        stats.daemonOps++;
+        stats.daemonOpTimeMs += opTime.count() / 1000;
+
         if (!daemonException && std::uncaught_exception()) {
             handle.markBad();
             debug("closing daemon connection because of an exception");
@@ -242,7 +440,176 @@ struct ConnectionHandle
 
 ConnectionHandle RemoteStore::getConnection()
 {
-    return ConnectionHandle(connections->get());
+    return ConnectionHandle(connections->get(), stats);
+}
+
+
+struct RemoteStore::PipelinedConnection
+{
+    ref<Connection> conn;
+
+    /* Called on the reader thread with either the source from which
+       to read the reply, or the error. */
+    typedef std::function<void(Source *, std::exception_ptr)> Handler;
+
+    struct State
+    {
+        uint64_t nextTag = 0;
+        std::map<uint64_t, Handler> pending;
+        std::exception_ptr failure;
+        bool done = false;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable readerDone;
+
+    std::mutex writeLock;
+
+    std::thread::id readerId;
+
+    PipelinedConnection(ref<Connection> conn) : conn(conn) { }
+
+    /* Start the reader thread, which keeps this object alive until
+       the daemon closes the connection. */
+    static std::shared_ptr<PipelinedConnection> start(ref<Connection> conn)
+    {
+        auto pc = std::make_shared<PipelinedConnection>(conn);
+        std::thread thread([pc]() { pc->reader(); });
+        pc->readerId = thread.get_id();
+        thread.detach();
+        return pc;
+    }
+
+    /* Send a request, written by `request', and call `handler' when
+       the reply arrives. */
+    void send(std::function<void(Sink &)> request, Handler handler)
+    {
+        uint64_t tag;
+        {
+            auto state(state_.lock());
+            if (state->failure) std::rethrow_exception(state->failure);
+            tag = state->nextTag++;
+            state->pending.emplace(tag, handler);
+        }
+
+        try {
+            std::lock_guard<std::mutex> lock(writeLock);
+            conn->to << tag;
+            request(conn->to);
+            conn->to.flush();
+        } catch (...) {
+            /* Unless the reader thread has already failed the request
+               because the connection is gone. */
+            if (state_.lock()->pending.erase(tag)) throw;
+        }
+    }
+
+    void reader()
+    {
+        try {
+            while (true) {
+                auto tag = readNum<uint64_t>(conn->from);
+                bool failed = readInt(conn->from);
+
+                Handler handler;
+                {
+                    auto state(state_.lock());
+                    auto i = state->pending.find(tag);
+                    if (i == state->pending.end())
+                        throw Error("got a reply with unknown tag %d from Nix daemon", tag);
+                    handler = std::move(i->second);
+                    state->pending.erase(i);
+                }
+
+                if (failed)
+                    handler(nullptr, std::make_exception_ptr(Error(readString(conn->from))));
+                else
+                    handler(&conn->from, nullptr);
+            }
+        } catch (...) {
+            std::exception_ptr failure;
+            try {
+                throw;
+            } catch (EndOfFile &) {
+                failure = std::make_exception_ptr(Error("the Nix daemon closed the pipelined connection"));
+            } catch (...) {
+                failure = std::current_exception();
+            }
+
+            std::map<uint64_t, Handler> pending;
+            {
+                auto state(state_.lock());
+                state->failure = failure;
+                pending.swap(state->pending);
+            }
+
+            for (auto & i : pending)
+                i.second(nullptr, failure);
+        }
+
+        state_.lock()->done = true;
+        readerDone.notify_all();
+    }
+
+    /* Tell the daemon that there are no more requests, and wait for
+       the replies to the outstanding ones. */
+    void shutdown()
+    {
+        try {
+            std::lock_guard<std::mutex> lock(writeLock);
+            conn->closeWrite();
+        } catch (...) {
+            ignoreException();
+        }
+
+        if (std::this_thread::get_id() == readerId) return;
+
+        auto state(state_.lock());
+        while (!state->done)
+            state.wait(readerDone);
+    }
+};
+
+
+RemoteStore::~RemoteStore()
+{
+    auto pc = pipeline_.lock()->conn;
+    if (pc) pc->shutdown();
+}
+
+
+void RemoteStore::Connection::closeWrite()
+{
+    to.flush();
+    if (::shutdown(to.fd, SHUT_WR) == -1)
+        throw SysError("shutting down connection to the Nix daemon");
+}
+
+
+std::shared_ptr<RemoteStore::PipelinedConnection> RemoteStore::getPipelinedConnection()
+{
+    if (!pipelineQueries) return nullptr;
+
+    auto pipeline(pipeline_.lock());
+
+    if (pipeline->unsupported) return nullptr;
+
+    if (pipeline->conn && !pipeline->conn->state_.lock()->failure)
+        return pipeline->conn;
+
+    auto conn = openConnectionWrapper();
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 23) {
+        pipeline->unsupported = true;
+        return nullptr;
+    }
+
+    conn->to << wopPipeline;
+    auto ex = conn->processStderr();
+    if (ex) std::rethrow_exception(ex);
+
+    return pipeline->conn = PipelinedConnection::start(conn);
 }
 
 
@@ -341,9 +708,67 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 }
 
 
+static std::shared_ptr<ValidPathInfo> readPathInfo(Store & store,
+    const Path & path, Source & from, unsigned int daemonVersion)
+{
+    auto info = std::make_shared<ValidPathInfo>();
+    info->path = path;
+    info->deriver = readString(from);
+    if (info->deriver != "") store.assertStorePath(info->deriver);
+    info->narHash = Hash(readString(from), htSHA256);
+    info->references = readStorePaths<PathSet>(store, from);
+    from >> info->registrationTime >> info->narSize;
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 16) {
+        from >> info->ultimate;
+        info->sigs = readStrings<StringSet>(from);
+        from >> info->ca;
+    }
+    return info;
+}
+
+
 void RemoteStore::queryPathInfoUncached(const Path & path,
     Callback<std::shared_ptr<ValidPathInfo>> callback)
 {
+    /* Use the pipelined connection if possible, so that concurrent
+       queries (e.g. from computeFSClosure()) don't wait for each
+       other. */
+    std::shared_ptr<PipelinedConnection> pc;
+    try {
+        pc = getPipelinedConnection();
+    } catch (Error & e) {
+        debug("not using a pipelined connection to '%s': %s", getUri(), e.msg());
+        pipeline_.lock()->unsupported = true;
+    }
+
+    if (pc) {
+        auto callbackPtr = std::make_shared<decltype(callback)>(std::move(callback));
+        auto daemonVersion = pc->conn->daemonVersion;
+        try {
+            pc->send(
+                [&](Sink & to) { to << wopQueryPathInfo << path; },
+                [this, path, callbackPtr, daemonVersion](Source * from, std::exception_ptr ex) {
+                    std::shared_ptr<ValidPathInfo> info;
+                    try {
+                        if (ex) std::rethrow_exception(ex);
+                        if (readInt(*from))
+                            info = readPathInfo(*this, path, *from, daemonVersion);
+                    } catch (...) {
+                        callbackPtr->rethrow();
+                        /* Errors while reading the reply are fatal
+                           to the connection. */
+                        if (!ex) throw;
+                        return;
+                    }
+                    try {
+                        if (!info) throw InvalidPath("path '%s' is not valid", path);
+                        (*callbackPtr)(std::move(info));
+                    } catch (...) { callbackPtr->rethrow(); }
+                });
+        } catch (...) { callbackPtr->rethrow(); }
+        return;
+    }
+
     try {
         std::shared_ptr<ValidPathInfo> info;
         {
@@ -361,24 +786,79 @@ void RemoteStore::queryPathInfoUncached(const Path & path,
                 bool valid; conn->from >> valid;
                 if (!valid) throw InvalidPath(format("path '%s' is not valid") % path);
             }
-            info = std::make_shared<ValidPathInfo>();
-            info->path = path;
-            info->deriver = readString(conn->from);
-            if (info->deriver != "") assertStorePath(info->deriver);
-            info->narHash = Hash(readString(conn->from), htSHA256);
-            info->references = readStorePaths<PathSet>(*this, conn->from);
-            conn->from >> info->registrationTime >> info->narSize;
-            if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
-                conn->from >> info->ultimate;
-                info->sigs = readStrings<StringSet>(conn->from);
-                conn->from >> info->ca;
-            }
+            info = readPathInfo(*this, path, conn->from, conn->daemonVersion);
         }
         callback(std::move(info));
     } catch (...) { callback.rethrow(); }
 }
 
 
+void RemoteStore::preloadPathInfoCache(const PathSet & paths)
+{
+    Store::preloadPathInfoCache(paths);
+
+    PathSet missing;
+    for (auto & path : paths) {
+        auto hash = storePathHash(path);
+        if (hash && !pathInfoCache.get(*hash))
+            missing.insert(path);
+    }
+
+    if (missing.size() < 2) return;
+
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 24) return;
+
+    conn->to << wopQueryPathInfos << missing;
+    conn.processStderr();
+
+    /* Remember the paths that are missing from the reply as
+       invalid. */
+    auto count = readNum<size_t>(conn->from);
+    for (size_t n = 0; n < count; n++) {
+        auto path = readStorePath(*this, conn->from);
+        auto info = readPathInfo(*this, path, conn->from, conn->daemonVersion);
+        if (auto hash = storePathHash(path))
+            pathInfoCache.upsert(*hash, info);
+        missing.erase(path);
+    }
+
+    for (auto & path : missing)
+        pathInfoCache.upsert(*storePathHash(path), nullptr);
+}
+
+
+void RemoteStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection,
+    bool includeOutputs, bool includeDerivers)
+{
+    {
+        auto conn(getConnection());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 24) {
+            /* Let the daemon compute the closure, and put the info
+               about the paths in it in the cache, since the caller
+               is likely to query it. As in Store::computeFSClosure(),
+               the paths already in `out' aren't traversed again, so
+               the daemon gets them too. */
+            conn->to << wopQueryClosure << paths
+                << flipDirection << includeOutputs << includeDerivers << out;
+            conn.processStderr();
+            auto count = readNum<size_t>(conn->from);
+            for (size_t n = 0; n < count; n++) {
+                auto path = readStorePath(*this, conn->from);
+                auto info = readPathInfo(*this, path, conn->from, conn->daemonVersion);
+                if (auto hash = storePathHash(path))
+                    pathInfoCache.upsert(*hash, info);
+                out.insert(path);
+            }
+            return;
+        }
+    }
+
+    Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+}
+
+
 void RemoteStore::queryReferrers(const Path & path,
     PathSet & referrers)
 {
@@ -428,6 +908,32 @@ Path RemoteStore::queryPathFromHashPart(const string & hashPart)
 }
 
 
+std::map<string, Path> RemoteStore::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    bool batched;
+    {
+        auto conn(getConnection());
+        batched = GET_PROTOCOL_MINOR(conn->daemonVersion) >= 22;
+    }
+    if (!batched) return Store::queryPathsFromHashParts(hashParts);
+
+    auto conn(getConnection());
+    conn->to << wopQueryPathsFromHashParts << hashParts;
+    conn.processStderr();
+    std::map<string, Path> res;
+    auto paths = readStrings<Strings>(conn->from);
+    auto i = hashParts.begin();
+    for (auto & path : paths) {
+        if (!path.empty()) {
+            assertStorePath(path);
+            res.emplace(*i, path);
+        }
+        ++i;
+    }
+    return res;
+}
+
+
 void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
     RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
 {
@@ -520,6 +1026,26 @@ Path RemoteStore::addTextToStore(const string & name, const string & s,
 }
 
 
+Paths RemoteStore::addTextsToStore(const std::vector<StoreText> & texts,
+    RepairFlag repair)
+{
+    if (repair) throw Error("repairing is not supported when building through the Nix daemon");
+
+    {
+        auto conn(getConnection());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 26) {
+            conn->to << wopAddTextsToStore << texts.size();
+            for (auto & text : texts)
+                conn->to << text.name << text.contents << text.references;
+            conn.processStderr();
+            return readStorePaths<Paths>(*this, conn->from);
+        }
+    }
+
+    return Store::addTextsToStore(texts, repair);
+}
+
+
 void RemoteStore::buildPaths(const PathSet & drvPaths, BuildMode buildMode)
 {
     auto conn(getConnection());
@@ -578,6 +1104,27 @@ void RemoteStore::addTempRoot(const Path & path)
 }
 
 
+void RemoteStore::addTempRoots(const PathSet & paths)
+{
+    if (paths.empty()) return;
+
+    auto conn(getConnection());
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 27) {
+        for (auto & path : paths) {
+            conn->to << wopAddTempRoot << path;
+            conn.processStderr();
+            readInt(conn->from);
+        }
+        return;
+    }
+
+    conn->to << wopAddTempRoots << paths;
+    conn.processStderr();
+    readInt(conn->from);
+}
+
+
 void RemoteStore::addIndirectRoot(const Path & path)
 {
     auto conn(getConnection());
@@ -626,12 +1173,41 @@ void RemoteStore::collectGarbage(const GCOptions & options, GCResults & results)
 
     results.paths = readStrings<PathSet>(conn->from);
     results.bytesFreed = readLongLong(conn->from);
-    readLongLong(conn->from); // obsolete
+    results.filesDeleted = readLongLong(conn->from);
 
-    {
-        auto state_(Store::state.lock());
-        state_->pathInfoCache.clear();
+    pathInfoCache.clear();
+}
+
+
+GCPlan RemoteStore::planGarbage(bool censor)
+{
+    auto conn(getConnection());
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 25)
+        throw Error("the daemon of '%s' is too old to plan garbage collection", getUri());
+
+    conn->to << wopPlanGarbage;
+    conn.processStderr();
+
+    GCPlan plan;
+
+    auto roots = readNum<size_t>(conn->from);
+    for (size_t n = 0; n < roots; n++) {
+        auto & root(plan.roots[readStorePath(*this, conn->from)]);
+        root.links = readStrings<StringSet>(conn->from);
+        root.closureSize = readNum<uint64_t>(conn->from);
+        root.exclusiveSize = readNum<uint64_t>(conn->from);
     }
+
+    auto dead = readNum<size_t>(conn->from);
+    for (size_t n = 0; n < dead; n++) {
+        auto path = readStorePath(*this, conn->from);
+        plan.dead[path] = readNum<uint64_t>(conn->from);
+    }
+
+    plan.deadSize = readNum<uint64_t>(conn->from);
+    plan.liveSize = readNum<uint64_t>(conn->from);
+
+    return plan;
 }
 
 
@@ -708,6 +1284,9 @@ void RemoteStore::flushBadConnections()
 
 RemoteStore::Connection::~Connection()
 {
+    if (ops)
+        debug("closing daemon connection after %d operations taking %.2f ms on average",
+            ops, opTime.count() / 1000.0 / ops);
     try {
         to.flush();
     } catch (...) {
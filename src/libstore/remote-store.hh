@@ -15,6 +15,7 @@ struct FdSink;
 struct FdSource;
 template<typename T> class Pool;
 struct ConnectionHandle;
+class LocalDBReader;
 
 
 /* FIXME: RemoteStore is a misnomer - should be something like
@@ -29,8 +30,20 @@ public:
     const Setting<unsigned int> maxConnectionAge{(Store*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
 
+    const Setting<unsigned int> maxConnectionIdle{(Store*) this, 300, "max-connection-idle",
+            "number of seconds after which an idle connection is closed (0 means never)"};
+
+    const Setting<unsigned int> connectionGrowthDelay{(Store*) this, 10, "connection-growth-delay",
+            "number of milliseconds to wait for a busy connection before opening another one, "
+            "up to max-connections (0 means open one right away)"};
+
+    const Setting<bool> pipelineQueries{(Store*) this, true, "pipeline-queries",
+            "whether to send path info queries concurrently on a separate connection, if the daemon supports it"};
+
     RemoteStore(const Params & params);
 
+    ~RemoteStore();
+
     /* Implementations of abstract store API methods. */
 
     bool isValidPathUncached(const Path & path) override;
@@ -53,6 +66,16 @@ public:
 
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    std::map<string, Path> queryPathsFromHashParts(const StringSet & hashParts) override;
+
+    void preloadPathInfoCache(const PathSet & paths) override;
+
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
@@ -69,6 +92,9 @@ public:
     Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair) override;
 
+    Paths addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair) override;
+
     void buildPaths(const PathSet & paths, BuildMode buildMode) override;
 
     BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
@@ -78,6 +104,8 @@ public:
 
     void addTempRoot(const Path & path) override;
 
+    void addTempRoots(const PathSet & paths) override;
+
     void addIndirectRoot(const Path & path) override;
 
     void syncWithGC() override;
@@ -86,6 +114,8 @@ public:
 
     void collectGarbage(const GCOptions & options, GCResults & results) override;
 
+    GCPlan planGarbage(bool censor) override;
+
     void optimiseStore() override;
 
     bool verifyStore(bool checkContents, RepairFlag repair) override;
@@ -102,6 +132,8 @@ public:
 
     void flushBadConnections();
 
+    const Stats & getStats() override;
+
 protected:
 
     struct Connection
@@ -112,11 +144,25 @@ protected:
         unsigned int daemonVersion;
         std::chrono::time_point<std::chrono::steady_clock> startTime;
 
+        /* Number of operations done on this connection, and the total
+           time they took. */
+        uint64_t ops = 0;
+        std::chrono::microseconds opTime{0};
+
         virtual ~Connection();
 
         std::exception_ptr processStderr(Sink * sink = 0, Source * source = 0);
+
+        /* Close the sending side of the connection, so that the
+           daemon sees end-of-file. */
+        virtual void closeWrite();
     };
 
+    /* A connection in pipelined mode (see wopPipeline), on which
+       queries are sent without waiting for the replies to earlier
+       ones. */
+    struct PipelinedConnection;
+
     ref<Connection> openConnectionWrapper();
 
     virtual ref<Connection> openConnection() = 0;
@@ -125,7 +171,11 @@ protected:
 
     ref<Pool<Connection>> connections;
 
-    virtual void setOptions(Connection & conn);
+    /* Write a wopSetOptions request for our settings to `conn',
+       returning false if there is nothing to send. */
+    virtual bool sendOptions(Connection & conn);
+
+    void setOptions(Connection & conn);
 
     ConnectionHandle getConnection();
 
@@ -135,21 +185,74 @@ private:
 
     std::atomic_bool failed{false};
 
+    /* The protocol version of the daemon on the last connection we
+       opened, which lets us send the greeting and our options on the
+       next one without waiting for the daemon's version first. */
+    std::atomic<unsigned int> lastDaemonVersion{0};
+
+    struct PipelineState
+    {
+        std::shared_ptr<PipelinedConnection> conn;
+        bool unsupported = false;
+    };
+
+    Sync<PipelineState> pipeline_;
+
+    /* Return the pipelined connection, opening it if necessary, or
+       nullptr if pipelining is disabled or not supported by the
+       daemon. */
+    std::shared_ptr<PipelinedConnection> getPipelinedConnection();
+
+    static bool isIdle(Connection & conn);
+
 };
 
 class UDSRemoteStore : public LocalFSStore, public RemoteStore
 {
 public:
 
+    const Setting<bool> directReads{(Store*) this, false, "direct-reads",
+        "whether to read path metadata directly from the (read-only) database of the local store, "
+        "sending only other operations to the daemon"};
+
     UDSRemoteStore(const Params & params);
     UDSRemoteStore(std::string path, const Params & params);
 
+    ~UDSRemoteStore();
+
     std::string getUri() override;
 
+    bool isValidPathUncached(const Path & path) override;
+
+    PathSet queryValidPaths(const PathSet & paths,
+        SubstituteFlag maybeSubstitute = NoSubstitute) override;
+
+    void queryPathInfoUncached(const Path & path,
+        Callback<std::shared_ptr<ValidPathInfo>> callback) override;
+
+    void queryReferrers(const Path & path, PathSet & referrers) override;
+
+    PathSet queryValidDerivers(const Path & path) override;
+
+    PathSet queryDerivationOutputs(const Path & path) override;
+
+    StringSet queryDerivationOutputNames(const Path & path) override;
+
+    Path queryPathFromHashPart(const string & hashPart) override;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
 private:
 
     ref<RemoteStore::Connection> openConnection() override;
     std::optional<std::string> path;
+
+    /* If `direct-reads' is enabled and the database is readable. */
+    std::unique_ptr<LocalDBReader> db;
+
+    void openDB();
 };
 
 
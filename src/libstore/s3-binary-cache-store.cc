@@ -8,6 +8,7 @@
 #include "compression.hh"
 #include "download.hh"
 #include "istringstream_nocopy.hh"
+#include "thread-pool.hh"
 
 #include <aws/core/Aws.h>
 #include <aws/core/VersionConfig.h>
@@ -15,6 +16,7 @@
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
 #include <aws/core/client/ClientConfiguration.h>
 #include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/http/HttpResponse.h>
 #include <aws/core/utils/logging/FormattedLogSystem.h>
 #include <aws/core/utils/logging/LogMacros.h>
 #include <aws/core/utils/threading/Executor.h>
@@ -22,9 +24,13 @@
 #include <aws/s3/model/GetObjectRequest.h>
 #include <aws/s3/model/HeadObjectRequest.h>
 #include <aws/s3/model/ListObjectsRequest.h>
+#include <aws/s3/model/ListObjectsV2Request.h>
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/transfer/TransferManager.h>
 
+#include <deque>
+#include <fstream>
+
 using namespace Aws::Transfer;
 
 namespace nix {
@@ -180,8 +186,15 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
     const Setting<std::string> logCompression{this, "", "log-compression", "compression method for log/* files"};
     const Setting<bool> multipartUpload{
         this, false, "multipart-upload", "whether to use multi-part uploads"};
+    const Setting<bool> multipartDownload{
+        this, false, "multipart-download", "whether to download large files as parallel ranged requests"};
+    const Setting<unsigned int> downloadThreads{
+        this, 8, "download-threads", "number of parallel requests in multi-part downloads"};
     const Setting<uint64_t> bufferSize{
-        this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads"};
+        this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads and downloads"};
+    const Setting<unsigned int> listPrefixLength{
+        this, 0, "list-prefix-length", "length of the hash prefixes by which to list .narinfo files when checking "
+        "the validity of many paths, or 0 to choose it from the number of paths and of .narinfo files in the bucket"};
 
     std::string bucketName;
 
@@ -232,6 +245,107 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         }
     }
 
+    /* The number of .narinfo files in the bucket, estimated from the
+       listing of a single hash prefix, or 0 if not known yet. */
+    std::atomic<uint64_t> narInfoCountEstimate{0};
+
+    uint64_t estimateNarInfoCount(const std::string & hashPart)
+    {
+        if (!narInfoCountEstimate) {
+            const size_t sampleLen = 3;
+            uint64_t n = listNarInfos(std::string(hashPart, 0, sampleLen)).size();
+            narInfoCountEstimate = std::max(n, (uint64_t) 1) << (5 * sampleLen);
+            debug("'s3://%s' has about %d .narinfo files", bucketName, (uint64_t) narInfoCountEstimate);
+        }
+        return narInfoCountEstimate;
+    }
+
+    /* For many paths, listing the .narinfo files whose names start
+       with the hash prefixes of the paths can take far fewer requests
+       than fetching every .narinfo. Unless `list-prefix-length' is
+       set, the prefix length is the one that takes the fewest
+       requests, given that a listing returns up to 1000 keys per
+       request and that the bucket may hold many more .narinfo files
+       than we're asking about. */
+    PathSet queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute) override
+    {
+        size_t prefixLen = std::min((unsigned int) listPrefixLength, 32U);
+
+        if (!prefixLen && paths.size() >= 512) {
+            auto objects = estimateNarInfoCount(storePathToHash(*paths.begin()));
+            uint64_t best = paths.size();
+            for (size_t len = 1; len <= 6; ++len) {
+                uint64_t nrPrefixes = std::min((uint64_t) paths.size(), (uint64_t) 1 << (5 * len));
+                uint64_t pages = 1 + (objects >> (5 * len)) / 1000;
+                if (nrPrefixes * pages < best) {
+                    best = nrPrefixes * pages;
+                    prefixLen = len;
+                }
+            }
+        }
+
+        if (!prefixLen)
+            return S3BinaryCacheStore::queryValidPaths(paths, maybeSubstitute);
+
+        std::map<std::string, std::map<std::string, Path>> prefixes;
+        for (auto & path : paths) {
+            auto hashPart = storePathToHash(path);
+            prefixes[std::string(hashPart, 0, prefixLen)][hashPart] = path;
+        }
+
+        debug("checking %d paths in 's3://%s' by listing %d prefixes",
+            paths.size(), bucketName, prefixes.size());
+
+        Sync<PathSet> valid;
+
+        ThreadPool pool(std::min((size_t) downloadThreads, prefixes.size()));
+
+        for (auto & i : prefixes)
+            pool.enqueue([&, prefix(i.first), &wanted(i.second)]() {
+                for (auto & hashPart : listNarInfos(prefix)) {
+                    auto j = wanted.find(hashPart);
+                    if (j != wanted.end())
+                        valid.lock()->insert(j->second);
+                }
+            });
+
+        pool.process();
+
+        return *valid.lock();
+    }
+
+    /* Return the hash parts of the .narinfo files in the bucket whose
+       names start with `prefix'. */
+    std::set<std::string> listNarInfos(const std::string & prefix)
+    {
+        std::set<std::string> hashParts;
+        std::string token;
+
+        do {
+            stats.list++;
+
+            auto request =
+                Aws::S3::Model::ListObjectsV2Request()
+                .WithBucket(bucketName)
+                .WithPrefix(prefix)
+                .WithDelimiter("/");
+            if (!token.empty()) request.SetContinuationToken(token);
+
+            auto res = checkAws(fmt("AWS error listing bucket '%s'", bucketName),
+                s3Helper.client->ListObjectsV2(request));
+
+            for (auto & object : res.GetContents()) {
+                auto & key = object.GetKey();
+                if (key.size() != 40 || !hasSuffix(key, ".narinfo")) continue;
+                hashParts.insert(key.substr(0, 32));
+            }
+
+            token = res.GetIsTruncated() ? res.GetNextContinuationToken() : "";
+        } while (!token.empty());
+
+        return hashParts;
+    }
+
     bool fileExists(const std::string & path) override
     {
         stats.head++;
@@ -261,8 +375,15 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         const std::string & mimeType,
         const std::string & contentEncoding)
     {
-        auto stream = std::make_shared<istringstream_nocopy>(data);
+        uploadFile(path, std::make_shared<istringstream_nocopy>(data), data.size(),
+            mimeType, contentEncoding);
+    }
 
+    void uploadFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> stream, uint64_t size,
+        const std::string & mimeType,
+        const std::string & contentEncoding)
+    {
         auto maxThreads = std::thread::hardware_concurrency();
 
         static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
@@ -328,8 +449,6 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             if (contentEncoding != "")
                 request.SetContentEncoding(contentEncoding);
 
-            auto stream = std::make_shared<istringstream_nocopy>(data);
-
             request.SetBody(stream);
 
             auto result = checkAws(fmt("AWS error uploading '%s'", path),
@@ -343,10 +462,10 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
                 .count();
 
         printInfo(format("uploaded 's3://%1%/%2%' (%3% bytes) in %4% ms") %
-                  bucketName % path % data.size() % duration);
+                  bucketName % path % size % duration);
 
         stats.putTimeMs += duration;
-        stats.putBytes += data.size();
+        stats.putBytes += size;
         stats.put++;
     }
 
@@ -363,8 +482,111 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             uploadFile(path, data, mimeType, "");
     }
 
+    void upsertFileFromPath(const std::string & path, const Path & srcPath,
+        const std::string & mimeType) override
+    {
+        /* With multi-part uploads enabled, the transfer manager
+           reads the file in chunks of `buffer-size' bytes. */
+        auto stream = std::make_shared<std::fstream>(srcPath, std::ios_base::in | std::ios_base::binary);
+        if (!*stream) throw SysError("opening '%s'", srcPath);
+        stream->seekg(0, std::ios_base::end);
+        uint64_t size = stream->tellg();
+        stream->seekg(0, std::ios_base::beg);
+        uploadFile(path, stream, size, mimeType, "");
+    }
+
+    Aws::S3::Model::GetObjectRequest makeRangeRequest(const std::string & path,
+        uint64_t start, uint64_t end)
+    {
+        auto request =
+            Aws::S3::Model::GetObjectRequest()
+            .WithBucket(bucketName)
+            .WithKey(path)
+            .WithRange(fmt("bytes=%d-%d", start, end - 1));
+
+        request.SetResponseStreamFactory([]() {
+            return Aws::New<std::stringstream>("STRINGSTREAM");
+        });
+
+        return request;
+    }
+
+    /* Download a file as a sequence of ranges of `buffer-size' bytes,
+       fetching up to `download-threads' of them in parallel, and pass
+       them to `sink' in order. The first request tells us the size of
+       the file, so small files take a single request. */
+    void getFileInParts(const std::string & path, Sink & sink)
+    {
+        stats.get++;
+
+        auto now1 = std::chrono::steady_clock::now();
+
+        uint64_t partSize = bufferSize;
+
+        auto outcome = s3Helper.client->GetObject(makeRangeRequest(path, 0, partSize));
+
+        if (!outcome.IsSuccess()) {
+            auto & error = outcome.GetError();
+            if (error.GetErrorType() == Aws::S3::S3Errors::NO_SUCH_KEY)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            /* S3 doesn't return ranges of empty files. */
+            if (error.GetResponseCode() == Aws::Http::HttpResponseCode::REQUESTED_RANGE_NOT_SATISFIABLE)
+                return;
+            throw Error("AWS error fetching '%s': %s", path, error.GetMessage());
+        }
+
+        auto result = outcome.GetResultWithOwnership();
+
+        /* E.g. "bytes 0-5242879/123456789". */
+        uint64_t total;
+        auto contentRange = result.GetContentRange();
+        auto slash = contentRange.rfind('/');
+        if (slash == std::string::npos || !string2Int(std::string(contentRange, slash + 1), total))
+            throw Error("AWS returned an invalid Content-Range for '%s'", path);
+
+        auto decompressor = makeDecompressionSink(result.GetContentEncoding(), sink);
+
+        auto first = dynamic_cast<std::stringstream &>(result.GetBody()).str();
+        if (first.size() != std::min(partSize, total))
+            throw Error("got a truncated response fetching '%s'", path);
+        (*decompressor)(first);
+
+        std::deque<std::pair<uint64_t, Aws::S3::Model::GetObjectOutcomeCallable>> parts;
+        uint64_t next = first.size();
+
+        while (next < total || !parts.empty()) {
+            while (next < total && parts.size() < downloadThreads) {
+                auto end = std::min(next + partSize, total);
+                parts.emplace_back(end - next,
+                    s3Helper.client->GetObjectCallable(makeRangeRequest(path, next, end)));
+                next = end;
+            }
+
+            auto result = checkAws(fmt("AWS error fetching '%s'", path), parts.front().second.get());
+            auto part = dynamic_cast<std::stringstream &>(result.GetBody()).str();
+            if (part.size() != parts.front().first)
+                throw Error("got a truncated response fetching '%s'", path);
+            parts.pop_front();
+
+            (*decompressor)(part);
+        }
+
+        decompressor->finish();
+
+        auto now2 = std::chrono::steady_clock::now();
+        auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+
+        printTalkative("downloaded 's3://%s/%s' (%d bytes) in %d ms",
+            bucketName, path, total, duration);
+
+        stats.getBytes += total;
+        stats.getTimeMs += duration;
+    }
+
     void getFile(const std::string & path, Sink & sink) override
     {
+        if (multipartDownload) return getFileInParts(path, sink);
+
         stats.get++;
 
         // FIXME: stream output to sink.
@@ -382,6 +604,38 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
     }
 
+    std::string getFileRange(const std::string & path,
+        uint64_t offset, uint64_t length) override
+    {
+        if (!length) return "";
+
+        stats.get++;
+
+        auto outcome = s3Helper.client->GetObject(makeRangeRequest(path, offset, offset + length));
+
+        if (!outcome.IsSuccess()) {
+            auto & error = outcome.GetError();
+            if (error.GetErrorType() == Aws::S3::S3Errors::NO_SUCH_KEY)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            throw Error("AWS error fetching '%s': %s", path, error.GetMessage());
+        }
+
+        auto result = outcome.GetResultWithOwnership();
+
+        /* Ranges refer to the stored object, so they're meaningless
+           if it was compressed on upload. */
+        if (result.GetContentEncoding() != "")
+            return BinaryCacheStore::getFileRange(path, offset, length);
+
+        auto data = dynamic_cast<std::stringstream &>(result.GetBody()).str();
+        if (data.size() != length)
+            throw Error("got a truncated response fetching '%s'", path);
+
+        stats.getBytes += length;
+
+        return data;
+    }
+
     PathSet queryAllValidPaths() override
     {
         PathSet paths;
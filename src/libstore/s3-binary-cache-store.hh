@@ -25,6 +25,7 @@ public:
         std::atomic<uint64_t> getBytes{0};
         std::atomic<uint64_t> getTimeMs{0};
         std::atomic<uint64_t> head{0};
+        std::atomic<uint64_t> list{0};
     };
 
     virtual const Stats & getS3Stats() = 0;
@@ -7,9 +7,17 @@ create table if not exists ValidPaths (
     narSize          integer,
     ultimate         integer, -- null implies "false"
     sigs             text, -- space-separated
-    ca               text -- if not null, an assertion that the path is content-addressed; see ValidPathInfo
+    ca               text, -- if not null, an assertion that the path is content-addressed; see ValidPathInfo
+    closureSize      integer, -- sum of the narSizes of the closure; null if not computed yet
+    closureCount     integer, -- number of paths in the closure; likewise
+    hashPart         text, -- the hash part of `path'
+    lastVerified     integer, -- when the contents were last checked against `hash'; null if never
+    treeHash         text, -- hash of `hash' and the tree hash of the contents when they were last checked; null if not computed
+    contentHash      text -- hash of the contents modulo the hash parts of the path and its references; null if not computed
 );
 
+create index if not exists IndexHashPart on ValidPaths(hashPart);
+
 create table if not exists Refs (
     referrer  integer not null,
     reference integer not null,
@@ -40,3 +48,30 @@ create table if not exists DerivationOutputs (
 );
 
 create index if not exists IndexDerivationOutputs on DerivationOutputs(path);
+
+-- The files in the .links directory used by store optimisation, so
+-- that neither optimisation nor the garbage collector has to read
+-- that directory.
+create table if not exists Links (
+    hash  text primary key not null, -- name of the link, i.e. the base-32 hash of its contents
+    inode integer not null
+);
+
+create index if not exists IndexLinksInode on Links(inode);
+
+-- For each file content hash, a file that `optimise-method = reflink'
+-- deduplicates later files with the same contents against.
+create table if not exists DedupSources (
+    hash text primary key not null,
+    path text not null -- relative to the store directory
+);
+
+-- For the resolved hash of a derivation (see `early-cutoff'), the
+-- outputs produced by some derivation with that hash. These need not
+-- be valid anymore.
+create table if not exists EquivalentOutputs (
+    resolvedHash text not null,
+    id           text not null, -- symbolic output id, usually "out"
+    path         text not null,
+    primary key (resolvedHash, id)
+);
@@ -3,10 +3,13 @@
 
 #include <sqlite3.h>
 
+#include <algorithm>
 #include <atomic>
 
 namespace nix {
 
+SQLiteStats sqliteStats;
+
 [[noreturn]] void throwSQLiteError(sqlite3 * db, const FormatOrString & fs)
 {
     int err = sqlite3_errcode(db);
@@ -42,6 +45,32 @@ SQLite::~SQLite()
     }
 }
 
+/* The busy handler installed by SQLite::setBusyTimeout(). `count' is
+   the number of times it has been called for the current lock; the
+   delay doubles from 1 ms to 100 ms and then stays there. */
+static int busyHandler(void * timeout, int count)
+{
+    uint64_t delay = count < 7 ? 1 << count : 100;
+    uint64_t waited = count < 7 ? (1 << count) - 1 : 127 + (count - 7) * 100;
+    if (waited >= (uintptr_t) timeout) return 0;
+
+    sqliteStats.busyRetries++;
+    sqliteStats.busyWaitMs += delay;
+
+    struct timespec t;
+    t.tv_sec = 0;
+    t.tv_nsec = delay * 1000 * 1000;
+    nanosleep(&t, 0);
+    return 1;
+}
+
+void SQLite::setBusyTimeout(uint64_t ms)
+{
+    /* Pass the timeout by value, since this object may be moved. */
+    if (sqlite3_busy_handler(db, busyHandler, (void *) (uintptr_t) ms) != SQLITE_OK)
+        throwSQLiteError(db, "setting timeout");
+}
+
 void SQLite::exec(const std::string & stmt)
 {
     retrySQLite<void>([&]() {
@@ -175,7 +204,7 @@ SQLiteTxn::~SQLiteTxn()
     }
 }
 
-void handleSQLiteBusy(const SQLiteBusy & e)
+void handleSQLiteBusy(const SQLiteBusy & e, unsigned int attempt)
 {
     static std::atomic<time_t> lastWarned{0};
 
@@ -187,11 +216,19 @@ void handleSQLiteBusy(const SQLiteBusy & e)
     }
 
     /* Sleep for a while since retrying the transaction right away
-       is likely to fail again. */
+       is likely to fail again.  The upper bound doubles with every
+       attempt, from 2 ms up to 1 s; the delay is randomised so that
+       competing processes don't retry in lockstep. */
     checkInterrupt();
+    uint64_t maxDelay = std::min<uint64_t>(1000, 2 << std::min(attempt, 9u));
+    uint64_t delay = maxDelay / 2 + random() % (maxDelay / 2 + 1);
+
+    sqliteStats.busyRetries++;
+    sqliteStats.busyWaitMs += delay;
+
     struct timespec t;
-    t.tv_sec = 0;
-    t.tv_nsec = (random() % 100) * 1000 * 1000; /* <= 0.1s */
+    t.tv_sec = delay / 1000;
+    t.tv_nsec = (delay % 1000) * 1000 * 1000;
     nanosleep(&t, 0);
 }
 
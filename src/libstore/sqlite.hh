@@ -1,5 +1,6 @@
 #pragma once
 
+#include <atomic>
 #include <functional>
 #include <string>
 
@@ -23,6 +24,11 @@ struct SQLite
     operator sqlite3 * () { return db; }
 
     void exec(const std::string & stmt);
+
+    /* Wait up to `ms' milliseconds for a lock held by another
+       connection, backing off exponentially, rather than failing
+       with SQLITE_BUSY right away. */
+    void setBusyTimeout(uint64_t ms);
 };
 
 /* RAII wrapper to create and destroy SQLite prepared statements. */
@@ -95,18 +101,32 @@ MakeError(SQLiteBusy, SQLiteError);
 
 [[noreturn]] void throwSQLiteError(sqlite3 * db, const FormatOrString & fs);
 
-void handleSQLiteBusy(const SQLiteBusy & e);
+/* Contention statistics for all SQLite databases opened by this
+   process: the number of times a lock couldn't be acquired (in the
+   busy handler or by retrySQLite()), and the total time spent
+   sleeping as a result. */
+struct SQLiteStats
+{
+    std::atomic<uint64_t> busyRetries{0};
+    std::atomic<uint64_t> busyWaitMs{0};
+};
+
+extern SQLiteStats sqliteStats;
+
+/* Sleep before retrying a transaction that failed with SQLITE_BUSY
+   for the `attempt'th time. */
+void handleSQLiteBusy(const SQLiteBusy & e, unsigned int attempt);
 
 /* Convenience function for retrying a SQLite transaction when the
    database is busy. */
 template<typename T>
 T retrySQLite(std::function<T()> fun)
 {
-    while (true) {
+    for (unsigned int attempt = 0; ; ++attempt) {
         try {
             return fun();
         } catch (SQLiteBusy & e) {
-            handleSQLiteBusy(e);
+            handleSQLiteBusy(e, attempt);
         }
     }
 }
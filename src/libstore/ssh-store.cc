@@ -44,6 +44,12 @@ private:
     struct Connection : RemoteStore::Connection
     {
         std::unique_ptr<SSHMaster::Connection> sshConn;
+
+        void closeWrite() override
+        {
+            to.flush();
+            sshConn->in = -1;
+        }
     };
 
     ref<RemoteStore::Connection> openConnection() override;
@@ -52,7 +58,7 @@ private:
 
     SSHMaster master;
 
-    void setOptions(RemoteStore::Connection & conn) override
+    bool sendOptions(RemoteStore::Connection & conn) override
     {
         /* TODO Add a way to explicitly ask for some options to be
            forwarded. One option: A way to query the daemon for its
@@ -60,6 +66,7 @@ private:
            forward-cores or forward-overridden-cores that only
            override the requested settings.
         */
+        return false;
     };
 };
 
@@ -1,19 +1,68 @@
 #include "ssh.hh"
+#include "globals.hh"
+#include "hash.hh"
+
+#include <sys/socket.h>
+#include <sys/un.h>
 
 namespace nix {
 
-SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD)
+/* The control socket shared by all SSH connections with the same
+   parameters if `ssh-control-persist' is set. It's named after a hash
+   of the parameters since socket paths are limited to about 100
+   characters. */
+static Path defaultControlPath(const std::string & host, const std::string & keyFile, bool compress)
+{
+    if (!settings.sshControlPersist) return "";
+
+    auto runtimeDir = getEnv("XDG_RUNTIME_DIR");
+    Path dir = (runtimeDir != "" ? runtimeDir + "/nix" : getCacheDir() + "/nix") + "/ssh";
+    createDirs(dir);
+    if (chmod(dir.c_str(), 0700) == -1)
+        throw SysError("setting permissions of '%s'", dir);
+
+    auto key = fmt("%s %s %d %s", host, keyFile, compress, getEnv("NIX_SSHOPTS"));
+    return dir + "/" + string(hashString(htSHA256, key).to_string(Base32, false), 0, 16);
+}
+
+SSHMaster::SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD,
+    const Path & controlPath, unsigned int persist)
     : host(host)
     , fakeSSH(host == "localhost")
     , keyFile(keyFile)
     , useMaster(useMaster && !fakeSSH)
     , compress(compress)
     , logFD(logFD)
+    , controlPath(fakeSSH ? "" : controlPath != "" ? controlPath : defaultControlPath(host, keyFile, compress))
+    , persist(controlPath != "" ? persist : settings.sshControlPersist)
 {
     if (host == "" || hasPrefix(host, "-"))
         throw Error("invalid SSH host name '%s'", host);
 }
 
+/* Remove a control socket that no master listens on anymore (e.g.
+   because it was killed). Otherwise ssh would make a connection of
+   its own rather than start a new master. */
+static void removeStaleControlSocket(const Path & path)
+{
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1 || !S_ISSOCK(st.st_mode)) return;
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) return;
+    strcpy(addr.sun_path, path.c_str());
+
+    AutoCloseFD fd = socket(PF_UNIX, SOCK_STREAM, 0);
+    if (!fd) return;
+    closeOnExec(fd.get());
+
+    if (connect(fd.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1 && errno == ECONNREFUSED) {
+        debug("removing stale SSH control socket '%s'", path);
+        unlink(path.c_str());
+    }
+}
+
 void SSHMaster::addCommonSSHOpts(Strings & args)
 {
     for (auto & i : tokenizeString<Strings>(getEnv("NIX_SSHOPTS")))
@@ -53,7 +102,15 @@ std::unique_ptr<SSHMaster::Connection> SSHMaster::startCommand(const std::string
         } else {
             args = { "ssh", host.c_str(), "-x", "-a" };
             addCommonSSHOpts(args);
-            if (socketPath != "")
+            if (controlPath != "")
+                /* The first connection becomes the master and stays
+                   around in the background after we exit. */
+                args.insert(args.end(),
+                    { "-S", controlPath
+                    , "-o", "ControlMaster=auto"
+                    , "-o", fmt("ControlPersist=%d", persist)
+                    });
+            else if (socketPath != "")
                 args.insert(args.end(), {"-S", socketPath});
             if (verbosity >= lvlChatty)
                 args.push_back("-v");
@@ -77,6 +134,15 @@ std::unique_ptr<SSHMaster::Connection> SSHMaster::startCommand(const std::string
 
 Path SSHMaster::startMaster()
 {
+    if (controlPath != "") {
+        auto state(state_.lock());
+        if (!state->controlPathChecked) {
+            removeStaleControlSocket(controlPath);
+            state->controlPathChecked = true;
+        }
+        return "";
+    }
+
     if (!useMaster) return "";
 
     auto state(state_.lock());
@@ -16,11 +16,20 @@ private:
     const bool compress;
     const int logFD;
 
+    /* If set, connections are multiplexed over a control socket at
+       this path that outlives this process by `persist' seconds, so
+       that subsequent processes can reuse it. If not given, it
+       defaults to a socket shared by all SSHMasters with the same
+       parameters if `ssh-control-persist' is set. */
+    const Path controlPath;
+    const unsigned int persist;
+
     struct State
     {
         Pid sshMaster;
         std::unique_ptr<AutoDelete> tmpDir;
         Path socketPath;
+        bool controlPathChecked = false;
     };
 
     Sync<State> state_;
@@ -29,7 +38,8 @@ private:
 
 public:
 
-    SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1);
+    SSHMaster(const std::string & host, const std::string & keyFile, bool useMaster, bool compress, int logFD = -1,
+        const Path & controlPath = "", unsigned int persist = 0);
 
     struct Connection
     {
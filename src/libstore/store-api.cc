@@ -6,8 +6,14 @@
 #include "thread-pool.hh"
 #include "json.hh"
 #include "derivations.hh"
+#include "sqlite.hh"
+#include "pathlocks.hh"
+#include "path-table.hh"
+#include "download.hh"
 
+#include <condition_variable>
 #include <future>
+#include <unordered_set>
 
 
 namespace nix {
@@ -82,6 +88,24 @@ string storePathToHash(const Path & path)
 }
 
 
+std::optional<StorePathHash> StorePathHash::parse(std::string_view hashPart)
+{
+    StorePathHash res;
+    if (hashPart.size() != storePathHashLen || !base32Decode(hashPart, res.hash, size))
+        return {};
+    return res;
+}
+
+
+std::optional<StorePathHash> storePathHash(const Path & path)
+{
+    auto slash = path.rfind('/');
+    auto base = std::string_view(path).substr(slash == Path::npos ? 0 : slash + 1);
+    if (base.size() < storePathHashLen) return {};
+    return StorePathHash::parse(base.substr(0, storePathHashLen));
+}
+
+
 void checkStoreName(const string & name)
 {
     string validChars = "+-._?=";
@@ -245,9 +269,40 @@ Path Store::computeStorePathForText(const string & name, const string & s,
 }
 
 
+struct Store::ClosureGraph
+{
+    struct Node
+    {
+        bool loaded = false;
+        std::vector<PathTable::Id> references;
+        uint64_t narSize = 0, downloadSize = 0;
+        std::optional<std::pair<uint64_t, uint64_t>> closureSize;
+    };
+
+    PathTable paths;
+    std::vector<Node> nodes;
+
+    /* `visited[id] == generation' iff `id' has been visited by the
+       current traversal. */
+    std::vector<uint32_t> visited;
+    uint32_t generation = 0;
+
+    PathTable::Id intern(const Path & path)
+    {
+        auto id = paths.intern(path);
+        if (id >= nodes.size()) {
+            nodes.resize(id + 1);
+            visited.resize(id + 1, 0);
+        }
+        return id;
+    }
+};
+
+
 Store::Store(const Params & params)
     : Config(params)
-    , state({(size_t) pathInfoCacheSize})
+    , pathInfoCache((size_t) pathInfoCacheSize)
+    , closureGraph(std::make_shared<Sync<ClosureGraph>>())
 {
 }
 
@@ -262,11 +317,15 @@ bool Store::isValidPath(const Path & storePath)
 {
     assertStorePath(storePath);
 
+    /* A store entry whose hash part can't be decoded was never
+       written by Nix, so it isn't a valid path. */
+    auto hash = storePathHash(storePath);
+    if (!hash) return false;
+
     auto hashPart = storePathToHash(storePath);
 
     {
-        auto state_(state.lock());
-        auto res = state_->pathInfoCache.get(hashPart);
+        auto res = pathInfoCache.get(*hash);
         if (res) {
             stats.narInfoReadAverted++;
             return *res != 0;
@@ -274,12 +333,13 @@ bool Store::isValidPath(const Path & storePath)
     }
 
     if (diskCache) {
-        auto res = diskCache->lookupNarInfo(getUri(), hashPart);
+        bool stale;
+        auto res = diskCache->lookupNarInfo(getUri(), hashPart, &stale);
         if (res.first != NarInfoDiskCache::oUnknown) {
             stats.narInfoReadAverted++;
-            auto state_(state.lock());
-            state_->pathInfoCache.upsert(hashPart,
+            pathInfoCache.upsert(*hash,
                 res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
+            if (stale) refreshPathInfo(storePath);
             return res.first == NarInfoDiskCache::oValid;
         }
     }
@@ -330,11 +390,15 @@ void Store::queryPathInfo(const Path & storePath,
     assertStorePath(storePath);
 
     auto hashPart = storePathToHash(storePath);
+    auto hash = storePathHash(storePath);
 
     try {
 
+        if (!hash)
+            throw InvalidPath(format("path '%s' is not valid") % storePath);
+
         {
-            auto res = state.lock()->pathInfoCache.get(hashPart);
+            auto res = pathInfoCache.get(*hash);
             if (res) {
                 stats.narInfoReadAverted++;
                 if (!*res)
@@ -344,52 +408,146 @@ void Store::queryPathInfo(const Path & storePath,
         }
 
         if (diskCache) {
-            auto res = diskCache->lookupNarInfo(getUri(), hashPart);
+            /* Stale entries are used while they're refreshed. */
+            bool stale;
+            auto res = diskCache->lookupNarInfo(getUri(), hashPart, &stale);
             if (res.first != NarInfoDiskCache::oUnknown) {
                 stats.narInfoReadAverted++;
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(hashPart,
-                        res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
-                    if (res.first == NarInfoDiskCache::oInvalid ||
-                        (res.second->path != storePath && storePathToName(storePath) != ""))
-                        throw InvalidPath(format("path '%s' is not valid") % storePath);
-                }
+                pathInfoCache.upsert(*hash,
+                    res.first == NarInfoDiskCache::oInvalid ? 0 : res.second);
+                if (stale) refreshPathInfo(storePath);
+                if (res.first == NarInfoDiskCache::oInvalid ||
+                    (res.second->path != storePath && storePathToName(storePath) != ""))
+                    throw InvalidPath(format("path '%s' is not valid") % storePath);
                 return callback(ref<ValidPathInfo>(res.second));
             }
         }
 
     } catch (...) { return callback.rethrow(); }
 
-    queryPathInfoUncached(storePath,
-        {[this, storePath, hashPart, callback](std::future<std::shared_ptr<ValidPathInfo>> fut) {
+    fetchPathInfo(storePath, &callback);
+}
 
-            try {
-                auto info = fut.get();
 
-                if (diskCache)
-                    diskCache->upsertNarInfo(getUri(), hashPart, info);
+void Store::refreshPathInfo(const Path & storePath)
+{
+    debug("refreshing the cached info of '%s'", storePath);
+    fetchPathInfo(storePath, nullptr);
+}
 
-                {
-                    auto state_(state.lock());
-                    state_->pathInfoCache.upsert(hashPart, info);
-                }
 
-                if (!info
-                    || (info->path != storePath && storePathToName(storePath) != ""))
-                {
-                    stats.narInfoMissing++;
-                    throw InvalidPath("path '%s' is not valid", storePath);
-                }
+void Store::fetchPathInfo(const Path & storePath, Callback<ref<ValidPathInfo>> * callback)
+{
+    auto hashPart = storePathToHash(storePath);
+    auto hash = storePathHash(storePath);
 
+    {
+        auto pending(pendingPathInfo.lock());
+        auto i = pending->find(storePath);
+        if (i != pending->end()) {
+            if (callback) {
+                i->second.callbacks.push_back(*callback);
+                if (i->second.promotion && getDefaultDownloadPriority() != DownloadPriority::Speculative)
+                    i->second.promotion->promote();
+            }
+            return;
+        }
+        PendingPathInfo entry;
+        if (callback) entry.callbacks.push_back(*callback);
+        entry.promotion = getCurrentDownloadPromotion();
+        pending->emplace(storePath, std::move(entry));
+    }
+
+    /* Nobody may be holding on to this store while it's being
+       refreshed in the background. */
+    std::shared_ptr<Store> keepAlive;
+    if (!callback) keepAlive = shared_from_this();
+
+    /* Pass the result to everybody who asked for this path in the
+       meantime. */
+    auto finish = [this, storePath, keepAlive](std::shared_ptr<ValidPathInfo> info, std::exception_ptr exc) {
+        std::vector<Callback<ref<ValidPathInfo>>> callbacks;
+        {
+            auto pending(pendingPathInfo.lock());
+            auto i = pending->find(storePath);
+            if (i == pending->end()) return;
+            callbacks = std::move(i->second.callbacks);
+            pending->erase(i);
+        }
+        for (auto & callback : callbacks)
+            if (exc)
+                callback.rethrow(exc);
+            else
                 callback(ref<ValidPathInfo>(info));
-            } catch (...) { callback.rethrow(); }
-        }});
+    };
+
+    try {
+        queryPathInfoUncached(storePath,
+            {[this, storePath, hashPart, hash, finish](std::future<std::shared_ptr<ValidPathInfo>> fut) {
+
+                std::shared_ptr<ValidPathInfo> info;
+                std::exception_ptr exc;
+
+                try {
+                    info = fut.get();
+
+                    if (diskCache)
+                        diskCache->upsertNarInfo(getUri(), hashPart, info);
+
+                    if (hash) pathInfoCache.upsert(*hash, info);
+
+                    if (!info
+                        || (info->path != storePath && storePathToName(storePath) != ""))
+                    {
+                        stats.narInfoMissing++;
+                        throw InvalidPath("path '%s' is not valid", storePath);
+                    }
+                } catch (...) { exc = std::current_exception(); }
+
+                finish(info, exc);
+            }});
+    } catch (...) { finish(nullptr, std::current_exception()); }
+}
+
+
+std::map<string, Path> Store::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    std::map<string, Path> res;
+    for (auto & hashPart : hashParts) {
+        auto path = queryPathFromHashPart(hashPart);
+        if (!path.empty()) res.emplace(hashPart, path);
+    }
+    return res;
+}
+
+
+void Store::preloadPathInfoCache(const PathSet & paths)
+{
+    if (!diskCache) return;
+
+    StringSet hashParts;
+    for (auto & path : paths) {
+        auto hash = storePathHash(path);
+        if (hash && !pathInfoCache.get(*hash))
+            hashParts.insert(storePathToHash(path));
+    }
+
+    if (hashParts.empty()) return;
+
+    for (auto & i : diskCache->lookupNarInfos(getUri(), hashParts)) {
+        auto hash = StorePathHash::parse(i.first);
+        if (!hash) continue;
+        stats.narInfoReadAverted++;
+        pathInfoCache.upsert(*hash,
+            i.second.first == NarInfoDiskCache::oInvalid ? 0 : i.second.second);
+    }
 }
 
 
 PathSet Store::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
+    preloadPathInfoCache(paths);
+
     struct State
     {
         size_t left;
@@ -538,29 +696,158 @@ void Store::pathInfoToJSON(JSONPlaceholder & jsonOut, const PathSet & storePaths
 }
 
 
+void Store::loadClosureGraph(const Paths & paths)
+{
+    /* Query the missing paths and their missing references in
+       parallel, like computeFSClosure() does.  The graph is only
+       locked to record each result. */
+    struct State
+    {
+        size_t pending = 0;
+        std::unordered_set<StorePathHash> seen;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_;
+    std::condition_variable done;
+
+    auto finish = [&](std::exception_ptr exc) {
+        auto state(state_.lock());
+        if (exc && !state->exc) state->exc = exc;
+        assert(state->pending);
+        if (!--state->pending) done.notify_one();
+    };
+
+    std::function<void(const Path &)> enqueue;
+
+    enqueue = [&](const Path & path) -> void {
+        {
+            auto state(state_.lock());
+            if (state->exc) return;
+            auto hash = storePathHash(path);
+            if (hash && !state->seen.insert(*hash).second) return;
+            state->pending++;
+        }
+
+        queryPathInfo(path, {[&, path](std::future<ref<ValidPathInfo>> fut) {
+            try {
+                auto info = fut.get();
+                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                    std::shared_ptr<ValidPathInfo>(info));
+
+                Paths missing;
+                {
+                    auto graph(closureGraph->lock());
+                    std::vector<PathTable::Id> references;
+                    for (auto & ref : info->references) {
+                        auto id = graph->intern(ref);
+                        references.push_back(id);
+                        if (!graph->nodes[id].loaded) missing.push_back(ref);
+                    }
+                    auto & node(graph->nodes[graph->intern(path)]);
+                    node.references = std::move(references);
+                    node.narSize = info->narSize;
+                    node.downloadSize = narInfo ? narInfo->fileSize : 0;
+                    node.loaded = true;
+                }
+
+                for (auto & ref : missing)
+                    if (ref != path) enqueue(ref);
+
+                finish(nullptr);
+            } catch (...) {
+                finish(std::current_exception());
+            }
+        }});
+    };
+
+    for (auto & path : paths)
+        enqueue(path);
+
+    auto state(state_.lock());
+    while (state->pending) state.wait(done);
+    if (state->exc) std::rethrow_exception(state->exc);
+}
+
+
 std::pair<uint64_t, uint64_t> Store::getClosureSize(const Path & storePath)
 {
-    uint64_t totalNarSize = 0, totalDownloadSize = 0;
-    PathSet closure;
-    computeFSClosure(storePath, closure, false, false);
-    for (auto & p : closure) {
-        auto info = queryPathInfo(p);
-        totalNarSize += info->narSize;
-        auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-            std::shared_ptr<const ValidPathInfo>(info));
-        if (narInfo)
-            totalDownloadSize += narInfo->fileSize;
+    /* Start over once the graph has grown past the size of the path
+       info cache, so that it doesn't keep every path ever queried. */
+    {
+        auto graph(closureGraph->lock());
+        if (graph->paths.size() > (size_t) pathInfoCacheSize)
+            *graph = ClosureGraph();
+    }
+
+    while (true) {
+
+        Paths missing;
+
+        {
+            auto graph(closureGraph->lock());
+
+            auto root = graph->intern(storePath);
+            if (graph->nodes[root].closureSize)
+                return *graph->nodes[root].closureSize;
+
+            if (++graph->generation == 0) {
+                std::fill(graph->visited.begin(), graph->visited.end(), 0);
+                graph->generation = 1;
+            }
+            auto generation = graph->generation;
+
+            uint64_t totalNarSize = 0, totalDownloadSize = 0;
+
+            std::vector<PathTable::Id> todo{root};
+            graph->visited[root] = generation;
+
+            while (!todo.empty()) {
+                auto id = todo.back();
+                todo.pop_back();
+
+                auto & node(graph->nodes[id]);
+                if (!node.loaded) {
+                    missing.push_back(graph->paths[id]);
+                    continue;
+                }
+
+                totalNarSize += node.narSize;
+                totalDownloadSize += node.downloadSize;
+
+                for (auto ref : node.references)
+                    if (graph->visited[ref] != generation) {
+                        graph->visited[ref] = generation;
+                        todo.push_back(ref);
+                    }
+            }
+
+            if (missing.empty()) {
+                graph->nodes[root].closureSize = std::make_pair(totalNarSize, totalDownloadSize);
+                return {totalNarSize, totalDownloadSize};
+            }
+        }
+
+        /* Load the parts of the closure that we haven't seen yet,
+           and try again. */
+        loadClosureGraph(missing);
     }
-    return {totalNarSize, totalDownloadSize};
 }
 
 
 const Store::Stats & Store::getStats()
 {
-    {
-        auto state_(state.lock());
-        stats.pathInfoCacheSize = state_->pathInfoCache.size();
-    }
+    auto cacheStats = pathInfoCache.getStats();
+    stats.pathInfoCacheSize = cacheStats.size;
+    stats.pathInfoCacheHits = cacheStats.hits;
+    stats.pathInfoCacheMisses = cacheStats.misses;
+    stats.pathInfoCacheContended = cacheStats.contended;
+    stats.sqliteBusyRetries = sqliteStats.busyRetries.load();
+    stats.sqliteBusyWaitMs = sqliteStats.busyWaitMs.load();
+    stats.pathLockWaits = pathLockStats.waits.load();
+    stats.pathLockWaitMs = pathLockStats.waitTimeMs.load();
+    stats.gcLockWaits = gcLockStats.waits.load();
+    stats.gcLockWaitMs = gcLockStats.waitTimeMs.load();
     return stats;
 }
 
@@ -576,6 +863,86 @@ void Store::buildPaths(const PathSet & paths, BuildMode buildMode)
 }
 
 
+/* Call `copy' for every path in `infos' after it has been called for
+   the references of the path that are in `infos'. Of the paths that
+   are ready, the largest one that fits in the `copy-bytes-in-flight'
+   budget is started first, so that big NARs don't end up at the tail
+   of the copy. A path that is larger than the whole budget is started
+   when nothing else is in flight. */
+static void scheduleCopies(const std::map<Path, const ValidPathInfo *> & infos,
+    std::function<void(const ValidPathInfo & info)> copy)
+{
+    ThreadPool pool;
+
+    uint64_t limit = std::max((uint64_t) 1, settings.copyBytesInFlight.get());
+
+    struct State
+    {
+        std::multimap<uint64_t, const ValidPathInfo *> ready;
+        std::map<Path, size_t> refsLeft;
+        std::map<Path, PathSet> referrers;
+        uint64_t inFlight = 0;
+        size_t running = 0, done = 0;
+    };
+
+    Sync<State> state_;
+
+    std::function<void(State &)> startCopies;
+
+    auto runCopy = [&](const ValidPathInfo * info, uint64_t size) {
+        copy(*info);
+
+        auto state(state_.lock());
+        state->inFlight -= size;
+        state->running--;
+        state->done++;
+        for (auto & referrer : state->referrers[info->path])
+            if (!--state->refsLeft[referrer]) {
+                auto i = infos.at(referrer);
+                state->ready.emplace(i->narSize, i);
+            }
+        startCopies(*state);
+    };
+
+    startCopies = [&](State & state) {
+        while (!state.ready.empty() && state.running < pool.getMaxThreads()) {
+            auto i = state.ready.upper_bound(limit - state.inFlight);
+            if (i == state.ready.begin()) {
+                if (state.inFlight) break;
+                i = state.ready.end();
+            }
+            --i;
+            auto info = i->second;
+            auto size = std::min(i->first, limit);
+            state.ready.erase(i);
+            state.inFlight += size;
+            state.running++;
+            pool.enqueue([&runCopy, info, size]() { runCopy(info, size); });
+        }
+    };
+
+    {
+        auto state(state_.lock());
+        for (auto & i : infos) {
+            size_t n = 0;
+            for (auto & ref : i.second->references)
+                if (ref != i.first && infos.count(ref)) {
+                    state->referrers[ref].insert(i.first);
+                    n++;
+                }
+            state->refsLeft[i.first] = n;
+            if (!n) state->ready.emplace(i.second->narSize, i.second);
+        }
+        startCopies(*state);
+    }
+
+    pool.process();
+
+    if (state_.lock()->done != infos.size())
+        throw Error("copying paths incomplete (cyclic reference?)");
+}
+
+
 void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
     const Path & storePath, RepairFlag repair, CheckSigsFlag checkSigs)
 {
@@ -596,17 +963,29 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
     uint64_t total = 0;
 
     if (!info->narHash) {
-        StringSink sink;
-        srcStore->narFromPath({storePath}, sink);
+        /* If the NAR may be big, fetch it twice rather than keeping
+           it in memory: once to compute its hash, and once to copy
+           it below. */
+        if (info->narSize && info->narSize <= settings.copyBytesInFlight) {
+            StringSink sink;
+            srcStore->narFromPath({storePath}, sink);
+            auto info2 = make_ref<ValidPathInfo>(*info);
+            info2->narHash = hashString(htSHA256, *sink.s);
+            if (info->ultimate) info2->ultimate = false;
+            info = info2;
+
+            StringSource source(*sink.s);
+            dstStore->addToStore(*info, source, repair, checkSigs);
+            return;
+        }
+
+        HashSink hashSink(htSHA256);
+        srcStore->narFromPath({storePath}, hashSink);
+        auto hash = hashSink.finish();
         auto info2 = make_ref<ValidPathInfo>(*info);
-        info2->narHash = hashString(htSHA256, *sink.s);
-        if (!info->narSize) info2->narSize = sink.s->size();
-        if (info->ultimate) info2->ultimate = false;
+        info2->narHash = hash.first;
+        info2->narSize = hash.second;
         info = info2;
-
-        StringSource source(*sink.s);
-        dstStore->addToStore(*info, source, repair, checkSigs);
-        return;
     }
 
     if (info->ultimate) {
@@ -615,32 +994,39 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
-    auto source = sinkToSource([&](Sink & sink) {
-        LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
-            sink(data, len);
-            total += len;
-            act.progress(total, info->narSize);
-        });
-        srcStore->narFromPath({storePath}, wrapperSink);
-    }, [&]() {
-        throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", storePath, srcStore->getUri());
+    /* Fetch (and possibly decompress) the NAR in a separate thread,
+       so that it's not held up while the destination store is
+       unpacking the previous part of it, and vice versa. The
+       destination store checks the NAR hash while reading it. */
+    auto narSource = srcStore->narSourceFromPath(storePath, &*dstStore);
+
+    LambdaSource source([&](unsigned char * data, size_t len) {
+        auto n = narSource->read(data, len);
+        total += n;
+        act.progress(total, info->narSize);
+        return n;
     });
 
-    dstStore->addToStore(*info, *source, repair, checkSigs);
+    dstStore->addToStore(*info, source, repair, checkSigs);
 }
 
 
-void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePaths,
-    RepairFlag repair, CheckSigsFlag checkSigs, SubstituteFlag substitute)
+std::unique_ptr<Source> Store::narSourceFromPath(const Path & path, Store * deltaBaseStore)
 {
-    PathSet valid = dstStore->queryValidPaths(storePaths, substitute);
-
-    PathSet missing;
-    for (auto & path : storePaths)
-        if (!valid.count(path)) missing.insert(path);
+    auto act = getCurActivity();
+    return sinkToSourceThreaded([this, path, act](Sink & sink) {
+        PushActivity pact(act);
+        narFromPath(path, sink);
+    }, [this, path]() {
+        throw EndOfFile("NAR for '%s' fetched from '%s' is incomplete", path, getUri());
+    });
+}
 
-    if (missing.empty()) return;
 
+/* Copy paths that are known to be missing from `dstStore'. */
+static void copyMissingPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & missing,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
     Activity act(*logger, lvlInfo, actCopyPaths, fmt("copying %d paths", missing.size()));
 
     std::atomic<size_t> nrDone{0};
@@ -652,47 +1038,182 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePa
         act.progress(nrDone, missing.size(), nrRunning, nrFailed);
     };
 
-    ThreadPool pool;
+    /* Unless we have to carry on after failures, let the destination
+       import the paths as a batch, which allows local stores to
+       register them in a few transactions rather than one per
+       path. That requires the paths' infos up front, in topological
+       order. */
+    if (!settings.keepGoing) {
+        Sync<ValidPathInfos> infos_;
+        std::atomic<bool> haveHashes{true};
+
+        ThreadPool pool;
+
+        processGraph<Path>(pool, missing,
+            [&](const Path & storePath) {
+                auto info = srcStore->queryPathInfo(storePath);
+                bytesExpected += info->narSize;
+                act.setExpected(actCopyPath, bytesExpected);
+                return info->references;
+            },
+            [&](const Path & storePath) {
+                auto info = srcStore->queryPathInfo(storePath);
+                if (!info->narHash) haveHashes = false;
+                auto infos(infos_.lock());
+                infos->push_back(*info);
+                infos->back().ultimate = false;
+            });
+
+        /* Paths without a NAR hash need the NAR to be fetched first;
+           copyStorePath() deals with that. */
+        if (haveHashes) {
+            auto infos(infos_.lock());
+            auto srcUri = srcStore->getUri();
+
+            dstStore->addMultipleToStore(*infos,
+                [&](const ValidPathInfo & info, Sink & sink) {
+                    checkInterrupt();
+
+                    Activity act2(*logger, lvlInfo, actCopyPath,
+                        fmt("copying path '%s' from '%s'", info.path, srcUri),
+                        {info.path, srcUri, dstStore->getUri()});
+                    PushActivity pact(act2.id);
+
+                    MaintainCount<decltype(nrRunning)> mc(nrRunning);
+                    showProgress();
 
-    processGraph<Path>(pool,
-        PathSet(missing.begin(), missing.end()),
+                    uint64_t total = 0;
+                    LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
+                        sink(data, len);
+                        total += len;
+                        act2.progress(total, info.narSize);
+                    });
+                    srcStore->narFromPath(info.path, wrapperSink);
 
-        [&](const Path & storePath) {
-            if (dstStore->isValidPath(storePath)) {
-                nrDone++;
-                showProgress();
-                return PathSet();
-            }
+                    nrDone++;
+                    showProgress();
+                },
+                repair, checkSigs);
 
-            auto info = srcStore->queryPathInfo(storePath);
+            return;
+        }
 
-            bytesExpected += info->narSize;
-            act.setExpected(actCopyPath, bytesExpected);
+        bytesExpected = 0;
+    }
 
-            return info->references;
-        },
+    Sync<std::map<Path, ref<const ValidPathInfo>>> infos_;
 
-        [&](const Path & storePath) {
-            checkInterrupt();
+    {
+        ThreadPool pool;
 
-            if (!dstStore->isValidPath(storePath)) {
-                MaintainCount<decltype(nrRunning)> mc(nrRunning);
-                showProgress();
-                try {
-                    copyStorePath(srcStore, dstStore, storePath, repair, checkSigs);
-                } catch (Error &e) {
-                    nrFailed++;
-                    if (!settings.keepGoing)
-                        throw e;
-                    logger->log(lvlError, format("could not copy %s: %s") % storePath % e.what());
+        for (auto & storePath : missing)
+            pool.enqueue([&, storePath]() {
+                if (dstStore->isValidPath(storePath)) {
+                    nrDone++;
                     showProgress();
                     return;
                 }
-            }
 
-            nrDone++;
+                auto info = srcStore->queryPathInfo(storePath);
+
+                bytesExpected += info->narSize;
+                act.setExpected(actCopyPath, bytesExpected);
+
+                infos_.lock()->emplace(storePath, info);
+            });
+
+        pool.process();
+    }
+
+    auto infos(infos_.lock());
+    std::map<Path, const ValidPathInfo *> byPath;
+    for (auto & i : *infos) byPath.emplace(i.first, &*i.second);
+
+    scheduleCopies(byPath, [&](const ValidPathInfo & info) {
+        checkInterrupt();
+
+        if (!dstStore->isValidPath(info.path)) {
+            MaintainCount<decltype(nrRunning)> mc(nrRunning);
             showProgress();
+            try {
+                copyStorePath(srcStore, dstStore, info.path, repair, checkSigs);
+            } catch (Error &e) {
+                nrFailed++;
+                if (!settings.keepGoing)
+                    throw e;
+                logger->log(lvlError, format("could not copy %s: %s") % info.path % e.what());
+                showProgress();
+                return;
+            }
+        }
+
+        nrDone++;
+        showProgress();
+    });
+}
+
+
+void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePaths,
+    RepairFlag repair, CheckSigsFlag checkSigs, SubstituteFlag substitute)
+{
+    PathSet valid = dstStore->queryValidPaths(storePaths);
+
+    PathSet missing;
+    for (auto & path : storePaths)
+        if (!valid.count(path)) missing.insert(path);
+
+    if (missing.empty()) return;
+
+    if (!substitute) {
+        copyMissingPaths(srcStore, dstStore, missing, repair, checkSigs);
+        return;
+    }
+
+    /* Let the destination substitute what it can, and meanwhile push
+       the paths that it presumably can't get from its substituters:
+       those that we can't substitute either and that don't depend on
+       a path that it's substituting. If we have no substituters to
+       go by, the destination gets to try every path first. */
+    auto substitutable = srcStore->querySubstitutablePaths(missing);
+
+    std::map<Path, bool> canPush;
+    std::function<bool(const Path &)> pushable = [&](const Path & path) {
+        auto i = canPush.find(path);
+        if (i != canPush.end()) return i->second;
+        bool res = !substitutable.count(path);
+        if (res)
+            for (auto & ref : srcStore->queryPathInfo(path)->references)
+                if (ref != path && missing.count(ref) && !pushable(ref)) {
+                    res = false;
+                    break;
+                }
+        canPush[path] = res;
+        return res;
+    };
+
+    PathSet push, rest;
+    for (auto & path : missing)
+        if (!substitutable.empty() && pushable(path))
+            push.insert(path);
+        else
+            rest.insert(path);
+
+    if (!rest.empty()) {
+        auto substituted = std::async(std::launch::async, [&]() {
+            return dstStore->queryValidPaths(rest, Substitute);
         });
+
+        if (!push.empty())
+            copyMissingPaths(srcStore, dstStore, push, repair, checkSigs);
+
+        valid = substituted.get();
+        push.clear();
+        for (auto & path : rest)
+            if (!valid.count(path)) push.insert(path);
+    }
+
+    if (!push.empty())
+        copyMissingPaths(srcStore, dstStore, push, repair, checkSigs);
 }
 
 
@@ -837,6 +1358,31 @@ void Store::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
     addToStore(info, source, repair, checkSigs, accessor);
 }
 
+Paths Store::addTextsToStore(const std::vector<StoreText> & texts,
+    RepairFlag repair)
+{
+    Paths res;
+    for (auto & text : texts)
+        res.push_back(addTextToStore(text.name, text.contents, text.references, repair));
+    return res;
+}
+
+void Store::addMultipleToStore(const ValidPathInfos & infos,
+    std::function<void(const ValidPathInfo & info, Sink & sink)> narFromPath,
+    RepairFlag repair, CheckSigsFlag checkSigs)
+{
+    std::map<Path, const ValidPathInfo *> byPath;
+    for (auto & info : infos) byPath[info.path] = &info;
+
+    scheduleCopies(byPath, [&](const ValidPathInfo & info) {
+        checkInterrupt();
+        auto source = sinkToSource([&](Sink & sink) {
+            narFromPath(info, sink);
+        });
+        addToStore(info, *source, repair, checkSigs);
+    });
+}
+
 }
 
 
@@ -925,8 +1471,14 @@ static RegisterStoreImplementation regStore([](
     -> std::shared_ptr<Store>
 {
     switch (getStoreType(uri, get(params, "state", settings.nixStateDir))) {
-        case tDaemon:
-            return std::shared_ptr<Store>(std::make_shared<UDSRemoteStore>(params));
+        case tDaemon: {
+            /* If we're using the daemon only because we can't write
+               to the store, we can still read its database. */
+            Store::Params params2 = params;
+            if ((uri == "" || uri == "auto") && !params2.count("direct-reads"))
+                params2["direct-reads"] = "true";
+            return std::shared_ptr<Store>(std::make_shared<UDSRemoteStore>(params2));
+        }
         case tLocal: {
             Store::Params params2 = params;
             if (hasPrefix(uri, "/"))
@@ -7,14 +7,17 @@
 #include "sync.hh"
 #include "globals.hh"
 #include "config.hh"
+#include "download.hh"
 
 #include <atomic>
+#include <optional>
 #include <limits>
 #include <map>
 #include <unordered_map>
 #include <unordered_set>
 #include <memory>
 #include <string>
+#include <cstring>
 
 
 namespace nix {
@@ -32,6 +35,7 @@ struct BasicDerivation;
 struct Derivation;
 class FSAccessor;
 class NarInfoDiskCache;
+struct DownloadPromotion;
 class Store;
 class JSONPlaceholder;
 
@@ -45,9 +49,46 @@ enum AllowInvalidFlag : bool { DisallowInvalid = false, AllowInvalid = true };
 /* Size of the hash part of store paths, in base-32 characters. */
 const size_t storePathHashLen = 32; // i.e. 160 bits
 
+
+/* The hash part of a store path in binary form, for use as a compact
+   key instead of the base-32 string or the full path. */
+struct StorePathHash
+{
+    static const size_t size = 20;
+
+    unsigned char hash[size];
+
+    /* Parse the base-32 hash part of a store path.  Returns nothing
+       if it isn't one. */
+    static std::optional<StorePathHash> parse(std::string_view hashPart);
+
+    std::string to_string() const
+    {
+        return base32Encode(hash, size);
+    }
+
+    bool operator == (const StorePathHash & other) const
+    {
+        return memcmp(hash, other.hash, size) == 0;
+    }
+
+    bool operator != (const StorePathHash & other) const
+    {
+        return !(*this == other);
+    }
+
+    bool operator < (const StorePathHash & other) const
+    {
+        return memcmp(hash, other.hash, size) < 0;
+    }
+};
+
 /* Magic header of exportPath() output (obsolete). */
 const uint32_t exportMagic = 0x4558494e;
 
+/* First word of an export with an index (see exportPaths()). */
+const uint64_t exportIndexMagic = 0x5844494e;
+
 
 typedef std::unordered_map<Path, std::unordered_set<std::string>> Roots;
 
@@ -99,6 +140,40 @@ struct GCResults
     /* For `gcReturnDead', `gcDeleteDead' and `gcDeleteSpecific', the
        number of bytes that would be or was freed. */
     unsigned long long bytesFreed = 0;
+
+    /* The number of files and directories that were deleted, and the
+       time this took in seconds. */
+    unsigned long long filesDeleted = 0;
+    double deletionTime = 0;
+};
+
+
+/* What a garbage collection would delete, as computed by
+   Store::planGarbage() without acquiring the GC lock. Sizes are NAR
+   sizes, which approximate the disk space used by the paths. */
+struct GCPlan
+{
+    struct Root
+    {
+        /* The links (e.g. symlinks in /nix/var/nix/gcroots) that make
+           this path a root. */
+        StringSet links;
+
+        /* The size of the closure of the root. */
+        uint64_t closureSize = 0;
+
+        /* The size of the paths that only this root keeps alive,
+           i.e. that would become garbage if it were removed. */
+        uint64_t exclusiveSize = 0;
+    };
+
+    std::map<Path, Root> roots;
+
+    /* The valid paths that would be deleted, and their sizes. */
+    std::map<Path, uint64_t> dead;
+
+    uint64_t deadSize = 0;
+    uint64_t liveSize = 0;
 };
 
 
@@ -108,11 +183,27 @@ struct SubstitutablePathInfo
     PathSet references;
     unsigned long long downloadSize; /* 0 = unknown or inapplicable */
     unsigned long long narSize; /* 0 = unknown */
+    /* The substituter that has the path, if known. Not sent to
+       clients of the daemon. */
+    std::shared_ptr<Store> substituter;
 };
 
 typedef std::map<Path, SubstitutablePathInfo> SubstitutablePathInfos;
 
 
+/* What needs to be done to realise a set of paths, as computed by
+   Store::planMissing(). */
+struct BuildPlan
+{
+    PathSet willBuild, willSubstitute, unknown;
+    unsigned long long downloadSize = 0, narSize = 0;
+
+    /* The substituter chosen for each path in `willSubstitute', if
+       known. */
+    std::map<Path, ref<Store>> substituters;
+};
+
+
 struct ValidPathInfo
 {
     Path path;
@@ -196,6 +287,15 @@ struct ValidPathInfo
 typedef list<ValidPathInfo> ValidPathInfos;
 
 
+/* A regular file to be added to the store by addTextsToStore(). */
+struct StoreText
+{
+    string name;
+    string contents;
+    PathSet references;
+};
+
+
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 
 
@@ -234,6 +334,18 @@ struct BuildResult
        was repeated). */
     time_t startTime = 0, stopTime = 0;
 
+    /* Resource usage of the build (or the last round), if it ran in
+       its own cgroup (see the `use-cgroups' setting); otherwise 0. */
+    uint64_t cpuUser = 0, cpuSystem = 0; // microseconds
+    uint64_t peakMemory = 0, ioRead = 0, ioWrite = 0; // bytes
+
+    /* The most space used in the build directory, if it was on a
+       tmpfs (see the `build-dir-tmpfs' setting); otherwise 0. */
+    uint64_t peakBuildDirUsage = 0; // bytes
+
+    /* Time spent waiting for the output locks held by other builds. */
+    uint64_t lockWaitTime = 0; // milliseconds
+
     bool success() {
         return status == Built || status == Substituted || status == AlreadyValid;
     }
@@ -256,15 +368,36 @@ public:
 
 protected:
 
-    struct State
+    /* Path info keyed by the hash part of the store path, or null for
+       paths known to be invalid. */
+    ShardedLRUCache<StorePathHash, std::shared_ptr<ValidPathInfo>> pathInfoCache;
+
+    /* Callbacks waiting for a queryPathInfoUncached() call that is
+       already in progress, so that concurrent queries for the same
+       path share a single request. */
+    struct PendingPathInfo
     {
-        LRUCache<std::string, std::shared_ptr<ValidPathInfo>> pathInfoCache;
+        std::vector<Callback<ref<ValidPathInfo>>> callbacks;
+
+        /* Set if the query was started speculatively, to promote
+           its downloads once somebody waits for it. */
+        std::shared_ptr<DownloadPromotion> promotion;
     };
 
-    Sync<State> state;
+    Sync<std::map<Path, PendingPathInfo>> pendingPathInfo;
 
     std::shared_ptr<NarInfoDiskCache> diskCache;
 
+    /* The reference graph and closure sizes computed so far by
+       getClosureSize().  It's discarded once it has more paths than
+       `path-info-cache-size'. */
+    struct ClosureGraph;
+    std::shared_ptr<Sync<ClosureGraph>> closureGraph;
+
+    /* Add `paths' and the parts of their closure that aren't in
+       `closureGraph' yet to it. */
+    void loadClosureGraph(const Paths & paths);
+
     Store(const Params & params);
 
 public:
@@ -346,6 +479,12 @@ public:
     virtual PathSet queryValidPaths(const PathSet & paths,
         SubstituteFlag maybeSubstitute = NoSubstitute);
 
+    /* Put the entries of the NAR info disk cache for `paths' in the
+       in-memory path info cache, using a bulk lookup, so that
+       subsequent queries about them don't each go to the disk
+       cache. */
+    virtual void preloadPathInfoCache(const PathSet & paths);
+
     /* Query the set of all valid paths. Note that for some store
        backends, the name part of store paths may be omitted
        (i.e. you'll get /nix/store/<hash> rather than
@@ -362,8 +501,19 @@ public:
     void queryPathInfo(const Path & path,
         Callback<ref<ValidPathInfo>> callback);
 
+    /* Query the store itself about `path' in the background and
+       update the caches with the result, unless such a query is
+       already in progress.  This is how entries of the disk cache
+       that have become stale are refreshed.  Errors are ignored. */
+    void refreshPathInfo(const Path & path);
+
 protected:
 
+    /* Add `callback' (if not null) to the callbacks waiting for the
+       info of `storePath', and start a queryPathInfoUncached() call
+       for it if none is in progress. */
+    void fetchPathInfo(const Path & storePath, Callback<ref<ValidPathInfo>> * callback);
+
     virtual void queryPathInfoUncached(const Path & path,
         Callback<std::shared_ptr<ValidPathInfo>> callback) = 0;
 
@@ -388,10 +538,21 @@ public:
     virtual StringSet queryDerivationOutputNames(const Path & path)
     { unsupported("queryDerivationOutputNames"); }
 
+    /* Return those of the given derivations (in `drv!out1,out2,...'
+       form) whose wanted outputs are all valid, as far as that can be
+       determined without reading the derivations. */
+    virtual PathSet queryBuiltDerivations(const PathSet & paths)
+    { return {}; }
+
     /* Query the full store path given the hash part of a valid store
        path, or "" if the path doesn't exist. */
     virtual Path queryPathFromHashPart(const string & hashPart) = 0;
 
+    /* Like queryPathFromHashPart(), but for many hash parts at once.
+       Hash parts that don't correspond to a valid path are omitted
+       from the result. */
+    virtual std::map<string, Path> queryPathsFromHashParts(const StringSet & hashParts);
+
     /* Query which of the given paths have substitutes. */
     virtual PathSet querySubstitutablePaths(const PathSet & paths) { return {}; };
 
@@ -413,6 +574,17 @@ public:
         RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs,
         std::shared_ptr<FSAccessor> accessor = 0);
 
+    /* Import a set of paths. `infos' must be in topological order
+       (references first), and the references of each path must be
+       valid or in `infos'. `narFromPath' is called to write the NAR
+       of a path to a sink; it may be called concurrently for
+       different paths. The default implementation calls addToStore()
+       for the paths in parallel, respecting references (see
+       scheduleCopies()). */
+    virtual void addMultipleToStore(const ValidPathInfos & infos,
+        std::function<void(const ValidPathInfo & info, Sink & sink)> narFromPath,
+        RepairFlag repair = NoRepair, CheckSigsFlag checkSigs = CheckSigs);
+
     /* Copy the contents of a path to the store and register the
        validity the resulting path.  The resulting path is returned.
        The function object `filter' can be used to exclude files (see
@@ -426,9 +598,24 @@ public:
     virtual Path addTextToStore(const string & name, const string & s,
         const PathSet & references, RepairFlag repair = NoRepair) = 0;
 
+    /* Add several texts to the store, returning their paths in the
+       same order. The references of each text must be valid or
+       earlier in `texts'. The default implementation calls
+       addTextToStore() for each of them. */
+    virtual Paths addTextsToStore(const std::vector<StoreText> & texts,
+        RepairFlag repair = NoRepair);
+
     /* Write a NAR dump of a store path. */
     virtual void narFromPath(const Path & path, Sink & sink) = 0;
 
+    /* Return a source producing the NAR dump of a store path, which
+       is fetched in a separate thread. The default implementation
+       runs narFromPath() in that thread. If `deltaBaseStore' is
+       given, stores that have binary deltas may reconstruct the NAR
+       from a delta against a path that is valid in that store. */
+    virtual std::unique_ptr<Source> narSourceFromPath(const Path & path,
+        Store * deltaBaseStore = nullptr);
+
     /* For each path, if it's a derivation, build it.  Building a
        derivation means ensuring that the output paths are valid.  If
        they are already valid, this is a no-op.  Otherwise, validity
@@ -455,6 +642,14 @@ public:
     virtual void addTempRoot(const Path & path)
     { unsupported("addTempRoot"); }
 
+    /* Add several temporary roots at once. The default implementation
+       calls addTempRoot() for each path. */
+    virtual void addTempRoots(const PathSet & paths)
+    {
+        for (auto & path : paths)
+            addTempRoot(path);
+    }
+
     /* Add an indirect root, which is merely a symlink to `path' from
        /nix/var/nix/gcroots/auto/<hash of `path'>.  `path' is supposed
        to be a symlink to a store path.  The garbage collector will
@@ -495,6 +690,14 @@ public:
     virtual void collectGarbage(const GCOptions & options, GCResults & results)
     { unsupported("collectGarbage"); }
 
+    /* Determine which paths a garbage collection would delete and how
+       much data each root keeps alive, without locking out other
+       processes. The result may be out of date by the time it's
+       returned. If `censor' is set, the links of runtime roots are
+       hidden as in findRoots(). */
+    virtual GCPlan planGarbage(bool censor)
+    { unsupported("planGarbage"); }
+
     /* Return a string representing information about the path that
        can be loaded into the database using `nix-store --load-db' or
        `nix-store --register-validity'. */
@@ -512,8 +715,10 @@ public:
 
     /* Return the size of the closure of the specified path, that is,
        the sum of the size of the NAR serialisation of each path in
-       the closure. */
-    std::pair<uint64_t, uint64_t> getClosureSize(const Path & storePath);
+       the closure. The references and sizes of the paths visited are
+       remembered, so computing the closure sizes of many paths (as
+       in `nix path-info -rS') doesn't query and copy them again. */
+    virtual std::pair<uint64_t, uint64_t> getClosureSize(const Path & storePath);
 
     /* Optimise the disk space usage of the Nix store by hard-linking files
        with the same contents. */
@@ -560,13 +765,21 @@ public:
         PathSet & willBuild, PathSet & willSubstitute, PathSet & unknown,
         unsigned long long & downloadSize, unsigned long long & narSize);
 
+    /* Like queryMissing(), but also return which substituter has
+       each path, so that building the paths afterwards doesn't have
+       to query the substituters again. */
+    BuildPlan planMissing(const PathSet & targets);
+
     /* Sort a set of paths topologically under the references
        relation.  If p refers to q, then p preceeds q in this list. */
     Paths topoSortPaths(const PathSet & paths);
 
     /* Export multiple paths in the format expected by ‘nix-store
-       --import’. */
-    void exportPaths(const Paths & paths, Sink & sink);
+       --import’. If `index' is set, the NARs are preceded by an index
+       of the paths' metadata rather than followed by it, so that
+       importPathsFromFile() can unpack them in parallel or pick out
+       some of them. */
+    void exportPaths(const Paths & paths, Sink & sink, bool index = false);
 
     void exportPath(const Path & path, Sink & sink);
 
@@ -577,6 +790,13 @@ public:
     Paths importPaths(Source & source, std::shared_ptr<FSAccessor> accessor,
         CheckSigsFlag checkSigs = CheckSigs);
 
+    /* Import the contents of an export read from `fd'. If it's an
+       indexed export in a seekable file, the NARs are read from their
+       offsets in parallel, and if `paths' is not empty, only the
+       closure of `paths' within the export is imported. */
+    Paths importPathsFromFile(int fd, const PathSet & paths,
+        CheckSigsFlag checkSigs = CheckSigs);
+
     struct Stats
     {
         std::atomic<uint64_t> narInfoRead{0};
@@ -584,6 +804,9 @@ public:
         std::atomic<uint64_t> narInfoMissing{0};
         std::atomic<uint64_t> narInfoWrite{0};
         std::atomic<uint64_t> pathInfoCacheSize{0};
+        std::atomic<uint64_t> pathInfoCacheHits{0};
+        std::atomic<uint64_t> pathInfoCacheMisses{0};
+        std::atomic<uint64_t> pathInfoCacheContended{0};
         std::atomic<uint64_t> narRead{0};
         std::atomic<uint64_t> narReadBytes{0};
         std::atomic<uint64_t> narReadCompressedBytes{0};
@@ -592,20 +815,52 @@ public:
         std::atomic<uint64_t> narWriteBytes{0};
         std::atomic<uint64_t> narWriteCompressedBytes{0};
         std::atomic<uint64_t> narWriteCompressionTimeMs{0};
+        std::atomic<uint64_t> sqliteBusyRetries{0};
+        std::atomic<uint64_t> sqliteBusyWaitMs{0};
+        std::atomic<uint64_t> pathLockWaits{0};
+        std::atomic<uint64_t> pathLockWaitMs{0};
+        std::atomic<uint64_t> gcLockWaits{0};
+        std::atomic<uint64_t> gcLockWaitMs{0};
+
+        /* For stores that talk to a daemon, statistics about the
+           pool of connections and the operations done on them. */
+        std::atomic<uint64_t> connectionsOpened{0};
+        std::atomic<uint64_t> connectionsReaped{0};
+        std::atomic<uint64_t> connectionsInvalid{0};
+        std::atomic<uint64_t> connectionWaits{0};
+        std::atomic<uint64_t> connectionWaitMs{0};
+        std::atomic<uint64_t> connectionLimit{0};
+        std::atomic<uint64_t> daemonOps{0};
+        std::atomic<uint64_t> daemonOpTimeMs{0};
+
+        /* For stores that talk to an HTTP server, statistics about
+           the requests to that host. */
+        Sync<DownloadHostStats> downloadHostStats;
     };
 
-    const Stats & getStats();
+    virtual const Stats & getStats();
 
     /* Return the build log of the specified store path, if available,
        or null otherwise. */
     virtual std::shared_ptr<std::string> getBuildLog(const Path & path)
     { return nullptr; }
 
+    /* Write the build log of the specified store path to `sink'.
+       Returns false if it's not available.  Unlike getBuildLog(),
+       this doesn't need to hold the entire log in memory. */
+    virtual bool readBuildLog(const Path & path, Sink & sink)
+    {
+        auto log = getBuildLog(path);
+        if (!log) return false;
+        sink(*log);
+        return true;
+    }
+
     /* Hack to allow long-running processes like hydra-queue-runner to
        occasionally flush their path info cache. */
     void clearPathInfoCache()
     {
-        state.lock()->pathInfoCache.clear();
+        pathInfoCache.clear();
     }
 
     /* Establish a connection to the store, for store types that have
@@ -677,6 +932,8 @@ public:
     }
 
     std::shared_ptr<std::string> getBuildLog(const Path & path) override;
+
+    bool readBuildLog(const Path & path, Sink & sink) override;
 };
 
 
@@ -686,6 +943,10 @@ string storePathToName(const Path & path);
 /* Extract the hash part of the given store path. */
 string storePathToHash(const Path & path);
 
+/* Likewise, in binary form, or nothing if `path' doesn't start with
+   a valid hash part (in which case it can't be a valid path). */
+std::optional<StorePathHash> storePathHash(const Path & path);
+
 /* Check whether ‘name’ is a valid store path name part, i.e. contains
    only the characters [a-zA-Z0-9\+\-\.\_\?\=] and doesn't start with
    a dot. */
@@ -701,7 +962,9 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
    in parallel. They are copied in a topologically sorted order
    (i.e. if A is a reference of B, then A is copied before B), but
    the set of store paths is not automatically closed; use
-   copyClosure() for that. */
+   copyClosure() for that. If `substitute' is set, the destination
+   substitutes the missing paths that it can while the others are
+   being copied. */
 void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePaths,
     RepairFlag repair = NoRepair,
     CheckSigsFlag checkSigs = CheckSigs,
@@ -806,3 +1069,19 @@ std::string makeFixedOutputCA(bool recursive, const Hash & hash);
 std::pair<std::string, Store::Params> splitUriAndParams(const std::string & uri);
 
 }
+
+
+namespace std {
+
+template<> struct hash<nix::StorePathHash>
+{
+    size_t operator()(const nix::StorePathHash & h) const
+    {
+        /* The hash part is already a hash. */
+        size_t res;
+        memcpy(&res, h.hash, sizeof(res));
+        return res;
+    }
+};
+
+}
@@ -6,7 +6,7 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION 0x115
+#define PROTOCOL_VERSION 0x11b
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -49,6 +49,13 @@ typedef enum {
     wopNarFromPath = 38,
     wopAddToStoreNar = 39,
     wopQueryMissing = 40,
+    wopQueryPathsFromHashParts = 41,
+    wopPipeline = 42,
+    wopQueryPathInfos = 43,
+    wopQueryClosure = 44,
+    wopPlanGarbage = 45,
+    wopAddTextsToStore = 46,
+    wopAddTempRoots = 47,
 } WorkerOp;
 
 
@@ -52,4 +52,14 @@ void restoreAffinity()
 }
 
 
+bool affinityLocked()
+{
+#if __linux__
+    return didSaveAffinity;
+#else
+    return false;
+#endif
+}
+
+
 }
@@ -6,4 +6,7 @@ void setAffinityTo(int cpu);
 int lockToCurrentCPU();
 void restoreAffinity();
 
+/* Whether restoreAffinity() has anything to restore. */
+bool affinityLocked();
+
 }
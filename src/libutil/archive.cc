@@ -2,6 +2,9 @@
 #include <algorithm>
 #include <vector>
 #include <map>
+#include <deque>
+#include <thread>
+#include <condition_variable>
 
 #include <strings.h> // for strcasecmp
 
@@ -11,9 +14,14 @@
 #include <dirent.h>
 #include <fcntl.h>
 
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 #include "archive.hh"
 #include "util.hh"
 #include "config.hh"
+#include "thread-pool.hh"
 
 namespace nix {
 
@@ -40,34 +48,69 @@ static string caseHackSuffix = "~nix~case~hack~";
 PathFilter defaultPathFilter = [](const Path &) { return true; };
 
 
-static void dumpContents(const Path & path, size_t size,
-    Sink & sink)
+static void copyContents(const Path & path, size_t size, Sink & sink)
 {
-    sink << "contents" << size;
-
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     if (!fd) throw SysError(format("opening file '%1%'") % path);
 
-    std::vector<unsigned char> buf(65536);
     size_t left = size;
 
+#if __linux__
+    /* When writing to a file descriptor, let the kernel copy the
+       contents, rather than copying them through user space. */
+    auto fdSink = dynamic_cast<FdSink *>(&sink);
+    if (fdSink && size >= 65536) {
+        fdSink->flush();
+        while (left > 0) {
+            checkInterrupt();
+            auto n = sendfile(fdSink->fd, fd.get(), nullptr, left);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                /* Fall back to copying if the descriptors don't
+                   support this. */
+                if (left == size && (errno == EINVAL || errno == ENOSYS)) break;
+                throw SysError("sending the contents of '%s'", path);
+            }
+            if (n == 0) throw EndOfFile("file '%s' ended unexpectedly", path);
+            left -= n;
+            fdSink->written += n;
+        }
+    }
+#endif
+
+    std::vector<unsigned char> buf(65536);
+
     while (left > 0) {
         auto n = std::min(left, buf.size());
         readFull(fd.get(), buf.data(), n);
         left -= n;
         sink(buf.data(), n);
     }
+}
 
+
+static void dumpContents(const Path & path, size_t size,
+    Sink & sink)
+{
+    sink << "contents" << size;
+    copyContents(path, size, sink);
     writePadding(size, sink);
 }
 
 
-static void dump(const Path & path, Sink & sink, PathFilter & filter)
+typedef std::function<void(const Path & path, size_t size, Sink & sink)> ContentsDumper;
+
+
+/* Dump `name' in the directory `dirFd', whose full path is `path'.
+   Directories are walked relative to their file descriptors, so the
+   kernel doesn't have to resolve the full path of every entry. */
+static void dump(int dirFd, const Path & name, const Path & path, Sink & sink,
+    PathFilter & filter, const ContentsDumper & dumpContents)
 {
     checkInterrupt();
 
     struct stat st;
-    if (lstat(path.c_str(), &st))
+    if (fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW))
         throw SysError(format("getting attributes of path '%1%'") % path);
 
     sink << "(";
@@ -84,8 +127,11 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 
         /* If we're on a case-insensitive system like macOS, undo
            the case hack applied by restorePath(). */
+        AutoCloseFD fd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (!fd) throw SysError(format("opening directory '%1%'") % path);
+
         std::map<string, string> unhacked;
-        for (auto & i : readDirectory(path))
+        for (auto & i : readDirectory(fd.get(), path))
             if (archiveSettings.useCaseHack) {
                 string name(i.name);
                 size_t pos = i.name.find(caseHackSuffix);
@@ -103,13 +149,13 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
         for (auto & i : unhacked)
             if (filter(path + "/" + i.first)) {
                 sink << "entry" << "(" << "name" << i.first << "node";
-                dump(path + "/" + i.second, sink, filter);
+                dump(fd.get(), i.second, path + "/" + i.second, sink, filter, dumpContents);
                 sink << ")";
             }
     }
 
     else if (S_ISLNK(st.st_mode))
-        sink << "type" << "symlink" << "target" << readLink(path);
+        sink << "type" << "symlink" << "target" << readLinkAt(dirFd, name, path);
 
     else throw Error(format("file '%1%' has an unsupported type") % path);
 
@@ -120,7 +166,124 @@ static void dump(const Path & path, Sink & sink, PathFilter & filter)
 void dumpPath(const Path & path, Sink & sink, PathFilter & filter)
 {
     sink << narVersionMagic1;
-    dump(path, sink, filter);
+    dump(AT_FDCWD, path, path, sink, filter, dumpContents);
+}
+
+
+void dumpPathParallel(const Path & path, Sink & sink, PathFilter & filter)
+{
+    /* Walk the tree on this thread. Each regular file becomes a
+       piece consisting of the archive data leading up to its contents
+       and the contents themselves. The contents of small files are
+       read ahead on a thread pool, and pieces are written in order
+       as the read-ahead window fills up. Large files are streamed
+       when their turn comes, to bound memory use. */
+    enum PieceState { psQueued, psReading, psDone };
+
+    struct Piece
+    {
+        std::string prefix;
+        Path path;
+        size_t size;
+        bool prefetch;
+        PieceState state = psQueued;
+        StringSink contents;
+        std::exception_ptr ex;
+    };
+
+    const size_t maxSmallFile = 4 << 20, maxBytesAhead = 64 << 20, maxPiecesAhead = 4096;
+
+    /* The pieces that have not been written yet. Only accessed by
+       this thread; workers only touch the pieces they were given,
+       synchronising on `lock'. */
+    std::deque<std::shared_ptr<Piece>> window;
+    size_t bytesAhead = 0;
+
+    Sync<int> lock;
+    std::condition_variable done;
+
+    ThreadPool pool(std::max(16U, std::thread::hardware_concurrency()));
+
+    auto read = [&](Piece & piece) {
+        try {
+            copyContents(piece.path, piece.size, piece.contents);
+        } catch (...) {
+            piece.ex = std::current_exception();
+        }
+    };
+
+    auto writeFront = [&]() {
+        auto piece = window.front();
+        window.pop_front();
+
+        sink(piece->prefix);
+
+        if (!piece->prefetch) {
+            copyContents(piece->path, piece->size, sink);
+            return;
+        }
+
+        bytesAhead -= piece->size;
+
+        /* If no worker has got to this piece yet, read it
+           ourselves. */
+        bool readHere = false;
+        {
+            auto l(lock.lock());
+            if (piece->state == psQueued) {
+                piece->state = psReading;
+                readHere = true;
+            } else
+                while (piece->state != psDone) l.wait(done);
+        }
+
+        if (readHere) read(*piece);
+        if (piece->ex) std::rethrow_exception(piece->ex);
+
+        sink(*piece->contents.s);
+    };
+
+    StringSink meta;
+
+    meta << narVersionMagic1;
+    dump(AT_FDCWD, path, path, meta, filter, [&](const Path & path, size_t size, Sink & metaSink) {
+        metaSink << "contents" << size;
+
+        auto piece = std::make_shared<Piece>();
+        piece->prefix = std::move(*meta.s);
+        meta.s->clear();
+        piece->path = path;
+        piece->size = size;
+        piece->prefetch = size <= maxSmallFile;
+        window.push_back(piece);
+
+        if (piece->prefetch) {
+            bytesAhead += size;
+            pool.enqueue([&, piece]() {
+                {
+                    auto l(lock.lock());
+                    if (piece->state != psQueued) return;
+                    piece->state = psReading;
+                }
+                read(*piece);
+                {
+                    auto l(lock.lock());
+                    piece->state = psDone;
+                }
+                done.notify_all();
+            });
+        }
+
+        while (!window.empty() && (bytesAhead > maxBytesAhead || window.size() > maxPiecesAhead))
+            writeFront();
+
+        writePadding(size, metaSink);
+    });
+
+    while (!window.empty())
+        writeFront();
+
+    sink(*meta.s);
 }
 
 
@@ -156,8 +319,21 @@ static void parseContents(ParseSink & sink, Source & source, const Path & path)
     unsigned long long left = size;
     std::vector<unsigned char> buf(65536);
 
+    auto fdSource = dynamic_cast<FdSource *>(&source);
+
     while (left) {
         checkInterrupt();
+
+        /* Let the sink read large contents directly from a file
+           descriptor once the source has no buffered data. */
+        if (fdSource && left >= buf.size() && !fdSource->hasData()) {
+            if (sink.receiveContentsFromFd(fdSource->fd, left)) {
+                fdSource->read += left;
+                break;
+            }
+            fdSource = nullptr;
+        }
+
         auto n = buf.size();
         if ((unsigned long long)n > left) n = left;
         source(buf.data(), n);
@@ -294,13 +470,184 @@ void parseDump(ParseSink & sink, Source & source)
 }
 
 
+static void preallocate(int fd, unsigned long long len)
+{
+#if HAVE_POSIX_FALLOCATE
+    if (len) {
+        errno = posix_fallocate(fd, 0, len);
+        /* Note that EINVAL may indicate that the underlying
+           filesystem doesn't support preallocation (e.g. on
+           OpenSolaris).  Since preallocation is just an
+           optimisation, ignore it. */
+        if (errno && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
+            throw SysError(format("preallocating file of %1% bytes") % len);
+    }
+#endif
+}
+
+
+static void makeExecutable(int fd)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw SysError("fstat");
+    if (fchmod(fd, st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
+        throw SysError("fchmod");
+}
+
+
+/* Write the parts of the NAR serialisation of a regular file of
+   `size' bytes that precede and follow its contents. */
+static void writeFilePrefix(Sink & sink, bool executable, unsigned long long size)
+{
+    sink << narVersionMagic1 << "(" << "type" << "regular";
+    if (executable) sink << "executable" << "";
+    sink << "contents" << (uint64_t) size;
+}
+
+static void writeFileSuffix(Sink & sink, unsigned long long size)
+{
+    writePadding(size, sink);
+    sink << ")";
+}
+
+
+/* A sink that restores a NAR to the file system. The NAR is parsed
+   on the calling thread, which also creates directories and symlinks
+   and writes large files. Small files are collected in memory and
+   created and written on a thread pool, since with many small files
+   restoring is otherwise dominated by the latency of open(), write()
+   and close().
+
+   If `reuseFile' is set, the pool hashes every small file and only
+   writes it if `reuseFile' declines to create it. Large files are
+   hashed while they're written, and afterwards offered to
+   `reuseFile' under a temporary name that replaces them if it
+   succeeds, which saves space but not the writes. */
 struct RestoreSink : ParseSink
 {
     Path dstPath;
+
+    FileReuser reuseFile;
+
+    /* Files up to this size are written by the pool. With
+       `reuseFile', this is larger, so that most files can be reused
+       without being written. */
+    unsigned long long maxSmallFile = 1 << 20;
+
+    /* Wait for the pool once this much data is waiting to be
+       written. */
+    const size_t maxBytesPending = 64 << 20;
+
+    struct File
+    {
+        Path path;
+        bool executable = false;
+        unsigned long long size = 0;
+        std::string contents;
+        /* For large files with `reuseFile'. */
+        std::unique_ptr<HashSink> hashSink;
+    };
+
+    /* The file being parsed. If `fd' is open, it is a large file
+       being written on this thread. */
+    std::unique_ptr<File> file;
     AutoCloseFD fd;
 
+    struct State
+    {
+        size_t bytesPending = 0;
+        std::exception_ptr ex;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+
+    /* Declared last, so that the workers, which refer to the fields
+       above, are stopped first. */
+    ThreadPool pool{16};
+
+    void checkError()
+    {
+        auto state(state_.lock());
+        if (state->ex) std::rethrow_exception(state->ex);
+    }
+
+    void writeFile(File & file)
+    {
+        if (reuseFile) {
+            HashSink hashSink(htSHA256);
+            writeFilePrefix(hashSink, file.executable, file.size);
+            hashSink((const unsigned char *) file.contents.data(), file.contents.size());
+            writeFileSuffix(hashSink, file.size);
+            if (reuseFile(file.path, hashSink.finish().first)) return;
+        }
+
+        AutoCloseFD fd = open(file.path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+        if (!fd) throw SysError(format("creating file '%1%'") % file.path);
+        if (file.executable) makeExecutable(fd.get());
+        preallocate(fd.get(), file.size);
+        writeFull(fd.get(), file.contents);
+        fd = -1;
+    }
+
+    /* Hand off the current file, if any, to the pool. */
+    void finishFile()
+    {
+        if (!file) return;
+
+        if (fd) {
+            fd = -1;
+            if (file->hashSink) {
+                writeFileSuffix(*file->hashSink, file->size);
+                Path tmpPath = file->path + ".tmp";
+                if (reuseFile(tmpPath, file->hashSink->finish().first)
+                    && rename(tmpPath.c_str(), file->path.c_str()) == -1)
+                    throw SysError(format("renaming '%1%' to '%2%'") % tmpPath % file->path);
+            }
+            file.reset();
+            return;
+        }
+
+        auto size = file->contents.size();
+
+        {
+            auto state(state_.lock());
+            while (state->bytesPending && state->bytesPending + size > maxBytesPending && !state->ex)
+                state.wait(wakeup);
+            if (state->ex) std::rethrow_exception(state->ex);
+            state->bytesPending += size;
+        }
+
+        std::shared_ptr<File> f(file.release());
+
+        pool.enqueue([this, f, size]() {
+            std::exception_ptr ex;
+            try {
+                writeFile(*f);
+            } catch (...) {
+                ex = std::current_exception();
+            }
+            {
+                auto state(state_.lock());
+                state->bytesPending -= size;
+                if (ex && !state->ex) state->ex = ex;
+            }
+            wakeup.notify_one();
+        });
+    }
+
+    /* Wait for all files to be written. */
+    void finish()
+    {
+        finishFile();
+        pool.process();
+        checkError();
+    }
+
     void createDirectory(const Path & path)
     {
+        finishFile();
         Path p = dstPath + path;
         if (mkdir(p.c_str(), 0777) == -1)
             throw SysError(format("creating directory '%1%'") % p);
@@ -308,53 +655,108 @@ struct RestoreSink : ParseSink
 
     void createRegularFile(const Path & path)
     {
-        Path p = dstPath + path;
-        fd = open(p.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
-        if (!fd) throw SysError(format("creating file '%1%'") % p);
+        finishFile();
+        file = std::make_unique<File>();
+        file->path = dstPath + path;
     }
 
     void isExecutable()
     {
-        struct stat st;
-        if (fstat(fd.get(), &st) == -1)
-            throw SysError("fstat");
-        if (fchmod(fd.get(), st.st_mode | (S_IXUSR | S_IXGRP | S_IXOTH)) == -1)
-            throw SysError("fchmod");
+        file->executable = true;
+        if (fd) makeExecutable(fd.get());
     }
 
     void preallocateContents(unsigned long long len)
     {
-#if HAVE_POSIX_FALLOCATE
-        if (len) {
-            errno = posix_fallocate(fd.get(), 0, len);
-            /* Note that EINVAL may indicate that the underlying
-               filesystem doesn't support preallocation (e.g. on
-               OpenSolaris).  Since preallocation is just an
-               optimisation, ignore it. */
-            if (errno && errno != EINVAL && errno != EOPNOTSUPP && errno != ENOSYS)
-                throw SysError(format("preallocating file of %1% bytes") % len);
-        }
-#endif
+        file->size = len;
+
+        if (len > maxSmallFile) {
+            fd = open(file->path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+            if (!fd) throw SysError(format("creating file '%1%'") % file->path);
+            if (file->executable) makeExecutable(fd.get());
+            preallocate(fd.get(), len);
+            if (reuseFile) {
+                file->hashSink = std::make_unique<HashSink>(htSHA256);
+                writeFilePrefix(*file->hashSink, file->executable, len);
+            }
+        } else
+            file->contents.reserve(len);
     }
 
     void receiveContents(unsigned char * data, unsigned int len)
     {
-        writeFull(fd.get(), data, len);
+        if (fd) {
+            writeFull(fd.get(), data, len);
+            if (file->hashSink) (*file->hashSink)(data, len);
+        } else
+            file->contents.append((const char *) data, len);
+    }
+
+    bool receiveContentsFromFd(int fromFd, unsigned long long len) override
+    {
+        if (!fd || file->hashSink) return false;
+
+#if __linux__
+        /* splice() needs a pipe on one side, so if `fromFd' isn't one,
+           relay the data through a pipe. */
+        Pipe relay;
+        bool direct = true;
+        unsigned long long left = len;
+
+        while (left) {
+            checkInterrupt();
+            auto n = splice(fromFd, nullptr, direct ? fd.get() : relay.writeSide.get(), nullptr,
+                direct ? left : std::min(left, 65536ULL), SPLICE_F_MOVE);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                if (errno == EINVAL && left == len) {
+                    if (!direct) return false;
+                    direct = false;
+                    relay.create();
+                    continue;
+                }
+                throw SysError("receiving file contents");
+            }
+            if (n == 0) throw EndOfFile("unexpected end-of-file");
+
+            if (!direct)
+                for (auto m = n; m > 0; ) {
+                    auto k = splice(relay.readSide.get(), nullptr, fd.get(), nullptr, m, SPLICE_F_MOVE);
+                    if (k == -1) {
+                        if (errno == EINTR) continue;
+                        throw SysError("writing file contents");
+                    }
+                    m -= k;
+                }
+
+            left -= n;
+        }
+
+        return true;
+#else
+        return false;
+#endif
     }
 
     void createSymlink(const Path & path, const string & target)
     {
+        finishFile();
         Path p = dstPath + path;
         nix::createSymlink(target, p);
     }
 };
 
 
-void restorePath(const Path & path, Source & source)
+void restorePath(const Path & path, Source & source, FileReuser reuseFile)
 {
     RestoreSink sink;
     sink.dstPath = path;
+    if (reuseFile) {
+        sink.reuseFile = reuseFile;
+        sink.maxSmallFile = 16 << 20;
+    }
     parseDump(sink, source);
+    sink.finish();
 }
 
 
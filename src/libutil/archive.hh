@@ -2,6 +2,7 @@
 
 #include "types.hh"
 #include "serialise.hh"
+#include "hash.hh"
 
 
 namespace nix {
@@ -48,6 +49,13 @@ namespace nix {
 void dumpPath(const Path & path, Sink & sink,
     PathFilter & filter = defaultPathFilter);
 
+/* Like dumpPath(), but read the contents of small files ahead on
+   multiple threads while earlier parts of the archive are being
+   written.  `filter' and `sink' are only called from the calling
+   thread. */
+void dumpPathParallel(const Path & path, Sink & sink,
+    PathFilter & filter = defaultPathFilter);
+
 void dumpString(const std::string & s, Sink & sink);
 
 /* FIXME: fix this API, it sucks. */
@@ -60,6 +68,11 @@ struct ParseSink
     virtual void preallocateContents(unsigned long long size) { };
     virtual void receiveContents(unsigned char * data, unsigned int len) { };
 
+    /* Receive `len' bytes of contents by reading `fd' directly, if
+       the sink can do that more efficiently. Returns false (without
+       reading) otherwise. */
+    virtual bool receiveContentsFromFd(int fd, unsigned long long len) { return false; };
+
     virtual void createSymlink(const Path & path, const string & target) { };
 };
 
@@ -72,7 +85,15 @@ struct TeeSink : ParseSink
 
 void parseDump(ParseSink & sink, Source & source);
 
-void restorePath(const Path & path, Source & source);
+/* Called by restorePath() for every regular file, with the path of
+   the file and the SHA-256 hash of its NAR serialisation (the hash
+   used for the links of `nix-store --optimise'). If it returns true,
+   it has created the file itself with the same contents and
+   executable bit, e.g. by linking to an identical file.  It can be
+   called from several threads at the same time. */
+typedef std::function<bool(const Path & path, const Hash & hash)> FileReuser;
+
+void restorePath(const Path & path, Source & source, FileReuser reuseFile = {});
 
 /* Read a NAR from 'source' and write it to 'sink'. */
 void copyNAR(Source & source, Sink & sink);
@@ -5,13 +5,19 @@
 
 #include <lzma.h>
 #include <bzlib.h>
+#include <zlib.h>
 #include <cstdio>
 #include <cstring>
 
 #include <brotli/decode.h>
 #include <brotli/encode.h>
 
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
 #include <iostream>
+#include <thread>
 
 namespace nix {
 
@@ -51,8 +57,24 @@ struct XzDecompressionSink : CompressionSink
 
     XzDecompressionSink(Sink & nextSink) : nextSink(nextSink)
     {
+#ifdef HAVE_LZMA_MT_DECODER
+        /* Decode the blocks of multi-block streams (as produced by
+           lzma_stream_encoder_mt(), i.e. with parallel-compression)
+           on multiple threads. The output is still produced in order.
+           Single-block streams are decoded as before. */
+        lzma_mt mt_options = {};
+        mt_options.flags = LZMA_CONCATENATED;
+        mt_options.threads = lzma_cputhreads();
+        if (mt_options.threads == 0)
+            mt_options.threads = 1;
+        /* Above this, fall back to single-threaded decoding. */
+        mt_options.memlimit_threading = std::max(lzma_physmem() / 4, (uint64_t) 64 << 20);
+        mt_options.memlimit_stop = UINT64_MAX;
+        lzma_ret ret = lzma_stream_decoder_mt(&strm, &mt_options);
+#else
         lzma_ret ret = lzma_stream_decoder(
             &strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma decoder");
 
@@ -147,6 +169,60 @@ struct BzipDecompressionSink : ChunkedCompressionSink
     }
 };
 
+struct GzipDecompressionSink : ChunkedCompressionSink
+{
+    Sink & nextSink;
+    z_stream strm;
+
+    GzipDecompressionSink(Sink & nextSink) : nextSink(nextSink)
+    {
+        memset(&strm, 0, sizeof(strm));
+        /* 16 selects the gzip format. */
+        if (inflateInit2(&strm, 16 + MAX_WBITS) != Z_OK)
+            throw CompressionError("unable to initialise gzip decoder");
+
+        strm.next_out = (Bytef *) outbuf;
+        strm.avail_out = sizeof(outbuf);
+    }
+
+    ~GzipDecompressionSink()
+    {
+        inflateEnd(&strm);
+    }
+
+    void finish() override
+    {
+        flush();
+    }
+
+    void writeInternal(const unsigned char * data, size_t len) override
+    {
+        assert(len <= std::numeric_limits<decltype(strm.avail_in)>::max());
+
+        strm.next_in = (Bytef *) data;
+        strm.avail_in = len;
+
+        while (strm.avail_in) {
+            checkInterrupt();
+
+            int ret = inflate(&strm, Z_NO_FLUSH);
+            if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+                throw CompressionError("error %d while decompressing gzip file", ret);
+
+            if (strm.avail_out < sizeof(outbuf) || strm.avail_in == 0) {
+                nextSink(outbuf, sizeof(outbuf) - strm.avail_out);
+                strm.next_out = (Bytef *) outbuf;
+                strm.avail_out = sizeof(outbuf);
+            }
+
+            /* Files like 'pigz' output consist of several
+               concatenated gzip members. */
+            if (ret == Z_STREAM_END && strm.avail_in && inflateReset(&strm) != Z_OK)
+                throw CompressionError("unable to reset gzip decoder");
+        }
+    }
+};
+
 struct BrotliDecompressionSink : ChunkedCompressionSink
 {
     Sink & nextSink;
@@ -198,6 +274,68 @@ struct BrotliDecompressionSink : ChunkedCompressionSink
     }
 };
 
+#if HAVE_ZSTD
+struct ZstdDecompressionSink : ChunkedCompressionSink
+{
+    Sink & nextSink;
+    ZSTD_DStream * stream;
+
+    /* If `base' is given, the input is a patch created with `zstd
+       --patch-from', which refers to `base' (which must outlive the
+       sink) as its prefix. */
+    ZstdDecompressionSink(Sink & nextSink, const std::string * base = nullptr) : nextSink(nextSink)
+    {
+        stream = ZSTD_createDStream();
+        if (!stream)
+            throw CompressionError("unable to initialise zstd decoder");
+
+#if HAVE_ZSTD_DELTA
+        /* Patches of large files need `--long', i.e. a window as
+           big as the base. */
+        if (base
+            && (ZSTD_isError(ZSTD_DCtx_setParameter(stream, ZSTD_d_windowLogMax, ZSTD_WINDOWLOG_MAX))
+                || ZSTD_isError(ZSTD_DCtx_refPrefix(stream, base->data(), base->size()))))
+        {
+            ZSTD_freeDStream(stream);
+            throw CompressionError("unable to initialise zstd patch decoder");
+        }
+#else
+        assert(!base);
+#endif
+    }
+
+    ~ZstdDecompressionSink()
+    {
+        ZSTD_freeDStream(stream);
+    }
+
+    void finish() override
+    {
+        flush();
+    }
+
+    void writeInternal(const unsigned char * data, size_t len) override
+    {
+        ZSTD_inBuffer in{data, len, 0};
+        bool full = false;
+
+        /* Keep going while there is input, or while the decoder
+           filled the output buffer and may have more to flush. */
+        while (in.pos < in.size || full) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf, sizeof(outbuf), 0};
+            auto res = ZSTD_decompressStream(stream, &out, &in);
+            if (ZSTD_isError(res))
+                throw CompressionError("error %s while decompressing zstd file", ZSTD_getErrorName(res));
+
+            nextSink(outbuf, out.pos);
+            full = out.pos == out.size;
+        }
+    }
+};
+#endif
+
 ref<std::string> decompress(const std::string & method, const std::string & in)
 {
     StringSink ssink;
@@ -215,12 +353,28 @@ ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & ne
         return make_ref<XzDecompressionSink>(nextSink);
     else if (method == "bzip2")
         return make_ref<BzipDecompressionSink>(nextSink);
+    else if (method == "gzip")
+        return make_ref<GzipDecompressionSink>(nextSink);
     else if (method == "br")
         return make_ref<BrotliDecompressionSink>(nextSink);
+#if HAVE_ZSTD
+    else if (method == "zstd")
+        return make_ref<ZstdDecompressionSink>(nextSink);
+#endif
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
 
+ref<CompressionSink> makeDeltaDecompressionSink(const std::string & method,
+    Sink & nextSink, const std::string & base)
+{
+#if HAVE_ZSTD_DELTA
+    if (method == "zstd")
+        return make_ref<ZstdDecompressionSink>(nextSink, &base);
+#endif
+    throw UnknownCompressionMethod("unknown delta method '%s'", method);
+}
+
 struct XzCompressionSink : CompressionSink
 {
     Sink & nextSink;
@@ -228,8 +382,10 @@ struct XzCompressionSink : CompressionSink
     lzma_stream strm = LZMA_STREAM_INIT;
     bool finished = false;
 
-    XzCompressionSink(Sink & nextSink, bool parallel) : nextSink(nextSink)
+    XzCompressionSink(Sink & nextSink, bool parallel, int level) : nextSink(nextSink)
     {
+        uint32_t preset = level == -1 ? LZMA_PRESET_DEFAULT : level;
+
         lzma_ret ret;
         bool done = false;
 
@@ -238,7 +394,7 @@ struct XzCompressionSink : CompressionSink
             lzma_mt mt_options = {};
             mt_options.flags = 0;
             mt_options.timeout = 300; // Using the same setting as the xz cmd line
-            mt_options.preset = LZMA_PRESET_DEFAULT;
+            mt_options.preset = preset;
             mt_options.filters = NULL;
             mt_options.check = LZMA_CHECK_CRC64;
             mt_options.threads = lzma_cputhreads();
@@ -255,7 +411,7 @@ struct XzCompressionSink : CompressionSink
         }
 
         if (!done)
-            ret = lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+            ret = lzma_easy_encoder(&strm, preset, LZMA_CHECK_CRC64);
 
         if (ret != LZMA_OK)
             throw CompressionError("unable to initialise lzma encoder");
@@ -306,10 +462,10 @@ struct BzipCompressionSink : ChunkedCompressionSink
     bz_stream strm;
     bool finished = false;
 
-    BzipCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BzipCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         memset(&strm, 0, sizeof(strm));
-        int ret = BZ2_bzCompressInit(&strm, 9, 0, 30);
+        int ret = BZ2_bzCompressInit(&strm, level == -1 ? 9 : level, 0, 30);
         if (ret != BZ_OK)
             throw CompressionError("unable to initialise bzip2 encoder");
 
@@ -360,11 +516,13 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     BrotliEncoderState *state;
     bool finished = false;
 
-    BrotliCompressionSink(Sink & nextSink) : nextSink(nextSink)
+    BrotliCompressionSink(Sink & nextSink, int level) : nextSink(nextSink)
     {
         state = BrotliEncoderCreateInstance(nullptr, nullptr, nullptr);
         if (!state)
             throw CompressionError("unable to initialise brotli encoder");
+        if (level != -1 && !BrotliEncoderSetParameter(state, BROTLI_PARAM_QUALITY, level))
+            throw CompressionError("invalid brotli compression level %d", level);
     }
 
     ~BrotliCompressionSink()
@@ -406,24 +564,124 @@ struct BrotliCompressionSink : ChunkedCompressionSink
     }
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+#if HAVE_ZSTD
+struct ZstdCompressionSink : ChunkedCompressionSink
+{
+    Sink & nextSink;
+    uint8_t outbuf[BUFSIZ];
+    ZSTD_CCtx * ctx;
+
+    ZstdCompressionSink(Sink & nextSink, bool parallel, int level) : nextSink(nextSink)
+    {
+        ctx = ZSTD_createCCtx();
+        if (!ctx || ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel,
+                    level == -1 ? ZSTD_CLEVEL_DEFAULT : level)))
+            throw CompressionError("unable to initialise zstd encoder");
+
+        /* This fails if libzstd was built without multi-threading
+           support. */
+        if (parallel
+            && ZSTD_isError(ZSTD_CCtx_setParameter(ctx, ZSTD_c_nbWorkers,
+                    std::max(1U, std::thread::hardware_concurrency()))))
+            printMsg(lvlError, "warning: parallel zstd compression requested but not supported, falling back to single-threaded compression");
+    }
+
+    ~ZstdCompressionSink()
+    {
+        ZSTD_freeCCtx(ctx);
+    }
+
+    void finish() override
+    {
+        flush();
+
+        while (true) {
+            ZSTD_inBuffer in{nullptr, 0, 0};
+            ZSTD_outBuffer out{outbuf, sizeof(outbuf), 0};
+            auto res = ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(res))
+                throw CompressionError("error %s while compressing zstd file", ZSTD_getErrorName(res));
+            nextSink(outbuf, out.pos);
+            if (res == 0) break;
+        }
+    }
+
+    void writeInternal(const unsigned char * data, size_t len) override
+    {
+        ZSTD_inBuffer in{data, len, 0};
+
+        while (in.pos < in.size) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out{outbuf, sizeof(outbuf), 0};
+            auto res = ZSTD_compressStream2(ctx, &out, &in, ZSTD_e_continue);
+            if (ZSTD_isError(res))
+                throw CompressionError("error %s while compressing zstd file", ZSTD_getErrorName(res));
+
+            nextSink(outbuf, out.pos);
+        }
+    }
+};
+#endif
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel, int level)
 {
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzCompressionSink>(nextSink, parallel);
+        return make_ref<XzCompressionSink>(nextSink, parallel, level);
     else if (method == "bzip2")
-        return make_ref<BzipCompressionSink>(nextSink);
+        return make_ref<BzipCompressionSink>(nextSink, level);
     else if (method == "br")
-        return make_ref<BrotliCompressionSink>(nextSink);
+        return make_ref<BrotliCompressionSink>(nextSink, level);
+#if HAVE_ZSTD
+    else if (method == "zstd")
+        return make_ref<ZstdCompressionSink>(nextSink, parallel, level);
+#endif
     else
         throw UnknownCompressionMethod(format("unknown compression method '%s'") % method);
 }
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
+struct FramedSink : BufferedSink
+{
+    Sink & nextSink;
+
+    FramedSink(Sink & nextSink) : BufferedSink(64 * 1024), nextSink(nextSink) { }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        writeString(data, len, nextSink);
+    }
+};
+
+void writeCompressedFrames(const std::string & method, Sink & sink,
+    std::function<void(Sink &)> fun, int level)
+{
+    FramedSink framedSink(sink);
+    auto compressionSink = makeCompressionSink(method, framedSink, false, level);
+    fun(*compressionSink);
+    compressionSink->finish();
+    framedSink.flush();
+    sink << "";
+}
+
+void readCompressedFrames(const std::string & method, Source & source, Sink & sink)
+{
+    auto decompressionSink = makeDecompressionSink(method, sink);
+    while (true) {
+        auto frame = readString(source);
+        if (frame.empty()) break;
+        (*decompressionSink)(frame);
+    }
+    decompressionSink->finish();
+}
+
+ref<std::string> compress(const std::string & method, const std::string & in,
+    const bool parallel, int level)
 {
     StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink, parallel);
+    auto sink = makeCompressionSink(method, ssink, parallel, level);
     (*sink)(in);
     sink->finish();
     return ssink.s;
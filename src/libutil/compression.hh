@@ -17,9 +17,30 @@ ref<std::string> decompress(const std::string & method, const std::string & in);
 
 ref<CompressionSink> makeDecompressionSink(const std::string & method, Sink & nextSink);
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
-
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+/* Return a sink that applies a binary delta against `base', such as
+   one created by `zstd --patch-from' (method "zstd"), and writes the
+   result to `nextSink'. `base' must outlive the sink. */
+ref<CompressionSink> makeDeltaDecompressionSink(const std::string & method,
+    Sink & nextSink, const std::string & base);
+
+/* `level' is the compression level, with a meaning specific to each
+   method; -1 selects the method's default. */
+ref<std::string> compress(const std::string & method, const std::string & in,
+    const bool parallel = false, int level = -1);
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink,
+    const bool parallel = false, int level = -1);
+
+/* Write the data that `fun' writes to its sink to `sink', compressed
+   with `method' and split into frames (strings), followed by an empty
+   frame. This allows sending compressed data on a connection without
+   knowing its size in advance. */
+void writeCompressedFrames(const std::string & method, Sink & sink,
+    std::function<void(Sink &)> fun, int level = -1);
+
+/* Read data written by writeCompressedFrames() from `source',
+   writing the decompressed data to `sink'. */
+void readCompressedFrames(const std::string & method, Source & source, Sink & sink);
 
 MakeError(UnknownCompressionMethod, Error);
 
@@ -1,3 +1,4 @@
+#include <array>
 #include <iostream>
 #include <cstring>
 
@@ -8,10 +9,12 @@
 #include "archive.hh"
 #include "util.hh"
 #include "istringstream_nocopy.hh"
+#include "thread-pool.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 namespace nix {
 
@@ -73,29 +76,71 @@ static string printHash16(const Hash & hash)
 const string base32Chars = "0123456789abcdfghijklmnpqrsvwxyz";
 
 
-static string printHash32(const Hash & hash)
+/* The value of each base-32 digit, or -1. */
+static const std::array<signed char, 256> base32Values = []() {
+    std::array<signed char, 256> values;
+    values.fill(-1);
+    for (size_t n = 0; n < base32Chars.size(); ++n)
+        values[(unsigned char) base32Chars[n]] = n;
+    return values;
+}();
+
+
+std::string base32Encode(const unsigned char * data, size_t size)
 {
-    assert(hash.hashSize);
-    size_t len = hash.base32Len();
-    assert(len);
+    assert(size && size <= Hash::maxHashSize);
+    size_t len = base32Len(size);
+
+    /* Pad the input so that every digit can be read as the low bits
+       of a 16-bit window. */
+    unsigned char buf[Hash::maxHashSize + 1];
+    memcpy(buf, data, size);
+    buf[size] = 0;
 
-    string s;
-    s.reserve(len);
+    std::string s(len, '0');
 
-    for (int n = (int) len - 1; n >= 0; n--) {
+    for (size_t n = 0; n < len; ++n) {
         unsigned int b = n * 5;
         unsigned int i = b / 8;
         unsigned int j = b % 8;
-        unsigned char c =
-            (hash.hash[i] >> j)
-            | (i >= hash.hashSize - 1 ? 0 : hash.hash[i + 1] << (8 - j));
-        s.push_back(base32Chars[c & 0x1f]);
+        s[len - n - 1] = base32Chars[((buf[i] | buf[i + 1] << 8) >> j) & 0x1f];
     }
 
     return s;
 }
 
 
+bool base32Decode(std::string_view s, unsigned char * data, size_t size)
+{
+    if (s.size() != base32Len(size)) return false;
+
+    memset(data, 0, size);
+
+    for (size_t n = 0; n < s.size(); ++n) {
+        int digit = base32Values[(unsigned char) s[s.size() - n - 1]];
+        if (digit < 0) return false;
+        unsigned int b = n * 5;
+        unsigned int i = b / 8;
+        unsigned int j = b % 8;
+        data[i] |= digit << j;
+
+        if (i < size - 1)
+            data[i + 1] |= digit >> (8 - j);
+        else if (digit >> (8 - j))
+            return false;
+    }
+
+    return true;
+}
+
+
+static string printHash32(const Hash & hash)
+{
+    assert(hash.hashSize);
+    return base32Encode(hash.hash, hash.hashSize);
+}
+
+
 string printHash16or32(const Hash & hash)
 {
     return hash.to_string(hash.type == htMD5 ? Base16 : Base32, false);
@@ -171,26 +216,8 @@ Hash::Hash(const std::string & s, HashType type)
     }
 
     else if (!isSRI && size == base32Len()) {
-
-        for (unsigned int n = 0; n < size; ++n) {
-            char c = s[pos + size - n - 1];
-            unsigned char digit;
-            for (digit = 0; digit < base32Chars.size(); ++digit) /* !!! slow */
-                if (base32Chars[digit] == c) break;
-            if (digit >= 32)
-                throw BadHash("invalid base-32 hash '%s'", s);
-            unsigned int b = n * 5;
-            unsigned int i = b / 8;
-            unsigned int j = b % 8;
-            hash[i] |= digit << j;
-
-            if (i < hashSize - 1) {
-                hash[i + 1] |= digit >> (8 - j);
-            } else {
-                if (digit >> (8 - j))
-                    throw BadHash("invalid base-32 hash '%s'", s);
-            }
-        }
+        if (!base32Decode(std::string_view(s).substr(pos), hash, hashSize))
+            throw BadHash("invalid base-32 hash '%s'", s);
     }
 
     else if (isSRI || size == base64Len()) {
@@ -313,6 +340,41 @@ HashResult HashSink::currentHash()
 }
 
 
+MultiHashSink::MultiHashSink(const std::vector<HashType> & types)
+    : types(types)
+{
+    ctxs = new Ctx[types.size()];
+    bytes = 0;
+    for (size_t i = 0; i < types.size(); ++i)
+        start(types[i], ctxs[i]);
+}
+
+MultiHashSink::~MultiHashSink()
+{
+    bufPos = 0;
+    delete[] ctxs;
+}
+
+void MultiHashSink::write(const unsigned char * data, size_t len)
+{
+    bytes += len;
+    for (size_t i = 0; i < types.size(); ++i)
+        update(types[i], ctxs[i], data, len);
+}
+
+std::pair<std::vector<Hash>, unsigned long long> MultiHashSink::finish()
+{
+    flush();
+    std::vector<Hash> hashes;
+    for (size_t i = 0; i < types.size(); ++i) {
+        Hash hash(types[i]);
+        nix::finish(types[i], ctxs[i], hash.hash);
+        hashes.push_back(hash);
+    }
+    return {hashes, bytes};
+}
+
+
 HashResult hashPath(
     HashType ht, const Path & path, PathFilter & filter)
 {
@@ -322,6 +384,116 @@ HashResult hashPath(
 }
 
 
+Hash hashPathTree(const Path & path, PathFilter & filter, size_t maxThreads)
+{
+    const size_t chunkSize = 1 << 20;
+
+    struct Node
+    {
+        enum { tpRegular, tpDirectory, tpSymlink } type;
+        bool executable = false;
+        uint64_t size = 0;
+        std::string target;
+        std::vector<std::pair<std::string, Node *>> entries;
+        std::vector<Hash> chunks;
+    };
+
+    /* The pool writes into the nodes' chunk hashes, so the nodes must
+       outlive it. In particular, if walk() throws, the pool is shut
+       down (waiting for the running jobs) before they are freed. */
+    std::list<Node> nodes;
+
+    ThreadPool pool(maxThreads);
+
+    /* Walk the tree on this thread, hashing the chunks of regular
+       files on the pool as they are found. */
+    std::function<Node *(const Path &)> walk;
+    walk = [&](const Path & path) {
+        checkInterrupt();
+
+        auto st = lstat(path);
+        auto node = &nodes.emplace_back();
+
+        if (S_ISREG(st.st_mode)) {
+            node->type = Node::tpRegular;
+            node->executable = st.st_mode & S_IXUSR;
+            node->size = st.st_size;
+            node->chunks.resize((node->size + chunkSize - 1) / chunkSize);
+            for (size_t i = 0; i < node->chunks.size(); ++i) {
+                auto & hash(node->chunks[i]);
+                uint64_t offset = i * chunkSize;
+                size_t len = std::min((uint64_t) chunkSize, node->size - offset);
+                pool.enqueue([path, &hash, offset, len]() {
+                    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (!fd) throw SysError("opening file '%s'", path);
+                    std::vector<unsigned char> buf(len);
+                    for (size_t done = 0; done < len; ) {
+                        checkInterrupt();
+                        auto n = pread(fd.get(), buf.data() + done, len - done, offset + done);
+                        if (n == -1) {
+                            if (errno == EINTR) continue;
+                            throw SysError("reading file '%s'", path);
+                        }
+                        if (n == 0) throw Error("file '%s' changed while hashing it", path);
+                        done += n;
+                    }
+                    HashSink sink(htSHA256);
+                    sink << "chunk";
+                    sink(buf.data(), buf.size());
+                    hash = sink.finish().first;
+                });
+            }
+        }
+
+        else if (S_ISDIR(st.st_mode)) {
+            node->type = Node::tpDirectory;
+            std::set<std::string> names;
+            for (auto & i : readDirectory(path))
+                names.insert(i.name);
+            for (auto & name : names) {
+                Path child = path + "/" + name;
+                if (!filter(child)) continue;
+                node->entries.emplace_back(name, walk(child));
+            }
+        }
+
+        else if (S_ISLNK(st.st_mode)) {
+            node->type = Node::tpSymlink;
+            node->target = readLink(path);
+        }
+
+        else throw Error("file '%s' has an unsupported type", path);
+
+        return node;
+    };
+
+    auto root = walk(path);
+
+    pool.process();
+
+    std::function<Hash(const Node &)> combine;
+    combine = [&](const Node & node) {
+        HashSink sink(htSHA256);
+        if (node.type == Node::tpRegular) {
+            sink << "regular" << node.executable << node.size;
+            for (auto & hash : node.chunks)
+                sink(hash.hash, hash.hashSize);
+        } else if (node.type == Node::tpDirectory) {
+            sink << "directory" << node.entries.size();
+            for (auto & i : node.entries) {
+                auto hash = combine(*i.second);
+                sink << i.first;
+                sink(hash.hash, hash.hashSize);
+            }
+        } else
+            sink << "symlink" << node.target;
+        return sink.finish().first;
+    };
+
+    return combine(*root);
+}
+
+
 Hash compressHash(const Hash & hash, unsigned int newSize)
 {
     Hash h;
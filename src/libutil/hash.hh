@@ -20,6 +20,20 @@ const int sha512HashSize = 64;
 
 extern const string base32Chars;
 
+/* Encode `size' bytes in Nix's flavour of base-32 (which starts with
+   the most significant digit and uses the alphabet `base32Chars'). */
+std::string base32Encode(const unsigned char * data, size_t size);
+
+/* Decode a base-32 string into `size' bytes. Returns false if `s'
+   doesn't have the right length or isn't valid base-32. */
+bool base32Decode(std::string_view s, unsigned char * data, size_t size);
+
+/* Return the length of the base-32 encoding of `size' bytes. */
+inline size_t base32Len(size_t size)
+{
+    return (size * 8 - 1) / 5 + 1;
+}
+
 enum Base : int { Base64, Base32, Base16, SRI };
 
 
@@ -98,6 +112,15 @@ typedef std::pair<Hash, unsigned long long> HashResult;
 HashResult hashPath(HashType ht, const Path & path,
     PathFilter & filter = defaultPathFilter);
 
+/* Compute a SHA-256 Merkle tree hash of the given path: files are
+   hashed in 1 MiB chunks and directories over the hashes of their
+   entries, so the work is spread over up to `maxThreads' threads (0
+   means the number of cores) even for a single large file. It covers
+   the same information as hashPath(), but is NOT the NAR hash; use it
+   only to detect whether a path has changed. */
+Hash hashPathTree(const Path & path, PathFilter & filter = defaultPathFilter,
+    size_t maxThreads = 0);
+
 /* Compress a hash to the specified number of bytes by cyclically
    XORing bytes together. */
 Hash compressHash(const Hash & hash, unsigned int newSize);
@@ -127,5 +150,25 @@ public:
     HashResult currentHash();
 };
 
+/* Like HashSink, but computes hashes of several types over the same
+   data in a single pass. */
+class MultiHashSink : public BufferedSink
+{
+private:
+    std::vector<HashType> types;
+    Ctx * ctxs;
+    unsigned long long bytes;
+
+public:
+    MultiHashSink(const std::vector<HashType> & types);
+    MultiHashSink(const MultiHashSink & h) = delete;
+    ~MultiHashSink();
+    void write(const unsigned char * data, size_t len);
+
+    /* Return the hashes, in the order of the types passed to the
+       constructor, and the number of bytes hashed. */
+    std::pair<std::vector<Hash>, unsigned long long> finish();
+};
+
 
 }
@@ -1,7 +1,11 @@
 #include "logging.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <chrono>
+#include <thread>
+#include <fcntl.h>
 #include <nlohmann/json.hpp>
 
 namespace nix {
@@ -102,12 +106,32 @@ Activity::Activity(Logger & logger, Verbosity lvl, ActivityType type,
     logger.startActivity(id, lvl, type, s, fields, parent);
 }
 
+/* A logger that sends messages as JSON to the process reading our
+   stderr. Messages are formatted by the thread that logs them and
+   pushed onto a lock-free list; whichever thread finds nobody else
+   writing takes everything pending and writes it in one go, so
+   threads that log at the same time neither serialise on a lock nor
+   do a write() each. */
 struct JSONLogger : Logger
 {
     Logger & prevLogger;
 
+    struct Line
+    {
+        std::string s;
+        Line * next;
+    };
+
+    std::atomic<Line *> pending{nullptr};
+    std::atomic<bool> writing{false};
+
     JSONLogger(Logger & prevLogger) : prevLogger(prevLogger) { }
 
+    ~JSONLogger()
+    {
+        flush(true);
+    }
+
     void addFields(nlohmann::json & json, const Fields & fields)
     {
         if (fields.empty()) return;
@@ -121,9 +145,54 @@ struct JSONLogger : Logger
                 abort();
     }
 
-    void write(const nlohmann::json & json)
+    /* Write the pending lines if nobody else is doing so. If `wait'
+       is set, don't return until the lines pending at the time of
+       the call have been written: messages (unlike activity updates)
+       are often followed by the process exiting. */
+    void flush(bool wait)
+    {
+        while (true) {
+            if (writing.exchange(true, std::memory_order_acquire)) {
+                if (!wait) return;
+                std::this_thread::yield();
+                continue;
+            }
+
+            while (Line * line = pending.exchange(nullptr, std::memory_order_acquire)) {
+                /* The list is newest first. */
+                Line * prev = nullptr;
+                while (line) {
+                    auto next = line->next;
+                    line->next = prev;
+                    prev = line;
+                    line = next;
+                }
+                std::string batch;
+                while (prev) {
+                    batch += prev->s;
+                    batch += '\n';
+                    auto next = prev->next;
+                    delete prev;
+                    prev = next;
+                }
+                writeToStderr(batch);
+            }
+
+            writing.store(false, std::memory_order_release);
+
+            /* A line pushed after we last looked may have been left
+               to us by a thread that saw `writing' set. */
+            if (!pending.load(std::memory_order_acquire)) return;
+            wait = false;
+        }
+    }
+
+    void write(const nlohmann::json & json, bool wait = false)
     {
-        prevLogger.log(lvlError, "@nix " + json.dump());
+        auto line = new Line{"@nix " + json.dump(), pending.load(std::memory_order_relaxed)};
+        while (!pending.compare_exchange_weak(line->next, line,
+                std::memory_order_release, std::memory_order_relaxed)) ;
+        flush(wait);
     }
 
     void log(Verbosity lvl, const FormatOrString & fs) override
@@ -132,7 +201,7 @@ struct JSONLogger : Logger
         json["action"] = "msg";
         json["level"] = lvl;
         json["msg"] = fs.s;
-        write(json);
+        write(json, true);
     }
 
     void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
@@ -173,6 +242,195 @@ Logger * makeJSONLogger(Logger & prevLogger)
     return new JSONLogger(prevLogger);
 }
 
+static const char * showActivityType(ActivityType type)
+{
+    switch (type) {
+    case actCopyPath: return "copyPath";
+    case actDownload: return "download";
+    case actRealise: return "realise";
+    case actCopyPaths: return "copyPaths";
+    case actBuilds: return "builds";
+    case actBuild: return "build";
+    case actOptimiseStore: return "optimiseStore";
+    case actVerifyPaths: return "verifyPaths";
+    case actSubstitute: return "substitute";
+    case actQueryPathInfo: return "queryPathInfo";
+    default: return "unknown";
+    }
+}
+
+static const char * showResultType(ResultType type)
+{
+    switch (type) {
+    case resFileLinked: return "fileLinked";
+    case resBuildLogLine: return "buildLogLine";
+    case resUntrustedPath: return "untrustedPath";
+    case resCorruptedPath: return "corruptedPath";
+    case resSetPhase: return "setPhase";
+    case resProgress: return "progress";
+    case resSetExpected: return "setExpected";
+    case resSetEstimate: return "setEstimate";
+    case resWorkerStats: return "workerStats";
+    default: return "unknown";
+    }
+}
+
+/* A logger that passes everything on to another logger and records
+   the start and end of each activity, and its results, in a file in
+   the Chrome trace event format (as understood by chrome://tracing
+   and Perfetto). Activities are written as nestable async events
+   whose id is the activity id, since activities on the same thread
+   needn't be properly nested. */
+struct TraceLogger : Logger
+{
+    Logger & next;
+
+    AutoCloseFD fd;
+
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+    struct State
+    {
+        std::string buf;
+        std::map<ActivityId, ActivityType> types;
+        bool finished = false;
+    };
+
+    Sync<State> state_;
+
+    TraceLogger(Logger & next, const Path & fileName)
+        : next(next)
+    {
+        fd = open(fileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
+        if (!fd) throw SysError("opening trace file '%s'", fileName);
+        writeFull(fd.get(), "[\n");
+    }
+
+    /* Write the end of the trace. Afterwards, we only forward to
+       `next'. */
+    void finish()
+    {
+        auto state(state_.lock());
+        if (state->finished) return;
+        state->finished = true;
+        state->buf += "{}]\n";
+        try {
+            writeFull(fd.get(), state->buf);
+        } catch (SysError &) {
+        }
+        state->buf.clear();
+        fd = -1;
+    }
+
+    nlohmann::json event(const char * ph, ActivityId act, const char * cat, const std::string & name)
+    {
+        static std::atomic<uint64_t> nextTid{1};
+        static thread_local uint64_t tid = nextTid++;
+
+        nlohmann::json json;
+        json["ph"] = ph;
+        json["id"] = fmt("0x%x", act);
+        json["cat"] = cat;
+        json["name"] = name;
+        json["pid"] = getpid();
+        json["tid"] = tid;
+        json["ts"] = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - epoch).count();
+        return json;
+    }
+
+    static nlohmann::json showFields(const Fields & fields)
+    {
+        auto arr = nlohmann::json::array();
+        for (auto & f : fields)
+            if (f.type == Logger::Field::tInt)
+                arr.push_back(f.i);
+            else
+                arr.push_back(f.s);
+        return arr;
+    }
+
+    void write(State & state, const nlohmann::json & json)
+    {
+        if (state.finished) return;
+        state.buf += json.dump();
+        state.buf += ",\n";
+        if (state.buf.size() >= 64 * 1024) {
+            try {
+                writeFull(fd.get(), state.buf);
+            } catch (SysError &) {
+            }
+            state.buf.clear();
+        }
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        next.log(lvl, fs);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        next.warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        next.startActivity(act, lvl, type, s, fields, parent);
+
+        auto json = event("b", act, showActivityType(type), s.empty() ? showActivityType(type) : s);
+        auto & args = json["args"];
+        args["parent"] = fmt("0x%x", parent);
+        if (!fields.empty()) args["fields"] = showFields(fields);
+
+        auto state(state_.lock());
+        state->types[act] = type;
+        write(*state, json);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        next.stopActivity(act);
+
+        auto state(state_.lock());
+        auto i = state->types.find(act);
+        if (i == state->types.end()) return;
+        write(*state, event("e", act, showActivityType(i->second), ""));
+        state->types.erase(i);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        next.result(act, type, fields);
+
+        /* Build log lines are the build log, not timing information. */
+        if (type == resBuildLogLine) return;
+
+        auto state(state_.lock());
+        auto i = state->types.find(act);
+        if (i == state->types.end()) return;
+        auto json = event("n", act, showActivityType(i->second), showResultType(type));
+        json["args"]["fields"] = showFields(fields);
+        write(*state, json);
+    }
+};
+
+void startTracing(const Path & fileName)
+{
+    logger = new TraceLogger(*logger, fileName);
+}
+
+void stopTracing()
+{
+    /* The trace logger is not deleted, since activities may still
+       refer to it. */
+    auto traceLogger = dynamic_cast<TraceLogger *>(logger);
+    if (!traceLogger) return;
+    traceLogger->finish();
+    logger = &traceLogger->next;
+}
+
 static Logger::Fields getFields(nlohmann::json & json)
 {
     Logger::Fields fields;
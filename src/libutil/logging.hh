@@ -36,6 +36,8 @@ typedef enum {
     resSetPhase = 104,
     resProgress = 105,
     resSetExpected = 106,
+    resSetEstimate = 107,
+    resWorkerStats = 108,
 } ResultType;
 
 typedef uint64_t ActivityId;
@@ -104,6 +106,10 @@ struct Activity
     void setExpected(ActivityType type2, uint64_t expected) const
     { result(resSetExpected, type2, expected); }
 
+    /* Set the estimated duration (in seconds) of the activity. */
+    void setEstimate(uint64_t seconds) const
+    { result(resSetEstimate, seconds); }
+
     template<typename... Args>
     void result(ResultType type, const Args & ... args) const
     {
@@ -133,6 +139,13 @@ Logger * makeDefaultLogger();
 
 Logger * makeJSONLogger(Logger & prevLogger);
 
+/* Wrap the current logger in one that also writes the activities to
+   `fileName' as Chrome trace events, until stopTracing() is
+   called. */
+void startTracing(const Path & fileName);
+
+void stopTracing();
+
 bool handleJSONLogMessage(const std::string & msg,
     const Activity & act, std::map<ActivityId, Activity> & activities,
     bool trusted);
@@ -2,7 +2,15 @@
 
 #include <map>
 #include <list>
+#include <deque>
 #include <optional>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <functional>
 
 namespace nix {
 
@@ -89,4 +97,258 @@ public:
     }
 };
 
+
+/* A cache that approximates LRU with the CLOCK (second chance)
+   algorithm.  Items live in an array that grows up to `capacity'
+   items as they are added, and are found through a hash table.  A
+   lookup only sets the item's `referenced' flag, so get() is O(1)
+   and doesn't modify the cache structure: it can run concurrently
+   with other get() calls (but not with upsert() or erase()).  When
+   the cache is full, a `hand' sweeps the array, clearing referenced
+   flags, and evicts the first item that hasn't been referenced since
+   the hand last passed it. */
+template<typename Key, typename Value>
+class ClockCache
+{
+private:
+
+    size_t capacity;
+
+    struct Slot
+    {
+        Key key;
+        Value value;
+        mutable std::atomic<bool> referenced{false};
+        Slot(const Key & key, const Value & value) : key(key), value(value) { }
+    };
+
+    /* A deque, so that growing it doesn't move the slots (which
+       can't be moved anyway because of the atomic flag). */
+    std::deque<Slot> slots;
+    std::unordered_map<Key, size_t> index;
+    size_t hand = 0;
+
+public:
+
+    ClockCache(size_t capacity)
+        : capacity(capacity)
+    {
+    }
+
+    void upsert(const Key & key, const Value & value)
+    {
+        if (capacity == 0) return;
+
+        auto i = index.find(key);
+        if (i != index.end()) {
+            slots[i->second].value = value;
+            slots[i->second].referenced = true;
+            return;
+        }
+
+        if (slots.size() < capacity) {
+            index.emplace(key, slots.size());
+            slots.emplace_back(key, value);
+            return;
+        }
+
+        /* Find an item to evict. Every item is passed at most once
+           with its flag set, so this terminates. */
+        while (slots[hand].referenced.exchange(false, std::memory_order_relaxed))
+            hand = (hand + 1) % slots.size();
+
+        auto & slot(slots[hand]);
+        index.erase(slot.key);
+        index.emplace(key, hand);
+        slot.key = key;
+        slot.value = value;
+        hand = (hand + 1) % slots.size();
+    }
+
+    bool erase(const Key & key)
+    {
+        auto i = index.find(key);
+        if (i == index.end()) return false;
+
+        /* Move the last item into the hole. */
+        auto pos = i->second;
+        index.erase(i);
+        auto last = slots.size() - 1;
+        if (pos != last) {
+            auto & slot(slots[pos]);
+            slot.key = std::move(slots[last].key);
+            slot.value = std::move(slots[last].value);
+            slot.referenced = slots[last].referenced.load(std::memory_order_relaxed);
+            index[slot.key] = pos;
+        }
+        slots.pop_back();
+        if (hand >= slots.size()) hand = 0;
+        return true;
+    }
+
+    /* Look up an item in the cache. If it exists, it gets a second
+       chance the next time the hand passes it. */
+    std::optional<Value> get(const Key & key) const
+    {
+        auto i = index.find(key);
+        if (i == index.end()) return {};
+        auto & slot(slots[i->second]);
+        slot.referenced.store(true, std::memory_order_relaxed);
+        return slot.value;
+    }
+
+    size_t size() const
+    {
+        return slots.size();
+    }
+
+    void clear()
+    {
+        slots.clear();
+        index.clear();
+        hand = 0;
+    }
+};
+
+
+/* A thread-safe cache, split into shards that are locked
+   independently, so that threads looking up different keys rarely
+   contend for the same lock.  Each shard is a ClockCache of (about)
+   `capacity / nrShards' items behind a reader-writer lock, so lookups
+   in the same shard don't exclude each other either. */
+template<typename Key, typename Value>
+class ShardedLRUCache
+{
+public:
+
+    /* Statistics of a shard: lookups that found or didn't find an
+       item, and lock acquisitions that had to wait for another
+       thread. */
+    struct Stats
+    {
+        uint64_t size = 0, hits = 0, misses = 0, contended = 0;
+    };
+
+private:
+
+    struct Shard
+    {
+        std::shared_mutex mutex;
+        ClockCache<Key, Value> cache;
+        /* Keep the counters of different shards apart, so that
+           counting doesn't make the shards contend after all. */
+        alignas(64) std::atomic<uint64_t> hits{0}, misses{0}, contended{0};
+        Shard(size_t capacity) : cache(capacity) { }
+    };
+
+    std::vector<std::unique_ptr<Shard>> shards;
+
+    Shard & getShard(const Key & key)
+    {
+        /* Mix in some high bits, since the low bits also pick the
+           bucket in the shard's hash table. */
+        auto h = std::hash<Key>()(key);
+        return *shards[(h ^ h >> 17) % shards.size()];
+    }
+
+    std::unique_lock<std::shared_mutex> lock(Shard & shard)
+    {
+        std::unique_lock<std::shared_mutex> lk(shard.mutex, std::try_to_lock);
+        if (!lk.owns_lock()) {
+            shard.contended++;
+            lk.lock();
+        }
+        return lk;
+    }
+
+    std::shared_lock<std::shared_mutex> readLock(Shard & shard)
+    {
+        std::shared_lock<std::shared_mutex> lk(shard.mutex, std::try_to_lock);
+        if (!lk.owns_lock()) {
+            shard.contended++;
+            lk.lock();
+        }
+        return lk;
+    }
+
+public:
+
+    ShardedLRUCache(size_t capacity, size_t nrShards = 16)
+    {
+        for (size_t n = 0; n < nrShards; ++n)
+            shards.push_back(std::make_unique<Shard>((capacity + nrShards - 1) / nrShards));
+    }
+
+    void upsert(const Key & key, const Value & value)
+    {
+        auto & shard(getShard(key));
+        auto lk(lock(shard));
+        shard.cache.upsert(key, value);
+    }
+
+    bool erase(const Key & key)
+    {
+        auto & shard(getShard(key));
+        auto lk(lock(shard));
+        return shard.cache.erase(key);
+    }
+
+    std::optional<Value> get(const Key & key)
+    {
+        auto & shard(getShard(key));
+        auto lk(readLock(shard));
+        auto res = shard.cache.get(key);
+        if (res) shard.hits++; else shard.misses++;
+        return res;
+    }
+
+    size_t size()
+    {
+        size_t n = 0;
+        for (auto & shard : shards) {
+            auto lk(readLock(*shard));
+            n += shard->cache.size();
+        }
+        return n;
+    }
+
+    void clear()
+    {
+        for (auto & shard : shards) {
+            auto lk(lock(*shard));
+            shard->cache.clear();
+        }
+    }
+
+    std::vector<Stats> getShardStats()
+    {
+        std::vector<Stats> res;
+        for (auto & shard : shards) {
+            Stats stats;
+            {
+                auto lk(readLock(*shard));
+                stats.size = shard->cache.size();
+            }
+            stats.hits = shard->hits;
+            stats.misses = shard->misses;
+            stats.contended = shard->contended;
+            res.push_back(stats);
+        }
+        return res;
+    }
+
+    /* The statistics summed over all shards. */
+    Stats getStats()
+    {
+        Stats total;
+        for (auto & stats : getShardStats()) {
+            total.size += stats.size;
+            total.hits += stats.hits;
+            total.misses += stats.misses;
+            total.contended += stats.contended;
+        }
+        return total;
+    }
+};
+
 }
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <chrono>
 #include <functional>
 #include <limits>
 #include <list>
@@ -26,8 +27,24 @@ namespace nix {
 
    Here, the Connection object referenced by ‘conn’ is automatically
    returned to the pool when ‘conn’ goes out of scope.
+
+   Optionally, the pool starts with a smaller limit than ‘max’ and
+   only grows when callers have to wait too long for an instance (see
+   setGrowth()), and instances that have been idle for too long are
+   dropped (see setMaxIdleTime()).
 */
 
+struct PoolStats
+{
+    uint64_t created = 0;
+    uint64_t reaped = 0;  // dropped after being idle for too long
+    uint64_t invalid = 0; // rejected by the validator
+    uint64_t waits = 0;
+    uint64_t waitTimeMs = 0;
+    uint64_t grown = 0;   // times the limit was raised
+    size_t limit = 0;
+};
+
 template <class R>
 class Pool
 {
@@ -42,14 +59,28 @@ public:
 
 private:
 
+    typedef std::chrono::steady_clock Clock;
+
     Factory factory;
     Validator validator;
 
+    struct Idle
+    {
+        ref<R> r;
+        Clock::time_point since;
+    };
+
     struct State
     {
         size_t inUse = 0;
         size_t max;
-        std::vector<ref<R>> idle;
+        /* The current limit on the number of instances, which is at
+           most ‘max’. */
+        size_t limit;
+        std::chrono::milliseconds growAfter{0};
+        std::chrono::seconds maxIdleTime{0};
+        std::vector<Idle> idle;
+        PoolStats stats;
     };
 
     Sync<State> state;
@@ -66,12 +97,32 @@ public:
     {
         auto state_(state.lock());
         state_->max = max;
+        state_->limit = max;
+    }
+
+    /* Start with a limit of ‘initial’ instances and raise it by one
+       (up to ‘max’) whenever a caller has waited ‘growAfter’ for an
+       instance. */
+    void setGrowth(size_t initial, std::chrono::milliseconds growAfter)
+    {
+        auto state_(state.lock());
+        state_->limit = std::min(std::max(initial, (size_t) 1), state_->max);
+        state_->growAfter = growAfter;
+    }
+
+    /* Drop instances that have been idle for more than ‘maxIdleTime’
+       (0 means never). */
+    void setMaxIdleTime(std::chrono::seconds maxIdleTime)
+    {
+        auto state_(state.lock());
+        state_->maxIdleTime = maxIdleTime;
     }
 
     void incCapacity()
     {
         auto state_(state.lock());
         state_->max++;
+        state_->limit++;
         /* we could wakeup here, but this is only used when we're
          * about to nest Pool usages, and we want to save the slot for
          * the nested use if we can
@@ -82,6 +133,7 @@ public:
     {
         auto state_(state.lock());
         state_->max--;
+        state_->limit--;
     }
 
     ~Pool()
@@ -89,6 +141,7 @@ public:
         auto state_(state.lock());
         assert(!state_->inUse);
         state_->max = 0;
+        state_->limit = 0;
         state_->idle.clear();
     }
 
@@ -114,7 +167,7 @@ public:
             {
                 auto state_(pool.state.lock());
                 if (!bad)
-                    state_->idle.push_back(ref<R>(r));
+                    state_->idle.push_back({ref<R>(r), Clock::now()});
                 assert(state_->inUse);
                 state_->inUse--;
             }
@@ -132,21 +185,41 @@ public:
         {
             auto state_(state.lock());
 
+            reap(*state_);
+
             /* If we're over the maximum number of instance, we need
-               to wait until a slot becomes available. */
-            while (state_->idle.empty() && state_->inUse >= state_->max)
-                state_.wait(wakeup);
+               to wait until a slot becomes available. If that takes
+               too long and we're allowed to, raise the limit. */
+            if (state_->idle.empty() && state_->inUse >= state_->limit) {
+                auto before = Clock::now();
+                state_->stats.waits++;
+                while (state_->idle.empty() && state_->inUse >= state_->limit) {
+                    bool canGrow = state_->growAfter.count() && state_->limit < state_->max;
+                    auto waited = Clock::now() - before;
+                    if (canGrow && waited >= state_->growAfter) {
+                        state_->limit++;
+                        state_->stats.grown++;
+                    } else if (canGrow)
+                        state_.wait_for(wakeup, state_->growAfter - waited);
+                    else
+                        state_.wait(wakeup);
+                }
+                state_->stats.waitTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(
+                    Clock::now() - before).count();
+            }
 
             while (!state_->idle.empty()) {
-                auto p = state_->idle.back();
+                auto p = state_->idle.back().r;
                 state_->idle.pop_back();
                 if (validator(p)) {
                     state_->inUse++;
                     return Handle(*this, p);
                 }
+                state_->stats.invalid++;
             }
 
             state_->inUse++;
+            state_->stats.created++;
         }
 
         /* We need to create a new instance. Because that might take a
@@ -176,11 +249,37 @@ public:
     void flushBad()
     {
         auto state_(state.lock());
-        std::vector<ref<R>> left;
+        std::vector<Idle> left;
         for (auto & p : state_->idle)
-            if (validator(p))
+            if (validator(p.r))
                 left.push_back(p);
+            else
+                state_->stats.invalid++;
         std::swap(state_->idle, left);
+        reap(*state_);
+    }
+
+    PoolStats getStats()
+    {
+        auto state_(state.lock());
+        auto stats = state_->stats;
+        stats.limit = state_->limit;
+        return stats;
+    }
+
+private:
+
+    void reap(State & state_)
+    {
+        if (!state_.maxIdleTime.count()) return;
+        auto now = Clock::now();
+        std::vector<Idle> left;
+        for (auto & p : state_.idle)
+            if (now - p.since <= state_.maxIdleTime)
+                left.push_back(p);
+            else
+                state_.stats.reaped++;
+        std::swap(state_.idle, left);
     }
 };
 
@@ -0,0 +1,170 @@
+#include "rewrite.hh"
+
+#include <algorithm>
+#include <queue>
+
+namespace nix {
+
+
+StringRewriter::StringRewriter(const StringRewrites & rewrites)
+    : nodes(1)
+{
+    /* Build the trie of the keys. */
+    for (auto & i : rewrites) {
+        if (i.first.empty()) continue;
+        uint32_t node = 0;
+        for (unsigned char c : i.first) {
+            auto & next(nodes[node].next);
+            auto j = std::lower_bound(next.begin(), next.end(), std::make_pair(c, (uint32_t) 0));
+            if (j != next.end() && j->first == c)
+                node = j->second;
+            else {
+                uint32_t child = nodes.size();
+                next.emplace(j, c, child);
+                nodes.emplace_back();
+                nodes[child].depth = nodes[node].depth + 1;
+                node = child;
+            }
+        }
+        nodes[node].match = node;
+        nodes[node].replacement = i.second;
+    }
+
+    rootNext.fill(0);
+    for (auto & i : nodes[0].next)
+        rootNext[i.first] = i.second;
+
+    /* Compute the failure transitions breadth-first, so that those of
+       shorter strings are known first. */
+    std::queue<uint32_t> todo;
+    for (auto & i : nodes[0].next)
+        todo.push(i.second);
+
+    while (!todo.empty()) {
+        auto node = todo.front();
+        todo.pop();
+        for (auto & i : nodes[node].next) {
+            auto child = i.second;
+            nodes[child].fail = step(nodes[node].fail, i.first);
+            if (!nodes[child].match)
+                nodes[child].match = nodes[nodes[child].fail].match;
+            todo.push(child);
+        }
+    }
+}
+
+
+uint32_t StringRewriter::step(uint32_t state, unsigned char c) const
+{
+    while (state) {
+        auto & next(nodes[state].next);
+        auto j = std::lower_bound(next.begin(), next.end(), std::make_pair(c, (uint32_t) 0));
+        if (j != next.end() && j->first == c) return j->second;
+        state = nodes[state].fail;
+    }
+    return rootNext[c];
+}
+
+
+std::string StringRewriter::rewrite(const std::string & s) const
+{
+    if (empty()) return s;
+    StringSink sink;
+    RewritingSink rewriter(*this, sink);
+    rewriter(s);
+    rewriter.finish();
+    return *sink.s;
+}
+
+
+void RewritingSink::write(const unsigned char * data, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len) {
+
+        /* As long as no key has been started, write bytes that can't
+           start one straight through. */
+        if (held.empty()) {
+            auto j = i;
+            while (j < len && !rewriter.rootNext[data[j]]) ++j;
+            next(data + i, j - i);
+            i = j;
+            if (i == len) break;
+        }
+
+        held.push_back(data[i++]);
+        scan();
+    }
+}
+
+
+void RewritingSink::scan()
+{
+    while (scanned < held.size()) {
+        state = rewriter.step(state, held[scanned++]);
+        auto & node(rewriter.nodes[state]);
+
+        /* The longest key ending here also starts first. */
+        if (node.match) {
+            auto len = rewriter.nodes[node.match].depth;
+            auto start = scanned - len;
+            if (!haveBest || start < bestStart || (start == bestStart && len > bestLen)) {
+                haveBest = true;
+                bestStart = start;
+                bestLen = len;
+                bestNode = node.match;
+            }
+        }
+
+        /* Keys found from now on start at or after `windowStart'. */
+        auto windowStart = scanned - node.depth;
+
+        if (haveBest) {
+            if (windowStart > bestStart) replaceBest();
+        } else if (windowStart) {
+            next((const unsigned char *) held.data(), windowStart);
+            held.erase(0, windowStart);
+            scanned -= windowStart;
+        }
+    }
+}
+
+
+void RewritingSink::replaceBest()
+{
+    next((const unsigned char *) held.data(), bestStart);
+    next(rewriter.nodes[bestNode].replacement);
+    held.erase(0, bestStart + bestLen);
+    haveBest = false;
+
+    /* The bytes after the key may have been scanned as part of a
+       longer candidate, so scan them again from the start. */
+    state = 0;
+    scanned = 0;
+}
+
+
+void RewritingSink::finish()
+{
+    flush();
+    while (true) {
+        scan();
+        if (!haveBest) break;
+        replaceBest();
+    }
+    next(held);
+    held.clear();
+    state = 0;
+    scanned = 0;
+}
+
+
+std::string rewriteStrings(const std::string & s, const StringRewrites & rewrites)
+{
+    if (rewrites.empty()) return s;
+    return StringRewriter(rewrites).rewrite(s);
+}
+
+
+}
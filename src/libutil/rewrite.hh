@@ -0,0 +1,103 @@
+#pragma once
+
+#include "types.hh"
+#include "serialise.hh"
+
+#include <array>
+
+namespace nix {
+
+typedef std::map<std::string, std::string> StringRewrites;
+
+
+/* An Aho-Corasick automaton for replacing the occurrences of the keys
+   of a set of rewrites by their values in a single pass, in time
+   linear in the size of the input.  Rewriting is leftmost-longest:
+   of the keys occurring in the input, the one that starts first
+   (and of those, the longest) is replaced, and scanning resumes
+   after it, so replacements are never rewritten again.  A
+   StringRewriter is immutable once constructed and may be used by
+   several RewritingSinks (and threads) at once. */
+class StringRewriter
+{
+    struct Node
+    {
+        /* The transitions of this node, sorted by byte. */
+        std::vector<std::pair<unsigned char, uint32_t>> next;
+
+        /* The node for the longest proper suffix of this node's
+           string that is a prefix of a key. */
+        uint32_t fail = 0;
+
+        /* The length of this node's string. */
+        uint32_t depth = 0;
+
+        /* The node for the longest suffix of this node's string
+           (including the string itself) that is a key, or 0. */
+        uint32_t match = 0;
+
+        /* The replacement, if this node's string is a key. */
+        std::string replacement;
+    };
+
+    std::vector<Node> nodes;
+
+    /* The transitions of the root, which is where the automaton
+       spends most of its time. */
+    std::array<uint32_t, 256> rootNext;
+
+    uint32_t step(uint32_t state, unsigned char c) const;
+
+    friend struct RewritingSink;
+
+public:
+
+    StringRewriter(const StringRewrites & rewrites);
+
+    bool empty() const { return nodes.size() == 1; }
+
+    std::string rewrite(const std::string & s) const;
+};
+
+
+/* A sink that applies a StringRewriter to the data written to it and
+   writes the result to `next'.  Since a key may span several writes,
+   the bytes that may still be part of a key are held back until more
+   data arrives or finish() is called. */
+struct RewritingSink : BufferedSink
+{
+    RewritingSink(const StringRewriter & rewriter, Sink & next)
+        : rewriter(rewriter), next(next) { }
+
+    void write(const unsigned char * data, size_t len) override;
+
+    /* Write the held back bytes.  Must be called at the end of the
+       input. */
+    void finish();
+
+private:
+
+    const StringRewriter & rewriter;
+    Sink & next;
+
+    uint32_t state = 0;
+
+    /* The bytes not written to `next' yet, and how many of them have
+       been fed to the automaton. */
+    std::string held;
+    size_t scanned = 0;
+
+    /* The leftmost-longest key found in `held' so far. */
+    bool haveBest = false;
+    size_t bestStart, bestLen;
+    uint32_t bestNode;
+
+    void scan();
+    void replaceBest();
+};
+
+
+/* Apply `rewrites' to `s'. */
+std::string rewriteStrings(const std::string & s, const StringRewrites & rewrites);
+
+}
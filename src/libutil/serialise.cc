@@ -1,9 +1,15 @@
 #include "serialise.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <cstring>
 #include <cerrno>
 #include <memory>
+#include <condition_variable>
+#include <list>
+#include <thread>
+
+#include <sys/uio.h>
 
 #include <boost/coroutine2/coroutine.hpp>
 
@@ -11,16 +17,64 @@
 namespace nix {
 
 
+/* Buffers are mostly allocated and freed on the same thread, so
+   keep a few per thread for reuse. */
+struct FreeBuffers
+{
+    std::vector<std::pair<size_t, std::unique_ptr<unsigned char[]>>> buffers;
+    ~FreeBuffers();
+};
+
+/* Sinks and sources with static storage duration may release their
+   buffers after the thread-local pool has been destroyed. */
+static thread_local bool freeBuffersDestroyed = false;
+
+FreeBuffers::~FreeBuffers()
+{
+    freeBuffersDestroyed = true;
+}
+
+static thread_local FreeBuffers freeBuffers;
+
+static const size_t maxFreeBuffers = 4, maxFreeBufferSize = 1024 * 1024;
+
+
+std::unique_ptr<unsigned char[]> allocBuffer(size_t size)
+{
+    if (!freeBuffersDestroyed)
+        for (auto i = freeBuffers.buffers.begin(); i != freeBuffers.buffers.end(); ++i)
+            if (i->first == size) {
+                auto buffer = std::move(i->second);
+                freeBuffers.buffers.erase(i);
+                return buffer;
+            }
+    return std::unique_ptr<unsigned char[]>(new unsigned char[size]);
+}
+
+
+void releaseBuffer(std::unique_ptr<unsigned char[]> buffer, size_t size)
+{
+    if (buffer && !freeBuffersDestroyed
+        && freeBuffers.buffers.size() < maxFreeBuffers && size <= maxFreeBufferSize)
+        freeBuffers.buffers.emplace_back(size, std::move(buffer));
+}
+
+
+BufferedSink::~BufferedSink()
+{
+    releaseBuffer(std::move(buffer), bufSize);
+}
+
+
 void BufferedSink::operator () (const unsigned char * data, size_t len)
 {
-    if (!buffer) buffer = decltype(buffer)(new unsigned char[bufSize]);
+    if (!buffer) buffer = allocBuffer(bufSize);
 
     while (len) {
         /* Optimisation: bypass the buffer if the data exceeds the
            buffer size. */
         if (bufPos + len >= bufSize) {
-            flush();
-            write(data, len);
+            flushAndWrite(data, len);
             break;
         }
         /* Otherwise, copy the bytes to the buffer.  Flush the buffer
@@ -42,6 +96,13 @@ void BufferedSink::flush()
 }
 
 
+void BufferedSink::flushAndWrite(const unsigned char * data, size_t len)
+{
+    flush();
+    write(data, len);
+}
+
+
 FdSink::~FdSink()
 {
     try { flush(); } catch (...) { ignoreException(); }
@@ -56,7 +117,7 @@ static void warnLargeDump()
 }
 
 
-void FdSink::write(const unsigned char * data, size_t len)
+void FdSink::checkWritten(size_t len)
 {
     written += len;
     static bool warned = false;
@@ -66,6 +127,12 @@ void FdSink::write(const unsigned char * data, size_t len)
             warned = true;
         }
     }
+}
+
+
+void FdSink::write(const unsigned char * data, size_t len)
+{
+    checkWritten(len);
     try {
         writeFull(fd, data, len);
     } catch (SysError & e) {
@@ -75,6 +142,46 @@ void FdSink::write(const unsigned char * data, size_t len)
 }
 
 
+void FdSink::flushAndWrite(const unsigned char * data, size_t len)
+{
+    if (!bufPos) {
+        write(data, len);
+        return;
+    }
+
+    checkWritten(bufPos + len);
+
+    /* Write the buffer and the data in one system call. */
+    struct iovec iov[2];
+    iov[0].iov_base = buffer.get();
+    iov[0].iov_len = bufPos;
+    iov[1].iov_base = (void *) data;
+    iov[1].iov_len = len;
+    bufPos = 0;
+
+    struct iovec * cur = iov;
+    int count = 2;
+    while (count) {
+        checkInterrupt();
+        ssize_t n = writev(fd, cur, count);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            _good = false;
+            throw SysError("writing to file");
+        }
+        while (count && (size_t) n >= cur->iov_len) {
+            n -= cur->iov_len;
+            cur++;
+            count--;
+        }
+        if (count) {
+            cur->iov_base = (char *) cur->iov_base + n;
+            cur->iov_len -= n;
+        }
+    }
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -107,9 +214,18 @@ std::string Source::drain()
 }
 
 
+BufferedSource::~BufferedSource()
+{
+    releaseBuffer(std::move(buffer), bufSize);
+}
+
+
 size_t BufferedSource::read(unsigned char * data, size_t len)
 {
-    if (!buffer) buffer = decltype(buffer)(new unsigned char[bufSize]);
+    /* Large reads bypass an empty buffer, saving a copy. */
+    if (!bufPosIn && len >= bufSize) return readUnbuffered(data, len);
+
+    if (!buffer) buffer = allocBuffer(bufSize);
 
     if (!bufPosIn) bufPosIn = readUnbuffered(buffer.get(), bufSize);
 
@@ -212,6 +328,161 @@ std::unique_ptr<Source> sinkToSource(
 }
 
 
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof,
+    size_t bufferSize)
+{
+    struct Cancelled { };
+
+    /* The producer copies data into a ring of fixed-size chunks,
+       which are allocated on first use and then reused. A chunk is
+       handed to the reader once it's full, or earlier if the reader
+       is waiting for data. The reader reads a chunk in place and
+       returns it to the ring when it's done with it. */
+    struct ThreadedSinkToSource : Source
+    {
+        const size_t chunkSize = 64 * 1024;
+
+        struct Chunk
+        {
+            std::unique_ptr<unsigned char[]> data;
+            size_t size = 0;
+        };
+
+        struct State
+        {
+            std::vector<Chunk> ring;
+            /* `ring[head]' is the first chunk handed to the reader;
+               `filled' chunks have been handed over. The chunk after
+               those is being filled by the producer. */
+            size_t head = 0, filled = 0;
+            bool done = false;
+            bool cancelled = false;
+            /* Whether the reader is waiting for data. */
+            bool waiting = false;
+            std::exception_ptr exc;
+        };
+
+        Sync<State> state_;
+        std::condition_variable avail, space;
+
+        std::function<void()> eof;
+        std::thread thr;
+
+        /* The chunk being read, if any. */
+        Chunk * cur = nullptr;
+        size_t pos = 0;
+
+        ThreadedSinkToSource(std::function<void(Sink &)> fun,
+            std::function<void()> eof, size_t bufferSize)
+            : eof(eof)
+        {
+            state_.lock()->ring.resize(std::max((size_t) 2, bufferSize / chunkSize));
+
+            thr = std::thread([this, fun]() {
+                std::exception_ptr exc;
+                try {
+                    LambdaSink sink([&](const unsigned char * data, size_t len) {
+                        while (len) {
+                            auto state(state_.lock());
+                            /* Wait for a free chunk. */
+                            while (state->filled == state->ring.size() && !state->cancelled)
+                                state.wait(space);
+                            if (state->cancelled) throw Cancelled();
+                            auto & chunk(state->ring[(state->head + state->filled) % state->ring.size()]);
+                            if (!chunk.data) chunk.data = std::make_unique<unsigned char[]>(chunkSize);
+                            auto n = std::min(len, chunkSize - chunk.size);
+                            memcpy(chunk.data.get() + chunk.size, data, n);
+                            chunk.size += n;
+                            data += n;
+                            len -= n;
+                            if (chunk.size == chunkSize) {
+                                state->filled++;
+                                avail.notify_one();
+                            } else if (state->waiting)
+                                /* Let the reader take the partial
+                                   chunk. */
+                                avail.notify_one();
+                        }
+                    });
+                    fun(sink);
+                } catch (Cancelled &) {
+                } catch (...) {
+                    exc = std::current_exception();
+                }
+                auto state(state_.lock());
+                if (state->filled < state->ring.size()
+                    && state->ring[(state->head + state->filled) % state->ring.size()].size)
+                    state->filled++;
+                state->done = true;
+                state->exc = exc;
+                avail.notify_one();
+            });
+        }
+
+        ~ThreadedSinkToSource()
+        {
+            {
+                auto state(state_.lock());
+                state->cancelled = true;
+                space.notify_one();
+            }
+            thr.join();
+        }
+
+        size_t read(unsigned char * data, size_t len) override
+        {
+            if (!cur || pos == cur->size) {
+                bool finished = false;
+                {
+                    auto state(state_.lock());
+
+                    /* Give back the chunk we've read. */
+                    if (cur) {
+                        cur->size = 0;
+                        cur = nullptr;
+                        state->head = (state->head + 1) % state->ring.size();
+                        state->filled--;
+                        space.notify_one();
+                    }
+
+                    while (!state->filled && !state->done) {
+                        /* Take a partially filled chunk rather than
+                           wait for the producer to fill it. */
+                        if (state->ring[state->head].size) {
+                            state->filled++;
+                            space.notify_one();
+                            break;
+                        }
+                        state->waiting = true;
+                        state.wait(avail);
+                        state->waiting = false;
+                    }
+
+                    if (!state->filled) {
+                        if (state->exc) std::rethrow_exception(state->exc);
+                        finished = true;
+                    } else {
+                        cur = &state->ring[state->head];
+                        pos = 0;
+                    }
+                }
+                if (finished) { eof(); abort(); }
+            }
+
+            auto n = std::min(cur->size - pos, len);
+            memcpy(data, cur->data.get() + pos, n);
+            pos += n;
+
+            return n;
+        }
+    };
+
+    return std::make_unique<ThreadedSinkToSource>(fun, eof, bufferSize);
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
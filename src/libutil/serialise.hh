@@ -1,6 +1,7 @@
 #pragma once
 
 #include <memory>
+#include <ostream>
 
 #include "types.hh"
 #include "util.hh"
@@ -23,6 +24,18 @@ struct Sink
 };
 
 
+/* Get a buffer of `size' bytes, reusing one given back to
+   releaseBuffer() on this thread if possible. */
+std::unique_ptr<unsigned char[]> allocBuffer(size_t size);
+
+/* Give back a buffer obtained from allocBuffer(). */
+void releaseBuffer(std::unique_ptr<unsigned char[]> buffer, size_t size);
+
+
+/* The default buffer size of FdSink and FdSource. */
+const size_t fdBufferSize = 128 * 1024;
+
+
 /* A buffered abstract sink. */
 struct BufferedSink : Sink
 {
@@ -32,6 +45,10 @@ struct BufferedSink : Sink
     BufferedSink(size_t bufSize = 32 * 1024)
         : bufSize(bufSize), bufPos(0), buffer(nullptr) { }
 
+    BufferedSink(BufferedSink &&) = default;
+
+    ~BufferedSink();
+
     void operator () (const unsigned char * data, size_t len) override;
 
     void operator () (const std::string & s)
@@ -42,6 +59,12 @@ struct BufferedSink : Sink
     void flush();
 
     virtual void write(const unsigned char * data, size_t len) = 0;
+
+protected:
+    /* Write the contents of the buffer followed by `data', and empty
+       the buffer. Sinks that can do that in one operation (like
+       FdSink with writev()) can override this. */
+    virtual void flushAndWrite(const unsigned char * data, size_t len);
 };
 
 
@@ -75,6 +98,10 @@ struct BufferedSource : Source
     BufferedSource(size_t bufSize = 32 * 1024)
         : bufSize(bufSize), bufPosIn(0), bufPosOut(0), buffer(nullptr) { }
 
+    BufferedSource(BufferedSource &&) = default;
+
+    ~BufferedSource();
+
     size_t read(unsigned char * data, size_t len) override;
 
 
@@ -93,13 +120,18 @@ struct FdSink : BufferedSink
     bool warn = false;
     size_t written = 0;
 
-    FdSink() : fd(-1) { }
-    FdSink(int fd) : fd(fd) { }
+    FdSink() : BufferedSink(fdBufferSize), fd(-1) { }
+    FdSink(int fd, size_t bufSize = fdBufferSize) : BufferedSink(bufSize), fd(fd) { }
     FdSink(FdSink&&) = default;
 
     FdSink& operator=(FdSink && s)
     {
         flush();
+        if (buffer) releaseBuffer(std::move(buffer), bufSize);
+        bufSize = s.bufSize;
+        buffer = std::move(s.buffer);
+        bufPos = s.bufPos;
+        s.bufPos = 0;
         fd = s.fd;
         s.fd = -1;
         warn = s.warn;
@@ -113,8 +145,57 @@ struct FdSink : BufferedSink
 
     bool good() override;
 
+protected:
+    void flushAndWrite(const unsigned char * data, size_t len) override;
+
 private:
     bool _good = true;
+
+    void checkWritten(size_t len);
+};
+
+
+/* A std::ostream that writes to a buffered sink, e.g. to stream large
+   JSON documents to a file descriptor without going through
+   std::cout.  Flushing the stream flushes the sink. */
+class SinkStream : public std::ostream
+{
+    struct Buf : std::streambuf
+    {
+        BufferedSink & sink;
+
+        Buf(BufferedSink & sink) : sink(sink) { }
+
+        int overflow(int c) override
+        {
+            if (c != EOF) {
+                unsigned char ch = c;
+                sink(&ch, 1);
+            }
+            return c;
+        }
+
+        std::streamsize xsputn(const char * s, std::streamsize n) override
+        {
+            sink((const unsigned char *) s, n);
+            return n;
+        }
+
+        int sync() override
+        {
+            sink.flush();
+            return 0;
+        }
+    };
+
+    Buf buf;
+
+public:
+
+    SinkStream(BufferedSink & sink) : std::ostream(nullptr), buf(sink)
+    {
+        rdbuf(&buf);
+    }
 };
 
 
@@ -124,12 +205,18 @@ struct FdSource : BufferedSource
     int fd;
     size_t read = 0;
 
-    FdSource() : fd(-1) { }
-    FdSource(int fd) : fd(fd) { }
+    FdSource() : BufferedSource(fdBufferSize), fd(-1) { }
+    FdSource(int fd, size_t bufSize = fdBufferSize) : BufferedSource(bufSize), fd(fd) { }
     FdSource(FdSource&&) = default;
 
     FdSource& operator=(FdSource && s)
     {
+        if (buffer) releaseBuffer(std::move(buffer), bufSize);
+        bufSize = s.bufSize;
+        buffer = std::move(s.buffer);
+        bufPosIn = s.bufPosIn;
+        bufPosOut = s.bufPosOut;
+        s.bufPosIn = s.bufPosOut = 0;
         fd = s.fd;
         s.fd = -1;
         read = s.read;
@@ -220,6 +307,19 @@ std::unique_ptr<Source> sinkToSource(
         throw EndOfFile("coroutine has finished");
     });
 
+/* Like sinkToSource(), but run the function in a separate thread,
+   passing data to the reader through a ring of reusable 64 KiB
+   chunks totalling `bufferSize' bytes. This allows the producer (e.g. a download and decompression)
+   and the consumer (e.g. unpacking into the store) to run in
+   parallel. Exceptions thrown by the function are rethrown by
+   read(). */
+std::unique_ptr<Source> sinkToSourceThreaded(
+    std::function<void(Sink &)> fun,
+    std::function<void()> eof = []() {
+        throw EndOfFile("producer thread has finished");
+    },
+    size_t bufferSize = 8 * 1024 * 1024);
+
 
 void writePadding(size_t len, Sink & sink);
 void writeString(const unsigned char * buf, size_t len, Sink & sink);
@@ -2,6 +2,7 @@
 
 #include <cstdlib>
 #include <mutex>
+#include <shared_mutex>
 #include <condition_variable>
 #include <cassert>
 
@@ -85,4 +86,63 @@ public:
     Lock lock() { return Lock(this); }
 };
 
+
+/* Like Sync, but for data that is mostly read: any number of threads
+   can hold a read lock, which only gives const access, while lock()
+   gives exclusive access as in Sync.
+
+     RWSync<Data> data;
+
+     {
+       auto data_(data.readLock());
+       if (data_->x == 123) ...
+     }
+*/
+
+template<class T>
+class RWSync
+{
+private:
+    std::shared_mutex mutex;
+    T data;
+
+public:
+
+    RWSync() { }
+    RWSync(const T & data) : data(data) { }
+    RWSync(T && data) noexcept : data(std::move(data)) { }
+
+    class ReadLock
+    {
+    private:
+        RWSync * s;
+        std::shared_lock<std::shared_mutex> lk;
+        friend RWSync;
+        ReadLock(RWSync * s) : s(s), lk(s->mutex) { }
+    public:
+        ReadLock(ReadLock && l) : s(l.s) { abort(); }
+        ReadLock(const ReadLock & l) = delete;
+        const T * operator -> () const { return &s->data; }
+        const T & operator * () const { return s->data; }
+    };
+
+    class Lock
+    {
+    private:
+        RWSync * s;
+        std::unique_lock<std::shared_mutex> lk;
+        friend RWSync;
+        Lock(RWSync * s) : s(s), lk(s->mutex) { }
+    public:
+        Lock(Lock && l) : s(l.s) { abort(); }
+        Lock(const Lock & l) = delete;
+        T * operator -> () { return &s->data; }
+        T & operator * () { return s->data; }
+    };
+
+    ReadLock readLock() { return ReadLock(this); }
+
+    Lock lock() { return Lock(this); }
+};
+
 }
@@ -0,0 +1,488 @@
+#include "tarfile.hh"
+#include "compression.hh"
+#include "archive.hh"
+#include "util.hh"
+
+#include <algorithm>
+#include <cstring>
+#include <map>
+#include <optional>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+
+struct TarEntry
+{
+    /* Relative path without `.' or empty components. */
+    Path name;
+    char type; // one of '0' (regular), '1' (hard link), '2' (symlink), '5' (directory)
+    bool executable = false;
+    uint64_t size = 0;
+    Path linkName;
+};
+
+
+/* The data of a tar entry. */
+struct TarEntrySource : Source
+{
+    Source & source;
+    uint64_t left;
+
+    TarEntrySource(Source & source, uint64_t size) : source(source), left(size) { }
+
+    size_t read(unsigned char * data, size_t len) override
+    {
+        if (!left) throw EndOfFile("end of tar entry");
+        auto n = (size_t) std::min((uint64_t) len, left);
+        source(data, n);
+        left -= n;
+        return n;
+    }
+
+    void drain()
+    {
+        unsigned char buf[65536];
+        while (left) read(buf, sizeof(buf));
+    }
+};
+
+
+static std::string tarField(const unsigned char * p, size_t len)
+{
+    return std::string((const char *) p, strnlen((const char *) p, len));
+}
+
+
+static uint64_t tarNumber(const unsigned char * p, size_t len)
+{
+    uint64_t n = 0;
+
+    /* GNU tar stores large numbers in base 256. */
+    if (p[0] & 0x80) {
+        n = p[0] & 0x7f;
+        for (size_t i = 1; i < len; ++i)
+            n = (n << 8) | p[i];
+        return n;
+    }
+
+    size_t i = 0;
+    while (i < len && (p[i] == ' ' || p[i] == 0)) ++i;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; ++i)
+        n = (n << 3) | (p[i] - '0');
+    return n;
+}
+
+
+static Path normaliseTarName(const std::string & name)
+{
+    Path res;
+    for (auto & c : tokenizeString<Strings>(name, "/")) {
+        if (c == ".") continue;
+        if (c == "..")
+            throw TarError("tar member '%s' contains '..'", name);
+        if (!res.empty()) res += '/';
+        res += c;
+    }
+    return res;
+}
+
+
+/* Parse the pax extended header records in `s'. */
+static void parsePaxHeader(const std::string & s, std::map<std::string, std::string> & pax)
+{
+    size_t pos = 0;
+    while (pos < s.size()) {
+        auto space = s.find(' ', pos);
+        size_t len;
+        if (space == std::string::npos || !string2Int(s.substr(pos, space - pos), len)
+            || len == 0 || pos + len > s.size() || s[pos + len - 1] != '\n')
+            throw TarError("invalid pax extended header");
+        auto record = s.substr(space + 1, pos + len - space - 2);
+        auto eq = record.find('=');
+        if (eq == std::string::npos)
+            throw TarError("invalid pax extended header");
+        pax[record.substr(0, eq)] = record.substr(eq + 1);
+        pos += len;
+    }
+}
+
+
+/* Call `handle' for each entry in the tar archive read from
+   `source'. */
+static void parseTar(Source & source, std::function<void(const TarEntry &, Source &)> handle)
+{
+    std::map<std::string, std::string> pax;
+    std::optional<std::string> longName, longLink;
+
+    try {
+        while (true) {
+            checkInterrupt();
+
+            unsigned char hdr[512];
+            try {
+                source(hdr, sizeof(hdr));
+            } catch (EndOfFile &) {
+                break;
+            }
+
+            /* The archive ends with zero blocks. */
+            if (std::all_of(hdr, hdr + sizeof(hdr), [](unsigned char c) { return c == 0; }))
+                break;
+
+            uint64_t sum = 0;
+            for (size_t i = 0; i < sizeof(hdr); ++i)
+                sum += i >= 148 && i < 156 ? ' ' : hdr[i];
+            if (sum != tarNumber(hdr + 148, 8))
+                throw TarError("tar header has an incorrect checksum");
+
+            char type = hdr[156];
+            uint64_t size = tarNumber(hdr + 124, 12);
+            auto padding = (512 - size % 512) % 512;
+
+            auto readData = [&]() {
+                std::string s(size, 0);
+                source((unsigned char *) s.data(), s.size());
+                TarEntrySource(source, padding).drain();
+                return tarField((const unsigned char *) s.data(), s.size());
+            };
+
+            if (type == 'L') { longName = readData(); continue; }
+            if (type == 'K') { longLink = readData(); continue; }
+            if (type == 'x') { parsePaxHeader(readData(), pax); continue; }
+            if (type == 'g') { readData(); continue; }
+
+            std::string name = tarField(hdr, 100);
+            if (memcmp(hdr + 257, "ustar", 5) == 0) {
+                auto prefix = tarField(hdr + 345, 155);
+                if (!prefix.empty()) name = prefix + "/" + name;
+            }
+            std::string linkName = tarField(hdr + 157, 100);
+
+            if (longName) name = *longName;
+            if (longLink) linkName = *longLink;
+            if (pax.count("path")) name = pax["path"];
+            if (pax.count("linkpath")) linkName = pax["linkpath"];
+            if (pax.count("size") && !string2Int(pax["size"], size))
+                throw TarError("invalid size in pax extended header");
+            padding = (512 - size % 512) % 512;
+
+            longName.reset();
+            longLink.reset();
+            pax.clear();
+
+            TarEntry entry;
+            entry.name = normaliseTarName(name);
+            entry.executable = tarNumber(hdr + 100, 8) & S_IXUSR;
+            entry.size = size;
+
+            if (type == 0 || type == '7') type = '0';
+            if (type == '0' && hasSuffix(name, "/")) type = '5';
+            if (type != '0' && type != '1' && type != '2' && type != '5')
+                throw TarError("tar member '%s' has unsupported type '%c'", name, type);
+            entry.type = type;
+
+            if (type == '1')
+                entry.linkName = normaliseTarName(linkName);
+            else if (type == '2')
+                entry.linkName = linkName;
+
+            TarEntrySource data(source, type == '0' ? size : 0);
+            handle(entry, data);
+            data.drain();
+
+            TarEntrySource(source, (type == '0' ? 0 : size) + padding).drain();
+        }
+    } catch (EndOfFile &) {
+        throw TarError("unexpected end of tar archive");
+    }
+}
+
+
+/* Return a source producing the decompressed contents of
+   `tarFile'. */
+static std::unique_ptr<Source> openTarfile(const Path & tarFile)
+{
+    std::string method = "none";
+    {
+        AutoCloseFD fd = open(tarFile.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) throw SysError("opening '%s'", tarFile);
+        unsigned char magic[6];
+        auto n = read(fd.get(), magic, sizeof(magic));
+        if (n == -1) throw SysError("reading '%s'", tarFile);
+        auto is = [&](const char * s, size_t len) {
+            return (size_t) n >= len && memcmp(magic, s, len) == 0;
+        };
+        if (is("\x1f\x8b", 2)) method = "gzip";
+        else if (is("\xfd" "7zXZ\0", 6)) method = "xz";
+        else if (is("BZh", 3)) method = "bzip2";
+        else if (is("\x28\xb5\x2f\xfd", 4)) method = "zstd";
+        else if (is("LZIP", 4)) method = "lzip";
+        else if (is("\x1f\x9d", 2)) method = "compress";
+    }
+
+    /* There is no library support for lzip and compress(1), so use
+       the external programs for these, like `tar' does. gzip can
+       decompress the latter. */
+    if (method == "lzip" || method == "compress")
+        return sinkToSourceThreaded([tarFile, method](Sink & sink) {
+            AutoCloseFD fd = open(tarFile.c_str(), O_RDONLY | O_CLOEXEC);
+            if (!fd) throw SysError("opening '%s'", tarFile);
+            FdSource source(fd.get());
+            RunOptions options(method == "lzip" ? "lzip" : "gzip", {"-d", "-c"});
+            options.standardIn = &source;
+            options.standardOut = &sink;
+            runProgram2(options);
+        });
+
+    return sinkToSourceThreaded([tarFile, method](Sink & sink) {
+        auto decompressor = makeDecompressionSink(method, sink);
+        readFile(tarFile, *decompressor);
+        decompressor->finish();
+    });
+}
+
+
+void unpackTarfile(const Path & tarFile, const Path & destDir)
+{
+    auto source = openTarfile(tarFile);
+
+    /* The type of each path created so far. Parents are only ever
+       directories created by us, so entries can't be written through
+       symlinks in the archive. */
+    std::map<Path, char> created;
+
+    auto makeParents = [&](const Path & name) {
+        for (size_t pos = 0; (pos = name.find('/', pos)) != std::string::npos; ++pos) {
+            auto dir = name.substr(0, pos);
+            auto i = created.find(dir);
+            if (i == created.end()) {
+                createDirs(destDir + "/" + dir);
+                created[dir] = '5';
+            } else if (i->second != '5')
+                throw TarError("tar member '%s' is inside non-directory '%s'", name, dir);
+        }
+    };
+
+    createDirs(destDir);
+    auto realDestDir = canonPath(destDir, true);
+
+    parseTar(*source, [&](const TarEntry & entry, Source & data) {
+        if (entry.name.empty()) return;
+
+        makeParents(entry.name);
+
+        auto path = destDir + "/" + entry.name;
+
+        auto i = created.find(entry.name);
+        if (i != created.end()) {
+            if (i->second == '5' && entry.type == '5') return;
+            deletePath(path);
+            /* Forget the contents of a replaced directory, i.e. the
+               entries starting with `name/' (and '0' follows '/'). */
+            created.erase(i);
+            created.erase(created.lower_bound(entry.name + "/"),
+                created.lower_bound(entry.name + "0"));
+        }
+
+        switch (entry.type) {
+
+        case '5':
+            if (mkdir(path.c_str(), 0755) == -1)
+                throw SysError("creating directory '%s'", path);
+            break;
+
+        case '0': {
+            AutoCloseFD fd = open(path.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC,
+                entry.executable ? 0755 : 0644);
+            if (!fd) throw SysError("creating file '%s'", path);
+            unsigned char buf[65536];
+            for (auto left = entry.size; left; ) {
+                auto n = (size_t) std::min((uint64_t) sizeof(buf), left);
+                data(buf, n);
+                writeFull(fd.get(), buf, n);
+                left -= n;
+            }
+            break;
+        }
+
+        case '1': {
+            auto j = created.find(entry.linkName);
+            if (j == created.end() || j->second != '0')
+                throw TarError("hard link '%s' refers to '%s', which is not a regular file in the archive",
+                    entry.name, entry.linkName);
+            /* Make sure that the target is still the file we created,
+               even if its parents were replaced in the meantime. */
+            auto target = destDir + "/" + entry.linkName;
+            auto targetDir = canonPath(dirOf(target), true);
+            if ((targetDir != realDestDir && !hasPrefix(targetDir, realDestDir + "/"))
+                || !S_ISREG(lstat(target).st_mode))
+                throw TarError("hard link '%s' refers to '%s', which is outside the archive",
+                    entry.name, entry.linkName);
+            if (link(target.c_str(), path.c_str()) == -1)
+                throw SysError("creating hard link from '%s' to '%s'", path, target);
+            break;
+        }
+
+        case '2':
+            createSymlink(entry.linkName, path);
+            break;
+        }
+
+        created[entry.name] = entry.type == '1' ? '0' : entry.type;
+    });
+}
+
+
+namespace {
+
+struct TarNode
+{
+    char type = '5';
+    bool executable = false;
+    /* The location of the contents of a regular file in the spool
+       file. */
+    uint64_t offset = 0, size = 0;
+    std::string target;
+    std::map<std::string, TarNode> entries;
+};
+
+}
+
+
+static void writeTarNode(const TarNode & node, int spoolFd, Sink & sink)
+{
+    sink << "(";
+
+    if (node.type == '0') {
+        sink << "type" << "regular";
+        if (node.executable)
+            sink << "executable" << "";
+        sink << "contents" << node.size;
+        unsigned char buf[65536];
+        for (uint64_t done = 0; done < node.size; ) {
+            checkInterrupt();
+            auto n = pread(spoolFd, buf, std::min((uint64_t) sizeof(buf), node.size - done),
+                node.offset + done);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading tar spool file");
+            }
+            if (n == 0) throw EndOfFile("unexpected end of tar spool file");
+            sink(buf, n);
+            done += n;
+        }
+        writePadding(node.size, sink);
+    }
+
+    else if (node.type == '5') {
+        sink << "type" << "directory";
+        for (auto & i : node.entries) {
+            sink << "entry" << "(" << "name" << i.first << "node";
+            writeTarNode(i.second, spoolFd, sink);
+            sink << ")";
+        }
+    }
+
+    else
+        sink << "type" << "symlink" << "target" << node.target;
+
+    sink << ")";
+}
+
+
+void tarToNar(const Path & tarFile, Sink & sink, TarRoot root)
+{
+    auto source = openTarfile(tarFile);
+
+    /* Only the tree is kept in memory. The contents of the regular
+       files are spooled to a temporary file, and copied from there
+       into the NAR once the tree is complete. */
+    AutoDelete tmpDir(createTempDir(), true);
+    Path spoolPath = (Path) tmpDir + "/contents";
+    AutoCloseFD spool = open(spoolPath.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0600);
+    if (!spool) throw SysError("creating '%s'", spoolPath);
+    uint64_t spoolSize = 0;
+
+    TarNode top;
+
+    auto stripName = [&](const Path & name) -> Path {
+        if (root != tarStripTopDirs) return name;
+        auto slash = name.find('/');
+        return slash == std::string::npos ? "" : std::string(name, slash + 1);
+    };
+
+    auto findNode = [&](const Path & name, bool create) -> TarNode * {
+        TarNode * node = &top;
+        for (auto & c : tokenizeString<Strings>(name, "/")) {
+            if (node->type != '5')
+                throw TarError("tar member '%s' is inside a non-directory", name);
+            auto i = node->entries.find(c);
+            if (i == node->entries.end()) {
+                if (!create) return nullptr;
+                i = node->entries.emplace(c, TarNode()).first;
+            }
+            node = &i->second;
+        }
+        return node;
+    };
+
+    parseTar(*source, [&](const TarEntry & entry, Source & data) {
+        auto name = stripName(entry.name);
+        if (name.empty()) return;
+
+        auto existing = findNode(name, false);
+        auto & node(*findNode(name, true));
+
+        if (entry.type == '5') {
+            if (!existing || node.type != '5') node = TarNode();
+            return;
+        }
+
+        node = TarNode();
+
+        if (entry.type == '0') {
+            node.type = '0';
+            node.executable = entry.executable;
+            node.offset = spoolSize;
+            node.size = entry.size;
+            unsigned char buf[65536];
+            for (auto left = entry.size; left; ) {
+                auto n = (size_t) std::min((uint64_t) sizeof(buf), left);
+                data(buf, n);
+                writeFull(spool.get(), buf, n);
+                left -= n;
+            }
+            spoolSize += entry.size;
+        }
+
+        else if (entry.type == '1') {
+            auto target = findNode(stripName(entry.linkName), false);
+            if (!target || target->type != '0')
+                throw TarError("hard link '%s' refers to '%s', which is not a regular file in the archive",
+                    entry.name, entry.linkName);
+            node.type = '0';
+            node.executable = target->executable;
+            node.offset = target->offset;
+            node.size = target->size;
+        }
+
+        else {
+            node.type = '2';
+            node.target = entry.linkName;
+        }
+    });
+
+    sink << narVersionMagic1;
+
+    if (root == tarSingleEntry && top.entries.size() == 1)
+        writeTarNode(top.entries.begin()->second, spool.get(), sink);
+    else
+        writeTarNode(top, spool.get(), sink);
+}
+
+
+}
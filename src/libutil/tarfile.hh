@@ -0,0 +1,32 @@
+#pragma once
+
+#include "serialise.hh"
+
+namespace nix {
+
+/* What to use as the root of the NAR produced by tarToNar(). */
+typedef enum {
+    /* The merged contents of the top-level directories, like `tar
+       --strip-components 1'. */
+    tarStripTopDirs,
+    /* The top-level entry if there is only one, otherwise a directory
+       containing all of them. */
+    tarSingleEntry,
+} TarRoot;
+
+/* Unpack the tar archive `tarFile' into the directory `destDir'. The
+   archive may be compressed with any method supported by
+   makeDecompressionSink(), or with lzip or compress(1) if the
+   corresponding programs are in $PATH; this is detected from its
+   contents. */
+void unpackTarfile(const Path & tarFile, const Path & destDir);
+
+/* Convert the tar archive `tarFile' directly into a NAR, without
+   unpacking it on disk first. Since NARs require the entries of a
+   directory to be sorted, the directory tree is kept in memory and
+   the contents of the files are spooled to a temporary file. */
+void tarToNar(const Path & tarFile, Sink & sink, TarRoot root);
+
+MakeError(TarError, Error);
+
+}
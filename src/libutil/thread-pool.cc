@@ -3,6 +3,11 @@
 
 namespace nix {
 
+/* The pool for which the current thread is a worker, and the index of
+   its queue. */
+static thread_local const ThreadPool * curPool = nullptr;
+static thread_local size_t curSlot = 0;
+
 ThreadPool::ThreadPool(size_t _maxThreads)
     : maxThreads(_maxThreads)
 {
@@ -13,6 +18,9 @@ ThreadPool::ThreadPool(size_t _maxThreads)
         if (!maxThreads) maxThreads = 1;
     }
 
+    for (size_t i = 0; i < maxThreads; ++i)
+        queues.push_back(std::make_unique<Queue>());
+
     debug("starting pool of %d threads", maxThreads - 1);
 }
 
@@ -34,31 +42,91 @@ void ThreadPool::shutdown()
 
     debug("reaping %d worker threads", workers.size());
 
-    work.notify_all();
+    wakeUp(true);
 
     for (auto & thr : workers)
         thr.join();
 }
 
-void ThreadPool::enqueue(const work_t & t)
+void ThreadPool::wakeUp(bool all)
+{
+    /* Taking the lock ensures that a thread that has just found
+       nothing to do is either already waiting or will see the
+       change. */
+    {
+        std::lock_guard<std::mutex> lock(idle);
+    }
+    if (all) work.notify_all(); else work.notify_one();
+}
+
+void ThreadPool::enqueue(const work_t & t, int priority)
 {
-    auto state(state_.lock());
     if (quit)
         throw ThreadPoolShutDown("cannot enqueue a work item while the thread pool is shutting down");
-    state->pending.push(t);
+
+    auto & queue(*queues[curPool == this ? curSlot : 0]);
+    {
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.items.push(Item{priority, nextSeq++, t});
+        pending++;
+    }
+
     /* Note: process() also executes items, so count it as a worker. */
-    if (state->pending.size() > state->workers.size() + 1 && state->workers.size() + 1 < maxThreads)
-        state->workers.emplace_back(&ThreadPool::doWork, this, false);
-    work.notify_one();
+    if (pending > nrWorkers + 1 && nrWorkers + 1 < maxThreads) {
+        auto state(state_.lock());
+        if (!quit && pending > nrWorkers + 1 && nrWorkers + 1 < maxThreads) {
+            state->workers.emplace_back(&ThreadPool::doWork, this, state->workers.size() + 1);
+            nrWorkers++;
+        }
+    }
+
+    wakeUp(false);
+}
+
+bool ThreadPool::dequeue(size_t slot, work_t & w)
+{
+    auto pop = [&](Queue & queue, std::optional<int> minPriority) {
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.items.empty()) return false;
+        if (minPriority && queue.items.top().priority < *minPriority) return false;
+        w = queue.items.top().work;
+        queue.items.pop();
+        pending--;
+        return true;
+    };
+
+    /* Take from our own queue, unless the shared queue has something
+       more important. */
+    if (slot) {
+        std::optional<int> sharedPriority;
+        {
+            auto & shared(*queues[0]);
+            std::lock_guard<std::mutex> lock(shared.lock);
+            if (!shared.items.empty())
+                sharedPriority = shared.items.top().priority + 1;
+        }
+        if (pop(*queues[slot], sharedPriority)) return true;
+    }
+
+    if (pop(*queues[0], {})) return true;
+
+    /* Steal from the other workers. */
+    size_t n = nrWorkers + 1;
+    for (size_t i = 1; i < n; ++i) {
+        auto victim = (slot + i) % n;
+        if (victim && pop(*queues[victim], {})) return true;
+    }
+
+    return slot && pop(*queues[slot], {});
 }
 
 void ThreadPool::process()
 {
-    state_.lock()->draining = true;
+    draining = true;
 
     /* Do work until no more work is pending or active. */
     try {
-        doWork(true);
+        doWork(0);
 
         auto state(state_.lock());
 
@@ -78,79 +146,71 @@ void ThreadPool::process()
     }
 }
 
-void ThreadPool::doWork(bool mainThread)
+void ThreadPool::doWork(size_t slot)
 {
-    if (!mainThread)
+    /* Slot 0 is the thread running process(). */
+    if (slot) {
         interruptCheck = [&]() { return (bool) quit; };
-
-    bool didWork = false;
-    std::exception_ptr exc;
+        curPool = this;
+        curSlot = slot;
+    }
 
     while (true) {
-        work_t w;
-        {
-            auto state(state_.lock());
-
-            if (didWork) {
-                assert(state->active);
-                state->active--;
-
-                if (exc) {
-
-                    if (!state->exception) {
-                        state->exception = exc;
-                        // Tell the other workers to quit.
-                        quit = true;
-                        work.notify_all();
-                    } else {
-                        /* Print the exception, since we can't
-                           propagate it. */
-                        try {
-                            std::rethrow_exception(exc);
-                        } catch (std::exception & e) {
-                            if (!dynamic_cast<Interrupted*>(&e) &&
-                                !dynamic_cast<ThreadPoolShutDown*>(&e))
-                                ignoreException();
-                        } catch (...) {
-                        }
-                    }
-                }
-            }
-
-            /* Wait until a work item is available or we're asked to
-               quit. */
-            while (true) {
-                if (quit) return;
+        if (quit) return;
 
-                if (!state->pending.empty()) break;
+        work_t w;
 
-                /* If there are no active or pending items, and the
-                   main thread is running process(), then no new items
-                   can be added. So exit. */
-                if (!state->active && state->draining) {
+        /* Count ourselves as active before taking an item, so that
+           nobody concludes that we're done while we hold an item that
+           may enqueue more. */
+        active++;
+
+        bool didWork = dequeue(slot, w);
+
+        if (didWork) {
+            try {
+                w();
+            } catch (...) {
+                auto exc = std::current_exception();
+                auto state(state_.lock());
+                if (!state->exception) {
+                    state->exception = exc;
+                    // Tell the other workers to quit.
                     quit = true;
-                    work.notify_all();
-                    return;
+                    wakeUp(true);
+                } else {
+                    /* Print the exception, since we can't
+                       propagate it. */
+                    try {
+                        std::rethrow_exception(exc);
+                    } catch (std::exception & e) {
+                        if (!dynamic_cast<Interrupted*>(&e) &&
+                            !dynamic_cast<ThreadPoolShutDown*>(&e))
+                            ignoreException();
+                    } catch (...) {
+                    }
                 }
-
-                state.wait(work);
             }
-
-            w = std::move(state->pending.front());
-            state->pending.pop();
-            state->active++;
+            w = nullptr;
         }
 
-        try {
-            w();
-        } catch (...) {
-            exc = std::current_exception();
+        /* If there are no active or pending items, and the main
+           thread is running process(), then no new items can be
+           added. So exit. */
+        if (--active == 0 && !pending && draining) {
+            quit = true;
+            wakeUp(true);
+            return;
         }
 
-        didWork = true;
+        if (didWork) continue;
+
+        /* Wait until a work item is available or we're asked to
+           quit. */
+        std::unique_lock<std::mutex> lock(idle);
+        while (!quit && !pending && !(draining && !active))
+            work.wait(lock);
     }
 }
 
 }
-
-
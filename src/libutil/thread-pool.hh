@@ -8,13 +8,20 @@
 #include <thread>
 #include <map>
 #include <atomic>
+#include <mutex>
+#include <memory>
 
 namespace nix {
 
 MakeError(ThreadPoolShutDown, Error)
 
-/* A simple thread pool that executes a queue of work items
-   (lambdas). */
+/* A thread pool that executes work items (lambdas). Each worker has
+   its own queue, to which the items it enqueues are added; items
+   enqueued by other threads go to a shared queue. Idle workers take
+   work from the shared queue and then steal from the other
+   workers. Within a queue, items with a higher priority run first,
+   and items with equal priority run in the order in which they were
+   enqueued. */
 class ThreadPool
 {
 public:
@@ -27,7 +34,7 @@ public:
     typedef std::function<void()> work_t;
 
     /* Enqueue a function to be executed by the thread pool. */
-    void enqueue(const work_t & t);
+    void enqueue(const work_t & t, int priority = 0);
 
     /* Execute work items until the queue is empty. Note that work
        items are allowed to add new items to the queue; this is
@@ -38,33 +45,72 @@ public:
        printed on stderr and otherwise ignored. */
     void process();
 
+    size_t getMaxThreads() const { return maxThreads; }
+
 private:
 
     size_t maxThreads;
 
+    struct Item
+    {
+        int priority;
+        uint64_t seq;
+        work_t work;
+
+        bool operator < (const Item & other) const
+        {
+            return priority != other.priority
+                ? priority < other.priority
+                : seq > other.seq;
+        }
+    };
+
+    /* Queue 0 is the shared queue; queue i > 0 belongs to the i'th
+       worker. */
+    struct Queue
+    {
+        std::mutex lock;
+        std::priority_queue<Item> items;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+
     struct State
     {
-        std::queue<work_t> pending;
-        size_t active = 0;
         std::exception_ptr exception;
         std::vector<std::thread> workers;
-        bool draining = false;
     };
 
     std::atomic_bool quit{false};
+    std::atomic_bool draining{false};
+
+    /* The number of queued items, and of threads that are running or
+       about to run an item. */
+    std::atomic<size_t> pending{0}, active{0};
+
+    std::atomic<size_t> nrWorkers{0};
+
+    std::atomic<uint64_t> nextSeq{0};
 
     Sync<State> state_;
 
+    /* Idle threads wait on `work' while holding `idle'. */
+    std::mutex idle;
     std::condition_variable work;
 
-    void doWork(bool mainThread);
+    void wakeUp(bool all);
+
+    bool dequeue(size_t slot, work_t & w);
+
+    void doWork(size_t slot);
 
     void shutdown();
 };
 
 /* Process in parallel a set of items of type T that have a partial
    ordering between them. Thus, any item is only processed after all
-   its dependencies have been processed. */
+   its dependencies have been processed. Of the items that are ready,
+   those with the most dependents go first. */
 template<typename T>
 void processGraph(
     ThreadPool & pool,
@@ -122,8 +168,9 @@ void processGraph(
                 auto i = refs.find(node);
                 assert(i != refs.end());
                 refs.erase(i);
+                /* Prefer nodes that other nodes are waiting on. */
                 if (refs.empty())
-                    pool.enqueue(std::bind(worker, rref));
+                    pool.enqueue(std::bind(worker, rref), graph->rrefs[rref].size());
             }
             graph->left.erase(node);
             graph->refs.erase(node);
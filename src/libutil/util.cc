@@ -4,6 +4,7 @@
 #include "sync.hh"
 #include "finally.hh"
 #include "serialise.hh"
+#include "thread-pool.hh"
 
 #include <cctype>
 #include <cerrno>
@@ -29,7 +30,9 @@
 #endif
 
 #ifdef __linux__
+#include <sched.h>
 #include <sys/prctl.h>
+#include <sys/syscall.h>
 #endif
 
 
@@ -232,12 +235,18 @@ bool pathExists(const Path & path)
 
 
 Path readLink(const Path & path)
+{
+    return readLinkAt(AT_FDCWD, path, path);
+}
+
+
+Path readLinkAt(int dirFd, const Path & name, const Path & path)
 {
     checkInterrupt();
     std::vector<char> buf;
     for (ssize_t bufSize = PATH_MAX/4; true; bufSize += bufSize/2) {
         buf.resize(bufSize);
-        ssize_t rlSize = readlink(path.c_str(), buf.data(), bufSize);
+        ssize_t rlSize = readlinkat(dirFd, name.c_str(), buf.data(), bufSize);
         if (rlSize == -1)
             if (errno == EINVAL)
                 throw Error("'%1%' is not a symlink", path);
@@ -256,16 +265,13 @@ bool isLink(const Path & path)
 }
 
 
-DirEntries readDirectory(const Path & path)
+static DirEntries readDirectory(DIR * dir, const Path & path)
 {
     DirEntries entries;
     entries.reserve(64);
 
-    AutoCloseDir dir(opendir(path.c_str()));
-    if (!dir) throw SysError(format("opening directory '%1%'") % path);
-
     struct dirent * dirent;
-    while (errno = 0, dirent = readdir(dir.get())) { /* sic */
+    while (errno = 0, dirent = readdir(dir)) { /* sic */
         checkInterrupt();
         string name = dirent->d_name;
         if (name == "." || name == "..") continue;
@@ -283,6 +289,29 @@ DirEntries readDirectory(const Path & path)
 }
 
 
+DirEntries readDirectory(const Path & path)
+{
+    AutoCloseDir dir(opendir(path.c_str()));
+    if (!dir) throw SysError(format("opening directory '%1%'") % path);
+    return readDirectory(dir.get(), path);
+}
+
+
+DirEntries readDirectory(int dirFd, const Path & path)
+{
+    /* fdopendir() takes ownership of the file descriptor. */
+    int fd2 = dup(dirFd);
+    if (fd2 == -1) throw SysError("duplicating file descriptor");
+    AutoCloseDir dir(fdopendir(fd2));
+    if (!dir) {
+        SysError e(format("opening directory '%1%'") % path);
+        close(fd2);
+        throw e;
+    }
+    return readDirectory(dir.get(), path);
+}
+
+
 unsigned char getFileType(const Path & path)
 {
     struct stat st = lstat(path);
@@ -377,42 +406,58 @@ void writeLine(int fd, string s)
 }
 
 
-static void _deletePath(const Path & path, unsigned long long & bytesFreed)
+/* Delete `name' in the directory `dirFd'. `parent' is the path of
+   that directory, used for error messages. If `bytesFreed' is null,
+   files whose type is known from the directory entry are removed
+   without being stat'ed. */
+static void _deletePath(int dirFd, const Path & parent, const Path & name,
+    unsigned char type, unsigned long long * bytesFreed)
 {
     checkInterrupt();
 
+    auto path = [&]() { return parent.empty() ? name : parent + "/" + name; };
+
     struct stat st;
-    if (lstat(path.c_str(), &st) == -1) {
-        if (errno == ENOENT) return;
-        throw SysError(format("getting status of '%1%'") % path);
-    }
+    if (bytesFreed || type == DT_DIR || type == DT_UNKNOWN) {
+        if (fstatat(dirFd, name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            if (errno == ENOENT) return;
+            throw SysError(format("getting status of '%1%'") % path());
+        }
+    } else
+        st.st_mode = 0;
 
-    if (!S_ISDIR(st.st_mode) && st.st_nlink == 1)
-        bytesFreed += st.st_blocks * 512;
+    if (bytesFreed && !S_ISDIR(st.st_mode) && st.st_nlink == 1)
+        *bytesFreed += st.st_blocks * 512;
 
     if (S_ISDIR(st.st_mode)) {
         /* Make the directory accessible. */
         const auto PERM_MASK = S_IRUSR | S_IWUSR | S_IXUSR;
         if ((st.st_mode & PERM_MASK) != PERM_MASK) {
-            if (chmod(path.c_str(), st.st_mode | PERM_MASK) == -1)
-                throw SysError(format("chmod '%1%'") % path);
+            if (fchmodat(dirFd, name.c_str(), st.st_mode | PERM_MASK, 0) == -1)
+                throw SysError(format("chmod '%1%'") % path());
+        }
+
+        AutoCloseFD fd = openat(dirFd, name.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT) return;
+            throw SysError(format("opening directory '%1%'") % path());
         }
 
-        for (auto & i : readDirectory(path))
-            _deletePath(path + "/" + i.name, bytesFreed);
+        auto dirPath = path();
+        for (auto & i : readDirectory(fd.get(), dirPath))
+            _deletePath(fd.get(), dirPath, i.name, i.type, bytesFreed);
     }
 
-    if (remove(path.c_str()) == -1) {
+    if (unlinkat(dirFd, name.c_str(), S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) == -1) {
         if (errno == ENOENT) return;
-        throw SysError(format("cannot unlink '%1%'") % path);
+        throw SysError(format("cannot unlink '%1%'") % path());
     }
 }
 
 
 void deletePath(const Path & path)
 {
-    unsigned long long dummy;
-    deletePath(path, dummy);
+    _deletePath(AT_FDCWD, "", path, DT_UNKNOWN, nullptr);
 }
 
 
@@ -420,7 +465,91 @@ void deletePath(const Path & path, unsigned long long & bytesFreed)
 {
     //Activity act(*logger, lvlDebug, format("recursively deleting path '%1%'") % path);
     bytesFreed = 0;
-    _deletePath(path, bytesFreed);
+    _deletePath(AT_FDCWD, "", path, DT_UNKNOWN, &bytesFreed);
+}
+
+
+void deletePathParallel(const Path & path)
+{
+    /* Each directory is removed by whoever finishes the last of its
+       subdirectories. Directories are not kept open while waiting
+       for that, to avoid running out of file descriptors on large
+       trees. */
+    struct Dir
+    {
+        std::shared_ptr<Dir> parent;
+        Path path;
+        std::atomic<size_t> pending{1};
+    };
+
+    ThreadPool pool;
+
+    std::function<void(std::shared_ptr<Dir>)> release = [&](std::shared_ptr<Dir> dir) {
+        if (--dir->pending) return;
+        if (rmdir(dir->path.c_str()) == -1 && errno != ENOENT)
+            throw SysError(format("cannot unlink '%1%'") % dir->path);
+        if (dir->parent) release(dir->parent);
+    };
+
+    std::function<void(std::shared_ptr<Dir>)> process = [&](std::shared_ptr<Dir> dir) {
+        checkInterrupt();
+
+        AutoCloseFD fd = open(dir->path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (!fd) {
+            if (errno != ENOENT)
+                throw SysError(format("opening directory '%1%'") % dir->path);
+        } else
+            for (auto & i : readDirectory(fd.get(), dir->path)) {
+                auto type = i.type;
+                struct stat st;
+                if (type == DT_UNKNOWN) {
+                    if (fstatat(fd.get(), i.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                        if (errno == ENOENT) continue;
+                        throw SysError(format("getting status of '%1%'") % (dir->path + "/" + i.name));
+                    }
+                    if (S_ISDIR(st.st_mode)) type = DT_DIR;
+                }
+                if (type != DT_DIR) {
+                    _deletePath(fd.get(), dir->path, i.name, type, nullptr);
+                    continue;
+                }
+                if (fstatat(fd.get(), i.name.c_str(), &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                    if (errno == ENOENT) continue;
+                    throw SysError(format("getting status of '%1%'") % (dir->path + "/" + i.name));
+                }
+                const auto PERM_MASK = S_IRUSR | S_IWUSR | S_IXUSR;
+                if ((st.st_mode & PERM_MASK) != PERM_MASK
+                    && fchmodat(fd.get(), i.name.c_str(), st.st_mode | PERM_MASK, 0) == -1)
+                    throw SysError(format("chmod '%1%'") % (dir->path + "/" + i.name));
+                auto child = std::make_shared<Dir>();
+                child->parent = dir;
+                child->path = dir->path + "/" + i.name;
+                dir->pending++;
+                pool.enqueue(std::bind(process, child));
+            }
+
+        release(dir);
+    };
+
+    struct stat st;
+    if (lstat(path.c_str(), &st) == -1) {
+        if (errno == ENOENT) return;
+        throw SysError(format("getting status of '%1%'") % path);
+    }
+
+    if (!S_ISDIR(st.st_mode)) {
+        deletePath(path);
+        return;
+    }
+
+    const auto PERM_MASK = S_IRUSR | S_IWUSR | S_IXUSR;
+    if ((st.st_mode & PERM_MASK) != PERM_MASK && chmod(path.c_str(), st.st_mode | PERM_MASK) == -1)
+        throw SysError(format("chmod '%1%'") % path);
+
+    auto root = std::make_shared<Dir>();
+    root->path = path;
+    pool.enqueue(std::bind(process, root));
+    pool.process();
 }
 
 
@@ -1000,30 +1129,134 @@ std::pair<int, std::string> runProgram(const RunOptions & options_)
     return {status, std::move(*sink.s)};
 }
 
-void runProgram2(const RunOptions & options)
+static sigset_t savedSignalMask;
+
+
+#if __linux__
+
+/* State shared between runProgram2() and the child created by
+   cloneHelper(). Since the child runs in the address space of the
+   parent until it calls exec, it can only do system calls; errors are
+   reported back through `err' and `what', and the child exits with
+   status 1. */
+struct SpawnArgs
+{
+    const RunOptions & options;
+    char * * argv;
+    int stdoutFd, stdinFd;
+    int err = 0;
+    const char * what = nullptr;
+};
+
+static int spawnChild(void * arg)
 {
-    checkInterrupt();
+    auto & a = *(SpawnArgs *) arg;
+    auto & options = a.options;
 
-    assert(!(options.standardIn && options.input));
+    auto fail = [&](const char * what) {
+        a.err = errno;
+        a.what = what;
+        _exit(1);
+    };
 
-    std::unique_ptr<Source> source_;
-    Source * source = options.standardIn;
+    if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+        fail("setting death signal");
+
+    if (a.stdoutFd != -1 && dup2(a.stdoutFd, STDOUT_FILENO) == -1)
+        fail("dupping stdout");
+    if (a.stdinFd != -1 && dup2(a.stdinFd, STDIN_FILENO) == -1)
+        fail("dupping stdin");
+
+    if (options.chdir && chdir(options.chdir->c_str()) == -1)
+        fail("chdir failed");
+    /* The libc wrappers of these change the credentials of all
+       threads of the process, i.e. of the parent's threads, so use
+       the system calls, which only affect the child. */
+    if (options.gid && syscall(SYS_setresgid, *options.gid, *options.gid, *options.gid) == -1)
+        fail("setgid failed");
+    /* Drop all other groups if we're setgid. */
+    if (options.gid && syscall(SYS_setgroups, 0, nullptr) == -1)
+        fail("setgroups failed");
+    if (options.uid && syscall(SYS_setresuid, *options.uid, *options.uid, *options.uid) == -1)
+        fail("setuid failed");
+
+    if (sigprocmask(SIG_SETMASK, &savedSignalMask, nullptr) == -1)
+        fail("restoring signals");
+
+    if (options.searchPath)
+        execvp(a.argv[0], a.argv);
+    else
+        execv(a.argv[0], a.argv);
 
-    if (options.input) {
-        source_ = std::make_unique<StringSource>(*options.input);
-        source = source_.get();
+    fail("executing");
+    return 1;
+}
+
+
+/* Start a helper program with clone(CLONE_VM | CLONE_VFORK), like
+   posix_spawn() does, so that the cost doesn't depend on the size of
+   our address space: the child shares our memory and we're suspended
+   until it has called exec. All the work after the clone is done with
+   plain system calls, so nothing in the child touches locks that
+   other threads of the parent may hold. */
+static pid_t cloneHelper(const RunOptions & options, std::vector<char *> & argv,
+    int stdoutFd, int stdinFd)
+{
+    SpawnArgs args{options, argv.data(), stdoutFd, stdinFd};
+
+    std::vector<char> stack(64 * 1024);
+
+    /* Block all signals while the child shares our memory, so that
+       no signal handler runs on its stack. */
+    sigset_t all, old;
+    sigfillset(&all);
+    if (pthread_sigmask(SIG_SETMASK, &all, &old))
+        throw SysError("blocking signals");
+
+    pid_t pid = clone(spawnChild, stack.data() + stack.size(),
+        CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    int cloneErr = errno;
+
+    pthread_sigmask(SIG_SETMASK, &old, nullptr);
+
+    if (pid == -1) {
+        errno = cloneErr;
+        throw SysError("unable to fork");
     }
 
-    /* Create a pipe. */
-    Pipe out, in;
-    if (options.standardOut) out.create();
-    if (source) in.create();
+    /* If the child failed, it has exited with status 1. Print the
+       error it would have printed itself with startProcess(). */
+    if (args.what) {
+        errno = args.err;
+        try {
+            std::cerr << "error: " << (strcmp(args.what, "executing") == 0
+                ? SysError("executing '%1%'", options.program)
+                : SysError(args.what)).what() << "\n";
+        } catch (...) { }
+    }
 
-    /* Fork. */
-    Pid pid = startProcess([&]() {
-        if (options.standardOut && dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+    return pid;
+}
+
+#endif
+
+
+/* Start a helper program for runProgram2(). On Linux, this uses
+   cloneHelper(), unless the CPU affinity has to be restored, which
+   the child can't do since it may log an error. Otherwise it falls
+   back to startProcess(). */
+static pid_t spawnHelper(const RunOptions & options, std::vector<char *> & argv,
+    int stdoutFd, int stdinFd)
+{
+#if __linux__
+    if (!affinityLocked())
+        return cloneHelper(options, argv, stdoutFd, stdinFd);
+#endif
+
+    return startProcess([&]() {
+        if (stdoutFd != -1 && dup2(stdoutFd, STDOUT_FILENO) == -1)
             throw SysError("dupping stdout");
-        if (source && dup2(in.readSide.get(), STDIN_FILENO) == -1)
+        if (stdinFd != -1 && dup2(stdinFd, STDIN_FILENO) == -1)
             throw SysError("dupping stdin");
 
         if (options.chdir && chdir((*options.chdir).c_str()) == -1)
@@ -1036,18 +1269,50 @@ void runProgram2(const RunOptions & options)
         if (options.uid && setuid(*options.uid) == -1)
             throw SysError("setuid failed");
 
-        Strings args_(options.args);
-        args_.push_front(options.program);
-
         restoreSignals();
 
         if (options.searchPath)
-            execvp(options.program.c_str(), stringsToCharPtrs(args_).data());
+            execvp(argv[0], argv.data());
         else
-            execv(options.program.c_str(), stringsToCharPtrs(args_).data());
+            execv(argv[0], argv.data());
 
         throw SysError("executing '%1%'", options.program);
     });
+}
+
+
+void runProgram2(const RunOptions & options)
+{
+    checkInterrupt();
+
+    assert(!(options.standardIn && options.input));
+
+    std::unique_ptr<Source> source_;
+    Source * source = options.standardIn;
+
+    if (options.input) {
+        source_ = std::make_unique<StringSource>(*options.input);
+        source = source_.get();
+    }
+
+    /* Create a pipe. */
+    Pipe out, in;
+    if (options.standardOut) out.create();
+    if (source) in.create();
+
+    Strings args_(options.args);
+    args_.push_front(options.program);
+    auto argv = stringsToCharPtrs(args_);
+
+    /* Fork. */
+    auto before = std::chrono::steady_clock::now();
+
+    Pid pid = spawnHelper(options, argv,
+        options.standardOut ? out.writeSide.get() : -1,
+        source ? in.readSide.get() : -1);
+
+    debug("started '%s' (pid %d) in %.3f ms", options.program, (pid_t) pid,
+        std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - before).count());
 
     out.writeSide = -1;
 
@@ -1468,7 +1733,6 @@ void triggerInterrupt()
     }
 }
 
-static sigset_t savedSignalMask;
 
 void startSignalHandlerThread()
 {
@@ -16,6 +16,7 @@
 #include <sstream>
 #include <optional>
 #include <future>
+#include <atomic>
 
 #ifndef HAVE_STRUCT_DIRENT_D_TYPE
 #define DT_UNKNOWN 0
@@ -97,6 +98,14 @@ typedef vector<DirEntry> DirEntries;
 
 DirEntries readDirectory(const Path & path);
 
+/* Read the contents of the directory open as `dirFd' (which remains
+   open). `path' is only used in error messages. */
+DirEntries readDirectory(int dirFd, const Path & path);
+
+/* Like readLink(), but for `name' relative to the directory open as
+   `dirFd'. */
+Path readLinkAt(int dirFd, const Path & name, const Path & path);
+
 unsigned char getFileType(const Path & path);
 
 /* Read the contents of a file into a string. */
@@ -122,6 +131,10 @@ void deletePath(const Path & path);
 
 void deletePath(const Path & path, unsigned long long & bytesFreed);
 
+/* Like deletePath(), but delete the contents of directories on
+   multiple threads. */
+void deletePathParallel(const Path & path);
+
 /* Create a temporary directory. */
 Path createTempDir(const Path & tmpRoot = "", const Path & prefix = "nix",
     bool includePid = true, bool useGlobalCounter = true, mode_t mode = 0755);
@@ -512,6 +525,22 @@ struct MaintainCount
 };
 
 
+/* A statistics counter that may be updated by several threads at
+   once. Nothing is synchronised through it, so its updates use relaxed
+   memory order, which on most platforms is as cheap as a plain
+   increment. */
+struct Counter
+{
+    std::atomic<uint64_t> n{0};
+
+    Counter & operator ++ () { n.fetch_add(1, std::memory_order_relaxed); return *this; }
+    void operator ++ (int) { n.fetch_add(1, std::memory_order_relaxed); }
+    Counter & operator += (uint64_t delta) { n.fetch_add(delta, std::memory_order_relaxed); return *this; }
+    uint64_t load() const { return n.load(std::memory_order_relaxed); }
+    operator uint64_t() const { return load(); }
+};
+
+
 /* Return the number of rows and columns of the terminal. */
 std::pair<unsigned short, unsigned short> getWindowSize();
 
@@ -9,7 +9,7 @@ namespace nix {
 XMLWriter::XMLWriter(bool indent, std::ostream & output)
     : output(output), indent(indent)
 {
-    output << "<?xml version='1.0' encoding='utf-8'?>" << std::endl;
+    output << "<?xml version='1.0' encoding='utf-8'?>\n";
     closed = false;
 }
 
@@ -31,7 +31,7 @@ void XMLWriter::close()
 void XMLWriter::indent_(size_t depth)
 {
     if (!indent) return;
-    output << string(depth * 2, ' ');
+    for (size_t n = 0; n < depth; ++n) output.write("  ", 2);
 }
 
 
@@ -43,7 +43,7 @@ void XMLWriter::openElement(const string & name,
     output << "<" << name;
     writeAttrs(attrs);
     output << ">";
-    if (indent) output << std::endl;
+    if (indent) output << '\n';
     pendingElems.push_back(name);
 }
 
@@ -53,7 +53,7 @@ void XMLWriter::closeElement()
     assert(!pendingElems.empty());
     indent_(pendingElems.size() - 1);
     output << "</" << pendingElems.back() << ">";
-    if (indent) output << std::endl;
+    if (indent) output << '\n';
     pendingElems.pop_back();
     if (pendingElems.empty()) closed = true;
 }
@@ -67,7 +67,7 @@ void XMLWriter::writeEmptyElement(const string & name,
     output << "<" << name;
     writeAttrs(attrs);
     output << " />";
-    if (indent) output << std::endl;
+    if (indent) output << '\n';
 }
 
 
@@ -75,17 +75,27 @@ void XMLWriter::writeAttrs(const XMLAttrs & attrs)
 {
     for (auto & i : attrs) {
         output << " " << i.first << "=\"";
-        for (size_t j = 0; j < i.second.size(); ++j) {
-            char c = i.second[j];
-            if (c == '"') output << "&quot;";
-            else if (c == '<') output << "&lt;";
-            else if (c == '>') output << "&gt;";
-            else if (c == '&') output << "&amp;";
-            /* Escape newlines to prevent attribute normalisation (see
-               XML spec, section 3.3.3. */
-            else if (c == '\n') output << "&#xA;";
-            else output << c;
+        /* Write the value in runs of characters that don't need
+           escaping. */
+        auto & value(i.second);
+        size_t start = 0;
+        for (size_t j = 0; j < value.size(); ++j) {
+            const char * escape;
+            switch (value[j]) {
+                case '"': escape = "&quot;"; break;
+                case '<': escape = "&lt;"; break;
+                case '>': escape = "&gt;"; break;
+                case '&': escape = "&amp;"; break;
+                /* Escape newlines to prevent attribute normalisation
+                   (see XML spec, section 3.3.3. */
+                case '\n': escape = "&#xA;"; break;
+                default: continue;
+            }
+            output.write(value.data() + start, j - start);
+            output << escape;
+            start = j + 1;
         }
+        output.write(value.data() + start, value.size() - start);
         output << "\"";
     }
 }
@@ -4,6 +4,7 @@
 #include <string>
 #include <list>
 #include <map>
+#include <vector>
 
 
 namespace nix {
@@ -16,6 +17,10 @@ using std::list;
 typedef map<string, string> XMLAttrs;
 
 
+/* Writes an XML document to `output' as it is being generated.
+   Nothing is buffered here apart from the names of the open elements,
+   and the stream is never flushed, so `output' determines how much
+   of the document is held in memory. */
 class XMLWriter
 {
 private:
@@ -25,7 +30,7 @@ private:
     bool indent;
     bool closed;
 
-    list<string> pendingElems;
+    std::vector<string> pendingElems;
 
 public:
 
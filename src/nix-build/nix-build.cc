@@ -17,6 +17,7 @@
 #include "common-eval-args.hh"
 #include "attr-path.hh"
 #include "legacy.hh"
+#include "finally.hh"
 
 using namespace nix;
 using namespace std::string_literals;
@@ -67,6 +68,76 @@ std::vector<string> shellwords(const string & s)
     return res;
 }
 
+/* A script that sources $stdenv/setup and writes the variables,
+   functions and shell options that it changed to the file "$1", as
+   commands that recreate them. */
+static const char * dumpShellEnvScript = R"sh(
+[ -e "$stdenv/setup" ] || exit 1
+__nixOut="$1"
+__nixOpts="$(shopt -p; set +o)"
+declare -A __nixVars
+for __nixV in $(compgen -v); do __nixVars[$__nixV]="$(declare -p "$__nixV" 2>/dev/null)"; done
+dontAddDisableDepTrack=1
+source "$stdenv/setup" >&2
+__nixNewOpts="$(shopt -p; set +o)"
+set +eu
+{
+    for __nixV in $(compgen -v); do
+        case "$__nixV" in
+            BASH*|FUNCNAME|PIPESTATUS|LINENO|RANDOM|SRANDOM|SECONDS|EPOCH*|HISTCMD|GROUPS|DIRSTACK|PPID|_|__nix*) continue;;
+        esac
+        __nixD="$(declare -p "$__nixV" 2>/dev/null)" || continue
+        __nixF="${__nixD#declare -}"; __nixF="${__nixF%% *}"
+        [[ $__nixF == *r* || "${__nixVars[$__nixV]-}" == "$__nixD" ]] || printf '%s\n' "$__nixD"
+    done
+    declare -f
+    while IFS= read -r __nixL; do
+        [[ $'\n'"$__nixOpts"$'\n' == *$'\n'"$__nixL"$'\n'* ]] || printf '%s\n' "$__nixL"
+    done <<< "$__nixNewOpts"
+} > "$__nixOut"
+)sh";
+
+/* Return a file that recreates the effect of sourcing $stdenv/setup
+   for the derivation `drvPath' with the environment `env', creating it
+   if it isn't in the cache yet. The result only depends on the
+   derivation, since the setup script and everything it sources are in
+   the store. */
+static std::optional<Path> getShellEnv(const Path & drvPath, const Path & shell,
+    bool pure, char * * env, const Path & tmpDir)
+{
+    auto dir = getCacheDir() + "/nix/shell-env";
+    auto file = fmt("%s/%s.sh", dir,
+        hashString(htSHA256, fmt("%s\n%s\n%d", drvPath, shell, pure)).to_string(Base32, false));
+
+    if (pathExists(file)) return file;
+
+    try {
+        createDirs(dir);
+
+        auto script = tmpDir + "/dump-env";
+        writeFile(script, dumpShellEnvScript);
+
+        auto tmp = fmt("%s.tmp-%d", file, getpid());
+        AutoDelete delTmp(tmp, false);
+
+        auto oldEnviron = environ;
+        environ = env;
+        Finally restoreEnviron([&]() { environ = oldEnviron; });
+
+        if (!statusOk(runProgram(RunOptions(shell, {script, tmp})).first))
+            return {};
+
+        if (rename(tmp.c_str(), file.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, file);
+        delTmp.cancel();
+
+        return file;
+    } catch (Error & e) {
+        printError("warning: cannot cache the shell environment: %s", e.what());
+        return {};
+    }
+}
+
 static void _main(int argc, char * * argv)
 {
     auto dryRun = false;
@@ -244,6 +315,7 @@ static void _main(int argc, char * * argv)
 
     auto state = std::make_unique<EvalState>(myArgs.searchPath, store);
     state->repair = repair;
+    state->batchTexts = true;
 
     Bindings & autoArgs = *myArgs.getAutoArgs(*state);
 
@@ -308,6 +380,8 @@ static void _main(int argc, char * * argv)
     state->printStats();
 
     auto buildPaths = [&](const PathSet & paths) {
+        state->flushTexts();
+
         /* Note: we do this even when !printMissing to efficiently
            fetch binary cache data. */
         unsigned long long downloadSize, narSize;
@@ -327,7 +401,9 @@ static void _main(int argc, char * * argv)
             throw UsageError("nix-shell requires a single derivation");
 
         auto & drvInfo = drvs.front();
-        auto drv = store->derivationFromPath(drvInfo.queryDrvPath());
+        auto drvPath = drvInfo.queryDrvPath();
+        state->flushTexts();
+        auto drv = store->derivationFromPath(drvPath);
 
         PathSet pathsToBuild;
 
@@ -405,6 +481,16 @@ static void _main(int argc, char * * argv)
 
         restoreAffinity();
 
+        Strings envStrs;
+        for (auto & i : env)
+            envStrs.push_back(i.first + "=" + i.second);
+
+        auto envPtrs = stringsToCharPtrs(envStrs);
+
+        std::optional<Path> shellEnv;
+        if (settings.shellEnvCache)
+            shellEnv = getShellEnv(drvInfo.queryDrvPath(), shell, pure, envPtrs.data(), tmpDir);
+
         /* Run a shell using the derivation's environment.  For
            convenience, source $stdenv/setup to setup additional
            environment variables and shell functions.  Also don't
@@ -415,7 +501,7 @@ static void _main(int argc, char * * argv)
                 "[ -n \"$PS1\" ] && [ -e ~/.bashrc ] && source ~/.bashrc; "
                 "%2%"
                 "dontAddDisableDepTrack=1; "
-                "[ -e $stdenv/setup ] && source $stdenv/setup; "
+                "%8%"
                 "%3%"
                 "PATH=\"%4%:$PATH\"; "
                 "SHELL=%5%; "
@@ -432,18 +518,15 @@ static void _main(int argc, char * * argv)
                 dirOf(shell),
                 shell,
                 (getenv("TZ") ? (string("export TZ='") + getenv("TZ") + "'; ") : ""),
-                envCommand));
-
-        Strings envStrs;
-        for (auto & i : env)
-            envStrs.push_back(i.first + "=" + i.second);
+                envCommand,
+                shellEnv
+                ? "source " + shellEscape(*shellEnv) + "; "
+                : "[ -e $stdenv/setup ] && source $stdenv/setup; "s));
 
         auto args = interactive
             ? Strings{"bash", "--rcfile", rcfile}
             : Strings{"bash", rcfile};
 
-        auto envPtrs = stringsToCharPtrs(envStrs);
-
         environ = envPtrs.data();
 
         auto argPtrs = stringsToCharPtrs(args);
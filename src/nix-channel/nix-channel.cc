@@ -2,6 +2,7 @@
 #include "globals.hh"
 #include "download.hh"
 #include "store-api.hh"
+#include "worker-protocol.hh"
 #include "legacy.hh"
 
 #include <fcntl.h>
@@ -75,6 +76,10 @@ static void update(const StringSet & channelNames)
 
     auto store = openStore();
 
+    // Daemons before protocol 1.24 don't have builtin:unpack-channel,
+    // so let them unpack the channels with tar, as before.
+    std::string useBuiltin = GET_PROTOCOL_MINOR(store->getProtocol()) >= 24 ? "true" : "false";
+
     // Download each channel.
     Strings exprs;
     for (const auto & channel : channels) {
@@ -103,12 +108,12 @@ static void update(const StringSet & channelNames)
             cname = cname + (string) match[1];
         }
 
-        std::string extraAttrs;
+        std::string extraAttrs = "useBuiltin = " + useBuiltin + "; ";
 
         bool unpacked = false;
         if (std::regex_search(filename, std::regex("\\.tar\\.(gz|bz2|xz)$"))) {
             runProgram(settings.nixBinDir + "/nix-build", false, { "--no-out-link", "--expr", "import <nix/unpack-channel.nix> "
-                        "{ name = \"" + cname + "\"; channelName = \"" + name + "\"; src = builtins.storePath \"" + filename + "\"; }" });
+                        "{ name = \"" + cname + "\"; channelName = \"" + name + "\"; src = builtins.storePath \"" + filename + "\"; useBuiltin = " + useBuiltin + "; }" });
             unpacked = true;
         }
 
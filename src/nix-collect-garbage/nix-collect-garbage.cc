@@ -3,27 +3,34 @@
 #include "shared.hh"
 #include "globals.hh"
 #include "legacy.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <cerrno>
 
+#include <fcntl.h>
+
 using namespace nix;
 
 std::string deleteOlderThan;
 bool dryRun = false;
 
 
-/* If `-d' was specified, remove all old generations of all profiles.
- * Of course, this makes rollbacks to before this point in time
- * impossible. */
-
-void removeOldGenerations(std::string dir)
+/* Find the profiles in `dir' and its subdirectories whose old
+   generations `-d' should remove. The generations of each directory
+   are read in one pass rather than once per profile. */
+static void findProfiles(const Path & dir, std::vector<std::pair<Path, Generations>> & profiles)
 {
     if (access(dir.c_str(), R_OK) != 0) return;
 
     bool canWrite = access(dir.c_str(), W_OK) == 0;
 
-    for (auto & i : readDirectory(dir)) {
+    AutoCloseFD fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (!fd) throw SysError("opening directory '%s'", dir);
+
+    std::optional<std::map<string, Generations>> gens;
+
+    for (auto & i : readDirectory(fd.get(), dir)) {
         checkInterrupt();
 
         auto path = dir + "/" + i.name;
@@ -32,23 +39,46 @@ void removeOldGenerations(std::string dir)
         if (type == DT_LNK && canWrite) {
             std::string link;
             try {
-                link = readLink(path);
+                link = readLinkAt(fd.get(), i.name, path);
             } catch (SysError & e) {
                 if (e.errNo == ENOENT) continue;
             }
             if (link.find("link") != string::npos) {
-                printInfo(format("removing old generations of profile %1%") % path);
-                if (deleteOlderThan != "")
-                    deleteGenerationsOlderThan(path, deleteOlderThan, dryRun);
-                else
-                    deleteOldGenerations(path, dryRun);
+                if (!gens) gens = findAllGenerations(dir);
+                profiles.emplace_back(path, (*gens)[i.name]);
             }
         } else if (type == DT_DIR) {
-            removeOldGenerations(path);
+            findProfiles(path, profiles);
         }
     }
 }
 
+
+/* If `-d' was specified, remove all old generations of all profiles.
+ * Of course, this makes rollbacks to before this point in time
+ * impossible. The profiles are processed in parallel. */
+
+void removeOldGenerations(std::string dir)
+{
+    std::vector<std::pair<Path, Generations>> profiles;
+    findProfiles(dir, profiles);
+
+    auto oldTime = deleteOlderThan != "" ? parseOlderThanTimeSpec(deleteOlderThan) : 0;
+
+    ThreadPool pool;
+
+    for (auto & i : profiles)
+        pool.enqueue([&, profile{&i}]() {
+            printInfo(format("removing old generations of profile %1%") % profile->first);
+            if (deleteOlderThan != "")
+                deleteGenerationsOlderThan(profile->first, profile->second, oldTime, dryRun);
+            else
+                deleteOldGenerations(profile->first, profile->second, dryRun);
+        });
+
+    pool.process();
+}
+
 static int _main(int argc, char * * argv)
 {
     {
@@ -10,8 +10,13 @@
 #include "derivations.hh"
 #include "finally.hh"
 #include "legacy.hh"
+#include "thread-pool.hh"
+#include "nar-info-disk-cache.hh"
 
 #include <algorithm>
+#include <thread>
+#include <queue>
+#include <condition_variable>
 
 #include <cstring>
 #include <unistd.h>
@@ -21,6 +26,8 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
 #include <errno.h>
 #include <pwd.h>
 #include <grp.h>
@@ -31,6 +38,10 @@
 #include <sys/ucred.h>
 #endif
 
+#if __linux__
+#include <sys/prctl.h>
+#endif
+
 using namespace nix;
 
 #ifndef __linux__
@@ -85,9 +96,17 @@ struct TunnelLogger : public Logger
 
     Sync<State> state_;
 
+    FdSink & to;
+
     unsigned int clientVersion;
 
-    TunnelLogger(unsigned int clientVersion) : clientVersion(clientVersion) { }
+    /* The logger that messages go to once the connection has switched
+       to a mode in which they can't be sent to the client anymore. */
+    Logger & prevLogger;
+    std::atomic<bool> detached{false};
+
+    TunnelLogger(FdSink & to, unsigned int clientVersion, Logger & prevLogger)
+        : to(to), clientVersion(clientVersion), prevLogger(prevLogger) { }
 
     void enqueueMsg(const std::string & s)
     {
@@ -110,6 +129,11 @@ struct TunnelLogger : public Logger
 
     void log(Verbosity lvl, const FormatOrString & fs) override
     {
+        if (detached) {
+            prevLogger.log(lvl, fs);
+            return;
+        }
+
         if (lvl > verbosity) return;
 
         StringSink buf;
@@ -151,6 +175,8 @@ struct TunnelLogger : public Logger
     void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
         const std::string & s, const Fields & fields, ActivityId parent) override
     {
+        if (detached) return;
+
         if (GET_PROTOCOL_MINOR(clientVersion) < 20) {
             if (!s.empty())
                 log(lvl, s + "...");
@@ -164,7 +190,7 @@ struct TunnelLogger : public Logger
 
     void stopActivity(ActivityId act) override
     {
-        if (GET_PROTOCOL_MINOR(clientVersion) < 20) return;
+        if (detached || GET_PROTOCOL_MINOR(clientVersion) < 20) return;
         StringSink buf;
         buf << STDERR_STOP_ACTIVITY << act;
         enqueueMsg(*buf.s);
@@ -172,7 +198,7 @@ struct TunnelLogger : public Logger
 
     void result(ActivityId act, ResultType type, const Fields & fields) override
     {
-        if (GET_PROTOCOL_MINOR(clientVersion) < 20) return;
+        if (detached || GET_PROTOCOL_MINOR(clientVersion) < 20) return;
         StringSink buf;
         buf << STDERR_RESULT << act << type << fields;
         enqueueMsg(*buf.s);
@@ -195,7 +221,8 @@ struct TunnelSink : Sink
 struct TunnelSource : BufferedSource
 {
     Source & from;
-    TunnelSource(Source & from) : from(from) { }
+    BufferedSink & to;
+    TunnelSource(Source & from, BufferedSink & to) : from(from), to(to) { }
 protected:
     size_t readUnbuffered(unsigned char * data, size_t len) override
     {
@@ -234,9 +261,118 @@ struct RetrieveRegularNARSink : ParseSink
 };
 
 
+/* The settings sent by the client in wopSetOptions. */
+struct ClientOptions
+{
+    bool keepFailed, keepGoing, tryFallback;
+    Verbosity verbosity;
+    unsigned int maxBuildJobs;
+    time_t maxSilentTime;
+    bool verboseBuild;
+    unsigned int buildCores;
+    bool useSubstitutes;
+    StringMap overrides;
+};
+
+
+static ClientOptions readClientOptions(Source & from, unsigned int clientVersion)
+{
+    ClientOptions options;
+    options.keepFailed = readInt(from);
+    options.keepGoing = readInt(from);
+    options.tryFallback = readInt(from);
+    options.verbosity = (Verbosity) readInt(from);
+    options.maxBuildJobs = readInt(from);
+    options.maxSilentTime = readInt(from);
+    readInt(from); // obsolete useBuildHook
+    options.verboseBuild = lvlError == (Verbosity) readInt(from);
+    readInt(from); // obsolete logType
+    readInt(from); // obsolete printBuildTrace
+    options.buildCores = readInt(from);
+    options.useSubstitutes = readInt(from);
+
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
+        unsigned int n = readInt(from);
+        for (unsigned int i = 0; i < n; i++) {
+            string name = readString(from);
+            string value = readString(from);
+            options.overrides.emplace(name, value);
+        }
+    }
+
+    return options;
+}
+
+
+static void applyClientOptions(const ClientOptions & options, bool trusted)
+{
+    settings.keepFailed = options.keepFailed;
+    settings.keepGoing = options.keepGoing;
+    settings.tryFallback = options.tryFallback;
+    verbosity = options.verbosity;
+    settings.maxBuildJobs.assign(options.maxBuildJobs);
+    settings.maxSilentTime = options.maxSilentTime;
+    settings.verboseBuild = options.verboseBuild;
+    settings.buildCores = options.buildCores;
+    settings.useSubstitutes = options.useSubstitutes;
+
+    for (auto & i : options.overrides) {
+        auto & name(i.first);
+        auto & value(i.second);
+
+        auto setSubstituters = [&](Setting<Strings> & res) {
+            if (name != res.name && res.aliases.count(name) == 0)
+                return false;
+            StringSet trusted = settings.trustedSubstituters;
+            for (auto & s : settings.substituters.get())
+                trusted.insert(s);
+            Strings subs;
+            auto ss = tokenizeString<Strings>(value);
+            for (auto & s : ss)
+                if (trusted.count(s))
+                    subs.push_back(s);
+                else
+                    warn("ignoring untrusted substituter '%s'", s);
+            res = subs;
+            return true;
+        };
+
+        try {
+            if (name == "ssh-auth-sock") // obsolete
+                ;
+            else if (trusted
+                || name == settings.buildTimeout.name
+                || name == "connect-timeout"
+                || (name == "builders" && value == ""))
+                settings.set(name, value);
+            else if (setSubstituters(settings.substituters))
+                ;
+            else if (setSubstituters(settings.extraSubstituters))
+                ;
+            else
+                warn("ignoring the user-specified setting '%s', because it is a restricted setting and you are not a trusted user", name);
+        } catch (UsageError & e) {
+            warn(e.what());
+        }
+    }
+}
+
+
+static void writePathInfo(Sink & to, const ValidPathInfo & info, unsigned int clientVersion)
+{
+    to << info.deriver << info.narHash.to_string(Base16, false) << info.references
+       << info.registrationTime << info.narSize;
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 16) {
+        to << info.ultimate
+           << info.sigs
+           << info.ca;
+    }
+}
+
+
 static void performOp(TunnelLogger * logger, ref<Store> store,
     bool trusted, unsigned int clientVersion,
-    Source & from, Sink & to, unsigned int op)
+    Source & from, BufferedSink & to, unsigned int op)
 {
     switch (op) {
 
@@ -385,6 +521,23 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddTextsToStore: {
+        auto count = readNum<size_t>(from);
+        std::vector<StoreText> texts;
+        for (size_t n = 0; n < count; n++) {
+            StoreText text;
+            text.name = readString(from);
+            text.contents = readString(from);
+            text.references = readStorePaths<PathSet>(*store, from);
+            texts.push_back(std::move(text));
+        }
+        logger->startWork();
+        auto paths = store->addTextsToStore(texts, NoRepair);
+        logger->stopWork();
+        to << paths;
+        break;
+    }
+
     case wopExportPath: {
         Path path = readStorePath(*store, from);
         readInt(from); // obsolete
@@ -398,7 +551,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
 
     case wopImportPaths: {
         logger->startWork();
-        TunnelSource source(from);
+        TunnelSource source(from, to);
         Paths paths = store->importPaths(source, nullptr,
             trusted ? NoCheckSigs : CheckSigs);
         logger->stopWork();
@@ -456,6 +609,15 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopAddTempRoots: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        store->addTempRoots(paths);
+        logger->stopWork();
+        to << 1;
+        break;
+    }
+
     case wopAddIndirectRoot: {
         Path path = absPath(readString(from));
         logger->startWork();
@@ -509,77 +671,38 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         store->collectGarbage(options, results);
         logger->stopWork();
 
-        to << results.paths << results.bytesFreed << 0 /* obsolete */;
+        /* The third field used to be obsolete, so older clients
+           ignore it and older daemons send 0. */
+        to << results.paths << results.bytesFreed << results.filesDeleted;
 
         break;
     }
 
-    case wopSetOptions: {
-        settings.keepFailed = readInt(from);
-        settings.keepGoing = readInt(from);
-        settings.tryFallback = readInt(from);
-        verbosity = (Verbosity) readInt(from);
-        settings.maxBuildJobs.assign(readInt(from));
-        settings.maxSilentTime = readInt(from);
-        readInt(from); // obsolete useBuildHook
-        settings.verboseBuild = lvlError == (Verbosity) readInt(from);
-        readInt(from); // obsolete logType
-        readInt(from); // obsolete printBuildTrace
-        settings.buildCores = readInt(from);
-        settings.useSubstitutes  = readInt(from);
-
-        StringMap overrides;
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
-            unsigned int n = readInt(from);
-            for (unsigned int i = 0; i < n; i++) {
-                string name = readString(from);
-                string value = readString(from);
-                overrides.emplace(name, value);
-            }
-        }
-
+    case wopPlanGarbage: {
+        /* The plan lists every path in the store and every root,
+           including runtime roots, so it's only for trusted users. */
         logger->startWork();
+        if (!trusted)
+            throw Error("you are not privileged to plan garbage collection");
+        auto plan = store->planGarbage(false);
+        logger->stopWork();
 
-        for (auto & i : overrides) {
-            auto & name(i.first);
-            auto & value(i.second);
-
-            auto setSubstituters = [&](Setting<Strings> & res) {
-                if (name != res.name && res.aliases.count(name) == 0)
-                    return false;
-                StringSet trusted = settings.trustedSubstituters;
-                for (auto & s : settings.substituters.get())
-                    trusted.insert(s);
-                Strings subs;
-                auto ss = tokenizeString<Strings>(value);
-                for (auto & s : ss)
-                    if (trusted.count(s))
-                        subs.push_back(s);
-                    else
-                        warn("ignoring untrusted substituter '%s'", s);
-                res = subs;
-                return true;
-            };
+        to << plan.roots.size();
+        for (auto & [path, root] : plan.roots)
+            to << path << root.links << root.closureSize << root.exclusiveSize;
 
-            try {
-                if (name == "ssh-auth-sock") // obsolete
-                    ;
-                else if (trusted
-                    || name == settings.buildTimeout.name
-                    || name == "connect-timeout"
-                    || (name == "builders" && value == ""))
-                    settings.set(name, value);
-                else if (setSubstituters(settings.substituters))
-                    ;
-                else if (setSubstituters(settings.extraSubstituters))
-                    ;
-                else
-                    warn("ignoring the user-specified setting '%s', because it is a restricted setting and you are not a trusted user", name);
-            } catch (UsageError & e) {
-                warn(e.what());
-            }
-        }
+        to << plan.dead.size();
+        for (auto & [path, narSize] : plan.dead)
+            to << path << narSize;
 
+        to << plan.deadSize << plan.liveSize;
+        break;
+    }
+
+    case wopSetOptions: {
+        auto options = readClientOptions(from, clientVersion);
+        logger->startWork();
+        applyClientOptions(options, trusted);
         logger->stopWork();
         break;
     }
@@ -634,13 +757,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         if (info) {
             if (GET_PROTOCOL_MINOR(clientVersion) >= 17)
                 to << 1;
-            to << info->deriver << info->narHash.to_string(Base16, false) << info->references
-               << info->registrationTime << info->narSize;
-            if (GET_PROTOCOL_MINOR(clientVersion) >= 16) {
-                to << info->ultimate
-                   << info->sigs
-                   << info->ca;
-            }
+            writePathInfo(to, *info, clientVersion);
         } else {
             assert(GET_PROTOCOL_MINOR(clientVersion) >= 17);
             to << 0;
@@ -707,7 +824,7 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         std::string saved;
         std::unique_ptr<Source> source;
         if (GET_PROTOCOL_MINOR(clientVersion) >= 21)
-            source = std::make_unique<TunnelSource>(from);
+            source = std::make_unique<TunnelSource>(from, to);
         else {
             TeeSink tee(from);
             parseDump(tee, tee.source);
@@ -725,6 +842,60 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
         break;
     }
 
+    case wopQueryPathsFromHashParts: {
+        auto hashParts = readStrings<StringSet>(from);
+        logger->startWork();
+        auto paths = store->queryPathsFromHashParts(hashParts);
+        logger->stopWork();
+        /* One path per hash part, in order, or "" if there is none. */
+        Strings res;
+        for (auto & hashPart : hashParts) {
+            auto i = paths.find(hashPart);
+            res.push_back(i == paths.end() ? "" : i->second);
+        }
+        to << res;
+        break;
+    }
+
+    case wopQueryPathInfos: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        std::vector<ref<const ValidPathInfo>> infos;
+        for (auto & path : store->queryValidPaths(paths))
+            infos.push_back(store->queryPathInfo(path));
+        logger->stopWork();
+        /* Invalid paths are omitted. */
+        to << infos.size();
+        for (auto & info : infos) {
+            to << info->path;
+            writePathInfo(to, *info, clientVersion);
+        }
+        break;
+    }
+
+    case wopQueryClosure: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        bool flipDirection, includeOutputs, includeDerivers;
+        from >> flipDirection >> includeOutputs >> includeDerivers;
+        /* The paths that the client already has, which aren't
+           traversed or returned. */
+        auto known = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        PathSet closure = known;
+        store->computeFSClosure(paths, closure, flipDirection, includeOutputs, includeDerivers);
+        std::vector<ref<const ValidPathInfo>> infos;
+        for (auto & path : closure)
+            if (!known.count(path))
+                infos.push_back(store->queryPathInfo(path));
+        logger->stopWork();
+        to << infos.size();
+        for (auto & info : infos) {
+            to << info->path;
+            writePathInfo(to, *info, clientVersion);
+        }
+        break;
+    }
+
     case wopQueryMissing: {
         PathSet targets = readStorePaths<PathSet>(*store, from);
         logger->startWork();
@@ -742,11 +913,371 @@ static void performOp(TunnelLogger * logger, ref<Store> store,
 }
 
 
-static void processConnection(bool trusted)
+/* Counters exported by the metrics server (see
+   `daemon-metrics-port'). They live in memory that the daemon shares
+   with the processes it forks. */
+struct Metrics
 {
-    MonitorFdHup monitor(from.fd);
+    static const size_t maxOps = 64;
+
+    /* Bucket i of an operation's latency histogram counts the
+       operations that took less than 2^i milliseconds (the last
+       bucket has the slower ones). */
+    static const size_t nrBuckets = 16;
+
+    std::atomic<uint64_t> connections{0};
+    std::atomic<uint64_t> activeConnections{0};
+
+    struct Op
+    {
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> failures{0};
+        std::atomic<uint64_t> timeUs{0};
+        std::atomic<uint64_t> latency[nrBuckets];
+    };
+
+    Op ops[maxOps];
+
+    std::atomic<uint64_t> sqliteBusyRetries{0}, sqliteBusyWaitMs{0};
+    std::atomic<uint64_t> pathLockWaits{0}, pathLockWaitMs{0};
+    std::atomic<uint64_t> gcLockWaits{0}, gcLockWaitMs{0};
+
+    WorkerStats workerStats;
+};
+
+static Metrics * metrics = nullptr;
+
+
+static void recordOp(WorkerOp op, std::chrono::steady_clock::duration duration, bool failed)
+{
+    if (!metrics || (size_t) op >= Metrics::maxOps) return;
+    auto & m(metrics->ops[op]);
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+    m.count++;
+    if (failed) m.failures++;
+    m.timeUs += us;
+    size_t i = 0;
+    while (i + 1 < Metrics::nrBuckets && us >= (1000ULL << i)) i++;
+    m.latency[i]++;
+}
+
+
+/* Add the changes in the statistics of this process since the last
+   call to the shared counters. */
+static void recordStoreStats(Store & store)
+{
+    if (!metrics) return;
+
+    static Sync<std::array<uint64_t, 6>> reported_;
+
+    auto & stats(store.getStats());
+    auto reported(reported_.lock());
 
-    /* Exchange the greeting. */
+    auto add = [&](std::atomic<uint64_t> & total, size_t i, uint64_t value) {
+        total += value - (*reported)[i];
+        (*reported)[i] = value;
+    };
+
+    add(metrics->sqliteBusyRetries, 0, stats.sqliteBusyRetries);
+    add(metrics->sqliteBusyWaitMs, 1, stats.sqliteBusyWaitMs);
+    add(metrics->pathLockWaits, 2, stats.pathLockWaits);
+    add(metrics->pathLockWaitMs, 3, stats.pathLockWaitMs);
+    add(metrics->gcLockWaits, 4, stats.gcLockWaits);
+    add(metrics->gcLockWaitMs, 5, stats.gcLockWaitMs);
+}
+
+
+/* Count a connection as active while this object exists. */
+struct ActiveConnection
+{
+    ActiveConnection(bool isNew)
+    {
+        if (!metrics) return;
+        if (isNew) metrics->connections++;
+        metrics->activeConnections++;
+    }
+
+    ~ActiveConnection()
+    {
+        if (metrics) metrics->activeConnections--;
+    }
+};
+
+
+/* Render the metrics in the Prometheus text format. */
+static std::string renderMetrics()
+{
+    static const std::vector<std::pair<WorkerOp, std::string>> opNames = {
+        {wopIsValidPath, "IsValidPath"},
+        {wopHasSubstitutes, "HasSubstitutes"},
+        {wopQueryPathHash, "QueryPathHash"},
+        {wopQueryReferences, "QueryReferences"},
+        {wopQueryReferrers, "QueryReferrers"},
+        {wopAddToStore, "AddToStore"},
+        {wopAddTextToStore, "AddTextToStore"},
+        {wopBuildPaths, "BuildPaths"},
+        {wopEnsurePath, "EnsurePath"},
+        {wopAddTempRoot, "AddTempRoot"},
+        {wopAddIndirectRoot, "AddIndirectRoot"},
+        {wopSyncWithGC, "SyncWithGC"},
+        {wopFindRoots, "FindRoots"},
+        {wopExportPath, "ExportPath"},
+        {wopQueryDeriver, "QueryDeriver"},
+        {wopSetOptions, "SetOptions"},
+        {wopCollectGarbage, "CollectGarbage"},
+        {wopQuerySubstitutablePathInfo, "QuerySubstitutablePathInfo"},
+        {wopQueryDerivationOutputs, "QueryDerivationOutputs"},
+        {wopQueryAllValidPaths, "QueryAllValidPaths"},
+        {wopQueryFailedPaths, "QueryFailedPaths"},
+        {wopClearFailedPaths, "ClearFailedPaths"},
+        {wopQueryPathInfo, "QueryPathInfo"},
+        {wopImportPaths, "ImportPaths"},
+        {wopQueryDerivationOutputNames, "QueryDerivationOutputNames"},
+        {wopQueryPathFromHashPart, "QueryPathFromHashPart"},
+        {wopQuerySubstitutablePathInfos, "QuerySubstitutablePathInfos"},
+        {wopQueryValidPaths, "QueryValidPaths"},
+        {wopQuerySubstitutablePaths, "QuerySubstitutablePaths"},
+        {wopQueryValidDerivers, "QueryValidDerivers"},
+        {wopOptimiseStore, "OptimiseStore"},
+        {wopVerifyStore, "VerifyStore"},
+        {wopBuildDerivation, "BuildDerivation"},
+        {wopAddSignatures, "AddSignatures"},
+        {wopNarFromPath, "NarFromPath"},
+        {wopAddToStoreNar, "AddToStoreNar"},
+        {wopQueryMissing, "QueryMissing"},
+        {wopQueryPathsFromHashParts, "QueryPathsFromHashParts"},
+        {wopPipeline, "Pipeline"},
+        {wopQueryPathInfos, "QueryPathInfos"},
+        {wopQueryClosure, "QueryClosure"},
+        {wopPlanGarbage, "PlanGarbage"},
+        {wopAddTextsToStore, "AddTextsToStore"},
+        {wopAddTempRoots, "AddTempRoots"},
+    };
+
+    std::string res;
+
+    auto header = [&](const std::string & name, const std::string & type, const std::string & help) {
+        res += fmt("# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    };
+
+    auto metric = [&](const std::string & name, const std::string & type,
+        const std::string & help, uint64_t value)
+    {
+        header(name, type, help);
+        res += fmt("%s %d\n", name, value);
+    };
+
+    auto seconds = [&](const std::string & name, const std::string & help, uint64_t ms)
+    {
+        header(name, "counter", help);
+        res += fmt("%s %.3f\n", name, ms / 1000.0);
+    };
+
+    metric("nix_daemon_connections_total", "counter",
+        "Connections accepted.", metrics->connections);
+    metric("nix_daemon_connections_active", "gauge",
+        "Connections being served.", metrics->activeConnections);
+
+    header("nix_daemon_ops_total", "counter", "Operations performed.");
+    for (auto & i : opNames) {
+        auto & m(metrics->ops[i.first]);
+        if (m.count)
+            res += fmt("nix_daemon_ops_total{op=\"%s\"} %d\n", i.second, m.count.load());
+    }
+
+    header("nix_daemon_op_failures_total", "counter", "Operations that failed.");
+    for (auto & i : opNames) {
+        auto & m(metrics->ops[i.first]);
+        if (m.count)
+            res += fmt("nix_daemon_op_failures_total{op=\"%s\"} %d\n", i.second, m.failures.load());
+    }
+
+    header("nix_daemon_op_duration_seconds", "histogram", "Time taken by operations.");
+    for (auto & i : opNames) {
+        auto & m(metrics->ops[i.first]);
+        if (!m.count) continue;
+        uint64_t count = 0;
+        for (size_t j = 0; j < Metrics::nrBuckets; ++j) {
+            count += m.latency[j];
+            res += j + 1 < Metrics::nrBuckets
+                ? fmt("nix_daemon_op_duration_seconds_bucket{op=\"%s\",le=\"%.3f\"} %d\n",
+                    i.second, (1ULL << j) / 1000.0, count)
+                : fmt("nix_daemon_op_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %d\n",
+                    i.second, count);
+        }
+        res += fmt("nix_daemon_op_duration_seconds_sum{op=\"%s\"} %.6f\n", i.second, m.timeUs / 1e6);
+        res += fmt("nix_daemon_op_duration_seconds_count{op=\"%s\"} %d\n", i.second, count);
+    }
+
+    auto & w(metrics->workerStats);
+    metric("nix_daemon_builds_running", "gauge",
+        "Builds in progress.", w.runningBuilds);
+    metric("nix_daemon_builds_done_total", "counter",
+        "Builds that succeeded.", w.doneBuilds);
+    metric("nix_daemon_builds_failed_total", "counter",
+        "Builds that failed.", w.failedBuilds);
+    metric("nix_daemon_substitutions_running", "gauge",
+        "Substitutions in progress.", w.runningSubstitutions);
+    metric("nix_daemon_substitutions_done_total", "counter",
+        "Substitutions that succeeded.", w.doneSubstitutions);
+    metric("nix_daemon_substitutions_failed_total", "counter",
+        "Substitutions that failed.", w.failedSubstitutions);
+    metric("nix_daemon_substituted_nar_bytes_total", "counter",
+        "Size of the NARs of the substituted paths.", w.substitutedNarSize);
+
+    metric("nix_daemon_sqlite_busy_retries_total", "counter",
+        "Transactions retried because the database was busy.", metrics->sqliteBusyRetries);
+    seconds("nix_daemon_sqlite_busy_wait_seconds_total",
+        "Time spent waiting for the database to become unlocked.", metrics->sqliteBusyWaitMs);
+    metric("nix_daemon_path_lock_waits_total", "counter",
+        "Waits for a path lock.", metrics->pathLockWaits);
+    seconds("nix_daemon_path_lock_wait_seconds_total",
+        "Time spent waiting for path locks.", metrics->pathLockWaitMs);
+    metric("nix_daemon_gc_lock_waits_total", "counter",
+        "Waits for the garbage collector lock.", metrics->gcLockWaits);
+    seconds("nix_daemon_gc_lock_wait_seconds_total",
+        "Time spent waiting for the garbage collector lock.", metrics->gcLockWaitMs);
+
+    return res;
+}
+
+
+/* Serve a connection that has switched to pipelined mode (see
+   wopPipeline). Every request is prefixed by a tag chosen by the
+   client. Requests are processed concurrently, and each reply is sent
+   as soon as it's ready, prefixed by the tag of the request and
+   whether it failed (in which case the reply is the error message).
+   Only queries that don't need a log or a data stream are
+   supported.
+
+   Requests are queued for up to one worker thread per CPU, which are
+   started as the queue grows. Once no more input is buffered, the connection
+   thread processes the queued requests itself before it blocks
+   reading the next one, so a client that sends a single request and
+   waits for the reply is always answered. */
+static void processPipelinedOps(ref<Store> store, unsigned int clientVersion,
+    BufferedSource & from, BufferedSink & to)
+{
+    struct State
+    {
+        std::queue<std::function<void()>> queue;
+        bool quit = false;
+    };
+
+    Sync<State> state_;
+    std::condition_variable wakeup;
+    std::vector<std::thread> workers;
+    size_t maxWorkers = std::max(std::thread::hardware_concurrency(), 1U);
+
+    std::mutex writeLock;
+
+    /* Take a queued request, if there is one. */
+    auto dequeue = [&](bool wait) -> std::function<void()> {
+        auto state(state_.lock());
+        while (wait && !state->quit && state->queue.empty())
+            state.wait(wakeup);
+        if (state->queue.empty()) return nullptr;
+        auto work = std::move(state->queue.front());
+        state->queue.pop();
+        return work;
+    };
+
+    Finally stopWorkers([&]() {
+        state_.lock()->quit = true;
+        wakeup.notify_all();
+        for (auto & thr : workers) thr.join();
+    });
+
+    auto enqueue = [&](uint64_t tag, WorkerOp op, std::function<void(Sink &)> work) {
+        auto item = [&, tag, op, work]() {
+            StringSink res;
+            bool failed = false;
+            auto start = std::chrono::steady_clock::now();
+            try {
+                work(res);
+            } catch (Error & e) {
+                failed = true;
+                res = StringSink();
+                res << e.msg();
+            } catch (std::exception & e) {
+                failed = true;
+                res = StringSink();
+                res << std::string(e.what());
+            }
+            recordOp(op, std::chrono::steady_clock::now() - start, failed);
+            try {
+                std::lock_guard<std::mutex> lock(writeLock);
+                to << tag << failed;
+                to(*res.s);
+                to.flush();
+            } catch (...) {
+                /* The client has gone away; the connection thread
+                   will notice. */
+                ignoreException();
+            }
+        };
+
+        size_t queued;
+        {
+            auto state(state_.lock());
+            state->queue.push(item);
+            queued = state->queue.size();
+        }
+        wakeup.notify_one();
+
+        if (queued > 1 && workers.size() < maxWorkers)
+            workers.emplace_back([&]() {
+                while (auto work = dequeue(true)) work();
+            });
+    };
+
+    while (true) {
+        /* Don't leave requests unprocessed while waiting for the
+           client. */
+        if (!from.hasData())
+            while (auto work = dequeue(false)) work();
+
+        uint64_t tag;
+        try {
+            tag = readNum<uint64_t>(from);
+        } catch (EndOfFile & e) {
+            break;
+        }
+
+        auto op = (WorkerOp) readInt(from);
+
+        switch (op) {
+
+        case wopQueryPathInfo: {
+            auto path = readString(from);
+            enqueue(tag, op, [store, path, clientVersion](Sink & to) {
+                store->assertStorePath(path);
+                std::shared_ptr<const ValidPathInfo> info;
+                try {
+                    info = store->queryPathInfo(path);
+                } catch (InvalidPath &) {
+                    to << 0;
+                    return;
+                }
+                to << 1;
+                writePathInfo(to, *info, clientVersion);
+            });
+            break;
+        }
+
+        default:
+            throw Error("operation %d is not supported on a pipelined connection", op);
+        }
+    }
+
+    while (auto work = dequeue(false)) work();
+}
+
+
+/* Exchange the greeting with a new client, returning its protocol
+   version. */
+static unsigned int exchangeGreeting(Source & from, BufferedSink & to)
+{
     unsigned int magic = readInt(from);
     if (magic != WORKER_MAGIC_1) throw Error("protocol mismatch");
     to << WORKER_MAGIC_2 << PROTOCOL_VERSION;
@@ -756,7 +1287,155 @@ static void processConnection(bool trusted)
     if (clientVersion < 0x10a)
         throw Error("the Nix client version is too old");
 
-    auto tunnelLogger = new TunnelLogger(clientVersion);
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from))
+        setAffinityTo(readInt(from));
+
+    readInt(from); // obsolete reserveSpace
+
+    return clientVersion;
+}
+
+
+/* Whether an operation can be performed by a thread of a daemon
+   running in threaded mode (see `daemon-threads'). These are the
+   queries that don't depend on the settings of the client and don't
+   change the state of the daemon process. */
+static bool canRunInThread(WorkerOp op)
+{
+    switch (op) {
+    case wopIsValidPath:
+    case wopQueryValidPaths:
+    case wopQueryPathInfo:
+    case wopQueryPathInfos:
+    case wopQueryClosure:
+    case wopQueryReferences:
+    case wopQueryReferrers:
+    case wopQueryValidDerivers:
+    case wopQueryDerivationOutputs:
+    case wopQueryDerivationOutputNames:
+    case wopQueryDeriver:
+    case wopQueryPathHash:
+    case wopQueryPathFromHashPart:
+    case wopQueryPathsFromHashParts:
+    case wopQueryAllValidPaths:
+    case wopNarFromPath:
+    case wopPipeline:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/* Process client requests until the client closes the connection. If
+   `firstOp' is set, that operation has already been read. If
+   `savedOptions' is set, the connection is served by a thread of a
+   daemon in threaded mode: wopSetOptions only records the client's
+   settings there, and the first operation that can't be performed by
+   a thread is returned without reading its arguments. */
+static std::optional<WorkerOp> processOps(TunnelLogger * tunnelLogger,
+    ref<Store> store, bool trusted, unsigned int clientVersion,
+    FdSource & from, FdSink & to, unsigned int & opCount,
+    std::optional<WorkerOp> firstOp = {},
+    std::optional<ClientOptions> * savedOptions = nullptr)
+{
+    while (true) {
+        WorkerOp op;
+        if (firstOp) {
+            op = *firstOp;
+            firstOp.reset();
+        } else {
+            try {
+                op = (WorkerOp) readInt(from);
+            } catch (Interrupted & e) {
+                break;
+            } catch (EndOfFile & e) {
+                break;
+            }
+        }
+
+        opCount++;
+
+        if (savedOptions && op == wopSetOptions) {
+            *savedOptions = readClientOptions(from, clientVersion);
+            tunnelLogger->startWork();
+            tunnelLogger->stopWork();
+            to.flush();
+            continue;
+        }
+
+        if (savedOptions && !canRunInThread(op))
+            return op;
+
+        /* Switch to pipelined mode for the rest of the
+           connection. Log messages produced from here on can't be
+           sent to the client. */
+        if (op == wopPipeline) {
+            tunnelLogger->startWork();
+            tunnelLogger->stopWork();
+            to.flush();
+            tunnelLogger->detached = true;
+            processPipelinedOps(store, clientVersion, from, to);
+            break;
+        }
+
+        auto start = std::chrono::steady_clock::now();
+        bool failed = false;
+
+        Finally recordMetrics([&]() {
+            recordOp(op, std::chrono::steady_clock::now() - start, failed);
+            recordStoreStats(*store);
+        });
+
+        try {
+            performOp(tunnelLogger, store, trusted, clientVersion, from, to, op);
+        } catch (Error & e) {
+            failed = true;
+            /* If we're not in a state where we can send replies, then
+               something went wrong processing the input of the
+               client.  This can happen especially if I/O errors occur
+               during addTextToStore() / importPath().  If that
+               happens, just send the error message and exit. */
+            bool errorAllowed = tunnelLogger->state_.lock()->canSendStderr;
+            tunnelLogger->stopWork(false, e.msg(), e.status);
+            if (!errorAllowed) throw;
+        } catch (std::bad_alloc & e) {
+            failed = true;
+            tunnelLogger->stopWork(false, "Nix daemon out of memory", 1);
+            throw;
+        }
+
+        to.flush();
+
+        assert(!tunnelLogger->state_.lock()->canSendStderr);
+    }
+
+    return {};
+}
+
+
+/* The state of a connection that a thread of a daemon in threaded
+   mode passes to a forked process, which continues with operation
+   `op'. */
+struct HandOff
+{
+    unsigned int clientVersion;
+    std::optional<ClientOptions> options;
+    WorkerOp op;
+};
+
+
+static void processConnection(bool trusted, const HandOff * handOff = nullptr)
+{
+    MonitorFdHup monitor(from.fd);
+
+    ActiveConnection activeConnection(!handOff);
+
+    unsigned int clientVersion = handOff
+        ? handOff->clientVersion
+        : exchangeGreeting(from, to);
+
+    auto tunnelLogger = new TunnelLogger(to, clientVersion, *logger);
     auto prevLogger = nix::logger;
     logger = tunnelLogger;
 
@@ -765,15 +1444,15 @@ static void processConnection(bool trusted)
     Finally finally([&]() {
         _isInterrupted = false;
         prevLogger->log(lvlDebug, fmt("%d operations", opCount));
+        if (sqliteStats.busyRetries)
+            prevLogger->log(lvlInfo, fmt("waited %d ms for the Nix database to become unlocked (%d retries)",
+                sqliteStats.busyWaitMs.load(), sqliteStats.busyRetries.load()));
     });
 
-    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from))
-        setAffinityTo(readInt(from));
-
-    readInt(from); // obsolete reserveSpace
-
-    /* Send startup error messages to the client. */
-    tunnelLogger->startWork();
+    /* Send startup error messages to the client. A connection that
+       was handed off has already received them; any messages are
+       sent with the reply to the next operation. */
+    if (!handOff) tunnelLogger->startWork();
 
     try {
 
@@ -793,42 +1472,17 @@ static void processConnection(bool trusted)
         params["path-info-cache-size"] = "0";
         auto store = openStore(settings.storeUri, params);
 
-        tunnelLogger->stopWork();
-        to.flush();
-
-        /* Process client requests. */
-        while (true) {
-            WorkerOp op;
-            try {
-                op = (WorkerOp) readInt(from);
-            } catch (Interrupted & e) {
-                break;
-            } catch (EndOfFile & e) {
-                break;
-            }
-
-            opCount++;
-
-            try {
-                performOp(tunnelLogger, store, trusted, clientVersion, from, to, op);
-            } catch (Error & e) {
-                /* If we're not in a state where we can send replies, then
-                   something went wrong processing the input of the
-                   client.  This can happen especially if I/O errors occur
-                   during addTextToStore() / importPath().  If that
-                   happens, just send the error message and exit. */
-                bool errorAllowed = tunnelLogger->state_.lock()->canSendStderr;
-                tunnelLogger->stopWork(false, e.msg(), e.status);
-                if (!errorAllowed) throw;
-            } catch (std::bad_alloc & e) {
-                tunnelLogger->stopWork(false, "Nix daemon out of memory", 1);
-                throw;
-            }
-
+        if (handOff) {
+            if (handOff->options)
+                applyClientOptions(*handOff->options, trusted);
+        } else {
+            tunnelLogger->stopWork();
             to.flush();
+        }
 
-            assert(!tunnelLogger->state_.lock()->canSendStderr);
-        };
+        /* Process client requests. */
+        processOps(tunnelLogger, store, trusted, clientVersion, from, to, opCount,
+            handOff ? handOff->op : std::optional<WorkerOp>());
 
     } catch (std::exception & e) {
         tunnelLogger->stopWork(false, e.what(), 1);
@@ -922,6 +1576,382 @@ static PeerInfo getPeerInfo(int remote)
 }
 
 
+/* In a daemon in threaded mode, the logger of the connection served
+   by the current thread, if any. */
+static thread_local Logger * threadLogger = nullptr;
+
+
+/* Logger that sends messages to the logger of the connection served
+   by the current thread, or to the daemon's own logger. */
+struct ThreadedLogger : Logger
+{
+    Logger & fallback;
+
+    ThreadedLogger(Logger & fallback) : fallback(fallback) { }
+
+    Logger & get()
+    {
+        return threadLogger ? *threadLogger : fallback;
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        get().log(lvl, fs);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        get().warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        get().startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        get().stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        get().result(act, type, fields);
+    }
+};
+
+
+/* Socket to the zygote, the process from which a daemon in threaded
+   mode forks the processes that take over connections from its
+   threads. The zygote is forked before any threads are started, so
+   forking from it is safe. */
+static AutoCloseFD zygoteSocket;
+
+
+/* The number of connections being served by threads. */
+static std::atomic<unsigned int> nrConnectionThreads{0};
+
+
+/* Write client options in the format of wopSetOptions. */
+static void writeClientOptions(Sink & to, const ClientOptions & options, unsigned int clientVersion)
+{
+    to << options.keepFailed << options.keepGoing << options.tryFallback
+       << options.verbosity << options.maxBuildJobs << options.maxSilentTime
+       << 0 // obsolete useBuildHook
+       << (options.verboseBuild ? lvlError : lvlVomit)
+       << 0 // obsolete logType
+       << 0 // obsolete printBuildTrace
+       << options.buildCores << options.useSubstitutes;
+
+    if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
+        to << options.overrides.size();
+        for (auto & i : options.overrides)
+            to << i.first << i.second;
+    }
+}
+
+
+/* Pass a connection to the zygote, along with the data that the
+   thread serving it has already read from it. If `handOff' is null,
+   the connection is new, and the process starts from the greeting. */
+static void handOffConnection(int fd, bool trusted, const HandOff * handOff, FdSource * from)
+{
+    StringSink sink;
+    sink << trusted << (handOff ? 1 : 0);
+    if (handOff) {
+        sink << handOff->clientVersion << handOff->op << (handOff->options ? 1 : 0);
+        if (handOff->options)
+            writeClientOptions(sink, *handOff->options, handOff->clientVersion);
+        if (from->buffer)
+            sink << std::string((char *) from->buffer.get() + from->bufPosOut, from->bufPosIn - from->bufPosOut);
+        else
+            sink << "";
+    }
+
+    struct iovec iov;
+    iov.iov_base = (void *) sink.s->data();
+    iov.iov_len = sink.s->size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(zygoteSocket.get(), &msg, 0) == -1)
+        throw SysError("handing off a connection");
+}
+
+
+/* The main loop of the zygote: fork a process for every connection
+   that is handed off to it. */
+static void zygoteLoop(int fdZygote)
+{
+    std::vector<char> buf(1024 * 1024);
+
+    while (true) {
+        struct iovec iov;
+        iov.iov_base = buf.data();
+        iov.iov_len = buf.size();
+
+        char control[CMSG_SPACE(sizeof(int))];
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        auto n = recvmsg(fdZygote, &msg, 0);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("receiving a connection");
+        }
+        if (n == 0) break;
+
+        AutoCloseFD remote;
+        auto cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+            remote = fd;
+            closeOnExec(remote.get());
+        }
+
+        if (!remote || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))) {
+            printError("ignoring an invalid connection hand-off");
+            continue;
+        }
+
+        std::string state(buf.data(), n);
+
+        try {
+            ProcessOptions options;
+            options.errorPrefix = "unexpected Nix daemon error: ";
+            options.dieWithParent = false;
+            options.runExitHandlers = true;
+            options.allowVfork = false;
+            startProcess([&]() {
+                close(fdZygote);
+
+                if (setsid() == -1)
+                    throw SysError(format("creating a new session"));
+
+                setSigChldAction(false);
+
+                StringSource source(state);
+                bool trusted = readInt(source);
+
+                from.fd = remote.get();
+                to.fd = remote.get();
+
+                if (!readInt(source)) {
+                    processConnection(trusted);
+                    exit(0);
+                }
+
+                HandOff handOff;
+                handOff.clientVersion = readInt(source);
+                handOff.op = (WorkerOp) readInt(source);
+                if (readInt(source))
+                    handOff.options = readClientOptions(source, handOff.clientVersion);
+                auto readAhead = readString(source);
+
+                if (!readAhead.empty()) {
+                    assert(readAhead.size() <= from.bufSize);
+                    from.buffer = decltype(from.buffer)(new unsigned char[from.bufSize]);
+                    memcpy(from.buffer.get(), readAhead.data(), readAhead.size());
+                    from.bufPosOut = 0;
+                    from.bufPosIn = readAhead.size();
+                }
+
+                processConnection(trusted, &handOff);
+
+                exit(0);
+            }, options);
+        } catch (Error & e) {
+            printError("error handing off a connection: %s", e.msg());
+        }
+    }
+}
+
+
+/* Serve a connection in a thread of a daemon in threaded mode, until
+   the client closes it or performs an operation that requires a
+   process of its own, in which case the connection is handed off to
+   the zygote. */
+static void serveConnectionThread(AutoCloseFD remote, bool trusted,
+    ref<Store> store, Logger & defaultLogger)
+{
+    ActiveConnection activeConnection(true);
+
+    try {
+        FdSource from(remote.get());
+        FdSink to(remote.get());
+
+        unsigned int clientVersion = exchangeGreeting(from, to);
+
+        TunnelLogger tunnelLogger(to, clientVersion, defaultLogger);
+        threadLogger = &tunnelLogger;
+        Finally resetLogger([&]() { threadLogger = nullptr; });
+
+        tunnelLogger.startWork();
+        tunnelLogger.stopWork();
+        to.flush();
+
+        std::optional<ClientOptions> options;
+        unsigned int opCount = 0;
+
+        try {
+            auto op = processOps(&tunnelLogger, store, trusted, clientVersion,
+                from, to, opCount, {}, &options);
+            if (op) {
+                HandOff handOff{clientVersion, options, *op};
+                handOffConnection(remote.get(), trusted, &handOff, &from);
+            }
+        } catch (std::exception & e) {
+            tunnelLogger.stopWork(false, e.what(), 1);
+            to.flush();
+        }
+    } catch (std::exception & e) {
+        printError("error processing connection: %s", e.what());
+    }
+}
+
+
+/* The main loop of the metrics server: reply to every HTTP request
+   with the metrics. */
+static void serveMetrics(int fdSocket)
+{
+    while (true) {
+        AutoCloseFD remote = accept(fdSocket, nullptr, nullptr);
+        if (!remote) {
+            if (errno == EINTR) continue;
+            throw SysError("accepting a metrics connection");
+        }
+
+        try {
+            struct timeval timeout = {5, 0};
+            setsockopt(remote.get(), SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(remote.get(), SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            /* Read the request headers. The URI doesn't matter. */
+            std::string request;
+            char buf[4096];
+            while (request.find("\r\n\r\n") == std::string::npos && request.size() < 65536) {
+                auto n = read(remote.get(), buf, sizeof(buf));
+                if (n <= 0) break;
+                request.append(buf, n);
+            }
+
+            auto body = renderMetrics();
+            writeFull(remote.get(),
+                "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                "\r\n" + body, false);
+        } catch (Error & e) {
+            printError("error serving metrics: %s", e.msg());
+        }
+    }
+}
+
+
+/* Allocate the shared metrics, and start a process that serves them
+   on port `daemon-metrics-port' of the loopback interface. */
+static void startMetricsServer()
+{
+    auto p = mmap(nullptr, sizeof(Metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        throw SysError("allocating shared memory for metrics");
+    metrics = new (p) Metrics();
+    workerStats = &metrics->workerStats;
+
+    AutoCloseFD fdMetrics = socket(AF_INET, SOCK_STREAM, 0);
+    if (!fdMetrics)
+        throw SysError("cannot create metrics socket");
+    closeOnExec(fdMetrics.get());
+
+    int one = 1;
+    setsockopt(fdMetrics.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(settings.daemonMetricsPort);
+
+    if (bind(fdMetrics.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("cannot bind to metrics port %d", settings.daemonMetricsPort);
+
+    if (listen(fdMetrics.get(), 5) == -1)
+        throw SysError("cannot listen on metrics port %d", settings.daemonMetricsPort);
+
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon error: ";
+    options.allowVfork = false;
+    startProcess([&]() {
+        serveMetrics(fdMetrics.get());
+    }, options);
+}
+
+
+/* Start a process that, every `narinfo-refresh-interval' seconds,
+   refreshes the entries of the disk cache of the substituters that
+   are in use and about to expire, so that clients don't have to wait
+   for them to be fetched again. */
+static pid_t startNarInfoRefresher()
+{
+    ProcessOptions options;
+    options.errorPrefix = "unexpected Nix daemon error: ";
+    options.allowVfork = false;
+    return startProcess([&]() {
+#if __linux__
+        /* Don't outlive the daemon if it dies without killing us. */
+        if (prctl(PR_SET_PDEATHSIG, SIGKILL) == -1)
+            throw SysError("setting the parent death signal");
+#endif
+
+        const time_t hotPeriod = 24 * 3600;
+        const size_t maxRefreshes = 10000;
+
+        auto diskCache = getNarInfoDiskCache();
+
+        while (true) {
+            sleep(settings.narInfoRefreshInterval);
+
+            try {
+                for (auto & sub : getDefaultSubstituters()) {
+                    auto now = time(0);
+                    auto paths = diskCache->queryHotNarInfos(sub->getUri(),
+                        now - hotPeriod, now + 2 * settings.narInfoRefreshInterval, maxRefreshes);
+                    if (paths.empty()) continue;
+                    printInfo("refreshing %d cached path infos from '%s'", paths.size(), sub->getUri());
+                    /* The queries finish in the background while we
+                       sleep. */
+                    for (auto & path : paths)
+                        sub->refreshPathInfo(path);
+                }
+            } catch (std::exception & e) {
+                printError("error refreshing the binary cache lookup cache: %s", e.what());
+            }
+        }
+    }, options);
+}
+
+
 #define SD_LISTEN_FDS_START 3
 
 
@@ -988,6 +2018,54 @@ static void daemonLoop(char * * argv)
 
     closeOnExec(fdSocket.get());
 
+    if (settings.daemonMetricsPort)
+        startMetricsServer();
+
+    Pid narInfoRefresher;
+    if (settings.narInfoRefreshInterval)
+        narInfoRefresher = startNarInfoRefresher();
+
+    /* Kill the refresher when we exit.  Don't wait for it, since
+       the SIGCHLD handler may reap it before we can. */
+    Finally stopNarInfoRefresher([&]() {
+        if (narInfoRefresher != -1)
+            kill(narInfoRefresher.release(), SIGKILL);
+    });
+
+    /* In threaded mode, start the zygote and open the store shared by
+       the threads. Since other processes (the ones that connections
+       are handed off to, and the garbage collector) modify the store,
+       the path info cache stays disabled. */
+    std::shared_ptr<Store> sharedStore;
+    Logger * daemonLogger = logger;
+    if (settings.daemonThreads) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1)
+            throw SysError("creating a socket pair");
+        AutoCloseFD parentSide(fds[0]), childSide(fds[1]);
+        closeOnExec(parentSide.get());
+        closeOnExec(childSide.get());
+
+        ProcessOptions options;
+        options.errorPrefix = "unexpected Nix daemon error: ";
+        options.runExitHandlers = true;
+        options.allowVfork = false;
+        startProcess([&]() {
+            fdSocket = -1;
+            parentSide = -1;
+            zygoteLoop(childSide.get());
+            exit(0);
+        }, options);
+
+        zygoteSocket = std::move(parentSide);
+
+        Store::Params params;
+        params["path-info-cache-size"] = "0";
+        sharedStore = openStore(settings.storeUri, params);
+
+        logger = new ThreadedLogger(*daemonLogger);
+    }
+
     /* Loop accepting connections. */
     while (1) {
 
@@ -1028,6 +2106,25 @@ static void daemonLoop(char * * argv)
                 % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
                 % (peer.uidKnown ? user : "<unknown>"));
 
+            if (sharedStore) {
+                /* Bound the number of threads, since each has a stack
+                   of its own and they all contend for the one shared
+                   store. Connections beyond that are served by
+                   processes of their own. */
+                if (nrConnectionThreads >= std::max(1U, settings.daemonMaxThreads.get())) {
+                    debug("too many connection threads, handing off the connection");
+                    handOffConnection(remote.get(), trusted, nullptr, nullptr);
+                    continue;
+                }
+                nrConnectionThreads++;
+                std::thread([remote{std::move(remote)}, trusted, sharedStore, daemonLogger]() mutable {
+                    Finally done([]() { nrConnectionThreads--; });
+                    serveConnectionThread(std::move(remote), trusted,
+                        ref<Store>(sharedStore), *daemonLogger);
+                }).detach();
+                continue;
+            }
+
             /* Fork a child to handle the connection. */
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
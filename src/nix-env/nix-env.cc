@@ -3,8 +3,11 @@
 #include "derivations.hh"
 #include "eval.hh"
 #include "get-drvs.hh"
+#include "eval-cache.hh"
+#include "json-to-value.hh"
 #include "globals.hh"
 #include "names.hh"
+#include "package-table.hh"
 #include "profiles.hh"
 #include "shared.hh"
 #include "store-api.hh"
@@ -13,6 +16,7 @@
 #include "json.hh"
 #include "value-to-json.hh"
 #include "xml-writer.hh"
+#include "serialise.hh"
 #include "legacy.hh"
 
 #include <cerrno>
@@ -20,6 +24,9 @@
 #include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <optional>
+
+#include <nlohmann/json.hpp>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -103,6 +110,7 @@ static void getAllExprs(EvalState & state,
 {
     StringSet namesSorted;
     for (auto & i : readDirectory(path)) namesSorted.insert(i.name);
+    state.addEvalInput("dir", path);
 
     for (auto & i : namesSorted) {
         /* Ignore the manifest.nix used by profiles.  This is
@@ -116,6 +124,9 @@ static void getAllExprs(EvalState & state,
         if (stat(path2.c_str(), &st) == -1)
             continue; // ignore dangling symlinks in ~/.nix-defexpr
 
+        if (S_ISDIR(st.st_mode))
+            state.addEvalInput("exists", path2 + "/default.nix");
+
         if (isNixExpr(path2, st) && (!S_ISREG(st.st_mode) || hasSuffix(path2, ".nix"))) {
             /* Strip off the `.nix' filename suffix (if applicable),
                otherwise the attribute cannot be selected with the
@@ -193,6 +204,106 @@ static void loadDerivations(EvalState & state, Path nixExprPath,
 }
 
 
+/* Load the available derivations for 'nix-env -q', going through the
+   evaluation cache if it's enabled.  Cached elements are represented
+   by attribute sets that contain only the requested information. */
+static void loadAvailable(Globals & globals, const string & pathPrefix,
+    bool wantDrvPath, bool wantOutputs, bool wantMeta, DrvInfos & elems)
+{
+    auto & state(*globals.state);
+    auto & instSource(globals.instSource);
+
+    auto cache = getEvalCache();
+    if (!cache) {
+        loadDerivations(state, instSource.nixExprPath, instSource.systemFilter,
+            *instSource.autoArgs, pathPrefix, elems);
+        return;
+    }
+
+    std::ostringstream str;
+    str << "query" << '\0' << instSource.nixExprPath << '\0' << instSource.systemFilter
+        << '\0' << pathPrefix << '\0' << showAutoArgs(*instSource.autoArgs)
+        << '\0' << wantDrvPath << wantOutputs << wantMeta;
+    auto key = str.str();
+
+    if (auto cached = cache->lookup(state, key)) {
+        for (auto & j : nlohmann::json::parse(*cached)) {
+            Value & v(*state.allocValue());
+            state.mkAttrs(v, 8);
+            mkString(*state.allocAttr(v, state.sName), j["name"].get<std::string>());
+            mkString(*state.allocAttr(v, state.sSystem), j["system"].get<std::string>());
+            if (wantDrvPath)
+                mkString(*state.allocAttr(v, state.sDrvPath), j["drvPath"].get<std::string>());
+            if (wantOutputs) {
+                mkString(*state.allocAttr(v, state.sOutPath), j["outPath"].get<std::string>());
+                auto & outputs(j["outputs"]);
+                Value & vOutputs(*state.allocAttr(v, state.sOutputs));
+                state.mkList(vOutputs, outputs.size());
+                unsigned int n = 0;
+                for (auto & k : outputs.items()) {
+                    mkString(*(vOutputs.listElems()[n++] = state.allocValue()), k.key());
+                    Value & vOut(*state.allocAttr(v, state.symbols.create(k.key())));
+                    state.mkAttrs(vOut, 1);
+                    mkString(*state.allocAttr(vOut, state.sOutPath), k.value().get<std::string>());
+                }
+            }
+            if (wantMeta)
+                parseJSON(state, j["meta"].dump(), *state.allocAttr(v, state.sMeta));
+            v.attrs->sort();
+            elems.push_back(DrvInfo(state, j["attrPath"].get<std::string>(), v.attrs));
+        }
+        return;
+    }
+
+    loadDerivations(state, instSource.nixExprPath, instSource.systemFilter,
+        *instSource.autoArgs, pathPrefix, elems);
+
+    /* Compute the requested information for every element.  If that
+       fails for reasons other than an assertion failure (which makes
+       opQuery() skip the element anyway), just don't cache the
+       result, since the failing element may not even be selected. */
+    auto res = nlohmann::json::array();
+    try {
+        for (auto & i : elems) {
+            nlohmann::json j;
+            try {
+                j["attrPath"] = i.attrPath;
+                j["name"] = i.queryName();
+                j["system"] = i.querySystem();
+                if (wantDrvPath)
+                    j["drvPath"] = i.queryDrvPath();
+                if (wantOutputs) {
+                    j["outPath"] = i.queryOutPath();
+                    j["outputs"] = i.queryOutputs();
+                }
+                if (wantMeta) {
+                    std::ostringstream str;
+                    {
+                        JSONObject metaObj(str);
+                        for (auto & name : i.queryMetaNames()) {
+                            Value * v = i.queryMeta(name);
+                            if (!v) continue;
+                            auto placeholder = metaObj.placeholder(name);
+                            PathSet context;
+                            printValueAsJSON(state, true, *v, placeholder, context);
+                        }
+                    }
+                    j["meta"] = nlohmann::json::parse(str.str());
+                }
+            } catch (AssertionError & e) {
+                continue;
+            }
+            res.push_back(j);
+        }
+    } catch (Error & e) {
+        debug("not caching available derivations: %s", e.what());
+        return;
+    }
+
+    cache->insert(state, key, res.dump());
+}
+
+
 static Path getDefNixExprPath()
 {
     return getHome() + "/.nix-defexpr";
@@ -528,6 +639,25 @@ static void opInstall(Globals & globals, Strings opFlags, Strings opArgs)
 typedef enum { utLt, utLeq, utEq, utAlways } UpgradeType;
 
 
+/* An index of derivations by name (without the version), so that
+   finding the derivations with the same name as some other one
+   doesn't require comparing it against all of them. The derivations
+   with a given name are kept in their original order, together with
+   their version. */
+typedef std::unordered_map<string, std::vector<std::pair<DrvInfo *, string>>> DrvNameIndex;
+
+
+static DrvNameIndex indexByName(DrvInfos & elems)
+{
+    DrvNameIndex index;
+    for (auto & i : elems) {
+        DrvName name(i.queryName());
+        index[name.name].emplace_back(&i, name.version);
+    }
+    return index;
+}
+
+
 static void upgradeDerivations(Globals & globals,
     const Strings & args, UpgradeType upgradeType)
 {
@@ -546,6 +676,7 @@ static void upgradeDerivations(Globals & globals,
         /* Fetch all derivations from the input file. */
         DrvInfos availElems;
         queryInstSources(*globals.state, globals.instSource, args, availElems, false);
+        auto availByName = indexByName(availElems);
 
         /* Go through all installed derivations. */
         DrvInfos newElems;
@@ -566,33 +697,32 @@ static void upgradeDerivations(Globals & globals,
                    priority.  If there are still multiple matches,
                    take the one with the highest version.
                    Do not upgrade if it would decrease the priority. */
-                DrvInfos::iterator bestElem = availElems.end();
+                DrvInfo * bestElem = nullptr;
                 string bestVersion;
-                for (auto j = availElems.begin(); j != availElems.end(); ++j) {
-                    if (comparePriorities(*globals.state, i, *j) > 0)
-                        continue;
-                    DrvName newName(j->queryName());
-                    if (newName.name == drvName.name) {
-                        int d = compareVersions(drvName.version, newName.version);
+                auto candidates = availByName.find(drvName.name);
+                if (candidates != availByName.end())
+                    for (auto & [j, newVersion] : candidates->second) {
+                        if (comparePriorities(*globals.state, i, *j) > 0)
+                            continue;
+                        int d = compareVersions(drvName.version, newVersion);
                         if ((upgradeType == utLt && d < 0) ||
                             (upgradeType == utLeq && d <= 0) ||
                             (upgradeType == utEq && d == 0) ||
                             upgradeType == utAlways)
                         {
                             long d2 = -1;
-                            if (bestElem != availElems.end()) {
+                            if (bestElem) {
                                 d2 = comparePriorities(*globals.state, *bestElem, *j);
-                                if (d2 == 0) d2 = compareVersions(bestVersion, newName.version);
+                                if (d2 == 0) d2 = compareVersions(bestVersion, newVersion);
                             }
                             if (d2 < 0 && (!globals.prebuiltOnly || isPrebuilt(*globals.state, *j))) {
                                 bestElem = j;
-                                bestVersion = newName.version;
+                                bestVersion = newVersion;
                             }
                         }
                     }
-                }
 
-                if (bestElem != availElems.end() &&
+                if (bestElem &&
                     i.queryOutPath() !=
                     bestElem->queryOutPath())
                 {
@@ -823,30 +953,31 @@ void printTable(Table & table)
 typedef enum { cvLess, cvEqual, cvGreater, cvUnavail } VersionDiff;
 
 static VersionDiff compareVersionAgainstSet(
-    const DrvInfo & elem, const DrvInfos & elems, string & version)
+    const DrvInfo & elem, const DrvNameIndex & elems, string & version)
 {
     DrvName name(elem.queryName());
 
     VersionDiff diff = cvUnavail;
     version = "?";
 
-    for (auto & i : elems) {
-        DrvName name2(i.queryName());
-        if (name.name == name2.name) {
-            int d = compareVersions(name.version, name2.version);
-            if (d < 0) {
-                diff = cvGreater;
-                version = name2.version;
-            }
-            else if (diff != cvGreater && d == 0) {
-                diff = cvEqual;
-                version = name2.version;
-            }
-            else if (diff != cvGreater && diff != cvEqual && d > 0) {
-                diff = cvLess;
-                if (version == "" || compareVersions(version, name2.version) < 0)
-                    version = name2.version;
-            }
+    auto sameName = elems.find(name.name);
+    if (sameName == elems.end()) return diff;
+
+    for (auto & i : sameName->second) {
+        auto & version2(i.second);
+        int d = compareVersions(name.version, version2);
+        if (d < 0) {
+            diff = cvGreater;
+            version = version2;
+        }
+        else if (diff != cvGreater && d == 0) {
+            diff = cvEqual;
+            version = version2;
+        }
+        else if (diff != cvGreater && diff != cvEqual && d > 0) {
+            diff = cvLess;
+            if (version == "" || compareVersions(version, version2) < 0)
+                version = version2;
         }
     }
 
@@ -854,29 +985,154 @@ static VersionDiff compareVersionAgainstSet(
 }
 
 
+static void queryJSON(Globals & globals, JSONObject & topObj, DrvInfo & i)
+{
+    JSONObject pkgObj = topObj.object(i.attrPath);
+
+    pkgObj.attr("name", i.queryName());
+    pkgObj.attr("system", i.querySystem());
+
+    JSONObject metaObj = pkgObj.object("meta");
+    StringSet metaNames = i.queryMetaNames();
+    for (auto & j : metaNames) {
+        auto placeholder = metaObj.placeholder(j);
+        Value * v = i.queryMeta(j);
+        if (!v) {
+            printError("derivation '%s' has invalid meta attribute '%s'", i.queryName(), j);
+            placeholder.write(nullptr);
+        } else {
+            PathSet context;
+            printValueAsJSON(*globals.state, true, *v, placeholder, context);
+        }
+    }
+}
+
+
 static void queryJSON(Globals & globals, vector<DrvInfo> & elems)
 {
-    JSONObject topObj(cout, true);
-    for (auto & i : elems) {
-        JSONObject pkgObj = topObj.object(i.attrPath);
-
-        pkgObj.attr("name", i.queryName());
-        pkgObj.attr("system", i.querySystem());
-
-        JSONObject metaObj = pkgObj.object("meta");
-        StringSet metaNames = i.queryMetaNames();
-        for (auto & j : metaNames) {
-            auto placeholder = metaObj.placeholder(j);
-            Value * v = i.queryMeta(j);
-            if (!v) {
-                printError("derivation '%s' has invalid meta attribute '%s'", i.queryName(), j);
-                placeholder.write(nullptr);
-            } else {
-                PathSet context;
-                printValueAsJSON(*globals.state, true, *v, placeholder, context);
-            }
+    /* Write the output directly to stdout, flushing it after every
+       package, so that it appears while evaluation is still in
+       progress. */
+    cout.flush();
+    FdSink sink(STDOUT_FILENO);
+    SinkStream out(sink);
+
+    {
+        JSONObject topObj(out, true);
+        for (auto & i : elems) {
+            queryJSON(globals, topObj, i);
+            out.flush();
         }
     }
+
+    sink.flush();
+}
+
+
+/* Call `callback' on the available derivations matching `args' as
+   they are being discovered, rather than evaluating and sorting all
+   of them first. */
+static void forEachAvailable(Globals & globals, const string & attrPath,
+    const Strings & args, const DrvCallback & callback)
+{
+    auto & state(*globals.state);
+    auto & instSource(globals.instSource);
+
+    DrvNames selectors = drvNamesFromArgs(args);
+    if (selectors.empty())
+        selectors.push_back(DrvName("*"));
+
+    Value vRoot;
+    loadSourceExpr(state, instSource.nixExprPath, vRoot);
+    Value & v(*findAlongAttrPath(state, attrPath, *instSource.autoArgs, vRoot));
+
+    getDerivations(state, v, attrPath, *instSource.autoArgs, [&](DrvInfo && i) {
+        if (instSource.systemFilter != "*" && i.querySystem() != instSource.systemFilter)
+            return;
+        DrvName drvName(i.queryName());
+        bool matched = false;
+        for (auto & sel : selectors)
+            if (sel.matches(drvName)) {
+                sel.hits++;
+                matched = true;
+            }
+        if (matched) callback(std::move(i));
+    }, true);
+
+    checkSelectorUse(selectors);
+}
+
+
+/* Print the available derivations matching `args' as JSON while they
+   are being discovered.  Since the output is an object keyed by
+   attribute path, the order of the packages doesn't matter. */
+static void queryAvailableJSON(Globals & globals, const string & attrPath,
+    const Strings & args)
+{
+    cout.flush();
+    FdSink sink(STDOUT_FILENO);
+    SinkStream out(sink);
+
+    {
+        JSONObject topObj(out, true);
+
+        forEachAvailable(globals, attrPath, args, [&](DrvInfo && i) {
+            queryJSON(globals, topObj, i);
+            out.flush();
+        });
+    }
+
+    sink.flush();
+}
+
+
+/* Write the attribute paths, names, systems, derivation paths,
+   outputs and the meta attributes `metaNames' of the available
+   derivations matching `args' to the package table `path' (see
+   package-table.hh). */
+static void exportAvailable(Globals & globals, const string & attrPath,
+    const Strings & args, const Path & path, const Strings & metaNames)
+{
+    Strings columns{"attrPath", "name", "system", "drvPath", "outputs"};
+    for (auto & name : metaNames)
+        columns.push_back("meta." + name);
+
+    PackageTableWriter table(columns);
+
+    forEachAvailable(globals, attrPath, args, [&](DrvInfo && i) {
+        std::vector<std::optional<std::string>> row;
+        try {
+            row.push_back(i.attrPath);
+            row.push_back(i.queryName());
+            row.push_back(i.querySystem());
+            row.push_back(i.queryDrvPath());
+
+            std::string outputs;
+            for (auto & j : i.queryOutputs())
+                outputs += j.first + "=" + j.second + "\n";
+            row.push_back(outputs);
+
+            for (auto & name : metaNames) {
+                Value * v = i.queryMeta(name);
+                if (!v)
+                    row.push_back({});
+                else if (v->type == tString)
+                    row.push_back(std::string(v->string.s));
+                else {
+                    std::ostringstream str;
+                    PathSet context;
+                    printValueAsJSON(*globals.state, true, *v, str, context);
+                    row.push_back(str.str());
+                }
+            }
+        } catch (AssertionError & e) {
+            printMsg(lvlTalkative, "skipping derivation named '%s' which gives an assertion failure", i.queryName());
+            return;
+        }
+        table.add(row);
+    });
+
+    table.write(path);
 }
 
 
@@ -896,6 +1152,8 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     bool compareVersions = false;
     bool xmlOutput = false;
     bool jsonOutput = false;
+    Path exportPath;
+    Strings exportMeta{"description", "homepage", "license"};
 
     enum { sInstalled, sAvailable } source = sInstalled;
 
@@ -915,6 +1173,10 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         else if (arg == "--available" || arg == "-a") source = sAvailable;
         else if (arg == "--xml") xmlOutput = true;
         else if (arg == "--json") jsonOutput = true;
+        else if (arg == "--export")
+            exportPath = absPath(needArg(i, opFlags, arg));
+        else if (arg == "--export-meta")
+            exportMeta = tokenizeString<Strings>(needArg(i, opFlags, arg), ",");
         else if (arg == "--attr-path" || arg == "-P") printAttrPath = true;
         else if (arg == "--attr" || arg == "-A")
             attrPath = needArg(i, opFlags, arg);
@@ -923,6 +1185,21 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     }
 
 
+    if (exportPath != "") {
+        if (source != sAvailable)
+            throw UsageError("'--export' requires '--available'");
+        exportAvailable(globals, attrPath, opArgs, exportPath, exportMeta);
+        return;
+    }
+
+    /* Available derivations can be printed as JSON as they're found,
+       unless they need to be compared to the installed ones or can be
+       loaded from the evaluation cache. */
+    if (jsonOutput && source == sAvailable && !compareVersions && !getEvalCache()) {
+        queryAvailableJSON(globals, attrPath, opArgs);
+        return;
+    }
+
     /* Obtain derivation information from the specified source. */
     DrvInfos availElems, installedElems;
 
@@ -930,15 +1207,19 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         installedElems = queryInstalled(*globals.state, globals.profile);
 
     if (source == sAvailable || compareVersions)
-        loadDerivations(*globals.state, globals.instSource.nixExprPath,
-            globals.instSource.systemFilter, *globals.instSource.autoArgs,
-            attrPath, availElems);
+        loadAvailable(globals, attrPath,
+            printDrvPath,
+            printOutPath || printStatus || globals.prebuiltOnly,
+            printMeta || printDescription || jsonOutput,
+            availElems);
 
     DrvInfos elems_ = filterBySelector(*globals.state,
         source == sInstalled ? installedElems : availElems,
         opArgs, false);
 
     DrvInfos & otherElems(source == sInstalled ? availElems : installedElems);
+    DrvNameIndex otherByName;
+    if (compareVersions) otherByName = indexByName(otherElems);
 
 
     /* Sort them by name. */
@@ -984,9 +1265,15 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
     RunPager pager;
 
     Table table;
+
+    /* Like JSON output, XML output goes directly to stdout and is
+       flushed after every package. */
+    cout.flush();
+    FdSink sink(STDOUT_FILENO);
+    SinkStream out(sink);
     std::ostringstream dummy;
-    XMLWriter xml(true, *(xmlOutput ? &cout : &dummy));
-    XMLOpenElement xmlRoot(xml, "items");
+    XMLWriter xml(true, xmlOutput ? (std::ostream &) out : dummy);
+    std::optional<XMLOpenElement> xmlRoot(std::in_place, xml, "items");
 
     for (auto & i : elems) {
         try {
@@ -1034,10 +1321,9 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
             if (compareVersions) {
                 /* Compare this element against the versions of the
                    same named packages in either the set of available
-                   elements, or the set of installed elements.  !!!
-                   This is O(N * M), should be O(N * lg M). */
+                   elements, or the set of installed elements. */
                 string version;
-                VersionDiff diff = compareVersionAgainstSet(i, otherElems, version);
+                VersionDiff diff = compareVersionAgainstSet(i, otherByName, version);
 
                 char ch;
                 switch (diff) {
@@ -1161,7 +1447,7 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
             } else
                 table.push_back(columns);
 
-            cout.flush();
+            if (xmlOutput) out.flush();
 
         } catch (AssertionError & e) {
             printMsg(lvlTalkative, "skipping derivation named '%1%' which gives an assertion failure", i.queryName());
@@ -1171,6 +1457,10 @@ static void opQuery(Globals & globals, Strings opFlags, Strings opArgs)
         }
     }
 
+    xmlRoot.reset();
+    xml.close();
+    sink.flush();
+
     if (!xmlOutput) printTable(table);
 }
 
@@ -1385,7 +1675,8 @@ static int _main(int argc, char * * argv)
                 opFlags.push_back(*arg);
                 /* FIXME: hacky */
                 if (*arg == "--from-profile" ||
-                    (op == opQuery && (*arg == "--attr" || *arg == "-A")))
+                    (op == opQuery && (*arg == "--attr" || *arg == "-A"
+                            || *arg == "--export" || *arg == "--export-meta")))
                     opFlags.push_back(getArg(*arg, arg, end));
             }
             else
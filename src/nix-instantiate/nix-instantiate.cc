@@ -3,16 +3,23 @@
 #include "eval.hh"
 #include "eval-inline.hh"
 #include "get-drvs.hh"
+#include "eval-cache.hh"
+#include "eval-server.hh"
 #include "attr-path.hh"
 #include "value-to-xml.hh"
 #include "value-to-json.hh"
 #include "util.hh"
+#include "serialise.hh"
 #include "store-api.hh"
 #include "common-eval-args.hh"
 #include "legacy.hh"
 
 #include <map>
 #include <iostream>
+#include <algorithm>
+#include <sstream>
+
+#include <nlohmann/json.hpp>
 
 
 using namespace nix;
@@ -21,11 +28,168 @@ using namespace nix;
 static Path gcRoot;
 static int rootNr = 0;
 static bool indirectRoot = false;
+static bool incrementalJobs = false;
 
 
 enum OutputKind { okPlain, okXML, okJSON };
 
 
+/* Return the derivations denoted by `attrPath', as pairs of
+   derivation paths and output names, using the evaluation cache if
+   it's enabled. */
+static std::vector<std::pair<Path, string>> instantiate(EvalState & state,
+    const string & attrPath, Bindings & autoArgs, Expr * e,
+    std::function<Value & ()> getRoot)
+{
+    std::vector<std::pair<Path, string>> res;
+
+    auto cache = getEvalCache();
+    string key;
+
+    if (cache) {
+        std::ostringstream str;
+        str << "instantiate" << '\0' << *e << '\0' << attrPath << '\0' << showAutoArgs(autoArgs);
+        key = str.str();
+
+        if (auto cached = cache->lookup(state, key)) {
+            for (auto & i : nlohmann::json::parse(*cached))
+                res.emplace_back(i[0].get<std::string>(), i[1].get<std::string>());
+            /* The derivations may have been garbage-collected since. */
+            if (std::all_of(res.begin(), res.end(), [&](const std::pair<Path, string> & i) {
+                    return state.store->isValidPath(i.first);
+                }))
+                return res;
+            res.clear();
+        }
+    }
+
+    Value & v(*findAlongAttrPath(state, attrPath, autoArgs, getRoot()));
+    state.forceValue(v);
+
+    DrvInfos drvs;
+    getDerivations(state, v, "", autoArgs, drvs, false);
+    std::vector<DrvInfo *> drvs2;
+    for (auto & i : drvs) drvs2.push_back(&i);
+    state.forceParallel(drvs2.size(), [&](size_t n) {
+        drvs2[n]->queryDrvPath();
+    });
+    for (auto & i : drvs) {
+        Path drvPath = i.queryDrvPath();
+
+        /* What output do we want? */
+        string outputName = i.queryOutputName();
+        if (outputName == "")
+            throw Error(format("derivation '%1%' lacks an 'outputName' attribute ") % drvPath);
+
+        res.emplace_back(drvPath, outputName);
+    }
+
+    state.flushTexts();
+
+    if (cache)
+        cache->insert(state, key, nlohmann::json(res).dump());
+
+    return res;
+}
+
+
+static void printDrvs(ref<Store> store, const DrvOutputs & drvs)
+{
+    for (auto & j : drvs) {
+        Path drvPath = j.first;
+        const string & outputName(j.second);
+
+        if (gcRoot == "")
+            printGCWarning();
+        else {
+            Path rootName = indirectRoot ? absPath(gcRoot) : gcRoot;
+            if (++rootNr > 1) rootName += "-" + std::to_string(rootNr);
+            auto store2 = store.dynamic_pointer_cast<LocalFSStore>();
+            if (store2)
+                drvPath = store2->addPermRoot(drvPath, rootName, indirectRoot);
+        }
+        std::cout << format("%1%%2%\n") % drvPath % (outputName != "out" ? "!" + outputName : "");
+    }
+}
+
+
+/* Instantiate each attribute ("job") of the attribute set at
+   `attrPath' separately, caching its derivations under the inputs
+   that its own evaluation read.  Jobs whose inputs are unchanged are
+   not evaluated again.  To find out precisely which inputs a job
+   reads, even if other jobs have already forced the values it
+   shares with them, each uncached job is evaluated in a child
+   process that starts from the state after evaluating the attribute
+   set itself. */
+static void instantiateJobs(EvalState & state, const string & attrPath,
+    Bindings & autoArgs, Expr * e, Value & vRoot)
+{
+    auto cache = getEvalCache();
+    assert(cache);
+
+    Value & vJobs(*findAlongAttrPath(state, attrPath, autoArgs, vRoot));
+    state.forceAttrs(vJobs);
+
+    std::ostringstream str;
+    str << "job" << '\0' << *e << '\0' << attrPath << '\0' << showAutoArgs(autoArgs);
+    auto keyPrefix = str.str();
+
+    size_t reused = 0, evaluated = 0;
+
+    for (auto & attr : vJobs.attrs->lexicographicOrder()) {
+        string name = attr->name;
+        auto key = keyPrefix + '\0' + name;
+
+        /* Don't add the inputs of cached jobs to the state, since the
+           children would inherit them. */
+        if (auto cached = cache->lookup(state, key, false)) {
+            DrvOutputs drvs;
+            for (auto & i : nlohmann::json::parse(*cached))
+                drvs.emplace_back(i[0].get<std::string>(), i[1].get<std::string>());
+            if (std::all_of(drvs.begin(), drvs.end(), [&](const std::pair<Path, string> & i) {
+                    return state.store->isValidPath(i.first);
+                }))
+            {
+                printDrvs(state.store, drvs);
+                reused++;
+                continue;
+            }
+        }
+
+        auto res = nlohmann::json::parse(state.evalInChild([&]() {
+            DrvInfos drvInfos;
+            getDerivations(state, *attr->value, "", autoArgs, drvInfos, false);
+
+            DrvOutputs drvs;
+            for (auto & i : drvInfos) {
+                string outputName = i.queryOutputName();
+                if (outputName == "")
+                    throw Error("derivation '%s' lacks an 'outputName' attribute", i.queryDrvPath());
+                drvs.emplace_back(i.queryDrvPath(), outputName);
+            }
+
+            state.flushTexts();
+
+            nlohmann::json res;
+            res["drvs"] = drvs;
+            if (auto inputs = state.getEvalInputs())
+                res["inputs"] = *inputs;
+            return res.dump();
+        }));
+
+        auto drvs = res["drvs"].get<DrvOutputs>();
+        if (res.count("inputs"))
+            cache->insert(state, key, nlohmann::json(drvs).dump(),
+                res["inputs"].get<std::map<std::string, std::string>>());
+
+        printDrvs(state.store, drvs);
+        evaluated++;
+    }
+
+    printInfo("reused %d jobs, evaluated %d jobs", reused, evaluated);
+}
+
+
 void processExpr(EvalState & state, const Strings & attrPaths,
     bool parseOnly, bool strict, Bindings & autoArgs,
     bool evalOnly, OutputKind output, bool location, Expr * e)
@@ -36,50 +200,49 @@ void processExpr(EvalState & state, const Strings & attrPaths,
     }
 
     Value vRoot;
-    state.eval(e, vRoot);
+    bool haveRoot = false;
+    auto getRoot = [&]() -> Value & {
+        if (!haveRoot) {
+            state.eval(e, vRoot);
+            haveRoot = true;
+        }
+        return vRoot;
+    };
 
     for (auto & i : attrPaths) {
-        Value & v(*findAlongAttrPath(state, i, autoArgs, vRoot));
-        state.forceValue(v);
-
-        PathSet context;
         if (evalOnly) {
+            Value & v(*findAlongAttrPath(state, i, autoArgs, getRoot()));
+            state.forceValue(v);
+
+            PathSet context;
             Value vRes;
             if (autoArgs.empty())
                 vRes = v;
             else
                 state.autoCallFunction(autoArgs, v, vRes);
-            if (output == okXML)
-                printValueAsXML(state, strict, location, vRes, std::cout, context);
-            else if (output == okJSON)
-                printValueAsJSON(state, strict, vRes, std::cout, context);
+            if (output == okXML) {
+                std::cout.flush();
+                FdSink sink(STDOUT_FILENO);
+                SinkStream out(sink);
+                printValueAsXML(state, strict, location, vRes, out, context);
+                sink.flush();
+            }
+            else if (output == okJSON) {
+                std::cout.flush();
+                FdSink sink(STDOUT_FILENO);
+                SinkStream out(sink);
+                printValueAsJSON(state, strict, vRes, out, context);
+                sink.flush();
+            }
             else {
                 if (strict) state.forceValueDeep(vRes);
                 std::cout << vRes << std::endl;
             }
-        } else {
-            DrvInfos drvs;
-            getDerivations(state, v, "", autoArgs, drvs, false);
-            for (auto & i : drvs) {
-                Path drvPath = i.queryDrvPath();
-
-                /* What output do we want? */
-                string outputName = i.queryOutputName();
-                if (outputName == "")
-                    throw Error(format("derivation '%1%' lacks an 'outputName' attribute ") % drvPath);
-
-                if (gcRoot == "")
-                    printGCWarning();
-                else {
-                    Path rootName = indirectRoot ? absPath(gcRoot) : gcRoot;
-                    if (++rootNr > 1) rootName += "-" + std::to_string(rootNr);
-                    auto store2 = state.store.dynamic_pointer_cast<LocalFSStore>();
-                    if (store2)
-                        drvPath = store2->addPermRoot(drvPath, rootName, indirectRoot);
-                }
-                std::cout << format("%1%%2%\n") % drvPath % (outputName != "out" ? "!" + outputName : "");
-            }
-        }
+            state.flushTexts();
+        } else if (incrementalJobs)
+            instantiateJobs(state, i, autoArgs, e, getRoot());
+        else
+            printDrvs(state.store, instantiate(state, i, autoArgs, e, getRoot));
     }
 }
 
@@ -140,6 +303,8 @@ static int _main(int argc, char * * argv)
                 repair = Repair;
             else if (*arg == "--dry-run")
                 settings.readOnlyMode = true;
+            else if (*arg == "--incremental-jobs")
+                incrementalJobs = true;
             else if (*arg != "" && arg->at(0) == '-')
                 return false;
             else
@@ -154,15 +319,52 @@ static int _main(int argc, char * * argv)
         if (evalOnly && !wantsReadWrite)
             settings.readOnlyMode = true;
 
+        if (incrementalJobs) {
+            if (evalOnly || findFile)
+                throw UsageError("'--incremental-jobs' only applies to instantiation");
+            /* Children are forked from the evaluating thread; no other
+               thread may be allocating at that point. */
+            evalSettings.evalCache = true;
+            evalSettings.evalCores = 1;
+            evalSettings.preparseThreads = 0;
+            evalSettings.prefetchThreads = 0;
+        }
+
         auto store = openStore();
 
+        if (attrPaths.empty()) attrPaths = {""};
+
+        if (evalSettings.evalServer && !incrementalJobs && !evalOnly && !findFile && !readStdin && repair == NoRepair) {
+            if (files.empty() && !fromArgs)
+                files.push_back("./default.nix");
+
+            /* Fall back to evaluating locally from the first
+               request that the server can't handle. */
+            while (!files.empty()) {
+                auto & file = files.front();
+                EvalRequest request;
+                request.fromArgs = fromArgs;
+                request.file = fromArgs || isUri(file) || hasPrefix(file, "<") ? file : absPath(file);
+                request.attrPaths = attrPaths;
+                request.searchPath = myArgs.searchPath;
+                request.autoArgs = myArgs.getRawAutoArgs();
+                request.readOnly = settings.readOnlyMode;
+                request.storeUri = store->getUri();
+                auto drvs = instantiateViaServer(request);
+                if (!drvs) break;
+                printDrvs(store, *drvs);
+                files.pop_front();
+            }
+
+            if (files.empty()) return 0;
+        }
+
         auto state = std::make_unique<EvalState>(myArgs.searchPath, store);
         state->repair = repair;
+        state->batchTexts = true;
 
         Bindings & autoArgs = *myArgs.getAutoArgs(*state);
 
-        if (attrPaths.empty()) attrPaths = {""};
-
         if (findFile) {
             for (auto & i : files) {
                 Path p = state->findFile(i);
@@ -9,6 +9,7 @@
 #include "legacy.hh"
 #include "finally.hh"
 #include "progress-bar.hh"
+#include "tarfile.hh"
 
 #include <iostream>
 
@@ -172,28 +173,80 @@ static int _main(int argc, char * * argv)
             AutoDelete tmpDir(createTempDir(), true);
             Path tmpFile = (Path) tmpDir + "/tmp";
 
-            /* Download the file. */
+            /* Download the file.  Unless we have to unpack it, hash
+               it at the same time. */
+            HashSink hashSink(ht);
             {
                 AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
                 if (!fd) throw SysError("creating temporary file '%s'", tmpFile);
 
-                FdSink sink(fd.get());
+                FdSink fileSink(fd.get());
+                LambdaSink sink([&](const unsigned char * data, size_t len) {
+                    fileSink(data, len);
+                    if (!unpack) hashSink(data, len);
+                });
 
                 DownloadRequest req(actualUri);
                 req.decompress = false;
                 getDownloader()->download(std::move(req), sink);
+                fileSink.flush();
             }
 
-            /* Optionally unpack the file. */
-            if (unpack) {
+            if (!unpack) {
+                hash = hashSink.finish().first;
+
+                if (expectedHash != Hash(ht) && expectedHash != hash)
+                    throw Error(format("hash mismatch for '%1%'") % uri);
+
+                storePath = store->makeFixedOutputPath(false, hash, name);
+                if (!store->isValidPath(storePath))
+                    storePath = store->addToStore(name, tmpFile, false, ht);
+
+            } else if (!hasSuffix(baseNameOf(uri), ".zip")) {
+                /* Convert tarballs directly into a NAR. If the
+                   archive contains a single file/directory, then that
+                   is used as the top-level. The NAR goes to a
+                   temporary file, and is hashed on the way. */
+                printInfo("unpacking...");
+                Path narFile = (Path) tmpDir + "/nar";
+                MultiHashSink narHashSink({ht, htSHA256});
+                {
+                    AutoCloseFD fd = open(narFile.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0600);
+                    if (!fd) throw SysError("creating temporary file '%s'", narFile);
+
+                    FdSink fileSink(fd.get());
+                    LambdaSink sink([&](const unsigned char * data, size_t len) {
+                        fileSink(data, len);
+                        narHashSink(data, len);
+                    });
+                    tarToNar(tmpFile, sink, tarSingleEntry);
+                    fileSink.flush();
+                }
+                auto res = narHashSink.finish();
+
+                hash = res.first[0];
+                if (expectedHash != Hash(ht) && expectedHash != hash)
+                    throw Error(format("hash mismatch for '%1%'") % uri);
+
+                ValidPathInfo info;
+                info.narHash = res.first[1];
+                info.narSize = res.second;
+                info.path = store->makeFixedOutputPath(true, hash, name);
+                info.ca = makeFixedOutputCA(true, hash);
+                if (!store->isValidPath(info.path)) {
+                    AutoCloseFD fd = open(narFile.c_str(), O_RDONLY | O_CLOEXEC);
+                    if (!fd) throw SysError("opening '%s'", narFile);
+                    FdSource source(fd.get());
+                    store->addToStore(info, source, NoRepair, NoCheckSigs);
+                }
+                storePath = info.path;
+
+            } else {
+
                 printInfo("unpacking...");
                 Path unpacked = (Path) tmpDir + "/unpacked";
                 createDirs(unpacked);
-                if (hasSuffix(baseNameOf(uri), ".zip"))
-                    runProgram("unzip", true, {"-qq", tmpFile, "-d", unpacked});
-                else
-                    // FIXME: this requires GNU tar for decompression.
-                    runProgram("tar", true, {"xf", tmpFile, "-C", unpacked});
+                runProgram("unzip", true, {"-qq", tmpFile, "-d", unpacked});
 
                 /* If the archive unpacks to a single file/directory, then use
                    that as the top-level. */
@@ -202,20 +255,16 @@ static int _main(int argc, char * * argv)
                     tmpFile = unpacked + "/" + entries[0].name;
                 else
                     tmpFile = unpacked;
-            }
 
-            /* FIXME: inefficient; addToStore() will also hash
-               this. */
-            hash = unpack ? hashPath(ht, tmpFile).first : hashFile(ht, tmpFile);
+                /* FIXME: inefficient; addToStore() will also hash
+                   this. */
+                hash = hashPath(ht, tmpFile).first;
 
-            if (expectedHash != Hash(ht) && expectedHash != hash)
-                throw Error(format("hash mismatch for '%1%'") % uri);
+                if (expectedHash != Hash(ht) && expectedHash != hash)
+                    throw Error(format("hash mismatch for '%1%'") % uri);
 
-            /* Copy the file to the Nix store. FIXME: if RemoteStore
-               implemented addToStoreFromDump() and downloadFile()
-               supported a sink, we could stream the download directly
-               into the Nix store. */
-            storePath = store->addToStore(name, tmpFile, unpack, ht);
+                storePath = store->addToStore(name, tmpFile, true, ht);
+            }
 
             assert(storePath == store->makeFixedOutputPath(unpack, hash, name));
         }
@@ -1,4 +1,5 @@
 #include "archive.hh"
+#include "compression.hh"
 #include "derivations.hh"
 #include "dotgraph.hh"
 #include "globals.hh"
@@ -9,6 +10,7 @@
 #include "util.hh"
 #include "worker-protocol.hh"
 #include "graphml.hh"
+#include "json.hh"
 #include "legacy.hh"
 
 #include <iostream>
@@ -473,13 +475,15 @@ static void opReadLog(Strings opFlags, Strings opArgs)
 
     RunPager pager;
 
+    FdSink sink(STDOUT_FILENO);
+
     for (auto & i : opArgs) {
         auto path = store->followLinksToStorePath(i);
-        auto log = store->getBuildLog(path);
-        if (!log)
+        if (!store->readBuildLog(path, sink))
             throw Error("build log of derivation '%s' is not available", path);
-        std::cout << *log;
     }
+
+    sink.flush();
 }
 
 
@@ -571,6 +575,7 @@ static void opCheckValidity(Strings opFlags, Strings opArgs)
 static void opGC(Strings opFlags, Strings opArgs)
 {
     bool printRoots = false;
+    bool printPlan = false;
     GCOptions options;
     options.action = GCOptions::gcDeleteDead;
 
@@ -579,6 +584,7 @@ static void opGC(Strings opFlags, Strings opArgs)
     /* Do what? */
     for (auto i = opFlags.begin(); i != opFlags.end(); ++i)
         if (*i == "--print-roots") printRoots = true;
+        else if (*i == "--print-plan") printPlan = true;
         else if (*i == "--print-live") options.action = GCOptions::gcReturnLive;
         else if (*i == "--print-dead") options.action = GCOptions::gcReturnDead;
         else if (*i == "--delete") options.action = GCOptions::gcDeleteDead;
@@ -601,6 +607,31 @@ static void opGC(Strings opFlags, Strings opArgs)
             std::cout << link << " -> " << target << "\n";
     }
 
+    else if (printPlan) {
+        auto plan = store->planGarbage(false);
+        JSONObject json(std::cout);
+        json.attr("deadSize", plan.deadSize);
+        json.attr("liveSize", plan.liveSize);
+        {
+            auto roots = json.object("roots");
+            for (auto & [path, root] : plan.roots) {
+                auto obj = roots.object(path);
+                {
+                    auto links = obj.list("links");
+                    for (auto & link : root.links)
+                        links.elem(link);
+                }
+                obj.attr("closureSize", root.closureSize);
+                obj.attr("exclusiveSize", root.exclusiveSize);
+            }
+        }
+        {
+            auto dead = json.object("dead");
+            for (auto & [path, narSize] : plan.dead)
+                dead.attr(path, narSize);
+        }
+    }
+
     else {
         PrintFreed freed(options.action == GCOptions::gcDeleteDead, results);
         store->collectGarbage(options, results);
@@ -661,14 +692,17 @@ static void opRestore(Strings opFlags, Strings opArgs)
 
 static void opExport(Strings opFlags, Strings opArgs)
 {
+    bool index = false;
+
     for (auto & i : opFlags)
-        throw UsageError(format("unknown flag '%1%'") % i);
+        if (i == "--index") index = true;
+        else throw UsageError(format("unknown flag '%1%'") % i);
 
     for (auto & i : opArgs)
         i = store->followLinksToStorePath(i);
 
     FdSink sink(STDOUT_FILENO);
-    store->exportPaths(opArgs, sink);
+    store->exportPaths(opArgs, sink, index);
     sink.flush();
 }
 
@@ -678,10 +712,11 @@ static void opImport(Strings opFlags, Strings opArgs)
     for (auto & i : opFlags)
         throw UsageError(format("unknown flag '%1%'") % i);
 
-    if (!opArgs.empty()) throw UsageError("no arguments expected");
+    PathSet only;
+    for (auto & i : opArgs)
+        only.insert(store->followLinksToStorePath(i));
 
-    FdSource source(STDIN_FILENO);
-    Paths paths = store->importPaths(source, nullptr, NoCheckSigs);
+    Paths paths = store->importPathsFromFile(STDIN_FILENO, only, NoCheckSigs);
 
     for (auto & i : paths)
         cout << format("%1%\n") % i << std::flush;
@@ -790,6 +825,10 @@ static void opServe(Strings opFlags, Strings opArgs)
     out.flush();
     unsigned int clientVersion = readInt(in);
 
+    /* The compression method of the NARs sent by cmdDumpStorePath and
+       cmdAddToStoreNar, if the client asked for one. */
+    std::string narCompression;
+
     auto getBuildSettings = [&]() {
         // FIXME: changing options here doesn't work if we're
         // building through the daemon.
@@ -823,8 +862,7 @@ static void opServe(Strings opFlags, Strings opArgs)
                 bool substitute = readInt(in);
                 PathSet paths = readStorePaths<PathSet>(*store, in);
                 if (lock && writeAllowed)
-                    for (auto & path : paths)
-                        store->addTempRoot(path);
+                    store->addTempRoots(paths);
 
                 /* If requested, substitute missing paths. This
                    implements nix-copy-closure's --use-substitutes
@@ -871,9 +909,16 @@ static void opServe(Strings opFlags, Strings opArgs)
                 break;
             }
 
-            case cmdDumpStorePath:
-                store->narFromPath(readStorePath(*store, in), out);
+            case cmdDumpStorePath: {
+                auto path = readStorePath(*store, in);
+                if (narCompression.empty())
+                    store->narFromPath(path, out);
+                else
+                    writeCompressedFrames(narCompression, out, [&](Sink & sink) {
+                        store->narFromPath(path, sink);
+                    });
                 break;
+            }
 
             case cmdImportPaths: {
                 if (!writeAllowed) throw Error("importing paths is not allowed");
@@ -950,14 +995,40 @@ static void opServe(Strings opFlags, Strings opArgs)
                 info.sigs = readStrings<StringSet>(in);
                 in >> info.ca;
 
-                // FIXME: race if addToStore doesn't read source?
-                store->addToStore(info, in, NoRepair, NoCheckSigs);
+                if (narCompression.empty())
+                    // FIXME: race if addToStore doesn't read source?
+                    store->addToStore(info, in, NoRepair, NoCheckSigs);
+                else {
+                    /* Decompress in a separate thread, in parallel
+                       with unpacking. */
+                    auto source = sinkToSourceThreaded([&](Sink & sink) {
+                        readCompressedFrames(narCompression, in, sink);
+                    });
+                    store->addToStore(info, *source, NoRepair, NoCheckSigs);
+                    /* Make sure all frames have been read. */
+                    source->drain();
+                }
 
                 out << 1; // indicate success
 
                 break;
             }
 
+            case cmdSetNarCompression: {
+                auto method = readString(in);
+                bool supported = true;
+                try {
+                    StringSink sink;
+                    makeCompressionSink(method, sink);
+                    makeDecompressionSink(method, sink);
+                } catch (UnknownCompressionMethod &) {
+                    supported = false;
+                }
+                narCompression = supported && method != "none" ? method : "";
+                out << supported;
+                break;
+            }
+
             default:
                 throw Error(format("unknown serve command %1%") % cmd);
         }
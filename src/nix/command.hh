@@ -84,6 +84,12 @@ struct SourceExprCommand : virtual Args, StoreCommand, MixEvalArgs
        = import ...; bla = import ...; }’. */
     Value * getSourceExpr(EvalState & state);
 
+    /* Return the source expression, called with the automatic
+       arguments if it's a function. This is shared by all
+       installables, so that e.g. the Nixpkgs fixpoint is only set
+       up once. */
+    Value * getRootValue(EvalState & state);
+
     ref<EvalState> getEvalState();
 
 private:
@@ -91,6 +97,8 @@ private:
     std::shared_ptr<EvalState> evalState;
 
     Value * vSourceExpr = 0;
+
+    Value * vRoot = 0;
 };
 
 enum RealiseMode { Build, NoBuild, DryRun };
@@ -1,9 +1,20 @@
 #include "command.hh"
+#include "common-args.hh"
+#include "json.hh"
+#include "references.hh"
 #include "serve-protocol.hh"
 #include "shared.hh"
 #include "store-api.hh"
 #include "worker-protocol.hh"
 
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#if __linux__
+#include <sched.h>
+#endif
+
 using namespace nix;
 
 std::string formatProtocol(unsigned int proto)
@@ -16,9 +27,61 @@ std::string formatProtocol(unsigned int proto)
     return "unknown";
 }
 
-struct CmdDoctor : StoreCommand
+/* Run `fun' `n' times and return the median of the durations in
+   milliseconds. */
+static double measure(unsigned int n, std::function<void()> fun)
+{
+    std::vector<double> times;
+    for (unsigned int i = 0; i < n; ++i) {
+        checkInterrupt();
+        auto before = std::chrono::steady_clock::now();
+        fun();
+        times.push_back(std::chrono::duration<double, std::milli>(
+            std::chrono::steady_clock::now() - before).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+/* A store path that doesn't exist, so that querying it isn't answered
+   from a cache. */
+static Path probePath(Store & store)
+{
+    static std::atomic<unsigned int> counter{0};
+    return store.makeStorePath("doctor",
+        hashString(htSHA256, fmt("%d-%d-%d", getpid(), time(0), counter++)), "probe");
+}
+
+/* The measurements made by `nix doctor --perf'. Times are in
+   milliseconds and throughputs in bytes per second. */
+struct PerfReport
+{
+    struct Substituter
+    {
+        std::string uri;
+        std::optional<double> narInfoLatency;
+        std::optional<double> downloadThroughput;
+        std::string error;
+    };
+
+    std::string storeUri;
+    std::optional<double> connectTime, queryLatency;
+    std::string storeError;
+    std::vector<Substituter> substituters;
+    double hashThroughput = 0, refScanThroughput = 0;
+    std::optional<double> sandboxSetupTime;
+    std::string sandboxError;
+};
+
+struct CmdDoctor : StoreCommand, MixJSON
 {
     bool success = true;
+    bool perf = false;
+
+    CmdDoctor()
+    {
+        mkFlag(0, "perf", "measure the performance of the store, the substituters and this machine", &perf);
+    }
 
     std::string name() override
     {
@@ -32,6 +95,15 @@ struct CmdDoctor : StoreCommand
 
     void run(ref<Store> store) override
     {
+        if (perf) {
+            auto report = measurePerf(store);
+            if (json)
+                printPerfJSON(report);
+            else
+                printPerf(report);
+            return;
+        }
+
         std::cout << "Store uri: " << store->getUri() << std::endl;
         std::cout << std::endl;
 
@@ -119,6 +191,180 @@ struct CmdDoctor : StoreCommand
 
         return true;
     }
+
+    PerfReport measurePerf(ref<Store> store)
+    {
+        PerfReport report;
+        report.storeUri = store->getUri();
+
+        /* The time to open a new connection to the store (for the
+           daemon, including the handshake), and the latency of a
+           query that has to go to the database. */
+        try {
+            report.connectTime = measure(5, [&]() {
+                openStore(report.storeUri)->getProtocol();
+            });
+            report.queryLatency = measure(20, [&]() {
+                store->isValidPath(probePath(*store));
+            });
+        } catch (Error & e) {
+            report.storeError = e.msg();
+        }
+
+        /* Paths to download from the substituters: the closure of
+           Nix itself, if it's in the store. */
+        PathSet candidates;
+        try {
+            auto nixBin = canonPath(settings.nixBinDir, true);
+            if (store->isInStore(nixBin))
+                store->computeFSClosure(store->toStorePath(nixBin), candidates);
+        } catch (Error &) { }
+
+        for (auto & sub : getDefaultSubstituters()) {
+            PerfReport::Substituter res;
+            res.uri = sub->getUri();
+            try {
+                /* The first query also fetches nix-cache-info. */
+                sub->isValidPath(probePath(*sub));
+                res.narInfoLatency = measure(5, [&]() {
+                    sub->isValidPath(probePath(*sub));
+                });
+
+                /* Download the largest NAR of at most 64 MiB that the
+                   substituter has. */
+                std::shared_ptr<const ValidPathInfo> best;
+                for (auto & path : sub->queryValidPaths(candidates)) {
+                    auto info = sub->queryPathInfo(path);
+                    if (info->narSize <= 64 * 1024 * 1024 && (!best || info->narSize > best->narSize))
+                        best = info;
+                }
+
+                if (best) {
+                    uint64_t bytes = 0;
+                    LambdaSink sink([&](const unsigned char * data, size_t len) {
+                        bytes += len;
+                    });
+                    auto time = measure(1, [&]() { sub->narFromPath(best->path, sink); });
+                    res.downloadThroughput = bytes / (time / 1000);
+                }
+            } catch (Error & e) {
+                res.error = e.msg();
+            }
+            report.substituters.push_back(res);
+        }
+
+        /* Hashing and reference scanning throughput, as used when
+           adding paths to the store and after builds. */
+        std::string data(64 * 1024 * 1024, 0);
+        std::mt19937_64 gen(1);
+        for (size_t i = 0; i + 8 <= data.size(); i += 8) {
+            auto n = gen();
+            memcpy(&data[i], &n, 8);
+        }
+
+        report.hashThroughput = data.size() / (measure(3, [&]() {
+            hashString(htSHA256, data);
+        }) / 1000);
+
+        StringSet hashes;
+        for (unsigned int i = 0; i < 1000; ++i)
+            hashes.insert(storePathToHash(probePath(*store)));
+        RefScanner scanner(hashes);
+        report.refScanThroughput = data.size() / (measure(3, [&]() {
+            scanner.scan(data);
+        }) / 1000);
+
+#if __linux__
+        /* The time to create the namespaces that a sandboxed build
+           runs in. */
+        try {
+            report.sandboxSetupTime = measure(5, [&]() {
+                Pid pid = startProcess([&]() {
+                    int flags = CLONE_NEWNS | CLONE_NEWPID | CLONE_NEWNET | CLONE_NEWIPC | CLONE_NEWUTS;
+                    if (getuid() != 0) flags |= CLONE_NEWUSER;
+                    if (unshare(flags) == -1)
+                        throw SysError("creating namespaces");
+                    _exit(0);
+                });
+                int status = pid.wait();
+                if (!statusOk(status))
+                    throw Error("cannot set up a sandbox: %s", statusToString(status));
+            });
+        } catch (Error & e) {
+            report.sandboxError = e.msg();
+        }
+#else
+        report.sandboxError = "not supported on this platform";
+#endif
+
+        return report;
+    }
+
+    void printPerf(const PerfReport & report)
+    {
+        auto ms = [](std::optional<double> t) {
+            return t ? fmt("%.2f ms", *t) : "-";
+        };
+
+        auto mbps = [](std::optional<double> t) {
+            return t ? fmt("%.1f MiB/s", *t / (1024 * 1024)) : "-";
+        };
+
+        std::cout << "Store uri: " << report.storeUri << std::endl;
+        if (report.storeError != "")
+            std::cout << "  error: " << report.storeError << std::endl;
+        std::cout << "  connection setup: " << ms(report.connectTime) << std::endl;
+        std::cout << "  query latency: " << ms(report.queryLatency) << std::endl;
+        std::cout << std::endl;
+
+        for (auto & sub : report.substituters) {
+            std::cout << "Substituter: " << sub.uri << std::endl;
+            if (sub.error != "")
+                std::cout << "  error: " << sub.error << std::endl;
+            std::cout << "  narinfo latency: " << ms(sub.narInfoLatency) << std::endl;
+            std::cout << "  download throughput: " << mbps(sub.downloadThroughput) << std::endl;
+            std::cout << std::endl;
+        }
+
+        std::cout << "SHA-256 throughput: " << mbps(report.hashThroughput) << std::endl;
+        std::cout << "Reference scan throughput: " << mbps(report.refScanThroughput) << std::endl;
+        std::cout << "Sandbox setup: " << ms(report.sandboxSetupTime);
+        if (report.sandboxError != "") std::cout << " (" << report.sandboxError << ")";
+        std::cout << std::endl;
+    }
+
+    void printPerfJSON(const PerfReport & report)
+    {
+        auto optional = [](JSONObject & obj, const std::string & name, std::optional<double> v) {
+            if (v) obj.attr(name, *v); else obj.attr(name, nullptr);
+        };
+
+        JSONObject json(std::cout);
+
+        {
+            auto obj = json.object("store");
+            obj.attr("uri", report.storeUri);
+            optional(obj, "connectTime", report.connectTime);
+            optional(obj, "queryLatency", report.queryLatency);
+            if (report.storeError != "") obj.attr("error", report.storeError);
+        }
+
+        {
+            auto list = json.list("substituters");
+            for (auto & sub : report.substituters) {
+                auto obj = list.object();
+                obj.attr("uri", sub.uri);
+                optional(obj, "narInfoLatency", sub.narInfoLatency);
+                optional(obj, "downloadThroughput", sub.downloadThroughput);
+                if (sub.error != "") obj.attr("error", sub.error);
+            }
+        }
+
+        json.attr("hashThroughput", report.hashThroughput);
+        json.attr("refScanThroughput", report.refScanThroughput);
+        optional(json, "sandboxSetupTime", report.sandboxSetupTime);
+        if (report.sandboxError != "") json.attr("sandboxError", report.sandboxError);
+    }
 };
 
 static RegisterCommand r1(make_ref<CmdDoctor>());
@@ -0,0 +1,36 @@
+#include "command.hh"
+#include "shared.hh"
+#include "store-api.hh"
+#include "eval-server.hh"
+
+using namespace nix;
+
+struct CmdEvalServer : StoreCommand
+{
+    std::string name() override
+    {
+        return "eval-server";
+    }
+
+    std::string description() override
+    {
+        return "keep evaluated Nix expressions in memory to answer nix-instantiate requests";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To let nix-instantiate use a resident evaluator:",
+                "nix eval-server & nix-instantiate --option eval-server true '<nixpkgs>' -A hello"
+            },
+        };
+    }
+
+    void run(ref<Store> store) override
+    {
+        runEvalServer(store);
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdEvalServer>());
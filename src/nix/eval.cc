@@ -4,6 +4,7 @@
 #include "store-api.hh"
 #include "eval.hh"
 #include "json.hh"
+#include "serialise.hh"
 #include "value-to-json.hh"
 #include "progress-bar.hh"
 
@@ -65,8 +66,10 @@ struct CmdEval : MixJSON, InstallableCommand
         if (raw) {
             std::cout << state->coerceToString(noPos, *v, context);
         } else if (json) {
-            JSONPlaceholder jsonOut(std::cout);
-            printValueAsJSON(*state, true, *v, jsonOut, context);
+            FdSink sink(STDOUT_FILENO);
+            SinkStream out(sink);
+            printValueAsJSON(*state, true, *v, out, context);
+            sink.flush();
         } else {
             state->forceValueDeep(*v);
             std::cout << *v << "\n";
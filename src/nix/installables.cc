@@ -8,6 +8,7 @@
 #include "store-api.hh"
 #include "shared.hh"
 
+#include <chrono>
 #include <regex>
 
 namespace nix {
@@ -71,6 +72,18 @@ Value * SourceExprCommand::getSourceExpr(EvalState & state)
     return vSourceExpr;
 }
 
+Value * SourceExprCommand::getRootValue(EvalState & state)
+{
+    if (vRoot) return vRoot;
+
+    auto source = getSourceExpr(state);
+
+    vRoot = state.allocValue();
+    state.autoCallFunction(*getAutoArgs(state), *source, *vRoot);
+
+    return vRoot;
+}
+
 ref<EvalState> SourceExprCommand::getEvalState()
 {
     if (!evalState)
@@ -175,11 +188,11 @@ struct InstallableAttrPath : InstallableValue
 
     Value * toValue(EvalState & state) override
     {
-        auto source = cmd.getSourceExpr(state);
+        auto root = cmd.getRootValue(state);
 
         Bindings & autoArgs = *cmd.getAutoArgs(state);
 
-        Value * v = findAlongAttrPath(state, attrPath, autoArgs, *source);
+        Value * v = findAlongAttrPath(state, attrPath, autoArgs, *root);
         state.forceValue(*v);
 
         return v;
@@ -233,12 +246,49 @@ std::shared_ptr<Installable> parseInstallable(
     return installables.front();
 }
 
+/* Evaluate the attribute path installables concurrently, up to their
+   derivation paths. Failures are ignored here; they're reported when
+   toBuildables() looks up the attribute path again, which then mostly
+   finds forced values since the root is shared. */
+static void evalInstallables(std::vector<std::shared_ptr<Installable>> & installables)
+{
+    std::vector<InstallableAttrPath *> values;
+    for (auto & i : installables)
+        if (auto i2 = std::dynamic_pointer_cast<InstallableAttrPath>(i))
+            values.push_back(i2.get());
+
+    if (values.empty()) return;
+
+    auto state = values.front()->cmd.getEvalState();
+
+    /* Set up the shared root before going parallel. */
+    values.front()->cmd.getRootValue(*state);
+
+    state->forceParallel(values.size(), [&](size_t n) {
+        auto i = values[n];
+        auto before = std::chrono::steady_clock::now();
+
+        auto v = i->toValue(*state);
+        state->forceValue(*v);
+        if (state->isDerivation(*v)) {
+            auto j = v->attrs->find(state->sDrvPath);
+            if (j != v->attrs->end()) state->forceValue(*j->value);
+        }
+
+        auto after = std::chrono::steady_clock::now();
+        printInfo("evaluated '%s' in %.3f s", i->what(),
+            std::chrono::duration<double>(after - before).count());
+    });
+}
+
 Buildables build(ref<Store> store, RealiseMode mode,
     std::vector<std::shared_ptr<Installable>> installables)
 {
     if (mode != Build)
         settings.readOnlyMode = true;
 
+    evalInstallables(installables);
+
     Buildables buildables;
 
     PathSet pathsToBuild;
@@ -294,6 +344,8 @@ PathSet toDerivations(ref<Store> store,
 {
     PathSet drvPaths;
 
+    evalInstallables(installables);
+
     for (auto & i : installables)
         for (auto & b : i->toBuildables()) {
             if (b.drvPath.empty()) {
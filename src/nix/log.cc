@@ -51,16 +51,28 @@ struct CmdLog : InstallableCommand
         auto b = installable->toBuildable();
 
         RunPager pager;
+        FdSink out(STDOUT_FILENO);
+
         for (auto & sub : subs) {
-            auto log = b.drvPath != "" ? sub->getBuildLog(b.drvPath) : nullptr;
+            /* Stream the log to the pager as it's read rather than
+               loading it into memory first. */
+            bool started = false;
+            LambdaSink sink([&](const unsigned char * data, size_t len) {
+                if (!started) {
+                    stopProgressBar();
+                    printInfo("got build log for '%s' from '%s'", installable->what(), sub->getUri());
+                    started = true;
+                }
+                out(data, len);
+            });
+
+            bool found = b.drvPath != "" && sub->readBuildLog(b.drvPath, sink);
             for (auto & output : b.outputs) {
-                if (log) break;
-                log = sub->getBuildLog(output.second);
+                if (found) break;
+                found = sub->readBuildLog(output.second, sink);
             }
-            if (!log) continue;
-            stopProgressBar();
-            printInfo("got build log for '%s' from '%s'", installable->what(), sub->getUri());
-            std::cout << *log;
+            if (!found) continue;
+            out.flush();
             return;
         }
 
@@ -146,6 +146,11 @@ void mainWrapped(int argc, char * * argv)
 
     startProgressBar(args.printBuildLogs);
 
+    Finally f2([]() { stopTracing(); });
+
+    if (settings.traceFile != "")
+        startTracing(settings.traceFile);
+
     if (args.useNet && !haveInternet()) {
         warn("you don't have Internet access; disabling some network-dependent features");
         args.useNet = false;
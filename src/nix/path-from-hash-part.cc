@@ -0,0 +1,50 @@
+#include "command.hh"
+#include "shared.hh"
+#include "store-api.hh"
+
+using namespace nix;
+
+struct CmdPathFromHashPart : StoreCommand
+{
+    std::vector<std::string> hashParts;
+
+    CmdPathFromHashPart()
+    {
+        expectArgs("hash-parts", &hashParts);
+    }
+
+    std::string name() override
+    {
+        return "path-from-hash-part";
+    }
+
+    std::string description() override
+    {
+        return "print the store paths that have the given hash parts";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To get the full path of a store path from its hash part:",
+                "nix path-from-hash-part 0ilmyircbmnkxqq8rh5c4hc6zmgbnpha"
+            },
+        };
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto paths = store->queryPathsFromHashParts(
+            StringSet(hashParts.begin(), hashParts.end()));
+
+        for (auto & hashPart : hashParts) {
+            auto i = paths.find(hashPart);
+            if (i == paths.end())
+                throw Error("there is no store path with hash part '%s'", hashPart);
+            std::cout << i->second << "\n";
+        }
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdPathFromHashPart>());
@@ -89,6 +89,8 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
         for (auto & storePath : storePaths)
             pathLen = std::max(pathLen, storePath.size());
 
+        store->preloadPathInfoCache(PathSet(storePaths.begin(), storePaths.end()));
+
         if (json) {
             JSONPlaceholder jsonRoot(std::cout);
             store->pathInfoToJSON(jsonRoot,
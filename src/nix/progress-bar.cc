@@ -24,6 +24,13 @@ static uint64_t getI(const std::vector<Logger::Field> & fields, size_t n)
     return fields[n].i;
 }
 
+static std::string showDuration(uint64_t seconds)
+{
+    if (seconds < 60) return fmt("%ds", seconds);
+    if (seconds < 3600) return fmt("%dm", (seconds + 30) / 60);
+    return fmt("%dh%02dm", seconds / 3600, (seconds % 3600) / 60);
+}
+
 class ProgressBar : public Logger
 {
 private:
@@ -40,6 +47,8 @@ private:
         bool visible = true;
         ActivityId parent;
         std::optional<std::string> name;
+        std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+        uint64_t estimate = 0; // seconds
     };
 
     struct ActivitiesByType
@@ -61,8 +70,19 @@ private:
 
         uint64_t corruptedPaths = 0, untrustedPaths = 0;
 
+        /* For computing the rate at which paths are copied. */
+        struct
+        {
+            std::chrono::steady_clock::time_point time;
+            uint64_t bytes = 0;
+            double rate = 0;
+        } copyRate;
+
         bool active = true;
         bool haveUpdate = true;
+
+        /* The progress bar as last written to the terminal. */
+        std::string lastDrawn;
     };
 
     Sync<State> state_;
@@ -81,6 +101,8 @@ public:
         , isTTY(isTTY)
     {
         state_.lock()->active = isTTY;
+        /* Redraw at most every 50 ms, however many updates come in
+           between. */
         updateThread = std::thread([&]() {
             auto state(state_.lock());
             while (state->active) {
@@ -120,8 +142,10 @@ public:
     void log(State & state, Verbosity lvl, const std::string & s)
     {
         if (state.active) {
-            writeToStderr("\r\e[K" + s + ANSI_NORMAL "\n");
-            draw(state);
+            /* Put the progress bar back as it was; the update thread
+               will bring it up to date. */
+            writeToStderr("\r\e[K" + s + ANSI_NORMAL "\n" + state.lastDrawn);
+            update(state);
         } else {
             auto s2 = s + ANSI_NORMAL "\n";
             if (!isTTY) s2 = filterANSIEscapes(s2, true);
@@ -274,6 +298,13 @@ public:
             update(*state);
         }
 
+        else if (type == resSetEstimate) {
+            auto i = state->its.find(act);
+            assert(i != state->its.end());
+            i->second->estimate = getI(fields, 0);
+            update(*state);
+        }
+
         else if (type == resSetExpected) {
             auto i = state->its.find(act);
             assert(i != state->its.end());
@@ -289,6 +320,7 @@ public:
 
     void update(State & state)
     {
+        if (state.haveUpdate) return;
         state.haveUpdate = true;
         updateCV.notify_one();
     }
@@ -321,6 +353,13 @@ public:
                     line += i->phase;
                     line += ")";
                 }
+                if (i->estimate) {
+                    auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(
+                        std::chrono::steady_clock::now() - i->startTime).count();
+                    line += elapsed < (int64_t) i->estimate
+                        ? fmt(" (~%s left)", showDuration(i->estimate - elapsed))
+                        : " (overdue)";
+                }
                 if (!i->lastLine.empty()) {
                     if (!i->s.empty()) line += ": ";
                     line += i->lastLine;
@@ -331,7 +370,40 @@ public:
         auto width = getWindowSize().second;
         if (width <= 0) std::numeric_limits<decltype(width)>::max();
 
-        writeToStderr("\r" + filterANSIEscapes(line, false, width) + "\e[K");
+        auto s = "\r" + filterANSIEscapes(line, false, width) + "\e[K";
+        if (s == state.lastDrawn) return;
+        writeToStderr(s);
+        state.lastDrawn = std::move(s);
+    }
+
+    /* Return the rate in bytes per second at which paths have been
+       copied recently, smoothed over updates at least a second
+       apart. */
+    double getCopyRate(State & state)
+    {
+        auto & act = state.activitiesByType[actCopyPath];
+        uint64_t bytes = act.done;
+        for (auto & j : act.its)
+            bytes += j.second->done;
+
+        auto now = std::chrono::steady_clock::now();
+        auto & r(state.copyRate);
+
+        if (r.time == std::chrono::steady_clock::time_point() || bytes < r.bytes) {
+            r.time = now;
+            r.bytes = bytes;
+            r.rate = 0;
+        } else {
+            auto elapsed = std::chrono::duration<double>(now - r.time).count();
+            if (elapsed >= 1) {
+                auto rate = (bytes - r.bytes) / elapsed;
+                r.rate = r.rate ? (r.rate + rate) / 2 : rate;
+                r.time = now;
+                r.bytes = bytes;
+            }
+        }
+
+        return r.rate;
     }
 
     std::string getStatus(State & state)
@@ -388,13 +460,32 @@ public:
 
         showActivity(actBuilds, "%s built");
 
+        {
+            /* The build worker's estimate of the remaining build
+               time. */
+            uint64_t estimate = 0;
+            for (auto & j : state.activitiesByType[actBuilds].its)
+                estimate = std::max(estimate, j.second->estimate);
+            if (estimate) {
+                if (!res.empty()) res += ", ";
+                res += fmt("ETA %s", showDuration(estimate));
+            }
+        }
+
         auto s1 = renderActivity(actCopyPaths, "%s copied");
         auto s2 = renderActivity(actCopyPath, "%s MiB", "%.1f", MiB);
 
         if (!s1.empty() || !s2.empty()) {
             if (!res.empty()) res += ", ";
             if (s1.empty()) res += "0 copied"; else res += s1;
-            if (!s2.empty()) { res += " ("; res += s2; res += ')'; }
+            if (!s2.empty()) {
+                res += " (";
+                res += s2;
+                auto rate = getCopyRate(state);
+                if (rate >= 0.1 * MiB)
+                    res += fmt(" at %.1f MiB/s", rate / MiB);
+                res += ')';
+            }
         }
 
         showActivity(actDownload, "%s MiB DL", "%.1f", MiB);
@@ -4,6 +4,11 @@
 #include <climits>
 
 #include <setjmp.h>
+#include <thread>
+#include <atomic>
+
+#include <fcntl.h>
+#include <sys/wait.h>
 
 #ifdef READLINE
 #include <readline/history.h>
@@ -30,6 +35,7 @@ extern "C" {
 #include "globals.hh"
 #include "command.hh"
 #include "finally.hh"
+#include "sync.hh"
 
 namespace nix {
 
@@ -57,6 +63,46 @@ struct NixRepl
 
     const Path historyFile;
 
+    /* Files are loaded on a background thread while the repl waits
+       for input.  The loads are finished on the main thread (see
+       finishLoads()) before the next command is processed, reusing
+       whatever the background thread managed to evaluate. */
+    struct PendingLoad
+    {
+        Path path;
+        Value * value = nullptr; // set once loaded
+    };
+
+#if HAVE_BOEHMGC
+    typedef std::list<PendingLoad, traceable_allocator<PendingLoad>> PendingLoads;
+#else
+    typedef std::list<PendingLoad> PendingLoads;
+#endif
+
+    PendingLoads pendingLoads;
+
+    std::thread backgroundThread;
+    std::atomic<bool> backgroundStop{false};
+
+    /* The names of the attributes of sets that have been evaluated,
+       keyed by the expression denoting the set ("" for the scope
+       added by pending loads), for completion. */
+    Sync<std::map<string, StringSet>> completionIndex;
+
+    /* Builds started by ':b', which run in the background. */
+    struct Build
+    {
+        unsigned int id;
+        Path drvPath;
+        Path logFile;
+        Pid pid;
+    };
+
+    std::list<Build> builds;
+    unsigned int nrBuilds = 0;
+    Path buildLogDir;
+    std::unique_ptr<AutoDelete> delBuildLogDir;
+
     NixRepl(const Strings & searchPath, nix::ref<Store> store);
     ~NixRepl();
     void mainLoop(const std::vector<std::string> & files);
@@ -67,6 +113,13 @@ struct NixRepl
     void loadFile(const Path & path);
     void initEnv();
     void reloadFiles();
+    void startBackground();
+    void stopBackground();
+    void finishLoads();
+    void indexValue(const string & expr, Value & v, unsigned int depth);
+    void startBuild(const Path & drvPath);
+    void reapBuilds();
+    void showBuilds();
     void addAttrsToScope(Value & attrs);
     void addVarToScope(const Symbol & name, Value & v);
     Expr * parseString(string s);
@@ -132,6 +185,7 @@ NixRepl::NixRepl(const Strings & searchPath, nix::ref<Store> store)
 
 NixRepl::~NixRepl()
 {
+    stopBackground();
     write_history(historyFile.c_str());
 }
 
@@ -217,7 +271,6 @@ void NixRepl::mainLoop(const std::vector<std::string> & files)
         loadedFiles.push_back(i);
 
     reloadFiles();
-    if (!loadedFiles.empty()) std::cout << std::endl;
 
     // Allow nix-repl specific settings in .inputrc
     rl_readline_name = "nix-repl";
@@ -235,11 +288,29 @@ void NixRepl::mainLoop(const std::vector<std::string> & files)
     std::string input;
 
     while (true) {
+        reapBuilds();
+
+        /* Evaluate in the background while we wait for input. */
+        startBackground();
+
         // When continuing input from previous lines, don't print a prompt, just align to the same
         // number of chars as the prompt.
         if (!getLine(input, input.empty() ? "nix-repl> " : "          "))
             break;
 
+        stopBackground();
+
+        /* Finish the loads before running the command.  A load that
+           fails is reported, but the command still runs. */
+        if (!removeWhitespace(input).empty())
+            try {
+                finishLoads();
+            } catch (Error & e) {
+                printMsg(lvlError, format(error + "%1%%2%") % (settings.showTrace ? e.prefix() : "") % e.msg());
+            } catch (Interrupted & e) {
+                printMsg(lvlError, format(error + "%1%%2%") % (settings.showTrace ? e.prefix() : "") % e.msg());
+            }
+
         try {
             if (!removeWhitespace(input).empty() && !processLine(input)) return;
         } catch (ParseError & e) {
@@ -335,30 +406,57 @@ StringSet NixRepl::completePrefix(string prefix)
         } catch (Error &) {
         }
     } else if ((dot = cur.rfind('.')) == string::npos) {
-        /* This is a variable name; look it up in the current scope. */
-        StringSet::iterator i = varNames.lower_bound(cur);
-        while (i != varNames.end()) {
-            if (string(*i, 0, cur.size()) != cur) break;
-            completions.insert(prev + *i);
-            i++;
+        /* This is a variable name; look it up in the current scope,
+           and in the files that are still being loaded. */
+        auto complete = [&](const StringSet & names) {
+            StringSet::iterator i = names.lower_bound(cur);
+            while (i != names.end()) {
+                if (string(*i, 0, cur.size()) != cur) break;
+                completions.insert(prev + *i);
+                i++;
+            }
+        };
+        complete(varNames);
+        if (!pendingLoads.empty()) {
+            auto index(completionIndex.lock());
+            auto i = index->find("");
+            if (i != index->end()) complete(i->second);
         }
     } else {
         try {
             /* This is an expression that should evaluate to an
-               attribute set.  Evaluate it to get the names of the
-               attributes. */
+               attribute set.  Use the names in the completion index,
+               if it has been evaluated already; otherwise evaluate it
+               to get the names of the attributes. */
             string expr(cur, 0, dot);
             string cur2 = string(cur, dot + 1);
 
-            Expr * e = parseString(expr);
-            Value v;
-            e->eval(state, *env, v);
-            state.forceAttrs(v);
+            StringSet names;
+            bool found;
+            {
+                auto index(completionIndex.lock());
+                auto i = index->find(expr);
+                found = i != index->end();
+                if (found) names = i->second;
+            }
 
-            for (auto & i : *v.attrs) {
-                string name = i.name;
-                if (string(name, 0, cur2.size()) != cur2) continue;
-                completions.insert(prev + expr + "." + name);
+            if (!found) {
+                stopBackground();
+                finishLoads();
+                Expr * e = parseString(expr);
+                Value v;
+                e->eval(state, *env, v);
+                state.forceAttrs(v);
+                indexValue(expr, v, 1);
+                for (auto & i : *v.attrs)
+                    names.insert(i.name);
+            }
+
+            StringSet::iterator i = names.lower_bound(cur2);
+            while (i != names.end()) {
+                if (string(*i, 0, cur2.size()) != cur2) break;
+                completions.insert(prev + expr + "." + *i);
+                i++;
             }
 
         } catch (ParseError & e) {
@@ -439,8 +537,9 @@ bool NixRepl::processLine(string line)
              << "  <expr>        Evaluate and print expression\n"
              << "  <x> = <expr>  Bind expression to variable\n"
              << "  :a <expr>     Add attributes from resulting set to scope\n"
-             << "  :b <expr>     Build derivation\n"
+             << "  :b <expr>     Build derivation in the background\n"
              << "  :i <expr>     Build derivation, then install result into current profile\n"
+             << "  :j            Show the progress of background builds\n"
              << "  :l <path>     Load Nix expression and add it to scope\n"
              << "  :p <expr>     Evaluate and print expression recursively\n"
              << "  :q            Exit nix-repl\n"
@@ -458,7 +557,8 @@ bool NixRepl::processLine(string line)
 
     else if (command == ":l" || command == ":load") {
         state.resetFileCache();
-        loadFile(arg);
+        std::cout << format("Loading '%1%' in the background...") % arg << std::endl;
+        pendingLoads.push_back({arg});
     }
 
     else if (command == ":r" || command == ":reload") {
@@ -486,23 +586,20 @@ bool NixRepl::processLine(string line)
         evalString(arg, v);
         Path drvPath = getDerivationPath(v);
 
-        if (command == ":b") {
-            /* We could do the build in this process using buildPaths(),
-               but doing it in a child makes it easier to recover from
-               problems / SIGINT. */
-            if (runProgram(settings.nixBinDir + "/nix", Strings{"build", "--no-link", drvPath}) == 0) {
-                Derivation drv = readDerivation(drvPath);
-                std::cout << std::endl << "this derivation produced the following outputs:" << std::endl;
-                for (auto & i : drv.outputs)
-                    std::cout << format("  %1% -> %2%") % i.first % i.second.path << std::endl;
-            }
-        } else if (command == ":i") {
+        if (command == ":b")
+            startBuild(drvPath);
+        else if (command == ":i") {
             runProgram(settings.nixBinDir + "/nix-env", Strings{"-i", drvPath});
         } else {
             runProgram(settings.nixBinDir + "/nix-shell", Strings{drvPath});
         }
     }
 
+    else if (command == ":j") {
+        reapBuilds();
+        showBuilds();
+    }
+
     else if (command == ":p" || command == ":print") {
         Value v;
         evalString(arg, v);
@@ -561,6 +658,9 @@ void NixRepl::initEnv()
     varNames.clear();
     for (auto & i : state.staticBaseEnv.vars)
         varNames.insert(i.first);
+
+    pendingLoads.clear();
+    completionIndex.lock()->clear();
 }
 
 
@@ -571,13 +671,182 @@ void NixRepl::reloadFiles()
     Strings old = loadedFiles;
     loadedFiles.clear();
 
-    bool first = true;
     for (auto & i : old) {
-        if (!first) std::cout << std::endl;
-        first = false;
-        std::cout << format("Loading '%1%'...") % i << std::endl;
-        loadFile(i);
+        std::cout << format("Loading '%1%' in the background...") % i << std::endl;
+        pendingLoads.push_back({i});
+    }
+}
+
+
+void NixRepl::startBackground()
+{
+    if (backgroundThread.joinable()) return;
+
+    backgroundStop = false;
+
+    backgroundThread = std::thread([&]() {
+        initEvalThread();
+        interruptCheck = [&]() { return (bool) backgroundStop; };
+
+        try {
+            for (auto & load : pendingLoads) {
+                if (load.value) continue;
+                Value v;
+                state.evalFile(lookupFileArg(state, load.path), v);
+                Value & v2(*state.allocValue());
+                state.autoCallFunction(*autoArgs, v, v2);
+                state.forceAttrs(v2);
+                load.value = &v2;
+                indexValue("", v2, 0);
+            }
+
+            /* Index the sets in scope that have been evaluated in the
+               meantime. */
+            for (auto & i : staticEnv.vars) {
+                if (backgroundStop) break;
+                indexValue(i.first, *env->values[i.second], 1);
+            }
+        } catch (Interrupted &) {
+        } catch (std::exception &) {
+            /* Failing loads will fail again on the main thread. */
+        }
+    });
+}
+
+
+void NixRepl::stopBackground()
+{
+    if (!backgroundThread.joinable()) return;
+    backgroundStop = true;
+    backgroundThread.join();
+}
+
+
+void NixRepl::finishLoads()
+{
+    while (!pendingLoads.empty()) {
+        auto load = pendingLoads.front();
+        pendingLoads.pop_front();
+        if (load.value) {
+            loadedFiles.remove(load.path);
+            loadedFiles.push_back(load.path);
+            addAttrsToScope(*load.value);
+        } else
+            loadFile(load.path);
+    }
+}
+
+
+/* Record the attribute names of `v' (if it's an evaluated set) and of
+   its evaluated subsets up to `depth' levels down, without forcing
+   anything.  The attributes of derivations are left out, since there
+   can be lots of them. */
+void NixRepl::indexValue(const string & expr, Value & v, unsigned int depth)
+{
+    if (v.type != tAttrs) return;
+
+    auto i = v.attrs->find(state.sType);
+    if (i != v.attrs->end() && i->value->type == tString && strcmp(i->value->string.s, "derivation") == 0)
+        return;
+
+    StringSet names;
+    for (auto & j : *v.attrs)
+        names.insert(j.name);
+
+    {
+        auto index(completionIndex.lock());
+        auto & names2((*index)[expr]);
+        if (expr.empty())
+            names2.insert(names.begin(), names.end());
+        else if (names2 == names)
+            return;
+        else
+            names2 = std::move(names);
+    }
+
+    if (depth)
+        for (auto & j : *v.attrs)
+            indexValue(expr.empty() ? (string) j.name : expr + "." + (string) j.name, *j.value, depth - 1);
+}
+
+
+void NixRepl::startBuild(const Path & drvPath)
+{
+    if (buildLogDir.empty()) {
+        buildLogDir = createTempDir("", "nix-repl");
+        delBuildLogDir = std::make_unique<AutoDelete>(buildLogDir, true);
     }
+
+    builds.emplace_back();
+    auto & build(builds.back());
+    build.id = ++nrBuilds;
+    build.drvPath = drvPath;
+    build.logFile = fmt("%s/%d.log", buildLogDir, build.id);
+
+    AutoCloseFD fd = open(build.logFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (!fd) throw SysError("creating '%s'", build.logFile);
+
+    /* We could do the build in this process using buildPaths(), but
+       doing it in a child makes it easier to recover from problems,
+       and lets the user continue meanwhile.  The child gets its own
+       process group so that SIGINT at the prompt doesn't kill it. */
+    build.pid = startProcess([&]() {
+        if (setpgid(0, 0) == -1)
+            throw SysError("creating a new process group");
+        if (dup2(fd.get(), STDOUT_FILENO) == -1 || dup2(fd.get(), STDERR_FILENO) == -1)
+            throw SysError("redirecting the build log");
+        restoreAffinity();
+        Strings args{"nix", "build", "--no-link", drvPath};
+        execv((settings.nixBinDir + "/nix").c_str(), stringsToCharPtrs(args).data());
+        throw SysError("executing 'nix'");
+    });
+    build.pid.setSeparatePG(true);
+
+    std::cout << format("[%1%] building '%2%' in the background") % build.id % drvPath << std::endl;
+}
+
+
+/* Return the last non-empty line of `s'. */
+static string lastLine(const string & s)
+{
+    auto lines = tokenizeString<std::vector<string>>(s, "\n\r");
+    return lines.empty() ? "" : lines.back();
+}
+
+
+void NixRepl::reapBuilds()
+{
+    for (auto i = builds.begin(); i != builds.end(); ) {
+        int status;
+        auto res = waitpid(i->pid, &status, WNOHANG);
+        if (res == 0) { ++i; continue; }
+        i->pid.release();
+
+        if (res != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+            Derivation drv = readDerivation(i->drvPath);
+            std::cout << format("[%1%] '%2%' produced the following outputs:") % i->id % i->drvPath << std::endl;
+            for (auto & j : drv.outputs)
+                std::cout << format("  %1% -> %2%") % j.first % j.second.path << std::endl;
+        } else {
+            std::cout << format("[%1%] building '%2%' failed; the log is in '%3%':")
+                % i->id % i->drvPath % i->logFile << std::endl;
+            auto log = tokenizeString<std::vector<string>>(readFile(i->logFile), "\n");
+            for (size_t n = log.size() > 10 ? log.size() - 10 : 0; n < log.size(); ++n)
+                std::cout << "  " << log[n] << std::endl;
+        }
+
+        i = builds.erase(i);
+    }
+}
+
+
+void NixRepl::showBuilds()
+{
+    if (builds.empty())
+        std::cout << "no builds are running" << std::endl;
+    for (auto & i : builds)
+        std::cout << format("[%1%] building '%2%': %3%")
+            % i.id % i.drvPath % lastLine(readFile(i.logFile)) << std::endl;
 }
 
 
@@ -6,11 +6,15 @@
 #include "get-drvs.hh"
 #include "common-args.hh"
 #include "json.hh"
-#include "json-to-value.hh"
 #include "shared.hh"
 
 #include <regex>
-#include <fstream>
+#include <optional>
+#include <string_view>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
 
 using namespace nix;
 
@@ -29,6 +33,201 @@ std::string hilite(const std::string & s, const std::smatch & m, std::string pos
           + std::string(m.suffix());
 }
 
+struct SearchEntry
+{
+    std::string attrPath, name, description;
+};
+
+/* The search cache is a binary file that can be used in place through
+   mmap().  It consists of a header, a table with the offset and
+   length of each entry's attribute path, name and description in the
+   string pool, a sorted table of trigrams occurring in the entries
+   (case-folded to lower case) with the start of their postings, the
+   postings (sorted entry numbers) themselves, and the string pool.
+   All integers are 32-bit in host byte order. */
+
+static const char searchIndexMagic[8] = {'N', 'I', 'X', 'S', 'R', 'C', 'H', 1};
+
+struct SearchIndexHeader
+{
+    char magic[8];
+    uint32_t nrEntries, nrTrigrams, nrPostings, stringsSize;
+};
+
+static uint32_t trigramAt(std::string_view s, size_t i)
+{
+    return
+        (uint32_t) (unsigned char) tolower(s[i]) << 16
+        | (uint32_t) (unsigned char) tolower(s[i + 1]) << 8
+        | (uint32_t) (unsigned char) tolower(s[i + 2]);
+}
+
+static std::string buildSearchIndex(const std::vector<SearchEntry> & entries)
+{
+    std::map<uint32_t, std::vector<uint32_t>> trigrams;
+    std::string strings;
+    std::vector<uint32_t> fields;
+
+    for (uint32_t n = 0; n < entries.size(); ++n) {
+        auto & e = entries[n];
+        for (auto s : {&e.attrPath, &e.name, &e.description}) {
+            fields.push_back(strings.size());
+            fields.push_back(s->size());
+            strings += *s;
+            for (size_t i = 0; i + 3 <= s->size(); ++i) {
+                auto & postings = trigrams[trigramAt(*s, i)];
+                if (postings.empty() || postings.back() != n)
+                    postings.push_back(n);
+            }
+        }
+    }
+
+    std::vector<uint32_t> keys, starts, postings;
+    for (auto & i : trigrams) {
+        keys.push_back(i.first);
+        starts.push_back(postings.size());
+        postings.insert(postings.end(), i.second.begin(), i.second.end());
+    }
+    starts.push_back(postings.size());
+
+    SearchIndexHeader header;
+    memcpy(header.magic, searchIndexMagic, sizeof(header.magic));
+    header.nrEntries = entries.size();
+    header.nrTrigrams = keys.size();
+    header.nrPostings = postings.size();
+    header.stringsSize = strings.size();
+
+    std::string res((char *) &header, sizeof(header));
+    for (auto v : {&fields, &keys, &starts, &postings})
+        res.append((char *) v->data(), v->size() * sizeof(uint32_t));
+    res += strings;
+    return res;
+}
+
+struct SearchIndex
+{
+    const SearchIndexHeader * header;
+    const uint32_t * fields, * keys, * starts, * postings;
+    const char * strings;
+
+    SearchIndex(const char * data, size_t size)
+    {
+        header = (const SearchIndexHeader *) data;
+        if (size < sizeof(SearchIndexHeader)
+            || memcmp(header->magic, searchIndexMagic, sizeof(header->magic)))
+            throw Error("search cache has an unsupported format");
+        fields = (const uint32_t *) (data + sizeof(SearchIndexHeader));
+        keys = fields + (size_t) header->nrEntries * 6;
+        starts = keys + header->nrTrigrams;
+        postings = starts + header->nrTrigrams + 1;
+        strings = (const char *) (postings + header->nrPostings);
+        if (strings + header->stringsSize != data + size)
+            throw Error("search cache is corrupt");
+        for (size_t i = 0; i < (size_t) header->nrEntries * 3; ++i)
+            if ((uint64_t) fields[i * 2] + fields[i * 2 + 1] > header->stringsSize)
+                throw Error("search cache is corrupt");
+    }
+
+    size_t size() const { return header->nrEntries; }
+
+    /* Field 0 is the attribute path, 1 the name and 2 the
+       description. */
+    std::string_view field(size_t n, size_t f) const
+    {
+        auto p = fields + n * 6 + f * 2;
+        return std::string_view(strings + p[0], p[1]);
+    }
+
+    std::vector<uint32_t> lookup(uint32_t trigram) const
+    {
+        auto i = std::lower_bound(keys, keys + header->nrTrigrams, trigram);
+        if (i == keys + header->nrTrigrams || *i != trigram) return {};
+        auto n = i - keys;
+        return std::vector<uint32_t>(postings + starts[n], postings + starts[n + 1]);
+    }
+};
+
+/* Return the trigrams that a string matching the extended regular
+   expression `re' must contain, as a list of alternatives, or nothing
+   if this is unknown.  Only alternations of plain literals of at
+   least three characters are handled, which covers most searches;
+   anything else is matched against every entry. */
+static std::optional<std::vector<std::vector<uint32_t>>> requiredTrigrams(const std::string & re)
+{
+    std::vector<std::vector<uint32_t>> res;
+    for (auto & branch : tokenizeString<Strings>(re, "|")) {
+        if (branch.size() < 3) return {};
+        for (auto c : branch)
+            if (!isalnum((unsigned char) c) && !strchr("-_ /,:;@=%!#~&'\"<>", c))
+                return {};
+        std::vector<uint32_t> trigrams;
+        for (size_t i = 0; i + 3 <= branch.size(); ++i)
+            trigrams.push_back(trigramAt(branch, i));
+        res.push_back(std::move(trigrams));
+    }
+    if (res.empty() || res.size() != (size_t) std::count(re.begin(), re.end(), '|') + 1)
+        return {};
+    return res;
+}
+
+static std::vector<uint32_t> intersect(const std::vector<uint32_t> & a, const std::vector<uint32_t> & b)
+{
+    std::vector<uint32_t> res;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(res));
+    return res;
+}
+
+/* Return the entries that may match all of `res'. */
+static std::vector<uint32_t> searchCandidates(const SearchIndex & index, const std::vector<std::string> & res)
+{
+    std::optional<std::vector<uint32_t>> candidates;
+
+    for (auto & re : res) {
+        auto alternatives = requiredTrigrams(re);
+        if (!alternatives) continue;
+        std::vector<uint32_t> matches;
+        for (auto & trigrams : *alternatives) {
+            auto m = index.lookup(trigrams[0]);
+            for (size_t i = 1; i < trigrams.size() && !m.empty(); ++i)
+                m = intersect(m, index.lookup(trigrams[i]));
+            std::vector<uint32_t> merged;
+            std::set_union(matches.begin(), matches.end(), m.begin(), m.end(), std::back_inserter(merged));
+            matches = std::move(merged);
+        }
+        candidates = candidates ? intersect(*candidates, matches) : matches;
+    }
+
+    if (candidates) return *candidates;
+
+    std::vector<uint32_t> all(index.size());
+    for (size_t i = 0; i < all.size(); ++i) all[i] = i;
+    return all;
+}
+
+struct MappedFile
+{
+    AutoCloseFD fd;
+    char * data = nullptr;
+    size_t size = 0;
+
+    MappedFile(const Path & path)
+    {
+        fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd) throw SysError("opening '%s'", path);
+        struct stat st;
+        if (fstat(fd.get(), &st)) throw SysError("statting '%s'", path);
+        size = st.st_size;
+        if (!size) return;
+        data = (char *) mmap(nullptr, size, PROT_READ, MAP_SHARED, fd.get(), 0);
+        if (data == MAP_FAILED) throw SysError("mmapping '%s'", path);
+    }
+
+    ~MappedFile()
+    {
+        if (data) munmap(data, size);
+    }
+};
+
 struct CmdSearch : SourceExprCommand, MixJSON
 {
     std::vector<std::string> res;
@@ -112,19 +311,18 @@ struct CmdSearch : SourceExprCommand, MixJSON
 
         auto sToplevel = state->symbols.create("_toplevel");
         auto sRecurse = state->symbols.create("recurseForDerivations");
-
-        bool fromCache = false;
+        auto sDescription = state->symbols.create("description");
 
         std::map<std::string, std::string> results;
 
-        std::function<void(Value *, std::string, bool, JSONObject *)> doExpr;
+        std::vector<SearchEntry> entries;
+
+        std::function<void(Value *, std::string, bool)> doExpr;
 
-        doExpr = [&](Value * v, std::string attrPath, bool toplevel, JSONObject * cache) {
+        doExpr = [&](Value * v, std::string attrPath, bool toplevel) {
             debug("at attribute '%s'", attrPath);
 
             try {
-                uint found = 0;
-
                 state->forceValue(*v);
 
                 if (v->type == tLambda && toplevel) {
@@ -135,63 +333,10 @@ struct CmdSearch : SourceExprCommand, MixJSON
                 }
 
                 if (state->isDerivation(*v)) {
-
                     DrvInfo drv(*state, attrPath, v->attrs);
-                    std::string description;
-                    std::smatch attrPathMatch;
-                    std::smatch descriptionMatch;
-                    std::smatch nameMatch;
-                    std::string name;
-
-                    DrvName parsed(drv.queryName());
-
-                    for (auto &regex : regexes) {
-                        std::regex_search(attrPath, attrPathMatch, regex);
-
-                        name = parsed.name;
-                        std::regex_search(name, nameMatch, regex);
-
-                        description = drv.queryMetaString("description");
-                        std::replace(description.begin(), description.end(), '\n', ' ');
-                        std::regex_search(description, descriptionMatch, regex);
-
-                        if (!attrPathMatch.empty()
-                            || !nameMatch.empty()
-                            || !descriptionMatch.empty())
-                        {
-                            found++;
-                        }
-                    }
-
-                    if (found == res.size()) {
-                        if (json) {
-
-                            auto jsonElem = jsonOut->object(attrPath);
-
-                            jsonElem.attr("pkgName", parsed.name);
-                            jsonElem.attr("version", parsed.version);
-                            jsonElem.attr("description", description);
-
-                        } else {
-                            auto name = hilite(parsed.name, nameMatch, "\e[0;2m")
-                                + std::string(parsed.fullName, parsed.name.length());
-                            results[attrPath] = fmt(
-                                "* %s (%s)\n  %s\n",
-                                wrap("\e[0;1m", hilite(attrPath, attrPathMatch, "\e[0;1m")),
-                                wrap("\e[0;2m", hilite(name, nameMatch, "\e[0;2m")),
-                                hilite(description, descriptionMatch, ANSI_NORMAL));
-                        }
-                    }
-
-                    if (cache) {
-                        cache->attr("type", "derivation");
-                        cache->attr("name", drv.queryName());
-                        cache->attr("system", drv.querySystem());
-                        if (description != "") {
-                            auto meta(cache->object("meta"));
-                            meta.attr("description", description);
-                        }
-                    }
+                    auto description = drv.queryMetaString("description");
+                    std::replace(description.begin(), description.end(), '\n', ' ');
+                    entries.push_back({attrPath, drv.queryName(), description});
                 }
 
                 else if (v->type == tAttrs) {
@@ -205,19 +350,32 @@ struct CmdSearch : SourceExprCommand, MixJSON
                         }
                     }
 
-                    bool toplevel2 = false;
-                    if (!fromCache) {
-                        Bindings::iterator j = v->attrs->find(sToplevel);
-                        toplevel2 = j != v->attrs->end() && state->forceBool(*j->value, *j->pos);
-                    }
-
-                    for (auto & i : *v->attrs) {
-                        auto cache2 =
-                            cache ? std::make_unique<JSONObject>(cache->object(i.name)) : nullptr;
+                    Bindings::iterator j = v->attrs->find(sToplevel);
+                    bool toplevel2 = j != v->attrs->end() && state->forceBool(*j->value, *j->pos);
+
+                    /* Evaluate the attributes in parallel, if enabled,
+                       including the names and descriptions of
+                       derivations. */
+                    auto attrs = v->attrs;
+                    state->forceParallel(attrs->size(), [&](size_t n) {
+                        auto & v2 = *(*attrs)[n].value;
+                        state->forceValue(v2);
+                        if (v2.type != tAttrs || !state->isDerivation(v2)) return;
+                        auto i = v2.attrs->find(state->sName);
+                        if (i != v2.attrs->end()) state->forceValue(*i->value);
+                        i = v2.attrs->find(state->sMeta);
+                        if (i == v2.attrs->end()) return;
+                        auto & meta = *i->value;
+                        state->forceValue(meta);
+                        if (meta.type != tAttrs) return;
+                        i = meta.attrs->find(sDescription);
+                        if (i != meta.attrs->end()) state->forceValue(*i->value);
+                    });
+
+                    for (auto & i : *v->attrs)
                         doExpr(i.value,
                             attrPath == "" ? (std::string) i.name : attrPath + "." + (std::string) i.name,
-                            toplevel2 || fromCache, cache2 ? cache2.get() : nullptr);
-                    }
+                            toplevel2);
                 }
 
             } catch (AssertionError & e) {
@@ -229,46 +387,80 @@ struct CmdSearch : SourceExprCommand, MixJSON
             }
         };
 
-        Path jsonCacheFileName = getCacheDir() + "/nix/package-search.json";
+        Path cacheFileName = getCacheDir() + "/nix/package-search.idx";
 
-        if (useCache && pathExists(jsonCacheFileName)) {
+        std::unique_ptr<MappedFile> cacheFile;
+        std::string data;
+        std::unique_ptr<SearchIndex> index;
 
-            warn("using cached results; pass '-u' to update the cache");
+        if (useCache && pathExists(cacheFileName)) {
+            cacheFile = std::make_unique<MappedFile>(cacheFileName);
+            try {
+                index = std::make_unique<SearchIndex>(cacheFile->data, cacheFile->size);
+                warn("using cached results; pass '-u' to update the cache");
+            } catch (Error & e) {
+                warn("%s; updating it", e.what());
+            }
+        }
 
-            Value vRoot;
-            parseJSON(*state, readFile(jsonCacheFileName), vRoot);
+        if (!index) {
+            doExpr(getSourceExpr(*state), "", true);
 
-            fromCache = true;
+            data = buildSearchIndex(entries);
+            index = std::make_unique<SearchIndex>(data.data(), data.size());
 
-            doExpr(&vRoot, "", true, nullptr);
+            if (writeCache) {
+                createDirs(dirOf(cacheFileName));
+                Path tmpFile = fmt("%s.tmp.%d", cacheFileName, getpid());
+                writeFile(tmpFile, data);
+                if (rename(tmpFile.c_str(), cacheFileName.c_str()) == -1)
+                    throw SysError("cannot rename '%s' to '%s'", tmpFile, cacheFileName);
+            }
         }
 
-        else {
-            createDirs(dirOf(jsonCacheFileName));
+        for (auto n : searchCandidates(*index, res)) {
+            std::string attrPath(index->field(n, 0));
+            DrvName parsed(std::string(index->field(n, 1)));
+            std::string description(index->field(n, 2));
+            std::smatch attrPathMatch;
+            std::smatch descriptionMatch;
+            std::smatch nameMatch;
+            std::string & name(parsed.name);
+
+            size_t found = 0;
+
+            for (auto &regex : regexes) {
+                std::regex_search(attrPath, attrPathMatch, regex);
+                std::regex_search(name, nameMatch, regex);
+                std::regex_search(description, descriptionMatch, regex);
+
+                if (!attrPathMatch.empty()
+                    || !nameMatch.empty()
+                    || !descriptionMatch.empty())
+                {
+                    found++;
+                }
+            }
 
-            Path tmpFile = fmt("%s.tmp.%d", jsonCacheFileName, getpid());
+            if (found != res.size()) continue;
 
-            std::ofstream jsonCacheFile;
+            if (json) {
 
-            try {
-                // iostream considered harmful
-                jsonCacheFile.exceptions(std::ofstream::failbit);
-                jsonCacheFile.open(tmpFile);
+                auto jsonElem = jsonOut->object(attrPath);
 
-                auto cache = writeCache ? std::make_unique<JSONObject>(jsonCacheFile, false) : nullptr;
+                jsonElem.attr("pkgName", parsed.name);
+                jsonElem.attr("version", parsed.version);
+                jsonElem.attr("description", description);
 
-                doExpr(getSourceExpr(*state), "", true, cache.get());
-
-            } catch (std::exception &) {
-                /* Fun fact: catching std::ios::failure does not work
-                   due to C++11 ABI shenanigans.
-                   https://gcc.gnu.org/bugzilla/show_bug.cgi?id=66145 */
-                if (!jsonCacheFile)
-                    throw Error("error writing to %s", tmpFile);
+            } else {
+                auto name = hilite(parsed.name, nameMatch, "\e[0;2m")
+                    + std::string(parsed.fullName, parsed.name.length());
+                results[attrPath] = fmt(
+                    "* %s (%s)\n  %s\n",
+                    wrap("\e[0;1m", hilite(attrPath, attrPathMatch, "\e[0;1m")),
+                    wrap("\e[0;2m", hilite(name, nameMatch, "\e[0;2m")),
+                    hilite(description, descriptionMatch, ANSI_NORMAL));
             }
-
-            if (writeCache && rename(tmpFile.c_str(), jsonCacheFileName.c_str()) == -1)
-                throw SysError("cannot rename '%s' to '%s'", tmpFile, jsonCacheFileName);
         }
 
         if (results.size() == 0)
@@ -0,0 +1,57 @@
+#include "command.hh"
+#include "json.hh"
+#include "package-table.hh"
+
+using namespace nix;
+
+struct CmdShowPackageTable : Command
+{
+    Path path;
+
+    CmdShowPackageTable()
+    {
+        expectArg("path", &path);
+    }
+
+    std::string name() override
+    {
+        return "show-package-table";
+    }
+
+    std::string description() override
+    {
+        return "show the contents of a package table as JSON";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To show a package table written by 'nix-env -qa --export':",
+                "nix show-package-table ./packages.table"
+            },
+        };
+    }
+
+    void run() override
+    {
+        PackageTable table(path);
+
+        /* Print a list with an object per row. Cells without a value
+           are left out of the object. */
+        {
+            JSONList jsonRoot(std::cout, true);
+
+            for (uint64_t row = 0; row < table.nrRows(); ++row) {
+                auto rowObj(jsonRoot.object());
+                for (size_t column = 0; column < table.nrColumns(); ++column)
+                    if (auto s = table.get(column, row))
+                        rowObj.attr(std::string(table.columnName(column)), std::string(*s));
+            }
+        }
+
+        std::cout << "\n";
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdShowPackageTable>());
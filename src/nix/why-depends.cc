@@ -1,8 +1,13 @@
 #include "command.hh"
 #include "store-api.hh"
+#include "local-store.hh"
+#include "refs-graph.hh"
 #include "progress-bar.hh"
 #include "fs-accessor.hh"
+#include "references.hh"
 #include "shared.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
 
 #include <queue>
 
@@ -80,8 +85,17 @@ struct CmdWhyDepends : SourceExprCommand
         auto dependencyPath = toStorePath(store, NoBuild, dependency);
         auto dependencyPathHash = storePathToHash(dependencyPath);
 
+        /* On a local store, use the reference graph if it's up to
+           date. */
+        std::shared_ptr<RefsGraph> refsGraph;
+        if (auto localStore = store.dynamic_pointer_cast<LocalStore>())
+            refsGraph = localStore->getRefsGraph(false);
+
         PathSet closure;
-        store->computeFSClosure({packagePath}, closure, false, false);
+        if (refsGraph)
+            refsGraph->computeClosure({packagePath}, closure);
+        else
+            store->computeFSClosure({packagePath}, closure, false, false);
 
         if (!closure.count(dependencyPath)) {
             printError("'%s' does not depend on '%s'", package->what(), dependency->what());
@@ -107,8 +121,14 @@ struct CmdWhyDepends : SourceExprCommand
 
         std::map<Path, Node> graph;
 
-        for (auto & path : closure)
-            graph.emplace(path, Node{path, store->queryPathInfo(path)->references});
+        for (auto & path : closure) {
+            PathSet refs;
+            if (refsGraph)
+                refsGraph->queryReferences(path, refs);
+            else
+                refs = store->queryPathInfo(path)->references;
+            graph.emplace(path, Node{path, refs});
+        }
 
         // Transpose the graph.
         for (auto & node : graph)
@@ -184,8 +204,20 @@ struct CmdWhyDepends : SourceExprCommand
             }
 
             /* For each reference, find the files and symlinks that
-               contain the reference. */
-            std::map<std::string, Strings> hits;
+               contain the reference. Files are read and scanned in
+               parallel; `hits' is sorted by the position of the file
+               in the traversal afterwards. */
+            RefScanner scanner(hashes);
+
+            Sync<std::map<std::string, std::vector<std::pair<size_t, std::string>>>> hits_;
+
+            auto getColour = [&](const std::string & hash) {
+                return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
+            };
+
+            ThreadPool pool;
+
+            size_t nrFiles = 0;
 
             std::function<void(const Path &)> visitPath;
 
@@ -194,9 +226,7 @@ struct CmdWhyDepends : SourceExprCommand
 
                 auto p2 = p == node.path ? "/" : std::string(p, node.path.size() + 1);
 
-                auto getColour = [&](const std::string & hash) {
-                    return hash == dependencyPathHash ? ANSI_GREEN : ANSI_BLUE;
-                };
+                auto fileNr = nrFiles++;
 
                 if (st.type == FSAccessor::Type::tDirectory) {
                     auto names = accessor->readDirectory(p);
@@ -205,39 +235,45 @@ struct CmdWhyDepends : SourceExprCommand
                 }
 
                 else if (st.type == FSAccessor::Type::tRegular) {
-                    auto contents = accessor->readFile(p);
+                    pool.enqueue([&, p, p2, fileNr]() {
+                        auto contents = accessor->readFile(p);
 
-                    for (auto & hash : hashes) {
-                        auto pos = contents.find(hash);
-                        if (pos != std::string::npos) {
+                        for (auto & i : scanner.scan(contents)) {
+                            auto & hash(i.first);
+                            auto pos = i.second;
                             size_t margin = 32;
                             auto pos2 = pos >= margin ? pos - margin : 0;
-                            hits[hash].emplace_back(fmt("%s: …%s…\n",
-                                    p2,
-                                    hilite(filterPrintable(
-                                            std::string(contents, pos2, pos - pos2 + hash.size() + margin)),
-                                        pos - pos2, storePathHashLen,
-                                        getColour(hash))));
+                            auto hit = fmt("%s: …%s…\n",
+                                p2,
+                                hilite(filterPrintable(
+                                        std::string(contents, pos2, pos - pos2 + hash.size() + margin)),
+                                    pos - pos2, storePathHashLen,
+                                    getColour(hash)));
+                            (*hits_.lock())[hash].emplace_back(fileNr, hit);
                         }
-                    }
+                    });
                 }
 
                 else if (st.type == FSAccessor::Type::tSymlink) {
                     auto target = accessor->readLink(p);
 
-                    for (auto & hash : hashes) {
-                        auto pos = target.find(hash);
-                        if (pos != std::string::npos)
-                            hits[hash].emplace_back(fmt("%s -> %s\n", p2,
-                                    hilite(target, pos, storePathHashLen, getColour(hash))));
-                    }
+                    for (auto & i : scanner.scan(target))
+                        (*hits_.lock())[i.first].emplace_back(fileNr, fmt("%s -> %s\n", p2,
+                                hilite(target, i.second, storePathHashLen, getColour(i.first))));
                 }
             };
 
-            // FIXME: should use scanForReferences().
-
             visitPath(node.path);
 
+            pool.process();
+
+            std::map<std::string, Strings> hits;
+            for (auto & i : *hits_.lock()) {
+                std::sort(i.second.begin(), i.second.end());
+                for (auto & hit : i.second)
+                    hits[i.first].push_back(hit.second);
+            }
+
             RunPager pager;
             for (auto & ref : refs) {
                 auto hash = storePathToHash(ref.second->path);
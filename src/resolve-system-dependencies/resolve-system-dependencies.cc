@@ -2,6 +2,9 @@
 #include "globals.hh"
 #include "shared.hh"
 #include "store-api.hh"
+#include "sync.hh"
+#include "thread-pool.hh"
+#include "finally.hh"
 #include <sys/utsname.h>
 #include <algorithm>
 #include <iostream>
@@ -17,15 +20,55 @@ using namespace nix;
 
 static auto cacheDir = Path{};
 
-Path resolveCacheFile(Path lib)
+/* The libraries that a binary refers to directly. The entry is only
+   used if the binary's inode and modification time haven't
+   changed. */
+struct IndexEntry
 {
-    std::replace(lib.begin(), lib.end(), '/', '%');
-    return cacheDir + "/" + lib;
+    ino_t ino;
+    time_t mtime;
+    std::set<string> libs;
+};
+
+typedef std::map<Path, IndexEntry> Index;
+
+/* The index is stored in a single file with one line per binary:
+   the path, inode, mtime and each library, separated by tabs. */
+static Path indexFile()
+{
+    return cacheDir + "/index";
 }
 
-std::set<string> readCacheFile(const Path & file)
+static Index readIndex()
 {
-    return tokenizeString<set<string>>(readFile(file), "\n");
+    Index index;
+    if (!pathExists(indexFile())) return index;
+    for (auto & line : tokenizeString<Strings>(readFile(indexFile()), "\n")) {
+        auto fields = tokenizeString<std::vector<string>>(line, "\t");
+        IndexEntry entry;
+        if (fields.size() < 3
+            || !string2Int(fields[1], entry.ino)
+            || !string2Int(fields[2], entry.mtime))
+            continue;
+        entry.libs.insert(fields.begin() + 3, fields.end());
+        index.emplace(fields[0], std::move(entry));
+    }
+    return index;
+}
+
+static void writeIndex(const Index & index)
+{
+    string s;
+    for (auto & i : index) {
+        s += fmt("%s\t%d\t%d", i.first, i.second.ino, i.second.mtime);
+        for (auto & lib : i.second.libs)
+            s += "\t" + lib;
+        s += "\n";
+    }
+    auto tmp = indexFile() + ".tmp-" + std::to_string(getpid());
+    writeFile(tmp, s);
+    if (rename(tmp.c_str(), indexFile().c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmp, indexFile());
 }
 
 std::set<std::string> runResolver(const Path & filename)
@@ -49,9 +92,11 @@ std::set<std::string> runResolver(const Path & filename)
     }
 
     char* obj = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd.get(), 0);
-    if (!obj)
+    if (obj == MAP_FAILED)
         throw SysError("mmapping '%s'", filename);
 
+    Finally unmap([&]() { munmap(obj, st.st_size); });
+
     ptrdiff_t mach64_offset = 0;
 
     uint32_t magic = ((mach_header_64*) obj)->magic;
@@ -114,42 +159,81 @@ Path resolveSymlink(const Path & path)
         : dirOf(path) + "/" + target;
 }
 
-std::set<string> resolveTree(const Path & path, PathSet & deps)
+struct State
 {
-    std::set<string> results;
-    if (deps.count(path))
-        return {};
-    deps.insert(path);
-    for (auto & lib : runResolver(path)) {
-        results.insert(lib);
-        for (auto & p : resolveTree(lib, deps)) {
-            results.insert(p);
-        }
+    Index index;
+    bool indexChanged = false;
+    std::set<string> visited, libs;
+};
+
+/* Return the libraries that the binary `path' refers to, using the
+   index if possible. */
+std::set<string> getLibs(Sync<State> & state_, const Path & path)
+{
+    struct stat st;
+    if (stat(path.c_str(), &st) == -1)
+        throw SysError("getting attributes of path '%1%'", path);
+
+    {
+        auto state(state_.lock());
+        auto i = state->index.find(path);
+        if (i != state->index.end() && i->second.ino == st.st_ino && i->second.mtime == st.st_mtime)
+            return i->second.libs;
     }
-    return results;
+
+    auto libs = runResolver(path);
+
+    auto state(state_.lock());
+    state->index[path] = IndexEntry{st.st_ino, st.st_mtime, libs};
+    state->indexChanged = true;
+
+    return libs;
 }
 
-std::set<string> getPath(const Path & path)
+/* Return the paths in `impurePaths', the symlinks they resolve
+   through, and all libraries they depend on directly or indirectly.
+   The libraries are scanned in parallel. */
+std::set<string> getPaths(const StringSet & impurePaths)
 {
-    if (hasPrefix(path, "/dev")) return {};
+    Sync<State> state_;
+    state_.lock()->index = readIndex();
+
+    std::set<string> paths;
+
+    ThreadPool pool;
 
-    Path cacheFile = resolveCacheFile(path);
-    if (pathExists(cacheFile))
-        return readCacheFile(cacheFile);
+    std::function<void(const Path &)> visit;
 
-    std::set<string> deps, paths;
-    paths.insert(path);
+    visit = [&](const Path & path) {
+        if (!state_.lock()->visited.insert(path).second) return;
+        auto libs = getLibs(state_, path);
+        state_.lock()->libs.insert(libs.begin(), libs.end());
+        for (auto & lib : libs)
+            pool.enqueue(std::bind(visit, lib));
+    };
 
-    Path nextPath(path);
-    while (isSymlink(nextPath)) {
-        nextPath = resolveSymlink(nextPath);
-        paths.insert(nextPath);
+    for (auto & path : impurePaths) {
+        if (hasPrefix(path, "/dev")) continue;
+
+        paths.insert(path);
+
+        Path nextPath(path);
+        while (isSymlink(nextPath)) {
+            nextPath = resolveSymlink(nextPath);
+            paths.insert(nextPath);
+        }
+
+        pool.enqueue(std::bind(visit, nextPath));
     }
 
-    for (auto & t : resolveTree(nextPath, deps))
-        paths.insert(t);
+    pool.process();
 
-    writeFile(cacheFile, concatStringsSep("\n", paths));
+    auto state(state_.lock());
+
+    paths.insert(state->libs.begin(), state->libs.end());
+
+    if (state->indexChanged)
+        writeIndex(state->index);
 
     return paths;
 }
@@ -186,11 +270,7 @@ int main(int argc, char ** argv)
             impurePaths.insert("/usr/lib/libSystem.dylib");
         }
 
-        std::set<string> allPaths;
-
-        for (auto & path : impurePaths)
-            for (auto & p : getPath(path))
-                allPaths.insert(p);
+        auto allPaths = getPaths(impurePaths);
 
         std::cout << "extra-chroot-dirs" << std::endl;
         for (auto & path : allPaths)
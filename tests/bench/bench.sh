@@ -0,0 +1,73 @@
+# Evaluator benchmarks. Each workload is run BENCH_RUNS times with
+# NIX_SHOW_STATS enabled, and the wall time and evaluator statistics
+# of the fastest run are reported. Variables:
+#
+#   BENCH_RUNS      number of runs per workload (default 3)
+#   BENCH_SCALE     size multiplier for the synthetic workloads (default 1)
+#   BENCH_FILTER    only run workloads whose name matches this regex
+#   BENCH_OUTPUT    file to write the results to as JSON (default results.json)
+#   BENCH_BASELINE  results of an earlier run to compare against
+#   BENCH_NIXPKGS   a pinned Nixpkgs checkout; if set, 'nix-env -qa' and
+#                   the instantiation of release.nix are benchmarked too
+
+(cd .. && source init.sh) > /dev/null 2>&1
+source ../common.sh
+
+runs=${BENCH_RUNS:-3}
+scale=${BENCH_SCALE:-1}
+filter=${BENCH_FILTER:-.}
+output=$(realpath ${BENCH_OUTPUT:-results.json})
+
+stats=$TEST_ROOT/bench-stats.json
+results=()
+
+run() {
+    local name=$1
+    shift
+    [[ $name =~ $filter ]] || return 0
+
+    local best= times=()
+    for ((i = 0; i < runs; i++)); do
+        local start=$(date +%s.%N)
+        NIX_SHOW_STATS=1 NIX_SHOW_STATS_PATH=$stats.tmp "$@" > /dev/null
+        local end=$(date +%s.%N)
+        local t=$(awk "BEGIN { printf \"%.3f\", $end - $start }")
+        times+=($t)
+        if [[ -z $best ]] || awk "BEGIN { exit !($t < $best) }"; then
+            best=$t
+            mv $stats.tmp $stats
+        fi
+    done
+
+    printf "%-24s %8s s\n" "$name" "$best"
+    results+=("{\"name\": \"$name\", \"wallTime\": $best, \"times\": [$(IFS=,; echo "${times[*]}")], \"stats\": $(cat $stats)}")
+}
+
+for w in attrsets lists strings calls fixpoint; do
+    run $w nix-instantiate --eval --strict micro.nix -A $w --arg scale $scale
+done
+
+# The language tests that don't need special flags.
+files=
+for i in ../lang/eval-okay-*.nix; do
+    base=${i%.nix}
+    if [[ -e $base.exp && ! -e $base.flags ]]; then
+        files+=" $(realpath $i)"
+    fi
+done
+export TEST_VAR=foo # for eval-okay-getenv.nix
+NIX_PATH=../lang/dir3:../lang/dir4 \
+    run lang nix-instantiate --eval --strict lang.nix --arg files "[ $files ]" --arg scale $((10 * scale))
+
+if [[ -n $BENCH_NIXPKGS ]]; then
+    run nixpkgs-qa nix-env -f "$BENCH_NIXPKGS" -qa --readonly-mode
+    run nixpkgs-release nix-instantiate --readonly-mode "$BENCH_NIXPKGS/pkgs/top-level/release.nix"
+fi
+
+(IFS=,; echo "[${results[*]}]") > $output
+echo "results written to $output"
+
+if [[ -n $BENCH_BASELINE ]]; then
+    echo
+    nix eval --raw "(import ./compare.nix { old = $(realpath $BENCH_BASELINE); new = $output; })"
+fi
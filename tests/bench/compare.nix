@@ -0,0 +1,29 @@
+# Print the wall times of two benchmark runs side by side.
+
+{ old, new }:
+
+with builtins;
+
+let
+
+  load = file: listToAttrs (map (r: { name = r.name; value = r; }) (fromJSON (readFile file)));
+
+  old' = load old;
+  new' = load new;
+
+  pad = w: s: let l = stringLength s; in
+    if l >= w then s else s + concatStringsSep "" (genList (_: " ") (w - l));
+
+  line = name:
+    let
+      o = old'.${name}.wallTime or null;
+      n = new'.${name}.wallTime;
+    in
+      pad 24 name + pad 12 (if o == null then "-" else toString o) + pad 12 (toString n)
+      + (if o == null || o == 0 then "" else "${toString (n * 100 / o)}%")
+      + "\n";
+
+in
+
+  pad 24 "workload" + pad 12 "old (s)" + pad 12 "new (s)" + "new/old\n"
+  + concatStringsSep "" (map line (attrNames new'))
@@ -0,0 +1,313 @@
+/* A load generator for the Nix daemon. It opens a number of
+   concurrent client connections and has each of them send a random
+   mix of operations for a fixed time, recording the latency of every
+   operation. */
+
+#include "shared.hh"
+#include "store-api.hh"
+#include "archive.hh"
+#include "sync.hh"
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+using namespace nix;
+
+
+typedef enum {
+    opQueryPathInfo,
+    opIsValidPath,
+    opAddToStoreNar,
+    opAddTempRoot,
+    opBuildPaths,
+    nrOps
+} LoadOp;
+
+static const char * opNames[nrOps] = {
+    "query-path-info",
+    "is-valid-path",
+    "add-to-store-nar",
+    "add-temp-root",
+    "build-paths",
+};
+
+
+/* The latencies of one kind of operation. Bucket i of the histogram
+   counts the operations that took less than 2^i microseconds (the
+   last bucket has the slower ones). */
+struct OpStats
+{
+    static const size_t nrBuckets = 25;
+
+    uint64_t failures = 0;
+    std::vector<uint64_t> latencies; // in microseconds
+    std::array<uint64_t, nrBuckets> histogram{};
+
+    void record(uint64_t us)
+    {
+        latencies.push_back(us);
+        size_t i = 0;
+        while (i + 1 < nrBuckets && us >= (1ULL << i)) i++;
+        histogram[i]++;
+    }
+
+    void merge(const OpStats & other)
+    {
+        failures += other.failures;
+        latencies.insert(latencies.end(), other.latencies.begin(), other.latencies.end());
+        for (size_t i = 0; i < nrBuckets; ++i)
+            histogram[i] += other.histogram[i];
+    }
+};
+
+typedef std::array<OpStats, nrOps> ClientStats;
+
+
+struct LoadConfig
+{
+    std::string storeUri = "daemon";
+    unsigned int clients = 8;
+    unsigned int duration = 10;
+    std::array<unsigned int, nrOps> weights{{50, 30, 5, 10, 5}};
+    size_t narSize = 4096;
+    std::vector<Path> sample, buildPaths;
+};
+
+
+/* Parse a mix like `query-path-info=50,add-to-store-nar=10'. Ops not
+   mentioned get weight 0. */
+static std::array<unsigned int, nrOps> parseMix(const std::string & s)
+{
+    std::array<unsigned int, nrOps> weights{};
+    for (auto & item : tokenizeString<Strings>(s, ",")) {
+        auto eq = item.find('=');
+        unsigned int w = 1;
+        if (eq != std::string::npos && !string2Int(item.substr(eq + 1), w))
+            throw UsageError("invalid weight in '%s'", item);
+        auto name = item.substr(0, eq);
+        auto i = std::find(opNames, opNames + nrOps, name);
+        if (i == opNames + nrOps)
+            throw UsageError("unknown operation '%s'", name);
+        weights[i - opNames] = w;
+    }
+    return weights;
+}
+
+
+static void runClient(const LoadConfig & config, unsigned int client,
+    std::chrono::steady_clock::time_point deadline, ClientStats & stats)
+{
+    /* Disable the path info cache, so that every query goes to the
+       daemon. */
+    auto store = openStore(config.storeUri, {{"path-info-cache-size", "0"}});
+
+    std::mt19937_64 rng(client);
+    std::discrete_distribution<int> pickOp(config.weights.begin(), config.weights.end());
+
+    auto randomPath = [&](const std::vector<Path> & paths) {
+        return paths[rng() % paths.size()];
+    };
+
+    uint64_t counter = 0;
+
+    while (std::chrono::steady_clock::now() < deadline) {
+        auto op = (LoadOp) pickOp(rng);
+
+        /* Prepare the arguments outside of the timed part. */
+        auto path = randomPath(config.sample);
+        ValidPathInfo info;
+        StringSink nar;
+        if (op == opIsValidPath && rng() % 2)
+            /* Half of the queried paths don't exist. */
+            path = store->makeStorePath("output:out",
+                hashString(htSHA256, fmt("%d-%d-%d", client, counter++, rng())), "bench-invalid");
+        else if (op == opAddToStoreNar) {
+            std::string contents(config.narSize, 'x');
+            auto tag = fmt("%d-%d-%d-%d\n", getpid(), client, counter++, rng());
+            contents.replace(0, std::min(tag.size(), contents.size()), tag);
+            dumpString(contents, nar);
+            info.narHash = hashString(htSHA256, *nar.s);
+            info.narSize = nar.s->size();
+            info.path = store->makeFixedOutputPath(true, info.narHash, "bench-load");
+            info.ca = makeFixedOutputCA(true, info.narHash);
+        }
+        else if (op == opBuildPaths && !config.buildPaths.empty())
+            path = randomPath(config.buildPaths);
+
+        auto start = std::chrono::steady_clock::now();
+
+        try {
+            switch (op) {
+            case opQueryPathInfo:
+                store->queryPathInfo(path);
+                break;
+            case opIsValidPath:
+                store->isValidPath(path);
+                break;
+            case opAddToStoreNar:
+                store->addToStore(info, nar.s);
+                break;
+            case opAddTempRoot:
+                store->addTempRoot(path);
+                break;
+            case opBuildPaths:
+                store->buildPaths({path});
+                break;
+            default:
+                abort();
+            }
+        } catch (Error & e) {
+            debug("%s failed: %s", opNames[op], e.msg());
+            stats[op].failures++;
+            continue;
+        }
+
+        stats[op].record(std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - start).count());
+    }
+}
+
+
+static void printReport(const ClientStats & total, double elapsed, bool showHistograms)
+{
+    std::cout << std::left << std::setw(18) << "operation" << std::right
+              << std::setw(10) << "count" << std::setw(8) << "failed" << std::setw(10) << "ops/s"
+              << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90"
+              << std::setw(10) << "p99" << std::setw(10) << "max" << "   (ms)\n";
+
+    uint64_t totalOps = 0;
+
+    for (size_t op = 0; op < nrOps; ++op) {
+        auto latencies = total[op].latencies;
+        if (latencies.empty() && !total[op].failures) continue;
+        std::sort(latencies.begin(), latencies.end());
+        totalOps += latencies.size();
+
+        auto ms = [](double us) { return us / 1000; };
+        auto percentile = [&](double p) {
+            return latencies.empty() ? 0 : ms(latencies[std::min(latencies.size() - 1, (size_t) (p * latencies.size()))]);
+        };
+        double sum = 0;
+        for (auto us : latencies) sum += us;
+
+        std::cout << std::left << std::setw(18) << opNames[op] << std::right << std::fixed
+                  << std::setw(10) << latencies.size() << std::setw(8) << total[op].failures
+                  << std::setprecision(0) << std::setw(10) << latencies.size() / elapsed
+                  << std::setprecision(3)
+                  << std::setw(10) << (latencies.empty() ? 0 : ms(sum / latencies.size()))
+                  << std::setw(10) << percentile(0.5) << std::setw(10) << percentile(0.9)
+                  << std::setw(10) << percentile(0.99) << std::setw(10) << percentile(1.0)
+                  << "\n";
+    }
+
+    std::cout << fmt("total: %d operations in %.1f s (%.0f ops/s)\n",
+        totalOps, elapsed, totalOps / elapsed);
+
+    if (!showHistograms) return;
+
+    for (size_t op = 0; op < nrOps; ++op) {
+        auto & h(total[op].histogram);
+        if (std::all_of(h.begin(), h.end(), [](uint64_t n) { return n == 0; })) continue;
+        std::cout << fmt("\n%s:\n", opNames[op]);
+        for (size_t i = 0; i < OpStats::nrBuckets; ++i)
+            if (h[i])
+                std::cout << fmt("  %s %10d us: %d\n",
+                    i + 1 < OpStats::nrBuckets ? "<" : ">=",
+                    1ULL << (i + 1 < OpStats::nrBuckets ? i : i - 1), h[i]);
+    }
+}
+
+
+static void mainWrapped(int argc, char * * argv)
+{
+    LoadConfig config;
+    size_t sampleSize = 1000;
+    bool showHistograms = false;
+
+    parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+        if (*arg == "--store")
+            config.storeUri = getArg(*arg, arg, end);
+        else if (*arg == "--clients")
+            config.clients = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--duration")
+            config.duration = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--mix")
+            config.weights = parseMix(getArg(*arg, arg, end));
+        else if (*arg == "--nar-size")
+            config.narSize = getIntArg<unsigned long>(*arg, arg, end, true);
+        else if (*arg == "--sample")
+            sampleSize = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--build")
+            config.buildPaths.push_back(getArg(*arg, arg, end));
+        else if (*arg == "--histograms")
+            showHistograms = true;
+        else
+            return false;
+        return true;
+    });
+
+    if (!config.clients || std::all_of(config.weights.begin(), config.weights.end(),
+            [](unsigned int w) { return w == 0; }))
+        throw UsageError("there must be at least one client and one operation");
+
+    /* The paths that the queries pick from. */
+    {
+        auto store = openStore(config.storeUri);
+        auto valid = store->queryAllValidPaths();
+        if (valid.empty())
+            throw Error("store '%s' has no valid paths to query", store->getUri());
+        config.sample.assign(valid.begin(), valid.end());
+        std::shuffle(config.sample.begin(), config.sample.end(), std::mt19937_64(0));
+        config.sample.resize(std::min(config.sample.size(), sampleSize));
+        for (auto & p : config.buildPaths)
+            p = store->followLinksToStorePath(p);
+    }
+
+    std::cerr << fmt("running %d clients against '%s' for %d s...\n",
+        config.clients, config.storeUri, config.duration);
+
+    std::vector<ClientStats> stats(config.clients);
+    Sync<std::exception_ptr> firstError;
+
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::seconds(config.duration);
+
+    std::vector<std::thread> threads;
+    for (unsigned int i = 0; i < config.clients; ++i)
+        threads.emplace_back([&, i]() {
+            try {
+                runClient(config, i, deadline, stats[i]);
+            } catch (...) {
+                auto e(firstError.lock());
+                if (!*e) *e = std::current_exception();
+            }
+        });
+
+    for (auto & thread : threads)
+        thread.join();
+
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    if (auto e = *firstError.lock())
+        std::rethrow_exception(e);
+
+    ClientStats total;
+    for (auto & s : stats)
+        for (size_t op = 0; op < nrOps; ++op)
+            total[op].merge(s[op]);
+
+    printReport(total, elapsed.count(), showHistograms);
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        mainWrapped(argc, argv);
+    });
+}
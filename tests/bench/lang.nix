@@ -0,0 +1,12 @@
+# Evaluate the 'eval-okay' language tests `scale' times each.
+# scopedImport is used because the results of import are cached.
+
+{ files, scale ? 1 }:
+
+with builtins;
+
+foldl' (acc: file:
+  foldl' (acc: i:
+    deepSeq (scopedImport { __benchIteration = i; } file) (acc + 1)
+  ) acc (genList (i: i) scale)
+) 0 files
@@ -0,0 +1,52 @@
+bench-programs := nix-bench-store-io nix-bench-daemon nix-bench-store-scale nix-bench-substitute
+
+programs += $(bench-programs)
+
+$(foreach prog, $(bench-programs), $(eval $(prog)_EXCLUDE_FROM_PROGRAM_LIST := 1))
+
+nix-bench-store-io_DIR := $(d)
+
+nix-bench-store-io_SOURCES := $(d)/store-io.cc
+
+nix-bench-store-io_LIBS = libmain libstore libutil
+
+nix-bench-store-io_LDFLAGS = -pthread
+
+nix-bench-daemon_DIR := $(d)
+
+nix-bench-daemon_SOURCES := $(d)/daemon-load.cc
+
+nix-bench-daemon_LIBS = libmain libstore libutil
+
+nix-bench-daemon_LDFLAGS = -pthread
+
+nix-bench-store-scale_DIR := $(d)
+
+nix-bench-store-scale_SOURCES := $(d)/store-scale.cc
+
+nix-bench-store-scale_LIBS = libmain libstore libutil
+
+nix-bench-store-scale_LDFLAGS = -pthread
+
+nix-bench-substitute_DIR := $(d)
+
+nix-bench-substitute_SOURCES := $(d)/substitute.cc
+
+nix-bench-substitute_LIBS = libmain libstore libutil
+
+nix-bench-substitute_LDFLAGS = -pthread
+
+# Run the evaluator benchmarks against the installed Nix, like
+# ‘make installcheck’, followed by the store I/O, daemon load, store
+# scaling and substitution benchmarks. See bench.sh and the sources
+# of the benchmark programs for the options that control them; the
+# daemon load benchmark runs against a daemon started in the test
+# environment.
+bench: tests/common.sh $(foreach prog, $(bench-programs), $(buildprefix)$(d)/$(prog))
+	@cd tests/bench && $(tests-environment) bench.sh
+	@$(nix-bench-store-io_PATH) $(BENCH_STORE_IO_FLAGS)
+	@cd tests && $(tests-environment) -c 'source common.sh; startDaemon; $(abspath $(nix-bench-daemon_PATH)) $(BENCH_DAEMON_FLAGS); killDaemon'
+	@$(nix-bench-store-scale_PATH) $(BENCH_STORE_SCALE_FLAGS)
+	@$(nix-bench-substitute_PATH) $(BENCH_SUBSTITUTE_FLAGS)
+
+.PHONY: bench
@@ -0,0 +1,80 @@
+# Synthetic evaluator workloads. Each attribute is a separate
+# benchmark; `scale' multiplies the amount of work.
+
+{ scale ? 1 }:
+
+with builtins;
+
+let
+
+  n = 10000 * scale;
+
+  range = genList (i: i) n;
+
+in
+
+{
+
+  # Construction, update and lookup of attribute sets.
+  attrsets =
+    let
+      sets = map (i: { "a${toString i}" = i; b = i; c.d = i; }) range;
+      big = listToAttrs (map (i: { name = "x${toString i}"; value = i; }) range);
+      merged = foldl' (acc: s: acc // { inherit (s) b; }) {} sets;
+    in
+      length (attrNames big)
+      + foldl' (acc: i: acc + big."x${toString i}") 0 range
+      + foldl' (acc: s: acc + s.b + s.c.d) 0 sets
+      + merged.b
+      + length (attrNames (mapAttrs (k: v: v + 1) big))
+      + length (filter (s: s ? c) sets);
+
+  # List primitives and list-heavy code.
+  lists =
+    let
+      l = map (i: i * 7 - 3) range;
+    in
+      length (filter (x: x > 0) l)
+      + length (sort lessThan (map (i: (i * 7919) - (i * 7919 / n) * n) range))
+      + length (concatLists (map (i: [ i i ]) range))
+      + foldl' add 0 l
+      + length (concatMap (i: [ i ]) range)
+      + (elemAt l (n / 2))
+      + (if elem (n - 1) range then 1 else 0);
+
+  # String building and manipulation.
+  strings =
+    let
+      strs = map toString range;
+      s = concatStringsSep "," strs;
+    in
+      stringLength s
+      + stringLength (replaceStrings [ "1" "2" ] [ "one" "two" ] s)
+      + length (filter isString (split "," (substring 0 (10000 * 5) s)))
+      + stringLength (foldl' (acc: x: "${x}-${acc}") "" (genList toString (n / 10)))
+      + length (filter (x: match "[0-9]*7" x != null) strs)
+      + stringLength (concatStrings (map (x: "<${x}>") strs));
+
+  # Function calls and thunks, without much allocation elsewhere.
+  calls =
+    let
+      fib = x: if x < 2 then x else fib (x - 1) + fib (x - 2);
+      compose = f: g: x: f (g x);
+      inc = x: x + 1;
+    in
+      fib (20 + (if scale > 1 then 2 else 0))
+      + foldl' (acc: i: compose inc inc acc) 0 range
+      + foldl' (acc: i: acc + ({ x, y ? 1, ... }: x + y) { x = i; z = 0; }) 0 range;
+
+  # A recursive attribute set of inter-dependent thunks.
+  fixpoint =
+    let
+      fix = f: let x = f x; in x;
+      pkgs = fix (self: listToAttrs (map (i: {
+        name = "p${toString i}";
+        value = if i == 0 then 0 else self."p${toString (i - 1)}" + 1;
+      }) (genList (i: i) (n / 2))));
+    in
+      pkgs."p${toString (n / 2 - 1)}";
+
+}
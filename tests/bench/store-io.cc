@@ -0,0 +1,266 @@
+/* Micro-benchmarks for the store's I/O primitives: NAR serialisation
+   and restoring, hashing, reference scanning and compression. They
+   run in-process on synthetic trees in a temporary directory, so no
+   store or daemon is needed. */
+
+#include "shared.hh"
+#include "archive.hh"
+#include "hash.hh"
+#include "references.hh"
+#include "compression.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <random>
+#include <regex>
+#include <iostream>
+#include <iomanip>
+
+#include <sys/stat.h>
+
+using namespace nix;
+
+
+/* A synthetic input tree. */
+struct Tree
+{
+    std::string name;
+    Path path;
+    uint64_t files = 0, bytes = 0;
+};
+
+
+/* The file contents: pseudo-random text, occasionally containing one
+   of `hashes' (like a store path reference would), so that both
+   compression and reference scanning see something realistic. */
+struct ContentGenerator
+{
+    std::mt19937_64 rng{42};
+    const std::vector<std::string> & hashes;
+
+    ContentGenerator(const std::vector<std::string> & hashes) : hashes(hashes) { }
+
+    std::string operator () (size_t size)
+    {
+        static const char chars[] = "abcdefghijklmnopqrstuvwxyz0123456789 \n";
+        std::string s(size, ' ');
+        for (size_t i = 0; i < size; ++i)
+            s[i] = chars[rng() % (sizeof(chars) - 1)];
+        if (!hashes.empty())
+            for (size_t pos = rng() % 4096; pos + 32 <= size; pos += 4096 + rng() % 4096)
+                s.replace(pos, 32, hashes[rng() % hashes.size()]);
+        return s;
+    }
+};
+
+
+static void writeTreeFile(Tree & tree, const Path & path, const std::string & contents)
+{
+    writeFile(path, contents);
+    tree.files++;
+    tree.bytes += contents.size();
+}
+
+
+/* Many small files, spread over a few directories. */
+static Tree makeSmallFiles(const Path & dir, ContentGenerator & gen, unsigned int scale)
+{
+    Tree tree{"small-files", dir + "/small-files"};
+    createDirs(tree.path);
+    for (unsigned int d = 0; d < 100; ++d) {
+        auto sub = fmt("%s/%d", tree.path, d);
+        createDirs(sub);
+        for (unsigned int f = 0; f < 200 * scale; ++f)
+            writeTreeFile(tree, fmt("%s/%d", sub, f), gen(gen.rng() % 8192));
+    }
+    return tree;
+}
+
+
+/* A few huge files. */
+static Tree makeLargeFiles(const Path & dir, ContentGenerator & gen, unsigned int scale)
+{
+    Tree tree{"large-files", dir + "/large-files"};
+    createDirs(tree.path);
+    for (unsigned int f = 0; f < 4; ++f)
+        writeTreeFile(tree, fmt("%s/%d", tree.path, f), gen(64ULL * scale << 20));
+    return tree;
+}
+
+
+/* Deeply nested directories with a file at every level. */
+static Tree makeDeepDirs(const Path & dir, ContentGenerator & gen, unsigned int scale)
+{
+    Tree tree{"deep-dirs", dir + "/deep-dirs"};
+    for (unsigned int c = 0; c < 20 * scale; ++c) {
+        auto sub = fmt("%s/%d", tree.path, c);
+        for (unsigned int d = 0; d < 100; ++d) {
+            sub += "/d";
+            createDirs(sub);
+            writeTreeFile(tree, sub + "/f", gen(gen.rng() % 1024));
+        }
+    }
+    return tree;
+}
+
+
+struct Bench
+{
+    unsigned int runs = 3;
+    std::regex filter{""};
+    bool haveFilter = false;
+
+    /* Run `fun' `runs' times and print the throughput of the fastest
+       run over `bytes' bytes and `files' files. */
+    void operator () (const std::string & name, const Tree & tree,
+        uint64_t bytes, uint64_t files, std::function<void()> fun)
+    {
+        auto fullName = name + "/" + tree.name;
+        if (haveFilter && !std::regex_search(fullName, filter)) return;
+
+        double best = 0;
+        for (unsigned int i = 0; i < runs; ++i) {
+            auto start = std::chrono::steady_clock::now();
+            fun();
+            std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+            if (!i || d.count() < best) best = d.count();
+        }
+
+        std::cout << std::left << std::setw(32) << fullName << std::right << std::fixed
+                  << std::setprecision(1) << std::setw(10) << bytes / best / (1 << 20) << " MB/s"
+                  << std::setprecision(0) << std::setw(12) << files / best << " files/s"
+                  << std::setprecision(3) << std::setw(10) << best << " s"
+                  << std::endl;
+    }
+};
+
+
+static void mainWrapped(int argc, char * * argv)
+{
+    unsigned int scale = 1;
+    unsigned int refs = 10000;
+    Strings methods = {"xz", "bzip2", "br", "zstd"};
+    Bench bench;
+
+    parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+        if (*arg == "--scale")
+            scale = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--runs")
+            bench.runs = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--refs")
+            refs = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--compression")
+            methods = tokenizeString<Strings>(getArg(*arg, arg, end), ",");
+        else if (*arg == "--filter") {
+            bench.filter = std::regex(getArg(*arg, arg, end));
+            bench.haveFilter = true;
+        }
+        else
+            return false;
+        return true;
+    });
+
+    if (!scale || !bench.runs)
+        throw UsageError("'--scale' and '--runs' must be positive");
+
+    /* The candidate references, as scanForReferences() gets them
+       from the inputs of a build. */
+    std::vector<std::string> hashes;
+    PathSet refPaths;
+    StringSet refHashes;
+    for (unsigned int i = 0; i < refs; ++i) {
+        auto h = compressHash(hashString(htSHA256, std::to_string(i)), 20).to_string(Base32, false);
+        hashes.push_back(h);
+        refHashes.insert(h);
+        refPaths.insert("/nix/store/" + h + "-ref-" + std::to_string(i));
+    }
+
+    AutoDelete tmpDir(createTempDir("", "nix-bench"), true);
+    Path dir = tmpDir;
+
+    /* Only a small fraction of the candidates occur in the contents,
+       as in a real build. */
+    std::vector<std::string> used(hashes.begin(), hashes.begin() + std::min((size_t) 50, hashes.size()));
+    ContentGenerator gen(used);
+
+    std::cerr << "generating trees in '" << dir << "'...\n";
+    std::vector<Tree> trees{
+        makeSmallFiles(dir, gen, scale),
+        makeLargeFiles(dir, gen, scale),
+        makeDeepDirs(dir, gen, scale),
+    };
+
+    for (auto & tree : trees) {
+        std::cerr << fmt("%s: %d files, %d MiB\n", tree.name, tree.files, tree.bytes >> 20);
+
+        StringSink nar;
+        dumpPath(tree.path, nar);
+        uint64_t narSize = nar.s->size();
+
+        bench("dumpPath", tree, narSize, tree.files, [&]() {
+            LambdaSink sink([](const unsigned char * data, size_t len) { });
+            dumpPath(tree.path, sink);
+        });
+
+        bench("dumpPathParallel", tree, narSize, tree.files, [&]() {
+            LambdaSink sink([](const unsigned char * data, size_t len) { });
+            dumpPathParallel(tree.path, sink);
+        });
+
+        bench("hashPath", tree, narSize, tree.files, [&]() {
+            hashPath(htSHA256, tree.path);
+        });
+
+        bench("restorePath", tree, narSize, tree.files, [&]() {
+            auto dest = dir + "/restored";
+            StringSource source(*nar.s);
+            restorePath(dest, source);
+            deletePath(dest);
+        });
+
+        bench("scanForReferences", tree, narSize, tree.files, [&]() {
+            HashResult hash;
+            scanForReferences(tree.path, refPaths, hash);
+        });
+
+        RefScanner scanner(refHashes);
+        bench("RefScanner", tree, narSize, tree.files, [&]() {
+            scanner.scan(*nar.s);
+        });
+
+        /* Some methods are too slow to compress all of the large
+           files repeatedly, so only use a prefix of the NAR. */
+        auto input = nar.s->substr(0, 64 << 20);
+
+        for (auto & method : methods) {
+            ref<std::string> compressed = make_ref<std::string>();
+            try {
+                compressed = compress(method, input);
+            } catch (UnknownCompressionMethod &) {
+                std::cerr << fmt("skipping unsupported compression method '%s'\n", method);
+                continue;
+            }
+
+            std::cerr << fmt("%s: %s compresses %d MiB to %d MiB\n",
+                tree.name, method, input.size() >> 20, compressed->size() >> 20);
+
+            /* There is no meaningful file count for a NAR prefix. */
+            bench("compress-" + method, tree, input.size(), 0, [&]() {
+                compress(method, input);
+            });
+
+            bench("decompress-" + method, tree, input.size(), 0, [&]() {
+                decompress(method, *compressed);
+            });
+        }
+    }
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        mainWrapped(argc, argv);
+    });
+}
@@ -0,0 +1,233 @@
+/* Synthesise large local stores and time the operations whose cost
+   grows with the size of the store: finding roots, computing
+   closures, querying referrers, verifying, optimising and garbage
+   collection. The stores are chroot stores (`local?root=...') in a
+   temporary directory, and the paths are registered with
+   registerValidPaths() directly, so no builds or privileges are
+   needed. */
+
+#include "shared.hh"
+#include "local-store.hh"
+#include "archive.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace nix;
+
+
+typedef enum { shapeRandom, shapeChain, shapeTree } Shape;
+
+
+struct ScaleConfig
+{
+    Shape shape = shapeRandom;
+    unsigned int refs = 5;
+    uint64_t fileSize = 1024;
+    double rootFraction = 0.01;
+};
+
+
+/* Run `fun' and print its duration, and the rate at which it
+   processed `items' items. */
+static void timeIt(const std::string & name, size_t items, std::function<void()> fun)
+{
+    auto start = std::chrono::steady_clock::now();
+    fun();
+    std::chrono::duration<double> d = std::chrono::steady_clock::now() - start;
+    std::cout << std::left << std::setw(28) << name << std::right << std::fixed
+              << std::setprecision(3) << std::setw(10) << d.count() << " s"
+              << std::setprecision(0) << std::setw(14) << items / d.count() << " paths/s"
+              << std::endl;
+}
+
+
+/* Create `n' valid paths in `store'. Path i only refers to paths < i,
+   so the paths can be registered in batches in order. The contents of
+   every path is a sparse file of `fileSize' bytes, so they all have
+   the same NAR hash. Returns the paths. */
+static std::vector<Path> synthesise(LocalStore & store, size_t n, const ScaleConfig & config)
+{
+    std::mt19937_64 rng(n);
+    std::vector<Path> paths;
+    paths.reserve(n);
+
+    Hash narHash;
+    uint64_t narSize = 0;
+
+    ValidPathInfos batch;
+
+    for (size_t i = 0; i < n; ++i) {
+        auto path = store.makeStorePath("output:out",
+            hashString(htSHA256, fmt("bench-%d", i)), fmt("bench-%d", i));
+
+        auto realPath = store.realStoreDir + "/" + baseNameOf(path);
+        {
+            AutoCloseFD fd = open(realPath.c_str(), O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0444);
+            if (!fd) throw SysError("creating '%s'", realPath);
+            if (ftruncate(fd.get(), config.fileSize) == -1)
+                throw SysError("resizing '%s'", realPath);
+        }
+
+        if (!narSize) {
+            auto res = hashPath(htSHA256, realPath);
+            narHash = res.first;
+            narSize = res.second;
+        }
+
+        ValidPathInfo info;
+        info.path = path;
+        info.narHash = narHash;
+        info.narSize = narSize;
+        info.ultimate = true;
+
+        if (i) {
+            switch (config.shape) {
+            case shapeChain:
+                info.references.insert(paths[i - 1]);
+                break;
+            case shapeTree:
+                info.references.insert(paths[(i - 1) / 2]);
+                break;
+            case shapeRandom:
+                for (unsigned int r = 0; r < config.refs; ++r)
+                    info.references.insert(paths[rng() % i]);
+                break;
+            }
+        }
+
+        paths.push_back(path);
+        batch.push_back(std::move(info));
+
+        if (batch.size() == 10000 || i + 1 == n) {
+            store.registerValidPaths(batch);
+            batch.clear();
+        }
+    }
+
+    return paths;
+}
+
+
+static void bench(const Path & root, size_t n, const ScaleConfig & config)
+{
+    std::cout << fmt("\n%d paths in '%s':\n", n, root);
+
+    auto store = openStore("local?root=" + root).cast<LocalStore>();
+
+    std::vector<Path> paths;
+    timeIt("synthesise", n, [&]() { paths = synthesise(*store, n, config); });
+
+    /* Make the most recently added paths, which are the ones nothing
+       refers to, roots. */
+    auto rootsDir = store->stateDir + "/gcroots/bench";
+    createDirs(rootsDir);
+    size_t nrRoots = std::max((size_t) 1, (size_t) (n * config.rootFraction));
+    PathSet rootPaths;
+    for (size_t i = n - std::min(n, nrRoots); i < n; ++i) {
+        createSymlink(paths[i], fmt("%s/%d", rootsDir, i));
+        rootPaths.insert(paths[i]);
+    }
+
+    timeIt("findRoots", nrRoots, [&]() { store->findRoots(false); });
+
+    PathSet closure;
+    timeIt("computeFSClosure(roots)", n, [&]() { store->computeFSClosure(rootPaths, closure); });
+    std::cout << fmt("  the roots keep %d paths alive\n", closure.size());
+
+    std::mt19937_64 rng(0);
+    size_t nrQueries = std::min(n, (size_t) 10000);
+    timeIt("queryReferrers", nrQueries, [&]() {
+        for (size_t i = 0; i < nrQueries; ++i) {
+            PathSet referrers;
+            store->queryReferrers(paths[rng() % n], referrers);
+        }
+    });
+
+    timeIt("verifyStore", n, [&]() { store->verifyStore(false, NoRepair); });
+
+    timeIt("optimiseStore", n, [&]() { store->optimiseStore(); });
+
+    {
+        GCOptions options;
+        options.action = GCOptions::gcReturnDead;
+        GCResults results;
+        timeIt("collectGarbage (dry run)", n, [&]() { store->collectGarbage(options, results); });
+        std::cout << fmt("  %d paths are dead\n", results.paths.size());
+    }
+
+    {
+        GCOptions options;
+        options.action = GCOptions::gcDeleteDead;
+        GCResults results;
+        timeIt("collectGarbage", n, [&]() { store->collectGarbage(options, results); });
+    }
+}
+
+
+static void mainWrapped(int argc, char * * argv)
+{
+    ScaleConfig config;
+    std::vector<size_t> sizes;
+    Path rootDir;
+
+    parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+        if (*arg == "--paths") {
+            for (auto & s : tokenizeString<Strings>(getArg(*arg, arg, end), ",")) {
+                size_t n;
+                if (!string2Int(s, n) || !n)
+                    throw UsageError("'--paths' requires a list of positive integers");
+                sizes.push_back(n);
+            }
+        }
+        else if (*arg == "--shape") {
+            auto s = getArg(*arg, arg, end);
+            if (s == "random") config.shape = shapeRandom;
+            else if (s == "chain") config.shape = shapeChain;
+            else if (s == "tree") config.shape = shapeTree;
+            else throw UsageError("unknown closure shape '%s'", s);
+        }
+        else if (*arg == "--refs")
+            config.refs = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--file-size")
+            config.fileSize = getIntArg<unsigned long long>(*arg, arg, end, true);
+        else if (*arg == "--roots") {
+            auto s = getArg(*arg, arg, end);
+            if (!string2Float(s, config.rootFraction) || config.rootFraction < 0 || config.rootFraction > 1)
+                throw UsageError("'--roots' requires a fraction between 0 and 1");
+        }
+        else if (*arg == "--keep")
+            rootDir = absPath(getArg(*arg, arg, end));
+        else
+            return false;
+        return true;
+    });
+
+    if (sizes.empty()) sizes = {10000, 100000, 1000000};
+
+    /* With `--keep', the stores are left in subdirectories of the
+       given directory for further experiments. */
+    AutoDelete tmpDir;
+    if (rootDir.empty()) {
+        rootDir = createTempDir("", "nix-bench");
+        tmpDir.reset(rootDir, true);
+    }
+
+    for (auto n : sizes)
+        bench(fmt("%s/%d", rootDir, n), n, config);
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        mainWrapped(argc, argv);
+    });
+}
@@ -0,0 +1,430 @@
+/* An end-to-end benchmark for substitution from a binary cache. It
+   creates a synthetic closure, copies it to a binary cache for each
+   compression method, and then times fetching it into a fresh store:
+
+   - in-process, one phase at a time (fetching the narinfos,
+     downloading the NARs, decompressing them and adding them to the
+     store), to show the contribution of each;
+
+   - with 'nix copy --from' and 'nix-store -r', which may overlap
+     these phases.
+
+   The caches are served by a small HTTP server in this process that
+   adds latency to every response and limits the bandwidth of each
+   connection. */
+
+#include "shared.hh"
+#include "local-store.hh"
+#include "binary-cache-store.hh"
+#include "nar-info.hh"
+#include "compression.hh"
+#include "archive.hh"
+#include "globals.hh"
+#include "util.hh"
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <thread>
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace nix;
+
+
+struct SubstConfig
+{
+    size_t paths = 500;
+    unsigned int refs = 3;
+    size_t narSize = 64 * 1024;
+    unsigned int runs = 3;
+    unsigned int latencyMs = 0;
+    uint64_t bandwidth = 0; // bytes per second per connection, 0 = unlimited
+    bool useHttp = true;
+};
+
+
+/* A minimal HTTP/1.1 server for the files below `root'. Every
+   response is delayed by `latencyMs', and the body is sent at no more
+   than `bandwidth' bytes per second. */
+struct ThrottledServer
+{
+    Path root;
+    unsigned int latencyMs;
+    uint64_t bandwidth;
+    AutoCloseFD fdSocket;
+    int port;
+
+    ThrottledServer(const Path & root, unsigned int latencyMs, uint64_t bandwidth)
+        : root(root), latencyMs(latencyMs), bandwidth(bandwidth)
+    {
+        fdSocket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (!fdSocket) throw SysError("cannot create socket");
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = 0;
+        socklen_t addrLen = sizeof(addr);
+        if (bind(fdSocket.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1
+            || listen(fdSocket.get(), 64) == -1
+            || getsockname(fdSocket.get(), (struct sockaddr *) &addr, &addrLen) == -1)
+            throw SysError("cannot listen on a local port");
+        port = ntohs(addr.sin_port);
+
+        std::thread([this]() { acceptConnections(); }).detach();
+    }
+
+    void acceptConnections()
+    {
+        while (true) {
+            int fd = accept4(fdSocket.get(), nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd == -1) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            std::thread([this, fd]() {
+                AutoCloseFD conn(fd);
+                try {
+                    serve(fd);
+                } catch (Error & e) {
+                    debug("HTTP connection failed: %s", e.msg());
+                }
+            }).detach();
+        }
+    }
+
+    void serve(int fd)
+    {
+        std::string buf;
+
+        while (true) {
+            /* Read the request headers. Requests from the binary
+               cache store never have a body. */
+            size_t end;
+            while ((end = buf.find("\r\n\r\n")) == std::string::npos) {
+                char data[4096];
+                auto n = read(fd, data, sizeof(data));
+                if (n == -1) throw SysError("reading HTTP request");
+                if (n == 0) return;
+                buf.append(data, n);
+            }
+            auto lines = tokenizeString<std::vector<std::string>>(buf.substr(0, end), "\r\n");
+            buf.erase(0, end + 4);
+            if (lines.empty()) return;
+
+            auto requestLine = tokenizeString<std::vector<std::string>>(lines[0], " ");
+            if (requestLine.size() < 2) return;
+            auto & method(requestLine[0]);
+            auto target = std::string(requestLine[1], 0, requestLine[1].find('?'));
+
+            std::optional<std::pair<uint64_t, uint64_t>> range;
+            for (auto & line : lines) {
+                auto colon = line.find(':');
+                if (colon == std::string::npos || toLower(line.substr(0, colon)) != "range") continue;
+                auto spec = trim(line.substr(colon + 1));
+                uint64_t start, last;
+                auto dash = spec.find('-');
+                if (hasPrefix(spec, "bytes=") && dash != std::string::npos
+                    && string2Int(spec.substr(6, dash - 6), start)
+                    && string2Int(spec.substr(dash + 1), last)
+                    && start <= last)
+                    range = std::make_pair(start, last);
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(latencyMs));
+
+            auto path = root + target;
+            if (target.find("..") != std::string::npos || !pathExists(path) || !S_ISREG(lstat(path).st_mode)) {
+                writeFull(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+                continue;
+            }
+
+            auto contents = readFile(path);
+            std::string status = "200 OK", extraHeaders;
+            if (range && range->first < contents.size()) {
+                auto last = std::min(range->second, (uint64_t) contents.size() - 1);
+                extraHeaders = fmt("Content-Range: bytes %d-%d/%d\r\n", range->first, last, contents.size());
+                contents = contents.substr(range->first, last - range->first + 1);
+                status = "206 Partial Content";
+            }
+
+            writeFull(fd, fmt("HTTP/1.1 %s\r\nContent-Length: %d\r\n%s\r\n",
+                    status, contents.size(), extraHeaders));
+
+            if (method == "HEAD") continue;
+
+            auto start = std::chrono::steady_clock::now();
+            for (size_t pos = 0; pos < contents.size(); ) {
+                auto n = std::min(contents.size() - pos, (size_t) 16384);
+                writeFull(fd, (unsigned char *) contents.data() + pos, n);
+                pos += n;
+                if (bandwidth)
+                    std::this_thread::sleep_until(start + std::chrono::microseconds(pos * 1000000 / bandwidth));
+            }
+        }
+    }
+};
+
+
+/* Add a closure of `config.paths' paths to `store'. Each path refers
+   to the previous one and to `config.refs' - 1 random earlier ones,
+   so the last path's closure contains all of them. The contents are
+   compressible text listing the references. Returns the last path. */
+static Path makeClosure(Store & store, const SubstConfig & config)
+{
+    static const char * words[] = {
+        "lib", "bin", "share", "include", "nix", "store", "config", "static",
+        "the", "of", "and", "function", "return", "if", "else", "while",
+    };
+
+    std::mt19937_64 rng(0);
+    std::vector<Path> paths;
+
+    for (size_t i = 0; i < config.paths; ++i) {
+        ValidPathInfo info;
+        info.path = store.makeStorePath("output:out",
+            hashString(htSHA256, fmt("bench-subst-%d", i)), fmt("bench-%d", i));
+
+        if (i) {
+            info.references.insert(paths[i - 1]);
+            for (unsigned int r = 1; r < config.refs; ++r)
+                info.references.insert(paths[rng() % i]);
+        }
+
+        std::string contents;
+        for (auto & ref : info.references)
+            contents += ref + "\n";
+        auto size = rng() % (2 * config.narSize + 1);
+        while (contents.size() < size) {
+            contents += words[rng() % (sizeof(words) / sizeof(words[0]))];
+            contents += rng() % 8 ? ' ' : '\n';
+        }
+
+        StringSink nar;
+        dumpString(contents, nar);
+        info.narHash = hashString(htSHA256, *nar.s);
+        info.narSize = nar.s->size();
+        store.addToStore(info, nar.s, NoRepair, NoCheckSigs);
+
+        paths.push_back(info.path);
+    }
+
+    return paths.back();
+}
+
+
+struct Timings
+{
+    double metadata = 0, download = 0, decompress = 0, restore = 0;
+};
+
+
+static double since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+
+/* Fetch the closure of `top' from `cacheUri' into the store at
+   `destRoot', one phase at a time. */
+static Timings measurePhases(const std::string & cacheUri, const Path & top, const Path & destRoot)
+{
+    Timings t;
+
+    auto cache = openStore(cacheUri).cast<BinaryCacheStore>();
+    auto dest = openStore("local?root=" + destRoot);
+
+    auto start = std::chrono::steady_clock::now();
+    PathSet closure;
+    cache->computeFSClosure({top}, closure);
+    t.metadata = since(start);
+
+    /* Add the references of each path before the path itself. */
+    auto sorted = cache->topoSortPaths(closure);
+    std::reverse(sorted.begin(), sorted.end());
+
+    std::vector<ref<const NarInfo>> infos;
+    for (auto & path : sorted)
+        infos.push_back(ref<const NarInfo>(
+                std::dynamic_pointer_cast<const NarInfo>(cache->queryPathInfo(path).get_ptr())));
+
+    start = std::chrono::steady_clock::now();
+    std::vector<std::shared_ptr<std::string>> compressed;
+    for (auto & info : infos) {
+        auto data = cache->getFile(info->url);
+        if (!data) throw Error("NAR '%s' is missing from '%s'", info->url, cacheUri);
+        compressed.push_back(data);
+    }
+    t.download = since(start);
+
+    start = std::chrono::steady_clock::now();
+    std::vector<ref<std::string>> nars;
+    for (size_t i = 0; i < infos.size(); ++i) {
+        nars.push_back(decompress(infos[i]->compression, *compressed[i]));
+        compressed[i].reset();
+    }
+    t.decompress = since(start);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < infos.size(); ++i)
+        dest->addToStore(*infos[i], nars[i], NoRepair, NoCheckSigs);
+    t.restore = since(start);
+
+    return t;
+}
+
+
+/* Run a Nix command, returning its wall time. */
+static double timeCommand(const std::string & program, const Strings & args)
+{
+    auto start = std::chrono::steady_clock::now();
+    auto res = runProgram(RunOptions(settings.nixBinDir + "/" + program, args).killStderr(true));
+    auto t = since(start);
+    if (!statusOk(res.first))
+        throw Error("'%s %s' %s", program, concatStringsSep(" ", args), statusToString(res.first));
+    return t;
+}
+
+
+static void mainWrapped(int argc, char * * argv)
+{
+    SubstConfig config;
+    Strings methods = {"none", "xz", "zstd", "br"};
+
+    parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+        if (*arg == "--paths")
+            config.paths = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--refs")
+            config.refs = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--nar-size")
+            config.narSize = getIntArg<unsigned long>(*arg, arg, end, true);
+        else if (*arg == "--runs")
+            config.runs = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--latency")
+            config.latencyMs = getIntArg<unsigned long>(*arg, arg, end, false);
+        else if (*arg == "--bandwidth")
+            config.bandwidth = getIntArg<unsigned long long>(*arg, arg, end, true);
+        else if (*arg == "--compression")
+            methods = tokenizeString<Strings>(getArg(*arg, arg, end), ",");
+        else if (*arg == "--file")
+            config.useHttp = false;
+        else
+            return false;
+        return true;
+    });
+
+    if (!config.paths || !config.runs)
+        throw UsageError("'--paths' and '--runs' must be positive");
+
+    if (!config.useHttp && (config.latencyMs || config.bandwidth))
+        throw UsageError("'--latency' and '--bandwidth' require an HTTP cache");
+
+    /* Don't let the narinfo disk cache hide the metadata phase. */
+    settings.ttlPositiveNarInfoCache = 0;
+    settings.ttlNegativeNarInfoCache = 0;
+
+    AutoDelete tmpDir(createTempDir("", "nix-bench"), true);
+    Path dir = tmpDir;
+
+    std::cerr << "creating the closure...\n";
+    auto src = openStore("local?root=" + dir + "/src");
+    auto top = makeClosure(*src, config);
+
+    std::unique_ptr<ThrottledServer> server;
+    if (config.useHttp)
+        server = std::make_unique<ThrottledServer>(dir + "/caches", config.latencyMs, config.bandwidth);
+
+    size_t run = 0;
+
+    for (auto & method : methods) {
+        auto cacheDir = dir + "/caches/" + method;
+        std::cerr << fmt("populating the %s cache...\n", method);
+        try {
+            copyClosure(src, openStore(fmt("file://%s?compression=%s", cacheDir, method)),
+                {top}, NoRepair, NoCheckSigs);
+        } catch (UnknownCompressionMethod &) {
+            std::cerr << fmt("skipping unsupported compression method '%s'\n", method);
+            continue;
+        }
+
+        uint64_t narSize = 0, fileSize = 0;
+        {
+            auto cache = openStore("file://" + cacheDir);
+            PathSet closure;
+            cache->computeFSClosure({top}, closure);
+            for (auto & path : closure) {
+                auto info = std::dynamic_pointer_cast<const NarInfo>(cache->queryPathInfo(path).get_ptr());
+                narSize += info->narSize;
+                fileSize += info->fileSize;
+            }
+        }
+
+        auto cacheUri = config.useHttp
+            ? fmt("http://127.0.0.1:%d/%s", server->port, method)
+            : "file://" + cacheDir;
+
+        /* The best time of each measurement over all runs. */
+        Timings best;
+        double bestCopy = 0, bestSubstitute = 0;
+
+        for (unsigned int i = 0; i < config.runs; ++i) {
+            auto fresh = [&]() { return fmt("%s/dest-%d", dir, run++); };
+
+            auto t = measurePhases(cacheUri, top, fresh());
+
+            auto copy = timeCommand("nix", {"copy", "--from", cacheUri,
+                    "--to", "local?root=" + fresh(), "--no-check-sigs",
+                    "--option", "narinfo-cache-positive-ttl", "0",
+                    "--option", "narinfo-cache-stale-ttl", "0", top});
+
+            auto substitute = timeCommand("nix-store", {"--store", "local?root=" + fresh(), "-r", top,
+                    "--option", "substituters", cacheUri,
+                    "--option", "require-sigs", "false",
+                    "--option", "narinfo-cache-positive-ttl", "0",
+                    "--option", "narinfo-cache-stale-ttl", "0"});
+
+            auto better = [&](double & b, double v) { if (!i || v < b) b = v; };
+            better(best.metadata, t.metadata);
+            better(best.download, t.download);
+            better(best.decompress, t.decompress);
+            better(best.restore, t.restore);
+            better(bestCopy, copy);
+            better(bestSubstitute, substitute);
+        }
+
+        std::cout << fmt("\n%s: %d paths, %.1f MiB of NARs, %.1f MiB compressed\n",
+            method, config.paths, narSize / 1048576.0, fileSize / 1048576.0);
+
+        auto line = [&](const std::string & name, double t, uint64_t bytes) {
+            std::cout << "  " << std::left << std::setw(20) << name << std::right << std::fixed
+                      << std::setprecision(3) << std::setw(9) << t << " s";
+            if (bytes)
+                std::cout << std::setprecision(1) << std::setw(10) << bytes / t / 1048576.0 << " MiB/s";
+            else
+                std::cout << std::setprecision(0) << std::setw(10) << config.paths / t << " paths/s";
+            std::cout << "\n";
+        };
+
+        line("metadata", best.metadata, 0);
+        line("download", best.download, fileSize);
+        line("decompress", best.decompress, narSize);
+        line("restore", best.restore, narSize);
+        line("(sum of phases)", best.metadata + best.download + best.decompress + best.restore, narSize);
+        line("nix copy --from", bestCopy, narSize);
+        line("nix-store -r", bestSubstitute, narSize);
+    }
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+        mainWrapped(argc, argv);
+    });
+}
@@ -168,3 +168,109 @@ clearCacheCache
 nix-store -r $outPath --substituters "file://$cacheDir2 file://$cacheDir" --trusted-public-keys "$publicKey"
 
 fi # HAVE_LIBSODIUM
+
+
+# Test the .narinfo index: with the .narinfo files gone, the paths
+# should still be found through the index.
+clearStore
+clearCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to "file://$cacheDir?write-narinfo-index=true" $outPath
+
+grep -q "NarInfoIndex: 2" $cacheDir/nix-cache-info
+[[ -n $(ls $cacheDir/narinfo-index/*.xz) ]]
+
+# The paths were copied in parallel, and none of the batched index
+# updates lost an entry.
+if type -p xz > /dev/null; then
+    [ "$(xz -dc $cacheDir/narinfo-index/*.xz | grep -c '^StorePath: ')" = "$(nix-store -qR $outPath | wc -l)" ]
+fi
+
+# Shards that can't be read are reported, and the individual .narinfo
+# files are used instead.
+cp -r $cacheDir/narinfo-index $TEST_ROOT/narinfo-index
+for shard in $cacheDir/narinfo-index/*.xz; do echo garbage > $shard; done
+
+clearStore
+clearCacheCache
+
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath 2>&1 | tee $TEST_ROOT/log
+grep -q "cannot read .narinfo index shard" $TEST_ROOT/log
+[ -e $outPath ]
+
+rm -rf $cacheDir/narinfo-index
+mv $TEST_ROOT/narinfo-index $cacheDir/narinfo-index
+
+rm $cacheDir/*.narinfo
+
+clearStore
+clearCacheCache
+
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+nix-store -qR $outPath | grep input-2
+
+
+# Test chunked NARs.
+clearStore
+clearCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to "file://$cacheDir?nar-chunking=true&nar-chunk-size=1024" $outPath
+
+grep -q "Compression: chunked" $cacheDir/*.narinfo
+[[ -n $(ls $cacheDir/chunks) ]]
+
+clearStore
+clearCacheCache
+
+nix-store --substituters "file://$cacheDir?local-chunk-cache=$TEST_ROOT/chunk-cache" --no-require-sigs -r $outPath
+nix-store --verify-path $outPath
+[[ -n $(ls $TEST_ROOT/chunk-cache) ]]
+
+
+# Test binary deltas: a NAR can be rebuilt from a patch made with `zstd
+# --patch-from' against the NAR of a path that is already valid.
+if [ -n "$HAVE_ZSTD_DELTA" ] && zstd --help 2>&1 | grep -q -- --patch-from; then
+    clearStore
+    clearCache
+
+    mkDeltaTest() {
+        echo "with import ./config.nix; mkDerivation { name = \"delta-$1\"; builder = builtins.toFile \"builder\" \"mkdir \$out; seq 1 100000 > \$out/data; echo \$name >> \$out/data\"; }" | nix-build - --no-out-link
+    }
+
+    basePath=$(mkDeltaTest 1)
+    newPath=$(mkDeltaTest 2)
+    nix copy --to file://$cacheDir $newPath
+
+    nix-store --dump $basePath > $TEST_ROOT/base.nar
+    nix-store --dump $newPath > $TEST_ROOT/new.nar
+    zstd -q --patch-from=$TEST_ROOT/base.nar $TEST_ROOT/new.nar -o $cacheDir/nar/delta.zst
+
+    narInfo=$cacheDir/$(basename $newPath | cut -c1-32).narinfo
+    narUrl=$(sed -n 's/^URL: //p' $narInfo)
+    echo "Delta: $(basename $basePath) zstd nar/delta.zst $(stat -c %s $cacheDir/nar/delta.zst)" >> $narInfo
+
+    # Without the full NAR, the path can only come from the delta.
+    mv $cacheDir/$narUrl $TEST_ROOT/full.nar
+    nix-store --delete $newPath
+    clearCacheCache
+    nix-store --substituters file://$cacheDir --no-require-sigs -r $newPath
+    nix-store --verify-path $newPath
+    [ "$(tail -n1 $newPath/data)" = delta-2 ]
+
+    # Without the base, the delta can't be used.
+    nix-store --delete $newPath $basePath
+    clearCacheCache
+    (! nix-store --substituters file://$cacheDir --no-require-sigs -r $newPath)
+
+    # A bad delta falls back to the full NAR.
+    basePath=$(mkDeltaTest 1)
+    mv $TEST_ROOT/full.nar $cacheDir/$narUrl
+    head -c 1000 /dev/urandom > $cacheDir/nar/delta.zst
+    clearCacheCache
+    nix-store --substituters file://$cacheDir --no-require-sigs -r $newPath 2>&1 | grep 'cannot use delta'
+    nix-store --verify-path $newPath
+fi
@@ -0,0 +1,17 @@
+with import ./config.nix;
+
+{ name ? "tmpfs", scratchHint ? null, delay ? "0" }:
+
+mkDerivation ({
+  inherit name;
+  buildCommand = ''
+    onTmpfs=
+    if grep -q " $PWD tmpfs " /proc/self/mounts; then onTmpfs=1; fi
+    sleep ${delay}
+    mkdir $out
+    echo $onTmpfs > $out/on-tmpfs
+    cat $greetingPath > $out/greeting
+  '';
+  passAsFile = [ "greeting" ];
+  greeting = "hello";
+} // (if scratchHint == null then {} else { __scratchHint = scratchHint; }))
@@ -0,0 +1,33 @@
+source common.sh
+
+# Mounting a tmpfs requires root.
+if [ "$(id -u)" != 0 ] || ! grep -q tmpfs /proc/filesystems; then exit 99; fi
+
+clearStore
+
+# The build directory is on a tmpfs, which is mounted in the
+# builder's own mount namespace, with the files that Nix put there
+# beforehand.
+out=$(nix-build build-dir-tmpfs.nix --no-out-link --option build-dir-tmpfs 10)
+[ "$(cat $out/on-tmpfs)" = 1 ]
+[ "$(cat $out/greeting)" = hello ]
+(! grep nix-build- /proc/self/mounts)
+
+# Derivations that need more scratch space than that are built on
+# disk, and so is everything with 'keep-failed'.
+out=$(nix-build build-dir-tmpfs.nix --no-out-link --option build-dir-tmpfs 1 \
+    --arg scratchHint 100000000 --argstr name big)
+[ -z "$(cat $out/on-tmpfs)" ]
+out=$(nix-build build-dir-tmpfs.nix --no-out-link --option build-dir-tmpfs 10 \
+    --option keep-failed true --argstr name kept)
+[ -z "$(cat $out/on-tmpfs)" ]
+
+# Without a scratch hint, a running build holds back the whole tmpfs
+# limit, so the other build has to wait for it.
+pair='{ scratchHint ? null }: let f = args: import ./build-dir-tmpfs.nix ({ inherit scratchHint; delay = "2"; } // args); in [ (f { name = "first"; }) (f { name = "second"; }) ]'
+nix-build -E "$pair" --no-out-link -j2 --option build-dir-tmpfs 100 2> $TEST_ROOT/log
+grep -q "reserved for tmpfs build directories" $TEST_ROOT/log
+
+# With a small hint, both run at the same time.
+nix-build -E "$pair" --arg scratchHint 1 --no-out-link -j2 --option build-dir-tmpfs 100 2> $TEST_ROOT/log
+(! grep -q "reserved for tmpfs build directories" $TEST_ROOT/log)
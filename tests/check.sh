@@ -4,12 +4,18 @@ clearStore
 
 nix-build dependencies.nix --no-out-link
 nix-build dependencies.nix --no-out-link --check
+nix-build dependencies.nix --no-out-link --check --repeat 2
 
 nix-build check.nix -A nondeterministic --no-out-link
 nix-build check.nix -A nondeterministic --no-out-link --check 2> $TEST_ROOT/log || status=$?
 grep 'may not be deterministic' $TEST_ROOT/log
 [ "$status" = "104" ]
 
+status=0
+nix-build check.nix -A nondeterministic --no-out-link --check --repeat 2 2> $TEST_ROOT/log || status=$?
+grep 'may not be deterministic' $TEST_ROOT/log
+[ "$status" = "104" ]
+
 clearStore
 
 nix-build dependencies.nix --no-out-link --repeat 3
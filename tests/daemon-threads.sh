@@ -0,0 +1,25 @@
+source common.sh
+
+clearStore
+
+# Allow only one connection to be served by a thread at a time, so that
+# concurrent clients are handed off to processes of their own.
+startDaemon --option daemon-threads true --option daemon-max-threads 1
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+expected=$(nix-store -qR $outPath | sort)
+
+pids=()
+for i in $(seq 1 8); do
+    nix-store -qR $outPath > $TEST_ROOT/closure-$i &
+    pids+=($!)
+done
+for pid in "${pids[@]}"; do
+    wait $pid
+done
+
+for i in $(seq 1 8); do
+    [ "$(sort $TEST_ROOT/closure-$i)" = "$expected" ]
+done
+
+killDaemon
@@ -50,3 +50,10 @@ nix-store -q --referrers-closure "$input2OutPath" | grep "$outPath"
 # Check that the derivers are set properly.
 test $(nix-store -q --deriver "$outPath") = "$drvPath"
 nix-store -q --deriver "$input2OutPath" | grep -q -- "-input-2.drv" 
+
+# Closures come out the same whatever the size of the path info cache,
+# including caches smaller than the number of shards.
+closure=$(nix-store -qR $outPath | sort)
+for size in 0 1 5 100; do
+    [ "$(nix path-info -r --store "local?path-info-cache-size=$size" $outPath | sort)" = "$closure" ]
+done
@@ -18,3 +18,14 @@ deps2="$(nix-store -qR $TEST_ROOT/result)"
 
 nix-store --dump-db > $TEST_ROOT/dump2
 cmp $TEST_ROOT/dump $TEST_ROOT/dump2
+
+# Adding references to a valid path changes its closure size.
+echo small > $TEST_ROOT/small
+small=$(nix-store --add $TEST_ROOT/small)
+head -c 100000 /dev/zero > $TEST_ROOT/big
+big=$(nix-store --add $TEST_ROOT/big)
+size=$(nix path-info -S $small | cut -f2)
+[ "$(nix path-info -S $small | cut -f2)" = "$size" ]
+
+nix-store --dump-db $small | awk -v big=$big 'NR == 5 { print 1; print big; next } { print }' | nix-store --load-db
+[ "$(nix path-info -S $small | cut -f2)" -gt "$size" ]
@@ -0,0 +1,30 @@
+{ comment }:
+
+with import ./config.nix;
+
+rec {
+
+  # Changing `comment' changes this derivation, but not its output.
+  dep = mkDerivation {
+    name = "early-cutoff-dep";
+    buildCommand = ''
+      # ${comment}
+      mkdir $out
+      echo hello > $out/greeting
+      echo $out > $out/self
+    '';
+  };
+
+  top = mkDerivation {
+    name = "early-cutoff-top";
+    inherit dep;
+    buildCommand = ''
+      echo built >> $TEST_ROOT/early-cutoff-builds
+      mkdir $out
+      cat $dep/greeting > $out/greeting
+      ln -s $dep $out/dep
+    '';
+    TEST_ROOT = builtins.getEnv "TEST_ROOT";
+  };
+
+}
@@ -0,0 +1,32 @@
+source common.sh
+
+clearStore
+
+rm -f $TEST_ROOT/early-cutoff-builds
+
+out1=$(nix-build early-cutoff.nix -A top --argstr comment foo --no-out-link --option early-cutoff true)
+[ "$(cat $TEST_ROOT/early-cutoff-builds | wc -l)" = 1 ]
+
+# The dependency is rebuilt, but the dependent is not.
+out2=$(nix-build early-cutoff.nix -A top --argstr comment bar --no-out-link --option early-cutoff true)
+[ "$out1" != "$out2" ]
+[ "$(cat $TEST_ROOT/early-cutoff-builds | wc -l)" = 1 ]
+[ "$(cat $out2/greeting)" = hello ]
+[ "$(readlink $out2/dep)" = "$(nix-store -q --references $out2)" ]
+[ "$(cat $out2/dep/self)" = "$(readlink $out2/dep)" ]
+nix-store --verify-path $out2
+
+# Without early cutoff, it is rebuilt.
+nix-build early-cutoff.nix -A top --argstr comment baz --no-out-link
+[ "$(cat $TEST_ROOT/early-cutoff-builds | wc -l)" = 2 ]
+
+# If the old outputs can't be copied, the derivation is built.
+if [ "$(id -u)" != 0 ]; then
+    chmod u+w $out1 $out2
+    chmod 000 $out1/greeting $out2/greeting
+    out3=$(nix-build early-cutoff.nix -A top --argstr comment qux --no-out-link --option early-cutoff true)
+    [ "$(cat $TEST_ROOT/early-cutoff-builds | wc -l)" = 3 ]
+    [ "$(cat $out3/greeting)" = hello ]
+    chmod 444 $out1/greeting $out2/greeting
+    chmod u-w $out1 $out2
+fi
@@ -0,0 +1,107 @@
+source common.sh
+
+clearStore
+
+rm -f $TEST_HOME/.cache/nix/eval-cache-*.sqlite
+
+echo -n foo > $TEST_ROOT/eval-cache-name
+
+cat > $TEST_ROOT/eval-cache.nix <<EOF2
+with import $(pwd)/config.nix;
+builtins.trace "evaluating" (mkDerivation {
+  name = builtins.readFile ./eval-cache-name;
+  buildCommand = "mkdir \$out";
+})
+EOF2
+
+instantiate() {
+    nix-instantiate --option eval-cache true $TEST_ROOT/eval-cache.nix 2> $TEST_ROOT/eval-cache.log
+}
+
+# The first evaluation fills the cache.
+drvPath=$(instantiate)
+[[ $drvPath =~ -foo.drv$ ]]
+grep -q evaluating $TEST_ROOT/eval-cache.log
+
+# The second one is answered from the cache.
+[[ $(instantiate) = $drvPath ]]
+(! grep -q evaluating $TEST_ROOT/eval-cache.log)
+
+# Changing an input invalidates the entry.
+echo -n bar > $TEST_ROOT/eval-cache-name
+drvPath2=$(instantiate)
+[[ $drvPath2 =~ -bar.drv$ ]]
+grep -q evaluating $TEST_ROOT/eval-cache.log
+
+# So does changing an environment variable read by the evaluation.
+[[ $(instantiate) = $drvPath2 ]]
+(! grep -q evaluating $TEST_ROOT/eval-cache.log)
+_NIX_TEST_SHARED=x instantiate > /dev/null
+grep -q evaluating $TEST_ROOT/eval-cache.log
+
+# Results that depend on the current time are not cached.
+cat > $TEST_ROOT/eval-cache-time.nix <<EOF2
+with import $(pwd)/config.nix;
+builtins.trace "evaluating" (mkDerivation {
+  name = if builtins.currentTime > 0 then "time" else "no-time";
+  buildCommand = "mkdir \$out";
+})
+EOF2
+nix-instantiate --option eval-cache true $TEST_ROOT/eval-cache-time.nix 2> /dev/null
+nix-instantiate --option eval-cache true $TEST_ROOT/eval-cache-time.nix 2> $TEST_ROOT/eval-cache.log
+grep -q evaluating $TEST_ROOT/eval-cache.log
+
+# nix-env -qa uses the cache as well.
+query() {
+    nix-env --option eval-cache true -f $TEST_ROOT/eval-cache.nix -qa --description 2> $TEST_ROOT/eval-cache.log
+}
+[[ $(query) = bar* ]]
+grep -q evaluating $TEST_ROOT/eval-cache.log
+[[ $(query) = bar* ]]
+(! grep -q evaluating $TEST_ROOT/eval-cache.log)
+
+# The cache is not used unless enabled.
+nix-instantiate $TEST_ROOT/eval-cache.nix 2> $TEST_ROOT/eval-cache.log
+grep -q evaluating $TEST_ROOT/eval-cache.log
+
+# Source trees copied to the store are remembered across evaluations,
+# but a change to any file is noticed.
+mkdir -p $TEST_ROOT/eval-cache-src
+echo foo > $TEST_ROOT/eval-cache-src/file
+copySource() {
+    nix-instantiate --option eval-source-cache true --eval -E "\"\${$TEST_ROOT/eval-cache-src}\""
+}
+srcPath=$(copySource)
+[[ $(copySource) = $srcPath ]]
+echo bar > $TEST_ROOT/eval-cache-src/file
+[[ $(copySource) != $srcPath ]]
+
+# With --incremental-jobs, only the jobs that read a changed file are
+# evaluated again, even though both share `common'.
+echo -n a > $TEST_ROOT/eval-cache-a
+echo -n b > $TEST_ROOT/eval-cache-b
+cat > $TEST_ROOT/eval-cache-jobs.nix <<EOF2
+with import $(pwd)/config.nix;
+let
+  common = name: builtins.trace "evaluating \${name}" (mkDerivation {
+    inherit name;
+    buildCommand = "mkdir \$out";
+  });
+in {
+  a = common (builtins.readFile ./eval-cache-a);
+  b = common (builtins.readFile ./eval-cache-b);
+}
+EOF2
+
+jobs() {
+    nix-instantiate --incremental-jobs $TEST_ROOT/eval-cache-jobs.nix 2> $TEST_ROOT/eval-cache.log
+}
+
+[[ $(jobs | wc -l) = 2 ]]
+grep -q "evaluating a" $TEST_ROOT/eval-cache.log
+grep -q "evaluating b" $TEST_ROOT/eval-cache.log
+
+echo -n a2 > $TEST_ROOT/eval-cache-a
+jobs | grep -q -- -a2.drv
+grep -q "evaluating a2" $TEST_ROOT/eval-cache.log
+(! grep -q "evaluating b" $TEST_ROOT/eval-cache.log)
@@ -0,0 +1,45 @@
+source common.sh
+
+clearStore
+
+socket=$TEST_HOME/.cache/nix/eval-server.socket
+rm -f $socket
+
+nix eval-server 2> $TEST_ROOT/eval-server.log &
+pidServer=$!
+trap "kill -9 $pidServer" EXIT
+for ((i = 0; i < 30; i++)); do
+    if [ -e $socket ]; then break; fi
+    sleep 1
+done
+
+expected=$(nix-instantiate dependencies.nix)
+
+instantiate() {
+    nix-instantiate --option eval-server true -vvvvv dependencies.nix 2> $TEST_ROOT/client.log
+}
+
+checkServed() {
+    [ "$(instantiate)" = "$expected" ]
+    (! grep -q "evaluating locally\|cannot connect" $TEST_ROOT/client.log)
+}
+
+checkServed
+checkServed
+
+if type -p nc > /dev/null; then
+    # A malformed request doesn't kill the server.
+    printf '\x05\0\0\0\0\0\0\0hello\0\0\0' | nc -U $socket > /dev/null || true
+    printf '\x02\0\0\0\0\0\0\0{}\0\0\0\0\0\0' | nc -U $socket > /dev/null || true
+    checkServed
+
+    # A client that sends nothing doesn't block the others for long.
+    sleep 60 | nc -U $socket > /dev/null &
+    pidStuck=$!
+    sleep 1
+    checkServed
+    kill $pidStuck || true
+fi
+
+kill -9 $pidServer
+trap "" EXIT
@@ -26,4 +26,12 @@ rec {
     exportReferencesGraph = ["refs" (import ./dependencies.nix).drvPath];
   };
 
+  packedClosure = derivation {
+    name = "closure.tar";
+    system = "builtin";
+    builder = "builtin:pack-closure";
+    closureInfo = "refs";
+    exportReferencesGraph = ["refs" (import ./dependencies.nix)];
+  };
+
 }
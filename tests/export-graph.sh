@@ -28,3 +28,12 @@ checkRef input-2
 checkRef input-2.drv
 
 for i in $(cat $outPath); do checkRef $i; done
+
+# Test packing the runtime closure into a tar archive.
+
+outPath=$(nix-build ./export-graph.nix -A packedClosure --no-out-link)
+
+deps=$(nix-build ./dependencies.nix --no-out-link)
+for i in $(nix-store -qR $deps); do
+    tar tf $outPath | grep -qE "^${i#/}/?$" || fail "closure archive lacks $i"
+done
@@ -3,6 +3,7 @@ source common.sh
 clearStore
 
 outPath=$(nix-build dependencies.nix --no-out-link)
+closure=$(nix-store -qR $outPath | sort)
 
 nix-store --export $outPath > $TEST_ROOT/exp
 
@@ -34,3 +35,46 @@ clearStore
 # Regression test: the derivers in exp_all2 are empty, which shouldn't
 # cause a failure.
 nix-store --import < $TEST_ROOT/exp_all2
+
+
+# Indexed exports can be imported as a whole or in part.
+nix-store --export --index $(nix-store -qR $outPath) > $TEST_ROOT/exp_index
+
+clearStore
+
+nix-store --import < $TEST_ROOT/exp_index
+nix-store --verify-path $outPath
+
+clearStore
+
+depPath=$(nix-store --import < $TEST_ROOT/exp_all | head -n1)
+clearStore
+nix-store --import $depPath < $TEST_ROOT/exp_index
+nix-store --verify-path $depPath
+(! nix-store --verify-path $outPath)
+
+clearStore
+
+cat $TEST_ROOT/exp_index | nix-store --import > /dev/null
+nix-store --verify-path $outPath
+
+
+# Paths are imported in batches; references within a batch and
+# between batches must both be registered.
+clearStore
+
+nix-store --import --option import-batch-size 2 < $TEST_ROOT/exp_all > /dev/null
+nix-store --verify-path $closure
+[[ $(nix-store -qR $outPath | sort) = $closure ]]
+
+# The same goes for 'nix copy', which imports the missing paths of a
+# closure in one go.
+cacheDir2=$TEST_ROOT/export-cache
+rm -rf $cacheDir2
+nix copy --to file://$cacheDir2 $outPath
+
+clearStore
+
+nix copy --from file://$cacheDir2 --no-check-sigs --option import-batch-size 2 $outPath
+nix-store --verify-path $closure
+[[ $(nix-store -qR $outPath | sort) = $closure ]]
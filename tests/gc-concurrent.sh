@@ -28,6 +28,11 @@ pid2=$!
 
 # Run the garbage collector while the build is running.
 sleep 6
+
+# The plan takes the temporary root of the running build into account.
+plan=$(nix-store --gc --print-plan)
+if echo "${plan#*\"dead\":}" | grep "\"$drvPath1\""; then false; fi
+
 nix-collect-garbage
 
 # Wait for build #1/#2 to finish.
@@ -35,4 +35,25 @@ if ! test -e $outPath; then
     exit 1
 fi
 
+# Store paths in the environment of a process are roots as well, also
+# when the environment was already scanned by an earlier collection.
+echo foo > $TEST_ROOT/gc-runtime-env
+envPath=$(nix-store --add $TEST_ROOT/gc-runtime-env)
+GC_RUNTIME_ROOT=$envPath sleep 60 &
+envChild=$!
+sleep 1
+
+nix-store --gc
+test -e $envPath
+nix-store --gc
+test -e $envPath
+
+kill $envChild
+wait $envChild || true
+nix-store --gc
+if test -e $envPath; then
+    echo "path in the environment of a dead process was not garbage collected!"
+    exit 1
+fi
+
 exit 0
@@ -16,6 +16,12 @@ if nix-store --gc --print-dead | grep $outPath; then false; fi
 
 nix-store --gc --print-dead
 
+# The dry-run planner agrees with --print-dead.
+plan=$(nix-store --gc --print-plan)
+echo "$plan" | grep "\"$outPath\":{\"links\":\[[^]]*\"$NIX_STATE_DIR/gcroots/foo\""
+echo "${plan#*\"dead\":}" | grep "\"$drvPath\""
+if echo "${plan#*\"dead\":}" | grep "\"$outPath\""; then false; fi
+
 inUse=$(readLink $outPath/input-2)
 if nix-store --delete $inUse; then false; fi
 test -e $inUse
@@ -38,3 +44,68 @@ nix-collect-garbage
 
 # Check that the output has been GC'd.
 if test -e $outPath/foobar; then false; fi
+
+# Same for the incremental collector, deleting one path per slice.
+drvPath=$(nix-instantiate dependencies.nix)
+outPath=$(nix-store -r "$drvPath")
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+
+nix-collect-garbage --option gc-incremental true --option gc-slice-time 0
+
+cat $outPath/foobar
+cat $outPath/input-2/bar
+if test -e $drvPath; then false; fi
+
+rm "$NIX_STATE_DIR"/gcroots/foo
+
+nix-collect-garbage --option gc-incremental true --option gc-slice-time 0
+
+if test -e $outPath/foobar; then false; fi
+
+# The collector leaves a snapshot of the reference graph behind, which
+# referrer closures and why-depends use while it is current.
+outPath=$(nix-build dependencies.nix --no-out-link)
+ln -sf $outPath "$NIX_STATE_DIR"/gcroots/foo
+inUse=$(readLink $outPath/input-2)
+
+nix-collect-garbage
+test -f $NIX_STATE_DIR/db/refs-graph
+
+nix-store -q --referrers-closure $inUse | grep $outPath
+nix why-depends $outPath $inUse | grep input-2
+
+# Paths added after the snapshot was taken are seen as well.
+echo foo > $TEST_ROOT/gc-new
+newPath=$(nix-store --add $TEST_ROOT/gc-new)
+[ "$(nix-store -q --referrers-closure $newPath)" = $newPath ]
+
+nix-collect-garbage
+(! test -e $newPath)
+cat $outPath/input-2/bar
+
+# Giving a valid path more references, or deleting paths, drops the
+# snapshot, since the new edges aren't in it.
+echo bar > $TEST_ROOT/gc-new
+newPath=$(nix-store --add $TEST_ROOT/gc-new)
+ln -sf $newPath "$NIX_STATE_DIR"/gcroots/bar
+nix-collect-garbage
+test -f $NIX_STATE_DIR/db/refs-graph
+(! nix-store -q --referrers-closure $inUse | grep $newPath)
+printf '%s\n\n1\n%s\n' $newPath $inUse | nix-store --register-validity --reregister
+(! test -f $NIX_STATE_DIR/db/refs-graph)
+nix-store -q --referrers-closure $inUse | grep $newPath
+
+nix-collect-garbage
+test -f $NIX_STATE_DIR/db/refs-graph
+rm "$NIX_STATE_DIR"/gcroots/bar
+nix-store --delete $newPath
+(! nix-store -q --referrers-closure $inUse | grep $newPath)
+
+rm "$NIX_STATE_DIR"/gcroots/foo
+
+# Paths are deleted by several threads at once.
+manyFiles=$(echo 'with import ./config.nix; mkDerivation { name = "many-files"; builder = builtins.toFile "builder" "for i in 1 2 3 4 5 6 7 8; do mkdir -p $out/$i/sub; for j in 1 2 3 4 5 6 7 8; do echo $i$j > $out/$i/sub/$j; ln -s $j $out/$i/link-$j; done; done"; }' | nix-build - --no-out-link)
+nix-collect-garbage --option gc-delete-threads 4 | tee $TEST_ROOT/gc-log
+grep -q 'files, .* files/s)' $TEST_ROOT/gc-log
+(! test -e $manyFiles)
+(! ls $NIX_STORE_DIR/trash 2> /dev/null | grep .)
@@ -0,0 +1,27 @@
+{ fail ? false }:
+
+with import ./config.nix;
+
+let
+
+  imported = n: builder: mkDerivation {
+    name = "imported-${toString n}";
+    builder = builtins.toFile "builder.sh" builder;
+  };
+
+  foo = n: value: mkDerivation {
+    name = "foo-${toString n}";
+    builder = builtins.toFile "builder.sh"
+      ''
+        echo -n FOO${toString value} > $out
+      '';
+  };
+
+in
+
+{
+  a = foo 1 (import (imported 1 "echo 'builtins.add 1 2' > $out"));
+  b = foo 2 (import (imported 2 "echo 'builtins.add 3 4' > $out"));
+} // (if fail then {
+  c = foo 3 (import (imported 3 "exit 1"));
+} else {})
@@ -10,3 +10,25 @@ fi
 outPath=$(nix-build ./import-derivation.nix --no-out-link)
 
 [ "$(cat $outPath)" = FOO579 ]
+
+clearStore
+
+outPath=$(nix-build --option eval-batch-ifd true ./import-derivation.nix --no-out-link)
+
+[ "$(cat $outPath)" = FOO579 ]
+
+# With several attributes, the imported derivations are built in a
+# single batch.
+clearStore
+
+nix-instantiate --option eval-batch-ifd true ./import-derivation-batch.nix 2> $TEST_ROOT/log
+grep -q 'building 2 paths needed by imports from derivations' $TEST_ROOT/log
+outPath=$(nix-build ./import-derivation-batch.nix -A b --no-out-link)
+[ "$(cat $outPath)" = FOO7 ]
+
+# A failing import build is reported by the evaluation.
+clearStore
+
+(! nix-instantiate --option eval-batch-ifd true --arg fail true ./import-derivation-batch.nix 2> $TEST_ROOT/log)
+grep -q 'building 3 paths needed by imports from derivations' $TEST_ROOT/log
+grep -q 'imported-3.drv' $TEST_ROOT/log
@@ -5,6 +5,14 @@ export TEST_VAR=foo # for eval-okay-getenv.nix
 nix-instantiate --eval -E 'builtins.trace "Hello" 123' 2>&1 | grep -q Hello
 (! nix-instantiate --show-trace --eval -E 'builtins.addErrorContext "Hello" 123' 2>&1 | grep -q Hello)
 nix-instantiate --show-trace --eval -E 'builtins.addErrorContext "Hello" (throw "Foo")' 2>&1 | grep -q Hello
+[[ $(nix-instantiate --option eval-allocator arena --eval -E 'builtins.length (builtins.genList (x: { inherit x; }) 10000)') = 10000 ]]
+nix-instantiate --option eval-profile-file $TEST_ROOT/profile --eval -E 'builtins.foldl'"'"' (x: y: x + y) 0 [ 1 2 3 ]'
+grep -q "primop __foldl'" $TEST_ROOT/profile
+nix-instantiate --option eval-stats-file $TEST_ROOT/stats.json --eval -E 'import ./lang/eval-okay-list.nix'
+grep -q '"parse"' $TEST_ROOT/stats.json
+[[ $(nix-instantiate --option eval-preparse-threads 2 --eval --strict lang/eval-okay-import.nix) = $(cat lang/eval-okay-import.exp) ]]
+nix-instantiate --option max-tail-calls 1000 --eval -E 'let f = x: f x; in f 1' 2>&1 | grep -q 'stack overflow'
+[[ $(nix-instantiate --option max-tail-calls 1000 --eval -E 'let f = n: if n == 0 then 0 else f (n - 1); in f 1000') = 0 ]]
 
 set +x
 
@@ -35,6 +43,10 @@ for i in lang/eval-fail-*.nix; do
         echo "FAIL: $i shouldn't evaluate"
         fail=1
     fi
+    if nix-instantiate --option eval-bytecode true --eval lang/$i.nix; then
+        echo "FAIL: $i shouldn't evaluate with the bytecode interpreter"
+        fail=1
+    fi
 done
 
 for i in lang/eval-okay-*.nix; do
@@ -53,6 +65,25 @@ for i in lang/eval-okay-*.nix; do
             echo "FAIL: evaluation result of $i not as expected"
             fail=1
         fi
+
+        if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option eval-bytecode true --eval --strict lang/$i.nix > lang/$i.out; then
+            echo "FAIL: $i should evaluate with the bytecode interpreter"
+            fail=1
+        elif ! diff lang/$i.out lang/$i.exp; then
+            echo "FAIL: bytecode evaluation result of $i not as expected"
+            fail=1
+        fi
+
+        # The first run fills the AST cache, the second one uses it.
+        for pass in store load; do
+            if ! NIX_PATH=lang/dir3:lang/dir4 nix-instantiate $flags --option ast-cache true --eval --strict lang/$i.nix > lang/$i.out; then
+                echo "FAIL: $i should evaluate with the AST cache ($pass)"
+                fail=1
+            elif ! diff lang/$i.out lang/$i.exp; then
+                echo "FAIL: evaluation result of $i with the AST cache ($pass) not as expected"
+                fail=1
+            fi
+        done
     fi
 
     if test -e lang/$i.exp.xml; then
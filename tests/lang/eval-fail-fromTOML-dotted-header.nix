@@ -0,0 +1,8 @@
+# A table created by a dotted key can't be defined by a header.
+builtins.fromTOML ''
+  [fruit]
+  apple.color = "red"
+
+  [fruit.apple]
+  texture = "smooth"
+''
@@ -0,0 +1 @@
+builtins.fromTOML "x = +.5"
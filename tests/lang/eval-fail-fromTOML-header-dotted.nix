@@ -0,0 +1,8 @@
+# A table defined by a header can't be extended by a dotted key.
+builtins.fromTOML ''
+  [a.b.c]
+  z = 9
+
+  [a]
+  b.c.t = 1
+''
@@ -0,0 +1,17 @@
+builtins.fromTOML ''
+  int1 = 0
+  int2 = -0
+  int3 = 0x00ff
+  int4 = 0o007
+  flt1 = -0.5
+  flt2 = 1e3
+  flt3 = 0.25e1
+  flt4 = 1_0.2_5
+
+  # Headers can define sub-tables of tables created by dotted keys.
+  [t]
+  x.y = 1
+
+  [t.x.z]
+  w = 2
+''
@@ -54,7 +54,8 @@
     physical.shape = "round"
     site."google.com" = true
 
-    # This is legal according to the spec, but cpptoml doesn't handle it.
+    # This is legal according to the spec, but would conflict with the
+    # [a.b.c] table below.
     #a.b.c = 1
     #a.d = 2
 
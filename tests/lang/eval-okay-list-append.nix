@@ -0,0 +1,6 @@
+# Appending to a list must not affect other lists sharing its buffer.
+let
+  xs = builtins.foldl' (acc: x: acc ++ [x]) [] (builtins.genList (x: x) 10);
+  a = xs ++ [ 100 ];
+  b = xs ++ [ 200 ];
+in [ (builtins.elemAt a 10) (builtins.elemAt b 10) (builtins.length xs) (builtins.elemAt (a ++ b) 21) ]
@@ -0,0 +1,3 @@
+let
+  f = x: builtins.trace "called" (x.a + 1);
+in [ (builtins.memoise f { a = 1; }) (builtins.memoise f { a = 1; }) (builtins.memoise f { a = 2; }) ]
@@ -0,0 +1,8 @@
+with builtins;
+
+let
+  n = 50000;
+  xs = genList (i: (i * 7919) - (i / 3) * 23757) n;
+  sorted = sort lessThan xs;
+  isSorted = l: all (i: elemAt l i <= elemAt l (i + 1)) (genList (i: i) (length l - 1));
+in [ (length sorted == n) (isSorted sorted) (head sorted) (elemAt sorted (n - 1)) ]
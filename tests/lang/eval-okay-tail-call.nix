@@ -0,0 +1,6 @@
+# Tail calls shouldn't use C stack space; `acc < 0' forces the
+# accumulator so that it doesn't become a deep chain of thunks.
+let
+  sum = n: acc: if n == 0 || acc < 0 then acc else sum (n - 1) (acc + n);
+  count = n: let m = n - 1; in assert m >= -1; if n == 0 then "done" else with { inherit m; }; count m;
+in [ (sum 1000000 0) (count 1000000) ]
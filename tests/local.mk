@@ -6,12 +6,13 @@ nix_tests = \
   gc.sh gc-concurrent.sh \
   referrers.sh user-envs.sh logging.sh nix-build.sh misc.sh fixed.sh \
   gc-runtime.sh check-refs.sh filter-source.sh \
-  remote-store.sh export.sh export-graph.sh \
+  remote-store.sh daemon-threads.sh export.sh export-graph.sh \
   timeout.sh secure-drv-outputs.sh nix-channel.sh \
   multiple-outputs.sh import-derivation.sh fetchurl.sh optimise-store.sh \
   binary-cache.sh nix-profile.sh repair.sh dump-db.sh case-hack.sh \
   check-reqs.sh pass-as-file.sh tarball.sh restricted.sh \
   placeholders.sh nix-shell.sh \
+  early-cutoff.sh \
   linux-sandbox.sh \
   build-dry.sh \
   build-remote.sh \
@@ -25,7 +26,12 @@ nix_tests = \
   pure-eval.sh \
   check.sh \
   plugins.sh \
+  unit.sh \
   search.sh \
+  eval-cache.sh \
+  peer-store.sh \
+  eval-server.sh \
+  build-dir-tmpfs.sh \
   nix-copy-ssh.sh
   # parallel.sh
 
@@ -35,4 +41,4 @@ tests-environment = NIX_REMOTE= $(bash) -e
 
 clean-files += $(d)/common.sh
 
-installcheck: $(d)/common.sh $(d)/plugins/libplugintest.$(SO_EXT)
+installcheck: $(d)/common.sh $(d)/plugins/libplugintest.$(SO_EXT) $(d)/unit/nix-unit-tests
@@ -37,6 +37,15 @@ diff -u baz.cat-nar $storePath/foo/baz
 nix ls-store --json -R $storePath/xyzzy 2>&1 | grep 'does not exist in NAR'
 nix ls-store $storePath/xyzzy 2>&1 | grep 'does not exist'
 
+# Test reading files from an uncompressed NAR in a binary cache,
+# which uses the NAR listing and range reads.
+cacheDir=$TEST_ROOT/nar-access-cache
+rm -rf $cacheDir
+nix copy --to file://$cacheDir?compression=none $storePath
+[[ -e $cacheDir/$(basename $storePath | cut -c1-32).ls ]]
+nix cat-store --store file://$cacheDir $storePath/foo/data > data.cat-store
+diff -u data.cat-store $storePath/foo/data
+
 # Test failure to dump.
 if nix-store --dump $storePath >/dev/full ; then
     echo "dumping to /dev/full should fail"
@@ -55,3 +55,10 @@ chmod a+rx $TEST_ROOT/shell.shebang.rb
 
 output=$($TEST_ROOT/shell.shebang.rb abc ruby)
 [ "$output" = '-e load("'"$TEST_ROOT"'/shell.shebang.rb") -- abc ruby' ]
+
+# Test caching the environment set up by $stdenv/setup
+for i in 1 2; do
+    [[ $(nix-shell --pure --option nix-shell-env-cache true shell.nix -A shellDrv --run \
+        'echo "$IMPURE_VAR - $VAR_FROM_STDENV_SETUP - $VAR_FROM_NIX"') = " - foo - bar" ]]
+done
+[[ -n $(ls $TEST_HOME/.cache/nix/shell-env) ]]
@@ -35,9 +35,101 @@ if [ "$inode1" != "$inode3" ]; then
     exit 1
 fi
 
+# The database has an entry for every file in the links directory.
+if [ -n "$(type -p sqlite3)" ]; then
+    [ "$(sqlite3 $NIX_STATE_DIR/db/db.sqlite 'select count(*) from Links')" = "$(ls $NIX_STORE_DIR/.links | wc -l)" ]
+fi
+
+# Deleting one of the paths keeps the links still used by the others.
+nix-store --delete $outPath1
+[ "$(cat $outPath2/foo)" = hello ]
+[ "$(stat --format=%h $outPath2/foo)" = 3 ]
+[ -n "$(ls $NIX_STORE_DIR/.links)" ]
+
 nix-store --gc
 
 if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
     echo ".links directory not empty after GC"
     exit 1
 fi
+
+if [ -n "$(type -p sqlite3)" ]; then
+    [ "$(sqlite3 $NIX_STATE_DIR/db/db.sqlite 'select count(*) from Links')" = 0 ]
+fi
+
+# Optimisation on several threads links all copies of a file together.
+clearStore
+
+mkFoo() {
+    echo "with import ./config.nix; mkDerivation { name = \"foo$1\"; builder = builtins.toFile \"builder\" \"mkdir \$out; for i in 1 2 3 4 5 6 7 8; do echo hello \$i > \$out/foo\$i; done\"; }" | nix-build - --no-out-link "${@:2}"
+}
+
+outPaths=
+for i in 1 2 3 4 5 6; do outPaths="$outPaths $(mkFoo $i)"; done
+
+nix-store --optimise --option optimise-threads 4
+
+for i in 1 2 3 4 5 6 7 8; do
+    inodes=$(for p in $outPaths; do stat --format=%i $p/foo$i; done | sort -u | wc -l)
+    [ "$inodes" = 1 ]
+done
+
+# In reflink mode, identical files keep their own inodes and nothing is
+# added to the links directory. File systems without dedupe support
+# leave the files alone.
+clearStore
+
+outPaths=
+for i in 1 2 3; do outPaths="$outPaths $(mkFoo $i)"; done
+
+nix-store --optimise --option optimise-method reflink
+
+for i in 1 2 3 4 5 6 7 8; do
+    inodes=$(for p in $outPaths; do stat --format=%i $p/foo$i; done | sort -u | wc -l)
+    [ "$inodes" = 3 ]
+    for p in $outPaths; do [ "$(cat $p/foo$i)" = "hello $i" ]; done
+done
+[ -z "$(ls $NIX_STORE_DIR/.links)" ]
+nix-store --verify --check-contents
+
+# Reflinking also works while building.
+outPath=$(mkFoo 4 --option auto-optimise-store true --option optimise-method reflink)
+[ "$(stat --format=%h $outPath/foo1)" = 1 ]
+[ "$(cat $outPath/foo1)" = "hello 1" ]
+
+# With restore-dedup, substituting a path reuses the files that are
+# already in the store instead of writing them again, both small files
+# (hashed before they're written) and large ones (replaced after).
+clearStore
+clearCache
+
+mkBig() {
+    echo "with import ./config.nix; mkDerivation { name = \"big$1\"; builder = builtins.toFile \"builder\" \"mkdir \$out; echo hello > \$out/small; head -c 20000000 /dev/zero > \$out/big; echo \$name > \$out/unique\"; }" | nix-build - --no-out-link "${@:2}"
+}
+
+outPath1=$(mkBig 1 --auto-optimise-store)
+outPath2=$(mkBig 2)
+outPath3=$(mkBig 3)
+nix copy --to file://$cacheDir $outPath2 $outPath3
+nix-store --delete $outPath2 $outPath3
+
+nix-store --substituters file://$cacheDir --no-require-sigs --option restore-dedup true -r $outPath2
+for f in small big; do
+    [ "$(stat --format=%i $outPath1/$f)" = "$(stat --format=%i $outPath2/$f)" ]
+done
+[ "$(cat $outPath2/unique)" = big2 ]
+nix-store --verify-path $outPath2
+
+# Files that aren't in the links directory are written as usual.
+[ "$(stat --format=%h $outPath2/unique)" = 1 ]
+
+# In reflink mode, reused files get their own inodes. Without clone
+# support, they are written instead.
+nix-store --optimise --option optimise-method reflink
+nix-store --substituters file://$cacheDir --no-require-sigs --option restore-dedup true --option optimise-method reflink -r $outPath3
+for f in small big; do
+    [ "$(stat --format=%i $outPath1/$f)" != "$(stat --format=%i $outPath3/$f)" ]
+    cmp $outPath1/$f $outPath3/$f
+done
+[ "$(cat $outPath3/unique)" = big3 ]
+nix-store --verify-path $outPath3
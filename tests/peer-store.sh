@@ -0,0 +1,58 @@
+source common.sh
+
+clearStore
+clearCache
+
+nix-store --generate-binary-cache-key peer.example.org $TEST_ROOT/sk $TEST_ROOT/pk
+pk=$(cat $TEST_ROOT/pk)
+
+outPath=$(nix-build dependencies.nix --no-out-link --secret-key-files $TEST_ROOT/sk)
+
+peer1=$TEST_ROOT/peer1
+peer2=$TEST_ROOT/peer2
+peer3=$TEST_ROOT/peer3
+rm -rf $peer1 $peer2 $peer3
+
+nix copy --to file://$peer1 $outPath
+nix copy --to file://$peer2 $outPath
+nix copy --to file://$peer3 $outPath
+
+# Peer 2 returns a different NAR hash and no signatures.
+for i in $peer2/*.narinfo; do
+    sed -i -e 's/^NarHash: .*/NarHash: sha256:1111111111111111111111111111111111111111111111111111/' -e '/^Sig: /d' $i
+done
+
+peersFile=$TEST_ROOT/peers
+
+substitute() {
+    clearStore
+    clearCacheCache
+    nix-store -r $outPath --substituters "peers://?peers-file=$peersFile" --trusted-public-keys $pk "$@"
+}
+
+# Without peers, nothing can be substituted.
+rm -f $peersFile
+(! substitute)
+
+# The peers are read from the peers file.
+echo "file://$peer1" > $peersFile
+substitute
+[ -x $outPath/program ]
+
+# An unsigned peer that answers first doesn't keep signed ones from
+# being used.
+printf "file://$peer2\nfile://$peer1\n" > $peersFile
+substitute 2>&1 | tee $TEST_ROOT/log
+grep -q "ignoring unsigned info about '$outPath' from peer 'file://$peer2'" $TEST_ROOT/log
+nix-store --verify-path $outPath
+
+# Paths only available from unsigned peers are not substituted.
+echo "file://$peer2" > $peersFile
+(! substitute)
+
+# If a peer that has a path loses it, another peer that has it is
+# used.
+printf "file://$peer1\nfile://$peer3\n" > $peersFile
+rm -rf $peer1/nar
+substitute
+[ -x $outPath/program ]
@@ -34,3 +34,18 @@ if [ -n "$(type -p sqlite3)" -a "$(sqlite3 $NIX_STATE_DIR/db/db.sqlite 'select c
     echo "referrers not cleaned up"
     exit 1
 fi
+
+# Concurrent writers wait for each other, also with a short busy timeout
+# and with the database memory-mapped.
+set +x
+for ((n = 0; n < $max; n++)); do
+    echo -n > $NIX_STORE_DIR/aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa-$n
+done
+set -x
+sqliteOpts="--option sqlite-mmap-size 16777216 --option sqlite-cache-size 4096 --option sqlite-busy-timeout 1"
+nix-store --register-validity $sqliteOpts < $TEST_ROOT/reg_info &
+pid=$!
+nix-store --register-validity $sqliteOpts < $TEST_ROOT/reg_info
+wait $pid
+
+[ "$(nix-store -q --referrers $reference $sqliteOpts | wc -l)" = "$max" ]
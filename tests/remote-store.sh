@@ -10,6 +10,35 @@ nix-store --dump-db > $TEST_ROOT/d1
 NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
 cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
+# Hash parts are looked up in one request, both by the daemon and by
+# the local store.
+paths=$(nix-store -qR $(nix-build dependencies.nix --no-out-link) | sort)
+hashParts=$(for p in $paths; do p=${p#$NIX_STORE_DIR/}; echo ${p%%-*}; done)
+[ "$(nix path-from-hash-part $hashParts | sort)" = "$paths" ]
+[ "$(NIX_REMOTE= nix path-from-hash-part $hashParts | sort)" = "$paths" ]
+(! nix path-from-hash-part 00000000000000000000000000000000)
+
+# Closures computed by the daemon, and batched path info queries, agree
+# with the local store. Querying two paths at once checks that paths
+# already in the closure are pruned correctly.
+drvPath=$(nix-instantiate dependencies.nix)
+input2=$(nix-store -q --references $drvPath | grep input-2)
+for flags in "-qR" "-qR --include-outputs" "-q --referrers-closure"; do
+    [ "$(nix-store $flags $input2 $drvPath | sort)" = "$(NIX_REMOTE= nix-store $flags $input2 $drvPath | sort)" ]
+done
+[ "$(nix path-info --json $paths)" = "$(NIX_REMOTE= nix path-info --json $paths)" ]
+[ "$(nix path-info -r --json $paths)" = "$(NIX_REMOTE= nix path-info -r --json $paths)" ]
+
+# A single pipelined query is answered without the client sending
+# anything else.
+path=$(echo "$paths" | head -n1)
+[ "$(timeout 60 nix path-info --store 'daemon?pipeline-queries=true' $path)" = "$path" ]
+
 nix-store --gc --max-freed 1K
 
+# Only trusted users may see the garbage collection plan.
+if [ "$(id -u)" != 0 ]; then
+    (! nix-store --gc --print-plan)
+fi
+
 killDaemon
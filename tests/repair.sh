@@ -13,6 +13,9 @@ hash=$(nix-hash $path2)
 chmod u+w $path2
 touch $path2/bad
 
+# Paths verified recently are skipped with verify-interval.
+nix-store --verify --check-contents --option verify-interval 1
+
 if nix-store --verify --check-contents -v; then
     echo "nix-store --verify succeeded unexpectedly" >&2
     exit 1
@@ -75,3 +78,35 @@ if [ "$(nix-hash $path2)" != "$hash" -o -e $path2/bad ]; then
     echo "path not repaired properly" >&2
     exit 1
 fi
+
+# With verify-tree-hash, a path whose NAR hash matches gets a tree
+# hash, and later runs check that instead of the NAR hash.
+clearStore
+
+tree=$TEST_ROOT/tree
+rm -rf $tree
+mkdir -p $tree/sub
+dd if=/dev/urandom of=$tree/big bs=1M count=3 2> /dev/null
+echo foo > $tree/sub/exe
+chmod +x $tree/sub/exe
+ln -s big $tree/link
+path3=$(nix-store --add $tree)
+
+nix-store --verify --check-contents --option verify-tree-hash true
+nix-store --verify --check-contents --option verify-tree-hash true -vv 2>&1 | grep "checking tree hash of '$path3'"
+(! nix-store --verify --check-contents --option verify-tree-hash true -vv 2>&1 | grep "checking contents of '$path3'")
+
+# A tree that can't be walked completely is reported, not crashed on.
+if [ "$(id -u)" != 0 ]; then
+    chmod u+w $path3
+    chmod 000 $path3/sub
+    (! nix-store --verify --check-contents --option verify-tree-hash true)
+    chmod 555 $path3/sub
+    nix-store --verify --check-contents --option verify-tree-hash true
+fi
+
+# Changing a byte in the middle chunk must change the tree hash, so
+# the NAR hash is checked again and the change found.
+chmod u+w $path3/big
+printf x | dd of=$path3/big bs=1 seek=$((3 << 19)) conv=notrunc 2> /dev/null
+(! nix-store --verify --check-contents --option verify-tree-hash true)
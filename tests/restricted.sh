@@ -49,3 +49,12 @@ output="$(nix eval --raw --restrict-eval -I "$traverseDir" \
     2>&1 || :)"
 echo "$output" | grep "is forbidden"
 ! echo "$output" | grep -F restricted-secret
+
+# The preparser must not read files that restricted mode forbids. The
+# forbidden file is a FIFO, so reading it would hang.
+mkdir -p $TEST_ROOT/preparse
+rm -f $TEST_ROOT/preparse-forbidden.nix
+mkfifo $TEST_ROOT/preparse-forbidden.nix
+echo 'if true then 1 else import ../preparse-forbidden.nix' > $TEST_ROOT/preparse/main.nix
+[[ $(timeout 60 nix-instantiate --eval --restrict-eval --option eval-preparse-threads 1 \
+    -I $TEST_ROOT/preparse $TEST_ROOT/preparse/main.nix) = 1 ]]
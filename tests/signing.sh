@@ -103,3 +103,23 @@ nix verify --store $TEST_ROOT/store0 -r $outPath2 --trusted-public-keys $pk1
 
 # Content-addressed stuff can be copied without signatures.
 nix copy --to $TEST_ROOT/store0 $outPathCA
+
+# Outputs are signed when they are registered, and are optimised by the
+# time nix-build returns, even if more of them are queued for
+# optimisation than max-jobs.
+clearStore
+
+cat > $TEST_ROOT/many.nix <<EOF2
+with import $(pwd)/config.nix;
+map (i: mkDerivation {
+  name = "many-\${toString i}";
+  builder = builtins.toFile "builder" "mkdir \$out; echo hello > \$out/foo";
+}) [ 1 2 3 4 5 6 ]
+EOF2
+
+outPaths=$(nix-build $TEST_ROOT/many.nix --no-out-link -j1 --auto-optimise-store --secret-key-files "$TEST_ROOT/sk1")
+[ "$(echo $outPaths | wc -w)" = 6 ]
+for p in $outPaths; do
+    [[ $(nix path-info --json $p) =~ 'cache1.example.org' ]]
+done
+[ "$(for p in $outPaths; do stat --format=%i $p/foo; done | sort -u | wc -l)" = 1 ]
@@ -21,6 +21,32 @@ nix-build -o $TEST_ROOT/result '<foo>' -I foo=file://$tarball
 
 nix-build -o $TEST_ROOT/result -E "import (fetchTarball file://$tarball)"
 
+# The unpacked tarball must have the same hash as the original tree,
+# for every compression method.
+hash=$(nix hash-path --base32 $tarroot)
+(cd $TEST_ROOT && tar c tarball) | gzip > $TEST_ROOT/tarball.tar.gz
+tarballs="$tarball $TEST_ROOT/tarball.tar.gz"
+if type -p lzip > /dev/null; then
+    (cd $TEST_ROOT && tar c tarball) | lzip > $TEST_ROOT/tarball.tar.lz
+    tarballs="$tarballs $TEST_ROOT/tarball.tar.lz"
+fi
+if type -p compress > /dev/null; then
+    (cd $TEST_ROOT && tar c tarball) | compress > $TEST_ROOT/tarball.tar.Z
+    tarballs="$tarballs $TEST_ROOT/tarball.tar.Z"
+fi
+for t in $tarballs; do
+    nix-build -o $TEST_ROOT/result -E "import (fetchTarball { url = file://$t; sha256 = \"$hash\"; })"
+done
+[[ $(nix-prefetch-url --unpack file://$TEST_ROOT/tarball.tar.gz) = $hash ]]
+
+# Fetches with constant arguments can be started in the background.
+cat > $TEST_ROOT/pins.nix <<EOF
+[ (fetchTarball { url = file://$tarball; sha256 = "$hash"; })
+  (builtins.fetchTarball { url = file://$TEST_ROOT/tarball.tar.gz; sha256 = "$hash"; name = "pin"; })
+]
+EOF
+nix-instantiate --eval --strict --option eval-prefetch-threads 2 $TEST_ROOT/pins.nix | grep -q -- '-pin"'
+
 nix-instantiate --eval -E '1 + 2' -I fnord=file://no-such-tarball.tar.xz
 nix-instantiate --eval -E 'with <fnord/xyzzy>; 1 + 2' -I fnord=file://no-such-tarball.tar.xz
 (! nix-instantiate --eval -E '<fnord/xyzzy> 1' -I fnord=file://no-such-tarball.tar.xz)
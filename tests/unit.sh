@@ -0,0 +1,3 @@
+source common.sh
+
+./unit/nix-unit-tests
@@ -0,0 +1,11 @@
+programs += nix-unit-tests
+
+nix-unit-tests_EXCLUDE_FROM_PROGRAM_LIST := 1
+
+nix-unit-tests_DIR := $(d)
+
+nix-unit-tests_SOURCES := $(wildcard $(d)/*.cc)
+
+nix-unit-tests_LIBS = libmain libstore libutil
+
+nix-unit-tests_LDFLAGS = -pthread
@@ -0,0 +1,121 @@
+#include "unit-tests.hh"
+#include "lru-cache.hh"
+
+#include <thread>
+
+namespace nix {
+
+static RegisterTest t1("clock-cache-basic", []() {
+    ClockCache<std::string, int> cache(3);
+    CHECK_EQ(cache.size(), 0);
+    CHECK(!cache.get("a"));
+
+    cache.upsert("a", 1);
+    cache.upsert("b", 2);
+    CHECK_EQ(cache.size(), 2);
+    CHECK_EQ(*cache.get("a"), 1);
+    CHECK_EQ(*cache.get("b"), 2);
+
+    cache.upsert("a", 3);
+    CHECK_EQ(cache.size(), 2);
+    CHECK_EQ(*cache.get("a"), 3);
+
+    CHECK(cache.erase("a"));
+    CHECK(!cache.erase("a"));
+    CHECK(!cache.get("a"));
+    CHECK_EQ(*cache.get("b"), 2);
+    CHECK_EQ(cache.size(), 1);
+
+    cache.clear();
+    CHECK_EQ(cache.size(), 0);
+    CHECK(!cache.get("b"));
+
+    ClockCache<std::string, int> empty(0);
+    empty.upsert("a", 1);
+    CHECK_EQ(empty.size(), 0);
+    CHECK(!empty.get("a"));
+});
+
+static RegisterTest t2("clock-cache-eviction", []() {
+    ClockCache<std::string, int> cache(3);
+    cache.upsert("a", 1);
+    cache.upsert("b", 2);
+    cache.upsert("c", 3);
+
+    /* `a' has been referenced, so it gets a second chance and `b' is
+       evicted instead. */
+    cache.get("a");
+    cache.upsert("d", 4);
+    CHECK_EQ(cache.size(), 3);
+    CHECK(cache.get("a"));
+    CHECK(!cache.get("b"));
+    CHECK(cache.get("c"));
+    CHECK(cache.get("d"));
+
+    /* Now everything has been referenced, so the hand clears all
+       flags and comes back to where it started, which is `c'. */
+    cache.upsert("e", 5);
+    CHECK_EQ(cache.size(), 3);
+    CHECK(!cache.get("c"));
+    CHECK(cache.get("a"));
+    CHECK(cache.get("d"));
+    CHECK(cache.get("e"));
+});
+
+static RegisterTest t3("clock-cache-erase", []() {
+    ClockCache<int, int> cache(4);
+    for (int i = 0; i < 4; ++i) cache.upsert(i, i * 10);
+
+    /* Erasing an item moves the last one into its slot. */
+    CHECK(cache.erase(1));
+    CHECK_EQ(cache.size(), 3);
+    CHECK_EQ(*cache.get(0), 0);
+    CHECK_EQ(*cache.get(2), 20);
+    CHECK_EQ(*cache.get(3), 30);
+
+    /* The cache fills up again before anything is evicted. */
+    cache.upsert(4, 40);
+    CHECK_EQ(cache.size(), 4);
+    for (int i : {0, 2, 3, 4}) CHECK(cache.get(i));
+
+    /* Erasing the slot under the hand, and the last slot, keeps the
+       cache usable. */
+    cache.upsert(5, 50);
+    CHECK_EQ(cache.size(), 4);
+    for (int i = 0; i <= 5; ++i) cache.erase(i);
+    CHECK_EQ(cache.size(), 0);
+    for (int i = 0; i < 10; ++i) cache.upsert(i, i);
+    CHECK_EQ(cache.size(), 4);
+});
+
+static RegisterTest t4("sharded-cache", []() {
+    ShardedLRUCache<int, int> cache(64, 4);
+
+    cache.upsert(1, 10);
+    CHECK_EQ(*cache.get(1), 10);
+    CHECK(!cache.get(2));
+    auto stats = cache.getStats();
+    CHECK_EQ(stats.size, 1);
+    CHECK_EQ(stats.hits, 1);
+    CHECK_EQ(stats.misses, 1);
+
+    /* Threads inserting and looking up their own keys see their own
+       values, and the cache never exceeds its capacity. */
+    std::vector<std::thread> threads;
+    std::atomic<unsigned int> wrong{0};
+    for (int t = 0; t < 8; ++t)
+        threads.emplace_back([&, t]() {
+            for (int i = 0; i < 10000; ++i) {
+                int key = t * 100000 + i % 100;
+                cache.upsert(key, key + 1);
+                auto v = cache.get(key);
+                if (v && *v != key + 1) wrong++;
+            }
+        });
+    for (auto & thread : threads) thread.join();
+
+    CHECK_EQ(wrong.load(), 0);
+    CHECK(cache.size() <= 64);
+});
+
+}
@@ -0,0 +1,41 @@
+#include "unit-tests.hh"
+#include "shared.hh"
+
+#include <iostream>
+
+using namespace nix;
+
+RegisterTest::Tests * RegisterTest::tests = 0;
+
+RegisterTest::RegisterTest(const std::string & name, std::function<void()> fun)
+{
+    if (!tests) tests = new Tests;
+    tests->emplace_back(name, fun);
+}
+
+
+/* Run the tests whose names are given on the command line, or all of
+   them. */
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        std::set<std::string> selected(argv + 1, argv + argc);
+
+        unsigned int failed = 0;
+        for (auto & test : *RegisterTest::tests) {
+            if (!selected.empty() && !selected.count(test.first)) continue;
+            try {
+                test.second();
+                std::cerr << fmt("test '%s' passed\n", test.first);
+            } catch (Error & e) {
+                std::cerr << fmt("test '%s' failed: %s\n", test.first, e.what());
+                failed++;
+            }
+        }
+
+        if (failed)
+            throw Exit(1);
+    });
+}
@@ -0,0 +1,106 @@
+#include "unit-tests.hh"
+#include "rewrite.hh"
+
+#include <random>
+
+namespace nix {
+
+/* Rewrite `s' the slow way: at each position, replace the longest key
+   starting there, if any. */
+static std::string naiveRewrite(const std::string & s, const StringRewrites & rewrites)
+{
+    std::string res;
+    size_t pos = 0;
+    while (pos < s.size()) {
+        const std::pair<const std::string, std::string> * best = nullptr;
+        for (auto & i : rewrites)
+            if (!i.first.empty() && s.compare(pos, i.first.size(), i.first) == 0
+                && (!best || i.first.size() > best->first.size()))
+                best = &i;
+        if (best) {
+            res += best->second;
+            pos += best->first.size();
+        } else
+            res += s[pos++];
+    }
+    return res;
+}
+
+/* Rewrite `s' through a RewritingSink, writing `chunkSize' bytes at a
+   time, so that keys span several writes. */
+static std::string streamRewrite(const std::string & s, const StringRewriter & rewriter, size_t chunkSize)
+{
+    StringSink sink;
+    RewritingSink rewritingSink(rewriter, sink);
+    for (size_t pos = 0; pos < s.size(); pos += chunkSize)
+        rewritingSink((const unsigned char *) s.data() + pos, std::min(chunkSize, s.size() - pos));
+    rewritingSink.finish();
+    return *sink.s;
+}
+
+static RegisterTest t1("rewrite-basic", []() {
+    CHECK_EQ(rewriteStrings("foo", {}), "foo");
+    CHECK_EQ(rewriteStrings("", {{"foo", "bar"}}), "");
+    CHECK_EQ(rewriteStrings("xfooyfoo", {{"foo", "bar"}}), "xbarybar");
+    CHECK_EQ(rewriteStrings("fofoo", {{"foo", "bar"}}), "fobar");
+    CHECK_EQ(rewriteStrings("fo", {{"foo", "bar"}}), "fo");
+
+    /* Replacements are never rewritten again. */
+    CHECK_EQ(rewriteStrings("ab", {{"a", "b"}, {"b", "a"}}), "ba");
+    CHECK_EQ(rewriteStrings("aaa", {{"a", "aa"}}), "aaaaaa");
+
+    /* Occurrences don't overlap. */
+    CHECK_EQ(rewriteStrings("aaa", {{"aa", "x"}}), "xa");
+    CHECK_EQ(rewriteStrings("aaaa", {{"aa", "x"}}), "xx");
+});
+
+static RegisterTest t2("rewrite-leftmost-longest", []() {
+    /* Of the keys starting at the same position, the longest wins. */
+    CHECK_EQ(rewriteStrings("abcdef", {{"abc", "1"}, {"abcde", "2"}, {"bcd", "3"}}), "2f");
+
+    /* A key that starts first wins over a longer one starting later. */
+    CHECK_EQ(rewriteStrings("abcdef", {{"ab", "1"}, {"bcdef", "2"}}), "1cdef");
+    CHECK_EQ(rewriteStrings("abcdef", {{"bc", "1"}, {"abcdx", "2"}, {"cdef", "3"}}), "a1def");
+
+    /* A longer key that doesn't complete falls back to a shorter
+       one, and the bytes after it are scanned again. */
+    CHECK_EQ(rewriteStrings("abcdy", {{"abc", "1"}, {"abcdx", "2"}}), "1dy");
+    CHECK_EQ(rewriteStrings("abcdx", {{"abc", "1"}, {"abcdxy", "2"}, {"dx", "3"}}), "13");
+
+    /* A key that is a suffix of a longer partial match. */
+    CHECK_EQ(rewriteStrings("abcabd", {{"abcabc", "1"}, {"cab", "2"}}), "ab2d");
+});
+
+static RegisterTest t3("rewrite-stream", []() {
+    StringRewriter rewriter({{"abc", "1"}, {"abcde", "2"}, {"bcd", "3"}, {"xyz", ""}});
+    std::string s = "abcdefxyzabcdxabcabcdeab";
+    auto expected = naiveRewrite(s, {{"abc", "1"}, {"abcde", "2"}, {"bcd", "3"}, {"xyz", ""}});
+    CHECK_EQ(rewriter.rewrite(s), expected);
+    for (size_t chunkSize = 1; chunkSize <= s.size(); ++chunkSize)
+        CHECK_EQ(streamRewrite(s, rewriter, chunkSize), expected);
+});
+
+/* Compare against the naive implementation on random inputs over a
+   small alphabet, so that keys overlap a lot. */
+static RegisterTest t4("rewrite-random", []() {
+    std::mt19937 rng(42);
+
+    auto randomString = [&](size_t maxLen) {
+        std::string s(rng() % (maxLen + 1), 'a');
+        for (auto & c : s) c = 'a' + rng() % 3;
+        return s;
+    };
+
+    for (int n = 0; n < 2000; ++n) {
+        StringRewrites rewrites;
+        for (int k = rng() % 6; k > 0; --k)
+            rewrites[randomString(5)] = randomString(3);
+        StringRewriter rewriter(rewrites);
+        auto s = randomString(40);
+        auto expected = naiveRewrite(s, rewrites);
+        CHECK_EQ(rewriter.rewrite(s), expected);
+        CHECK_EQ(streamRewrite(s, rewriter, 1 + rng() % 7), expected);
+    }
+});
+
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "types.hh"
+
+#include <functional>
+
+/* A minimal harness for testing internal data structures that can't
+   be reached from the command line. Each test registers itself with
+   a RegisterTest object; unit.sh runs them all through the
+   nix-unit-tests program. */
+
+namespace nix {
+
+MakeError(TestFailed, Error);
+
+struct RegisterTest
+{
+    typedef std::vector<std::pair<std::string, std::function<void()>>> Tests;
+    static Tests * tests;
+    RegisterTest(const std::string & name, std::function<void()> fun);
+};
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+            throw TestFailed("%s:%d: check '%s' failed", __FILE__, __LINE__, #cond); \
+    } while (0)
+
+#define CHECK_EQ(a, b) \
+    do { \
+        auto _a = (a); \
+        decltype(_a) _b = (b); \
+        if (!(_a == _b)) \
+            throw TestFailed("%s:%d: check '%s == %s' failed: got '%s', expected '%s'", \
+                __FILE__, __LINE__, #a, #b, _a, _b); \
+    } while (0)
+
+}
@@ -20,6 +20,30 @@ drvPath10=$(nix-env -f ./user-envs.nix -qa --drv-path --no-name '*' | grep foo-1
 
 # Query descriptions.
 nix-env -f ./user-envs.nix -qa '*' --description | grep -q silly
+nix-env -f ./user-envs.nix -qa --json 'foo-1.0' | grep -q '"name": *"foo-1.0"'
+(! nix-env -f ./user-envs.nix -qa --json 'nonexistent')
+
+# Export the available packages into a package table.
+nix-env -f ./user-envs.nix -qa --export $TEST_ROOT/packages.table --export-meta description,priority
+head -c 7 $TEST_ROOT/packages.table | grep -q NIXPKGT
+
+# Read it back.
+nix show-package-table $TEST_ROOT/packages.table > $TEST_ROOT/packages.json
+table() {
+    nix eval --raw "(let t = builtins.fromJSON (builtins.readFile $TEST_ROOT/packages.json); in $1)"
+}
+[ "$(table 'toString (builtins.length t)')" = 6 ]
+[ "$(table 'toString (map (r: r.attrPath) t)')" = "0 1 2 3 4 5" ]
+[ "$(table 'toString (map (r: r.name) t)')" = "foo-1.0 foo-2.0pre1 bar-0.1 foo-2.0 bar-0.1.1 foo-0.1" ]
+[ "$(table '(builtins.elemAt t 0).system')" = "$system" ]
+[ "$(table '(builtins.elemAt t 0).drvPath')" = "$drvPath10" ]
+[ "$(table '(builtins.elemAt t 0).outputs')" = "out=$outPath10" ]
+[ "$(table '(builtins.elemAt t 2)."meta.description"')" = "A silly test package" ]
+[ "$(table '(builtins.elemAt t 5)."meta.priority"')" = 10 ]
+# foo-0.1 has no description, and the others have no priority.
+[ "$(table 'if (builtins.elemAt t 5) ? "meta.description" then "yes" else "no"')" = no ]
+[ "$(table 'if (builtins.elemAt t 0) ? "meta.priority" then "yes" else "no"')" = no ]
+
 rm -f $HOME/.nix-defexpr
 ln -s $(pwd)/user-envs.nix $HOME/.nix-defexpr
 nix-env -qa '*' --description | grep -q silly